@@ -302,6 +302,7 @@ AC_DEFUN([DC_DOVECOT_HARDENING],[
 	AC_CC_RETPOLINE
 	AC_LD_RELRO
 	DOVECOT_WANT_UBSAN
+	DOVECOT_WANT_TSAN
 ])
 
 AC_DEFUN([DC_DOVECOT_FUZZER],[
@@ -573,3 +574,20 @@ AC_DEFUN([DOVECOT_WANT_UBSAN], [
      san_flags=""
   ])
 ])
+
+AC_DEFUN([DOVECOT_WANT_TSAN], [
+  AC_ARG_ENABLE(tsan,
+    AS_HELP_STRING([--enable-tsan], [Enable thread sanitizer (default=no)]),
+                   [want_tsan=yes], [want_tsan=no])
+  AC_MSG_CHECKING([whether we want thread sanitizer])
+  AC_MSG_RESULT([$want_tsan])
+  AS_IF([test x$want_tsan = xyes], [
+     gl_COMPILER_OPTION_IF([-fsanitize=thread], [
+       EXTRA_CFLAGS="$EXTRA_CFLAGS -fsanitize=thread -g -O1 -fno-omit-frame-pointer"
+       LDFLAGS="$LDFLAGS -fsanitize=thread"
+       AC_DEFINE([HAVE_THREAD_SANITIZER], [1], [Define if building with thread sanitizer])
+     ], [
+       AC_MSG_ERROR([No thread sanitizer support in your compiler])
+     ])
+  ])
+])
@@ -0,0 +1,20 @@
+dnl * Optional worker thread support (lib/thread-pool.h)
+AC_DEFUN([DOVECOT_THREADS], [
+  AC_CACHE_CHECK([for thread-local storage],i_cv_have_thread_local,[
+    AC_COMPILE_IFELSE([AC_LANG_PROGRAM([[
+      static _Thread_local int value;
+    ]], [[
+      value = 1;
+      return value;
+    ]])],[
+      i_cv_have_thread_local=yes
+    ], [
+      i_cv_have_thread_local=no
+    ])
+  ])
+  AC_SEARCH_LIBS([pthread_create], [pthread], [have_pthread=yes], [have_pthread=no])
+  AS_IF([test $i_cv_have_thread_local = yes && test $have_pthread = yes], [
+    AC_DEFINE(HAVE_THREADS,, [Define if worker threads can be used])
+  ])
+  AC_CHECK_HEADERS([sys/eventfd.h])
+])
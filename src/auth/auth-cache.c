@@ -232,7 +232,7 @@ struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 	struct auth_cache *cache;
 
 	cache = i_new(struct auth_cache, 1);
-	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	hash_table_create_open(&cache->hash, default_pool, 0, str_hash, strcmp);
 	cache->max_size = max_size;
 	cache->size_left = max_size;
 	cache->ttl_secs = ttl_secs;
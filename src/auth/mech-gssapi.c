@@ -18,6 +18,7 @@
 #include "str-sanitize.h"
 #include "hex-binary.h"
 #include "safe-memset.h"
+#include "sampling-profiler.h"
 #include "mech.h"
 #include "passdb.h"
 
@@ -166,9 +167,15 @@ obtain_service_credentials(struct auth_request *request, gss_cred_id_t *ret_r)
 	inbuf.length = str_len(principal_name);
 	inbuf.value = str_c_modifiable(principal_name);
 
+	/* The GSSAPI library dlopen()s its mechanisms and Kerberos plugins
+	   when they're first needed. The dynamic linker's locks aren't safe
+	   for the profiler's signal handler to take while we're holding
+	   them. */
+	sampling_profiler_block();
 	major_status = gss_import_name(&minor_status, &inbuf,
 				       GSS_C_NT_HOSTBASED_SERVICE,
 				       &gss_principal);
+	sampling_profiler_unblock();
 	str_free(&principal_name);
 
 	if (GSS_ERROR(major_status) != 0) {
@@ -177,9 +184,11 @@ obtain_service_credentials(struct auth_request *request, gss_cred_id_t *ret_r)
 		return major_status;
 	}
 
+	sampling_profiler_block();
 	major_status = gss_acquire_cred(&minor_status, gss_principal, 0,
 					GSS_C_NULL_OID_SET, GSS_C_ACCEPT,
 					ret_r, NULL, NULL);
+	sampling_profiler_unblock();
 	if (GSS_ERROR(major_status) != 0) {
 		mech_gssapi_log_error(request, major_status, GSS_C_GSS_CODE,
 				      "acquiring service credentials");
@@ -284,6 +293,7 @@ mech_gssapi_sec_context(struct gssapi_auth_request *request,
 	const char *username, *error;
 	int ret = 0;
 
+	sampling_profiler_block();
 	major_status = gss_accept_sec_context (
 		&minor_status,
 		&request->gss_ctx,
@@ -297,6 +307,7 @@ mech_gssapi_sec_context(struct gssapi_auth_request *request,
 		NULL, /* time_rec */
 		NULL  /* delegated_cred_handle */
 	);
+	sampling_profiler_unblock();
 
 	if (GSS_ERROR(major_status) != 0) {
 		mech_gssapi_log_error(auth_request, major_status,
@@ -441,7 +452,9 @@ mech_gssapi_krb5_userok(struct gssapi_auth_request *request,
 	}
 
 	/* Init a krb5 context and parse the principal username */
+	sampling_profiler_block();
 	krb5_err = krb5_init_context(&ctx);
+	sampling_profiler_unblock();
 	if (krb5_err != 0) {
 		e_error(request->auth_request.mech_event,
 			"krb5_init_context() failed: %d", (int)krb5_err);
@@ -12,6 +12,7 @@
 #include "dict-client.h"
 #include "dict-settings.h"
 #include "dict-connection.h"
+#include "dict-lookup-cache.h"
 #include "dict-commands.h"
 #include "main.h"
 
@@ -36,6 +37,10 @@ struct dict_connection_cmd {
 	unsigned int trans_id; /* obsolete */
 	unsigned int rows;
 
+	/* lookup cache key and generation when the lookup was started */
+	char *cache_key;
+	uint64_t cache_generation;
+
 	bool uncork_pending;
 };
 
@@ -52,6 +57,7 @@ static void dict_connection_cmd_free(struct dict_connection_cmd *cmd)
 	if (dict_iterate_deinit(&cmd->iter, &error) < 0)
 		e_error(cmd->event, "dict_iterate() failed: %s", error);
 	i_free(cmd->reply);
+	i_free(cmd->cache_key);
 	if (cmd->uncork_pending)
 		o_stream_uncork(cmd->conn->conn.output);
 
@@ -161,6 +167,14 @@ cmd_lookup_callback(const struct dict_lookup_result *result,
 	string_t *str = t_str_new(128);
 
 	event_set_name(cmd->event, "dict_server_lookup_finished");
+	if (cmd->cache_key != NULL && result->ret >= 0) {
+		const char *const *values =
+			result->ret > 0 ? result->values : NULL;
+		unsigned int evictions =
+			dict_lookup_cache_add(cmd->cache_key,
+					      cmd->cache_generation, values);
+		event_add_int(cmd->event, "cache_evictions", evictions);
+	}
 	if (result->ret > 0) {
 		cmd_lookup_write_reply(result->values, str);
 		e_debug(cmd->event, "Lookup finished");
@@ -181,6 +195,35 @@ cmd_lookup_callback(const struct dict_lookup_result *result,
 	dict_connection_cmd_try_flush(&cmd);
 }
 
+static bool
+cmd_lookup_cached(struct dict_connection_cmd *cmd, const char *key,
+		  const char *username)
+{
+	struct dict_lookup_result result;
+	const char *cache_key, *const *values;
+
+	cache_key = dict_lookup_cache_get_key(cmd->conn->name, username, key);
+	if (cache_key == NULL)
+		return FALSE;
+
+	if (!dict_lookup_cache_lookup(cache_key, &values)) {
+		event_add_str(cmd->event, "cache", "miss");
+		cmd->cache_key = i_strdup(cache_key);
+		cmd->cache_generation =
+			dict_lookup_cache_get_generation(cache_key);
+		return FALSE;
+	}
+
+	event_add_str(cmd->event, "cache", "hit");
+	i_zero(&result);
+	result.ret = values == NULL ? 0 : 1;
+	result.values = values;
+	if (values != NULL)
+		result.value = values[0];
+	cmd_lookup_callback(&result, cmd);
+	return TRUE;
+}
+
 static int cmd_lookup(struct dict_connection_cmd *cmd, const char *const *args)
 {
 	const char *username;
@@ -208,6 +251,9 @@ static int cmd_lookup(struct dict_connection_cmd *cmd, const char *const *args)
 		event_set_append_log_prefix(cmd->event, t_strdup_printf(
 			"LOOKUP %s (user %s): ", args[0], username));
 	}
+	if (cmd_lookup_cached(cmd, args[0], username))
+		return 1;
+
 	const struct dict_op_settings set = {
 		.username = username,
 	};
@@ -392,13 +438,14 @@ static void
 dict_connection_transaction_array_remove(struct dict_connection *conn,
 					 unsigned int id)
 {
-	const struct dict_connection_transaction *transactions;
+	struct dict_connection_transaction *transactions;
 	unsigned int i, count;
 
-	transactions = array_get(&conn->transactions, &count);
+	transactions = array_get_modifiable(&conn->transactions, &count);
 	for (i = 0; i < count; i++) {
 		if (transactions[i].id == id) {
 			i_assert(transactions[i].ctx == NULL);
+			dict_lookup_cache_keys_free(&transactions[i].cache_keys);
 			array_delete(&conn->transactions, i, 1);
 			return;
 		}
@@ -509,6 +556,16 @@ cmd_commit_finish(struct dict_connection_cmd *cmd,
 		e_debug(cmd->event, "Transaction finished: %s", result->error);
 	else
 		e_debug(cmd->event, "Transaction finished");
+	if (dict_lookup_cache_is_enabled()) {
+		struct dict_connection_transaction *trans =
+			dict_connection_transaction_lookup(cmd->conn,
+							   cmd->trans_id);
+		/* Lookups that were started after the write was sent may
+		   have cached the old value, so drop the keys again. This is
+		   done even if the commit failed, since the result may still
+		   have been (partially) written. */
+		dict_lookup_cache_invalidate_keys(&trans->cache_keys);
+	}
 	dict_connection_transaction_array_remove(cmd->conn, cmd->trans_id);
 	dict_connection_cmd_try_flush(&cmd);
 }
@@ -556,6 +613,18 @@ cmd_rollback(struct dict_connection_cmd *cmd, const char *const *args)
 	return 0;
 }
 
+static void
+cmd_cache_invalidate(struct dict_connection_cmd *cmd,
+		     struct dict_connection_transaction *trans, const char *key)
+{
+	const char *cache_key;
+
+	cache_key = dict_lookup_cache_get_key(cmd->conn->name,
+					      trans->ctx->set.username, key);
+	if (cache_key != NULL)
+		dict_lookup_cache_invalidate_later(cache_key, &trans->cache_keys);
+}
+
 static int cmd_set(struct dict_connection_cmd *cmd, const char *const *args)
 {
 	struct dict_connection_transaction *trans;
@@ -576,7 +645,8 @@ static int cmd_set(struct dict_connection_cmd *cmd, const char *const *args)
 	}
 
 	event_add_str(cmd->event, "user", trans->ctx->set.username);
-        dict_set(trans->ctx, args[1], args[2]);
+	cmd_cache_invalidate(cmd, trans, args[1]);
+	dict_set(trans->ctx, args[1], args[2]);
 	return 0;
 }
 
@@ -599,7 +669,8 @@ static int cmd_unset(struct dict_connection_cmd *cmd, const char *const *args)
 		return -1;
 	}
 
-        dict_unset(trans->ctx, args[1]);
+	cmd_cache_invalidate(cmd, trans, args[1]);
+	dict_unset(trans->ctx, args[1]);
 	return 0;
 }
 
@@ -625,7 +696,8 @@ cmd_atomic_inc(struct dict_connection_cmd *cmd, const char *const *args)
 		return -1;
 	}
 
-        dict_atomic_inc(trans->ctx, args[1], diff);
+	cmd_cache_invalidate(cmd, trans, args[1]);
+	dict_atomic_inc(trans->ctx, args[1], diff);
 	return 0;
 }
 
@@ -158,8 +158,10 @@ bool dict_connection_unref(struct dict_connection *conn)
 	/* we should have only transactions that haven't been committed or
 	   rollbacked yet. close those before dict is deinitialized. */
 	if (array_is_created(&conn->transactions)) {
-		array_foreach_modifiable(&conn->transactions, transaction)
+		array_foreach_modifiable(&conn->transactions, transaction) {
 			dict_transaction_rollback(&transaction->ctx);
+			dict_lookup_cache_keys_free(&transaction->cache_keys);
+		}
 	}
 
 	if (conn->dict != NULL)
@@ -3,11 +3,14 @@
 
 #include "dict.h"
 #include "connection.h"
+#include "dict-lookup-cache.h"
 
 struct dict_connection_transaction {
 	unsigned int id;
 	struct dict_connection *conn;
 	struct dict_transaction_context *ctx;
+	/* lookup cache keys changed by this transaction */
+	ARRAY_TYPE(dict_lookup_cache_key) cache_keys;
 };
 
 struct dict_connection {
@@ -0,0 +1,338 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "llist.h"
+#include "str.h"
+#include "strescape.h"
+#include "ioloop.h"
+#include "crc32.h"
+#include "dict.h"
+#include "dict-settings.h"
+#include "dict-lookup-cache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Number of generation counters shared by all the dict processes. Each cache
+   key maps to one of them. A write increments the key's counter, which
+   invalidates the cached entries for all the keys using the same counter in
+   all the processes. */
+#define DICT_LOOKUP_CACHE_SHARED_SLOTS 4096
+
+struct dict_lookup_cache_entry {
+	/* LRU list */
+	struct dict_lookup_cache_entry *prev, *next;
+
+	char *key;
+	/* NULL if the key doesn't exist */
+	const char **values;
+	time_t expire_time;
+	size_t size;
+
+	/* the entry is valid only while the shared slot has this
+	   generation */
+	unsigned int slot;
+	uint64_t generation;
+};
+
+struct dict_lookup_cache {
+	HASH_TABLE(char *, struct dict_lookup_cache_entry *) entries;
+	/* most recently used entry is the head */
+	struct dict_lookup_cache_entry *head, *tail;
+	size_t size, max_size;
+
+	const char **prefixes;
+	unsigned int ttl_secs, negative_ttl_secs;
+
+	/* DICT_LOOKUP_CACHE_SHARED_SLOTS generation counters in shared
+	   memory */
+	uint64_t *shared_generations;
+	struct dict_lookup_cache_stats stats;
+};
+
+static struct dict_lookup_cache *cache = NULL;
+
+bool dict_lookup_cache_is_enabled(void)
+{
+	return cache != NULL;
+}
+
+const char *dict_lookup_cache_get_key(const char *dict_name,
+				      const char *username, const char *key)
+{
+	unsigned int i;
+	string_t *str;
+
+	if (cache == NULL)
+		return NULL;
+
+	for (i = 0; cache->prefixes[i] != NULL; i++) {
+		if (str_begins_with(key, cache->prefixes[i]))
+			break;
+	}
+	if (cache->prefixes[i] == NULL)
+		return NULL;
+
+	if (!str_begins_with(key, DICT_PATH_PRIVATE) || username == NULL)
+		username = "";
+
+	str = t_str_new(128);
+	str_append_tabescaped(str, dict_name);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, username);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, key);
+	return str_c(str);
+}
+
+static unsigned int dict_lookup_cache_get_slot(const char *cache_key)
+{
+	return str_hash(cache_key) % DICT_LOOKUP_CACHE_SHARED_SLOTS;
+}
+
+static uint64_t dict_lookup_cache_get_slot_generation(unsigned int slot)
+{
+	return __atomic_load_n(&cache->shared_generations[slot],
+			       __ATOMIC_ACQUIRE);
+}
+
+static void dict_lookup_cache_entry_free(struct dict_lookup_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	i_assert(cache->size >= entry->size);
+	cache->size -= entry->size;
+
+	i_free(entry->values);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+bool dict_lookup_cache_lookup(const char *cache_key,
+			      const char *const **values_r)
+{
+	struct dict_lookup_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->entries, cache_key);
+	if (entry != NULL && entry->generation !=
+	    dict_lookup_cache_get_slot_generation(entry->slot)) {
+		/* written by this or some other dict process */
+		dict_lookup_cache_entry_free(entry);
+		cache->stats.invalidations++;
+		entry = NULL;
+	}
+	if (entry != NULL && entry->expire_time <= ioloop_time) {
+		dict_lookup_cache_entry_free(entry);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		cache->stats.misses++;
+		return FALSE;
+	}
+
+	/* move to the head of the LRU list */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+
+	cache->stats.hits++;
+	if (entry->values == NULL)
+		cache->stats.negative_hits++;
+	*values_r = entry->values;
+	return TRUE;
+}
+
+uint64_t dict_lookup_cache_get_generation(const char *cache_key)
+{
+	return dict_lookup_cache_get_slot_generation(
+		dict_lookup_cache_get_slot(cache_key));
+}
+
+unsigned int dict_lookup_cache_add(const char *cache_key, uint64_t generation,
+				   const char *const *values)
+{
+	struct dict_lookup_cache_entry *entry;
+	unsigned int slot, ttl_secs, evictions = 0;
+
+	ttl_secs = values != NULL ? cache->ttl_secs : cache->negative_ttl_secs;
+	slot = dict_lookup_cache_get_slot(cache_key);
+	if (generation != dict_lookup_cache_get_slot_generation(slot) ||
+	    ttl_secs == 0)
+		return 0;
+
+	entry = hash_table_lookup(cache->entries, cache_key);
+	if (entry != NULL)
+		dict_lookup_cache_entry_free(entry);
+
+	entry = i_new(struct dict_lookup_cache_entry, 1);
+	entry->key = i_strdup(cache_key);
+	entry->size = sizeof(*entry) + strlen(cache_key) + 1;
+	if (values != NULL) {
+		entry->values = p_strarray_dup(default_pool, values);
+		for (unsigned int i = 0; values[i] != NULL; i++)
+			entry->size += sizeof(char *) + strlen(values[i]) + 1;
+		entry->size += sizeof(char *);
+	}
+	entry->expire_time = ioloop_time + ttl_secs;
+	entry->slot = slot;
+	entry->generation = generation;
+
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->size += entry->size;
+
+	while (cache->size > cache->max_size) {
+		dict_lookup_cache_entry_free(cache->tail);
+		evictions++;
+	}
+	cache->stats.evictions += evictions;
+	return evictions;
+}
+
+static void dict_lookup_cache_invalidate(const char *cache_key)
+{
+	struct dict_lookup_cache_entry *entry;
+
+	/* Any lookups that are running now in any process may return the
+	   old value. */
+	__atomic_add_fetch(&cache->shared_generations[
+		dict_lookup_cache_get_slot(cache_key)], 1, __ATOMIC_RELEASE);
+
+	entry = hash_table_lookup(cache->entries, cache_key);
+	if (entry != NULL) {
+		dict_lookup_cache_entry_free(entry);
+		cache->stats.invalidations++;
+	}
+}
+
+void dict_lookup_cache_invalidate_later(const char *cache_key,
+					ARRAY_TYPE(dict_lookup_cache_key) *keys)
+{
+	char *key;
+
+	dict_lookup_cache_invalidate(cache_key);
+
+	if (!array_is_created(keys))
+		i_array_init(keys, 4);
+	key = i_strdup(cache_key);
+	array_push_back(keys, &key);
+}
+
+void dict_lookup_cache_invalidate_keys(ARRAY_TYPE(dict_lookup_cache_key) *keys)
+{
+	char *key;
+
+	if (!array_is_created(keys))
+		return;
+	array_foreach_elem(keys, key)
+		dict_lookup_cache_invalidate(key);
+	dict_lookup_cache_keys_free(keys);
+}
+
+void dict_lookup_cache_keys_free(ARRAY_TYPE(dict_lookup_cache_key) *keys)
+{
+	char *key;
+
+	if (!array_is_created(keys))
+		return;
+	array_foreach_elem(keys, key)
+		i_free(key);
+	array_free(keys);
+}
+
+const struct dict_lookup_cache_stats *dict_lookup_cache_get_stats(void)
+{
+	return &cache->stats;
+}
+
+const char *dict_lookup_cache_get_shm_name(const char *base_dir)
+{
+	return t_strdup_printf("/dovecot-dict-cache-%08x", crc32_str(base_dir));
+}
+
+static int
+dict_lookup_cache_shm_open(const char *name, uint64_t **generations_r,
+			   const char **error_r)
+{
+	const size_t size = sizeof(uint64_t) * DICT_LOOKUP_CACHE_SHARED_SLOTS;
+	struct stat st;
+	void *mem;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("shm_open(%s) failed: %m", name);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", name);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_uid != geteuid()) {
+		/* don't trust counters that others can change */
+		*error_r = t_strdup_printf(
+			"%s is owned by UID %s, not by us (UID %s)", name,
+			dec2str(st.st_uid), dec2str(geteuid()));
+		i_close_fd(&fd);
+		return -1;
+	}
+	/* Growing the file fills it with zeros. If another process already
+	   did it, the size is unchanged and the counters are kept. */
+	if ((size_t)st.st_size < size && ftruncate(fd, size) < 0) {
+		*error_r = t_strdup_printf("ftruncate(%s) failed: %m", name);
+		i_close_fd(&fd);
+		return -1;
+	}
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	i_close_fd(&fd);
+	if (mem == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", name);
+		return -1;
+	}
+	*generations_r = mem;
+	return 0;
+}
+
+int dict_lookup_cache_init(const struct dict_server_settings *set,
+			   const char **error_r)
+{
+	const char *const *prefixes;
+	uint64_t *generations;
+
+	prefixes = t_strsplit_spaces(set->dict_cache_prefixes, " ");
+	if (prefixes[0] == NULL || set->dict_cache_max_size == 0)
+		return 0;
+
+	if (dict_lookup_cache_shm_open(
+		dict_lookup_cache_get_shm_name(set->base_dir),
+		&generations, error_r) < 0)
+		return -1;
+
+	cache = i_new(struct dict_lookup_cache, 1);
+	cache->shared_generations = generations;
+	cache->prefixes = p_strarray_dup(default_pool, prefixes);
+	cache->ttl_secs = set->dict_cache_ttl;
+	cache->negative_ttl_secs = set->dict_cache_negative_ttl;
+	cache->max_size = set->dict_cache_max_size;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+	return 0;
+}
+
+void dict_lookup_cache_deinit(void)
+{
+	if (cache == NULL)
+		return;
+
+	while (cache->head != NULL)
+		dict_lookup_cache_entry_free(cache->head);
+	hash_table_destroy(&cache->entries);
+	if (munmap(cache->shared_generations, sizeof(uint64_t) *
+		   DICT_LOOKUP_CACHE_SHARED_SLOTS) < 0)
+		i_error("munmap(dict lookup cache) failed: %m");
+	i_free(cache->prefixes);
+	i_free(cache);
+}
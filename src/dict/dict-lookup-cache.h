@@ -0,0 +1,71 @@
+#ifndef DICT_LOOKUP_CACHE_H
+#define DICT_LOOKUP_CACHE_H
+
+/* Cache for the dict server's lookups. Writes done through any dict process
+   using the same base_dir invalidate the key in all of them via generation
+   counters in shared memory. Writes that bypass the dict server are seen
+   only after the cached entry expires. */
+
+struct dict_server_settings;
+
+struct dict_lookup_cache_stats {
+	/* lookups answered from cache */
+	uint64_t hits;
+	/* hits that were cached "not found" replies */
+	uint64_t negative_hits;
+	/* cacheable lookups that had to be sent to the dict backend */
+	uint64_t misses;
+	/* entries dropped to stay under dict_cache_max_size */
+	uint64_t evictions;
+	/* entries dropped because of writes */
+	uint64_t invalidations;
+};
+
+ARRAY_DEFINE_TYPE(dict_lookup_cache_key, char *);
+
+/* Returns TRUE if lookups are being cached. */
+bool dict_lookup_cache_is_enabled(void);
+
+/* Returns the cache key for the dict lookup key, or NULL if the key isn't
+   cached. Shared keys are cached across all users. */
+const char *dict_lookup_cache_get_key(const char *dict_name,
+				      const char *username, const char *key);
+/* Lookup the cache key. Returns TRUE if found, with values_r set to NULL if
+   the key is cached as nonexistent. */
+bool dict_lookup_cache_lookup(const char *cache_key,
+			      const char *const **values_r);
+
+/* Returns the current generation of the cache key. It's shared by all the
+   dict processes and changes whenever the key (or another key sharing the
+   same counter) is invalidated in any of them. */
+uint64_t dict_lookup_cache_get_generation(const char *cache_key);
+/* Add lookup result to cache. values=NULL adds a negative entry. Nothing is
+   done if the generation has changed since the lookup was started, since
+   the result may already be outdated. Returns the number of entries that
+   were evicted to make space for it. */
+unsigned int dict_lookup_cache_add(const char *cache_key, uint64_t generation,
+				   const char *const *values);
+
+/* Drop the cache key in all the dict processes and remember it in the keys array, so it can be
+   invalidated again once the transaction is committed. */
+void dict_lookup_cache_invalidate_later(const char *cache_key,
+					ARRAY_TYPE(dict_lookup_cache_key) *keys);
+/* Invalidate all the keys and free the array. */
+void dict_lookup_cache_invalidate_keys(ARRAY_TYPE(dict_lookup_cache_key) *keys);
+/* Free the keys array without invalidating them. */
+void dict_lookup_cache_keys_free(ARRAY_TYPE(dict_lookup_cache_key) *keys);
+
+const struct dict_lookup_cache_stats *dict_lookup_cache_get_stats(void);
+
+/* Returns the name of the POSIX shared memory object containing the
+   generation counters shared by the dict processes using base_dir. */
+const char *dict_lookup_cache_get_shm_name(const char *base_dir);
+
+/* Enable the cache if dict_cache_prefixes is set. Returns -1 if the shared
+   generation counters can't be opened, in which case the cache stays
+   disabled. */
+int dict_lookup_cache_init(const struct dict_server_settings *set,
+			   const char **error_r);
+void dict_lookup_cache_deinit(void);
+
+#endif
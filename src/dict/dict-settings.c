@@ -108,6 +108,10 @@ struct service_settings dict_expire_service_settings = {
 static const struct setting_define dict_setting_defines[] = {
 	DEF(STR_HIDDEN, base_dir),
 	DEF(BOOL, verbose_proctitle),
+	DEF(STR, dict_cache_prefixes),
+	DEF(TIME, dict_cache_ttl),
+	DEF(TIME, dict_cache_negative_ttl),
+	DEF(SIZE, dict_cache_max_size),
 	{ .type = SET_STRLIST, .key = "dict",
 	  .offset = offsetof(struct dict_server_settings, dicts) },
 
@@ -117,6 +121,10 @@ static const struct setting_define dict_setting_defines[] = {
 const struct dict_server_settings dict_default_settings = {
 	.base_dir = PKG_RUNDIR,
 	.verbose_proctitle = FALSE,
+	.dict_cache_prefixes = "",
+	.dict_cache_ttl = 60,
+	.dict_cache_negative_ttl = 10,
+	.dict_cache_max_size = 10 * 1024 * 1024,
 	.dicts = ARRAY_INIT
 };
 
@@ -5,6 +5,12 @@ struct dict_server_settings {
 	pool_t pool;
 	const char *base_dir;
 	bool verbose_proctitle;
+
+	const char *dict_cache_prefixes;
+	unsigned int dict_cache_ttl;
+	unsigned int dict_cache_negative_ttl;
+	uoff_t dict_cache_max_size;
+
 	ARRAY(const char *) dicts;
 };
 
@@ -19,6 +19,7 @@
 #include "dict-connection.h"
 #include "dict-settings.h"
 #include "dict-init-cache.h"
+#include "dict-lookup-cache.h"
 #include "main.h"
 
 #include <math.h>
@@ -59,6 +60,13 @@ static void dict_proctitle_update(void *context ATTR_UNUSED)
 	add_stats_string(str, cmd_stats.lookups, "lookups");
 	add_stats_string(str, cmd_stats.iterations, "iters");
 	add_stats_string(str, cmd_stats.commits, "commits");
+	if (dict_lookup_cache_is_enabled()) {
+		const struct dict_lookup_cache_stats *cache_stats =
+			dict_lookup_cache_get_stats();
+		str_printfa(str, ", cache %"PRIu64"/%"PRIu64"/%"PRIu64
+			    " hits/misses/evictions", cache_stats->hits,
+			    cache_stats->misses, cache_stats->evictions);
+	}
 	str_append_c(str, ']');
 
 	process_title_set(str_c(str));
@@ -102,6 +110,7 @@ static void main_preinit(void)
 static void main_init(void)
 {
 	struct module_dir_load_settings mod_set;
+	const char *error;
 
 	dict_settings =
 		settings_get_or_fatal(master_service_get_event(master_service),
@@ -118,6 +127,8 @@ static void main_init(void)
 	   which we'll need to register. */
 	dict_drivers_register_all();
 	dict_commands_init();
+	if (dict_lookup_cache_init(dict_settings, &error) < 0)
+		i_error("dict_cache_prefixes: Lookup cache disabled: %s", error);
 	dict_connections_init();
 
 	if (dict_settings->verbose_proctitle)
@@ -134,6 +145,7 @@ static void main_deinit(void)
 
 	dict_drivers_unregister_all();
 	dict_commands_deinit();
+	dict_lookup_cache_deinit();
 
 	module_dir_unload(&modules);
 
@@ -0,0 +1,226 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "dict.h"
+#include "dict-settings.h"
+#include "dict-lookup-cache.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static struct dict_server_settings test_set = {
+	.dict_cache_prefixes = "shared/cached/ priv/cached/",
+	.dict_cache_ttl = 60,
+	.dict_cache_negative_ttl = 10,
+	.dict_cache_max_size = 1024*1024,
+};
+
+static void test_cache_init(void)
+{
+	const char *error;
+
+	test_assert(dict_lookup_cache_init(&test_set, &error) == 0);
+	test_assert(dict_lookup_cache_is_enabled());
+}
+
+static void test_cache_deinit(void)
+{
+	dict_lookup_cache_deinit();
+	(void)shm_unlink(dict_lookup_cache_get_shm_name(test_set.base_dir));
+}
+
+static const char *test_cache_key(const char *key)
+{
+	return dict_lookup_cache_get_key("dict", "user", key);
+}
+
+static void
+test_cache_add(const char *key, const char *value)
+{
+	const char *cache_key = test_cache_key(key);
+	const char *values[] = { value, NULL };
+
+	(void)dict_lookup_cache_add(cache_key,
+		dict_lookup_cache_get_generation(cache_key),
+		value == NULL ? NULL : values);
+}
+
+static bool test_cache_lookup(const char *key, const char **value_r)
+{
+	const char *const *values;
+
+	if (!dict_lookup_cache_lookup(test_cache_key(key), &values))
+		return FALSE;
+	*value_r = values == NULL ? NULL : values[0];
+	return TRUE;
+}
+
+static void test_dict_lookup_cache_keys(void)
+{
+	test_begin("dict lookup cache keys");
+	test_cache_init();
+
+	test_assert(test_cache_key("shared/other/key") == NULL);
+	test_assert(test_cache_key("priv/other/key") == NULL);
+	/* shared keys are shared between users, private ones aren't */
+	test_assert_strcmp(dict_lookup_cache_get_key("dict", "user1", "shared/cached/key"),
+			   dict_lookup_cache_get_key("dict", "user2", "shared/cached/key"));
+	test_assert(strcmp(dict_lookup_cache_get_key("dict", "user1", "priv/cached/key"),
+			   dict_lookup_cache_get_key("dict", "user2", "priv/cached/key")) != 0);
+	test_assert(strcmp(dict_lookup_cache_get_key("dict1", "user", "shared/cached/key"),
+			   dict_lookup_cache_get_key("dict2", "user", "shared/cached/key")) != 0);
+
+	test_cache_deinit();
+	test_end();
+}
+
+static void test_dict_lookup_cache_ttl(void)
+{
+	const struct dict_lookup_cache_stats *stats;
+	const char *value = NULL;
+
+	test_begin("dict lookup cache ttl");
+	test_cache_init();
+	stats = dict_lookup_cache_get_stats();
+	ioloop_time = 1000000;
+
+	test_assert(!test_cache_lookup("shared/cached/key", &value));
+	test_cache_add("shared/cached/key", "value");
+	test_assert(test_cache_lookup("shared/cached/key", &value));
+	test_assert_strcmp(value, "value");
+
+	/* negative entries use the shorter ttl */
+	test_cache_add("shared/cached/missing", NULL);
+	test_assert(test_cache_lookup("shared/cached/missing", &value));
+	test_assert(value == NULL);
+	test_assert(stats->negative_hits == 1);
+
+	ioloop_time += test_set.dict_cache_negative_ttl - 1;
+	test_assert(test_cache_lookup("shared/cached/missing", &value));
+	ioloop_time++;
+	test_assert(!test_cache_lookup("shared/cached/missing", &value));
+	test_assert(test_cache_lookup("shared/cached/key", &value));
+
+	ioloop_time = 1000000 + test_set.dict_cache_ttl;
+	test_assert(!test_cache_lookup("shared/cached/key", &value));
+
+	test_assert(stats->hits == 4);
+	test_assert(stats->misses == 3);
+	test_cache_deinit();
+
+	/* negative caching can be disabled */
+	test_set.dict_cache_negative_ttl = 0;
+	test_cache_init();
+	test_cache_add("shared/cached/missing", NULL);
+	test_assert(!test_cache_lookup("shared/cached/missing", &value));
+	test_cache_deinit();
+	test_set.dict_cache_negative_ttl = 10;
+	test_end();
+}
+
+static void test_dict_lookup_cache_eviction(void)
+{
+	const struct dict_lookup_cache_stats *stats;
+	const char *value, *cache_key;
+	const char *values[] = { "value", NULL };
+	unsigned int i, evictions = 0;
+
+	test_begin("dict lookup cache eviction");
+	test_set.dict_cache_max_size = 1024;
+	test_cache_init();
+	stats = dict_lookup_cache_get_stats();
+
+	test_cache_add("shared/cached/first", "value");
+	for (i = 0; evictions == 0; i++) {
+		/* keep the first key as the most recently used one */
+		test_assert(test_cache_lookup("shared/cached/first", &value));
+		cache_key = test_cache_key(t_strdup_printf("shared/cached/%u", i));
+		evictions = dict_lookup_cache_add(cache_key,
+			dict_lookup_cache_get_generation(cache_key), values);
+	}
+	test_assert(evictions == 1);
+	test_assert(stats->evictions == 1);
+	/* the least recently used one was evicted */
+	test_assert(!test_cache_lookup("shared/cached/0", &value));
+	test_assert(test_cache_lookup("shared/cached/first", &value));
+	test_assert(test_cache_lookup(t_strdup_printf("shared/cached/%u", i-1),
+				      &value));
+
+	test_cache_deinit();
+	test_set.dict_cache_max_size = 1024*1024;
+	test_end();
+}
+
+static void test_dict_lookup_cache_generation(void)
+{
+	ARRAY_TYPE(dict_lookup_cache_key) keys = ARRAY_INIT;
+	const char *cache_key, *value, *values[] = { "old", NULL };
+	uint64_t generation;
+	int status;
+	pid_t pid;
+
+	test_begin("dict lookup cache generation");
+	test_cache_init();
+	ioloop_time = 1000000;
+
+	/* lookup started before a write doesn't get cached */
+	cache_key = test_cache_key("shared/cached/key");
+	generation = dict_lookup_cache_get_generation(cache_key);
+	dict_lookup_cache_invalidate_later(cache_key, &keys);
+	(void)dict_lookup_cache_add(cache_key, generation, values);
+	test_assert(!test_cache_lookup("shared/cached/key", &value));
+
+	/* a lookup started before the commit doesn't get cached either */
+	generation = dict_lookup_cache_get_generation(cache_key);
+	dict_lookup_cache_invalidate_keys(&keys);
+	(void)dict_lookup_cache_add(cache_key, generation, values);
+	test_assert(!test_cache_lookup("shared/cached/key", &value));
+	test_assert(!array_is_created(&keys));
+
+	/* a write in another dict process invalidates the key */
+	test_cache_add("shared/cached/key", "value");
+	test_cache_add("shared/cached/other", "value");
+	test_assert(test_cache_lookup("shared/cached/key", &value));
+	if ((pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		const char *error;
+
+		dict_lookup_cache_deinit();
+		if (dict_lookup_cache_init(&test_set, &error) < 0)
+			i_fatal("%s", error);
+		dict_lookup_cache_invalidate_later(cache_key, &keys);
+		dict_lookup_cache_keys_free(&keys);
+		dict_lookup_cache_deinit();
+		_exit(0);
+	}
+	test_assert(waitpid(pid, &status, 0) == pid && status == 0);
+	test_assert(!test_cache_lookup("shared/cached/key", &value));
+	test_assert(test_cache_lookup("shared/cached/other", &value));
+	test_assert(dict_lookup_cache_get_stats()->invalidations == 1);
+
+	test_cache_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_dict_lookup_cache_keys,
+		test_dict_lookup_cache_ttl,
+		test_dict_lookup_cache_eviction,
+		test_dict_lookup_cache_generation,
+		NULL
+	};
+	static char base_dir[64];
+
+	/* the shared memory name is based on it, so make it unique */
+	i_snprintf(base_dir, sizeof(base_dir), ".test-dict-lookup-cache.%ld",
+		   (long)getpid());
+	test_set.base_dir = base_dir;
+	return test_run(test_functions);
+}
@@ -100,6 +100,7 @@ struct dsync_cmd_context {
 
 	unsigned int lock_timeout;
 	unsigned int import_commit_msgs_interval;
+	unsigned int mailbox_workers;
 
 	bool lock:1;
 	bool purge_remote:1;
@@ -691,6 +692,7 @@ cmd_dsync_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 	memcpy(set.sync_box_guid, ctx->mailbox_guid, sizeof(set.sync_box_guid));
 	set.lock_timeout_secs = ctx->lock_timeout;
 	set.import_commit_msgs_interval = ctx->import_commit_msgs_interval;
+	set.mailbox_workers = ctx->mailbox_workers;
 	set.state = ctx->state_input;
 	set.mailbox_alt_char = doveadm_settings->dsync_alt_char[0];
 	if (*doveadm_settings->dsync_hashed_headers == '\0') {
@@ -1192,6 +1194,13 @@ static void cmd_dsync_preinit(struct doveadm_mail_cmd_context *_ctx)
 		i_fatal("Invalid -I parameter '%s': %s", value_str, error);
 
 	(void)doveadm_cmd_param_uint32(cctx, "timeout", &ctx->io_timeout_secs);
+	(void)doveadm_cmd_param_uint32(cctx, "mailbox-workers",
+				       &ctx->mailbox_workers);
+	if (ctx->mailbox_workers == 0 ||
+	    ctx->mailbox_workers > DSYNC_BRAIN_MAX_MAILBOX_WORKERS) {
+		i_fatal("Invalid -W parameter: %u (must be 1..%u)",
+			ctx->mailbox_workers, DSYNC_BRAIN_MAX_MAILBOX_WORKERS);
+	}
 
 	if (!doveadm_cmd_param_array(cctx, "destination", &ctx->destination))
 		ctx->destination = empty_str_array;
@@ -1221,6 +1230,7 @@ static struct doveadm_mail_cmd_context *cmd_dsync_alloc(void)
         if ((doveadm_settings->parsed_features & DSYNC_FEATURE_NO_HEADER_HASHES) != 0)
                 ctx->no_header_hashes = TRUE;
 	ctx->import_commit_msgs_interval = doveadm_settings->dsync_commit_msgs_interval;
+	ctx->mailbox_workers = doveadm_settings->dsync_mailbox_workers;
 	return &ctx->ctx;
 }
 
@@ -1351,6 +1361,7 @@ DOVEADM_CMD_PARAM('e', "sync-until-time", CMD_PARAM_STR, 0) \
 DOVEADM_CMD_PARAM('O', "sync-flags", CMD_PARAM_STR, 0) \
 DOVEADM_CMD_PARAM('I', "sync-max-size", CMD_PARAM_STR, 0) \
 DOVEADM_CMD_PARAM('T', "timeout", CMD_PARAM_INT64, CMD_PARAM_FLAG_UNSIGNED) \
+DOVEADM_CMD_PARAM('W', "mailbox-workers", CMD_PARAM_INT64, CMD_PARAM_FLAG_UNSIGNED) \
 DOVEADM_CMD_PARAM('d', "default-destination", CMD_PARAM_BOOL, 0) \
 DOVEADM_CMD_PARAM('E', "legacy-dsync", CMD_PARAM_BOOL, 0) \
 DOVEADM_CMD_PARAM('\0', "destination", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
@@ -1360,7 +1371,7 @@ DOVEADM_CMD_PARAM('\0', "destination", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONA
 	"[-m <mailbox>] [-g <mailbox guid>] [-n <namespace> | -N] " \
 	"[-x <exclude>] [-a <all mailbox>] [-s <state>] [-T <secs>] " \
 	"[-t <start date>] [-e <end date>] [-O <sync flag>] [-I <max size>] " \
-	"-d|<dest>"
+	"[-W <mailbox workers>] -d|<dest>"
 
 struct doveadm_cmd_ver2 doveadm_cmd_dsync_mirror = {
 	.mail_cmd = cmd_dsync_alloc,
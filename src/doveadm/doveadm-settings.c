@@ -79,6 +79,7 @@ static const struct setting_define doveadm_setting_defines[] = {
 	DEF(STR, doveadm_api_key),
 	DEF(STR, dsync_features),
 	DEF(UINT, dsync_commit_msgs_interval),
+	DEF(UINT, dsync_mailbox_workers),
 	DEF(STR, doveadm_http_rawlog_dir),
 	DEF(STR_HIDDEN, dsync_hashed_headers),
 
@@ -108,6 +109,7 @@ const struct doveadm_settings doveadm_default_settings = {
 	.dsync_features = "",
 	.dsync_hashed_headers = "Date Message-ID",
 	.dsync_commit_msgs_interval = 100,
+	.dsync_mailbox_workers = 1,
 	.doveadm_api_key = "",
 	.doveadm_http_rawlog_dir = "",
 
@@ -190,6 +192,10 @@ static bool doveadm_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 		*error_r = "dsync_alt_char must not be empty";
 		return FALSE;
 	}
+	if (set->dsync_mailbox_workers == 0) {
+		*error_r = "dsync_mailbox_workers must not be 0";
+		return FALSE;
+	}
 	if (dsync_settings_parse_features(set, error_r) != 0)
 		return FALSE;
 	return TRUE;
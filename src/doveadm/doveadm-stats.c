@@ -23,6 +23,7 @@
 #define ADD_FILTER_PARAM "filter"
 #define ADD_EXPORTER_PARAM "exporter"
 #define ADD_EXPORTERINCL_PARAM "exporter-include"
+#define ADD_WINDOWS_PARAM "windows"
 
 enum doveadm_dump_field_type {
 	DOVEADM_DUMP_FIELD_TYPE_PASSTHROUGH = 0,
@@ -241,6 +242,7 @@ static int build_stats_add_cmd(struct stats_cmd_context *ctx,
 		   together with stats-settings */
 		{ ADD_EXPORTERINCL_PARAM,
 		  STATS_METRIC_SETTINGS_DEFAULT_EXPORTER_INCLUDE },
+		{ ADD_WINDOWS_PARAM, "" },
 	};
 
 	ctx->cmd = init_stats_cmd();
@@ -341,7 +343,8 @@ struct doveadm_cmd_ver2 doveadm_cmd_stats_add_ver2 = {
 	.usage = "[--"ADD_DESCR_PARAM" <string>] "
 	"[--"ADD_EXPORTER_PARAM" <name> [--"ADD_EXPORTERINCL_PARAM" <fields>]] "
 	"[--"ADD_FIELDS_PARAM" <fields>] "
-	"[--"ADD_GROUPBY_PARAM" <fields>] <name> <filter>",
+	"[--"ADD_GROUPBY_PARAM" <fields>] "
+	"[--"ADD_WINDOWS_PARAM" <times>] <name> <filter>",
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_PARAM('\0', ADD_NAME_PARAM, CMD_PARAM_STR, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAM('\0', ADD_FILTER_PARAM, CMD_PARAM_STR, CMD_PARAM_FLAG_POSITIONAL)
@@ -350,6 +353,7 @@ DOVEADM_CMD_PARAM('\0', ADD_EXPORTERINCL_PARAM, CMD_PARAM_STR, 0)
 DOVEADM_CMD_PARAM('\0', ADD_DESCR_PARAM, CMD_PARAM_STR, 0)
 DOVEADM_CMD_PARAM('\0', ADD_FIELDS_PARAM, CMD_PARAM_STR, 0)
 DOVEADM_CMD_PARAM('\0', ADD_GROUPBY_PARAM, CMD_PARAM_STR, 0)
+DOVEADM_CMD_PARAM('\0', ADD_WINDOWS_PARAM, CMD_PARAM_STR, 0)
 DOVEADM_CMD_PARAMS_END
 };
 
@@ -87,6 +87,7 @@ dsync_mailbox_state_find(struct dsync_brain *brain,
 	const uint8_t *guid_p;
 
 	guid_p = mailbox_guid;
+	brain = dsync_brain_get_main(brain);
 	return hash_table_lookup(brain->mailbox_states, guid_p);
 }
 
@@ -97,6 +98,7 @@ dsync_mailbox_state_remove(struct dsync_brain *brain,
 	const uint8_t *guid_p;
 
 	guid_p = mailbox_guid;
+	brain = dsync_brain_get_main(brain);
 	if (hash_table_lookup(brain->mailbox_states, guid_p) != NULL)
 		hash_table_remove(brain->mailbox_states, guid_p);
 }
@@ -136,6 +138,10 @@ dsync_brain_sync_mailbox_init(struct dsync_brain *brain,
 
 	brain->box = box;
 	brain->box_lock = lock;
+	brain->box_event = event_create(brain->event);
+	event_add_str(brain->box_event, "mailbox", mailbox_get_vname(box));
+	event_add_str(brain->box_event, "mailbox_guid",
+		      guid_128_to_string(local_dsync_box->mailbox_guid));
 	brain->pre_box_state = brain->state;
 	if (wait_for_remote_box) {
 		brain->box_send_state = DSYNC_BOX_STATE_MAILBOX;
@@ -356,13 +362,34 @@ int dsync_brain_sync_mailbox_open(struct dsync_brain *brain,
 	return 1;
 }
 
+static void dsync_brain_sync_mailbox_finished(struct dsync_brain *brain)
+{
+	struct event_passthrough *e;
+	uintmax_t duration;
+
+	e = event_create_passthrough(brain->box_event)->
+		set_name("dsync_mailbox_sync_finished");
+	if (brain->failed)
+		e->add_str("error", "Mailbox sync failed");
+	else if (brain->require_full_resync)
+		e->add_str("error", "Full resync required");
+	duration = dsync_mailbox_stats_add(&dsync_brain_get_main(brain)->box_stats,
+					   brain->box_event,
+					   mailbox_get_vname(brain->box));
+	e_debug(e->event(), "Mailbox %s synced in %ju.%03ju ms",
+		mailbox_get_vname(brain->box), duration / 1000,
+		duration % 1000);
+	event_unref(&brain->box_event);
+}
+
 void dsync_brain_sync_mailbox_deinit(struct dsync_brain *brain)
 {
 	enum mail_error error;
 
 	i_assert(brain->box != NULL);
 
-	array_push_back(&brain->remote_mailbox_states, &brain->mailbox_state);
+	array_push_back(&dsync_brain_get_main(brain)->remote_mailbox_states,
+			&brain->mailbox_state);
 	if (brain->box_exporter != NULL) {
 		const char *errstr;
 
@@ -393,6 +420,7 @@ void dsync_brain_sync_mailbox_deinit(struct dsync_brain *brain)
 	}
 	if (brain->log_scan != NULL)
 		dsync_transaction_log_scan_deinit(&brain->log_scan);
+	dsync_brain_sync_mailbox_finished(brain);
 	file_lock_free(&brain->box_lock);
 	mailbox_free(&brain->box);
 
@@ -476,6 +504,7 @@ dsync_brain_try_next_mailbox(struct dsync_brain *brain, struct mailbox **box_r,
 			     struct file_lock **lock_r,
 			     struct dsync_mailbox *dsync_box_r)
 {
+	struct dsync_brain *main_brain = dsync_brain_get_main(brain);
 	enum mailbox_flags flags = 0;
 	struct dsync_mailbox dsync_box;
 	struct mailbox *box;
@@ -488,7 +517,13 @@ dsync_brain_try_next_mailbox(struct dsync_brain *brain, struct mailbox **box_r,
 
 	*box_r = NULL;
 
-	while (dsync_mailbox_tree_iter_next(brain->local_tree_iter, &vname, &node)) {
+	/* mailbox workers share the main brain's iterator */
+	if (main_brain->local_tree_iter == NULL) {
+		/* another worker already reached the end of the list */
+		return -1;
+	}
+	while (dsync_mailbox_tree_iter_next(main_brain->local_tree_iter,
+					    &vname, &node)) {
 		if (node->existence == DSYNC_MAILBOX_NODE_EXISTS &&
 		    !guid_128_is_empty(node->mailbox_guid))
 			break;
@@ -496,7 +531,7 @@ dsync_brain_try_next_mailbox(struct dsync_brain *brain, struct mailbox **box_r,
 	}
 	if (vname == NULL) {
 		/* no more mailboxes */
-		dsync_mailbox_tree_iter_deinit(&brain->local_tree_iter);
+		dsync_mailbox_tree_iter_deinit(&main_brain->local_tree_iter);
 		return -1;
 	}
 
@@ -587,6 +622,12 @@ void dsync_brain_master_send_mailbox(struct dsync_brain *brain)
 	i_assert(brain->master_brain);
 	i_assert(brain->box == NULL);
 
+	if (array_is_created(&brain->workers)) {
+		/* the mailboxes are synced by the workers */
+		brain->state = DSYNC_STATE_FINISH;
+		dsync_ibc_send_end_of_list(brain->ibc, DSYNC_IBC_EOL_MAILBOX);
+		return;
+	}
 	if (!dsync_brain_next_mailbox(brain, &box, &lock, &dsync_box)) {
 		brain->state = DSYNC_STATE_FINISH;
 		dsync_ibc_send_end_of_list(brain->ibc, DSYNC_IBC_EOL_MAILBOX);
@@ -5,6 +5,7 @@
 #include "dsync-brain.h"
 #include "dsync-mailbox.h"
 #include "dsync-mailbox-state.h"
+#include "dsync-mailbox-stats.h"
 
 #define DSYNC_LOCK_FILENAME ".dovecot-sync.lock"
 #define DSYNC_MAILBOX_LOCK_FILENAME ".dovecot-box-sync.lock"
@@ -26,6 +27,10 @@ enum dsync_state {
 	DSYNC_STATE_RECV_MAILBOX_TREE,
 	DSYNC_STATE_RECV_MAILBOX_TREE_DELETES,
 
+	/* mailbox workers wait here until the main brain has synced the
+	   mailbox trees */
+	DSYNC_STATE_WORKER_WAIT_MAILBOX_TREES,
+
 	/* master decides in which order mailboxes are synced (it knows the
 	   slave's mailboxes by looking at the received mailbox tree) */
 	DSYNC_STATE_MASTER_SEND_MAILBOX,
@@ -53,6 +58,12 @@ struct dsync_brain {
 	struct event *event;
 	struct mail_user *user;
 	struct dsync_ibc *ibc;
+	/* main brain of a mailbox worker, or NULL */
+	struct dsync_brain *parent;
+	/* mailbox workers of the main brain */
+	ARRAY(struct dsync_brain *) workers;
+	unsigned int mailbox_workers;
+	enum dsync_brain_flags flags;
 	const char *process_title_prefix;
 	ARRAY(struct mail_namespace *) sync_namespaces;
 	const char *sync_box;
@@ -89,6 +100,10 @@ struct dsync_brain {
 
 	struct mailbox *box;
 	struct file_lock *box_lock;
+	/* created when starting to sync the mailbox, sent as
+	   dsync_mailbox_sync_finished event when done */
+	struct event *box_event;
+	struct dsync_mailbox_stats box_stats;
 	unsigned int mailbox_lock_timeout_secs;
 	struct dsync_mailbox local_dsync_box, remote_dsync_box;
 	pool_t dsync_box_pool;
@@ -130,6 +145,13 @@ struct dsync_brain {
 
 extern const char *dsync_box_state_names[DSYNC_BOX_STATE_DONE+1];
 
+/* Returns the brain that owns the mailbox trees and states shared by all
+   the mailbox workers. */
+static inline struct dsync_brain *dsync_brain_get_main(struct dsync_brain *brain)
+{
+	return brain->parent != NULL ? brain->parent : brain;
+}
+
 void dsync_brain_mailbox_trees_init(struct dsync_brain *brain);
 void dsync_brain_send_mailbox_tree(struct dsync_brain *brain);
 void dsync_brain_send_mailbox_tree_deletes(struct dsync_brain *brain);
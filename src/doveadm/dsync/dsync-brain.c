@@ -33,6 +33,7 @@ static const char *dsync_state_names[] = {
 	"send_mailbox_tree_deletes",
 	"recv_mailbox_tree",
 	"recv_mailbox_tree_deletes",
+	"worker_wait_mailbox_trees",
 	"master_send_mailbox",
 	"slave_recv_mailbox",
 	"sync_mails",
@@ -54,7 +55,8 @@ dsync_brain_get_proctitle_full(struct dsync_brain *brain,
 			       enum dsync_brain_title title)
 {
 	string_t *str = t_str_new(128);
-	const char *import_title, *export_title;
+	const char *import_title, *export_title, *sep = " workers:";
+	struct dsync_brain *worker;
 
 	str_append_c(str, '[');
 	if (brain->process_title_prefix != NULL)
@@ -85,6 +87,15 @@ dsync_brain_get_proctitle_full(struct dsync_brain *brain,
 			}
 		}
 	}
+	if (array_is_created(&brain->workers)) {
+		array_foreach_elem(&brain->workers, worker) {
+			if (worker->box == NULL)
+				continue;
+			str_append(str, sep);
+			str_append(str, mailbox_get_vname(worker->box));
+			sep = ",";
+		}
+	}
 	switch (title) {
 	case DSYNC_BRAIN_TITLE_NONE:
 		break;
@@ -101,8 +112,24 @@ static const char *dsync_brain_get_proctitle(struct dsync_brain *brain)
 	return dsync_brain_get_proctitle_full(brain, DSYNC_BRAIN_TITLE_NONE);
 }
 
+static bool dsync_brain_has_pending_data(struct dsync_brain *brain)
+{
+	struct dsync_brain *worker;
+
+	if (dsync_ibc_has_pending_data(brain->ibc))
+		return TRUE;
+	if (array_is_created(&brain->workers)) {
+		array_foreach_elem(&brain->workers, worker) {
+			if (dsync_ibc_has_pending_data(worker->ibc))
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 static void dsync_brain_run_io(void *context)
 {
+	/* mailbox workers' ibcs call this with their main brain */
 	struct dsync_brain *brain = context;
 	bool changed, try_pending;
 
@@ -121,7 +148,7 @@ static void dsync_brain_run_io(void *context)
 		if (changed)
 			try_pending = TRUE;
 		else if (try_pending) {
-			if (dsync_ibc_has_pending_data(brain->ibc))
+			if (dsync_brain_has_pending_data(brain))
 				changed = TRUE;
 			try_pending = FALSE;
 		}
@@ -130,7 +157,7 @@ static void dsync_brain_run_io(void *context)
 
 static struct dsync_brain *
 dsync_brain_common_init(struct mail_user *user, struct dsync_ibc *ibc,
-			bool master_brain)
+			bool master_brain, unsigned int worker_id)
 {
 	struct dsync_brain *brain;
 	const struct master_service_settings *service_set;
@@ -153,14 +180,17 @@ dsync_brain_common_init(struct mail_user *user, struct dsync_ibc *ibc,
 	p_array_init(&brain->remote_mailbox_states, pool, 64);
 
 	brain->event = event_create(user->event);
-	event_set_append_log_prefix(brain->event, t_strdup_printf(
-		"brain %c: ", master_brain ? 'M': 'S'));
+	event_set_append_log_prefix(brain->event, worker_id == 0 ?
+		t_strdup_printf("brain %c: ", master_brain ? 'M': 'S') :
+		t_strdup_printf("brain %c%u: ", master_brain ? 'M': 'S',
+				worker_id));
 	return brain;
 }
 
 static void
 dsync_brain_set_flags(struct dsync_brain *brain, enum dsync_brain_flags flags)
 {
+	brain->flags = flags;
 	brain->mail_requests =
 		(flags & DSYNC_BRAIN_FLAG_SEND_MAIL_REQUESTS) != 0;
 	brain->backup_send = (flags & DSYNC_BRAIN_FLAG_BACKUP_SEND) != 0;
@@ -191,37 +221,218 @@ dsync_brain_open_virtual_all_box(struct dsync_brain *brain,
 		mailbox_alloc(ns->list, vname, MAILBOX_FLAG_READONLY);
 }
 
+static void
+dsync_brain_master_send_handshake(struct dsync_brain *brain,
+				  unsigned int mailbox_workers)
+{
+	struct dsync_ibc_settings ibc_set;
+	struct mail_namespace *ns;
+	string_t *sync_ns_str = NULL;
+	enum dsync_brain_flags flags = brain->flags;
+
+	if (array_is_created(&brain->sync_namespaces)) {
+		sync_ns_str = t_str_new(128);
+		array_foreach_elem(&brain->sync_namespaces, ns) {
+			str_append(sync_ns_str, ns->prefix);
+			str_append_c(sync_ns_str, '\n');
+		}
+		str_delete(sync_ns_str, str_len(sync_ns_str)-1, 1);
+	}
+
+	i_zero(&ibc_set);
+	ibc_set.hostname = my_hostdomain();
+	ibc_set.sync_ns_prefixes = sync_ns_str == NULL ?
+		NULL : str_c(sync_ns_str);
+	ibc_set.sync_box = brain->sync_box;
+	ibc_set.virtual_all_box = brain->virtual_all_box == NULL ? NULL :
+		mailbox_get_vname(brain->virtual_all_box);
+	ibc_set.exclude_mailboxes = brain->exclude_mailboxes;
+	ibc_set.sync_since_timestamp = brain->sync_since_timestamp;
+	ibc_set.sync_until_timestamp = brain->sync_until_timestamp;
+	ibc_set.sync_max_size = brain->sync_max_size;
+	ibc_set.sync_flags = brain->sync_flag;
+	memcpy(ibc_set.sync_box_guid, brain->sync_box_guid,
+	       sizeof(ibc_set.sync_box_guid));
+	ibc_set.alt_char = brain->alt_char;
+	ibc_set.sync_type = brain->sync_type;
+	ibc_set.hdr_hash_v2 = TRUE;
+	ibc_set.lock_timeout = brain->lock_timeout;
+	ibc_set.hashed_headers = brain->hashed_headers;
+	ibc_set.mailbox_workers = mailbox_workers;
+	/* reverse the backup direction for the slave */
+	ibc_set.brain_flags = flags & ENUM_NEGATE(DSYNC_BRAIN_FLAG_BACKUP_SEND |
+						  DSYNC_BRAIN_FLAG_BACKUP_RECV);
+	if ((flags & DSYNC_BRAIN_FLAG_BACKUP_SEND) != 0)
+		ibc_set.brain_flags |= DSYNC_BRAIN_FLAG_BACKUP_RECV;
+	else if ((flags & DSYNC_BRAIN_FLAG_BACKUP_RECV) != 0)
+		ibc_set.brain_flags |= DSYNC_BRAIN_FLAG_BACKUP_SEND;
+	dsync_ibc_send_handshake(brain->ibc, &ibc_set);
+}
+
+static struct dsync_brain *
+dsync_brain_worker_init(struct dsync_brain *parent, struct dsync_ibc *ibc,
+			unsigned int worker_id)
+{
+	struct dsync_ibc_settings ibc_set;
+	struct dsync_brain *brain;
+
+	brain = dsync_brain_common_init(parent->user, ibc, parent->master_brain,
+					worker_id);
+	brain->parent = parent;
+	brain->process_title_prefix =
+		p_strdup(brain->pool, parent->process_title_prefix);
+	brain->sync_type = parent->sync_type;
+	if (array_is_created(&parent->sync_namespaces)) {
+		p_array_init(&brain->sync_namespaces, brain->pool,
+			     array_count(&parent->sync_namespaces));
+		array_append_array(&brain->sync_namespaces,
+				   &parent->sync_namespaces);
+	}
+	brain->sync_box = p_strdup(brain->pool, parent->sync_box);
+	memcpy(brain->sync_box_guid, parent->sync_box_guid,
+	       sizeof(brain->sync_box_guid));
+	brain->exclude_mailboxes = parent->exclude_mailboxes == NULL ? NULL :
+		p_strarray_dup(brain->pool, parent->exclude_mailboxes);
+	brain->sync_since_timestamp = parent->sync_since_timestamp;
+	brain->sync_until_timestamp = parent->sync_until_timestamp;
+	brain->sync_max_size = parent->sync_max_size;
+	brain->sync_flag = p_strdup(brain->pool, parent->sync_flag);
+	brain->alt_char = parent->alt_char;
+	brain->import_commit_msgs_interval = parent->import_commit_msgs_interval;
+	brain->hdr_hash_version = parent->hdr_hash_version;
+	/* the user is already locked by the main brain */
+	brain->mailbox_lock_timeout_secs = parent->mailbox_lock_timeout_secs;
+	brain->hashed_headers = parent->hashed_headers == NULL ? NULL :
+		p_strarray_dup(brain->pool, parent->hashed_headers);
+	dsync_brain_set_flags(brain, parent->flags);
+	/* only the main brain updates the process title */
+	brain->verbose_proctitle = FALSE;
+	if (parent->virtual_all_box != NULL) {
+		dsync_brain_open_virtual_all_box(brain,
+			mailbox_get_vname(parent->virtual_all_box));
+	}
+
+	/* The settings were already exchanged by the main brains, but the
+	   channel still needs its own handshake. */
+	i_zero(&ibc_set);
+	ibc_set.hostname = my_hostdomain();
+	ibc_set.hdr_hash_v2 = TRUE;
+	dsync_ibc_send_handshake(ibc, &ibc_set);
+
+	dsync_ibc_set_io_callback(ibc, dsync_brain_run_io, parent);
+	brain->state = brain->master_brain ?
+		DSYNC_STATE_MASTER_RECV_HANDSHAKE :
+		DSYNC_STATE_SLAVE_RECV_HANDSHAKE;
+	return brain;
+}
+
+static void dsync_brain_workers_init(struct dsync_brain *brain)
+{
+	struct dsync_brain *worker;
+	struct dsync_ibc *ibc;
+	unsigned int i;
+
+	i_assert(brain->parent == NULL);
+	i_assert(brain->mailbox_workers > 1 &&
+		 brain->mailbox_workers <= DSYNC_BRAIN_MAX_MAILBOX_WORKERS);
+
+	e_debug(brain->event, "Syncing mailboxes with %u workers",
+		brain->mailbox_workers);
+	i_array_init(&brain->workers, brain->mailbox_workers);
+	for (i = 1; i <= brain->mailbox_workers; i++) {
+		ibc = dsync_ibc_open_channel(brain->ibc, i);
+		worker = dsync_brain_worker_init(brain, ibc, i);
+		array_push_back(&brain->workers, &worker);
+	}
+}
+
+static void
+dsync_brain_worker_merge(struct dsync_brain *brain, struct dsync_brain *worker)
+{
+	if (worker->failed || dsync_ibc_has_failed(worker->ibc)) {
+		brain->failed = TRUE;
+		if (worker->mail_error != 0 &&
+		    (brain->mail_error == 0 ||
+		     brain->mail_error == MAIL_ERROR_TEMP))
+			brain->mail_error = worker->mail_error;
+	}
+	if (worker->require_full_resync)
+		brain->require_full_resync = TRUE;
+	if (worker->changes_during_remote_sync)
+		brain->changes_during_remote_sync = TRUE;
+	if (worker->changes_during_sync != NULL &&
+	    brain->changes_during_sync == NULL) {
+		brain->changes_during_sync =
+			p_strdup(brain->pool, worker->changes_during_sync);
+	}
+}
+
+static void dsync_brain_workers_deinit(struct dsync_brain *brain)
+{
+	struct dsync_brain *worker;
+	struct dsync_ibc *ibc;
+	enum mail_error mail_error;
+
+	if (!array_is_created(&brain->workers))
+		return;
+
+	array_foreach_elem(&brain->workers, worker) {
+		ibc = worker->ibc;
+		dsync_brain_worker_merge(brain, worker);
+		if (dsync_brain_deinit(&worker, &mail_error) < 0) {
+			brain->failed = TRUE;
+			if (brain->mail_error == 0 ||
+			    brain->mail_error == MAIL_ERROR_TEMP)
+				brain->mail_error = mail_error;
+		}
+		dsync_ibc_deinit(&ibc);
+	}
+	array_free(&brain->workers);
+}
+
+static bool dsync_brain_workers_finished(struct dsync_brain *brain)
+{
+	struct dsync_brain *worker;
+
+	if (!array_is_created(&brain->workers))
+		return TRUE;
+
+	array_foreach_elem(&brain->workers, worker) {
+		if (worker->state != DSYNC_STATE_DONE)
+			return FALSE;
+	}
+	/* This can be called from a worker ibc's input callback, so the
+	   workers are freed only by dsync_brain_deinit(). */
+	array_foreach_elem(&brain->workers, worker)
+		dsync_brain_worker_merge(brain, worker);
+	return TRUE;
+}
+
 struct dsync_brain *
 dsync_brain_master_init(struct mail_user *user, struct dsync_ibc *ibc,
 			enum dsync_brain_sync_type sync_type,
 			enum dsync_brain_flags flags,
 			const struct dsync_brain_settings *set)
 {
-	struct dsync_ibc_settings ibc_set;
 	struct dsync_brain *brain;
 	struct mail_namespace *ns;
-	string_t *sync_ns_str = NULL;
 	const char *error;
 
 	i_assert(sync_type != DSYNC_BRAIN_SYNC_TYPE_UNKNOWN);
 	i_assert(sync_type != DSYNC_BRAIN_SYNC_TYPE_STATE ||
 		 (set->state != NULL && *set->state != '\0'));
 	i_assert(N_ELEMENTS(dsync_state_names) == DSYNC_STATE_DONE+1);
+	i_assert(set->mailbox_workers <= DSYNC_BRAIN_MAX_MAILBOX_WORKERS);
 
-	brain = dsync_brain_common_init(user, ibc, BRAIN_MASTER);
+	brain = dsync_brain_common_init(user, ibc, BRAIN_MASTER, 0);
 	brain->process_title_prefix =
 		p_strdup(brain->pool, set->process_title_prefix);
 	brain->sync_type = sync_type;
 	if (array_count(&set->sync_namespaces) > 0) {
-		sync_ns_str = t_str_new(128);
 		p_array_init(&brain->sync_namespaces, brain->pool,
 			     array_count(&set->sync_namespaces));
-		array_foreach_elem(&set->sync_namespaces, ns) {
-			str_append(sync_ns_str, ns->prefix);
-			str_append_c(sync_ns_str, '\n');
+		array_foreach_elem(&set->sync_namespaces, ns)
 			array_push_back(&brain->sync_namespaces, &ns);
-		}
-		str_delete(sync_ns_str, str_len(sync_ns_str)-1, 1);
 	}
 	brain->alt_char = set->mailbox_alt_char == '\0' ? '_' :
 		set->mailbox_alt_char;
@@ -241,6 +452,7 @@ dsync_brain_master_init(struct mail_user *user, struct dsync_ibc *ibc,
 		brain->mailbox_lock_timeout_secs =
 			DSYNC_MAILBOX_DEFAULT_LOCK_TIMEOUT_SECS;
 	brain->import_commit_msgs_interval = set->import_commit_msgs_interval;
+	brain->mailbox_workers = set->mailbox_workers;
 	brain->hashed_headers =
 		(const char*const*)p_strarray_dup(brain->pool, set->hashed_headers);
 	dsync_brain_set_flags(brain, flags);
@@ -263,32 +475,10 @@ dsync_brain_master_init(struct mail_user *user, struct dsync_ibc *ibc,
 	}
 	dsync_brain_mailbox_trees_init(brain);
 
-	i_zero(&ibc_set);
-	ibc_set.hostname = my_hostdomain();
-	ibc_set.sync_ns_prefixes = sync_ns_str == NULL ?
-		NULL : str_c(sync_ns_str);
-	ibc_set.sync_box = set->sync_box;
-	ibc_set.virtual_all_box = set->virtual_all_box;
-	ibc_set.exclude_mailboxes = set->exclude_mailboxes;
-	ibc_set.sync_since_timestamp = set->sync_since_timestamp;
-	ibc_set.sync_until_timestamp = set->sync_until_timestamp;
-	ibc_set.sync_max_size = set->sync_max_size;
-	ibc_set.sync_flags = set->sync_flag;
-	memcpy(ibc_set.sync_box_guid, set->sync_box_guid,
-	       sizeof(ibc_set.sync_box_guid));
-	ibc_set.alt_char = brain->alt_char;
-	ibc_set.sync_type = sync_type;
-	ibc_set.hdr_hash_v2 = TRUE;
-	ibc_set.lock_timeout = set->lock_timeout_secs;
-	ibc_set.hashed_headers = set->hashed_headers;
-	/* reverse the backup direction for the slave */
-	ibc_set.brain_flags = flags & ENUM_NEGATE(DSYNC_BRAIN_FLAG_BACKUP_SEND |
-						  DSYNC_BRAIN_FLAG_BACKUP_RECV);
-	if ((flags & DSYNC_BRAIN_FLAG_BACKUP_SEND) != 0)
-		ibc_set.brain_flags |= DSYNC_BRAIN_FLAG_BACKUP_RECV;
-	else if ((flags & DSYNC_BRAIN_FLAG_BACKUP_RECV) != 0)
-		ibc_set.brain_flags |= DSYNC_BRAIN_FLAG_BACKUP_SEND;
-	dsync_ibc_send_handshake(ibc, &ibc_set);
+	/* With mailbox workers the handshake is sent only after seeing from
+	   the remote's handshake whether it supports them. */
+	if (brain->mailbox_workers <= 1)
+		dsync_brain_master_send_handshake(brain, 0);
 
 	dsync_ibc_set_io_callback(ibc, dsync_brain_run_io, brain);
 	brain->state = DSYNC_STATE_MASTER_RECV_HANDSHAKE;
@@ -309,7 +499,7 @@ dsync_brain_slave_init(struct mail_user *user, struct dsync_ibc *ibc,
 
 	i_assert(default_alt_char != '\0');
 
-	brain = dsync_brain_common_init(user, ibc, BRAIN_SLAVE);
+	brain = dsync_brain_common_init(user, ibc, BRAIN_SLAVE, 0);
 	brain->alt_char = default_alt_char;
 	brain->process_title_prefix =
 		p_strdup(brain->pool, process_title_prefix);
@@ -324,6 +514,7 @@ dsync_brain_slave_init(struct mail_user *user, struct dsync_ibc *ibc,
 
 	i_zero(&ibc_set);
 	ibc_set.hdr_hash_v2 = TRUE;
+	ibc_set.have_mailbox_workers = TRUE;
 	ibc_set.hostname = my_hostdomain();
 	dsync_ibc_send_handshake(ibc, &ibc_set);
 
@@ -354,10 +545,12 @@ static void dsync_brain_purge(struct dsync_brain *brain)
 int dsync_brain_deinit(struct dsync_brain **_brain, enum mail_error *error_r)
 {
 	struct dsync_brain *brain = *_brain;
+	const char *summary;
 	int ret;
 
 	*_brain = NULL;
 
+	dsync_brain_workers_deinit(brain);
 	if (dsync_ibc_has_timed_out(brain->ibc)) {
 		e_error(brain->event, "Timeout during state=%s%s",
 			dsync_state_names[brain->state],
@@ -387,6 +580,11 @@ int dsync_brain_deinit(struct dsync_brain **_brain, enum mail_error *error_r)
 	hash_table_iterate_deinit(&brain->mailbox_states_iter);
 	hash_table_destroy(&brain->mailbox_states);
 
+	summary = dsync_mailbox_stats_get_summary(&brain->box_stats);
+	if (summary != NULL)
+		e_debug(brain->event, "%s", summary);
+	dsync_mailbox_stats_free(&brain->box_stats);
+
 	pool_unref(&brain->dsync_box_pool);
 
 	if (brain->lock_fd != -1) {
@@ -499,6 +697,18 @@ static bool dsync_brain_master_recv_handshake(struct dsync_brain *brain)
 	}
 	dsync_brain_set_hdr_hash_version(brain, ibc_set);
 
+	if (brain->mailbox_workers > 1) {
+		if (!ibc_set->have_mailbox_workers) {
+			e_debug(brain->event, "Remote doesn't support "
+				"mailbox workers - syncing mailboxes serially");
+			brain->mailbox_workers = 0;
+		}
+		dsync_brain_master_send_handshake(brain,
+						  brain->mailbox_workers);
+		if (brain->mailbox_workers > 1)
+			dsync_brain_workers_init(brain);
+	}
+
 	brain->state = brain->sync_type == DSYNC_BRAIN_SYNC_TYPE_STATE ?
 		DSYNC_STATE_MASTER_SEND_LAST_COMMON :
 		DSYNC_STATE_SEND_MAILBOX_TREE;
@@ -575,6 +785,11 @@ static bool dsync_brain_slave_recv_handshake(struct dsync_brain *brain)
 		dsync_brain_open_virtual_all_box(brain, ibc_set->virtual_all_box);
 	dsync_brain_mailbox_trees_init(brain);
 
+	if (ibc_set->mailbox_workers > 1) {
+		brain->mailbox_workers = ibc_set->mailbox_workers;
+		dsync_brain_workers_init(brain);
+	}
+
 	if (brain->sync_type == DSYNC_BRAIN_SYNC_TYPE_STATE)
 		brain->state = DSYNC_STATE_SLAVE_RECV_LAST_COMMON;
 	else
@@ -640,6 +855,29 @@ static bool dsync_brain_slave_recv_last_common(struct dsync_brain *brain)
 	return changed;
 }
 
+static bool dsync_brain_worker_recv_handshake(struct dsync_brain *brain)
+{
+	const struct dsync_ibc_settings *ibc_set;
+
+	if (dsync_ibc_recv_handshake(brain->ibc, &ibc_set) == 0)
+		return FALSE;
+	/* the settings came already with the main brain's handshake */
+	brain->state = DSYNC_STATE_WORKER_WAIT_MAILBOX_TREES;
+	return TRUE;
+}
+
+static bool dsync_brain_worker_wait_mailbox_trees(struct dsync_brain *brain)
+{
+	/* the mailboxes can be synced only after the main brain has synced
+	   the mailbox trees */
+	if (brain->parent->state < DSYNC_STATE_MASTER_SEND_MAILBOX)
+		return FALSE;
+	brain->state = brain->master_brain ?
+		DSYNC_STATE_MASTER_SEND_MAILBOX :
+		DSYNC_STATE_SLAVE_RECV_MAILBOX;
+	return TRUE;
+}
+
 static bool dsync_brain_finish(struct dsync_brain *brain)
 {
 	const char *error;
@@ -647,6 +885,9 @@ static bool dsync_brain_finish(struct dsync_brain *brain)
 	bool require_full_resync;
 	enum dsync_ibc_recv_ret ret;
 
+	if (!dsync_brain_workers_finished(brain))
+		return FALSE;
+
 	if (!brain->master_brain) {
 		dsync_ibc_send_finish(brain->ibc,
 				      brain->failed ? "dsync failed" : NULL,
@@ -684,10 +925,14 @@ static bool dsync_brain_run_real(struct dsync_brain *brain, bool *changed_r)
 
 	switch (brain->state) {
 	case DSYNC_STATE_MASTER_RECV_HANDSHAKE:
-		changed = dsync_brain_master_recv_handshake(brain);
+		changed = brain->parent != NULL ?
+			dsync_brain_worker_recv_handshake(brain) :
+			dsync_brain_master_recv_handshake(brain);
 		break;
 	case DSYNC_STATE_SLAVE_RECV_HANDSHAKE:
-		changed = dsync_brain_slave_recv_handshake(brain);
+		changed = brain->parent != NULL ?
+			dsync_brain_worker_recv_handshake(brain) :
+			dsync_brain_slave_recv_handshake(brain);
 		break;
 	case DSYNC_STATE_MASTER_SEND_LAST_COMMON:
 		dsync_brain_master_send_last_common(brain);
@@ -710,6 +955,9 @@ static bool dsync_brain_run_real(struct dsync_brain *brain, bool *changed_r)
 	case DSYNC_STATE_RECV_MAILBOX_TREE_DELETES:
 		changed = dsync_brain_recv_mailbox_tree_deletes(brain);
 		break;
+	case DSYNC_STATE_WORKER_WAIT_MAILBOX_TREES:
+		changed = dsync_brain_worker_wait_mailbox_trees(brain);
+		break;
 	case DSYNC_STATE_MASTER_SEND_MAILBOX:
 		dsync_brain_master_send_mailbox(brain);
 		changed = TRUE;
@@ -739,6 +987,32 @@ static bool dsync_brain_run_real(struct dsync_brain *brain, bool *changed_r)
 	return brain->failed ? FALSE : ret;
 }
 
+static bool dsync_brain_run_workers(struct dsync_brain *brain, bool *changed_r)
+{
+	struct dsync_brain *worker;
+	bool changed;
+
+	array_foreach_elem(&brain->workers, worker) {
+		if (worker->state == DSYNC_STATE_DONE)
+			continue;
+
+		changed = FALSE;
+		if (dsync_ibc_has_failed(worker->ibc))
+			worker->failed = TRUE;
+		else T_BEGIN {
+			(void)dsync_brain_run_real(worker, &changed);
+		} T_END;
+		if (changed)
+			*changed_r = TRUE;
+		if (worker->failed) {
+			/* a failed mailbox worker fails the whole sync */
+			dsync_brain_worker_merge(brain, worker);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 bool dsync_brain_run(struct dsync_brain *brain, bool *changed_r)
 {
 	bool ret;
@@ -753,6 +1027,8 @@ bool dsync_brain_run(struct dsync_brain *brain, bool *changed_r)
 	T_BEGIN {
 		ret = dsync_brain_run_real(brain, changed_r);
 	} T_END;
+	if (ret && array_is_created(&brain->workers))
+		ret = dsync_brain_run_workers(brain, changed_r);
 	return ret;
 }
 
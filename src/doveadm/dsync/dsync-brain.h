@@ -54,6 +54,9 @@ enum dsync_brain_sync_type {
 	DSYNC_BRAIN_SYNC_TYPE_STATE
 };
 
+/* Maximum number of mailboxes that can be synced concurrently */
+#define DSYNC_BRAIN_MAX_MAILBOX_WORKERS 32
+
 struct dsync_brain_settings {
 	const char *process_title_prefix;
 	/* Sync only these namespaces */
@@ -89,6 +92,11 @@ struct dsync_brain_settings {
 	/* If non-zero, importing will attempt to commit transaction after
 	   saving this many messages. */
 	unsigned int import_commit_msgs_interval;
+	/* If higher than 1, sync this many mailboxes concurrently. Each
+	   mailbox worker has its own brain and ibc channel, but they share
+	   the mailbox trees and states with the main brain. Ignored if the
+	   remote doesn't support it. */
+	unsigned int mailbox_workers;
 	/* Input state for DSYNC_BRAIN_SYNC_TYPE_STATE */
 	const char *state;
 };
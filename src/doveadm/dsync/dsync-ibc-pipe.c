@@ -57,6 +57,8 @@ struct dsync_ibc_pipe {
 	ARRAY(pool_t) pools;
 	ARRAY(struct item) item_queue;
 	struct dsync_ibc_pipe *remote;
+	/* channels opened by the remote, which we haven't opened yet */
+	ARRAY(struct dsync_ibc_pipe *) channels;
 
 	pool_t pop_pool;
 	struct item pop_item;
@@ -141,6 +143,7 @@ static bool dsync_ibc_pipe_try_pop_eol(struct dsync_ibc_pipe *pipe)
 static void dsync_ibc_pipe_deinit(struct dsync_ibc *ibc)
 {
 	struct dsync_ibc_pipe *pipe = (struct dsync_ibc_pipe *)ibc;
+	struct dsync_ibc_pipe *channel;
 	struct item *item;
 	pool_t pool;
 
@@ -149,6 +152,12 @@ static void dsync_ibc_pipe_deinit(struct dsync_ibc *ibc)
 		pipe->remote->remote = NULL;
 	}
 
+	array_foreach_elem(&pipe->channels, channel) {
+		if (channel != NULL)
+			dsync_ibc_pipe_deinit(&channel->ibc);
+	}
+	array_free(&pipe->channels);
+
 	pool_unref(&pipe->pop_pool);
 	array_foreach_modifiable(&pipe->item_queue, item) {
 		pool_unref(&item->pool);
@@ -543,11 +552,16 @@ static void dsync_ibc_pipe_close_mail_streams(struct dsync_ibc *ibc)
 	struct dsync_ibc_pipe *pipe = (struct dsync_ibc_pipe *)ibc;
 
 	pipe_close_mail_streams(pipe);
-	pipe_close_mail_streams(pipe->remote);
+	if (pipe->remote != NULL)
+		pipe_close_mail_streams(pipe->remote);
 }
 
+static struct dsync_ibc *
+dsync_ibc_pipe_open_channel(struct dsync_ibc *ibc, unsigned int channel_id);
+
 static const struct dsync_ibc_vfuncs dsync_ibc_pipe_vfuncs = {
 	dsync_ibc_pipe_deinit,
+	dsync_ibc_pipe_open_channel,
 	dsync_ibc_pipe_send_handshake,
 	dsync_ibc_pipe_recv_handshake,
 	dsync_ibc_pipe_send_end_of_list,
@@ -583,9 +597,36 @@ dsync_ibc_pipe_alloc(void)
 	pipe->ibc.v = dsync_ibc_pipe_vfuncs;
 	i_array_init(&pipe->pools, 4);
 	i_array_init(&pipe->item_queue, 4);
+	i_array_init(&pipe->channels, 4);
 	return pipe;
 }
 
+static struct dsync_ibc *
+dsync_ibc_pipe_open_channel(struct dsync_ibc *ibc, unsigned int channel_id)
+{
+	struct dsync_ibc_pipe *pipe = (struct dsync_ibc_pipe *)ibc;
+	struct dsync_ibc_pipe *channel, *remote_channel, **channelp;
+
+	channelp = array_idx_get_space(&pipe->channels, channel_id);
+	if (*channelp != NULL) {
+		/* the remote already opened this channel */
+		channel = *channelp;
+		*channelp = NULL;
+		return &channel->ibc;
+	}
+
+	i_assert(pipe->remote != NULL);
+	channel = dsync_ibc_pipe_alloc();
+	remote_channel = dsync_ibc_pipe_alloc();
+	channel->remote = remote_channel;
+	remote_channel->remote = channel;
+
+	channelp = array_idx_get_space(&pipe->remote->channels, channel_id);
+	i_assert(*channelp == NULL);
+	*channelp = remote_channel;
+	return &channel->ibc;
+}
+
 void dsync_ibc_init_pipe(struct dsync_ibc **ibc1_r, struct dsync_ibc **ibc2_r)
 {
 	struct dsync_ibc_pipe *pipe1, *pipe2;
@@ -5,6 +5,8 @@
 
 struct dsync_ibc_vfuncs {
 	void (*deinit)(struct dsync_ibc *ibc);
+	struct dsync_ibc *(*open_channel)(struct dsync_ibc *ibc,
+					  unsigned int channel_id);
 
 	void (*send_handshake)(struct dsync_ibc *ibc,
 			       const struct dsync_ibc_settings *set);
@@ -7,7 +7,9 @@
 #include "istream.h"
 #include "istream-seekable.h"
 #include "istream-dot.h"
+#include "istream-multiplex.h"
 #include "ostream.h"
+#include "ostream-multiplex.h"
 #include "str.h"
 #include "strescape.h"
 #include "master-service.h"
@@ -25,14 +27,15 @@
 #define DSYNC_IBC_STREAM_OUTBUF_THROTTLE_SIZE (1024*128)
 
 #define DSYNC_PROTOCOL_VERSION_MAJOR 3
-#define DSYNC_PROTOCOL_VERSION_MINOR 5
-#define DSYNC_HANDSHAKE_VERSION "VERSION\tdsync\t3\t5\n"
+#define DSYNC_PROTOCOL_VERSION_MINOR 6
+#define DSYNC_HANDSHAKE_VERSION "VERSION\tdsync\t3\t6\n"
 
 #define DSYNC_PROTOCOL_MINOR_HAVE_ATTRIBUTES 1
 #define DSYNC_PROTOCOL_MINOR_HAVE_SAVE_GUID 2
 #define DSYNC_PROTOCOL_MINOR_HAVE_FINISH 3
 #define DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V2 4
 #define DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V3 5
+#define DSYNC_PROTOCOL_MINOR_HAVE_MAILBOX_WORKERS 6
 
 enum item_type {
 	ITEM_NONE,
@@ -79,7 +82,7 @@ static const struct {
 	  	"no_mail_sync no_backup_overwrite purge_remote "
 		"no_notify sync_since_timestamp sync_max_size sync_flags sync_until_timestamp "
 		"virtual_all_box empty_hdr_workaround "
-		"hashed_headers alt_char"
+		"hashed_headers alt_char mailbox_workers"
 	},
 	{ .name = "mailbox_state",
 	  .chr = 'S',
@@ -143,12 +146,15 @@ static_assert_array_size(items, ITEM_END_OF_LIST+1);
 
 struct dsync_ibc_stream {
 	struct dsync_ibc ibc;
+	/* ibc whose stream this channel is multiplexed in, or NULL */
+	struct dsync_ibc_stream *parent;
 
 	char *name, *temp_path_prefix;
 	unsigned int timeout_secs;
 	struct istream *input;
 	struct ostream *output;
 	struct io *io;
+	/* shared by all the channels, so it's only in the parent */
 	struct timeout *to;
 
 	unsigned int minor_version;
@@ -173,6 +179,7 @@ struct dsync_ibc_stream {
 	bool finish_received:1;
 	bool done_received:1;
 	bool stopped:1;
+	bool multiplexed:1;
 };
 
 static const char *dsync_ibc_stream_get_state(struct dsync_ibc_stream *ibc)
@@ -189,6 +196,14 @@ static const char *dsync_ibc_stream_get_state(struct dsync_ibc_stream *ibc)
 			       ibc->last_recv_item_eol ? " (EOL)" : "");
 }
 
+static void dsync_ibc_stream_timeout_reset(struct dsync_ibc_stream *ibc)
+{
+	/* activity in any of the channels means the connection is alive */
+	if (ibc->parent != NULL)
+		ibc = ibc->parent;
+	timeout_reset(ibc->to);
+}
+
 static void dsync_ibc_stream_stop(struct dsync_ibc_stream *ibc)
 {
 	ibc->stopped = TRUE;
@@ -197,6 +212,37 @@ static void dsync_ibc_stream_stop(struct dsync_ibc_stream *ibc)
 	io_loop_stop(current_ioloop);
 }
 
+static void dsync_ibc_stream_read_failed(struct dsync_ibc_stream *ibc)
+{
+	string_t *error;
+
+	if (ibc->stopped)
+		return;
+	error = t_str_new(128);
+	if (ibc->input->stream_errno != 0) {
+		str_printfa(error, "read(%s) failed: %s", ibc->name,
+			    i_stream_get_error(ibc->input));
+	} else {
+		i_assert(ibc->input->eof);
+		str_printfa(error, "read(%s) failed: EOF", ibc->name);
+	}
+	str_printfa(error, " (%s)", dsync_ibc_stream_get_state(ibc));
+	i_error("%s", str_c(error));
+	dsync_ibc_stream_stop(ibc);
+}
+
+static int dsync_ibc_stream_read_channels(struct dsync_ibc_stream *ibc)
+{
+	/* The connection is read only through the channel 0 stream. Read it
+	   even if this ibc's brain isn't expecting anything, so the data gets
+	   dispatched to the other channels, which then get their io called. */
+	if (i_stream_read(ibc->input) != -1 ||
+	    i_stream_get_data_size(ibc->input) > 0)
+		return 0;
+	dsync_ibc_stream_read_failed(ibc);
+	return -1;
+}
+
 static int dsync_ibc_stream_read_mail_stream(struct dsync_ibc_stream *ibc)
 {
 	do {
@@ -224,7 +270,9 @@ static int dsync_ibc_stream_read_mail_stream(struct dsync_ibc_stream *ibc)
 
 static void dsync_ibc_stream_input(struct dsync_ibc_stream *ibc)
 {
-	timeout_reset(ibc->to);
+	dsync_ibc_stream_timeout_reset(ibc);
+	if (ibc->multiplexed && dsync_ibc_stream_read_channels(ibc) < 0)
+		return;
 	if (ibc->value_input != NULL) {
 		if (dsync_ibc_stream_read_mail_stream(ibc) == 0)
 			return;
@@ -305,7 +353,7 @@ static int dsync_ibc_stream_output(struct dsync_ibc_stream *ibc)
 		if (dsync_ibc_stream_send_value_stream(ibc) < 0)
 			ret = 1;
 	}
-	timeout_reset(ibc->to);
+	dsync_ibc_stream_timeout_reset(ibc);
 
 	if (!dsync_ibc_is_send_queue_full(&ibc->ibc))
 		ibc->ibc.io_callback(ibc->ibc.io_context);
@@ -328,8 +376,10 @@ static void dsync_ibc_stream_init(struct dsync_ibc_stream *ibc)
 	io_set_pending(ibc->io);
 	o_stream_set_no_error_handling(ibc->output, TRUE);
 	o_stream_set_flush_callback(ibc->output, dsync_ibc_stream_output, ibc);
-	ibc->to = timeout_add(ibc->timeout_secs * 1000,
-			      dsync_ibc_stream_timeout, ibc);
+	if (ibc->parent == NULL) {
+		ibc->to = timeout_add(ibc->timeout_secs * 1000,
+				      dsync_ibc_stream_timeout, ibc);
+	}
 	o_stream_cork(ibc->output);
 	o_stream_nsend_str(ibc->output, DSYNC_HANDSHAKE_VERSION);
 
@@ -402,7 +452,6 @@ static void dsync_ibc_stream_deinit(struct dsync_ibc *_ibc)
 static int dsync_ibc_stream_next_line(struct dsync_ibc_stream *ibc,
 				      const char **line_r)
 {
-	string_t *error;
 	const char *line;
 	ssize_t ret;
 
@@ -413,19 +462,7 @@ static int dsync_ibc_stream_next_line(struct dsync_ibc_stream *ibc,
 	}
 	/* try reading some */
 	if ((ret = i_stream_read(ibc->input)) == -1) {
-		if (ibc->stopped)
-			return -1;
-		error = t_str_new(128);
-		if (ibc->input->stream_errno != 0) {
-			str_printfa(error, "read(%s) failed: %s", ibc->name,
-				    i_stream_get_error(ibc->input));
-		} else {
-			i_assert(ibc->input->eof);
-			str_printfa(error, "read(%s) failed: EOF", ibc->name);
-		}
-		str_printfa(error, " (%s)", dsync_ibc_stream_get_state(ibc));
-		i_error("%s", str_c(error));
-		dsync_ibc_stream_stop(ibc);
+		dsync_ibc_stream_read_failed(ibc);
 		return -1;
 	}
 	i_assert(ret >= 0);
@@ -591,7 +628,7 @@ dsync_ibc_stream_input_next(struct dsync_ibc_stream *ibc, enum item_type item,
 
 	i_assert(ibc->value_input == NULL);
 
-	timeout_reset(ibc->to);
+	dsync_ibc_stream_timeout_reset(ibc);
 
 	do {
 		if (dsync_ibc_stream_next_line(ibc, &line) <= 0)
@@ -757,6 +794,10 @@ dsync_ibc_stream_send_handshake(struct dsync_ibc *_ibc,
 		}
 	}
 	dsync_serializer_encode_add(encoder, "hashed_headers", str_c(str2));
+	if (set->mailbox_workers > 0) {
+		dsync_serializer_encode_add(encoder, "mailbox_workers",
+			t_strdup_printf("%u", set->mailbox_workers));
+	}
 	dsync_serializer_encode_finish(&encoder, str);
 	dsync_ibc_stream_send_string(ibc, str);
 }
@@ -884,8 +925,18 @@ dsync_ibc_stream_recv_handshake(struct dsync_ibc *_ibc,
 		set->brain_flags |= DSYNC_BRAIN_FLAG_EMPTY_HDR_WORKAROUND;
 	if (dsync_deserializer_decode_try(decoder, "hashed_headers", &value))
 		set->hashed_headers = (const char*const*)p_strsplit_tabescaped(pool, value);
+	if (dsync_deserializer_decode_try(decoder, "mailbox_workers", &value)) {
+		if (str_to_uint(value, &set->mailbox_workers) < 0 ||
+		    set->mailbox_workers > DSYNC_BRAIN_MAX_MAILBOX_WORKERS) {
+			dsync_ibc_input_error(ibc, decoder,
+				"Invalid mailbox_workers: %s", value);
+			return DSYNC_IBC_RECV_RET_TRYAGAIN;
+		}
+	}
 	set->hdr_hash_v2 = ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V2;
 	set->hdr_hash_v3 = ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V3;
+	set->have_mailbox_workers =
+		ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_MAILBOX_WORKERS;
 
 	*set_r = set;
 	return DSYNC_IBC_RECV_RET_OK;
@@ -2080,8 +2131,12 @@ static bool dsync_ibc_stream_has_pending_data(struct dsync_ibc *_ibc)
 	return ibc->has_pending_data;
 }
 
+static struct dsync_ibc *
+dsync_ibc_stream_open_channel(struct dsync_ibc *_ibc, unsigned int channel_id);
+
 static const struct dsync_ibc_vfuncs dsync_ibc_stream_vfuncs = {
 	dsync_ibc_stream_deinit,
+	dsync_ibc_stream_open_channel,
 	dsync_ibc_stream_send_handshake,
 	dsync_ibc_stream_recv_handshake,
 	dsync_ibc_stream_send_end_of_list,
@@ -2108,15 +2163,17 @@ static const struct dsync_ibc_vfuncs dsync_ibc_stream_vfuncs = {
 	dsync_ibc_stream_has_pending_data
 };
 
-struct dsync_ibc *
-dsync_ibc_init_stream(struct istream *input, struct ostream *output,
-		      const char *name, const char *temp_path_prefix,
-		      unsigned int timeout_secs)
+static struct dsync_ibc_stream *
+dsync_ibc_stream_alloc(struct istream *input, struct ostream *output,
+		       const char *name, const char *temp_path_prefix,
+		       unsigned int timeout_secs,
+		       struct dsync_ibc_stream *parent)
 {
 	struct dsync_ibc_stream *ibc;
 
 	ibc = i_new(struct dsync_ibc_stream, 1);
 	ibc->ibc.v = dsync_ibc_stream_vfuncs;
+	ibc->parent = parent;
 	ibc->input = input;
 	ibc->output = output;
 	i_stream_ref(ibc->input);
@@ -2126,5 +2183,70 @@ dsync_ibc_init_stream(struct istream *input, struct ostream *output,
 	ibc->timeout_secs = timeout_secs;
 	ibc->ret_pool = pool_alloconly_create("ibc stream data", 2048);
 	dsync_ibc_stream_init(ibc);
+	return ibc;
+}
+
+static void dsync_ibc_stream_multiplex(struct dsync_ibc_stream *ibc)
+{
+	struct istream *input = ibc->input;
+	struct ostream *output = ibc->output;
+	bool corked = o_stream_is_corked(output);
+
+	/* Everything after the handshake is multiplexed. The stream buffers
+	   are unlimited just like the parent streams', so a channel whose
+	   brain isn't reading can't block the other channels. */
+	io_remove(&ibc->io);
+	if (corked)
+		o_stream_uncork(output);
+	ibc->input = i_stream_create_multiplex(input, SIZE_MAX);
+	ibc->output = o_stream_create_multiplex(output, SIZE_MAX,
+		OSTREAM_MULTIPLEX_FORMAT_STREAM);
+	i_stream_unref(&input);
+	o_stream_unref(&output);
+
+	o_stream_set_no_error_handling(ibc->output, TRUE);
+	o_stream_set_flush_callback(ibc->output, dsync_ibc_stream_output, ibc);
+	if (corked)
+		o_stream_cork(ibc->output);
+	ibc->io = io_add_istream(ibc->input, dsync_ibc_stream_input, ibc);
+	ibc->multiplexed = TRUE;
+}
+
+static struct dsync_ibc *
+dsync_ibc_stream_open_channel(struct dsync_ibc *_ibc, unsigned int channel_id)
+{
+	struct dsync_ibc_stream *ibc = (struct dsync_ibc_stream *)_ibc;
+	struct dsync_ibc_stream *channel;
+	struct istream *input;
+	struct ostream *output;
+
+	i_assert(ibc->parent == NULL);
+	i_assert(ibc->handshake_received);
+	i_assert(channel_id > 0 && channel_id <= UINT8_MAX);
+
+	if (!ibc->multiplexed)
+		dsync_ibc_stream_multiplex(ibc);
+
+	input = i_stream_multiplex_add_channel(ibc->input, channel_id);
+	output = o_stream_multiplex_add_channel(ibc->output, channel_id);
+	/* finishing the channel must not finish the whole connection */
+	o_stream_set_finish_also_parent(output, FALSE);
+	channel = dsync_ibc_stream_alloc(input, output,
+		t_strdup_printf("%s/%u", ibc->name, channel_id),
+		ibc->temp_path_prefix, ibc->timeout_secs, ibc);
+	i_stream_unref(&input);
+	o_stream_unref(&output);
+	return &channel->ibc;
+}
+
+struct dsync_ibc *
+dsync_ibc_init_stream(struct istream *input, struct ostream *output,
+		      const char *name, const char *temp_path_prefix,
+		      unsigned int timeout_secs)
+{
+	struct dsync_ibc_stream *ibc;
+
+	ibc = dsync_ibc_stream_alloc(input, output, name, temp_path_prefix,
+				     timeout_secs, NULL);
 	return &ibc->ibc;
 }
@@ -12,6 +12,12 @@ void dsync_ibc_deinit(struct dsync_ibc **_ibc)
 	ibc->v.deinit(ibc);
 }
 
+struct dsync_ibc *
+dsync_ibc_open_channel(struct dsync_ibc *ibc, unsigned int channel_id)
+{
+	return ibc->v.open_channel(ibc, channel_id);
+}
+
 void dsync_ibc_set_io_callback(struct dsync_ibc *ibc,
 			       io_callback_t *callback, void *context)
 {
@@ -72,7 +72,12 @@ struct dsync_ibc_settings {
 	enum dsync_brain_flags brain_flags;
 	bool hdr_hash_v2;
 	bool hdr_hash_v3;
+	/* Remote can sync mailboxes concurrently over additional channels */
+	bool have_mailbox_workers;
 	unsigned int lock_timeout;
+	/* Number of mailbox workers the master wants to use. Each of them
+	   gets its own channel, see dsync_ibc_open_channel(). */
+	unsigned int mailbox_workers;
 };
 
 void dsync_ibc_init_pipe(struct dsync_ibc **ibc1_r,
@@ -83,6 +88,12 @@ dsync_ibc_init_stream(struct istream *input, struct ostream *output,
 		      unsigned int timeout_secs);
 void dsync_ibc_deinit(struct dsync_ibc **ibc);
 
+/* Open an additional channel to the remote. Both sides must open the same
+   channels right after the handshakes have been exchanged, before anything
+   else is sent. The channels must be deinitialized before the ibc. */
+struct dsync_ibc *
+dsync_ibc_open_channel(struct dsync_ibc *ibc, unsigned int channel_id);
+
 /* I/O callback is called whenever new data is available. It's also called on
    errors, so check first the error status. */
 void dsync_ibc_set_io_callback(struct dsync_ibc *ibc,
@@ -0,0 +1,48 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "time-util.h"
+#include "dsync-mailbox-stats.h"
+
+uintmax_t dsync_mailbox_stats_add(struct dsync_mailbox_stats *stats,
+				  struct event *box_event, const char *vname)
+{
+	struct timeval tv_created, tv_now;
+	long long diff;
+	uintmax_t duration;
+
+	/* box_event itself is never sent, so its last duration isn't
+	   available. Use the same creation timestamp that the sent
+	   passthrough event inherits. */
+	event_get_create_time(box_event, &tv_created);
+	i_gettimeofday(&tv_now);
+	diff = timeval_diff_usecs(&tv_now, &tv_created);
+	duration = diff < 0 ? 0 : (uintmax_t)diff;
+
+	stats->count++;
+	stats->total_usecs += duration;
+	if (stats->slowest_vname == NULL || duration > stats->slowest_usecs) {
+		stats->slowest_usecs = duration;
+		i_free(stats->slowest_vname);
+		stats->slowest_vname = i_strdup(vname);
+	}
+	return duration;
+}
+
+const char *
+dsync_mailbox_stats_get_summary(const struct dsync_mailbox_stats *stats)
+{
+	if (stats->count == 0)
+		return NULL;
+	i_assert(stats->slowest_vname != NULL);
+	return t_strdup_printf("Synced %u mailboxes in %ju ms, "
+			       "slowest was %s (%ju ms)", stats->count,
+			       stats->total_usecs / 1000, stats->slowest_vname,
+			       stats->slowest_usecs / 1000);
+}
+
+void dsync_mailbox_stats_free(struct dsync_mailbox_stats *stats)
+{
+	i_free(stats->slowest_vname);
+	i_zero(stats);
+}
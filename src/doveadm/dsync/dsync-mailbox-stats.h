@@ -0,0 +1,19 @@
+#ifndef DSYNC_MAILBOX_STATS_H
+#define DSYNC_MAILBOX_STATS_H
+
+/* Number of mailboxes synced so far and the slowest one of them */
+struct dsync_mailbox_stats {
+	unsigned int count;
+	uintmax_t total_usecs, slowest_usecs;
+	char *slowest_vname;
+};
+
+/* Account a finished mailbox sync. The duration is measured from the
+   creation of box_event until now. Returns the duration in usecs. */
+uintmax_t dsync_mailbox_stats_add(struct dsync_mailbox_stats *stats,
+				  struct event *box_event, const char *vname);
+/* Returns a human readable summary, or NULL if no mailboxes were synced. */
+const char *dsync_mailbox_stats_get_summary(const struct dsync_mailbox_stats *stats);
+void dsync_mailbox_stats_free(struct dsync_mailbox_stats *stats);
+
+#endif
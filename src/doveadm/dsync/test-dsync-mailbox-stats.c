@@ -0,0 +1,91 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "dsync-mailbox-stats.h"
+#include "test-common.h"
+
+#include <unistd.h>
+
+static void test_dsync_mailbox_stats_empty(void)
+{
+	struct dsync_mailbox_stats stats;
+
+	test_begin("dsync mailbox stats empty");
+	i_zero(&stats);
+	test_assert(dsync_mailbox_stats_get_summary(&stats) == NULL);
+	dsync_mailbox_stats_free(&stats);
+	test_end();
+}
+
+static void test_dsync_mailbox_stats_duration(void)
+{
+	struct dsync_mailbox_stats stats;
+	struct event *event;
+	uintmax_t duration;
+
+	test_begin("dsync mailbox stats duration");
+	i_zero(&stats);
+	/* the box event is never sent, but the duration must still be
+	   measured from its creation */
+	event = event_create(NULL);
+	usleep(20000);
+	duration = dsync_mailbox_stats_add(&stats, event, "INBOX");
+	test_assert(duration >= 20000);
+	test_assert(stats.count == 1);
+	test_assert(stats.total_usecs == duration);
+	test_assert(stats.slowest_usecs == duration);
+	test_assert_strcmp(stats.slowest_vname, "INBOX");
+	event_unref(&event);
+	dsync_mailbox_stats_free(&stats);
+	test_end();
+}
+
+static void test_dsync_mailbox_stats_slowest(void)
+{
+	struct dsync_mailbox_stats stats;
+	struct event *event;
+	uintmax_t duration, total;
+
+	test_begin("dsync mailbox stats slowest");
+	i_zero(&stats);
+
+	/* even an immediately finished first mailbox sets the slowest name */
+	event = event_create(NULL);
+	total = dsync_mailbox_stats_add(&stats, event, "fast");
+	event_unref(&event);
+	test_assert_strcmp(stats.slowest_vname, "fast");
+	test_assert(dsync_mailbox_stats_get_summary(&stats) != NULL);
+
+	event = event_create(NULL);
+	usleep(20000);
+	duration = dsync_mailbox_stats_add(&stats, event, "slow");
+	total += duration;
+	event_unref(&event);
+
+	event = event_create(NULL);
+	total += dsync_mailbox_stats_add(&stats, event, "fast2");
+	event_unref(&event);
+
+	test_assert(stats.count == 3);
+	test_assert(stats.total_usecs == total);
+	test_assert(stats.slowest_usecs == duration);
+	test_assert_strcmp(stats.slowest_vname, "slow");
+	test_assert_strcmp(dsync_mailbox_stats_get_summary(&stats),
+		t_strdup_printf("Synced 3 mailboxes in %ju ms, "
+				"slowest was slow (%ju ms)",
+				total / 1000, duration / 1000));
+	dsync_mailbox_stats_free(&stats);
+	test_assert(stats.slowest_vname == NULL && stats.count == 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_dsync_mailbox_stats_empty,
+		test_dsync_mailbox_stats_duration,
+		test_dsync_mailbox_stats_slowest,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -1026,6 +1026,14 @@ void client_command_free(struct client_command_context **_cmd)
 	event_add_int(cmd->event, "lock_wait_usecs", cmd->stats.lock_wait_usecs);
 	event_add_int(cmd->event, "net_in_bytes", cmd->stats.bytes_in);
 	event_add_int(cmd->event, "net_out_bytes", cmd->stats.bytes_out);
+	event_add_int(cmd->event, "cpu_user_usecs", cmd->stats.cpu_user_usecs);
+	event_add_int(cmd->event, "cpu_sys_usecs", cmd->stats.cpu_sys_usecs);
+	event_add_int(cmd->event, "disk_read_bytes", cmd->stats.disk_read_bytes);
+	event_add_int(cmd->event, "disk_write_bytes",
+		      cmd->stats.disk_write_bytes);
+	event_add_int(cmd->event, "mail_cache_hits", cmd->stats.cache_hits);
+	event_add_int(cmd->event, "mail_cache_misses", cmd->stats.cache_misses);
+	event_add_int(cmd->event, "mails_opened", cmd->stats.mails_opened);
 
 	if (cmd->name != NULL) {
 		string_t *str = t_str_new(128);
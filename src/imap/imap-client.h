@@ -4,6 +4,8 @@
 #include "imap-commands.h"
 #include "message-size.h"
 
+#include <sys/resource.h>
+
 #define CLIENT_COMMAND_QUEUE_MAX_SIZE 4
 /* Maximum number of CONTEXT=SEARCH UPDATEs. Clients probably won't need more
    than a few, so this is mainly to avoid more or less accidental pointless
@@ -72,12 +74,25 @@ struct client_command_stats {
 	uint64_t lock_wait_usecs;
 	/* how many bytes of client input/output command has used */
 	uint64_t bytes_in, bytes_out;
+	/* how much user/system CPU time this command has used */
+	uint64_t cpu_user_usecs, cpu_sys_usecs;
+	/* how many bytes this command has read/written from/to disk, i.e.
+	   excluding what was found from the page cache */
+	uint64_t disk_read_bytes, disk_write_bytes;
+	/* how many times the command has found / not found the wanted fields
+	   from the index cache */
+	uint64_t cache_hits, cache_misses;
+	/* how many times the command has opened a mail's stream */
+	uint64_t mails_opened;
 };
 
 struct client_command_stats_start {
 	struct timeval timeval;
 	uint64_t lock_wait_usecs;
 	uint64_t bytes_in, bytes_out;
+	struct rusage rusage;
+	uint64_t cache_hits, cache_misses;
+	uint64_t mails_opened;
 };
 
 struct client_command_context {
@@ -7,6 +7,8 @@
 #include "istream.h"
 #include "ostream.h"
 #include "time-util.h"
+#include "sampling-profiler.h"
+#include "mail-cache.h"
 #include "imap-commands.h"
 
 
@@ -158,33 +160,71 @@ void command_hook_unregister(command_hook_callback_t *pre,
 	i_panic("command_hook_unregister(): hook not registered");
 }
 
+static void
+command_stats_get(struct client_command_context *cmd,
+		  struct client_command_stats_start *stats_r)
+{
+	stats_r->timeval = ioloop_timeval;
+	stats_r->lock_wait_usecs = file_lock_wait_get_total_usecs();
+	stats_r->bytes_in = i_stream_get_absolute_offset(cmd->client->input);
+	stats_r->bytes_out = cmd->client->output->offset;
+	if (getrusage(RUSAGE_SELF, &stats_r->rusage) < 0)
+		i_zero(&stats_r->rusage);
+	mail_cache_get_lookup_counters(&stats_r->cache_hits,
+				       &stats_r->cache_misses);
+	stats_r->mails_opened = mail_get_opened_count();
+}
+
 void command_stats_start(struct client_command_context *cmd)
 {
-	cmd->stats_start.timeval = ioloop_timeval;
-	cmd->stats_start.lock_wait_usecs = file_lock_wait_get_total_usecs();
-	cmd->stats_start.bytes_in = i_stream_get_absolute_offset(cmd->client->input);
-	cmd->stats_start.bytes_out = cmd->client->output->offset;
+	command_stats_get(cmd, &cmd->stats_start);
 }
 
 void command_stats_flush(struct client_command_context *cmd)
 {
+	const struct client_command_stats_start *start = &cmd->stats_start;
+	struct client_command_stats_start now;
+
 	io_loop_time_refresh();
+	command_stats_get(cmd, &now);
+
 	cmd->stats.running_usecs +=
-		timeval_diff_usecs(&ioloop_timeval, &cmd->stats_start.timeval);
+		timeval_diff_usecs(&now.timeval, &start->timeval);
 	cmd->stats.lock_wait_usecs +=
-		file_lock_wait_get_total_usecs() -
-		cmd->stats_start.lock_wait_usecs;
-	cmd->stats.bytes_in += i_stream_get_absolute_offset(cmd->client->input) -
-		cmd->stats_start.bytes_in;
+		now.lock_wait_usecs - start->lock_wait_usecs;
+	cmd->stats.bytes_in += now.bytes_in - start->bytes_in;
 	cmd->stats.bytes_out += cmd->client->prev_output_size +
-		cmd->client->output->offset - cmd->stats_start.bytes_out;
+		now.bytes_out - start->bytes_out;
+	if (timeval_cmp(&now.rusage.ru_utime, &start->rusage.ru_utime) > 0) {
+		cmd->stats.cpu_user_usecs +=
+			timeval_diff_usecs(&now.rusage.ru_utime,
+					   &start->rusage.ru_utime);
+	}
+	if (timeval_cmp(&now.rusage.ru_stime, &start->rusage.ru_stime) > 0) {
+		cmd->stats.cpu_sys_usecs +=
+			timeval_diff_usecs(&now.rusage.ru_stime,
+					   &start->rusage.ru_stime);
+	}
+	/* ru_inblock and ru_oublock are in 512 byte units */
+	if (now.rusage.ru_inblock > start->rusage.ru_inblock) {
+		cmd->stats.disk_read_bytes += 512ULL *
+			(now.rusage.ru_inblock - start->rusage.ru_inblock);
+	}
+	if (now.rusage.ru_oublock > start->rusage.ru_oublock) {
+		cmd->stats.disk_write_bytes += 512ULL *
+			(now.rusage.ru_oublock - start->rusage.ru_oublock);
+	}
+	cmd->stats.cache_hits += now.cache_hits - start->cache_hits;
+	cmd->stats.cache_misses += now.cache_misses - start->cache_misses;
+	cmd->stats.mails_opened += now.mails_opened - start->mails_opened;
 	/* allow flushing multiple times */
-	command_stats_start(cmd);
+	cmd->stats_start = now;
 }
 
 bool command_exec(struct client_command_context *cmd)
 {
 	const struct command_hook *hook;
+	const char *old_profile_label;
 	bool finished;
 
 	i_assert(!cmd->executing);
@@ -193,6 +233,7 @@ bool command_exec(struct client_command_context *cmd)
 	command_stats_start(cmd);
 
 	event_push_global(cmd->global_event);
+	old_profile_label = sampling_profiler_set_label(cmd->name);
 	cmd->executing = TRUE;
 	array_foreach(&command_hooks, hook)
 		hook->pre(cmd);
@@ -200,6 +241,7 @@ bool command_exec(struct client_command_context *cmd)
 	array_foreach(&command_hooks, hook)
 		hook->post(cmd);
 	cmd->executing = FALSE;
+	(void)sampling_profiler_set_label(old_profile_label);
 	event_pop_global(cmd->global_event);
 	if (cmd->state == CLIENT_COMMAND_STATE_DONE)
 		finished = TRUE;
@@ -144,6 +144,16 @@ void auth_master_deinit(struct auth_master_connection **_conn)
 	i_free(conn);
 }
 
+void auth_master_forked(struct auth_master_connection *conn)
+{
+	connection_forked(&conn->conn);
+	timeout_remove(&conn->to);
+	conn->connected = FALSE;
+	conn->sent_handshake = FALSE;
+	/* the request IDs only need to be unique within a connection */
+	conn->request_counter = 0;
+}
+
 void auth_master_set_timeout(struct auth_master_connection *conn,
 			     unsigned int msecs)
 {
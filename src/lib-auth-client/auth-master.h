@@ -34,6 +34,10 @@ struct auth_user_reply {
 struct auth_master_connection *
 auth_master_init(const char *auth_socket_path, enum auth_master_flags flags);
 void auth_master_deinit(struct auth_master_connection **conn);
+/* Must be called by a fork()ed child process that keeps using the
+   connection. The socket is shared with the parent process, so it's closed
+   and a new connection is created for the next lookup. */
+void auth_master_forked(struct auth_master_connection *conn);
 
 /* Set timeout for lookups. */
 void auth_master_set_timeout(struct auth_master_connection *conn,
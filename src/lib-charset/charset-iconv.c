@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "buffer.h"
+#include "sampling-profiler.h"
 #include "charset-utf8-private.h"
 
 #ifdef HAVE_ICONV
@@ -26,7 +27,10 @@ iconv_charset_to_utf8_begin(const char *charset, normalizer_func_t *normalizer,
 	else {
 		if (strcmp(charset, "UTF-8//TEST") == 0)
 			charset = "UTF-8";
+		/* the conversion module may get dlopen()ed */
+		sampling_profiler_block();
 		cd = iconv_open("UTF-8", charset);
+		sampling_profiler_unblock();
 		if (cd == (iconv_t)-1)
 			return -1;
 	}
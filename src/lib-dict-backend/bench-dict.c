@@ -0,0 +1,194 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "ostream.h"
+#include "randgen.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "dict-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef BUILD_CDB
+#  include <cdb.h>
+#endif
+
+/**
+ * Writes the same key count entries into dict-file, dict-mmap and (if built
+ * with CDB support) dict-cdb and measures how long it takes to open each
+ * dict and do the first lookup, a number of random lookups and a prefix
+ * iteration.
+ */
+
+#define BENCH_DICT_PATH ".bench-dict"
+
+static const char *bench_key(unsigned int i)
+{
+	return t_strdup_printf("shared/bench/key%u", i);
+}
+
+static const char *bench_value(unsigned int i)
+{
+	return t_strdup_printf("value%u", i);
+}
+
+static void bench_dict_create_file(const char *path, unsigned int count)
+{
+	struct ostream *os = o_stream_create_file(path, 0, 0600, 0);
+
+	for (unsigned int i = 0; i < count; i++) T_BEGIN {
+		o_stream_nsend_str(os, t_strdup_printf("%s\n%s\n",
+			bench_key(i), bench_value(i)));
+	} T_END;
+	if (o_stream_finish(os) <= 0)
+		i_fatal("write(%s) failed: %s", path, o_stream_get_error(os));
+	o_stream_unref(&os);
+}
+
+static void bench_dict_create_mmap(const char *path, unsigned int count)
+{
+	struct dict_legacy_settings set = { .base_dir = "." };
+	struct dict_op_settings op_set = { .username = "" };
+	struct dict_transaction_context *trans;
+	struct dict *dict;
+	const char *error;
+
+	/* compact the log into the base file at commit */
+	if (dict_init_legacy(t_strdup_printf("mmap:%s:log_max_size=0", path),
+			     &set, &dict, &error) < 0)
+		i_fatal("dict_init(mmap) failed: %s", error);
+	trans = dict_transaction_begin(dict, &op_set);
+	for (unsigned int i = 0; i < count; i++) T_BEGIN {
+		dict_set(trans, bench_key(i), bench_value(i));
+	} T_END;
+	if (dict_transaction_commit(&trans, &error) < 0)
+		i_fatal("dict_transaction_commit(mmap) failed: %s", error);
+	dict_deinit(&dict);
+}
+
+#ifdef BUILD_CDB
+static void bench_dict_create_cdb(const char *path, unsigned int count)
+{
+	struct cdb_make cdbm;
+	int fd;
+
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	if (cdb_make_start(&cdbm, fd) < 0)
+		i_fatal("cdb_make_start(%s) failed: %m", path);
+	for (unsigned int i = 0; i < count; i++) T_BEGIN {
+		const char *key = bench_key(i), *value = bench_value(i);
+
+		if (cdb_make_add(&cdbm, key, strlen(key),
+				 value, strlen(value)) < 0)
+			i_fatal("cdb_make_add(%s) failed: %m", path);
+	} T_END;
+	if (cdb_make_finish(&cdbm) < 0)
+		i_fatal("cdb_make_finish(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+#endif
+
+static void
+bench_dict_run(const char *driver, const char *path, unsigned int count,
+	       unsigned int lookups)
+{
+	struct dict_legacy_settings set = { .base_dir = "." };
+	struct dict_op_settings op_set = { .username = "" };
+	struct dict_iterate_context *iter;
+	struct dict *dict;
+	const char *key, *value, *error;
+	unsigned int i, found = 0, iterated = 0;
+	uint64_t ts_0, ts_1, ts_2, ts_3;
+	int ret;
+
+	ts_0 = i_nanoseconds();
+	if (dict_init_legacy(t_strdup_printf("%s:%s", driver, path), &set,
+			     &dict, &error) < 0)
+		i_fatal("dict_init(%s) failed: %s", driver, error);
+	if (dict_lookup(dict, &op_set, pool_datastack_create(),
+			bench_key(0), &value, &error) <= 0)
+		i_fatal("dict_lookup(%s) failed: %s", driver, error);
+	ts_1 = i_nanoseconds();
+
+	for (i = 0; i < lookups; i++) T_BEGIN {
+		ret = dict_lookup(dict, &op_set, pool_datastack_create(),
+				  bench_key(i_rand_limit(count)), &value, &error);
+		if (ret < 0)
+			i_fatal("dict_lookup(%s) failed: %s", driver, error);
+		found += ret;
+	} T_END;
+	ts_2 = i_nanoseconds();
+	i_assert(found == lookups);
+
+	/* keys key1, key10..key19, key100..key199, etc. */
+	iter = dict_iterate_init(dict, &op_set, "shared/bench/key1",
+				 DICT_ITERATE_FLAG_RECURSE);
+	while (dict_iterate(iter, &key, &value))
+		iterated++;
+	if (dict_iterate_deinit(&iter, &error) < 0)
+		i_fatal("dict_iterate(%s) failed: %s", driver, error);
+	ts_3 = i_nanoseconds();
+	dict_deinit(&dict);
+
+	printf("%s\n", driver);
+	printf("\tOpen + first lookup: %0.02lf ms\n",
+	       (double)(ts_1 - ts_0) / 1000000.0);
+	printf("\tLookup: %0.02lf us/lookup\n",
+	       (double)(ts_2 - ts_1) / lookups / 1000.0);
+	printf("\tPrefix iteration: %0.02lf ms (%u keys)\n\n",
+	       (double)(ts_3 - ts_2) / 1000000.0, iterated);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s key_count lookup_count\n", prog);
+	fprintf(stderr, "Runs with 100000 keys and 100000 lookups if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count = 100000, lookups = 100000;
+
+	lib_init();
+	if (argc == 3) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0 ||
+		    str_to_uint(argv[2], &lookups) < 0 || lookups == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+	}
+
+	dict_driver_register(&dict_driver_file);
+	dict_driver_register(&dict_driver_mmap);
+	printf("Input data is %u keys, %u random lookups\n\n", count, lookups);
+
+	bench_dict_create_file(BENCH_DICT_PATH".file", count);
+	bench_dict_run("file", BENCH_DICT_PATH".file", count, lookups);
+	i_unlink(BENCH_DICT_PATH".file");
+
+	bench_dict_create_mmap(BENCH_DICT_PATH".mmap", count);
+	bench_dict_run("mmap", BENCH_DICT_PATH".mmap", count, lookups);
+	i_unlink(BENCH_DICT_PATH".mmap");
+	i_unlink(BENCH_DICT_PATH".mmap.log");
+
+#ifdef BUILD_CDB
+	dict_driver_register(&dict_driver_cdb);
+	bench_dict_create_cdb(BENCH_DICT_PATH".cdb", count);
+	bench_dict_run("cdb", BENCH_DICT_PATH".cdb", count, lookups);
+	i_unlink(BENCH_DICT_PATH".cdb");
+	dict_driver_unregister(&dict_driver_cdb);
+#endif
+
+	dict_driver_unregister(&dict_driver_mmap);
+	dict_driver_unregister(&dict_driver_file);
+	lib_deinit();
+	return 0;
+}
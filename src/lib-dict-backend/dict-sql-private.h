@@ -7,6 +7,13 @@ struct sql_dict {
 	pool_t pool;
 	struct sql_db *db;
 	const struct dict_sql_settings *set;
+	/* Prefix for the prepared statement cache keys. The sql_db may be
+	   shared with other dicts using different maps, so the keys must be
+	   unique for each config. */
+	const char *stmt_key_prefix;
+
+	/* asynchronous commits waiting to be sent as a single batch */
+	struct sql_dict_batch *batch;
 };
 
 #endif
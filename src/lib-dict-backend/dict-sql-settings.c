@@ -220,6 +220,16 @@ parse_setting(const char *key, const char *value,
 			ctx->set->connect = p_strdup(ctx->pool, value);
 			return NULL;
 		}
+		if (strcmp(key, "batch_max_transactions") == 0) {
+			if (str_to_uint(value, &ctx->set->batch_max_transactions) < 0)
+				return t_strconcat("Invalid number: ", value, NULL);
+			return NULL;
+		}
+		if (strcmp(key, "batch_delay_msecs") == 0) {
+			if (str_to_uint(value, &ctx->set->batch_delay_msecs) < 0)
+				return t_strconcat("Invalid number: ", value, NULL);
+			return NULL;
+		}
 		break;
 	case SECTION_MAP:
 		return parse_setting_from_defs(ctx->pool,
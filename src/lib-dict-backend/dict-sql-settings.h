@@ -38,6 +38,12 @@ struct dict_sql_map {
 
 struct dict_sql_settings {
 	const char *connect;
+	/* If non-zero, asynchronously committed transactions are collected
+	   into a single SQL transaction, which is committed after
+	   batch_delay_msecs or when batch_max_transactions have been
+	   collected. */
+	unsigned int batch_max_transactions;
+	unsigned int batch_delay_msecs;
 
 	unsigned int max_pattern_fields_count;
 	ARRAY(struct dict_sql_map) maps;
@@ -71,10 +71,19 @@ struct sql_dict_prev {
 	} value;
 };
 
+struct sql_dict_pending_stmt {
+	struct sql_statement *stmt;
+	bool get_rows;
+};
+
 struct sql_dict_transaction_context {
 	struct dict_transaction_context ctx;
 
+	/* NULL when batching is enabled and the transaction hasn't been
+	   committed yet. The built statements are then kept in pending_stmts
+	   until the commit decides which SQL transaction they're added to. */
 	struct sql_transaction_context *sql_ctx;
+	ARRAY(struct sql_dict_pending_stmt) pending_stmts;
 
 	pool_t inc_row_pool;
 	struct sql_dict_inc_row *inc_row;
@@ -88,12 +97,29 @@ struct sql_dict_transaction_context {
 	char *error;
 };
 
+struct sql_dict_batch {
+	struct sql_dict *dict;
+	struct sql_transaction_context *sql_ctx;
+	/* transactions waiting for the batch to be committed */
+	ARRAY(struct sql_dict_transaction_context *) transactions;
+	struct timeout *to_commit;
+};
+
 static struct sql_db_cache *dict_sql_db_cache;
 
 static void sql_dict_prev_inc_flush(struct sql_dict_transaction_context *ctx);
 static void sql_dict_prev_set_flush(struct sql_dict_transaction_context *ctx);
 static void sql_dict_prev_inc_free(struct sql_dict_transaction_context *ctx);
 static void sql_dict_prev_set_free(struct sql_dict_transaction_context *ctx);
+static unsigned int *
+sql_dict_next_inc_row(struct sql_dict_transaction_context *ctx);
+static void
+sql_dict_transaction_add_pending(struct sql_dict_transaction_context *ctx,
+				 struct sql_transaction_context *sql_ctx);
+static void sql_dict_batch_add(struct sql_dict_transaction_context *ctx,
+			       dict_transaction_commit_callback_t *callback,
+			       void *context);
+static void sql_dict_batch_commit(struct sql_dict *dict);
 
 static int
 sql_dict_init_legacy(struct dict *driver, const char *uri,
@@ -113,6 +139,7 @@ sql_dict_init_legacy(struct dict *driver, const char *uri,
 		pool_unref(&pool);
 		return -1;
 	}
+	dict->stmt_key_prefix = p_strconcat(pool, uri, "\t", NULL);
 	i_zero(&sql_set);
 	sql_set.driver = driver->name;
 	sql_set.connect_string = dict->set->connect;
@@ -131,6 +158,8 @@ static void sql_dict_deinit(struct dict *_dict)
 {
 	struct sql_dict *dict = (struct sql_dict *)_dict;
 
+	if (dict->batch != NULL)
+		sql_dict_batch_commit(dict);
 	sql_unref(&dict->db);
 	pool_unref(&dict->pool);
 }
@@ -138,9 +167,22 @@ static void sql_dict_deinit(struct dict *_dict)
 static void sql_dict_wait(struct dict *_dict)
 {
 	struct sql_dict *dict = (struct sql_dict *)_dict;
+
+	if (dict->batch != NULL)
+		sql_dict_batch_commit(dict);
 	sql_wait(dict->db);
 }
 
+static bool sql_dict_switch_ioloop(struct dict *_dict)
+{
+	struct sql_dict *dict = (struct sql_dict *)_dict;
+
+	if (dict->batch == NULL)
+		return FALSE;
+	dict->batch->to_commit = io_loop_move_timeout(&dict->batch->to_commit);
+	return TRUE;
+}
+
 /* Try to match path to map->pattern. For example pattern="shared/x/$/$/y"
    and path="shared/x/1/2/y", this is match and pattern_values=[1, 2]. */
 static bool
@@ -268,13 +310,24 @@ sql_dict_statement_bind(struct sql_statement *stmt, unsigned int column_idx,
 	}
 }
 
+static void
+sql_dict_statement_bind_params(struct sql_statement *stmt,
+			       const ARRAY_TYPE(sql_dict_param) *params)
+{
+	const struct sql_dict_param *param;
+
+	array_foreach(params, param) {
+		sql_dict_statement_bind(stmt, array_foreach_idx(params, param),
+					param);
+	}
+}
+
 static struct sql_statement *
 sql_dict_statement_init(struct sql_dict *dict, const char *query,
 			const ARRAY_TYPE(sql_dict_param) *params)
 {
 	struct sql_statement *stmt;
 	struct sql_prepared_statement *prep_stmt;
-	const struct sql_dict_param *param;
 
 	if ((sql_get_flags(dict->db) & SQL_DB_FLAG_PREP_STATEMENTS) != 0) {
 		prep_stmt = sql_prepared_statement_init(dict->db, query);
@@ -285,14 +338,37 @@ sql_dict_statement_init(struct sql_dict *dict, const char *query,
 		   Just use regular statements to avoid wasting memory. */
 		stmt = sql_statement_init(dict->db, query);
 	}
+	sql_dict_statement_bind_params(stmt, params);
+	return stmt;
+}
 
-	array_foreach(params, param) {
-		sql_dict_statement_bind(stmt, array_foreach_idx(params, param),
-					param);
+/* Create a statement from a prepared statement that was found from (or
+   added to) the db's statement cache. The prep_stmt is unreferenced. */
+static struct sql_statement *
+sql_dict_statement_init_cached(struct sql_dict *dict,
+			       struct sql_prepared_statement **_prep_stmt,
+			       const ARRAY_TYPE(sql_dict_param) *params)
+{
+	struct sql_prepared_statement *prep_stmt = *_prep_stmt;
+	struct sql_statement *stmt;
+
+	if ((sql_get_flags(dict->db) & SQL_DB_FLAG_PREP_STATEMENTS) != 0)
+		stmt = sql_statement_init_prepared(prep_stmt);
+	else {
+		stmt = sql_statement_init(dict->db,
+			sql_prepared_statement_get_query(prep_stmt));
 	}
+	sql_prepared_statement_unref(_prep_stmt);
+	sql_dict_statement_bind_params(stmt, params);
 	return stmt;
 }
 
+static unsigned int
+sql_dict_map_idx(struct sql_dict *dict, const struct dict_sql_map *map)
+{
+	return array_ptr_to_idx(&dict->set->maps, map);
+}
+
 static int
 sql_dict_value_get(const struct dict_sql_map *map,
 		   enum dict_sql_type value_type, const char *field_name,
@@ -394,13 +470,17 @@ sql_dict_where_build(const char *username, const struct dict_sql_map *map,
 	/* if we came here from iteration code there may be fewer
 	   pattern_values */
 	i_assert(count2 <= count);
+	/* query is NULL when the caller already has a cached statement and
+	   only needs the params */
+	i_assert(query != NULL || recurse_type == SQL_DICT_RECURSE_NONE);
 
 	if (count2 == 0 && !add_username) {
 		/* we want everything */
 		return 0;
 	}
 
-	str_append(query, " WHERE");
+	if (query != NULL)
+		str_append(query, " WHERE");
 	exact_count = count == count2 && recurse_type != SQL_DICT_RECURSE_NONE ?
 		count2-1 : count2;
 	if (exact_count != array_count(values_arr)) {
@@ -409,9 +489,10 @@ sql_dict_where_build(const char *username, const struct dict_sql_map *map,
 	}
 
 	for (i = 0; i < exact_count; i++) {
-		if (i > 0)
-			str_append(query, " AND");
-		str_printfa(query, " %s = ?", pattern_fields[i].name);
+		if (query != NULL) {
+			str_printfa(query, "%s %s = ?", i > 0 ? " AND" : "",
+				    pattern_fields[i].name);
+		}
 		if (sql_dict_field_get_value(map, &pattern_fields[i],
 					     pattern_values[i], "",
 					     params, error_r) < 0)
@@ -456,9 +537,10 @@ sql_dict_where_build(const char *username, const struct dict_sql_map *map,
 	}
 	if (add_username) {
 		struct sql_dict_param *param = array_append_space(params);
-		if (count2 > 0)
-			str_append(query, " AND");
-		str_printfa(query, " %s = ?", map->username_field);
+		if (query != NULL) {
+			str_printfa(query, "%s %s = ?", count2 > 0 ? " AND" : "",
+				    map->username_field);
+		}
 		param->value_type = DICT_SQL_TYPE_STRING;
 		param->value_str = t_strdup(username);
 	}
@@ -474,8 +556,10 @@ sql_lookup_get_query(struct sql_dict *dict,
 		     const char **error_r)
 {
 	const struct dict_sql_map *map;
+	struct sql_prepared_statement *prep_stmt;
 	ARRAY_TYPE(const_string) pattern_values;
-	const char *error;
+	const char *cache_key, *error;
+	string_t *query = NULL;
 
 	map = *map_r = sql_dict_find_map(dict, key, &pattern_values);
 	if (map == NULL) {
@@ -484,23 +568,37 @@ sql_lookup_get_query(struct sql_dict *dict,
 		return -1;
 	}
 
-	string_t *query = t_str_new(256);
+	/* The query only depends on the map and whether it's a private or
+	   shared key. */
+	cache_key = t_strdup_printf("%slookup/%u/%c", dict->stmt_key_prefix,
+				    sql_dict_map_idx(dict, map), key[0]);
+	prep_stmt = sql_prepared_statement_lookup_key(dict->db, cache_key);
+	if (prep_stmt == NULL) {
+		query = t_str_new(256);
+		str_append(query, "SELECT ");
+		if (map->expire_field != NULL)
+			str_printfa(query, "%s,", map->expire_field);
+		str_printfa(query, "%s FROM %s%s", map->value_field,
+			    sql_db_table_prefix(dict->db), map->table);
+	}
+
 	ARRAY_TYPE(sql_dict_param) params;
 	t_array_init(&params, 4);
-	str_append(query, "SELECT ");
-	if (map->expire_field != NULL)
-		str_printfa(query, "%s,", map->expire_field);
-	str_printfa(query, "%s FROM %s%s",
-		    map->value_field, sql_db_table_prefix(dict->db), map->table);
 	if (sql_dict_where_build(set->username, map, &pattern_values,
 				 key[0] == DICT_PATH_PRIVATE[0],
 				 SQL_DICT_RECURSE_NONE, query,
 				 &params, &error) < 0) {
 		*error_r = t_strdup_printf(
 			"sql dict lookup: Failed to lookup key %s: %s", key, error);
+		if (prep_stmt != NULL)
+			sql_prepared_statement_unref(&prep_stmt);
 		return -1;
 	}
-	*stmt_r = sql_dict_statement_init(dict, str_c(query), &params);
+	if (prep_stmt == NULL) {
+		prep_stmt = sql_prepared_statement_init_key(dict->db, cache_key,
+							    str_c(query));
+	}
+	*stmt_r = sql_dict_statement_init_cached(dict, &prep_stmt, &params);
 	return 0;
 }
 
@@ -978,18 +1076,34 @@ sql_dict_transaction_init(struct dict *_dict)
 
 	ctx = i_new(struct sql_dict_transaction_context, 1);
 	ctx->ctx.dict = _dict;
-	ctx->sql_ctx = sql_transaction_begin(dict->db);
+	if (dict->set->batch_max_transactions == 0)
+		ctx->sql_ctx = sql_transaction_begin(dict->db);
+	else {
+		/* The SQL transaction is decided at commit time, which is
+		   when we know whether this can be added to a batch. */
+		i_array_init(&ctx->pending_stmts, 8);
+	}
 
 	return &ctx->ctx;
 }
 
 static void sql_dict_transaction_free(struct sql_dict_transaction_context *ctx)
 {
+	struct sql_dict_pending_stmt *pending;
+
 	if (array_is_created(&ctx->prev_inc))
 		sql_dict_prev_inc_free(ctx);
 	if (array_is_created(&ctx->prev_set))
 		sql_dict_prev_set_free(ctx);
 
+	if (array_is_created(&ctx->pending_stmts)) {
+		array_foreach_modifiable(&ctx->pending_stmts, pending)
+			sql_statement_abort(&pending->stmt);
+		array_free(&ctx->pending_stmts);
+	}
+
+	if (ctx->sql_ctx != NULL)
+		sql_transaction_rollback(&ctx->sql_ctx);
 	pool_unref(&ctx->inc_row_pool);
 	i_free(ctx->error);
 	i_free(ctx);
@@ -1046,6 +1160,7 @@ sql_dict_transaction_commit(struct dict_transaction_context *_ctx, bool async,
 {
 	struct sql_dict_transaction_context *ctx =
 		(struct sql_dict_transaction_context *)_ctx;
+	struct sql_dict *dict = (struct sql_dict *)_ctx->dict;
 	const char *error;
 	struct dict_commit_result result;
 
@@ -1055,19 +1170,29 @@ sql_dict_transaction_commit(struct dict_transaction_context *_ctx, bool async,
 	if (array_is_created(&ctx->prev_set))
 		sql_dict_prev_set_flush(ctx);
 
+	if (ctx->sql_ctx == NULL && ctx->error == NULL && _ctx->changed) {
+		/* batching is enabled - the statements haven't been added
+		   to any SQL transaction yet */
+		if (async && !_ctx->non_atomic) {
+			sql_dict_batch_add(ctx, callback, context);
+			return;
+		}
+		sql_dict_transaction_add_pending(ctx,
+			sql_transaction_begin(dict->db));
+	}
+
 	/* note that the above calls might still set ctx->error */
 	i_zero(&result);
 	result.ret = DICT_COMMIT_RET_FAILED;
 	result.error = t_strdup(ctx->error);
 
-	if (_ctx->non_atomic)
+	if (_ctx->non_atomic && ctx->sql_ctx != NULL)
 		sql_transaction_set_non_atomic(ctx->sql_ctx);
 
 	if (ctx->error != NULL) {
-		sql_transaction_rollback(&ctx->sql_ctx);
+		/* rolled back by sql_dict_transaction_free() */
 	} else if (!_ctx->changed) {
 		/* nothing changed, no need to commit */
-		sql_transaction_rollback(&ctx->sql_ctx);
 		result.ret = DICT_COMMIT_RET_OK;
 	} else if (async) {
 		ctx->async_callback = callback;
@@ -1094,18 +1219,30 @@ static void sql_dict_transaction_rollback(struct dict_transaction_context *_ctx)
 	struct sql_dict_transaction_context *ctx =
 		(struct sql_dict_transaction_context *)_ctx;
 
-	sql_transaction_rollback(&ctx->sql_ctx);
 	sql_dict_transaction_free(ctx);
 }
 
+struct dict_sql_build_query_field {
+	const struct dict_sql_map *map;
+	const char *value;
+};
+
+struct dict_sql_build_query {
+	struct sql_dict *dict;
+
+	ARRAY(struct dict_sql_build_query_field) fields;
+	const ARRAY_TYPE(const_string) *pattern_values;
+	bool add_username;
+};
+
 static struct sql_statement *
-sql_dict_transaction_stmt_init(struct sql_dict_transaction_context *ctx,
-			       const char *query,
-			       const ARRAY_TYPE(sql_dict_param) *params)
+sql_dict_transaction_stmt_init_cached(struct sql_dict_transaction_context *ctx,
+				      struct sql_prepared_statement **prep_stmt,
+				      const ARRAY_TYPE(sql_dict_param) *params)
 {
 	struct sql_dict *dict = (struct sql_dict *)ctx->ctx.dict;
 	struct sql_statement *stmt =
-		sql_dict_statement_init(dict, query, params);
+		sql_dict_statement_init_cached(dict, prep_stmt, params);
 
 	if (ctx->ctx.timestamp.tv_sec != 0)
 		sql_statement_set_timestamp(stmt, &ctx->ctx.timestamp);
@@ -1114,18 +1251,43 @@ sql_dict_transaction_stmt_init(struct sql_dict_transaction_context *ctx,
 	return stmt;
 }
 
-struct dict_sql_build_query_field {
-	const struct dict_sql_map *map;
-	const char *value;
-};
-
-struct dict_sql_build_query {
-	struct sql_dict *dict;
+static void
+sql_dict_transaction_update_stmt(struct sql_dict_transaction_context *ctx,
+				 struct sql_statement **stmt, bool get_rows)
+{
+	if (ctx->sql_ctx == NULL) {
+		struct sql_dict_pending_stmt *pending =
+			array_append_space(&ctx->pending_stmts);
+
+		pending->stmt = *stmt;
+		pending->get_rows = get_rows;
+		*stmt = NULL;
+	} else if (get_rows) {
+		sql_update_stmt_get_rows(ctx->sql_ctx, stmt,
+					 sql_dict_next_inc_row(ctx));
+	} else {
+		sql_update_stmt(ctx->sql_ctx, stmt);
+	}
+}
 
-	ARRAY(struct dict_sql_build_query_field) fields;
-	const ARRAY_TYPE(const_string) *pattern_values;
-	bool add_username;
-};
+/* Returns the statement cache key for a set/inc of the given fields. */
+static const char *
+sql_dict_build_query_cache_key(const struct dict_sql_build_query *build,
+			       const char *op, bool add_expire)
+{
+	const struct dict_sql_build_query_field *field;
+	string_t *key = t_str_new(64);
+
+	str_append(key, build->dict->stmt_key_prefix);
+	str_append(key, op);
+	array_foreach(&build->fields, field) {
+		str_printfa(key, "/%u",
+			    sql_dict_map_idx(build->dict, field->map));
+	}
+	str_printfa(key, "/%c%c", build->add_username ? 'u' : '-',
+		    add_expire ? 'e' : '-');
+	return str_c(key);
+}
 
 static int sql_dict_set_query(struct sql_dict_transaction_context *ctx,
 			      const struct dict_sql_build_query *build,
@@ -1135,10 +1297,12 @@ static int sql_dict_set_query(struct sql_dict_transaction_context *ctx,
 	struct sql_dict *dict = build->dict;
 	const struct dict_sql_build_query_field *fields;
 	const struct dict_sql_field *pattern_fields;
+	struct sql_prepared_statement *prep_stmt;
 	ARRAY_TYPE(sql_dict_param) params;
 	const char *const *pattern_values;
+	const char *cache_key;
 	unsigned int i, field_count, count, count2;
-	string_t *prefix, *suffix;
+	string_t *prefix = NULL, *suffix = NULL;
 	time_t expire_timestamp = 0;
 
 	fields = array_get(&build->fields, &field_count);
@@ -1148,43 +1312,60 @@ static int sql_dict_set_query(struct sql_dict_transaction_context *ctx,
 	    ctx->ctx.set.expire_secs > 0)
 		expire_timestamp = ioloop_time + ctx->ctx.set.expire_secs;
 
+	/* The query depends only on the maps being set and whether username
+	   and expire fields are added. If it's already cached, only the
+	   params need to be built. */
+	cache_key = sql_dict_build_query_cache_key(build, "set",
+						   expire_timestamp != 0);
+	prep_stmt = sql_prepared_statement_lookup_key(dict->db, cache_key);
+
 	t_array_init(&params, 4);
-	prefix = t_str_new(64);
-	suffix = t_str_new(256);
-	/* SQL table is guaranteed to be the same for all fields.
-	   Build all the SQL field names into prefix and '?' placeholders for
-	   each value into the suffix. The actual field values will be added
-	   into params[]. */
-	str_printfa(prefix, "INSERT INTO %s%s",
-		    sql_db_table_prefix(dict->db), fields[0].map->table);
-	str_append(prefix, " (");
-	str_append(suffix, ") VALUES (");
+	if (prep_stmt == NULL) {
+		prefix = t_str_new(64);
+		suffix = t_str_new(256);
+		/* SQL table is guaranteed to be the same for all fields.
+		   Build all the SQL field names into prefix and '?'
+		   placeholders for each value into the suffix. The actual
+		   field values will be added into params[]. */
+		str_printfa(prefix, "INSERT INTO %s%s",
+			    sql_db_table_prefix(dict->db), fields[0].map->table);
+		str_append(prefix, " (");
+		str_append(suffix, ") VALUES (");
+	}
 	for (i = 0; i < field_count; i++) {
-		if (i > 0) {
-			str_append_c(prefix, ',');
-			str_append_c(suffix, ',');
+		if (prefix != NULL) {
+			if (i > 0) {
+				str_append_c(prefix, ',');
+				str_append_c(suffix, ',');
+			}
+			str_append(prefix,
+				   t_strcut(fields[i].map->value_field, ','));
+			str_append_c(suffix, '?');
 		}
-		str_append(prefix, t_strcut(fields[i].map->value_field, ','));
 
 		enum dict_sql_type value_type =
 			fields[i].map->value_types[0];
-		str_append_c(suffix, '?');
 		if (sql_dict_value_get(fields[i].map,
 				       value_type, "value", fields[i].value,
 				       "", &params, error_r) < 0)
-			return -1;
+			goto failed;
 	}
 	if (build->add_username) {
 		struct sql_dict_param *param = array_append_space(&params);
-		str_printfa(prefix, ",%s", fields[0].map->username_field);
-		str_append(suffix, ",?");
+		if (prefix != NULL) {
+			str_printfa(prefix, ",%s",
+				    fields[0].map->username_field);
+			str_append(suffix, ",?");
+		}
 		param->value_type = DICT_SQL_TYPE_STRING;
 		param->value_str = ctx->ctx.set.username;
 	}
 	if (expire_timestamp != 0) {
 		struct sql_dict_param *param = array_append_space(&params);
-		str_printfa(prefix, ",%s", fields[0].map->expire_field);
-		str_append(suffix, ",?");
+		if (prefix != NULL) {
+			str_printfa(prefix, ",%s", fields[0].map->expire_field);
+			str_append(suffix, ",?");
+		}
 		param->value_type = DICT_SQL_TYPE_UINT;
 		param->value_int64 = expire_timestamp;
 	}
@@ -1194,21 +1375,31 @@ static int sql_dict_set_query(struct sql_dict_transaction_context *ctx,
 	pattern_values = array_get(build->pattern_values, &count2);
 	i_assert(count == count2);
 	for (i = 0; i < count; i++) {
-		str_printfa(prefix, ",%s", pattern_fields[i].name);
-		str_append(suffix, ",?");
+		if (prefix != NULL) {
+			str_printfa(prefix, ",%s", pattern_fields[i].name);
+			str_append(suffix, ",?");
+		}
 		if (sql_dict_field_get_value(fields[0].map, &pattern_fields[i],
 					     pattern_values[i], "",
 					     &params, error_r) < 0)
-			return -1;
+			goto failed;
 	}
 
-	str_append_str(prefix, suffix);
-	str_append_c(prefix, ')');
+	if (prefix != NULL) {
+		str_append_str(prefix, suffix);
+		str_append_c(prefix, ')');
+	}
 
 	enum sql_db_flags flags = sql_get_flags(dict->db);
-	if ((flags & SQL_DB_FLAG_ON_DUPLICATE_KEY) != 0)
+	if ((flags & (SQL_DB_FLAG_ON_DUPLICATE_KEY |
+		      SQL_DB_FLAG_ON_CONFLICT_DO)) == 0)
+		goto finish;
+
+	if (prefix == NULL) {
+		/* query is already cached */
+	} else if ((flags & SQL_DB_FLAG_ON_DUPLICATE_KEY) != 0)
 		str_append(prefix, " ON DUPLICATE KEY UPDATE ");
-	else if ((flags & SQL_DB_FLAG_ON_CONFLICT_DO) != 0) {
+	else {
 		str_append(prefix, " ON CONFLICT (");
 		for (i = 0; i < count; i++) {
 			if (i > 0)
@@ -1221,70 +1412,96 @@ static int sql_dict_set_query(struct sql_dict_transaction_context *ctx,
 			str_append(prefix, fields[0].map->username_field);
 		}
 		str_append(prefix, ") DO UPDATE SET ");
-	} else {
-		*stmt_r = sql_dict_transaction_stmt_init(ctx, str_c(prefix), &params);
-		return 0;
 	}
 
 	/* If the row already exists, UPDATE it instead. The pattern_values
 	   don't need to be updated here, because they are expected to be part
 	   of the row's primary key. */
 	for (i = 0; i < field_count; i++) {
-		const char *first_value_field =
-			t_strcut(fields[i].map->value_field, ',');
-		if (i > 0)
-			str_append_c(prefix, ',');
-		str_append(prefix, first_value_field);
-		str_append_c(prefix, '=');
+		if (prefix != NULL) {
+			const char *first_value_field =
+				t_strcut(fields[i].map->value_field, ',');
+			if (i > 0)
+				str_append_c(prefix, ',');
+			str_append(prefix, first_value_field);
+			str_append(prefix, "=?");
+		}
 
 		enum dict_sql_type value_type =
 			fields[i].map->value_types[0];
-		str_append_c(prefix, '?');
 		if (sql_dict_value_get(fields[i].map,
 				       value_type, "value", fields[i].value,
 				       "", &params, error_r) < 0)
-			return -1;
+			goto failed;
 	}
 	if (expire_timestamp != 0) {
-		str_printfa(prefix, ",%s=?", fields[0].map->expire_field);
+		if (prefix != NULL) {
+			str_printfa(prefix, ",%s=?",
+				    fields[0].map->expire_field);
+		}
 		struct sql_dict_param *param = array_append_space(&params);
 		param->value_type = DICT_SQL_TYPE_UINT;
 		param->value_int64 = expire_timestamp;
 	}
-	*stmt_r = sql_dict_transaction_stmt_init(ctx, str_c(prefix), &params);
+finish:
+	if (prep_stmt == NULL) {
+		prep_stmt = sql_prepared_statement_init_key(dict->db, cache_key,
+							    str_c(prefix));
+	}
+	*stmt_r = sql_dict_transaction_stmt_init_cached(ctx, &prep_stmt, &params);
 	return 0;
+
+failed:
+	if (prep_stmt != NULL)
+		sql_prepared_statement_unref(&prep_stmt);
+	return -1;
 }
 
 static int
 sql_dict_update_query(const struct dict_sql_build_query *build,
 		      const struct dict_op_settings_private *set,
-		      const char **query_r, ARRAY_TYPE(sql_dict_param) *params,
+		      struct sql_prepared_statement **prep_stmt_r,
+		      ARRAY_TYPE(sql_dict_param) *params,
 		      const char **error_r)
 {
+	struct sql_db *db = build->dict->db;
 	const struct dict_sql_build_query_field *fields;
+	struct sql_prepared_statement *prep_stmt;
 	unsigned int i, field_count;
-	string_t *query;
+	const char *cache_key;
+	string_t *query = NULL;
 
 	fields = array_get(&build->fields, &field_count);
 	i_assert(field_count > 0);
 
-	query = t_str_new(64);
-	str_printfa(query, "UPDATE %s%s SET ",
-		    sql_db_table_prefix(build->dict->db), fields[0].map->table);
-	for (i = 0; i < field_count; i++) {
-		const char *first_value_field =
-			t_strcut(fields[i].map->value_field, ',');
-		if (i > 0)
-			str_append_c(query, ',');
-		str_printfa(query, "%s=%s+?", first_value_field,
-			    first_value_field);
+	cache_key = sql_dict_build_query_cache_key(build, "inc", FALSE);
+	prep_stmt = sql_prepared_statement_lookup_key(db, cache_key);
+	if (prep_stmt == NULL) {
+		query = t_str_new(64);
+		str_printfa(query, "UPDATE %s%s SET ",
+			    sql_db_table_prefix(db), fields[0].map->table);
+		for (i = 0; i < field_count; i++) {
+			const char *first_value_field =
+				t_strcut(fields[i].map->value_field, ',');
+			if (i > 0)
+				str_append_c(query, ',');
+			str_printfa(query, "%s=%s+?", first_value_field,
+				    first_value_field);
+		}
 	}
 
 	if (sql_dict_where_build(set->username, fields[0].map, build->pattern_values,
 				 build->add_username, SQL_DICT_RECURSE_NONE,
-				 query, params, error_r) < 0)
+				 query, params, error_r) < 0) {
+		if (prep_stmt != NULL)
+			sql_prepared_statement_unref(&prep_stmt);
 		return -1;
-	*query_r = str_c(query);
+	}
+	if (prep_stmt == NULL) {
+		prep_stmt = sql_prepared_statement_init_key(db, cache_key,
+							    str_c(query));
+	}
+	*prep_stmt_r = prep_stmt;
 	return 0;
 }
 
@@ -1349,7 +1566,7 @@ static void sql_dict_prev_set_flush(struct sql_dict_transaction_context *ctx)
 			"dict-sql: Failed to set %u fields (first %s): %s",
 			count, prev_sets[0].key, error);
 	} else {
-		sql_update_stmt(ctx->sql_ctx, &stmt);
+		sql_dict_transaction_update_stmt(ctx, &stmt, FALSE);
 	}
 	sql_dict_prev_set_free(ctx);
 }
@@ -1362,10 +1579,11 @@ static void sql_dict_unset(struct dict_transaction_context *_ctx,
 	struct sql_dict *dict = (struct sql_dict *)_ctx->dict;
 	const struct dict_op_settings_private *set = &_ctx->set;
 	const struct dict_sql_map *map;
+	struct sql_prepared_statement *prep_stmt;
 	ARRAY_TYPE(const_string) pattern_values;
-	string_t *query = t_str_new(256);
+	string_t *query = NULL;
 	ARRAY_TYPE(sql_dict_param) params;
-	const char *error;
+	const char *cache_key, *error;
 
 	if (ctx->error != NULL)
 		return;
@@ -1383,7 +1601,14 @@ static void sql_dict_unset(struct dict_transaction_context *_ctx,
 		return;
 	}
 
-	str_printfa(query, "DELETE FROM %s%s", sql_db_table_prefix(dict->db), map->table);
+	cache_key = t_strdup_printf("%sunset/%u/%c", dict->stmt_key_prefix,
+				    sql_dict_map_idx(dict, map), key[0]);
+	prep_stmt = sql_prepared_statement_lookup_key(dict->db, cache_key);
+	if (prep_stmt == NULL) {
+		query = t_str_new(256);
+		str_printfa(query, "DELETE FROM %s%s",
+			    sql_db_table_prefix(dict->db), map->table);
+	}
 	t_array_init(&params, 4);
 	if (sql_dict_where_build(set->username, map, &pattern_values,
 				 key[0] == DICT_PATH_PRIVATE[0],
@@ -1391,10 +1616,17 @@ static void sql_dict_unset(struct dict_transaction_context *_ctx,
 				 &params, &error) < 0) {
 		ctx->error = i_strdup_printf(
 			"dict-sql: Failed to delete %s: %s", key, error);
+		if (prep_stmt != NULL)
+			sql_prepared_statement_unref(&prep_stmt);
 	} else {
+		if (prep_stmt == NULL) {
+			prep_stmt = sql_prepared_statement_init_key(dict->db,
+				cache_key, str_c(query));
+		}
 		struct sql_statement *stmt =
-			sql_dict_transaction_stmt_init(ctx, str_c(query), &params);
-		sql_update_stmt(ctx->sql_ctx, &stmt);
+			sql_dict_transaction_stmt_init_cached(ctx, &prep_stmt,
+							      &params);
+		sql_dict_transaction_update_stmt(ctx, &stmt, FALSE);
 	}
 }
 
@@ -1434,7 +1666,8 @@ static void sql_dict_prev_inc_flush(struct sql_dict_transaction_context *ctx)
 	struct dict_sql_build_query_field *field;
 	ARRAY_TYPE(sql_dict_param) params;
 	struct sql_dict_param *param;
-	const char *query, *error;
+	struct sql_prepared_statement *prep_stmt;
+	const char *error;
 
 	i_assert(array_is_created(&ctx->prev_inc));
 
@@ -1477,15 +1710,15 @@ static void sql_dict_prev_inc_flush(struct sql_dict_transaction_context *ctx)
 		param->value_int64 = prev_incs[i].value.diff;
 	}
 
-	if (sql_dict_update_query(&build, set, &query, &params, &error) < 0) {
+	if (sql_dict_update_query(&build, set, &prep_stmt, &params, &error) < 0) {
 		ctx->error = i_strdup_printf(
 			"dict-sql: Failed to increase %u fields (first %s): %s",
 			count, prev_incs[0].key, error);
 	} else {
 		struct sql_statement *stmt =
-			sql_dict_transaction_stmt_init(ctx, query, &params);
-		sql_update_stmt_get_rows(ctx->sql_ctx, &stmt,
-					 sql_dict_next_inc_row(ctx));
+			sql_dict_transaction_stmt_init_cached(ctx, &prep_stmt,
+							      &params);
+		sql_dict_transaction_update_stmt(ctx, &stmt, TRUE);
 	}
 	sql_dict_prev_inc_free(ctx);
 }
@@ -1602,6 +1835,79 @@ static void sql_dict_atomic_inc(struct dict_transaction_context *_ctx,
 	prev_inc->value.diff = diff;
 }
 
+/* Add the statements built for the transaction to the SQL transaction. */
+static void
+sql_dict_transaction_add_pending(struct sql_dict_transaction_context *ctx,
+				 struct sql_transaction_context *sql_ctx)
+{
+	struct sql_dict_pending_stmt *pending;
+
+	i_assert(ctx->sql_ctx == NULL);
+	i_assert(ctx->error == NULL);
+
+	ctx->sql_ctx = sql_ctx;
+	array_foreach_modifiable(&ctx->pending_stmts, pending) {
+		sql_dict_transaction_update_stmt(ctx, &pending->stmt,
+						 pending->get_rows);
+	}
+	array_clear(&ctx->pending_stmts);
+}
+
+static void
+sql_dict_batch_commit_callback(const struct sql_commit_result *sql_result,
+			       struct sql_dict_batch *batch)
+{
+	struct sql_dict_transaction_context *ctx;
+
+	/* All the transactions in the batch were committed (or failed)
+	   together. sql_dict_transaction_commit_callback() frees them. */
+	array_foreach_elem(&batch->transactions, ctx)
+		sql_dict_transaction_commit_callback(sql_result, ctx);
+	array_free(&batch->transactions);
+	i_free(batch);
+}
+
+static void sql_dict_batch_commit(struct sql_dict *dict)
+{
+	struct sql_dict_batch *batch = dict->batch;
+
+	dict->batch = NULL;
+	timeout_remove(&batch->to_commit);
+	e_debug(dict->dict.event, "Committing a batch of %u transactions",
+		array_count(&batch->transactions));
+	sql_transaction_commit(&batch->sql_ctx,
+			       sql_dict_batch_commit_callback, batch);
+}
+
+static void
+sql_dict_batch_add(struct sql_dict_transaction_context *ctx,
+		   dict_transaction_commit_callback_t *callback, void *context)
+{
+	struct sql_dict *dict = (struct sql_dict *)ctx->ctx.dict;
+	struct sql_dict_batch *batch = dict->batch;
+
+	if (batch == NULL) {
+		batch = dict->batch = i_new(struct sql_dict_batch, 1);
+		batch->dict = dict;
+		batch->sql_ctx = sql_transaction_begin(dict->db);
+		i_array_init(&batch->transactions,
+			     dict->set->batch_max_transactions);
+		batch->to_commit = timeout_add_short(dict->set->batch_delay_msecs,
+						     sql_dict_batch_commit, dict);
+	}
+
+	ctx->async_callback = callback;
+	ctx->async_context = context;
+	sql_dict_transaction_add_pending(ctx, batch->sql_ctx);
+	/* the SQL transaction is owned by the batch */
+	ctx->sql_ctx = NULL;
+	array_push_back(&batch->transactions, &ctx);
+
+	if (array_count(&batch->transactions) >=
+	    dict->set->batch_max_transactions)
+		sql_dict_batch_commit(dict);
+}
+
 static int
 sql_dict_expire_map(struct sql_dict *dict, const struct dict_sql_map *map,
 		    const char **error_r)
@@ -1654,6 +1960,7 @@ static struct dict sql_dict = {
 		.init_legacy = sql_dict_init_legacy,
 		.deinit = sql_dict_deinit,
 		.wait = sql_dict_wait,
+		.switch_ioloop = sql_dict_switch_ioloop,
 		.expire_scan = sql_dict_expire_scan,
 		.lookup = sql_dict_lookup,
 		.iterate_init = sql_dict_iterate_init,
@@ -1,6 +1,8 @@
 /* Copyright (c) 2017-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "write-full.h"
 #include "test-lib.h"
 #include "sql-api.h"
 #include "dict.h"
@@ -9,6 +11,12 @@
 #include "dict-sql-private.h"
 #include "driver-test.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TEST_BATCH_CONF_PATH ".test-dict-sql-batch.conf"
+#define TEST_SHARED_DB_CONF_PATH ".test-dict-sql-shared-db.conf"
+
 struct dict_op_settings dict_op_settings = {
 	.username = "testuser",
 };
@@ -78,6 +86,68 @@ static void test_lookup_one(void)
 	test_end();
 }
 
+static void test_lookup_cached(void)
+{
+	const char *value = NULL, *error = NULL;
+	struct test_driver_result_set rset[] = {
+		{
+			.rows = 1,
+			.cols = 1,
+			.col_names = (const char *[]){"value", NULL},
+			.row_data = (const char **[]){(const char*[]){"one", NULL}},
+		},
+		{
+			.rows = 1,
+			.cols = 1,
+			.col_names = (const char *[]){"value", NULL},
+			.row_data = (const char **[]){(const char*[]){"two", NULL}},
+		},
+		{
+			.rows = 1,
+			.cols = 1,
+			.col_names = (const char *[]){"bytes", NULL},
+			.row_data = (const char **[]){(const char*[]){"128", NULL}},
+		},
+	};
+	struct test_driver_result res1 = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT value FROM table WHERE a = 'hello' AND b = 'world'", NULL},
+		.result = &rset[0],
+	};
+	struct test_driver_result res2 = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT value FROM table WHERE a = 'foo' AND b = 'bar'", NULL},
+		.result = &rset[1],
+	};
+	struct test_driver_result res3 = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT bytes FROM quota WHERE username = 'testuser'", NULL},
+		.result = &rset[2],
+	};
+	struct dict *dict;
+	pool_t pool = pool_datastack_create();
+
+	test_begin("dict lookup cached statement");
+	test_setup(&dict);
+
+	/* the second lookup uses the cached statement with different
+	   parameters */
+	test_set_expected(dict, &res1);
+	test_set_expected(dict, &res2);
+	test_set_expected(dict, &res3);
+	test_assert(dict_lookup(dict, &dict_op_settings, pool,
+				"shared/dictmap/hello/world", &value, &error) == 1);
+	test_assert_strcmp(value, "one");
+	test_assert(dict_lookup(dict, &dict_op_settings, pool,
+				"shared/dictmap/foo/bar", &value, &error) == 1);
+	test_assert_strcmp(value, "two");
+	test_assert(dict_lookup(dict, &dict_op_settings, pool,
+				"priv/quota/bytes", &value, &error) == 1);
+	test_assert_strcmp(value, "128");
+	test_teardown(&dict);
+	test_end();
+}
+
 static void test_atomic_inc(void)
 {
 	const char *error;
@@ -290,6 +360,185 @@ static void test_iterate(void)
 	test_end();
 }
 
+static void test_batch_commit_callback(const struct dict_commit_result *result,
+				       unsigned int *pending)
+{
+	test_assert(result->ret == DICT_COMMIT_RET_OK);
+	if (--*pending == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_batch_commit(void)
+{
+	const char *error;
+	struct test_driver_result res = {
+		.affected_rows = 1,
+		.nqueries = 6,
+		.queries = (const char *[]){
+			"INSERT INTO quota (count,username) VALUES (5,'user2') ON DUPLICATE KEY UPDATE count=5",
+			"DELETE FROM quota WHERE username = 'user2'",
+			"UPDATE quota SET bytes=bytes+128,count=count+1 WHERE username = 'user1'",
+			"UPDATE quota SET bytes=bytes+256,count=count+2 WHERE username = 'user2'",
+			"INSERT INTO quota (bytes,username) VALUES (10,'user3') ON DUPLICATE KEY UPDATE bytes=10",
+			"UPDATE quota SET count=count+1 WHERE username = 'user1'",
+			NULL},
+		.result = NULL,
+	};
+	struct dict_op_settings set1 = { .username = "user1" };
+	struct dict_op_settings set2 = { .username = "user2" };
+	struct dict_op_settings set3 = { .username = "user3" };
+	struct dict_legacy_settings set = { .base_dir = "." };
+	struct dict_transaction_context *ctx;
+	struct ioloop *ioloop;
+	struct dict *dict;
+	unsigned int pending = 4;
+	int fd;
+
+	test_begin("dict batch commit");
+	fd = creat(TEST_BATCH_CONF_PATH, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", TEST_BATCH_CONF_PATH);
+	const char *conf =
+		"connect = host=localhost\n"
+		"batch_max_transactions = 3\n"
+		"batch_delay_msecs = 10\n"
+		"map {\n"
+		"  pattern = priv/quota/bytes\n"
+		"  table = quota\n"
+		"  username_field = username\n"
+		"  value_field = bytes\n"
+		"  value_type = uint\n"
+		"}\n"
+		"map {\n"
+		"  pattern = priv/quota/count\n"
+		"  table = quota\n"
+		"  username_field = username\n"
+		"  value_field = count\n"
+		"  value_type = uint\n"
+		"}\n";
+	if (write_full(fd, conf, strlen(conf)) < 0)
+		i_fatal("write(%s) failed: %m", TEST_BATCH_CONF_PATH);
+	i_close_fd(&fd);
+
+	ioloop = io_loop_create();
+	if (dict_init_legacy("mysql:"TEST_BATCH_CONF_PATH, &set, &dict, &error) < 0)
+		i_fatal("cannot initialize dict: %s", error);
+	test_set_expected(dict, &res);
+
+	/* invalid transaction isn't added to the batch */
+	ctx = dict_transaction_begin(dict, &set1);
+	dict_atomic_inc(ctx, "priv/quota/nonexistent", 1);
+	test_assert(dict_transaction_commit(&ctx, &error) < 0);
+
+	/* synchronous commits aren't added to the batch */
+	ctx = dict_transaction_begin(dict, &set2);
+	dict_set(ctx, "priv/quota/count", "5");
+	dict_unset(ctx, "priv/quota/bytes");
+	test_assert(dict_transaction_commit(&ctx, &error) == 1);
+
+	/* the first 3 transactions are committed as a single batch once
+	   batch_max_transactions is reached */
+	ctx = dict_transaction_begin(dict, &set1);
+	dict_atomic_inc(ctx, "priv/quota/bytes", 128);
+	dict_atomic_inc(ctx, "priv/quota/count", 1);
+	dict_transaction_commit_async(&ctx, test_batch_commit_callback, &pending);
+	ctx = dict_transaction_begin(dict, &set2);
+	dict_atomic_inc(ctx, "priv/quota/bytes", 256);
+	dict_atomic_inc(ctx, "priv/quota/count", 2);
+	dict_transaction_commit_async(&ctx, test_batch_commit_callback, &pending);
+	test_assert(pending == 4);
+	ctx = dict_transaction_begin(dict, &set3);
+	dict_set(ctx, "priv/quota/bytes", "10");
+	dict_transaction_commit_async(&ctx, test_batch_commit_callback, &pending);
+
+	/* the last one is committed after batch_delay_msecs */
+	ctx = dict_transaction_begin(dict, &set1);
+	dict_atomic_inc(ctx, "priv/quota/count", 1);
+	dict_transaction_commit_async(&ctx, test_batch_commit_callback, &pending);
+	io_loop_run(ioloop);
+	test_assert(pending == 0);
+
+	dict_deinit(&dict);
+	io_loop_destroy(&ioloop);
+	i_unlink(TEST_BATCH_CONF_PATH);
+	test_end();
+}
+
+static void test_shared_db_prepared_statements(void)
+{
+	const char *value, *error;
+	struct test_driver_result_set rset[] = {
+		{
+			.rows = 1,
+			.cols = 1,
+			.col_names = (const char *[]){"value", NULL},
+			.row_data = (const char **[]){(const char*[]){"one", NULL}},
+		},
+		{
+			.rows = 1,
+			.cols = 1,
+			.col_names = (const char *[]){"other_value", NULL},
+			.row_data = (const char **[]){(const char*[]){"two", NULL}},
+		},
+	};
+	struct test_driver_result res1 = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT value FROM table WHERE a = 'hello' AND b = 'world'", NULL},
+		.result = &rset[0],
+	};
+	struct test_driver_result res2 = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT other_value FROM other WHERE c = 'hello'", NULL},
+		.result = &rset[1],
+	};
+	struct dict_legacy_settings set = { .base_dir = "." };
+	struct dict *dict1, *dict2;
+	pool_t pool = pool_datastack_create();
+	int fd;
+
+	test_begin("dict shared db prepared statements");
+	fd = creat(TEST_SHARED_DB_CONF_PATH, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", TEST_SHARED_DB_CONF_PATH);
+	/* same connect string as dict.conf, so the sql_db is shared, and
+	   the first map has the same index and key type */
+	const char *conf =
+		"connect = host=localhost\n"
+		"map {\n"
+		"  pattern = shared/other/$key\n"
+		"  table = other\n"
+		"  value_field = other_value\n"
+		"  value_type = string\n"
+		"  fields {\n"
+		"    c = $key\n"
+		"  }\n"
+		"}\n";
+	if (write_full(fd, conf, strlen(conf)) < 0)
+		i_fatal("write(%s) failed: %m", TEST_SHARED_DB_CONF_PATH);
+	i_close_fd(&fd);
+
+	test_setup(&dict1);
+	if (dict_init_legacy("mysql:"TEST_SHARED_DB_CONF_PATH, &set,
+			     &dict2, &error) < 0)
+		i_fatal("cannot initialize dict: %s", error);
+	test_assert(((struct sql_dict *)dict1)->db ==
+		    ((struct sql_dict *)dict2)->db);
+
+	test_set_expected(dict1, &res1);
+	test_assert(dict_lookup(dict1, &dict_op_settings, pool,
+				"shared/dictmap/hello/world", &value, &error) == 1);
+	test_assert_strcmp(value, "one");
+	test_set_expected(dict2, &res2);
+	test_assert(dict_lookup(dict2, &dict_op_settings, pool,
+				"shared/other/hello", &value, &error) == 1);
+	test_assert_strcmp(value, "two");
+
+	dict_deinit(&dict2);
+	test_teardown(&dict1);
+	i_unlink(TEST_SHARED_DB_CONF_PATH);
+	test_end();
+}
+
 int main(void) {
 	sql_drivers_init();
 	sql_driver_test_register();
@@ -297,10 +546,13 @@ int main(void) {
 
 	static void (*const test_functions[])(void) = {
 		test_lookup_one,
+		test_lookup_cached,
 		test_atomic_inc,
 		test_set,
 		test_unset,
 		test_iterate,
+		test_batch_commit,
+		test_shared_db_prepared_statements,
 		NULL
 	};
 
@@ -657,6 +657,22 @@ static int client_dict_reconnect(struct client_dict *dict, const char *reason,
 	return ret;
 }
 
+void dict_client_forked(void)
+{
+	struct connection *_conn;
+
+	if (dict_connections == NULL)
+		return;
+	for (_conn = dict_connections->connections; _conn != NULL;
+	     _conn = _conn->next) {
+		struct dict_client_connection *conn =
+			(struct dict_client_connection *)_conn;
+
+		timeout_remove(&conn->dict->to_idle);
+		connection_forked(_conn);
+	}
+}
+
 static void dict_conn_destroy(struct connection *_conn)
 {
 	struct dict_client_connection *conn =
@@ -12,6 +12,7 @@ void dict_drivers_register_builtin(void)
 	dict_driver_register(&dict_driver_client);
 	dict_driver_register(&dict_driver_file);
 	dict_driver_register(&dict_driver_fs);
+	dict_driver_register(&dict_driver_mmap);
 	dict_driver_register(&dict_driver_redis);
 }
 
@@ -22,5 +23,12 @@ void dict_drivers_unregister_builtin(void)
 	dict_driver_unregister(&dict_driver_client);
 	dict_driver_unregister(&dict_driver_file);
 	dict_driver_unregister(&dict_driver_fs);
+	dict_driver_unregister(&dict_driver_mmap);
 	dict_driver_unregister(&dict_driver_redis);
 }
+
+void dict_drivers_forked(void)
+{
+	dict_client_forked();
+	dict_redis_forked();
+}
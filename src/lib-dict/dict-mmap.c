@@ -0,0 +1,1490 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "strnum.h"
+#include "strescape.h"
+#include "home-expand.h"
+#include "mkdir-parents.h"
+#include "eacces-error.h"
+#include "file-lock.h"
+#include "mmap-util.h"
+#include "nfs-workarounds.h"
+#include "write-full.h"
+#include "fsync-mode.h"
+#include "fdatasync-path.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "settings.h"
+#include "settings-parser.h"
+#include "dict-transaction-memory.h"
+#include "dict-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* The dict consists of two files: an immutable base file, which is mmap()ed,
+   and an append-only log containing the changes done after the base file was
+   written. Once the log grows too large, the base file and the log are
+   compacted into a new base file and the log is replaced with an empty one.
+
+   The base file begins with a header, followed by record_count 32bit record
+   offsets in key-sorted order, hash_size hash slots and finally the records.
+   Each record is a record header, NUL-terminated key and NUL-terminated value
+   padded to 32bit alignment. All numbers are in host byte order.
+
+   The log consists of "S<key>\t<value>\n" and "U<key>\n" lines with
+   tab-escaped keys and values. Increments are logged as their resulting
+   values, so reading the same log lines multiple times is harmless. This
+   allows readers to see the new base file together with the old log while
+   compaction is renaming the files. A partially written line at the end of
+   the log is ignored and truncated away by the next writer.
+
+   With fsync=optimized the log appends aren't fsynced, so a crash may lose
+   the latest changes, but the dict stays consistent. The new base file and
+   the directory are fsynced during compaction before the old log is
+   replaced, since otherwise everything in the log could be lost.
+   fsync=always also fsyncs the log after each commit. */
+
+#define DICT_MMAP_FILE_MAGIC 0x50414d44 /* "DMAP" */
+#define DICT_MMAP_FILE_VERSION 1
+#define DICT_MMAP_LOG_SUFFIX ".log"
+#define DICT_MMAP_LOCK_TIMEOUT_SECS (60*2)
+#define DICT_MMAP_RECORD_ALIGN(size) (((size) + 3) & ~(size_t)3)
+
+struct dict_mmap_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_count;
+	/* number of hash slots - 0 or a power of 2 */
+	uint32_t hash_size;
+};
+
+struct dict_mmap_hash_slot {
+	uint32_t hash;
+	/* record index + 1, 0 = unused slot */
+	uint32_t idx1;
+};
+
+struct dict_mmap_record_header {
+	uint32_t key_size;
+	uint32_t value_size;
+};
+
+/* mmap()ed base file. Iterators keep a reference to it, so the memory stays
+   valid even if the base file is replaced while iterating. */
+struct dict_mmap_file {
+	int refcount;
+	char *path;
+	dev_t st_dev;
+	ino_t st_ino;
+
+	void *mmap_base;
+	size_t mmap_size;
+
+	unsigned int record_count, hash_size;
+	const uint32_t *offsets;
+	const struct dict_mmap_hash_slot *hash;
+};
+
+struct dict_mmap_entry {
+	const char *key;
+	/* NULL = unset */
+	const char *value;
+};
+ARRAY_DEFINE_TYPE(dict_mmap_entry, struct dict_mmap_entry);
+
+struct mmap_dict {
+	struct dict dict;
+	enum file_lock_method lock_method;
+	enum fsync_mode fsync_mode;
+	uoff_t log_max_size;
+
+	char *path;
+	char *home_dir;
+	bool dict_path_checked;
+
+	struct dict_mmap_file *file;
+	/* base file has been refreshed after the log was opened */
+	bool base_refreshed;
+
+	/* Changes read from the log. They override the base file. Unset keys
+	   point to dict_mmap_unset_value. */
+	pool_t overlay_pool;
+	HASH_TABLE(char *, char *) overlay;
+	int log_fd;
+	/* log offset up to which the overlay has been read */
+	uoff_t log_offset;
+	/* log size when it was last checked, (uoff_t)-1 if unknown */
+	uoff_t log_size;
+
+	struct timeout *to_compact;
+};
+
+struct mmap_dict_iterate_context {
+	struct dict_iterate_context ctx;
+	pool_t pool;
+
+	struct dict_mmap_file *file;
+	unsigned int base_idx;
+	ARRAY_TYPE(dict_mmap_entry) overlay;
+	unsigned int overlay_idx;
+
+	const char *path;
+	size_t path_len;
+
+	enum dict_iterate_flags flags;
+	const char *values[2];
+	const char *error;
+};
+
+struct dict_mmap_settings {
+	pool_t pool;
+
+	const char *dict_mmap_path;
+	const char *dict_mmap_lock_method;
+	const char *dict_mmap_fsync;
+	uoff_t dict_mmap_log_max_size;
+};
+#undef DEF
+#define DEF(type, name) \
+	SETTING_DEFINE_STRUCT_##type(#name, name, struct dict_mmap_settings)
+static const struct setting_define dict_mmap_setting_defines[] = {
+	DEF(STR_VARS, dict_mmap_path),
+	DEF(ENUM, dict_mmap_lock_method),
+	DEF(ENUM, dict_mmap_fsync),
+	DEF(SIZE, dict_mmap_log_max_size),
+
+	SETTING_DEFINE_LIST_END
+};
+static const struct dict_mmap_settings dict_mmap_default_settings = {
+	.dict_mmap_path = "",
+	.dict_mmap_lock_method = "fcntl:flock",
+	.dict_mmap_fsync = "optimized:never:always",
+	.dict_mmap_log_max_size = 1024*1024,
+};
+const struct setting_parser_info dict_mmap_setting_parser_info = {
+	.name = "dict_mmap",
+
+	.defines = dict_mmap_setting_defines,
+	.defaults = &dict_mmap_default_settings,
+
+	.struct_size = sizeof(struct dict_mmap_settings),
+	.pool_offset1 = 1 + offsetof(struct dict_mmap_settings, pool),
+};
+
+static char dict_mmap_unset_value[] = "";
+
+static int
+mmap_dict_lock(struct mmap_dict *dict, struct file_lock **lock_r,
+	       const char **error_r);
+static int mmap_dict_refresh(struct mmap_dict *dict, const char **error_r);
+static int mmap_dict_compact_locked(struct mmap_dict *dict,
+				    struct file_lock **lock,
+				    const char **error_r);
+
+static uint32_t dict_mmap_key_hash(const char *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint32_t hash = 2166136261U;
+
+	/* FNV-1a - this is written to the base file, so it must not change */
+	for (; *p != '\0'; p++) {
+		hash ^= *p;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static const char *
+dict_mmap_file_corrupted(struct dict_mmap_file *file, const char *reason)
+{
+	return t_strdup_printf("Corrupted dict file %s: %s", file->path, reason);
+}
+
+static int
+dict_mmap_file_open(const char *path, int fd, struct dict_mmap_file **file_r,
+		    const char **error_r)
+{
+	struct dict_mmap_file *file;
+	struct dict_mmap_header hdr;
+	struct stat st;
+	uint64_t min_size;
+
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+		return -1;
+	}
+
+	file = i_new(struct dict_mmap_file, 1);
+	file->refcount = 1;
+	file->path = i_strdup(path);
+	file->st_dev = st.st_dev;
+	file->st_ino = st.st_ino;
+	file->mmap_size = st.st_size;
+	if (file->mmap_size < sizeof(hdr)) {
+		*error_r = dict_mmap_file_corrupted(file, "File too small");
+		i_free(file->path);
+		i_free(file);
+		return -1;
+	}
+	file->mmap_base = mmap_ro_file(fd, &file->mmap_size);
+	if (file->mmap_base == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", path);
+		i_free(file->path);
+		i_free(file);
+		return -1;
+	}
+
+	memcpy(&hdr, file->mmap_base, sizeof(hdr));
+	min_size = sizeof(hdr) + (uint64_t)hdr.record_count * sizeof(uint32_t) +
+		(uint64_t)hdr.hash_size * sizeof(struct dict_mmap_hash_slot);
+	if (hdr.magic != DICT_MMAP_FILE_MAGIC)
+		*error_r = dict_mmap_file_corrupted(file, "Invalid magic");
+	else if (hdr.version != DICT_MMAP_FILE_VERSION) {
+		*error_r = dict_mmap_file_corrupted(file, t_strdup_printf(
+			"Unsupported version %u", hdr.version));
+	} else if ((hdr.hash_size & (hdr.hash_size - 1)) != 0 ||
+		   hdr.hash_size < hdr.record_count)
+		*error_r = dict_mmap_file_corrupted(file, "Invalid hash_size");
+	else if (min_size > file->mmap_size)
+		*error_r = dict_mmap_file_corrupted(file, "File truncated");
+	else {
+		file->record_count = hdr.record_count;
+		file->hash_size = hdr.hash_size;
+		file->offsets = CONST_PTR_OFFSET(file->mmap_base, sizeof(hdr));
+		file->hash = (const void *)(file->offsets + file->record_count);
+		*file_r = file;
+		return 0;
+	}
+	if (munmap(file->mmap_base, file->mmap_size) < 0)
+		i_error("munmap(%s) failed: %m", path);
+	i_free(file->path);
+	i_free(file);
+	return -1;
+}
+
+static void dict_mmap_file_unref(struct dict_mmap_file **_file)
+{
+	struct dict_mmap_file *file = *_file;
+
+	if (file == NULL)
+		return;
+	*_file = NULL;
+
+	i_assert(file->refcount > 0);
+	if (--file->refcount > 0)
+		return;
+
+	if (munmap(file->mmap_base, file->mmap_size) < 0)
+		i_error("munmap(%s) failed: %m", file->path);
+	i_free(file->path);
+	i_free(file);
+}
+
+static bool
+dict_mmap_file_get_record(struct dict_mmap_file *file, unsigned int idx,
+			  const char **key_r, const char **value_r)
+{
+	struct dict_mmap_record_header rec;
+	const char *data;
+	size_t offset, avail;
+
+	i_assert(idx < file->record_count);
+
+	offset = file->offsets[idx];
+	if (offset > file->mmap_size - sizeof(rec))
+		return FALSE;
+	memcpy(&rec, CONST_PTR_OFFSET(file->mmap_base, offset), sizeof(rec));
+	data = CONST_PTR_OFFSET(file->mmap_base, offset + sizeof(rec));
+	avail = file->mmap_size - offset - sizeof(rec);
+	if ((size_t)rec.key_size + 1 > avail ||
+	    (size_t)rec.value_size + 1 > avail - rec.key_size - 1)
+		return FALSE;
+	if (data[rec.key_size] != '\0' ||
+	    data[rec.key_size + 1 + rec.value_size] != '\0')
+		return FALSE;
+	*key_r = data;
+	*value_r = data + rec.key_size + 1;
+	return TRUE;
+}
+
+static int
+dict_mmap_file_lookup(struct dict_mmap_file *file, const char *key,
+		      const char **value_r, const char **error_r)
+{
+	const char *rec_key, *rec_value;
+	unsigned int i, n, mask;
+	uint32_t hash;
+
+	if (file->record_count == 0)
+		return 0;
+
+	hash = dict_mmap_key_hash(key);
+	mask = file->hash_size - 1;
+	for (i = hash & mask, n = 0; n < file->hash_size; i = (i + 1) & mask, n++) {
+		const struct dict_mmap_hash_slot *slot = &file->hash[i];
+
+		if (slot->idx1 == 0)
+			break;
+		if (slot->hash != hash)
+			continue;
+		if (slot->idx1 > file->record_count ||
+		    !dict_mmap_file_get_record(file, slot->idx1 - 1,
+					       &rec_key, &rec_value)) {
+			*error_r = dict_mmap_file_corrupted(file,
+				"Broken hash slot");
+			return -1;
+		}
+		if (strcmp(rec_key, key) == 0) {
+			*value_r = rec_value;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Find the first record whose key is equal or larger than the prefix. */
+static int
+dict_mmap_file_find_first(struct dict_mmap_file *file, const char *prefix,
+			  unsigned int *idx_r, const char **error_r)
+{
+	const char *key, *value;
+	unsigned int idx, left = 0, right = file->record_count;
+
+	while (left < right) {
+		idx = left + (right - left) / 2;
+		if (!dict_mmap_file_get_record(file, idx, &key, &value)) {
+			*error_r = dict_mmap_file_corrupted(file,
+				t_strdup_printf("Broken record #%u", idx));
+			return -1;
+		}
+		if (strcmp(key, prefix) < 0)
+			left = idx + 1;
+		else
+			right = idx;
+	}
+	*idx_r = left;
+	return 0;
+}
+
+static int
+dict_mmap_file_write(struct ostream *output,
+		     const ARRAY_TYPE(dict_mmap_entry) *entries,
+		     const char **error_r)
+{
+	static const unsigned char padding[3] = { 0, 0, 0 };
+	const struct dict_mmap_entry *entries_arr;
+	struct dict_mmap_header hdr;
+	struct dict_mmap_record_header rec;
+	struct dict_mmap_hash_slot *hash;
+	uint32_t *offsets;
+	unsigned int i, count, slot_idx, mask;
+	size_t offset, size;
+
+	entries_arr = array_get(entries, &count);
+
+	i_zero(&hdr);
+	hdr.magic = DICT_MMAP_FILE_MAGIC;
+	hdr.version = DICT_MMAP_FILE_VERSION;
+	hdr.record_count = count;
+	hdr.hash_size = count == 0 ? 0 : nearest_power(count * 2);
+
+	offsets = i_new(uint32_t, count);
+	hash = i_new(struct dict_mmap_hash_slot, hdr.hash_size);
+	offset = sizeof(hdr) + count * sizeof(uint32_t) +
+		hdr.hash_size * sizeof(struct dict_mmap_hash_slot);
+	mask = hdr.hash_size - 1;
+	for (i = 0; i < count; i++) {
+		if (offset > (uint32_t)-1) {
+			*error_r = "File would become too large";
+			i_free(offsets);
+			i_free(hash);
+			return -1;
+		}
+		offsets[i] = offset;
+		offset += DICT_MMAP_RECORD_ALIGN(sizeof(rec) +
+			strlen(entries_arr[i].key) + 1 +
+			strlen(entries_arr[i].value) + 1);
+
+		uint32_t key_hash = dict_mmap_key_hash(entries_arr[i].key);
+		slot_idx = key_hash & mask;
+		while (hash[slot_idx].idx1 != 0)
+			slot_idx = (slot_idx + 1) & mask;
+		hash[slot_idx].hash = key_hash;
+		hash[slot_idx].idx1 = i + 1;
+	}
+
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, offsets, count * sizeof(uint32_t));
+	o_stream_nsend(output, hash,
+		       hdr.hash_size * sizeof(struct dict_mmap_hash_slot));
+	i_free(offsets);
+	i_free(hash);
+
+	for (i = 0; i < count; i++) {
+		rec.key_size = strlen(entries_arr[i].key);
+		rec.value_size = strlen(entries_arr[i].value);
+		size = sizeof(rec) + rec.key_size + 1 + rec.value_size + 1;
+
+		o_stream_nsend(output, &rec, sizeof(rec));
+		o_stream_nsend(output, entries_arr[i].key, rec.key_size + 1);
+		o_stream_nsend(output, entries_arr[i].value, rec.value_size + 1);
+		o_stream_nsend(output, padding,
+			       DICT_MMAP_RECORD_ALIGN(size) - size);
+	}
+	return 0;
+}
+
+static int
+mmap_dict_ensure_path_home_dir(struct mmap_dict *dict, const char *home_dir,
+			       const char **error_r)
+{
+	if (null_strcmp(dict->home_dir, home_dir) == 0)
+		return 0;
+
+	if (dict->dict_path_checked) {
+		*error_r = t_strdup_printf("home_dir changed from %s to %s "
+				"(requested dict was: %s)", dict->home_dir,
+				home_dir, dict->path);
+		return -1;
+	}
+
+	char *_p = dict->path;
+	dict->path = i_strdup(home_expand_tilde(dict->path, home_dir));
+	dict->home_dir = i_strdup(home_dir);
+	i_free(_p);
+	dict->dict_path_checked = TRUE;
+	return 0;
+}
+
+static const char *mmap_dict_get_log_path(struct mmap_dict *dict)
+{
+	return t_strconcat(dict->path, DICT_MMAP_LOG_SUFFIX, NULL);
+}
+
+static bool mmap_dict_fsync_mode_parse(const char *str, enum fsync_mode *mode_r)
+{
+	if (strcmp(str, "optimized") == 0)
+		*mode_r = FSYNC_MODE_OPTIMIZED;
+	else if (strcmp(str, "never") == 0)
+		*mode_r = FSYNC_MODE_NEVER;
+	else if (strcmp(str, "always") == 0)
+		*mode_r = FSYNC_MODE_ALWAYS;
+	else
+		return FALSE;
+	return TRUE;
+}
+
+static void mmap_dict_init_common(struct mmap_dict *dict)
+{
+	dict->overlay_pool = pool_alloconly_create("mmap dict overlay", 1024);
+	hash_table_create(&dict->overlay, dict->overlay_pool, 0,
+			  str_hash, strcmp);
+	dict->log_fd = -1;
+}
+
+static int
+mmap_dict_init(const struct dict *dict_driver, struct event *event,
+	       struct dict **dict_r, const char **error_r)
+{
+	struct dict_mmap_settings *set;
+	struct mmap_dict *dict;
+
+	if (settings_get(event, &dict_mmap_setting_parser_info, 0,
+			 &set, error_r) < 0)
+		return -1;
+
+	dict = i_new(struct mmap_dict, 1);
+	dict->path = i_strdup(set->dict_mmap_path);
+	dict->log_max_size = set->dict_mmap_log_max_size;
+	if (!file_lock_method_parse(set->dict_mmap_lock_method,
+				    &dict->lock_method))
+		i_unreached(); /* enum should have been checked already */
+	if (!mmap_dict_fsync_mode_parse(set->dict_mmap_fsync,
+					&dict->fsync_mode))
+		i_unreached(); /* enum should have been checked already */
+	settings_free(set);
+
+	dict->dict = *dict_driver;
+	mmap_dict_init_common(dict);
+	*dict_r = &dict->dict;
+	return 0;
+}
+
+static int
+mmap_dict_init_legacy(struct dict *driver, const char *uri,
+		      const struct dict_legacy_settings *set ATTR_UNUSED,
+		      struct dict **dict_r, const char **error_r)
+{
+	struct mmap_dict *dict;
+	const char *const *args, *value;
+
+	dict = i_new(struct mmap_dict, 1);
+	dict->lock_method = FILE_LOCK_METHOD_FCNTL;
+	dict->log_max_size = dict_mmap_default_settings.dict_mmap_log_max_size;
+
+	/* <path>[:lock=fcntl|flock][:fsync=optimized|never|always]
+	   [:log_max_size=<bytes>] */
+	args = t_strsplit(uri, ":");
+	for (unsigned int i = 1; args[i] != NULL; i++) {
+		if (strcmp(args[i], "lock=fcntl") == 0)
+			dict->lock_method = FILE_LOCK_METHOD_FCNTL;
+		else if (strcmp(args[i], "lock=flock") == 0)
+			dict->lock_method = FILE_LOCK_METHOD_FLOCK;
+		else if (str_begins(args[i], "fsync=", &value) &&
+			 mmap_dict_fsync_mode_parse(value, &dict->fsync_mode))
+			;
+		else if (str_begins(args[i], "log_max_size=", &value) &&
+			 str_to_uoff(value, &dict->log_max_size) == 0)
+			;
+		else {
+			*error_r = t_strdup_printf("Invalid parameter: %s",
+						   args[i]);
+			i_free(dict);
+			return -1;
+		}
+	}
+
+	/* keep the path for now, later in dict operations check if home_dir
+	   should be prepended. */
+	dict->path = i_strdup(args[0]);
+
+	dict->dict = *driver;
+	mmap_dict_init_common(dict);
+	*dict_r = &dict->dict;
+	return 0;
+}
+
+static void mmap_dict_log_close(struct mmap_dict *dict)
+{
+	i_close_fd_path(&dict->log_fd, mmap_dict_get_log_path(dict));
+	hash_table_clear(dict->overlay, TRUE);
+	p_clear(dict->overlay_pool);
+	dict->log_offset = 0;
+	dict->base_refreshed = FALSE;
+}
+
+static void mmap_dict_compact(struct mmap_dict *dict)
+{
+	struct file_lock *lock;
+	const char *error;
+	int ret;
+
+	timeout_remove(&dict->to_compact);
+
+	if (mmap_dict_lock(dict, &lock, &error) < 0) {
+		e_error(dict->dict.event, "Failed to compact %s: %s",
+			dict->path, error);
+		return;
+	}
+	/* refresh once more now that we're locked - someone else may have
+	   already compacted the files */
+	if ((ret = mmap_dict_refresh(dict, &error)) == 0 &&
+	    dict->log_offset >= dict->log_max_size)
+		ret = mmap_dict_compact_locked(dict, &lock, &error);
+	if (ret < 0) {
+		e_error(dict->dict.event, "Failed to compact %s: %s",
+			dict->path, error);
+	}
+	if (lock != NULL)
+		file_unlock(&lock);
+}
+
+static void mmap_dict_deinit(struct dict *_dict)
+{
+	struct mmap_dict *dict = (struct mmap_dict *)_dict;
+
+	/* Finish a pending compaction. The dict may not be used again in
+	   this process, so the log could otherwise keep growing. */
+	if (dict->to_compact != NULL)
+		mmap_dict_compact(dict);
+
+	mmap_dict_log_close(dict);
+	dict_mmap_file_unref(&dict->file);
+	hash_table_destroy(&dict->overlay);
+	pool_unref(&dict->overlay_pool);
+	i_free(dict->path);
+	i_free(dict->home_dir);
+	i_free(dict);
+}
+
+static bool mmap_dict_switch_ioloop(struct dict *_dict)
+{
+	struct mmap_dict *dict = (struct mmap_dict *)_dict;
+
+	if (dict->to_compact != NULL)
+		dict->to_compact = io_loop_move_timeout(&dict->to_compact);
+	return FALSE;
+}
+
+static bool mmap_dict_log_need_reopen(struct mmap_dict *dict)
+{
+	const char *log_path = mmap_dict_get_log_path(dict);
+	struct stat st1, st2;
+
+	if (dict->log_fd == -1)
+		return TRUE;
+
+	if (nfs_safe_stat(log_path, &st1) < 0) {
+		if (errno == ENOENT)
+			return TRUE;
+		e_error(dict->dict.event, "stat(%s) failed: %m", log_path);
+		return FALSE;
+	}
+	if (fstat(dict->log_fd, &st2) < 0) {
+		if (errno != ESTALE)
+			e_error(dict->dict.event, "fstat(%s) failed: %m", log_path);
+		return TRUE;
+	}
+	if (st1.st_ino != st2.st_ino ||
+	    !CMP_DEV_T(st1.st_dev, st2.st_dev)) {
+		/* log was replaced by compaction */
+		return TRUE;
+	}
+	dict->log_size = st2.st_size;
+	return FALSE;
+}
+
+/* Returns 1 if the log was reopened, 0 if it's unchanged, -1 on error. */
+static int mmap_dict_log_open_latest(struct mmap_dict *dict,
+				     const char **error_r)
+{
+	const char *log_path;
+
+	if (!mmap_dict_log_need_reopen(dict))
+		return 0;
+
+	mmap_dict_log_close(dict);
+	log_path = mmap_dict_get_log_path(dict);
+	dict->log_size = (uoff_t)-1;
+	dict->log_fd = open(log_path, O_RDWR | O_APPEND);
+	if (dict->log_fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		if (errno == EACCES)
+			*error_r = eacces_error_get("open", log_path);
+		else
+			*error_r = t_strdup_printf("open(%s) failed: %m", log_path);
+		return -1;
+	}
+	return 1;
+}
+
+static void
+mmap_dict_overlay_update(struct mmap_dict *dict, char *key, char *value)
+{
+	char *orig_key, *orig_value;
+
+	if (hash_table_lookup_full(dict->overlay, key, &orig_key, &orig_value))
+		hash_table_update(dict->overlay, orig_key, value);
+	else
+		hash_table_insert(dict->overlay, key, value);
+}
+
+static int mmap_dict_log_apply_line(struct mmap_dict *dict, const char *line)
+{
+	const char *p;
+	char *key, *value;
+
+	switch (line[0]) {
+	case 'S':
+		p = strchr(line + 1, '\t');
+		if (p == NULL)
+			return -1;
+		key = str_tabunescape(p_strdup_until(dict->overlay_pool,
+						     line + 1, p));
+		value = str_tabunescape(p_strdup(dict->overlay_pool, p + 1));
+		break;
+	case 'U':
+		key = str_tabunescape(p_strdup(dict->overlay_pool, line + 1));
+		value = dict_mmap_unset_value;
+		break;
+	default:
+		return -1;
+	}
+	mmap_dict_overlay_update(dict, key, value);
+	return 0;
+}
+
+static int mmap_dict_log_refresh(struct mmap_dict *dict, const char **error_r)
+{
+	struct istream *input;
+	const char *line;
+	int ret = 0;
+
+	if (mmap_dict_log_open_latest(dict, error_r) < 0)
+		return -1;
+	if (dict->log_fd == -1 || dict->log_size == dict->log_offset) {
+		/* nothing new in the log */
+		return 0;
+	}
+
+	input = i_stream_create_fd(dict->log_fd, SIZE_MAX);
+	i_stream_seek(input, dict->log_offset);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (mmap_dict_log_apply_line(dict, line) < 0) {
+			e_error(dict->dict.event,
+				"Corrupted dict log %s: Invalid line: %s",
+				mmap_dict_get_log_path(dict), line);
+		}
+	}
+	if (input->stream_errno != 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %s",
+					   mmap_dict_get_log_path(dict),
+					   i_stream_get_error(input));
+		ret = -1;
+	}
+	/* a partially written line is left unread */
+	dict->log_offset = input->v_offset;
+	i_stream_destroy(&input);
+	return ret;
+}
+
+static int mmap_dict_base_refresh(struct mmap_dict *dict, const char **error_r)
+{
+	struct dict_mmap_file *file;
+	struct stat st;
+	int fd, ret;
+
+	if (nfs_safe_stat(dict->path, &st) < 0) {
+		if (errno != ENOENT) {
+			*error_r = t_strdup_printf("stat(%s) failed: %m",
+						   dict->path);
+			return -1;
+		}
+		dict_mmap_file_unref(&dict->file);
+		dict->base_refreshed = TRUE;
+		return 0;
+	}
+	if (dict->file != NULL && dict->file->st_ino == st.st_ino &&
+	    CMP_DEV_T(dict->file->st_dev, st.st_dev)) {
+		dict->base_refreshed = TRUE;
+		return 0;
+	}
+
+	fd = open(dict->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			dict_mmap_file_unref(&dict->file);
+			dict->base_refreshed = TRUE;
+			return 0;
+		}
+		if (errno == EACCES)
+			*error_r = eacces_error_get("open", dict->path);
+		else
+			*error_r = t_strdup_printf("open(%s) failed: %m", dict->path);
+		return -1;
+	}
+	ret = dict_mmap_file_open(dict->path, fd, &file, error_r);
+	i_close_fd_path(&fd, dict->path);
+	if (ret < 0)
+		return -1;
+
+	dict_mmap_file_unref(&dict->file);
+	dict->file = file;
+	dict->base_refreshed = TRUE;
+	return 0;
+}
+
+static int mmap_dict_refresh(struct mmap_dict *dict, const char **error_r)
+{
+	/* Compaction replaces the base file before the log. Refreshing the
+	   log first guarantees that an already replaced log is never used
+	   together with the old base file. While the log stays the same, the
+	   base file doesn't need to be checked at all: the new base file is
+	   the old base file + the log, so applying the log on top of either
+	   gives the same result. */
+	if (mmap_dict_log_refresh(dict, error_r) < 0)
+		return -1;
+	if (dict->log_fd != -1 && dict->base_refreshed)
+		return 0;
+	return mmap_dict_base_refresh(dict, error_r);
+}
+
+/* Returns 1 if found, 0 if not, -1 on error. The returned value is valid
+   until the next refresh. */
+static int
+mmap_dict_lookup_value(struct mmap_dict *dict, const char *key,
+		       const char **value_r, const char **error_r)
+{
+	const char *value;
+
+	value = hash_table_lookup(dict->overlay, key);
+	if (value != NULL) {
+		if (value == dict_mmap_unset_value)
+			return 0;
+		*value_r = value;
+		return 1;
+	}
+	if (dict->file == NULL)
+		return 0;
+	return dict_mmap_file_lookup(dict->file, key, value_r, error_r);
+}
+
+static int mmap_dict_lookup(struct dict *_dict,
+			    const struct dict_op_settings *set,
+			    pool_t pool, const char *key,
+			    const char *const **values_r, const char **error_r)
+{
+	struct mmap_dict *dict = (struct mmap_dict *)_dict;
+	const char *value;
+	int ret;
+
+	if (mmap_dict_ensure_path_home_dir(dict, set->home_dir, error_r) < 0)
+		return -1;
+
+	if (mmap_dict_refresh(dict, error_r) < 0)
+		return -1;
+
+	if ((ret = mmap_dict_lookup_value(dict, key, &value, error_r)) <= 0)
+		return ret;
+
+	const char **values = p_new(pool, const char *, 2);
+	values[0] = p_strdup(pool, value);
+	*values_r = values;
+	return 1;
+}
+
+static int dict_mmap_entry_cmp(const struct dict_mmap_entry *e1,
+			       const struct dict_mmap_entry *e2)
+{
+	return strcmp(e1->key, e2->key);
+}
+
+/* Get the overlay entries beginning with the prefix, sorted by key. */
+static void
+mmap_dict_overlay_get_sorted(struct mmap_dict *dict, pool_t pool,
+			     const char *prefix,
+			     ARRAY_TYPE(dict_mmap_entry) *entries)
+{
+	struct hash_iterate_context *iter;
+	struct dict_mmap_entry *entry;
+	char *key, *value;
+
+	iter = hash_table_iterate_init(dict->overlay);
+	while (hash_table_iterate(iter, dict->overlay, &key, &value)) {
+		if (!str_begins_with(key, prefix))
+			continue;
+		entry = array_append_space(entries);
+		entry->key = p_strdup(pool, key);
+		entry->value = value == dict_mmap_unset_value ? NULL :
+			p_strdup(pool, value);
+	}
+	hash_table_iterate_deinit(&iter);
+	array_sort(entries, dict_mmap_entry_cmp);
+}
+
+static struct dict_iterate_context *
+mmap_dict_iterate_init(struct dict *_dict,
+		       const struct dict_op_settings *set,
+		       const char *path, enum dict_iterate_flags flags)
+{
+	struct mmap_dict_iterate_context *ctx;
+	struct mmap_dict *dict = (struct mmap_dict *)_dict;
+	const char *error;
+	pool_t pool;
+
+	pool = pool_alloconly_create("mmap dict iterate", 256);
+	ctx = p_new(pool, struct mmap_dict_iterate_context, 1);
+	ctx->ctx.dict = _dict;
+	ctx->pool = pool;
+
+	ctx->path = p_strdup(pool, path);
+	ctx->path_len = strlen(path);
+	ctx->flags = flags;
+	p_array_init(&ctx->overlay, pool, 8);
+
+	if (mmap_dict_ensure_path_home_dir(dict, set->home_dir, &error) < 0 ||
+	    mmap_dict_refresh(dict, &error) < 0) {
+		ctx->error = p_strdup(pool, error);
+		return &ctx->ctx;
+	}
+
+	mmap_dict_overlay_get_sorted(dict, pool, path, &ctx->overlay);
+	if (dict->file != NULL) {
+		ctx->file = dict->file;
+		ctx->file->refcount++;
+		if (dict_mmap_file_find_first(ctx->file, path, &ctx->base_idx,
+					      &error) < 0)
+			ctx->error = p_strdup(pool, error);
+	}
+	return &ctx->ctx;
+}
+
+/* Return the next key with the iteration prefix, merging the sorted base
+   file records with the sorted overlay. */
+static bool
+mmap_dict_iterate_next(struct mmap_dict_iterate_context *ctx,
+		       const char **key_r, const char **value_r)
+{
+	const struct dict_mmap_entry *entry;
+	const char *base_key, *base_value;
+	int diff;
+
+	for (;;) {
+		base_key = NULL;
+		if (ctx->file != NULL && ctx->base_idx < ctx->file->record_count) {
+			if (!dict_mmap_file_get_record(ctx->file, ctx->base_idx,
+						       &base_key, &base_value)) {
+				ctx->error = p_strdup(ctx->pool,
+					dict_mmap_file_corrupted(ctx->file,
+						t_strdup_printf("Broken record #%u",
+								ctx->base_idx)));
+				return FALSE;
+			}
+			if (strncmp(base_key, ctx->path, ctx->path_len) != 0) {
+				/* no more matching records */
+				ctx->base_idx = ctx->file->record_count;
+				base_key = NULL;
+			}
+		}
+		entry = ctx->overlay_idx < array_count(&ctx->overlay) ?
+			array_idx(&ctx->overlay, ctx->overlay_idx) : NULL;
+
+		if (base_key == NULL && entry == NULL)
+			return FALSE;
+		diff = base_key == NULL ? 1 :
+			(entry == NULL ? -1 : strcmp(base_key, entry->key));
+		if (diff < 0) {
+			ctx->base_idx++;
+			*key_r = base_key;
+			*value_r = base_value;
+			return TRUE;
+		}
+		if (diff == 0) {
+			/* overlay overrides the base record */
+			ctx->base_idx++;
+		}
+		ctx->overlay_idx++;
+		if (entry->value != NULL) {
+			*key_r = entry->key;
+			*value_r = entry->value;
+			return TRUE;
+		}
+	}
+}
+
+static bool mmap_dict_iterate(struct dict_iterate_context *_ctx,
+			      const char **key_r, const char *const **values_r)
+{
+	struct mmap_dict_iterate_context *ctx =
+		(struct mmap_dict_iterate_context *)_ctx;
+	const char *key, *value;
+
+	if (ctx->error != NULL)
+		return FALSE;
+
+	while (mmap_dict_iterate_next(ctx, &key, &value)) {
+		if ((ctx->flags & DICT_ITERATE_FLAG_RECURSE) != 0) {
+			/* match everything */
+		} else if ((ctx->flags & DICT_ITERATE_FLAG_EXACT_KEY) != 0) {
+			if (key[ctx->path_len] != '\0')
+				continue;
+		} else {
+			if (strchr(key + ctx->path_len, '/') != NULL)
+				continue;
+		}
+
+		*key_r = key;
+		ctx->values[0] = value;
+		*values_r = ctx->values;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static int mmap_dict_iterate_deinit(struct dict_iterate_context *_ctx,
+				    const char **error_r)
+{
+	struct mmap_dict_iterate_context *ctx =
+		(struct mmap_dict_iterate_context *)_ctx;
+	int ret = ctx->error != NULL ? -1 : 0;
+
+	*error_r = t_strdup(ctx->error);
+	dict_mmap_file_unref(&ctx->file);
+	pool_unref(&ctx->pool);
+	return ret;
+}
+
+static struct dict_transaction_context *
+mmap_dict_transaction_init(struct dict *_dict)
+{
+	struct dict_transaction_memory_context *ctx;
+	pool_t pool;
+
+	pool = pool_alloconly_create("mmap dict transaction", 2048);
+	ctx = p_new(pool, struct dict_transaction_memory_context, 1);
+	dict_transaction_memory_init(ctx, _dict, pool);
+	return &ctx->ctx;
+}
+
+static int mmap_dict_mkdir(struct mmap_dict *dict, const char **error_r)
+{
+	const char *path, *p, *root;
+	struct stat st;
+	mode_t mode = 0700;
+
+	p = strrchr(dict->path, '/');
+	if (p == NULL)
+		return 0;
+	path = t_strdup_until(dict->path, p);
+
+	if (stat_first_parent(path, &root, &st) < 0) {
+		if (errno == EACCES)
+			*error_r = eacces_error_get("stat", root);
+		else
+			*error_r = t_strdup_printf("stat(%s) failed: %m", root);
+		return -1;
+	}
+	if ((st.st_mode & S_ISGID) != 0) {
+		/* preserve parent's permissions when it has setgid bit */
+		mode = st.st_mode;
+	}
+
+	if (mkdir_parents(path, mode) < 0 && errno != EEXIST) {
+		if (errno == EACCES)
+			*error_r = eacces_error_get("mkdir_parents", path);
+		else
+			*error_r = t_strdup_printf("mkdir_parents(%s) failed: %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int mmap_dict_log_create(struct mmap_dict *dict, const char **error_r)
+{
+	const char *log_path = mmap_dict_get_log_path(dict);
+
+	dict->log_fd = open(log_path, O_CREAT | O_RDWR | O_APPEND, 0600);
+	if (dict->log_fd == -1 && errno == ENOENT) {
+		if (mmap_dict_mkdir(dict, error_r) < 0)
+			return -1;
+		dict->log_fd = open(log_path, O_CREAT | O_RDWR | O_APPEND, 0600);
+	}
+	if (dict->log_fd == -1) {
+		if (errno == EACCES)
+			*error_r = eacces_error_get("creat", log_path);
+		else
+			*error_r = t_strdup_printf("creat(%s) failed: %m", log_path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+mmap_dict_lock(struct mmap_dict *dict, struct file_lock **lock_r,
+	       const char **error_r)
+{
+	struct file_lock_settings lock_set = {
+		.lock_method = dict->lock_method,
+	};
+	const char *error;
+	int ret;
+
+	if (mmap_dict_log_open_latest(dict, error_r) < 0)
+		return -1;
+
+	*lock_r = NULL;
+	for (;;) {
+		if (dict->log_fd == -1) {
+			/* log doesn't exist yet, we need to create it */
+			if (mmap_dict_log_create(dict, error_r) < 0)
+				return -1;
+		}
+		if (file_wait_lock(dict->log_fd, mmap_dict_get_log_path(dict),
+				   F_WRLCK, &lock_set,
+				   DICT_MMAP_LOCK_TIMEOUT_SECS,
+				   lock_r, &error) <= 0) {
+			*error_r = t_strdup_printf(
+				"file_wait_lock(%s) failed: %s",
+				mmap_dict_get_log_path(dict), error);
+			return -1;
+		}
+		/* check again if we need to reopen the log because it was
+		   just replaced */
+		if ((ret = mmap_dict_log_open_latest(dict, error_r)) == 0)
+			return 0;
+		/* the locked fd was already closed */
+		file_lock_free(lock_r);
+		if (ret < 0)
+			return -1;
+	}
+}
+
+static void
+mmap_dict_log_add_change(struct mmap_dict *dict, string_t *str,
+			 const char *key, const char *value)
+{
+	char *overlay_value;
+
+	if (value != NULL) {
+		str_append_c(str, 'S');
+		str_append_tabescaped(str, key);
+		str_append_c(str, '\t');
+		str_append_tabescaped(str, value);
+		overlay_value = p_strdup(dict->overlay_pool, value);
+	} else {
+		str_append_c(str, 'U');
+		str_append_tabescaped(str, key);
+		overlay_value = dict_mmap_unset_value;
+	}
+	str_append_c(str, '\n');
+	mmap_dict_overlay_update(dict, p_strdup(dict->overlay_pool, key),
+				 overlay_value);
+}
+
+static int
+mmap_dict_apply_changes(struct dict_transaction_memory_context *ctx,
+			string_t *str, bool *atomic_inc_not_found_r,
+			const char **error_r)
+{
+	struct mmap_dict *dict = (struct mmap_dict *)ctx->ctx.dict;
+	const struct dict_transaction_memory_change *change;
+	const char *old_value;
+	long long num;
+	int ret;
+
+	array_foreach(&ctx->changes, change) {
+		switch (change->type) {
+		case DICT_CHANGE_TYPE_INC:
+			ret = mmap_dict_lookup_value(dict, change->key,
+						     &old_value, error_r);
+			if (ret < 0)
+				return -1;
+			if (ret == 0) {
+				*atomic_inc_not_found_r = TRUE;
+				break;
+			}
+			if (str_to_llong(old_value, &num) < 0) {
+				*error_r = t_strdup_printf(
+					"Key %s value isn't a number: %s",
+					change->key, old_value);
+				return -1;
+			}
+			mmap_dict_log_add_change(dict, str, change->key,
+				t_strdup_printf("%lld", num + change->value.diff));
+			break;
+		case DICT_CHANGE_TYPE_SET:
+			mmap_dict_log_add_change(dict, str, change->key,
+						 change->value.str);
+			break;
+		case DICT_CHANGE_TYPE_UNSET:
+			mmap_dict_log_add_change(dict, str, change->key, NULL);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+mmap_dict_log_append(struct mmap_dict *dict, const string_t *str,
+		     const char **error_r)
+{
+	const char *log_path = mmap_dict_get_log_path(dict);
+	struct stat st;
+
+	if (str_len(str) == 0)
+		return 0;
+
+	if (fstat(dict->log_fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", log_path);
+		return -1;
+	}
+	if ((uoff_t)st.st_size > dict->log_offset) {
+		/* a writer crashed in the middle of writing a line */
+		if (ftruncate(dict->log_fd, dict->log_offset) < 0) {
+			*error_r = t_strdup_printf("ftruncate(%s) failed: %m",
+						   log_path);
+			return -1;
+		}
+	}
+	if (write_full(dict->log_fd, str_data(str), str_len(str)) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", log_path);
+		return -1;
+	}
+	if (dict->fsync_mode == FSYNC_MODE_ALWAYS &&
+	    fdatasync(dict->log_fd) < 0) {
+		*error_r = t_strdup_printf("fdatasync(%s) failed: %m", log_path);
+		return -1;
+	}
+	dict->log_offset += str_len(str);
+	return 0;
+}
+
+static int
+mmap_dict_create_file(struct mmap_dict *dict, const char *path,
+		      const char **error_r)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("creat(%s) failed: %m", path);
+		return -1;
+	}
+	/* use the same permissions as the current log */
+	if (fstat(dict->log_fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   mmap_dict_get_log_path(dict));
+		i_close_fd(&fd);
+		return -1;
+	}
+	if ((st.st_mode & 07777) != 0600 &&
+	    fchmod(fd, st.st_mode & 07777) < 0) {
+		*error_r = t_strdup_printf("fchmod(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+mmap_dict_write_base(struct mmap_dict *dict, const char *temp_path,
+		     const ARRAY_TYPE(dict_mmap_entry) *entries,
+		     const char **error_r)
+{
+	struct ostream *output;
+	int fd;
+
+	if ((fd = mmap_dict_create_file(dict, temp_path, error_r)) == -1)
+		return -1;
+
+	output = o_stream_create_fd_autoclose(&fd, IO_BLOCK_SIZE);
+	o_stream_cork(output);
+	if (dict_mmap_file_write(output, entries, error_r) < 0) {
+		o_stream_abort(output);
+		o_stream_destroy(&output);
+		return -1;
+	}
+	if (o_stream_finish(output) <= 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %s", temp_path,
+					   o_stream_get_error(output));
+		o_stream_destroy(&output);
+		return -1;
+	}
+	/* the old log is deleted after the rename, so make sure the new
+	   base file doesn't get lost on crash */
+	if (dict->fsync_mode != FSYNC_MODE_NEVER &&
+	    fdatasync(o_stream_get_fd(output)) < 0) {
+		*error_r = t_strdup_printf("fdatasync(%s) failed: %m",
+					   temp_path);
+		o_stream_destroy(&output);
+		return -1;
+	}
+	o_stream_destroy(&output);
+	return 0;
+}
+
+static int mmap_dict_fsync_dir(struct mmap_dict *dict, const char **error_r)
+{
+	const char *p, *dir;
+
+	if (dict->fsync_mode == FSYNC_MODE_NEVER)
+		return 0;
+
+	p = strrchr(dict->path, '/');
+	dir = p == NULL ? "." : (p == dict->path ? "/" :
+				 t_strdup_until(dict->path, p));
+	if (fdatasync_path(dir) < 0) {
+		*error_r = t_strdup_printf("fdatasync(%s) failed: %m", dir);
+		return -1;
+	}
+	return 0;
+}
+
+/* Merge the base file and the log into a new base file and replace the log
+   with an empty one. The log must be locked and refreshed. If the log is
+   replaced, the lock is freed. */
+static int mmap_dict_compact_locked(struct mmap_dict *dict,
+				    struct file_lock **lock,
+				    const char **error_r)
+{
+	ARRAY_TYPE(dict_mmap_entry) overlay, entries;
+	const struct dict_mmap_entry *entry;
+	struct dict_mmap_entry *new_entry;
+	const char *base_key = NULL, *base_value = NULL;
+	const char *temp_path, *log_path, *temp_log_path;
+	unsigned int base_idx = 0, base_count, overlay_idx = 0;
+	pool_t pool;
+	int fd, diff, ret = 0;
+
+	base_count = dict->file == NULL ? 0 : dict->file->record_count;
+	pool = pool_alloconly_create("mmap dict compact", 1024);
+	p_array_init(&overlay, pool, hash_table_count(dict->overlay));
+	mmap_dict_overlay_get_sorted(dict, pool, "", &overlay);
+	i_array_init(&entries, base_count + array_count(&overlay));
+
+	while (base_idx < base_count || overlay_idx < array_count(&overlay)) {
+		if (base_idx < base_count &&
+		    !dict_mmap_file_get_record(dict->file, base_idx,
+					       &base_key, &base_value)) {
+			*error_r = dict_mmap_file_corrupted(dict->file,
+				t_strdup_printf("Broken record #%u", base_idx));
+			ret = -1;
+			break;
+		}
+		entry = overlay_idx < array_count(&overlay) ?
+			array_idx(&overlay, overlay_idx) : NULL;
+		diff = base_idx == base_count ? 1 :
+			(entry == NULL ? -1 : strcmp(base_key, entry->key));
+		if (diff < 0) {
+			new_entry = array_append_space(&entries);
+			new_entry->key = base_key;
+			new_entry->value = base_value;
+			base_idx++;
+			continue;
+		}
+		if (diff == 0)
+			base_idx++;
+		overlay_idx++;
+		if (entry->value != NULL)
+			array_push_back(&entries, entry);
+	}
+
+	temp_path = t_strconcat(dict->path, ".tmp", NULL);
+	if (ret == 0 &&
+	    (ret = mmap_dict_write_base(dict, temp_path, &entries, error_r)) < 0)
+		i_unlink_if_exists(temp_path);
+	array_free(&entries);
+	pool_unref(&pool);
+	if (ret < 0)
+		return -1;
+
+	if (rename(temp_path, dict->path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, dict->path);
+		i_unlink_if_exists(temp_path);
+		return -1;
+	}
+	/* the rename must be on disk before the log is emptied */
+	if (mmap_dict_fsync_dir(dict, error_r) < 0)
+		return -1;
+
+	/* The new base file contains everything in the log. Replace the log
+	   with an empty one. If this fails, the old log is just applied on top
+	   of the new base file. */
+	log_path = mmap_dict_get_log_path(dict);
+	temp_log_path = t_strconcat(log_path, ".tmp", NULL);
+	if ((fd = mmap_dict_create_file(dict, temp_log_path, error_r)) == -1)
+		return -1;
+	i_close_fd_path(&fd, temp_log_path);
+	if (rename(temp_log_path, log_path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_log_path, log_path);
+		i_unlink_if_exists(temp_log_path);
+		return -1;
+	}
+	if (mmap_dict_fsync_dir(dict, error_r) < 0)
+		return -1;
+	e_debug(dict->dict.event, "Compacted %s (%"PRIuUOFF_T" bytes of log)",
+		dict->path, dict->log_offset);
+
+	/* dict->log_fd is locked, not the new log. We're closing the old log
+	   so we can just free the lock struct. */
+	file_lock_free(lock);
+	mmap_dict_log_close(dict);
+	return mmap_dict_refresh(dict, error_r);
+}
+
+static int
+mmap_dict_write_changes(struct dict_transaction_memory_context *ctx,
+			bool *atomic_inc_not_found_r, const char **error_r)
+{
+	struct mmap_dict *dict = (struct mmap_dict *)ctx->ctx.dict;
+	struct file_lock *lock;
+	const char *error;
+	string_t *str;
+
+	*atomic_inc_not_found_r = FALSE;
+
+	if (mmap_dict_ensure_path_home_dir(dict, ctx->ctx.set.home_dir, error_r) < 0)
+		return -1;
+	if (array_count(&ctx->changes) == 0)
+		return 0;
+
+	if (mmap_dict_lock(dict, &lock, error_r) < 0)
+		return -1;
+	/* refresh once more now that we're locked */
+	if (mmap_dict_refresh(dict, error_r) < 0) {
+		file_unlock(&lock);
+		return -1;
+	}
+
+	str = t_str_new(256);
+	if (mmap_dict_apply_changes(ctx, str, atomic_inc_not_found_r,
+				    error_r) < 0 ||
+	    mmap_dict_log_append(dict, str, error_r) < 0) {
+		/* the overlay may already contain some of the changes -
+		   read it again from the log */
+		file_unlock(&lock);
+		mmap_dict_log_close(dict);
+		return -1;
+	}
+
+	if (dict->log_offset >= dict->log_max_size) {
+		if (current_ioloop != NULL) {
+			/* compact after the commit callback is called */
+			if (dict->to_compact == NULL) {
+				dict->to_compact = timeout_add_short(0,
+					mmap_dict_compact, dict);
+			}
+		} else if (mmap_dict_compact_locked(dict, &lock, &error) < 0) {
+			/* the changes were already written successfully */
+			e_error(ctx->ctx.event, "Failed to compact %s: %s",
+				dict->path, error);
+		}
+	}
+	if (lock != NULL)
+		file_unlock(&lock);
+	return 0;
+}
+
+static void
+mmap_dict_transaction_commit(struct dict_transaction_context *_ctx,
+			     bool async ATTR_UNUSED,
+			     dict_transaction_commit_callback_t *callback,
+			     void *context)
+{
+	struct dict_transaction_memory_context *ctx =
+		(struct dict_transaction_memory_context *)_ctx;
+	struct dict_commit_result result;
+	bool atomic_inc_not_found;
+
+	i_zero(&result);
+	if (mmap_dict_write_changes(ctx, &atomic_inc_not_found, &result.error) < 0)
+		result.ret = DICT_COMMIT_RET_FAILED;
+	else if (atomic_inc_not_found)
+		result.ret = DICT_COMMIT_RET_NOTFOUND;
+	else
+		result.ret = DICT_COMMIT_RET_OK;
+	pool_unref(&ctx->pool);
+
+	callback(&result, context);
+}
+
+struct dict dict_driver_mmap = {
+	.name = "mmap",
+	.v = {
+		.init = mmap_dict_init,
+		.init_legacy = mmap_dict_init_legacy,
+		.deinit = mmap_dict_deinit,
+		.lookup = mmap_dict_lookup,
+		.iterate_init = mmap_dict_iterate_init,
+		.iterate = mmap_dict_iterate,
+		.iterate_deinit = mmap_dict_iterate_deinit,
+		.transaction_init = mmap_dict_transaction_init,
+		.transaction_commit = mmap_dict_transaction_commit,
+		.transaction_rollback = dict_transaction_memory_rollback,
+		.set = dict_transaction_memory_set,
+		.unset = dict_transaction_memory_unset,
+		.atomic_inc = dict_transaction_memory_atomic_inc,
+		.switch_ioloop = mmap_dict_switch_ioloop,
+	}
+};
@@ -119,6 +119,7 @@ void dict_transaction_commit_async_noop_callback(
 
 extern struct dict dict_driver_client;
 extern struct dict dict_driver_file;
+extern struct dict dict_driver_mmap;
 extern struct dict dict_driver_fs;
 extern struct dict dict_driver_redis;
 extern struct dict dict_driver_cdb;
@@ -127,6 +128,10 @@ extern struct dict dict_driver_fail;
 extern struct dict_iterate_context dict_iter_unsupported;
 extern struct dict_transaction_context dict_transaction_unsupported;
 
+/* Close the connections inherited from the parent process. */
+void dict_client_forked(void);
+void dict_redis_forked(void);
+
 void dict_pre_api_callback(struct dict *dict);
 void dict_post_api_callback(struct dict *dict);
 
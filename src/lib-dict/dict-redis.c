@@ -175,6 +175,27 @@ redis_disconnected(struct redis_connection *conn, const char *reason)
 		io_loop_stop(conn->dict->dict.ioloop);
 }
 
+void dict_redis_forked(void)
+{
+	struct connection *_conn;
+
+	if (redis_connections == NULL)
+		return;
+	for (_conn = redis_connections->connections; _conn != NULL;
+	     _conn = _conn->next) {
+		struct redis_connection *conn =
+			(struct redis_connection *)_conn;
+
+		/* the replies are still waited for by the parent process */
+		conn->dict->db_id_set = FALSE;
+		conn->dict->connected = FALSE;
+		connection_forked(_conn);
+		array_clear(&conn->dict->replies);
+		array_clear(&conn->dict->input_states);
+		timeout_remove(&conn->dict->to);
+	}
+}
+
 static void redis_conn_destroy(struct connection *_conn)
 {
 	struct redis_connection *conn = (struct redis_connection *)_conn;
@@ -99,6 +99,10 @@ void dict_driver_unregister(struct dict *driver);
 
 void dict_drivers_register_builtin(void);
 void dict_drivers_unregister_builtin(void);
+/* Must be called by a fork()ed child process that keeps using the dicts it
+   inherited. The dict server connections are shared with the parent
+   process, so they're closed and reconnected when needed. */
+void dict_drivers_forked(void);
 
 void dict_drivers_register_all(void);
 void dict_drivers_unregister_all(void);
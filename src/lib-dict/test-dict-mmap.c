@@ -0,0 +1,302 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "dict-private.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_DICT_PATH ".test-dict-mmap"
+#define TEST_DICT_LOG_PATH TEST_DICT_PATH".log"
+
+static const struct dict_op_settings test_op_set = {
+	.username = "testuser",
+};
+
+static struct dict *test_dict_init(const char *params)
+{
+	struct dict_legacy_settings set = {
+		.base_dir = ".",
+	};
+	struct dict *dict;
+	const char *error;
+
+	if (dict_init_legacy(t_strconcat("mmap:"TEST_DICT_PATH, params, NULL),
+			     &set, &dict, &error) < 0)
+		i_fatal("dict_init() failed: %s", error);
+	return dict;
+}
+
+static void test_dict_cleanup(void)
+{
+	i_unlink_if_exists(TEST_DICT_PATH);
+	i_unlink_if_exists(TEST_DICT_LOG_PATH);
+}
+
+static const char *test_dict_lookup(struct dict *dict, const char *key)
+{
+	const char *value, *error;
+	int ret;
+
+	ret = dict_lookup(dict, &test_op_set, pool_datastack_create(), key,
+			  &value, &error);
+	if (ret < 0)
+		i_fatal("dict_lookup(%s) failed: %s", key, error);
+	return ret == 0 ? NULL : value;
+}
+
+static void test_dict_set(struct dict *dict, const char *key, const char *value)
+{
+	struct dict_transaction_context *t;
+	const char *error;
+
+	t = dict_transaction_begin(dict, &test_op_set);
+	if (value != NULL)
+		dict_set(t, key, value);
+	else
+		dict_unset(t, key);
+	if (dict_transaction_commit(&t, &error) < 0)
+		i_fatal("dict_transaction_commit(%s) failed: %s", key, error);
+}
+
+static const char *test_dict_iterate(struct dict *dict, const char *path,
+				     enum dict_iterate_flags flags)
+{
+	struct dict_iterate_context *iter;
+	const char *key, *value, *error;
+	string_t *str = t_str_new(128);
+
+	iter = dict_iterate_init(dict, &test_op_set, path, flags);
+	while (dict_iterate(iter, &key, &value))
+		str_printfa(str, "%s=%s,", key, value);
+	test_assert(dict_iterate_deinit(&iter, &error) == 0);
+	return str_c(str);
+}
+
+static off_t test_file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		if (errno == ENOENT)
+			return -1;
+		i_fatal("stat(%s) failed: %m", path);
+	}
+	return st.st_size;
+}
+
+static void test_dict_mmap_set_get(void)
+{
+	struct dict_transaction_context *t;
+	struct dict *dict, *dict2;
+	const char *error;
+
+	test_begin("dict-mmap set/get");
+	test_dict_cleanup();
+	dict = test_dict_init("");
+	dict2 = test_dict_init("");
+
+	test_assert(test_dict_lookup(dict, "shared/key1") == NULL);
+	test_dict_set(dict, "shared/key1", "value1");
+	test_dict_set(dict, "shared/key\twith\nescapes", "value\t\001\n");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key1"), "value1");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key\twith\nescapes"),
+			   "value\t\001\n");
+	/* the changes are only in the log */
+	test_assert(test_file_size(TEST_DICT_PATH) == -1);
+	test_assert_strcmp(test_dict_lookup(dict2, "shared/key1"), "value1");
+
+	/* increments */
+	t = dict_transaction_begin(dict2, &test_op_set);
+	dict_set(t, "shared/counter", "10");
+	dict_atomic_inc(t, "shared/counter", 5);
+	test_assert(dict_transaction_commit(&t, &error) == DICT_COMMIT_RET_OK);
+	t = dict_transaction_begin(dict, &test_op_set);
+	dict_atomic_inc(t, "shared/counter", -20);
+	test_assert(dict_transaction_commit(&t, &error) == DICT_COMMIT_RET_OK);
+	test_assert_strcmp(test_dict_lookup(dict2, "shared/counter"), "-5");
+	t = dict_transaction_begin(dict, &test_op_set);
+	dict_atomic_inc(t, "shared/nonexistent", 1);
+	test_assert(dict_transaction_commit(&t, &error) == DICT_COMMIT_RET_NOTFOUND);
+
+	/* unset */
+	test_dict_set(dict2, "shared/key1", NULL);
+	test_assert(test_dict_lookup(dict, "shared/key1") == NULL);
+
+	dict_deinit(&dict);
+	dict_deinit(&dict2);
+	test_dict_cleanup();
+	test_end();
+}
+
+static void test_dict_mmap_compact(void)
+{
+	struct dict *dict, *dict2;
+	char key[32];
+
+	test_begin("dict-mmap compact");
+	test_dict_cleanup();
+	dict = test_dict_init(":fsync=always:log_max_size=100");
+	dict2 = test_dict_init("");
+
+	for (unsigned int i = 0; i < 100; i++) {
+		i_snprintf(key, sizeof(key), "shared/key%u", i);
+		test_dict_set(dict, key, dec2str(i));
+	}
+	test_dict_set(dict, "shared/key0", NULL);
+	test_assert(test_file_size(TEST_DICT_PATH) > 0);
+	test_assert(test_file_size(TEST_DICT_LOG_PATH) < 100);
+
+	/* the other dict notices the replaced base file and log */
+	test_assert(test_dict_lookup(dict2, "shared/key0") == NULL);
+	test_assert_strcmp(test_dict_lookup(dict2, "shared/key1"), "1");
+	test_assert_strcmp(test_dict_lookup(dict2, "shared/key99"), "99");
+	test_dict_set(dict2, "shared/key1", "updated");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key1"), "updated");
+	test_assert(test_dict_lookup(dict, "shared/key100") == NULL);
+
+	dict_deinit(&dict);
+	dict_deinit(&dict2);
+
+	dict = test_dict_init("");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key1"), "updated");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key50"), "50");
+	dict_deinit(&dict);
+	test_dict_cleanup();
+	test_end();
+}
+
+static void test_dict_mmap_iterate(void)
+{
+	struct dict_iterate_context *iter;
+	struct dict *dict;
+	const char *key, *value, *error;
+	unsigned int count = 0;
+
+	test_begin("dict-mmap iterate");
+	test_dict_cleanup();
+	dict = test_dict_init(":log_max_size=0");
+	test_dict_set(dict, "shared/a/1", "a1");
+	test_dict_set(dict, "shared/a/2", "a2");
+	test_dict_set(dict, "shared/a/3/x", "a3x");
+	test_dict_set(dict, "shared/b", "b");
+	dict_deinit(&dict);
+
+	/* base file has everything, overlay changes it */
+	dict = test_dict_init("");
+	test_dict_set(dict, "shared/a/2", NULL);
+	test_dict_set(dict, "shared/a/1", "updated");
+	test_dict_set(dict, "shared/a/15", "a15");
+	test_assert(test_file_size(TEST_DICT_LOG_PATH) > 0);
+
+	test_assert_strcmp(test_dict_iterate(dict, "shared/a/", 0),
+			   "shared/a/1=updated,shared/a/15=a15,");
+	test_assert_strcmp(test_dict_iterate(dict, "shared/a/",
+					     DICT_ITERATE_FLAG_RECURSE),
+			   "shared/a/1=updated,shared/a/15=a15,shared/a/3/x=a3x,");
+	test_assert_strcmp(test_dict_iterate(dict, "shared/a/1",
+					     DICT_ITERATE_FLAG_EXACT_KEY),
+			   "shared/a/1=updated,");
+	test_assert_strcmp(test_dict_iterate(dict, "shared/c/", 0), "");
+	test_assert_strcmp(test_dict_iterate(dict, "shared/",
+					     DICT_ITERATE_FLAG_RECURSE),
+			   "shared/a/1=updated,shared/a/15=a15,shared/a/3/x=a3x,shared/b=b,");
+	dict_deinit(&dict);
+
+	/* the base file is replaced while iterating */
+	dict = test_dict_init(":log_max_size=0");
+	iter = dict_iterate_init(dict, &test_op_set, "shared/",
+				 DICT_ITERATE_FLAG_RECURSE);
+	test_assert(dict_iterate(iter, &key, &value));
+	test_assert_strcmp(key, "shared/a/1");
+	test_dict_set(dict, "shared/a/3/x", NULL);
+	while (dict_iterate(iter, &key, &value))
+		count++;
+	test_assert(count == 3);
+	test_assert(dict_iterate_deinit(&iter, &error) == 0);
+	test_assert_strcmp(test_dict_iterate(dict, "shared/a/3/", 0), "");
+	dict_deinit(&dict);
+	test_dict_cleanup();
+	test_end();
+}
+
+static void test_dict_mmap_partial_log(void)
+{
+	static const char partial[] = "Sshared/partial\tval";
+	struct dict *dict;
+	int fd;
+
+	test_begin("dict-mmap partial log line");
+	test_dict_cleanup();
+	dict = test_dict_init("");
+	test_dict_set(dict, "shared/key1", "value1");
+
+	/* simulate a crash in the middle of writing */
+	fd = open(TEST_DICT_LOG_PATH, O_WRONLY | O_APPEND);
+	if (fd == -1)
+		i_fatal("open("TEST_DICT_LOG_PATH") failed: %m");
+	if (write_full(fd, partial, strlen(partial)) < 0)
+		i_fatal("write("TEST_DICT_LOG_PATH") failed: %m");
+	i_close_fd(&fd);
+
+	test_assert(test_dict_lookup(dict, "shared/partial") == NULL);
+	test_dict_set(dict, "shared/key2", "value2");
+	test_assert(test_dict_lookup(dict, "shared/partial") == NULL);
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key2"), "value2");
+	dict_deinit(&dict);
+
+	dict = test_dict_init("");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key1"), "value1");
+	test_assert_strcmp(test_dict_lookup(dict, "shared/key2"), "value2");
+	test_assert(test_dict_lookup(dict, "shared/partial") == NULL);
+	dict_deinit(&dict);
+	test_dict_cleanup();
+	test_end();
+}
+
+static void test_dict_mmap_corrupted(void)
+{
+	static const unsigned char garbage[32] = { 1, 2, 3, 4 };
+	struct dict *dict;
+	const char *value, *error;
+	int fd;
+
+	test_begin("dict-mmap corrupted base file");
+	test_dict_cleanup();
+	fd = creat(TEST_DICT_PATH, 0600);
+	if (fd == -1)
+		i_fatal("creat("TEST_DICT_PATH") failed: %m");
+	if (write_full(fd, garbage, sizeof(garbage)) < 0)
+		i_fatal("write("TEST_DICT_PATH") failed: %m");
+	i_close_fd(&fd);
+
+	dict = test_dict_init("");
+	test_assert(dict_lookup(dict, &test_op_set, pool_datastack_create(),
+				"shared/key", &value, &error) < 0);
+	test_assert(strstr(error, "Invalid magic") != NULL);
+	dict_deinit(&dict);
+	test_dict_cleanup();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_dict_mmap_set_get,
+		test_dict_mmap_compact,
+		test_dict_mmap_iterate,
+		test_dict_mmap_partial_log,
+		test_dict_mmap_corrupted,
+		NULL
+	};
+	int ret;
+
+	dict_driver_register(&dict_driver_mmap);
+	ret = test_run(test_functions);
+	dict_driver_unregister(&dict_driver_mmap);
+	return ret;
+}
@@ -29,6 +29,8 @@ struct imapc_client {
 	void *login_context;
 
 	ARRAY(struct imapc_client_connection *) conns;
+	/* counters of the connections that have already been freed */
+	struct imapc_client_stats freed_conns_stats;
 	bool logging_out;
 
 	struct ioloop *ioloop;
@@ -92,6 +92,7 @@ imapc_client_init(const struct imapc_client_settings *set,
 		set->cmd_timeout_msecs : IMAPC_DEFAULT_COMMAND_TIMEOUT_MSECS;
 	client->set.max_line_length = set->max_line_length != 0 ?
 		set->max_line_length : IMAPC_DEFAULT_MAX_LINE_LENGTH;
+	client->set.max_pipelined_commands = set->max_pipelined_commands;
 	client->set.throttle_set = set->throttle_set;
 
 	if (client->set.throttle_set.init_msecs == 0)
@@ -124,6 +125,31 @@ void imapc_client_ref(struct imapc_client *client)
 	client->refcount++;
 }
 
+static void imapc_client_send_finished_event(struct imapc_client *client)
+{
+	struct imapc_client_stats stats;
+
+	imapc_client_get_stats(client, &stats);
+	if (stats.commands_finished == 0)
+		return;
+
+	struct event_passthrough *e = event_create_passthrough(client->event)->
+		set_name("imapc_client_finished")->
+		add_int("commands_finished", stats.commands_finished)->
+		add_int("rtt_usecs_avg",
+			stats.rtt_usecs_sum / stats.commands_finished)->
+		add_int("rtt_usecs_max", stats.rtt_usecs_max)->
+		add_int("bytes_in", stats.bytes_in)->
+		add_int("bytes_out", stats.bytes_out)->
+		add_int("max_commands_in_flight", stats.max_commands_in_flight);
+	e_debug(e->event(), "%u commands finished, "
+		"avg RTT %"PRIu64" us, max RTT %"PRIu64" us, "
+		"in=%"PRIuUOFF_T" bytes, out=%"PRIuUOFF_T" bytes",
+		stats.commands_finished,
+		stats.rtt_usecs_sum / stats.commands_finished,
+		stats.rtt_usecs_max, stats.bytes_in, stats.bytes_out);
+}
+
 void imapc_client_unref(struct imapc_client **_client)
 {
 	struct imapc_client *client = *_client;
@@ -134,6 +160,7 @@ void imapc_client_unref(struct imapc_client **_client)
 	if (--client->refcount > 0)
 		return;
 
+	imapc_client_send_finished_event(client);
 	if (client->ssl_ctx != NULL)
 		ssl_iostream_context_unref(&client->ssl_ctx);
 	event_unref(&client->event);
@@ -151,6 +178,8 @@ void imapc_client_disconnect(struct imapc_client *client)
 		array_delete(&client->conns, i-1, 1);
 
 		i_assert(imapc_connection_get_mailbox(conn->conn) == NULL);
+		imapc_connection_add_stats(conn->conn,
+					   &client->freed_conns_stats);
 		imapc_connection_deinit(&conn->conn);
 		i_free(conn);
 	}
@@ -542,6 +571,16 @@ int imapc_client_get_capabilities(struct imapc_client *client,
 	return -1;
 }
 
+void imapc_client_get_stats(struct imapc_client *client,
+			    struct imapc_client_stats *stats_r)
+{
+	struct imapc_client_connection *conn;
+
+	*stats_r = client->freed_conns_stats;
+	array_foreach_elem(&client->conns, conn)
+		imapc_connection_add_stats(conn->conn, stats_r);
+}
+
 int imapc_client_create_temp_fd(struct imapc_client *client,
 				const char **path_r)
 {
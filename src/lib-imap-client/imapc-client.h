@@ -118,6 +118,10 @@ struct imapc_client_settings {
 	   streams). 0 = unlimited. */
 	size_t max_line_length;
 
+	/* Maximum number of commands sent to server while waiting for their
+	   tagged replies. 0 = unlimited. */
+	unsigned int max_pipelined_commands;
+
 	struct imapc_throttling_settings throttle_set;
 };
 
@@ -133,6 +137,19 @@ struct imapc_command_reply {
 	const char *text_without_resp;
 };
 
+struct imapc_client_stats {
+	/* Number of commands that have received their tagged reply */
+	unsigned int commands_finished;
+	/* Sum and maximum of the time between fully sending a command and
+	   receiving its tagged reply */
+	uint64_t rtt_usecs_sum, rtt_usecs_max;
+	/* Bytes read from and written to the server (before SSL) */
+	uoff_t bytes_in, bytes_out;
+	/* Highest number of commands that were waiting for a tagged reply
+	   at the same time */
+	unsigned int max_commands_in_flight;
+};
+
 struct imapc_arg_file {
 	/* file descriptor containing the value */
 	int fd;
@@ -246,6 +263,12 @@ bool imapc_client_mailbox_is_opened(struct imapc_client_mailbox *box);
 int imapc_client_get_capabilities(struct imapc_client *client,
 				  enum imapc_capability *capabilities_r);
 
+/* Get the RTT and throughput counters summed over all the client's
+   connections, including the connections that have already been
+   disconnected. */
+void imapc_client_get_stats(struct imapc_client *client,
+			    struct imapc_client_stats *stats_r);
+
 int imapc_client_create_temp_fd(struct imapc_client *client,
 				const char **path_r);
 
@@ -59,6 +59,8 @@ struct imapc_command {
 	void *context;
 
 	struct timeval start_time;
+	/* When the command was fully sent to the server */
+	struct timeval sent_time;
 
 	/* This is the AUTHENTICATE command */
 	bool authenticate:1;
@@ -149,6 +151,10 @@ struct imapc_connection {
 	struct timeval throttle_end_timeval;
 	struct timeout *to_throttle, *to_throttle_shrink;
 
+	/* RTT and throughput counters. bytes_in/out contain only the
+	   traffic of the previous (disconnected) connections. */
+	struct imapc_client_stats stats;
+
 	bool reconnecting:1;
 	bool reconnect_waiting:1;
 	bool reconnect_ok:1;
@@ -481,10 +487,17 @@ void imapc_connection_disconnect_full(struct imapc_connection *conn,
 	if (conn->parser != NULL)
 		imap_parser_unref(&conn->parser);
 	io_remove(&conn->io);
+	if (conn->fd != -1) {
+		conn->stats.bytes_in +=
+			i_stream_get_absolute_offset(conn->raw_input);
+		conn->stats.bytes_out += conn->raw_output->offset;
+	}
 	ssl_iostream_destroy(&conn->ssl_iostream);
 	if (conn->fd != -1) {
 		i_stream_destroy(&conn->input);
 		o_stream_destroy(&conn->output);
+		conn->raw_input = NULL;
+		conn->raw_output = NULL;
 		net_disconnect(conn->fd);
 		conn->fd = -1;
 	}
@@ -1505,6 +1518,17 @@ static int imapc_connection_input_tagged(struct imapc_connection *conn)
 	}
 	if ((cmd->flags & IMAPC_COMMAND_FLAG_SELECT) != 0)
 		conn->select_waiting_reply = FALSE;
+	if (cmd->sent) {
+		long long rtt_usecs =
+			timeval_diff_usecs(&ioloop_timeval, &cmd->sent_time);
+
+		if (rtt_usecs < 0)
+			rtt_usecs = 0;
+		conn->stats.commands_finished++;
+		conn->stats.rtt_usecs_sum += rtt_usecs;
+		conn->stats.rtt_usecs_max =
+			I_MAX(conn->stats.rtt_usecs_max, (uint64_t)rtt_usecs);
+	}
 
 	if (reply.state == IMAPC_COMMAND_STATE_BAD) {
 		e_error(conn->event, "Command '%s' failed with BAD: %u %s",
@@ -2089,12 +2113,16 @@ static void imapc_command_send_finished(struct imapc_connection *conn,
 	if (cmd->idle)
 		conn->idle_plus_waiting = TRUE;
 	cmd->sent = TRUE;
+	cmd->sent_time = ioloop_timeval;
 
 	/* everything sent. move command to wait list. */
 	cmdp = array_front(&conn->cmd_send_queue);
 	i_assert(*cmdp == cmd);
 	array_pop_front(&conn->cmd_send_queue);
 	array_push_back(&conn->cmd_wait_list, &cmd);
+	conn->stats.max_commands_in_flight =
+		I_MAX(conn->stats.max_commands_in_flight,
+		      array_count(&conn->cmd_wait_list));
 
 	/* send the next command in queue */
 	imapc_command_send_more(conn);
@@ -2228,6 +2256,13 @@ static void imapc_command_send_more(struct imapc_connection *conn)
 		/* wait until existing commands have finished */
 		return;
 	}
+	if (conn->client->set.max_pipelined_commands > 0 &&
+	    cmd->send_pos == 0 &&
+	    array_count(&conn->cmd_wait_list) >=
+	    conn->client->set.max_pipelined_commands) {
+		/* wait for some of the pipelined commands to finish */
+		return;
+	}
 	if (conn->select_waiting_reply) {
 		/* wait for SELECT to finish */
 		return;
@@ -2588,6 +2623,24 @@ void imapc_connection_idle(struct imapc_connection *conn)
 	imapc_command_send(cmd, "IDLE");
 }
 
+void imapc_connection_add_stats(struct imapc_connection *conn,
+				struct imapc_client_stats *stats)
+{
+	stats->commands_finished += conn->stats.commands_finished;
+	stats->rtt_usecs_sum += conn->stats.rtt_usecs_sum;
+	stats->rtt_usecs_max = I_MAX(stats->rtt_usecs_max,
+				     conn->stats.rtt_usecs_max);
+	stats->bytes_in += conn->stats.bytes_in;
+	stats->bytes_out += conn->stats.bytes_out;
+	if (conn->fd != -1) {
+		stats->bytes_in +=
+			i_stream_get_absolute_offset(conn->raw_input);
+		stats->bytes_out += conn->raw_output->offset;
+	}
+	stats->max_commands_in_flight = I_MAX(stats->max_commands_in_flight,
+					      conn->stats.max_commands_in_flight);
+}
+
 struct event *imapc_connection_get_event(struct imapc_connection *conn)
 {
 	return conn->event;
@@ -60,6 +60,9 @@ struct imapc_client_mailbox *
 imapc_connection_get_mailbox(struct imapc_connection *conn);
 
 void imapc_connection_idle(struct imapc_connection *conn);
+/* Add the connection's counters to stats. */
+void imapc_connection_add_stats(struct imapc_connection *conn,
+				struct imapc_client_stats *stats);
 struct event *imapc_connection_get_event(struct imapc_connection *conn);
 
 #endif
@@ -836,6 +836,74 @@ static void test_imapc_client_get_capabilities_disconnected(void)
 	test_end();
 }
 
+/*
+ * imapc pipelining limit
+ */
+
+static void test_imapc_pipelining_limit_client(void)
+{
+	struct imapc_client_stats stats;
+	struct imapc_command *cmd;
+	unsigned int i;
+
+	imapc_client_set_login_callback(imapc_client,
+					imapc_login_callback, NULL);
+	imapc_client_login(imapc_client);
+	imapc_client_run(imapc_client);
+	test_assert(imapc_login_last_reply == IMAPC_COMMAND_STATE_OK);
+
+	for (i = 1; i <= 4; i++) {
+		cmd = imapc_client_cmd(imapc_client, imapc_command_callback,
+				       NULL);
+		imapc_command_sendf(cmd, "CMD%u", i);
+	}
+	for (i = 1; i <= 4; i++) {
+		test_assert_idx(test_imapc_cmd_last_reply_expect(
+			IMAPC_COMMAND_STATE_OK), i);
+	}
+
+	imapc_client_get_stats(imapc_client, &stats);
+	/* LOGIN + 4 commands */
+	test_assert(stats.commands_finished == 5);
+	test_assert(stats.max_commands_in_flight == 2);
+	test_assert(stats.rtt_usecs_max <= stats.rtt_usecs_sum);
+	test_assert(stats.bytes_in > 0);
+	test_assert(stats.bytes_out > 0);
+}
+
+static void test_imapc_pipelining_limit_server(void)
+{
+	test_server_wait_connection(&server, TRUE);
+	test_assert(test_imapc_server_expect(
+		"1 LOGIN \"testuser\" \"testpass\""));
+	o_stream_nsend_str(server.output, "1 OK \r\n");
+
+	/* only two commands are sent before the first reply */
+	test_assert(test_imapc_server_expect("2 CMD1"));
+	test_assert(test_imapc_server_expect("3 CMD2"));
+	o_stream_nsend_str(server.output, "2 OK \r\n");
+	test_assert(test_imapc_server_expect("4 CMD3"));
+	o_stream_nsend_str(server.output, "3 OK \r\n");
+	test_assert(test_imapc_server_expect("5 CMD4"));
+	o_stream_nsend_str(server.output, "4 OK \r\n5 OK \r\n");
+
+	test_assert(test_imapc_server_expect("6 LOGOUT"));
+	o_stream_nsend_str(server.output, "6 OK \r\n");
+
+	test_assert(i_stream_read_next_line(server.input) == NULL);
+}
+
+static void test_imapc_pipelining_limit(void)
+{
+	struct imapc_client_settings set = test_imapc_default_settings;
+	set.max_pipelined_commands = 2;
+
+	test_begin("imapc pipelining limit");
+	test_run_client_server(&set, test_imapc_pipelining_limit_client,
+			       test_imapc_pipelining_limit_server);
+	test_end();
+}
+
 /*
  * Main
  */
@@ -867,6 +935,7 @@ int main(int argc ATTR_UNUSED, char *argv[])
 		test_imapc_client_get_capabilities,
 		test_imapc_client_get_capabilities_reconnected,
 		test_imapc_client_get_capabilities_disconnected,
+		test_imapc_pipelining_limit,
 		NULL
 	};
 
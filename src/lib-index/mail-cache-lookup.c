@@ -9,6 +9,22 @@
 
 #define CACHE_PREFETCH IO_BLOCK_SIZE
 
+static uint64_t mail_cache_lookup_hits, mail_cache_lookup_misses;
+
+static void mail_cache_lookup_count(int ret)
+{
+	if (ret > 0)
+		mail_cache_lookup_hits++;
+	else if (ret == 0)
+		mail_cache_lookup_misses++;
+}
+
+void mail_cache_get_lookup_counters(uint64_t *hits_r, uint64_t *misses_r)
+{
+	*hits_r = mail_cache_lookup_hits;
+	*misses_r = mail_cache_lookup_misses;
+}
+
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r)
 {
@@ -421,8 +437,10 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 
 	ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
-	if (ret <= 0)
+	if (ret <= 0) {
+		mail_cache_lookup_count(ret);
 		return ret;
+	}
 
 	/* the field should exist */
 	mail_cache_lookup_iter_init(view, seq, &iter);
@@ -442,6 +460,7 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	}
 	/* NOTE: view->cache->fields may have been reallocated by
 	   mail_cache_lookup_*(). */
+	mail_cache_lookup_count(ret);
 	return ret;
 }
 
@@ -616,6 +635,7 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 						     &pool);
 	} T_END;
 	pool_unref(&pool);
+	mail_cache_lookup_count(ret);
 	return ret;
 }
 
@@ -184,6 +184,11 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      uint32_t seq, const unsigned int field_idxs[],
 			      unsigned int fields_count);
 
+/* Returns the number of mail_cache_lookup_field() and
+   mail_cache_lookup_headers() calls that found / didn't find the wanted
+   fields, summed over all caches in this process. */
+void mail_cache_get_lookup_counters(uint64_t *hits_r, uint64_t *misses_r);
+
 /* "Error in index cache file %s: ...". */
 void mail_cache_set_corrupted(struct mail_cache *cache, const char *fmt, ...)
 	ATTR_FORMAT(2, 3) ATTR_COLD;
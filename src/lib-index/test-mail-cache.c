@@ -388,6 +388,37 @@ static void test_mail_cache_record_max_size4(void)
 	test_end();
 }
 
+static void test_mail_cache_lookup_counters(void)
+{
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	string_t *str = t_str_new(16);
+	uint64_t hits, misses, hits2, misses2;
+
+	test_begin("mail cache lookup counters");
+	test_mail_cache_init(test_mail_index_init(TRUE), &ctx);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo");
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+
+	mail_cache_get_lookup_counters(&hits, &misses);
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert(mail_cache_lookup_field(cache_view, str, 2,
+					    ctx.cache_field.idx) == 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	mail_cache_view_close(&cache_view);
+
+	mail_cache_get_lookup_counters(&hits2, &misses2);
+	test_assert(hits2 - hits == 2);
+	test_assert(misses2 - misses == 1);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
 static void test_mail_cache_add_decisions(void)
 {
 	struct mail_cache_field cache_fields[TEST_FIELD_COUNT];
@@ -814,6 +845,7 @@ int main(void)
 		test_mail_cache_record_max_size2,
 		test_mail_cache_record_max_size3,
 		test_mail_cache_record_max_size4,
+		test_mail_cache_lookup_counters,
 		test_mail_cache_add_decisions,
 		test_mail_cache_lookup_decisions,
 		test_mail_cache_lookup_decisions2,
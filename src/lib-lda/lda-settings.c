@@ -1,7 +1,9 @@
 /* Copyright (c) 2005-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "hostpid.h"
+#include "message-part-data.h"
 #include "settings-parser.h"
 #include "mail-storage-settings.h"
 #include "smtp-submit-settings.h"
@@ -9,6 +11,30 @@
 
 static bool lda_settings_check(void *_set, pool_t pool, const char **error_r);
 
+struct lda_precache_profile {
+	const char *name;
+	enum mail_fetch_field fields;
+	const char *const *headers;
+};
+
+static const char *lda_precache_sort_headers[] = {
+	"From", "To", "Cc", "Subject",
+	NULL
+};
+static const char *lda_precache_thread_headers[] = {
+	"Message-ID", "In-Reply-To", "References", "Subject",
+	NULL
+};
+static const struct lda_precache_profile lda_precache_profiles[] = {
+	/* ENVELOPE is generated from the cached headers */
+	{ "imap", MAIL_FETCH_IMAP_BODYSTRUCTURE | MAIL_FETCH_DATE,
+	  message_part_envelope_headers },
+	{ "snippet", MAIL_FETCH_BODY_SNIPPET, NULL },
+	{ "sort", MAIL_FETCH_DATE | MAIL_FETCH_VIRTUAL_SIZE,
+	  lda_precache_sort_headers },
+	{ "thread", MAIL_FETCH_DATE, lda_precache_thread_headers },
+};
+
 #undef DEF
 #define DEF(type, name) \
 	SETTING_DEFINE_STRUCT_##type(#name, name, struct lda_settings)
@@ -20,6 +46,7 @@ static const struct setting_define lda_setting_defines[] = {
 	DEF(STR, deliver_log_format),
 	DEF(STR, recipient_delimiter),
 	DEF(STR, lda_original_recipient_header),
+	DEF(STR, lda_precache),
 	DEF(BOOL, quota_full_tempfail),
 	DEF(BOOL, lda_mailbox_autocreate),
 	DEF(BOOL, lda_mailbox_autosubscribe),
@@ -35,6 +62,7 @@ static const struct lda_settings lda_default_settings = {
 	.deliver_log_format = "msgid=%m: %$",
 	.recipient_delimiter = "+",
 	.lda_original_recipient_header = "",
+	.lda_precache = "",
 	.quota_full_tempfail = FALSE,
 	.lda_mailbox_autocreate = FALSE,
 	.lda_mailbox_autosubscribe = FALSE
@@ -53,12 +81,62 @@ const struct setting_parser_info lda_setting_parser_info = {
 #endif
 };
 
+static const struct lda_precache_profile *
+lda_precache_profile_find(const char *name)
+{
+	for (unsigned int i = 0; i < N_ELEMENTS(lda_precache_profiles); i++) {
+		if (strcasecmp(lda_precache_profiles[i].name, name) == 0)
+			return &lda_precache_profiles[i];
+	}
+	return NULL;
+}
+
+static bool
+lda_settings_parse_precache(struct lda_settings *set, pool_t pool,
+			    const char **error_r)
+{
+	const struct lda_precache_profile *profile;
+	struct lda_precache *precache;
+	ARRAY_TYPE(const_string) headers;
+	const char *const *names, *hdr;
+
+	precache = p_new(pool, struct lda_precache, 1);
+	p_array_init(&headers, pool, 16);
+	names = t_strsplit_spaces(set->lda_precache, " ,");
+	for (; *names != NULL; names++) {
+		if (str_begins_icase(*names, "hdr.", &hdr)) {
+			hdr = p_strdup(pool, hdr);
+			array_push_back(&headers, &hdr);
+			continue;
+		}
+		profile = lda_precache_profile_find(*names);
+		if (profile == NULL) {
+			*error_r = t_strdup_printf(
+				"lda_precache: Unknown profile: %s", *names);
+			return FALSE;
+		}
+		precache->fields |= profile->fields;
+		for (unsigned int i = 0;
+		     profile->headers != NULL && profile->headers[i] != NULL; i++)
+			array_push_back(&headers, &profile->headers[i]);
+	}
+	if (array_count(&headers) > 0) {
+		array_append_zero(&headers);
+		precache->headers = array_front(&headers);
+	}
+	set->parsed_precache = precache;
+	return TRUE;
+}
+
 static bool lda_settings_check(void *_set, pool_t pool,
-	const char **error_r ATTR_UNUSED)
+	const char **error_r)
 {
 	struct lda_settings *set = _set;
 
 	if (*set->hostname == '\0')
 		set->hostname = p_strdup(pool, my_hostdomain());
+	if (set->lda_precache[0] != '\0' &&
+	    !lda_settings_parse_precache(set, pool, error_r))
+		return FALSE;
 	return TRUE;
 }
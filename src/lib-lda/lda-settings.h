@@ -1,8 +1,17 @@
 #ifndef LDA_SETTINGS_H
 #define LDA_SETTINGS_H
 
+#include "mail-storage.h"
+
 struct mail_user_settings;
 
+/* lda_precache parsed into the fields and headers to cache */
+struct lda_precache {
+	enum mail_fetch_field fields;
+	/* NULL-terminated, or NULL if no headers */
+	const char *const *headers;
+};
+
 struct lda_settings {
 	pool_t pool;
 	const char *hostname;
@@ -11,10 +20,14 @@ struct lda_settings {
 	const char *deliver_log_format;
 	const char *recipient_delimiter;
 	const char *lda_original_recipient_header;
+	const char *lda_precache;
 
 	bool quota_full_tempfail;
 	bool lda_mailbox_autocreate;
 	bool lda_mailbox_autosubscribe;
+
+	/* NULL if lda_precache is empty */
+	const struct lda_precache *parsed_precache;
 };
 
 extern const struct setting_parser_info lda_setting_parser_info;
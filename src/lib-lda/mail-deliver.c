@@ -52,6 +52,7 @@ static const char *lda_log_wanted_headers[] = {
 };
 static enum mail_fetch_field lda_log_wanted_fetch_fields =
 	MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE;
+
 static MODULE_CONTEXT_DEFINE_INIT(mail_deliver_user_module,
 				  &mail_user_module_register);
 static MODULE_CONTEXT_DEFINE_INIT(mail_deliver_storage_module,
@@ -367,6 +368,21 @@ mail_deliver_open_mail(struct mailbox *box, uint32_t uid,
 	return mail;
 }
 
+static void
+mail_deliver_save_set_precache(struct mail_deliver_context *ctx,
+			       struct mailbox *box,
+			       struct mail_save_context *save_ctx)
+{
+	const struct lda_precache *precache = ctx->set->parsed_precache;
+	struct mailbox_header_lookup_ctx *headers_ctx = NULL;
+
+	if (precache->headers != NULL)
+		headers_ctx = mailbox_header_lookup_init(box, precache->headers);
+	mailbox_save_set_precache_fields(save_ctx, precache->fields,
+					 headers_ctx);
+	mailbox_header_lookup_unref(&headers_ctx);
+}
+
 int mail_deliver_save(struct mail_deliver_context *ctx, const char *mailbox,
 		      enum mail_flags flags, const char *const *keywords,
 		      struct mail_storage **storage_r)
@@ -427,6 +443,8 @@ int mail_deliver_save(struct mail_deliver_context *ctx, const char *mailbox,
 	dest_mail = mailbox_save_get_dest_mail(save_ctx);
 	mail_add_temp_wanted_fields(dest_mail, lda_log_wanted_fetch_fields, NULL);
 	mailbox_header_lookup_unref(&headers_ctx);
+	if (ctx->set->parsed_precache != NULL)
+		mail_deliver_save_set_precache(ctx, box, save_ctx);
 	mail_deliver_deduplicate_guid_if_needed(ctx->session, save_ctx);
 
 	if (mailbox_save_using_mail(&save_ctx, ctx->src_mail) < 0)
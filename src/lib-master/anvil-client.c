@@ -50,6 +50,7 @@ struct anvil_client {
 #define ANVIL_RECONNECT_MIN_SECS 5
 
 static void anvil_client_destroy(struct connection *conn);
+static void anvil_query_free(struct anvil_query **_query);
 static int anvil_client_input_line(struct connection *conn, const char *line);
 
 static struct connection_list *anvil_connections;
@@ -112,6 +113,29 @@ void anvil_client_deinit(struct anvil_client **_client)
 		connection_list_deinit(&anvil_connections);
 }
 
+void anvil_client_forked(struct anvil_client *client)
+{
+	struct anvil_query *const *queries, *query;
+	unsigned int count;
+
+	queries = array_get(&client->queries_arr, &count);
+	while (aqueue_count(client->queries) > 0) {
+		query = queries[aqueue_idx(client->queries, 0)];
+		anvil_query_free(&query);
+		aqueue_delete_tail(client->queries);
+	}
+	timeout_remove(&client->to_cancel);
+	timeout_remove(&client->to_reconnect);
+
+	io_remove(&client->cmd_io);
+	i_stream_destroy(&client->cmd_input);
+	if (client->cmd_output != NULL)
+		o_stream_abort(client->cmd_output);
+	o_stream_destroy(&client->cmd_output);
+	client->reply_pending = FALSE;
+	connection_forked(&client->conn);
+}
+
 static void anvil_client_cmd_pending_input(struct anvil_client *client)
 {
 	const char *line, *cmd, *const *args;
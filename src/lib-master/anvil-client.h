@@ -32,6 +32,11 @@ anvil_client_init(const char *path,
 		  const struct anvil_client_callbacks *callbacks,
 		  enum anvil_client_flags flags) ATTR_NULL(2);
 void anvil_client_deinit(struct anvil_client **client);
+/* Must be called by a fork()ed child process that keeps using the client.
+   The connection is shared with the parent process, so it's closed and
+   reconnected when needed. The pending queries are left for the parent to
+   finish, so their callbacks aren't called. */
+void anvil_client_forked(struct anvil_client *client);
 
 /* Connect to anvil. If retry=TRUE, try connecting for a while */
 int anvil_client_connect(struct anvil_client *client, bool retry);
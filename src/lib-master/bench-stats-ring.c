@@ -0,0 +1,223 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "write-full.h"
+#include "stats-ring.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/**
+ * Compares sending stats events to another process via a UNIX socket and
+ * via the shared memory ring. The consumer is a child process that only
+ * reads the data and counts the lines. The wall clock time and the
+ * producer's CPU usage (i.e. what the event generating process pays) are
+ * reported.
+ */
+
+/* similar to what stats_client sends for a typical event */
+#define BENCH_EVENT_LINE \
+	"EVENT\t0\t0\t1\tc1700000000\t123456\tC1700000000\t123987\t" \
+	"s../src/lib-storage/mail-storage.c\t1234\tnmail_opened\t" \
+	"Cmailbox\tLuser\tbench@example.com\tLmailbox\tINBOX\n"
+
+struct bench_result {
+	uint64_t wall_nsecs;
+	uint64_t cpu_usecs;
+	unsigned int full_count;
+};
+
+static uint64_t bench_get_cpu_usecs(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		i_fatal("getrusage() failed: %m");
+	return (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+		(uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+}
+
+static unsigned int bench_count_lines(const unsigned char *data, size_t size)
+{
+	unsigned int count = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n')
+			count++;
+	}
+	return count;
+}
+
+static void bench_socket_consumer(int fd, unsigned int count)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	unsigned int lines = 0;
+	ssize_t ret;
+
+	while (lines < count) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret <= 0)
+			i_fatal("read() failed: %m");
+		lines += bench_count_lines(buf, ret);
+	}
+}
+
+static void bench_ring_consumer(struct stats_ring *ring, unsigned int count)
+{
+	buffer_t *buf = buffer_create_dynamic(default_pool, 1024*64);
+	const char *error;
+	unsigned int lines = 0;
+	int ret;
+
+	while (lines < count) {
+		buffer_set_used_size(buf, 0);
+		ret = stats_ring_read(ring, buf, &error);
+		if (ret < 0)
+			i_fatal("stats_ring_read() failed: %s", error);
+		if (ret == 0)
+			(void)sched_yield();
+		lines += bench_count_lines(buf->data, buf->used);
+	}
+	buffer_free(&buf);
+}
+
+static void bench_wait_child(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		i_fatal("Consumer process failed");
+}
+
+static void bench_socket(unsigned int count, struct bench_result *result_r)
+{
+	size_t len = strlen(BENCH_EVENT_LINE);
+	uint64_t ts, cpu;
+	unsigned int i;
+	int fds[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		i_fatal("socketpair() failed: %m");
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		i_close_fd(&fds[0]);
+		bench_socket_consumer(fds[1], count);
+		exit(0);
+	}
+	i_close_fd(&fds[1]);
+
+	ts = i_nanoseconds();
+	cpu = bench_get_cpu_usecs();
+	for (i = 0; i < count; i++) {
+		if (write_full(fds[0], BENCH_EVENT_LINE, len) < 0)
+			i_fatal("write() failed: %m");
+	}
+	bench_wait_child(pid);
+	result_r->cpu_usecs = bench_get_cpu_usecs() - cpu;
+	result_r->wall_nsecs = i_nanoseconds() - ts;
+	result_r->full_count = 0;
+	i_close_fd(&fds[0]);
+}
+
+static void bench_ring(unsigned int count, struct bench_result *result_r)
+{
+	struct stats_ring *ring, *consumer;
+	size_t len = strlen(BENCH_EVENT_LINE);
+	const char *error;
+	uint64_t ts, cpu;
+	unsigned int i;
+	pid_t pid;
+
+	if (stats_ring_create(STATS_RING_DEFAULT_SIZE, &ring, &error) < 0)
+		i_fatal("stats_ring_create() failed: %s", error);
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		if (stats_ring_open(dup(stats_ring_get_fd(ring)),
+				    &consumer, &error) < 0)
+			i_fatal("stats_ring_open() failed: %s", error);
+		bench_ring_consumer(consumer, count);
+		exit(0);
+	}
+
+	ts = i_nanoseconds();
+	cpu = bench_get_cpu_usecs();
+	result_r->full_count = 0;
+	for (i = 0; i < count; i++) {
+		/* stats-client would fall back to the socket here */
+		while (!stats_ring_write(ring, BENCH_EVENT_LINE, len)) {
+			result_r->full_count++;
+			(void)sched_yield();
+		}
+	}
+	bench_wait_child(pid);
+	result_r->cpu_usecs = bench_get_cpu_usecs() - cpu;
+	result_r->wall_nsecs = i_nanoseconds() - ts;
+	stats_ring_free(&ring);
+}
+
+static void
+bench_print(const char *name, unsigned int count,
+	    const struct bench_result *result)
+{
+	printf("%s\n", name);
+	printf("\tThroughput: %0.0lf events/s\n",
+	       count / ((double)result->wall_nsecs / 1000000000));
+	printf("\tProducer CPU: %0.02lf ns/event\n",
+	       (double)result->cpu_usecs * 1000 / count);
+	if (result->full_count > 0)
+		printf("\tRing full: %u times\n", result->full_count);
+	printf("\n");
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s count\n", prog);
+	fprintf(stderr, "Sends 1000000 events if nothing given\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count = 1000000;
+	struct bench_result result;
+
+	lib_init();
+
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (!stats_ring_is_supported()) {
+		fprintf(stderr, "Shared memory stats rings not supported\n");
+		return 1;
+	}
+
+	printf("%u events\n\n", count);
+	bench_socket(count, &result);
+	bench_print("socket", count, &result);
+	bench_ring(count, &result);
+	bench_print("shared memory ring", count, &result);
+
+	lib_deinit();
+	return 0;
+}
@@ -53,6 +53,8 @@ static const struct setting_define master_service_setting_defines[] = {
 	DEF(BOOL, version_ignore),
 	DEF(BOOL, shutdown_clients),
 	DEF(BOOL, verbose_proctitle),
+	DEF(BOOL, process_profile),
+	DEF(TIME_MSECS, process_profile_interval),
 
 	DEF(STR, haproxy_trusted_networks),
 	DEF(TIME, haproxy_timeout),
@@ -91,6 +93,8 @@ static const struct master_service_settings master_service_default_settings = {
 	.version_ignore = FALSE,
 	.shutdown_clients = TRUE,
 	.verbose_proctitle = FALSE,
+	.process_profile = FALSE,
+	.process_profile_interval = 10,
 
 	.haproxy_trusted_networks = "",
 	.haproxy_timeout = 3
@@ -195,6 +199,10 @@ master_service_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 				  master_service_set_process_shutdown_filter_wrapper,
 				  error_r))
 		return FALSE;
+	if (set->process_profile && set->process_profile_interval == 0) {
+		*error_r = "process_profile_interval must not be 0";
+		return FALSE;
+	}
 	/* doveconf / config checks dovecot_storage_version separately.
 	   This check shouldn't fail e.g. "doveconf -d" command. */
 	if (!is_config_binary() &&
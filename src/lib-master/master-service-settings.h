@@ -22,6 +22,8 @@ struct master_service_settings {
 	bool version_ignore;
 	bool shutdown_clients;
 	bool verbose_proctitle;
+	bool process_profile;
+	unsigned int process_profile_interval;
 
 	const char *haproxy_trusted_networks;
 	unsigned int haproxy_timeout;
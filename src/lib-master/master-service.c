@@ -17,6 +17,7 @@
 #include "process-title.h"
 #include "time-util.h"
 #include "restrict-access.h"
+#include "sampling-profiler.h"
 #include "settings.h"
 #include "settings-parser.h"
 #include "syslog-util.h"
@@ -827,6 +828,24 @@ void master_service_init_stats_client(struct master_service *service,
 	} T_END;
 }
 
+void master_service_init_forked(struct master_service *service)
+{
+	hostpid_init();
+	io_loop_recreate(current_ioloop);
+	if (service->ioloop != current_ioloop)
+		io_loop_recreate(service->ioloop);
+	lib_signals_forked();
+	if (service->stats_client != NULL)
+		stats_client_forked(service->stats_client);
+}
+
+void master_service_exit_forked(struct master_service *service, int status)
+{
+	if (service->stats_client != NULL)
+		stats_client_deinit(&service->stats_client);
+	_exit(status);
+}
+
 void master_service_set_die_with_master(struct master_service *service,
 					bool set)
 {
@@ -951,6 +970,15 @@ static void master_status_update_wait(struct master_service *service)
 	io_loop_destroy(&ioloop);
 }
 
+static void master_service_profiler_init(struct master_service *service)
+{
+	const char *error;
+
+	if (sampling_profiler_init(service->set->process_profile_interval,
+				   service->event, &error) < 0)
+		e_error(service->event, "process_profile: %s", error);
+}
+
 void master_service_init_finish(struct master_service *service)
 {
 	struct stat st;
@@ -995,6 +1023,8 @@ void master_service_init_finish(struct master_service *service)
 		lib_signals_set_handler(SIGQUIT, 0, sig_close_listeners, service);
 	}
 	master_service_io_listeners_add(service);
+	if (service->set != NULL && service->set->process_profile)
+		master_service_profiler_init(service);
 	if (service->want_ssl_server &&
 	    (service->flags & MASTER_SERVICE_FLAG_NO_SSL_INIT) == 0)
 		master_service_ssl_ctx_init(service);
@@ -1599,6 +1629,8 @@ static void master_service_deinit_real(struct master_service *service)
 		io_remove(&service->listeners[i].io);
 	master_service_ssl_ctx_deinit(service);
 
+	/* send the remaining samples before disconnecting from stats */
+	sampling_profiler_deinit();
 	if (service->stats_client != NULL)
 		stats_client_deinit(&service->stats_client);
 	timeout_remove(&service->to_overflow_call);
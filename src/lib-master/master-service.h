@@ -167,6 +167,16 @@ void master_service_init_log_with_pid(struct master_service *service);
 void master_service_init_stats_client(struct master_service *service,
 				      bool silent_notfound_errors);
 
+/* Must be called by a child process that was fork()ed without exec() and
+   keeps using the service. Connections that can't be shared with the parent
+   process are reopened. */
+void master_service_init_forked(struct master_service *service);
+/* Exit such a child process. Only the connections reopened by
+   master_service_init_forked() are flushed and closed. Everything else is
+   left for the parent process. */
+void ATTR_NORETURN
+master_service_exit_forked(struct master_service *service, int status);
+
 /* If set, die immediately when connection to master is lost.
    Normally all existing clients are handled first. */
 void master_service_set_die_with_master(struct master_service *service,
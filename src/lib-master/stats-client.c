@@ -4,15 +4,19 @@
 #include "str.h"
 #include "strescape.h"
 #include "ostream.h"
+#include "ostream-unix.h"
 #include "time-util.h"
 #include "lib-event-private.h"
 #include "event-filter.h"
 #include "connection.h"
+#include "stats-ring.h"
 #include "stats-client.h"
 
 #define STATS_CLIENT_HANDSHAKE_TIMEOUT_MSECS (5*1000)
 #define STATS_CLIENT_DEINIT_TIMEOUT_MSECS (60*1000)
 #define STATS_CLIENT_RECONNECT_INTERVAL_MSECS (10*1000)
+/* The first server minor version that supports the RING command */
+#define STATS_CLIENT_RING_MIN_MINOR_VERSION 1
 
 enum stats_timeout_type {
 	STATS_CLIENT_HANDSHAKE_WAIT,
@@ -25,6 +29,8 @@ struct stats_client {
 	struct ioloop *ioloop;
 	struct timeout *to_reconnect;
 	struct timeval wait_started;
+	/* Shared memory ring for sending events, or NULL if not used */
+	struct stats_ring *ring;
 	bool handshaked;
 	bool handshake_received_at_least_once;
 	bool silent_notfound_errors;
@@ -34,6 +40,43 @@ static struct connection_list *stats_clients;
 
 static void stats_client_connect(struct stats_client *client);
 
+static void
+stats_client_send(struct stats_client *client, const void *data, size_t size)
+{
+	if (client->ring != NULL) {
+		if (stats_ring_write(client->ring, data, size))
+			return;
+		stats_ring_socket_sent(client->ring, data, size);
+	}
+	o_stream_nsend(client->conn.output, data, size);
+}
+
+static void stats_client_ring_init(struct stats_client *client)
+{
+	const char *error;
+
+	if (client->ring != NULL || !client->conn.unix_socket ||
+	    client->conn.minor_version < STATS_CLIENT_RING_MIN_MINOR_VERSION ||
+	    !stats_ring_is_supported())
+		return;
+
+	if (stats_ring_create(STATS_RING_DEFAULT_SIZE, &client->ring,
+			      &error) < 0) {
+		e_error(client->conn.event,
+			"stats: Failed to create ring, using only socket: %s",
+			error);
+		return;
+	}
+	if (!o_stream_unix_write_fd(client->conn.output,
+				    stats_ring_get_fd(client->ring)))
+		i_unreached();
+	/* The RING line itself is the first line counted as sent via the
+	   socket. This way the ring isn't written to until the server has
+	   processed everything sent before it. */
+	o_stream_nsend_str(client->conn.output, "RING\n");
+	stats_ring_socket_sent(client->ring, "RING\n", 5);
+}
+
 static int
 client_handshake_filter(const char *const *args, struct event_filter **filter_r,
 			const char **error_r)
@@ -69,6 +112,7 @@ stats_client_handshake(struct stats_client *client, const char *const *args)
 	}
 	client->handshaked = TRUE;
 	client->handshake_received_at_least_once = TRUE;
+	stats_client_ring_init(client);
 	if (client->ioloop != NULL)
 		io_loop_stop(client->ioloop);
 
@@ -107,6 +151,7 @@ static void stats_client_destroy(struct connection *conn)
 		event->sent_to_stats_id = 0;
 
 	client->handshaked = FALSE;
+	stats_ring_free(&client->ring);
 	connection_disconnect(conn);
 	if (client->ioloop != NULL) {
 		/* waiting for stats handshake to finish */
@@ -190,7 +235,7 @@ stats_event_write(struct stats_client *client,
 	str_append_c(str, '\n');
 	event_unref(&merged_event);
 	if (flush_output || str_len(str) >= IO_BLOCK_SIZE) {
-		o_stream_nsend(client->conn.output, str_data(str), str_len(str));
+		stats_client_send(client, str_data(str), str_len(str));
 		str_truncate(str, 0);
 	}
 }
@@ -229,7 +274,7 @@ stats_client_send_event(struct stats_client *client, struct event *event,
 	}
 
 	stats_event_write(client, event, global_event, ctx, str, FALSE);
-	o_stream_nsend(client->conn.output, str_data(str), str_len(str));
+	stats_client_send(client, str_data(str), str_len(str));
 
 	i_assert(recursion > 0);
 	if (--recursion == 0) {
@@ -245,8 +290,8 @@ stats_client_free_event(struct stats_client *client, struct event *event)
 {
 	if (event->sent_to_stats_id == 0)
 		return;
-	o_stream_nsend_str(client->conn.output,
-			   t_strdup_printf("END\t%"PRIu64"\n", event->id));
+	const char *line = t_strdup_printf("END\t%"PRIu64"\n", event->id);
+	stats_client_send(client, line, strlen(line));
 }
 
 static bool
@@ -297,7 +342,7 @@ static void stats_category_registered(struct event_category *category)
 
 	string_t *str = t_str_new(256);
 	stats_category_append(str, category);
-	o_stream_nsend(client->conn.output, str_data(str), str_len(str));
+	stats_client_send(client, str_data(str), str_len(str));
 }
 
 static void stats_global_init(void)
@@ -427,6 +472,22 @@ stats_client_init_unittest(buffer_t *buf, const char *filter)
 	return client;
 }
 
+void stats_client_forked(struct stats_client *client)
+{
+	struct event *event;
+
+	for (event = events_get_head(); event != NULL; event = event->next)
+		event->sent_to_stats_id = 0;
+	stats_ring_free(&client->ring);
+	/* Anything still buffered was meant to be sent by the parent. */
+	connection_forked(&client->conn);
+	timeout_remove(&client->to_reconnect);
+	/* The filter is inherited from the parent, so keep sending events
+	   without waiting for the new connection's handshake. Otherwise
+	   they would be dropped until the child runs its ioloop. */
+	stats_client_connect(client);
+}
+
 static int stats_client_deinit_callback(struct connection *conn)
 {
 	struct ostream *output = conn->output;
@@ -456,6 +517,7 @@ void stats_client_deinit(struct stats_client **_client)
 	}
 
 	event_filter_unref(&client->filter);
+	stats_ring_free(&client->ring);
 	connection_deinit(&client->conn);
 	timeout_remove(&client->to_reconnect);
 	o_stream_unref(&client->conn.output);
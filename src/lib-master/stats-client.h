@@ -4,6 +4,10 @@
 struct stats_client *
 stats_client_init(const char *path, bool silent_notfound_errors);
 void stats_client_deinit(struct stats_client **client);
+/* Called in a child process after fork() and io_loop_recreate(). The
+   connection is still shared with the parent process, so drop it without
+   sending anything and connect again. */
+void stats_client_forked(struct stats_client *client);
 
 struct stats_client *
 stats_client_init_unittest(buffer_t *buf, const char *filter);
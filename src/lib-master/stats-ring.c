@@ -0,0 +1,317 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#define _GNU_SOURCE /* for memfd_create() and file seals */
+#include "lib.h"
+#include "buffer.h"
+#include "stats-ring.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS) && \
+	defined(__ATOMIC_ACQUIRE)
+#  define STATS_RING_SUPPORTED
+#endif
+
+#define STATS_RING_MAGIC 0x53524e47 /* "SRNG" */
+#define STATS_RING_CACHELINE_SIZE 64
+
+/* The positions are only increasing. The offset within the data area is
+   position & (size-1). Each field is written only by either the producer
+   or the consumer, and they're in separate cachelines so the two processes
+   don't keep invalidating each others' caches. */
+struct stats_ring_header {
+	uint32_t magic;
+	uint32_t size;
+	uint8_t unused[STATS_RING_CACHELINE_SIZE - 8];
+
+	/* written by the producer */
+	uint64_t write_pos;
+	uint8_t unused2[STATS_RING_CACHELINE_SIZE - 8];
+
+	/* written by the consumer */
+	uint64_t read_pos;
+	uint64_t socket_lines_processed;
+	uint8_t unused3[STATS_RING_CACHELINE_SIZE - 16];
+};
+
+struct stats_ring {
+	int fd;
+	void *mmap_base;
+	size_t mmap_size;
+
+	struct stats_ring_header *hdr;
+	unsigned char *data;
+	size_t size;
+
+	/* Local copy of the position written by us. The shared memory is
+	   never trusted by the consumer. */
+	uint64_t pos;
+	/* Producer: number of lines sent via the socket */
+	uint64_t socket_lines_sent;
+	/* Consumer: number of lines processed from the socket */
+	uint64_t socket_lines_processed;
+};
+
+#ifdef STATS_RING_SUPPORTED
+#define STATS_RING_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STATS_RING_STORE(ptr, value) \
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+bool stats_ring_is_supported(void)
+{
+	return TRUE;
+}
+
+static struct stats_ring *stats_ring_alloc(int fd, void *mmap_base,
+					   size_t mmap_size)
+{
+	struct stats_ring *ring;
+
+	ring = i_new(struct stats_ring, 1);
+	ring->fd = fd;
+	ring->mmap_base = mmap_base;
+	ring->mmap_size = mmap_size;
+	ring->hdr = mmap_base;
+	ring->data = PTR_OFFSET(mmap_base, sizeof(*ring->hdr));
+	ring->size = mmap_size - sizeof(*ring->hdr);
+	return ring;
+}
+
+int stats_ring_create(size_t size, struct stats_ring **ring_r,
+		      const char **error_r)
+{
+	struct stats_ring *ring;
+	size_t mmap_size = sizeof(struct stats_ring_header) + size;
+	void *mmap_base;
+	int fd;
+
+	i_assert(size > 0 && (size & (size-1)) == 0 && size <= UINT32_MAX);
+
+	fd = memfd_create("dovecot-stats-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("memfd_create() failed: %m");
+		return -1;
+	}
+	if (ftruncate(fd, mmap_size) < 0) {
+		*error_r = t_strdup_printf("ftruncate() failed: %m");
+		i_close_fd(&fd);
+		return -1;
+	}
+	/* The consumer requires the seals, so that the producer can't cause
+	   it to crash with SIGBUS by shrinking the file. */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		  F_SEAL_SEAL) < 0) {
+		*error_r = t_strdup_printf("fcntl(F_ADD_SEALS) failed: %m");
+		i_close_fd(&fd);
+		return -1;
+	}
+	mmap_base = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	if (mmap_base == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap() failed: %m");
+		i_close_fd(&fd);
+		return -1;
+	}
+	ring = stats_ring_alloc(fd, mmap_base, mmap_size);
+	ring->hdr->magic = STATS_RING_MAGIC;
+	ring->hdr->size = size;
+	*ring_r = ring;
+	return 0;
+}
+
+int stats_ring_open(int fd, struct stats_ring **ring_r, const char **error_r)
+{
+	struct stats_ring *ring;
+	struct stats_ring_header *hdr;
+	struct stat st;
+	void *mmap_base;
+	int seals;
+
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat() failed: %m");
+		i_close_fd(&fd);
+		return -1;
+	}
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+		*error_r = "Ring fd isn't sealed against shrinking";
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_size <= (off_t)sizeof(*hdr) ||
+	    st.st_size > (off_t)(sizeof(*hdr) + UINT32_MAX)) {
+		*error_r = t_strdup_printf("Invalid ring size %"PRIuUOFF_T,
+					   st.st_size);
+		i_close_fd(&fd);
+		return -1;
+	}
+	mmap_base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	if (mmap_base == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap() failed: %m");
+		i_close_fd(&fd);
+		return -1;
+	}
+	ring = stats_ring_alloc(fd, mmap_base, st.st_size);
+	hdr = ring->hdr;
+	if (hdr->magic != STATS_RING_MAGIC || hdr->size != ring->size ||
+	    (ring->size & (ring->size-1)) != 0) {
+		*error_r = "Invalid ring header";
+		stats_ring_free(&ring);
+		return -1;
+	}
+	ring->pos = STATS_RING_LOAD(&hdr->read_pos);
+	ring->socket_lines_processed =
+		STATS_RING_LOAD(&hdr->socket_lines_processed);
+	*ring_r = ring;
+	return 0;
+}
+
+void stats_ring_free(struct stats_ring **_ring)
+{
+	struct stats_ring *ring = *_ring;
+
+	if (ring == NULL)
+		return;
+	*_ring = NULL;
+
+	if (munmap(ring->mmap_base, ring->mmap_size) < 0)
+		i_error("munmap(stats ring) failed: %m");
+	i_close_fd(&ring->fd);
+	i_free(ring);
+}
+
+int stats_ring_get_fd(struct stats_ring *ring)
+{
+	return ring->fd;
+}
+
+bool stats_ring_write(struct stats_ring *ring, const void *data, size_t size)
+{
+	uint64_t read_pos;
+	size_t offset, first;
+
+	if (STATS_RING_LOAD(&ring->hdr->socket_lines_processed) !=
+	    ring->socket_lines_sent) {
+		/* the consumer hasn't yet processed everything sent via the
+		   socket */
+		return FALSE;
+	}
+	read_pos = STATS_RING_LOAD(&ring->hdr->read_pos);
+	i_assert(read_pos <= ring->pos);
+	if (size > ring->size - (ring->pos - read_pos))
+		return FALSE;
+
+	offset = ring->pos & (ring->size - 1);
+	first = I_MIN(size, ring->size - offset);
+	memcpy(ring->data + offset, data, first);
+	memcpy(ring->data, CONST_PTR_OFFSET(data, first), size - first);
+
+	ring->pos += size;
+	STATS_RING_STORE(&ring->hdr->write_pos, ring->pos);
+	return TRUE;
+}
+
+void stats_ring_socket_sent(struct stats_ring *ring,
+			    const void *data, size_t size)
+{
+	const unsigned char *p = data, *end = p + size;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		ring->socket_lines_sent++;
+		p++;
+	}
+}
+
+int stats_ring_read(struct stats_ring *ring, buffer_t *dest,
+		    const char **error_r)
+{
+	uint64_t write_pos;
+	size_t size, offset, first;
+
+	write_pos = STATS_RING_LOAD(&ring->hdr->write_pos);
+	if (write_pos == ring->pos)
+		return 0;
+	if (write_pos < ring->pos || write_pos - ring->pos > ring->size) {
+		*error_r = t_strdup_printf(
+			"Invalid write position %"PRIu64" (read position "
+			"%"PRIu64", size %zu)", write_pos, ring->pos,
+			ring->size);
+		return -1;
+	}
+	size = write_pos - ring->pos;
+	offset = ring->pos & (ring->size - 1);
+	first = I_MIN(size, ring->size - offset);
+	buffer_append(dest, ring->data + offset, first);
+	buffer_append(dest, ring->data, size - first);
+
+	ring->pos = write_pos;
+	STATS_RING_STORE(&ring->hdr->read_pos, ring->pos);
+	return 1;
+}
+
+void stats_ring_socket_line_processed(struct stats_ring *ring)
+{
+	STATS_RING_STORE(&ring->hdr->socket_lines_processed,
+			 ++ring->socket_lines_processed);
+}
+#else
+bool stats_ring_is_supported(void)
+{
+	return FALSE;
+}
+
+int stats_ring_create(size_t size ATTR_UNUSED,
+		      struct stats_ring **ring_r ATTR_UNUSED,
+		      const char **error_r)
+{
+	*error_r = "Shared memory stats rings not supported";
+	return -1;
+}
+
+int stats_ring_open(int fd, struct stats_ring **ring_r ATTR_UNUSED,
+		    const char **error_r)
+{
+	*error_r = "Shared memory stats rings not supported";
+	i_close_fd(&fd);
+	return -1;
+}
+
+void stats_ring_free(struct stats_ring **ring)
+{
+	i_assert(*ring == NULL);
+}
+
+int stats_ring_get_fd(struct stats_ring *ring ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+bool stats_ring_write(struct stats_ring *ring ATTR_UNUSED,
+		      const void *data ATTR_UNUSED, size_t size ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void stats_ring_socket_sent(struct stats_ring *ring ATTR_UNUSED,
+			    const void *data ATTR_UNUSED,
+			    size_t size ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+int stats_ring_read(struct stats_ring *ring ATTR_UNUSED,
+		    buffer_t *dest ATTR_UNUSED,
+		    const char **error_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void stats_ring_socket_line_processed(struct stats_ring *ring ATTR_UNUSED)
+{
+	i_unreached();
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef STATS_RING_H
+#define STATS_RING_H
+
+/* Shared memory ring buffer for sending stats protocol lines from a process
+   to the stats process without any syscalls. The process creates the ring
+   and sends its fd to the stats process, which maps it and drains it
+   periodically. There is a single producer and a single consumer.
+
+   The producer falls back to sending the lines via the stats socket when
+   the ring is full. To keep the lines ordered, the consumer always drains
+   the ring before processing a line from the socket, and the producer
+   doesn't write to the ring again until the consumer has processed all the
+   lines sent via the socket. */
+
+#define STATS_RING_DEFAULT_SIZE (256*1024)
+
+struct stats_ring;
+
+/* Returns TRUE if shared memory rings are supported by this system. */
+bool stats_ring_is_supported(void);
+
+/* Create a new ring with the given data size, which must be a power of 2.
+   Returns 0 on success, -1 on error. */
+int stats_ring_create(size_t size, struct stats_ring **ring_r,
+		      const char **error_r);
+/* Map a ring created by another process. The fd is closed on failure, and
+   with stats_ring_free() on success. The ring contents are untrusted, so
+   they're validated. Returns 0 on success, -1 on error. */
+int stats_ring_open(int fd, struct stats_ring **ring_r, const char **error_r);
+void stats_ring_free(struct stats_ring **ring);
+
+/* Returns the fd to send to the consumer. */
+int stats_ring_get_fd(struct stats_ring *ring);
+
+/* Producer: Append data consisting of full lines to the ring. Returns FALSE
+   if the data must be sent via the socket instead, either because the ring
+   is full or because there are unprocessed lines in the socket. */
+bool stats_ring_write(struct stats_ring *ring, const void *data, size_t size);
+/* Producer: Data was sent via the socket. */
+void stats_ring_socket_sent(struct stats_ring *ring,
+			    const void *data, size_t size);
+
+/* Consumer: Append all the available data in the ring to dest. Returns 1 if
+   data was read, 0 if the ring was empty, -1 if the ring is corrupted. */
+int stats_ring_read(struct stats_ring *ring, buffer_t *dest,
+		    const char **error_r);
+/* Consumer: A line received from the socket was processed. */
+void stats_ring_socket_line_processed(struct stats_ring *ring);
+
+#endif
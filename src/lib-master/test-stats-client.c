@@ -0,0 +1,189 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "net.h"
+#include "write-full.h"
+#include "lib-event-private.h"
+#include "stats-client.h"
+#include "test-common.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_SOCKET_PATH ".test-stats-client"
+#define TEST_SERVER_HANDSHAKE \
+	"VERSION\tstats-server\t4\t0\nFILTER\tevent=test_*\n"
+
+static const char *test_conn_path(unsigned int idx)
+{
+	return t_strdup_printf(TEST_SOCKET_PATH".conn%u", idx);
+}
+
+/* Accept two connections and write everything received from them into
+   files. Returns after both have been disconnected. */
+static void ATTR_NORETURN test_stats_server(int fd_listen)
+{
+	struct pollfd pfd[3];
+	string_t *input[2];
+	unsigned char buf[1024];
+	unsigned int i, conn_count = 0, eof_count = 0;
+	ssize_t ret;
+	int fd;
+
+	alarm(10);
+	i_zero(&pfd);
+	pfd[0].fd = fd_listen;
+	pfd[0].events = POLLIN;
+	while (eof_count < 2) {
+		if (poll(pfd, 1 + conn_count, -1) < 0)
+			i_fatal("poll() failed: %m");
+		if ((pfd[0].revents & POLLIN) != 0) {
+			fd = net_accept(fd_listen, NULL, NULL);
+			if (fd < 0)
+				i_fatal("net_accept() failed: %m");
+			if (write_full(fd, TEST_SERVER_HANDSHAKE,
+				       strlen(TEST_SERVER_HANDSHAKE)) < 0)
+				i_fatal("write() failed: %m");
+			input[conn_count] = t_str_new(1024);
+			pfd[1 + conn_count].fd = fd;
+			pfd[1 + conn_count].events = POLLIN;
+			if (++conn_count == 2)
+				pfd[0].fd = -1;
+		}
+		for (i = 0; i < conn_count; i++) {
+			if (pfd[1 + i].revents == 0)
+				continue;
+			ret = read(pfd[1 + i].fd, buf, sizeof(buf));
+			if (ret < 0)
+				i_fatal("read() failed: %m");
+			if (ret == 0) {
+				i_close_fd(&pfd[1 + i].fd);
+				eof_count++;
+			} else {
+				str_append_data(input[i], buf, ret);
+			}
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		fd = creat(test_conn_path(i), 0600);
+		if (fd == -1 ||
+		    write_full(fd, str_data(input[i]), str_len(input[i])) < 0)
+			i_fatal("write(%s) failed: %m", test_conn_path(i));
+		i_close_fd(&fd);
+	}
+	_exit(0);
+}
+
+static const char *test_conn_read(unsigned int idx)
+{
+	const char *path = test_conn_path(idx);
+	string_t *str = t_str_new(1024);
+	unsigned char buf[1024];
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		str_append_data(str, buf, ret);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	i_unlink(path);
+	return str_c(str);
+}
+
+static void test_stats_client_forked(void)
+{
+	struct ioloop *ioloop;
+	struct stats_client *client;
+	struct event *parent, *event;
+	const char *conn1, *conn2, *begin;
+	pid_t server_pid, child_pid;
+	int fd_listen, status;
+
+	test_begin("stats client forked");
+	i_unlink_if_exists(TEST_SOCKET_PATH);
+	fd_listen = net_listen_unix(TEST_SOCKET_PATH, 2);
+	if (fd_listen == -1)
+		i_fatal("net_listen_unix() failed: %m");
+	fd_set_nonblock(fd_listen, FALSE);
+	if ((server_pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (server_pid == 0)
+		test_stats_server(fd_listen);
+	i_close_fd(&fd_listen);
+
+	ioloop = io_loop_create();
+	client = stats_client_init(TEST_SOCKET_PATH, FALSE);
+	/* global events are sent with BEGIN */
+	parent = event_create(NULL);
+	event_push_global(parent);
+	event = event_create(parent);
+	event_set_name(event, "test_parent");
+	e_debug(event, "parent");
+	event_unref(&event);
+	begin = t_strdup_printf("BEGIN\t%"PRIu64"\t", parent->id);
+
+	if ((child_pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (child_pid == 0) {
+		/* The child must reconnect. The parent event is already
+		   known by the parent's connection, but it has to be sent
+		   again for the child's connection. */
+		io_loop_recreate(ioloop);
+		stats_client_forked(client);
+		event = event_create(parent);
+		event_set_name(event, "test_child");
+		e_debug(event, "child");
+		event_unref(&event);
+		stats_client_deinit(&client);
+		_exit(0);
+	}
+	if (waitpid(child_pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* the parent's connection still works */
+	event = event_create(parent);
+	event_set_name(event, "test_parent2");
+	e_debug(event, "parent");
+	event_unref(&event);
+	event_pop_global(parent);
+	event_unref(&parent);
+	stats_client_deinit(&client);
+	io_loop_destroy(&ioloop);
+
+	if (waitpid(server_pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	i_unlink(TEST_SOCKET_PATH);
+
+	conn1 = test_conn_read(0);
+	test_assert(str_begins_with(conn1, "VERSION\tstats-client\t4\t"));
+	test_assert(strstr(conn1, begin) != NULL);
+	test_assert(strstr(conn1, "\tntest_parent\n") != NULL);
+	test_assert(strstr(conn1, "\tntest_parent2\n") != NULL);
+	test_assert(strstr(conn1, "test_child") == NULL);
+
+	conn2 = test_conn_read(1);
+	test_assert(str_begins_with(conn2, "VERSION\tstats-client\t4\t"));
+	test_assert(strstr(conn2, begin) != NULL);
+	test_assert(strstr(conn2, "\tntest_child\n") != NULL);
+	test_assert(strstr(conn2, "test_parent") == NULL);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_stats_client_forked,
+		NULL
+	};
+	return test_run(test_functions);
+}
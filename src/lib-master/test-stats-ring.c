@@ -0,0 +1,163 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "stats-ring.h"
+#include "test-common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define TEST_RING_SIZE 64
+
+static void test_stats_ring_open(struct stats_ring *producer,
+				 struct stats_ring **consumer_r)
+{
+	const char *error;
+	int fd;
+
+	fd = dup(stats_ring_get_fd(producer));
+	if (fd == -1)
+		i_fatal("dup() failed: %m");
+	test_assert(stats_ring_open(fd, consumer_r, &error) == 0);
+}
+
+static void test_stats_ring_read(void)
+{
+	struct stats_ring *producer, *consumer;
+	buffer_t *buf = t_buffer_create(128);
+	const char *error;
+
+	test_begin("stats ring read");
+	test_assert(stats_ring_create(TEST_RING_SIZE, &producer, &error) == 0);
+	test_stats_ring_open(producer, &consumer);
+
+	test_assert(stats_ring_read(consumer, buf, &error) == 0);
+	test_assert(stats_ring_write(producer, "line1\n", 6));
+	test_assert(stats_ring_write(producer, "line2\n", 6));
+	test_assert(stats_ring_read(consumer, buf, &error) == 1);
+	test_assert_strcmp(str_c(buf), "line1\nline2\n");
+	test_assert(stats_ring_read(consumer, buf, &error) == 0);
+
+	stats_ring_free(&consumer);
+	stats_ring_free(&producer);
+	test_end();
+}
+
+static void test_stats_ring_wrap(void)
+{
+	struct stats_ring *producer, *consumer;
+	buffer_t *buf = t_buffer_create(128);
+	const char *error, *line = "0123456789abcdefghi\n";
+	unsigned int i;
+
+	test_begin("stats ring wrap");
+	test_assert(stats_ring_create(TEST_RING_SIZE, &producer, &error) == 0);
+	test_stats_ring_open(producer, &consumer);
+
+	/* 20 byte lines with 64 byte ring: the writes wrap at various
+	   offsets */
+	for (i = 0; i < 20; i++) {
+		test_assert_idx(stats_ring_write(producer, line, 20), i);
+		test_assert_idx(stats_ring_write(producer, line, 20), i);
+		test_assert_idx(stats_ring_write(producer, line, 20), i);
+		/* full */
+		test_assert_idx(!stats_ring_write(producer, line, 20), i);
+
+		buffer_set_used_size(buf, 0);
+		test_assert_idx(stats_ring_read(consumer, buf, &error) == 1, i);
+		test_assert_idx(strcmp(str_c(buf),
+			t_strconcat(line, line, line, NULL)) == 0, i);
+	}
+	/* the whole ring can be filled */
+	for (i = 0; i < TEST_RING_SIZE/4; i++)
+		test_assert_idx(stats_ring_write(producer, "123\n", 4), i);
+	test_assert(!stats_ring_write(producer, "\n", 1));
+	buffer_set_used_size(buf, 0);
+	test_assert(stats_ring_read(consumer, buf, &error) == 1);
+	test_assert(buf->used == TEST_RING_SIZE);
+
+	stats_ring_free(&consumer);
+	stats_ring_free(&producer);
+	test_end();
+}
+
+static void test_stats_ring_socket_ordering(void)
+{
+	struct stats_ring *producer, *consumer;
+	buffer_t *buf = t_buffer_create(128);
+	const char *error;
+
+	test_begin("stats ring socket ordering");
+	test_assert(stats_ring_create(TEST_RING_SIZE, &producer, &error) == 0);
+	test_stats_ring_open(producer, &consumer);
+
+	/* two lines sent via the socket - ring can't be written to until
+	   the consumer has processed both of them */
+	stats_ring_socket_sent(producer, "sock1\nsock2\n", 12);
+	test_assert(!stats_ring_write(producer, "ring1\n", 6));
+	stats_ring_socket_line_processed(consumer);
+	test_assert(!stats_ring_write(producer, "ring1\n", 6));
+	stats_ring_socket_line_processed(consumer);
+	test_assert(stats_ring_write(producer, "ring1\n", 6));
+	test_assert(stats_ring_read(consumer, buf, &error) == 1);
+	test_assert_strcmp(str_c(buf), "ring1\n");
+
+	stats_ring_free(&consumer);
+	stats_ring_free(&producer);
+	test_end();
+}
+
+static void test_stats_ring_corrupted(void)
+{
+	struct stats_ring *producer, *consumer;
+	buffer_t *buf = t_buffer_create(128);
+	const char *error;
+	uint64_t pos;
+	uint32_t magic = 0;
+	int fds[2];
+
+	test_begin("stats ring corrupted");
+	/* not a sealed memfd */
+	if (pipe(fds) < 0)
+		i_fatal("pipe() failed: %m");
+	i_close_fd(&fds[1]);
+	test_assert(stats_ring_open(fds[0], &consumer, &error) < 0);
+
+	/* invalid magic */
+	test_assert(stats_ring_create(TEST_RING_SIZE, &producer, &error) == 0);
+	if (pwrite(stats_ring_get_fd(producer), &magic, sizeof(magic), 0) < 0)
+		i_fatal("pwrite() failed: %m");
+	test_assert(stats_ring_open(dup(stats_ring_get_fd(producer)),
+				    &consumer, &error) < 0);
+	stats_ring_free(&producer);
+
+	/* write position is beyond the ring size. It's in the second
+	   cacheline of the header. */
+	test_assert(stats_ring_create(TEST_RING_SIZE, &producer, &error) == 0);
+	test_stats_ring_open(producer, &consumer);
+	pos = TEST_RING_SIZE + 1;
+	if (pwrite(stats_ring_get_fd(producer), &pos, sizeof(pos), 64) < 0)
+		i_fatal("pwrite() failed: %m");
+	test_assert(stats_ring_read(consumer, buf, &error) < 0);
+	test_assert(buf->used == 0);
+	stats_ring_free(&consumer);
+	stats_ring_free(&producer);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_stats_ring_read,
+		test_stats_ring_wrap,
+		test_stats_ring_socket_ordering,
+		test_stats_ring_corrupted,
+		NULL
+	};
+	if (!stats_ring_is_supported()) {
+		printf("Shared memory stats rings not supported - skipping\n");
+		return 0;
+	}
+	return test_run(test_functions);
+}
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "llist.h"
 #include "ioloop.h"
+#include "time-util.h"
 #include "sql-api-private.h"
 
 #include <time.h>
@@ -16,10 +17,30 @@ static struct event_category event_category_sqlpool = {
 	.name = "sqlpool",
 };
 
+/* Weight of a new latency sample in the host's moving average is
+   1/SQLPOOL_LATENCY_EWMA_DIVISOR. */
+#define SQLPOOL_LATENCY_EWMA_DIVISOR 8
+/* Default number of consecutive retryable query failures after which the
+   host isn't used for a while. 0 disables this. */
+#define SQLPOOL_DEFAULT_CIRCUIT_FAILURES 5
+#define SQLPOOL_DEFAULT_CIRCUIT_OPEN_SECS 10
+
 struct sqlpool_host {
+	char *name;
 	char *connect_string;
 
 	unsigned int connection_count;
+	/* number of queries sent to this host that haven't finished yet */
+	unsigned int queries_in_flight;
+	/* moving average of query latency, 0 if no queries done yet */
+	uint64_t latency_ewma_usecs;
+
+	/* number of consecutive queries that failed with a retryable error */
+	unsigned int failure_count;
+	/* if non-zero, the host isn't used until this time. After that a
+	   single query is sent to it to see if it works again. */
+	time_t circuit_open_until;
+	bool circuit_probe_sent;
 };
 
 struct sqlpool_connection {
@@ -33,6 +54,8 @@ struct sqlpool_db {
 	pool_t pool;
 	const struct sql_db *driver;
 	unsigned int connection_limit;
+	unsigned int circuit_failures;
+	unsigned int circuit_open_secs;
 
 	ARRAY(struct sqlpool_host) hosts;
 	/* all connections from all hosts */
@@ -54,6 +77,8 @@ struct sqlpool_request {
 
 	unsigned int host_idx;
 	unsigned int retry_count;
+	/* when the query was sent to host_idx, 0 if it's not running */
+	uint64_t sent_usecs;
 
 	struct event *event;
 
@@ -161,6 +186,34 @@ sqlpool_request_handle_transaction(struct sql_db *conndb,
 			       driver_sqlpool_commit_callback, trans);
 }
 
+static void
+sqlpool_request_send_query(struct sqlpool_db *db, struct sql_db *conndb,
+			   unsigned int host_idx,
+			   struct sqlpool_request *request)
+{
+	struct sqlpool_host *host = array_idx_modifiable(&db->hosts, host_idx);
+
+	if (host->circuit_open_until != 0)
+		host->circuit_probe_sent = TRUE;
+	host->queries_in_flight++;
+	request->host_idx = host_idx;
+	request->sent_usecs = i_microseconds();
+	sql_query(conndb, request->query, driver_sqlpool_query_callback,
+		  request);
+}
+
+static unsigned int
+sqlpool_conndb_get_host_idx(struct sqlpool_db *db, struct sql_db *conndb)
+{
+	const struct sqlpool_connection *conn;
+
+	array_foreach(&db->all_connections, conn) {
+		if (conn->db == conndb)
+			return conn->host_idx;
+	}
+	i_unreached();
+}
+
 static void
 sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 {
@@ -174,8 +227,8 @@ sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 	timeout_reset(db->request_to);
 
 	if (request->query != NULL) {
-		sql_query(conndb, request->query,
-			  driver_sqlpool_query_callback, request);
+		sqlpool_request_send_query(db, conndb,
+			sqlpool_conndb_get_host_idx(db, conndb), request);
 	} else if (request->trans != NULL) {
 		sqlpool_request_handle_transaction(conndb, request->trans);
 	} else {
@@ -319,37 +372,82 @@ sqlpool_add_new_connection(struct sqlpool_db *db)
 		return sqlpool_add_connection(db, host, host_idx);
 }
 
+static bool sqlpool_host_is_usable(const struct sqlpool_host *host)
+{
+	if (host->circuit_open_until == 0)
+		return TRUE;
+	/* circuit is open: allow a single probe query once the wait is over */
+	return host->circuit_open_until <= ioloop_time &&
+		!host->circuit_probe_sent;
+}
+
+static uint64_t sqlpool_host_get_cost(const struct sqlpool_host *host)
+{
+	/* Expected time for a new query to finish if the host processes its
+	   queries one at a time. Hosts without latency data yet get the
+	   lowest cost, so they'll be tried soon. */
+	return host->latency_ewma_usecs * (host->queries_in_flight + 1);
+}
+
 static const struct sqlpool_connection *
 sqlpool_find_available_connection(struct sqlpool_db *db,
 				  unsigned int unwanted_host_idx,
+				  bool ignore_circuits,
 				  bool *all_disconnected_r)
 {
-	const struct sqlpool_connection *conns;
-	unsigned int i, count;
+	const struct sqlpool_connection *conns, *best = NULL;
+	const struct sqlpool_host *hosts;
+	unsigned int i, count, hosts_count, best_idx = 0;
+	uint64_t cost, best_cost = UINT64_MAX;
 
 	*all_disconnected_r = TRUE;
 
+	hosts = array_get(&db->hosts, &hosts_count);
 	conns = array_get(&db->all_connections, &count);
+	/* Use the connection whose host has the lowest expected latency.
+	   Connections with equal cost are used in round-robin order. */
 	for (i = 0; i < count; i++) {
 		unsigned int idx = (i + db->last_query_conn_idx + 1) % count;
 		struct sql_db *conndb = conns[idx].db;
+		const struct sqlpool_host *host = &hosts[conns[idx].host_idx];
 
 		if (conns[idx].host_idx == unwanted_host_idx)
 			continue;
+		if (!ignore_circuits && !sqlpool_host_is_usable(host)) {
+			if (conndb->state != SQL_DB_STATE_DISCONNECTED)
+				*all_disconnected_r = FALSE;
+			continue;
+		}
 
 		if (!SQL_DB_IS_READY(conndb) && conndb->to_reconnect == NULL) {
 			/* see if we could reconnect to it immediately */
 			(void)sql_connect(conndb);
 		}
 		if (SQL_DB_IS_READY(conndb)) {
-			db->last_query_conn_idx = idx;
 			*all_disconnected_r = FALSE;
-			return &conns[idx];
-		}
-		if (conndb->state != SQL_DB_STATE_DISCONNECTED)
+			cost = sqlpool_host_get_cost(host);
+			if (cost < best_cost) {
+				best = &conns[idx];
+				best_idx = idx;
+				best_cost = cost;
+			}
+		} else if (conndb->state != SQL_DB_STATE_DISCONNECTED)
 			*all_disconnected_r = FALSE;
 	}
-	return NULL;
+	if (best != NULL)
+		db->last_query_conn_idx = best_idx;
+	return best;
+}
+
+static bool sqlpool_have_usable_hosts(struct sqlpool_db *db)
+{
+	const struct sqlpool_host *host;
+
+	array_foreach(&db->hosts, host) {
+		if (sqlpool_host_is_usable(host))
+			return TRUE;
+	}
+	return FALSE;
 }
 
 static bool
@@ -362,10 +460,16 @@ driver_sqlpool_get_connection(struct sqlpool_db *db,
 	bool all_disconnected;
 
 	conn = sqlpool_find_available_connection(db, unwanted_host_idx,
-						 &all_disconnected);
+						 FALSE, &all_disconnected);
 	if (conn == NULL && unwanted_host_idx != UINT_MAX) {
 		/* maybe there are no wanted hosts. use any of them. */
-		conn = sqlpool_find_available_connection(db, UINT_MAX,
+		conn = sqlpool_find_available_connection(db, UINT_MAX, FALSE,
+							 &all_disconnected);
+	}
+	if (conn == NULL && !sqlpool_have_usable_hosts(db)) {
+		/* all hosts have been failing. don't make it worse by
+		   refusing to send queries anywhere. */
+		conn = sqlpool_find_available_connection(db, UINT_MAX, TRUE,
 							 &all_disconnected);
 	}
 	if (conn == NULL && all_disconnected) {
@@ -378,7 +482,7 @@ driver_sqlpool_get_connection(struct sqlpool_db *db,
 			if (conndb->connect_delay > SQL_CONNECT_RESET_DELAY)
 				conndb->connect_delay = SQL_CONNECT_RESET_DELAY;
 		}
-		conn = sqlpool_find_available_connection(db, UINT_MAX,
+		conn = sqlpool_find_available_connection(db, UINT_MAX, TRUE,
 							 &all_disconnected);
 	}
 	if (conn == NULL) {
@@ -479,6 +583,21 @@ driver_sqlpool_parse_hosts(struct sqlpool_db *db, const char *connect_string,
 					value);
 				return -1;
 			}
+		} else if (strcmp(key, "circuit_failures") == 0) {
+			if (str_to_uint(value, &db->circuit_failures) < 0) {
+				*error_r = t_strdup_printf(
+					"Invalid value for circuit_failures: %s",
+					value);
+				return -1;
+			}
+		} else if (strcmp(key, "circuit_open_secs") == 0) {
+			if (str_to_uint(value, &db->circuit_open_secs) < 0 ||
+			    db->circuit_open_secs == 0) {
+				*error_r = t_strdup_printf(
+					"Invalid value for circuit_open_secs: %s",
+					value);
+				return -1;
+			}
 		} else if (strcmp(key, "host") == 0) {
 			array_push_back(&hostnames, &value);
 		} else {
@@ -493,6 +612,7 @@ driver_sqlpool_parse_hosts(struct sqlpool_db *db, const char *connect_string,
 	if (array_count(&hostnames) == 0) {
 		/* no hosts specified. create a default one. */
 		host = array_append_space(&db->hosts);
+		host->name = i_strdup("default");
 		host->connect_string = i_strdup(connect_string);
 	} else {
 		if (*connect_string == '\0')
@@ -500,6 +620,7 @@ driver_sqlpool_parse_hosts(struct sqlpool_db *db, const char *connect_string,
 
 		array_foreach_elem(&hostnames, hostname) {
 			host = array_append_space(&db->hosts);
+			host->name = i_strdup(hostname);
 			host->connect_string =
 				i_strconcat("host=", hostname, " ",
 					    connect_string, NULL);
@@ -534,6 +655,8 @@ int driver_sqlpool_init_full(const struct sql_settings *set, const struct sql_db
 	db->driver = driver;
 	db->api = driver_sqlpool_db;
 	db->api.flags = driver->flags;
+	db->circuit_failures = SQLPOOL_DEFAULT_CIRCUIT_FAILURES;
+	db->circuit_open_secs = SQLPOOL_DEFAULT_CIRCUIT_OPEN_SECS;
 	db->api.event = event_create(set->event_parent);
 	event_add_category(db->api.event, &event_category_sqlpool);
 	event_set_append_log_prefix(db->api.event,
@@ -579,8 +702,10 @@ static void driver_sqlpool_deinit(struct sql_db *_db)
 
 	driver_sqlpool_abort_requests(db);
 
-	array_foreach_modifiable(&db->hosts, host)
+	array_foreach_modifiable(&db->hosts, host) {
+		i_free(host->name);
 		i_free(host->connect_string);
+	}
 
 	i_assert(array_count(&db->all_connections) == 0);
 	array_free(&db->hosts);
@@ -694,6 +819,52 @@ driver_sqlpool_append_request(struct sqlpool_db *db,
 	}
 }
 
+static void
+sqlpool_host_query_finished(struct sqlpool_db *db,
+			    struct sqlpool_request *request, bool failed)
+{
+	struct sqlpool_host *host =
+		array_idx_modifiable(&db->hosts, request->host_idx);
+	uint64_t latency = i_microseconds() - request->sent_usecs;
+
+	i_assert(host->queries_in_flight > 0);
+	host->queries_in_flight--;
+	request->sent_usecs = 0;
+
+	if (!failed) {
+		if (host->latency_ewma_usecs == 0)
+			host->latency_ewma_usecs = latency;
+		else {
+			host->latency_ewma_usecs = host->latency_ewma_usecs -
+				host->latency_ewma_usecs / SQLPOOL_LATENCY_EWMA_DIVISOR +
+				latency / SQLPOOL_LATENCY_EWMA_DIVISOR;
+		}
+		if (host->latency_ewma_usecs == 0)
+			host->latency_ewma_usecs = 1;
+		if (host->circuit_open_until != 0) {
+			e_info(db->api.event,
+			       "Host %s is working again", host->name);
+		}
+		host->failure_count = 0;
+		host->circuit_open_until = 0;
+		host->circuit_probe_sent = FALSE;
+		return;
+	}
+
+	host->failure_count++;
+	if (db->circuit_failures == 0 ||
+	    host->failure_count < db->circuit_failures)
+		return;
+	if (host->circuit_open_until == 0) {
+		e_warning(db->api.event,
+			  "Host %s: %u queries failed in a row - "
+			  "not using it for %u secs", host->name,
+			  host->failure_count, db->circuit_open_secs);
+	}
+	host->circuit_open_until = ioloop_time + db->circuit_open_secs;
+	host->circuit_probe_sent = FALSE;
+}
+
 static void
 driver_sqlpool_query_callback(struct sql_result *result,
 			      struct sqlpool_request *request)
@@ -702,6 +873,7 @@ driver_sqlpool_query_callback(struct sql_result *result,
 	const struct sqlpool_connection *conn = NULL;
 	struct sql_db *conndb;
 
+	sqlpool_host_query_finished(db, request, result->failed_try_retry);
 	if (result->failed_try_retry &&
 	    request->retry_count < array_count(&db->hosts)) {
 		e_warning(db->api.event, "Query failed, retrying: %s",
@@ -710,10 +882,8 @@ driver_sqlpool_query_callback(struct sql_result *result,
 		driver_sqlpool_prepend_request(db, request);
 
 		if (driver_sqlpool_get_connection(request->db,
-						  request->host_idx, &conn)) {
-			request->host_idx = conn->host_idx;
+						  request->host_idx, &conn))
 			sqlpool_request_send_next(db, conn->db);
-		}
 	} else {
 		if (result->failed) {
 			e_error(db->api.event, "Query failed, aborting: %s",
@@ -743,11 +913,8 @@ driver_sqlpool_query(struct sql_db *_db, const char *query,
 
 	if (!driver_sqlpool_get_connection(db, UINT_MAX, &conn))
 		driver_sqlpool_append_request(db, request);
-	else {
-		request->host_idx = conn->host_idx;
-		sql_query(conn->db, query, driver_sqlpool_query_callback,
-			  request);
-	}
+	else
+		sqlpool_request_send_query(db, conn->db, conn->host_idx, request);
 }
 
 static void driver_sqlpool_exec(struct sql_db *_db, const char *query)
@@ -318,6 +318,8 @@ driver_test_transaction_commit(struct sql_transaction_context *ctx,
 				sql_commit_callback_t *callback, void *context)
 {
 	struct sql_commit_result res;
+
+	i_zero(&res);
 	res.error_type = driver_test_transaction_commit_s(ctx, &res.error);
 	callback(&res, context);
 }
@@ -148,6 +148,9 @@ struct sql_db {
 
 	struct event *event;
 	HASH_TABLE(char *, struct sql_prepared_statement *) prepared_stmt_hash;
+	/* cache key => prepared statement. The statements are also in
+	   prepared_stmt_hash. */
+	HASH_TABLE(char *, struct sql_prepared_statement *) prepared_stmt_key_hash;
 
 	enum sql_db_state state;
 	/* last time we started connecting to this server
@@ -114,6 +114,8 @@ void sql_init_common(struct sql_db *db)
 	i_array_init(&db->module_contexts, 5);
 	hash_table_create(&db->prepared_stmt_hash, default_pool, 0,
 			  str_hash, strcmp);
+	hash_table_create(&db->prepared_stmt_key_hash, default_pool, 0,
+			  str_hash, strcmp);
 }
 
 void sql_ref(struct sql_db *db)
@@ -133,7 +135,13 @@ static void sql_prepared_statements_free(struct sql_db *db)
 {
 	struct hash_iterate_context *iter;
 	struct sql_prepared_statement *prep_stmt;
-	char *query;
+	char *query, *key;
+
+	iter = hash_table_iterate_init(db->prepared_stmt_key_hash);
+	while (hash_table_iterate(iter, db->prepared_stmt_key_hash, &key, &prep_stmt))
+		i_free(key);
+	hash_table_iterate_deinit(&iter);
+	hash_table_clear(db->prepared_stmt_key_hash, TRUE);
 
 	iter = hash_table_iterate_init(db->prepared_stmt_hash);
 	while (hash_table_iterate(iter, db->prepared_stmt_hash, &query, &prep_stmt)) {
@@ -162,6 +170,7 @@ void sql_unref(struct sql_db **_db)
 	timeout_remove(&db->to_reconnect);
 	sql_prepared_statements_free(db);
 	hash_table_destroy(&db->prepared_stmt_hash);
+	hash_table_destroy(&db->prepared_stmt_key_hash);
 	db->v.deinit(db);
 }
 
@@ -339,6 +348,40 @@ void sql_prepared_statement_unref(struct sql_prepared_statement **_prep_stmt)
 	prep_stmt->refcount--;
 }
 
+struct sql_prepared_statement *
+sql_prepared_statement_init_key(struct sql_db *db, const char *key,
+				const char *query_template)
+{
+	struct sql_prepared_statement *stmt;
+
+	stmt = sql_prepared_statement_lookup_key(db, key);
+	if (stmt != NULL) {
+		i_assert(strcmp(stmt->query_template, query_template) == 0);
+		return stmt;
+	}
+
+	stmt = sql_prepared_statement_init(db, query_template);
+	hash_table_insert(db->prepared_stmt_key_hash, i_strdup(key), stmt);
+	return stmt;
+}
+
+struct sql_prepared_statement *
+sql_prepared_statement_lookup_key(struct sql_db *db, const char *key)
+{
+	struct sql_prepared_statement *stmt;
+
+	stmt = hash_table_lookup(db->prepared_stmt_key_hash, key);
+	if (stmt != NULL)
+		stmt->refcount++;
+	return stmt;
+}
+
+const char *
+sql_prepared_statement_get_query(struct sql_prepared_statement *prep_stmt)
+{
+	return prep_stmt->query_template;
+}
+
 static void
 sql_statement_init_fields(struct sql_statement *stmt, struct sql_db *db)
 {
@@ -138,6 +138,22 @@ struct sql_result *sql_query_s(struct sql_db *db, const char *query);
 struct sql_prepared_statement *
 sql_prepared_statement_init(struct sql_db *db, const char *query_template);
 void sql_prepared_statement_unref(struct sql_prepared_statement **prep_stmt);
+/* Like sql_prepared_statement_init(), but also remember the statement under
+   a caller-chosen cache key (e.g. "map/operation"). Callers that generate
+   their queries dynamically can use sql_prepared_statement_lookup_key() to
+   find the statement again without having to rebuild the query template.
+   The statements are kept until the db is deinitialized. */
+struct sql_prepared_statement *
+sql_prepared_statement_init_key(struct sql_db *db, const char *key,
+				const char *query_template);
+/* Returns the prepared statement earlier initialized with
+   sql_prepared_statement_init_key(), or NULL if there is none. The returned
+   statement is referenced and must be unreferenced by the caller. */
+struct sql_prepared_statement *
+sql_prepared_statement_lookup_key(struct sql_db *db, const char *key);
+/* Returns the query template of the prepared statement. */
+const char *
+sql_prepared_statement_get_query(struct sql_prepared_statement *prep_stmt);
 
 struct sql_statement *
 sql_statement_init(struct sql_db *db, const char *query_template);
@@ -0,0 +1,272 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "test-common.h"
+#include "sql-api-private.h"
+
+/* Asynchronous SQL driver that answers every query after a host-specific
+   delay, so sqlpool's host selection can be tested. */
+
+struct test_host {
+	const char *name;
+	unsigned int latency_msecs;
+	bool fail;
+
+	unsigned int queries;
+};
+
+struct test_pool_sql_db {
+	struct sql_db api;
+	struct test_host *host;
+
+	struct timeout *to;
+	sql_query_callback_t *callback;
+	void *context;
+};
+
+static struct test_host test_hosts[] = {
+	{ .name = "fast", .latency_msecs = 1 },
+	{ .name = "slow", .latency_msecs = 30 },
+	{ .name = "down", .latency_msecs = 1, .fail = TRUE },
+};
+
+static unsigned int test_queries_left, test_queries_failed;
+static struct sql_db *test_sql;
+
+extern const struct sql_db driver_test_pool_db;
+
+static struct test_host *test_host_find(const char *name)
+{
+	for (unsigned int i = 0; i < N_ELEMENTS(test_hosts); i++) {
+		if (strcmp(test_hosts[i].name, name) == 0)
+			return &test_hosts[i];
+	}
+	i_unreached();
+}
+
+static struct sql_db *driver_test_pool_init(const char *connect_string)
+{
+	struct test_pool_sql_db *db;
+
+	i_assert(str_begins_with(connect_string, "host="));
+
+	db = i_new(struct test_pool_sql_db, 1);
+	db->api = driver_test_pool_db;
+	db->host = test_host_find(t_strcut(connect_string + 5, ' '));
+	return &db->api;
+}
+
+static void driver_test_pool_deinit(struct sql_db *_db)
+{
+	struct test_pool_sql_db *db = (struct test_pool_sql_db *)_db;
+
+	i_assert(db->to == NULL);
+	array_free(&_db->module_contexts);
+	i_free(db);
+}
+
+static int driver_test_pool_connect(struct sql_db *_db)
+{
+	if (_db->state == SQL_DB_STATE_DISCONNECTED)
+		sql_db_set_state(_db, SQL_DB_STATE_IDLE);
+	return 1;
+}
+
+static void driver_test_pool_disconnect(struct sql_db *_db)
+{
+	sql_db_set_state(_db, SQL_DB_STATE_DISCONNECTED);
+}
+
+static const char *
+driver_test_pool_escape_string(struct sql_db *_db ATTR_UNUSED,
+			       const char *string)
+{
+	return string;
+}
+
+static void driver_test_pool_result_free(struct sql_result *result)
+{
+	i_free(result);
+}
+
+static int driver_test_pool_result_next_row(struct sql_result *result)
+{
+	return result->failed ? -1 : 0;
+}
+
+static const char *
+driver_test_pool_result_get_error(struct sql_result *result ATTR_UNUSED)
+{
+	return "Host is down";
+}
+
+static void driver_test_pool_query_finish(struct test_pool_sql_db *db)
+{
+	sql_query_callback_t *callback = db->callback;
+	struct sql_result *result;
+
+	timeout_remove(&db->to);
+	db->callback = NULL;
+
+	result = i_new(struct sql_result, 1);
+	result->v.free = driver_test_pool_result_free;
+	result->v.next_row = driver_test_pool_result_next_row;
+	result->v.get_error = driver_test_pool_result_get_error;
+	result->db = &db->api;
+	result->refcount = 1;
+	result->failed = db->host->fail;
+	result->failed_try_retry = db->host->fail;
+
+	sql_db_set_state(&db->api, SQL_DB_STATE_IDLE);
+	callback(result, db->context);
+	sql_result_unref(result);
+}
+
+static void
+driver_test_pool_query(struct sql_db *_db, const char *query ATTR_UNUSED,
+		       sql_query_callback_t *callback, void *context)
+{
+	struct test_pool_sql_db *db = (struct test_pool_sql_db *)_db;
+
+	i_assert(SQL_DB_IS_READY(_db));
+	sql_db_set_state(_db, SQL_DB_STATE_BUSY);
+
+	db->host->queries++;
+	db->callback = callback;
+	db->context = context;
+	db->to = timeout_add_short(db->host->latency_msecs,
+				   driver_test_pool_query_finish, db);
+}
+
+const struct sql_db driver_test_pool_db = {
+	.name = "testpool",
+	.flags = SQL_DB_FLAG_POOLED,
+
+	.v = {
+		.init = driver_test_pool_init,
+		.deinit = driver_test_pool_deinit,
+		.connect = driver_test_pool_connect,
+		.disconnect = driver_test_pool_disconnect,
+		.escape_string = driver_test_pool_escape_string,
+		.query = driver_test_pool_query,
+	}
+};
+
+static void test_query_callback(struct sql_result *result,
+				void *context ATTR_UNUSED)
+{
+	if (result->failed)
+		test_queries_failed++;
+	if (--test_queries_left == 0) {
+		io_loop_stop(current_ioloop);
+		return;
+	}
+	sql_query(test_sql, "SELECT 1", test_query_callback, NULL);
+}
+
+static void test_run_queries(unsigned int count)
+{
+	test_queries_left = count;
+	test_queries_failed = 0;
+	sql_query(test_sql, "SELECT 1", test_query_callback, NULL);
+	io_loop_run(current_ioloop);
+}
+
+static void test_hosts_reset(void)
+{
+	for (unsigned int i = 0; i < N_ELEMENTS(test_hosts); i++)
+		test_hosts[i].queries = 0;
+}
+
+static void test_sqlpool_init(const char *connect_string)
+{
+	const struct sql_settings set = {
+		.driver = "testpool",
+		.connect_string = connect_string,
+	};
+	const char *error;
+
+	test_hosts_reset();
+	if (sql_init_full(&set, &test_sql, &error) < 0)
+		i_fatal("sql_init_full() failed: %s", error);
+}
+
+static void test_sqlpool_latency(void)
+{
+	struct ioloop *ioloop;
+
+	test_begin("sqlpool latency based host selection");
+	ioloop = io_loop_create();
+	test_sqlpool_init("host=slow host=fast");
+
+	test_run_queries(40);
+	test_assert(test_queries_failed == 0);
+	/* both hosts are tried once before there's any latency data */
+	test_assert(test_host_find("slow")->queries <= 2);
+	test_assert(test_host_find("fast")->queries >= 38);
+
+	sql_unref(&test_sql);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_sqlpool_circuit_breaker(void)
+{
+	struct test_host *down = test_host_find("down");
+	struct ioloop *ioloop;
+	struct timeout *to;
+
+	test_begin("sqlpool circuit breaker");
+	ioloop = io_loop_create();
+	test_sqlpool_init("host=down host=fast "
+			  "circuit_failures=2 circuit_open_secs=1");
+
+	/* failed queries are retried with the other host */
+	test_expect_errors(3);
+	test_run_queries(20);
+	test_expect_no_more_errors();
+	test_assert(test_queries_failed == 0);
+	test_assert(down->queries == 2);
+	test_assert(test_host_find("fast")->queries == 20);
+
+	/* after the wait a single query is sent to see if the host works */
+	to = timeout_add_short(1100, io_loop_stop, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_expect_error_string("Query failed, retrying");
+	test_run_queries(5);
+	test_expect_no_more_errors();
+	test_assert(test_queries_failed == 0);
+	test_assert(down->queries == 3);
+
+	/* the host works again */
+	to = timeout_add_short(1100, io_loop_stop, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	down->fail = FALSE;
+	test_run_queries(5);
+	test_assert(test_queries_failed == 0);
+	test_assert(down->queries >= 4);
+
+	sql_unref(&test_sql);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_sqlpool_latency,
+		test_sqlpool_circuit_breaker,
+		NULL
+	};
+	int ret;
+
+	sql_drivers_init();
+	sql_driver_register(&driver_test_pool_db);
+	ret = test_run(test_functions);
+	sql_driver_unregister(&driver_test_pool_db);
+	sql_drivers_deinit();
+	return ret;
+}
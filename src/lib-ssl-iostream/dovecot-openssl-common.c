@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "randgen.h"
+#include "sampling-profiler.h"
 #include "dovecot-openssl-common.h"
 #include "iostream-openssl.h"
 
@@ -79,7 +80,12 @@ void dovecot_openssl_common_global_ref(void)
 		/*i_warning("CRYPTO_set_mem_functions() was called too late");*/
 	}
 
+	/* OpenSSL may dlopen() the modules listed in its config file. The
+	   dynamic linker's locks aren't safe for the profiler's signal
+	   handler to take while we're holding them. */
+	sampling_profiler_block();
 	OPENSSL_init_ssl(0, NULL);
+	sampling_profiler_unblock();
 }
 
 bool dovecot_openssl_common_global_unref(void)
@@ -89,6 +95,8 @@ bool dovecot_openssl_common_global_unref(void)
 	if (--openssl_init_refcount > 0)
 		return TRUE;
 
+	/* engines, providers and config modules get dlclose()d */
+	sampling_profiler_block();
 	if (dovecot_openssl_engine != NULL) {
 #ifdef HAVE_OSSL_PROVIDER_try_load
 		OSSL_PROVIDER_unload(dovecot_openssl_engine);
@@ -98,15 +106,14 @@ bool dovecot_openssl_common_global_unref(void)
 		dovecot_openssl_engine = NULL;
 	}
 	OPENSSL_cleanup();
+	sampling_profiler_unblock();
 	return FALSE;
 }
 
-int dovecot_openssl_common_global_set_engine(const char *engine,
-					     const char **error_r)
+static int
+dovecot_openssl_common_global_load_engine(const char *engine,
+					  const char **error_r)
 {
-	if (dovecot_openssl_engine != NULL)
-		return 1;
-
 #ifdef HAVE_ENGINE_by_id
 	ENGINE_load_builtin_engines();
 	dovecot_openssl_engine = ENGINE_by_id(engine);
@@ -138,3 +145,18 @@ int dovecot_openssl_common_global_set_engine(const char *engine,
 #endif
 	return 1;
 }
+
+int dovecot_openssl_common_global_set_engine(const char *engine,
+					     const char **error_r)
+{
+	int ret;
+
+	if (dovecot_openssl_engine != NULL)
+		return 1;
+
+	/* engines and providers are dlopen()ed */
+	sampling_profiler_block();
+	ret = dovecot_openssl_common_global_load_engine(engine, error_r);
+	sampling_profiler_unblock();
+	return ret;
+}
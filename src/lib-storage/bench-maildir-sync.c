@@ -0,0 +1,144 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "write-full.h"
+#include "master-service.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Measures how long it takes to sync a maildir with a large cur/ directory
+ * after a single new mail was added to it, with and without
+ * maildir_sync_journal. The first sync scans the whole directory in both
+ * cases.
+ */
+
+#define BENCH_SYNC_ROUNDS 20
+
+static const char bench_mail[] = "Subject: bench\n\nbody\n";
+
+static void bench_write_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, bench_mail, sizeof(bench_mail)-1) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static uint64_t bench_sync(struct mailbox *box)
+{
+	uint64_t ts = i_nanoseconds();
+
+	if (mailbox_sync(box, 0) < 0) {
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	return i_nanoseconds() - ts;
+}
+
+static void
+bench_maildir_sync(struct test_mail_storage_ctx *ctx, bool journal,
+		   unsigned int count)
+{
+	const char *const journal_input[] = {
+		"maildir_sync_journal=yes",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.extra_input = journal ? journal_input : NULL,
+	};
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	const char *path;
+	string_t *fname;
+	size_t prefix_len;
+	uint64_t full_nsecs, incr_nsecs = 0;
+	unsigned int i;
+
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_open(box) < 0) {
+		i_fatal("mailbox_open() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+				&path) <= 0)
+		i_unreached();
+
+	fname = str_new(default_pool, 256);
+	str_printfa(fname, "%s/cur/", path);
+	prefix_len = str_len(fname);
+	for (i = 0; i < count; i++) {
+		str_truncate(fname, prefix_len);
+		str_printfa(fname, "%u.M%uP1.bench:2,S", i, i);
+		bench_write_file(str_c(fname));
+	}
+	full_nsecs = bench_sync(box);
+
+	for (i = 0; i < BENCH_SYNC_ROUNDS; i++) {
+		str_truncate(fname, prefix_len);
+		str_printfa(fname, "%u.M%uP2.bench:2,", i, i);
+		bench_write_file(str_c(fname));
+		incr_nsecs += bench_sync(box);
+	}
+	str_free(&fname);
+
+	printf("%s\n", journal ? "journal" : "readdir");
+	printf("\tFirst sync: %0.02lf ms\n", (double)full_nsecs / 1000000);
+	printf("\tSync after a new mail: %0.02lf ms\n\n",
+	       (double)incr_nsecs / BENCH_SYNC_ROUNDS / 1000000);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s count\n", prog);
+	fprintf(stderr, "Runs with 100000 mails if nothing given\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_mail_storage_ctx *ctx;
+	unsigned int count = 100000;
+
+	master_service = master_service_init("bench-maildir-sync",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	printf("%u mails in cur/\n\n", count);
+	ctx = test_mail_storage_init();
+	bench_maildir_sync(ctx, FALSE, count);
+	bench_maildir_sync(ctx, TRUE, count);
+	test_mail_storage_deinit(&ctx);
+
+	master_service_deinit(&master_service);
+	return 0;
+}
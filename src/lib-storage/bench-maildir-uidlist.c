@@ -0,0 +1,210 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "time-util.h"
+#include "write-full.h"
+#include "master-service.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Compares the text and binary maildir_uidlist_format with a large
+ * maildir. Measures how long it takes to open the mailbox and read
+ * a mail (which reads the whole dovecot-uidlist) and to deliver a new
+ * mail to it (which reads dovecot-uidlist and appends to it while
+ * locked).
+ */
+
+#define BENCH_ROUNDS 20
+
+static const char bench_mail[] = "Subject: bench\n\nbody\n";
+
+static void bench_write_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, bench_mail, sizeof(bench_mail)-1) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static struct mailbox *bench_mailbox_open(struct test_mail_storage_ctx *ctx)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_open(box) < 0 || mailbox_sync(box, 0) < 0) {
+		i_fatal("Failed to open mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	return box;
+}
+
+static void bench_fill(struct test_mail_storage_ctx *ctx, unsigned int count)
+{
+	struct mailbox *box;
+	const char *path;
+	string_t *fname;
+	size_t prefix_len;
+	unsigned int i;
+
+	box = bench_mailbox_open(ctx);
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+				&path) <= 0)
+		i_unreached();
+	fname = t_str_new(256);
+	str_printfa(fname, "%s/cur/", path);
+	prefix_len = str_len(fname);
+	for (i = 0; i < count; i++) {
+		str_truncate(fname, prefix_len);
+		str_printfa(fname, "%u.M%uP1.bench:2,S", i, i);
+		bench_write_file(str_c(fname));
+	}
+	if (mailbox_sync(box, 0) < 0) {
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	mailbox_free(&box);
+}
+
+static uint64_t bench_open(struct test_mail_storage_ctx *ctx)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mailbox_status status;
+	struct mail *mail;
+	struct istream *input;
+	uint64_t ts = i_nanoseconds();
+
+	box = bench_mailbox_open(ctx);
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, status.messages);
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+		i_fatal("mail_get_stream() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&trans);
+	mailbox_free(&box);
+	return i_nanoseconds() - ts;
+}
+
+static uint64_t bench_deliver(struct test_mail_storage_ctx *ctx)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	uint64_t ts = i_nanoseconds();
+	int ret;
+
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", MAILBOX_FLAG_SAVEONLY);
+	if (mailbox_open(box) < 0) {
+		i_fatal("mailbox_open() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+					  __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	input = i_stream_create_from_data(bench_mail, sizeof(bench_mail)-1);
+	ret = mailbox_save_begin(&save_ctx, input);
+	while (ret == 0 && i_stream_read(input) > 0) {
+		if (mailbox_save_continue(save_ctx) < 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		ret = mailbox_save_finish(&save_ctx);
+	else
+		mailbox_save_cancel(&save_ctx);
+	if (ret < 0 || mailbox_transaction_commit(&trans) < 0) {
+		i_fatal("Saving failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	i_stream_unref(&input);
+	mailbox_free(&box);
+	return i_nanoseconds() - ts;
+}
+
+static void
+bench_maildir_uidlist(struct test_mail_storage_ctx *ctx, const char *format,
+		      unsigned int count)
+{
+	const char *const extra_input[] = {
+		t_strdup_printf("maildir_uidlist_format=%s", format),
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.extra_input = extra_input,
+	};
+	uint64_t open_nsecs = 0, deliver_nsecs = 0;
+	unsigned int i;
+
+	test_mail_storage_init_user(ctx, &set);
+	bench_fill(ctx, count);
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		open_nsecs += bench_open(ctx);
+		deliver_nsecs += bench_deliver(ctx);
+	}
+
+	printf("%s\n", format);
+	printf("\tOpen and read a mail: %0.02lf ms\n",
+	       (double)open_nsecs / BENCH_ROUNDS / 1000000);
+	printf("\tDeliver a mail: %0.02lf ms\n\n",
+	       (double)deliver_nsecs / BENCH_ROUNDS / 1000000);
+	test_mail_storage_deinit_user(ctx);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s count\n", prog);
+	fprintf(stderr, "Runs with 200000 mails if nothing given\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_mail_storage_ctx *ctx;
+	unsigned int count = 200000;
+
+	master_service = master_service_init("bench-maildir-uidlist",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	printf("%u mails\n\n", count);
+	ctx = test_mail_storage_init();
+	bench_maildir_uidlist(ctx, "text", count);
+	bench_maildir_uidlist(ctx, "binary", count);
+	test_mail_storage_deinit(&ctx);
+
+	master_service_deinit(&master_service);
+	return 0;
+}
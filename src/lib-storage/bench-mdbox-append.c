@@ -0,0 +1,176 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "strnum.h"
+#include "hostpid.h"
+#include "istream.h"
+#include "time-util.h"
+#include "master-service.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/**
+ * Runs concurrent writer processes that save mails to the same mdbox
+ * storage, each mail in its own transaction like LMTP deliveries and IMAP
+ * APPENDs do. The writers either all save to INBOX or each to its own
+ * mailbox, in which case they share only the storage's map index.
+ */
+
+static const char bench_mail[] =
+	"From: sender@example.com\n"
+	"To: user@example.com\n"
+	"Subject: bench\n"
+	"\n"
+	"body\n";
+
+static int bench_save(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	int ret;
+
+	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+					  __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	input = i_stream_create_from_data(bench_mail, sizeof(bench_mail)-1);
+	ret = mailbox_save_begin(&save_ctx, input);
+	while (ret == 0 && i_stream_read(input) > 0) {
+		if (mailbox_save_continue(save_ctx) < 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		ret = mailbox_save_finish(&save_ctx);
+	else
+		mailbox_save_cancel(&save_ctx);
+	i_stream_unref(&input);
+	if (ret < 0) {
+		mailbox_transaction_rollback(&trans);
+		return -1;
+	}
+	return mailbox_transaction_commit(&trans);
+}
+
+static int
+bench_writer(struct test_mail_storage_ctx *ctx, const char *box_name,
+	     unsigned int count)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.keep_home = TRUE,
+	};
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	unsigned int i;
+	int ret = 0;
+
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, box_name, MAILBOX_FLAG_SAVEONLY);
+	if (mailbox_open(box) < 0)
+		ret = -1;
+	for (i = 0; i < count && ret == 0; i++)
+		ret = bench_save(box);
+	if (ret < 0) {
+		i_error("Saving to %s failed: %s", box_name,
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	return ret;
+}
+
+static void
+bench_mdbox_append(struct test_mail_storage_ctx *ctx, bool same_mailbox,
+		   unsigned int writers, unsigned int count)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+	};
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	pid_t *pids;
+	unsigned int i;
+	uint64_t ts, nsecs;
+	int status;
+	bool failed = FALSE;
+
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	for (i = 0; i < writers && !same_mailbox; i++) {
+		box = mailbox_alloc(ns->list, t_strdup_printf("box%u", i), 0);
+		if (mailbox_create(box, NULL, FALSE) < 0) {
+			i_fatal("mailbox_create() failed: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		}
+		mailbox_free(&box);
+	}
+	test_mail_storage_deinit_user(ctx);
+
+	pids = t_new(pid_t, writers);
+	ts = i_nanoseconds();
+	for (i = 0; i < writers; i++) {
+		if ((pids[i] = fork()) == (pid_t)-1)
+			i_fatal("fork() failed: %m");
+		if (pids[i] == 0) {
+			/* temp file names contain the PID */
+			hostpid_init();
+			_exit(bench_writer(ctx, same_mailbox ? "INBOX" :
+					   t_strdup_printf("box%u", i),
+					   count) < 0 ? 1 : 0);
+		}
+	}
+	for (i = 0; i < writers; i++) {
+		if (waitpid(pids[i], &status, 0) < 0)
+			i_fatal("waitpid() failed: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = TRUE;
+	}
+	nsecs = i_nanoseconds() - ts;
+	if (failed)
+		i_fatal("Some of the writers failed");
+
+	printf("%u writers, %s\n", writers,
+	       same_mailbox ? "same mailbox" : "separate mailboxes");
+	printf("\t%0.02lf deliveries/sec\n\n",
+	       (double)writers * count * 1000000000 / nsecs);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [writers [mails]]\n", prog);
+	fprintf(stderr, "Runs 8 writers with 500 mails each if nothing given\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_mail_storage_ctx *ctx;
+	unsigned int writers = 8, count = 500;
+
+	master_service = master_service_init("bench-mdbox-append",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (argc > 3 ||
+	    (argc >= 2 && (str_to_uint(argv[1], &writers) < 0 ||
+			   writers == 0)) ||
+	    (argc == 3 && (str_to_uint(argv[2], &count) < 0 || count == 0))) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	ctx = test_mail_storage_init();
+	bench_mdbox_append(ctx, TRUE, 1, count);
+	bench_mdbox_append(ctx, TRUE, writers, count);
+	bench_mdbox_append(ctx, FALSE, writers, count);
+	test_mail_storage_deinit(&ctx);
+
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -3,7 +3,9 @@
 #include "lib.h"
 #include "istream.h"
 #include "str.h"
+#include "index-mail.h"
 #include "dbox-file.h"
+#include "dbox-mail.h"
 #include "dbox-save.h"
 #include "dbox-attachment.h"
 
@@ -21,6 +23,117 @@ void dbox_attachment_save_write_metadata(struct mail_save_context *ctx,
 	str_append_c(str, '\n');
 }
 
+bool dbox_attachment_storage_is_compatible(struct dbox_storage *src_storage,
+					   struct dbox_storage *dest_storage)
+{
+	const struct mail_storage_settings *src_set = src_storage->storage.set;
+	const struct mail_storage_settings *dest_set = dest_storage->storage.set;
+
+	return src_storage->attachment_dir != NULL &&
+		dest_storage->attachment_dir != NULL &&
+		strcmp(src_storage->attachment_dir,
+		       dest_storage->attachment_dir) == 0 &&
+		strcmp(src_set->mail_attachment_fs,
+		       dest_set->mail_attachment_fs) == 0 &&
+		strcmp(src_set->mail_attachment_hash,
+		       dest_set->mail_attachment_hash) == 0;
+}
+
+static void dbox_attachment_save_copy_abort(struct mail_save_context *ctx)
+{
+	struct dbox_storage *storage =
+		DBOX_STORAGE(ctx->transaction->box->storage);
+	const ARRAY_TYPE(mail_attachment_extref) *extrefs;
+	const struct mail_attachment_extref *extref;
+
+	/* delete the links that were already created */
+	extrefs = index_attachment_save_get_extrefs(ctx);
+	array_foreach(extrefs, extref) {
+		(void)index_attachment_delete(&storage->storage,
+					      storage->attachment_fs,
+					      extref->path);
+	}
+	index_attachment_save_free(ctx);
+}
+
+static bool
+dbox_attachment_save_link_all(struct mail_save_context *ctx,
+			      struct dbox_storage *src_storage,
+			      struct dbox_file *src_file, const char *ext_refs)
+{
+	ARRAY_TYPE(mail_attachment_extref) extrefs;
+	const struct mail_attachment_extref *extref;
+	const char *path_suffix, *src_path;
+
+	t_array_init(&extrefs, 16);
+	if (!index_attachment_parse_extrefs(ext_refs, pool_datastack_create(),
+					    &extrefs))
+		return FALSE;
+
+	path_suffix = src_storage->v.get_attachment_path_suffix(src_file);
+	array_foreach(&extrefs, extref) {
+		src_path = t_strdup_printf("%s/%s%s",
+					   src_storage->attachment_dir,
+					   extref->path, path_suffix);
+		if (index_attachment_save_link(ctx, src_path, extref) <= 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+bool dbox_attachment_save_begin_copy(struct mail_save_context *ctx,
+				     struct istream *input)
+{
+	struct dbox_storage *dest_storage =
+		DBOX_STORAGE(ctx->transaction->box->storage);
+	struct dbox_storage *src_storage;
+	struct mail *src_mail;
+	struct dbox_file *file;
+	struct istream *msg_input;
+	const char *ext_refs;
+	bool ret;
+
+	if (ctx->copy_src_mail == NULL ||
+	    mail_get_backend_mail(ctx->copy_src_mail, &src_mail) < 0)
+		return FALSE;
+	if (src_mail->box->v.mail_alloc != dbox_mail_alloc) {
+		/* not a dbox mail */
+		return FALSE;
+	}
+	src_storage = DBOX_STORAGE(src_mail->box->storage);
+	if (!dbox_attachment_storage_is_compatible(src_storage, dest_storage))
+		return FALSE;
+	if (((struct mail_private *)src_mail)->v.istream_opened !=
+	    index_mail_opened) {
+		/* a plugin changes the saved message data, e.g. decrypts it.
+		   the message needs to go through it. */
+		return FALSE;
+	}
+
+	if (dbox_mail_metadata_read(DBOX_MAIL(src_mail), &file) < 0)
+		return FALSE;
+	ext_refs = dbox_file_metadata_get(file, DBOX_METADATA_EXT_REF);
+	if (ext_refs == NULL) {
+		/* nothing to share */
+		return FALSE;
+	}
+
+	msg_input = i_stream_create_range(file->input,
+		file->cur_offset + file->msg_header_size,
+		file->cur_physical_size);
+	index_attachment_save_begin_copy(ctx, dest_storage->attachment_fs,
+					 input, msg_input);
+	i_stream_unref(&msg_input);
+
+	T_BEGIN {
+		ret = dbox_attachment_save_link_all(ctx, src_storage, file,
+						    ext_refs);
+	} T_END;
+	if (!ret)
+		dbox_attachment_save_copy_abort(ctx);
+	return ret;
+}
+
 static int
 dbox_attachment_file_get_stream_from(struct dbox_file *file,
 				     const char *ext_refs,
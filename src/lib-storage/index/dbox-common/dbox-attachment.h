@@ -4,7 +4,18 @@
 #include "index-attachment.h"
 
 struct dbox_file;
+struct dbox_storage;
 
+/* Returns TRUE if both storages save attachments to the same place in the
+   same way, so the dest_storage can reference src_storage's attachments. */
+bool dbox_attachment_storage_is_compatible(struct dbox_storage *src_storage,
+					   struct dbox_storage *dest_storage);
+/* When copying a dbox message with external attachments to a compatible
+   storage, reference the existing attachment files instead of extracting and
+   writing them again. Returns TRUE if this was done, FALSE if the message
+   should be saved normally with index_attachment_save_begin(). */
+bool dbox_attachment_save_begin_copy(struct mail_save_context *ctx,
+				     struct istream *input);
 void dbox_attachment_save_write_metadata(struct mail_save_context *ctx,
 					 string_t *str);
 
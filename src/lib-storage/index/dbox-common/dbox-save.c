@@ -61,7 +61,10 @@ void dbox_save_begin(struct dbox_save_context *ctx, struct istream *input)
 
 	if (_ctx->data.received_date == (time_t)-1)
 		_ctx->data.received_date = ioloop_time;
-	index_attachment_save_begin(_ctx, storage->attachment_fs, ctx->input);
+	if (!dbox_attachment_save_begin_copy(_ctx, ctx->input)) {
+		index_attachment_save_begin(_ctx, storage->attachment_fs,
+					    ctx->input);
+	}
 }
 
 int dbox_save_continue(struct mail_save_context *_ctx)
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "hash.h"
+#include "bsearch-insert-pos.h"
 #include "ostream.h"
 #include "mkdir-parents.h"
 #include "unlink-old-files.h"
@@ -423,8 +424,35 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 	return 0;
 }
 
+int mdbox_map_zero_ref_file_cmp(const uint32_t *file_id,
+				const struct mdbox_map_zero_ref_file *file)
+{
+	if (*file_id < file->file_id)
+		return -1;
+	if (*file_id > file->file_id)
+		return 1;
+	return 0;
+}
+
+static void
+mdbox_map_add_zero_ref(ARRAY_TYPE(mdbox_map_zero_ref_file) *files,
+		       const struct mdbox_map_mail_index_record *rec)
+{
+	struct mdbox_map_zero_ref_file *file;
+	unsigned int idx;
+
+	if (!array_bsearch_insert_pos(files, &rec->file_id,
+				      mdbox_map_zero_ref_file_cmp, &idx)) {
+		file = array_insert_space(files, idx);
+		file->file_id = rec->file_id;
+	} else {
+		file = array_idx_modifiable(files, idx);
+	}
+	file->zero_ref_size += rec->size;
+}
+
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r)
+				 ARRAY_TYPE(mdbox_map_zero_ref_file) *files_r)
 {
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
@@ -455,7 +483,7 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 				      &data, &expunged);
 		if (data != NULL && !expunged) {
 			rec = data;
-			seq_range_array_add(file_ids_r, rec->file_id);
+			mdbox_map_add_zero_ref(files_r, rec);
 		}
 	}
 	return 0;
@@ -547,17 +575,15 @@ void mdbox_map_atomic_unset_fscked(struct mdbox_map_atomic_context *atomic)
 		mail_index_unset_fscked(atomic->sync_trans);
 }
 
-int mdbox_map_atomic_finish(struct mdbox_map_atomic_context **_atomic)
+static int
+mdbox_map_atomic_sync_end(struct mdbox_map_atomic_context *atomic, bool commit)
 {
-	struct mdbox_map_atomic_context *atomic = *_atomic;
 	int ret = 0;
 
-	*_atomic = NULL;
-
 	if (atomic->sync_ctx == NULL) {
 		/* not locked */
 		i_assert(!atomic->locked);
-	} else if (atomic->success) {
+	} else if (commit) {
 		if (mail_index_sync_commit(&atomic->sync_ctx) < 0) {
 			mail_storage_set_index_error(MAP_STORAGE(atomic->map),
 						     atomic->map->index);
@@ -566,6 +592,28 @@ int mdbox_map_atomic_finish(struct mdbox_map_atomic_context **_atomic)
 	} else {
 		mail_index_sync_rollback(&atomic->sync_ctx);
 	}
+	atomic->sync_view = NULL;
+	atomic->sync_trans = NULL;
+	atomic->locked = FALSE;
+	atomic->map_refreshed = FALSE;
+	return ret;
+}
+
+int mdbox_map_atomic_unlock(struct mdbox_map_atomic_context *atomic)
+{
+	i_assert(atomic->locked);
+
+	return mdbox_map_atomic_sync_end(atomic, !atomic->failed);
+}
+
+int mdbox_map_atomic_finish(struct mdbox_map_atomic_context **_atomic)
+{
+	struct mdbox_map_atomic_context *atomic = *_atomic;
+	int ret;
+
+	*_atomic = NULL;
+
+	ret = mdbox_map_atomic_sync_end(atomic, atomic->success);
 	i_free(atomic);
 	return ret;
 }
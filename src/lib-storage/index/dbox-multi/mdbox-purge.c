@@ -6,6 +6,9 @@
 #include "ostream.h"
 #include "str.h"
 #include "hash.h"
+#include "sleep.h"
+#include "time-util.h"
+#include "master-service.h"
 #include "dbox-attachment.h"
 #include "mdbox-storage.h"
 #include "mdbox-storage-rebuild.h"
@@ -25,6 +28,10 @@
       primary storage is done if _ALT flag was removed from any message.
 */
 
+/* Approximate number of I/O operations needed for each purged file in addition
+   to reading and writing the messages: open, stat, fsync and unlink. */
+#define MDBOX_PURGE_FILE_IO_OPS 4
+
 enum mdbox_msg_action {
 	MDBOX_MSG_ACTION_MOVE_TO_ALT = 1,
 	MDBOX_MSG_ACTION_MOVE_FROM_ALT
@@ -33,6 +40,7 @@ enum mdbox_msg_action {
 struct mdbox_purge_context {
 	pool_t pool;
 	struct mdbox_storage *storage;
+	struct event *event;
 
 	uint32_t lowest_primary_file_id;
 	/* list of file_ids that exist in primary storage. this list is looked
@@ -41,6 +49,8 @@ struct mdbox_purge_context {
 	ARRAY_TYPE(seq_range) primary_file_ids;
 	/* list of file_ids that we need to purge */
 	ARRAY_TYPE(seq_range) purge_file_ids;
+	/* files with zero refcount messages, sorted by file_id */
+	ARRAY_TYPE(mdbox_map_zero_ref_file) zero_ref_files;
 
 	/* uint32_t map_uid => enum mdbox_msg_action action */
 	HASH_TABLE(void *, void *) altmoves;
@@ -48,6 +58,15 @@ struct mdbox_purge_context {
 
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_append_context *append_ctx;
+
+	/* I/O done so far, for mdbox_purge_max_bytes_per_sec and
+	   mdbox_purge_max_iops */
+	uint64_t start_usecs, throttle_usecs;
+	uoff_t io_bytes;
+	uint64_t io_ops;
+
+	unsigned int files_purged;
+	uoff_t reclaimed_bytes;
 };
 
 static int mdbox_map_file_msg_offset_cmp(const struct mdbox_map_file_msg *m1,
@@ -300,7 +319,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	ARRAY_TYPE(mail_attachment_extref) ext_refs;
 	pool_t ext_refs_pool;
 	unsigned int i, count;
-	uoff_t offset;
+	uoff_t offset, copied_bytes = 0;
 	int ret;
 
 	i_assert(ctx->atomic == NULL);
@@ -373,9 +392,15 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 			if (ret <= 0)
 				break;
 			array_push_back(&copied_map_uids, &msgs[i].map_uid);
+			copied_bytes += file->input->v_offset - offset;
+			ctx->io_ops++;
 		}
+		ctx->io_ops++;
 		offset = file->input->v_offset;
 	}
+	/* the copied messages were both read and written */
+	ctx->io_bytes += copied_bytes * 2;
+	ctx->io_ops += MDBOX_PURGE_FILE_IO_OPS;
 	if (offset != (uoff_t)st.st_size && ret > 0) {
 		/* file has more messages than what map tells us */
 		dbox_file_set_corrupted(file,
@@ -426,6 +451,16 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		(void)dbox_file_unlink(file);
 		if (mdbox_map_remove_file_id(ctx->storage->map, file_id) < 0)
 			ret = -1;
+		ctx->files_purged++;
+		ctx->reclaimed_bytes += st.st_size - copied_bytes;
+		e_debug(event_create_passthrough(ctx->event)->
+			set_name("mdbox_purge_file_finished")->
+			add_int("file_id", file_id)->
+			add_int("copied_bytes", copied_bytes)->
+			add_int("reclaimed_bytes", st.st_size - copied_bytes)->
+			event(), "Purged file m.%u: Copied %"PRIuUOFF_T
+			" bytes, reclaimed %"PRIuUOFF_T" bytes", file_id,
+			copied_bytes, st.st_size - copied_bytes);
 	} else {
 		dbox_file_unlock(file);
 	}
@@ -473,10 +508,14 @@ mdbox_purge_alloc(struct mdbox_storage *storage)
 	ctx = p_new(pool, struct mdbox_purge_context, 1);
 	ctx->pool = pool;
 	ctx->storage = storage;
+	ctx->event = event_create(storage->storage.storage.event);
+	event_set_append_log_prefix(ctx->event, "purge: ");
 	ctx->lowest_primary_file_id = (uint32_t)-1;
 	i_array_init(&ctx->primary_file_ids, 64);
 	i_array_init(&ctx->purge_file_ids, 64);
+	i_array_init(&ctx->zero_ref_files, 64);
 	hash_table_create_direct(&ctx->altmoves, pool, 0);
+	ctx->start_usecs = i_microseconds();
 	return ctx;
 }
 
@@ -489,6 +528,8 @@ static void mdbox_purge_free(struct mdbox_purge_context **_ctx)
 	hash_table_destroy(&ctx->altmoves);
 	array_free(&ctx->primary_file_ids);
 	array_free(&ctx->purge_file_ids);
+	array_free(&ctx->zero_ref_files);
+	event_unref(&ctx->event);
 	pool_unref(&ctx->pool);
 }
 
@@ -644,19 +685,86 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 	return ret;
 }
 
+static int
+mdbox_purge_file_cmp(const struct mdbox_map_zero_ref_file *f1,
+		     const struct mdbox_map_zero_ref_file *f2)
+{
+	/* most reclaimable bytes first */
+	if (f1->zero_ref_size > f2->zero_ref_size)
+		return -1;
+	if (f1->zero_ref_size < f2->zero_ref_size)
+		return 1;
+	if (f1->file_id < f2->file_id)
+		return -1;
+	if (f1->file_id > f2->file_id)
+		return 1;
+	return 0;
+}
+
+static void
+mdbox_purge_get_files(struct mdbox_purge_context *ctx,
+		      ARRAY_TYPE(mdbox_map_zero_ref_file) *files_r)
+{
+	const struct mdbox_map_zero_ref_file *zero_ref_file;
+	struct mdbox_map_zero_ref_file *file;
+	struct seq_range_iter iter;
+	unsigned int i = 0;
+	uint32_t file_id;
+
+	seq_range_array_iter_init(&iter, &ctx->purge_file_ids);
+	while (seq_range_array_iter_nth(&iter, i++, &file_id)) {
+		file = array_append_space(files_r);
+		file->file_id = file_id;
+		zero_ref_file = array_bsearch(&ctx->zero_ref_files, &file_id,
+					      mdbox_map_zero_ref_file_cmp);
+		if (zero_ref_file != NULL)
+			file->zero_ref_size = zero_ref_file->zero_ref_size;
+	}
+	array_sort(files_r, mdbox_purge_file_cmp);
+}
+
+static bool mdbox_purge_throttle(struct mdbox_purge_context *ctx)
+{
+	const struct mdbox_settings *set = ctx->storage->set;
+	uint64_t wanted_usecs = 0, elapsed_usecs, sleep_usecs;
+
+	/* sleep until the I/O done so far fits within the budget */
+	if (set->mdbox_purge_max_bytes_per_sec > 0) {
+		wanted_usecs = ctx->io_bytes * 1000000 /
+			set->mdbox_purge_max_bytes_per_sec;
+	}
+	if (set->mdbox_purge_max_iops > 0) {
+		wanted_usecs = I_MAX(wanted_usecs, ctx->io_ops * 1000000 /
+				     set->mdbox_purge_max_iops);
+	}
+	elapsed_usecs = i_microseconds() - ctx->start_usecs;
+	if (wanted_usecs <= elapsed_usecs)
+		return TRUE;
+
+	sleep_usecs = wanted_usecs - elapsed_usecs;
+	ctx->throttle_usecs += sleep_usecs;
+	return i_sleep_intr_usecs(sleep_usecs);
+}
+
 int mdbox_purge(struct mail_storage *_storage)
 {
 	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
+	const struct mdbox_settings *set = storage->set;
 	struct mdbox_purge_context *ctx;
+	ARRAY_TYPE(mdbox_map_zero_ref_file) files;
+	const struct mdbox_map_zero_ref_file *zero_ref_file, *files_arr;
 	struct dbox_file *file;
-	struct seq_range_iter iter;
-	unsigned int i = 0;
+	unsigned int i, count, files_done = 0;
 	uint32_t file_id;
-	bool deleted;
+	bool deleted, interrupted = FALSE;
 	int ret;
 
 	ctx = mdbox_purge_alloc(storage);
-	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
+	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->zero_ref_files);
+	array_foreach(&ctx->zero_ref_files, zero_ref_file) {
+		seq_range_array_add(&ctx->purge_file_ids,
+				    zero_ref_file->file_id);
+	}
 	if (storage->alt_storage_dir != NULL) {
 		if (mdbox_purge_get_primary_files(ctx) < 0)
 			ret = -1;
@@ -667,19 +775,48 @@ int mdbox_purge(struct mail_storage *_storage)
 		}
 	}
 
-	seq_range_array_iter_init(&iter, &ctx->purge_file_ids); i = 0;
-	while (ret == 0 &&
-	       seq_range_array_iter_nth(&iter, i++, &file_id)) T_BEGIN {
-		file = mdbox_file_init(storage, file_id);
-		if (dbox_file_open(file, &deleted) > 0 && !deleted) {
-			if (mdbox_file_purge(ctx, file, file_id) < 0)
-				ret = -1;
-		} else {
-			if (mdbox_map_remove_file_id(storage->map, file_id) < 0)
-				ret = -1;
+	/* Purge the files with the most reclaimable space first. If the
+	   purging is limited or interrupted, the rest of the files are
+	   purged by the next run. */
+	t_array_init(&files, I_MAX(array_count(&ctx->purge_file_ids), 1));
+	mdbox_purge_get_files(ctx, &files);
+	files_arr = array_get(&files, &count);
+	for (i = 0; i < count && ret == 0 && !interrupted; i++) T_BEGIN {
+		file_id = files_arr[i].file_id;
+		if (set->mdbox_purge_max_files > 0 &&
+		    i >= set->mdbox_purge_max_files)
+			interrupted = TRUE;
+		else if (master_service_is_killed(master_service))
+			interrupted = TRUE;
+		else {
+			file = mdbox_file_init(storage, file_id);
+			if (dbox_file_open(file, &deleted) > 0 && !deleted) {
+				if (mdbox_file_purge(ctx, file, file_id) < 0)
+					ret = -1;
+			} else {
+				if (mdbox_map_remove_file_id(storage->map,
+							     file_id) < 0)
+					ret = -1;
+			}
+			dbox_file_unref(&file);
+			files_done++;
+			if (ret == 0 && i + 1 < count &&
+			    !mdbox_purge_throttle(ctx))
+				interrupted = TRUE;
 		}
-		dbox_file_unref(&file);
 	} T_END;
+
+	e_debug(event_create_passthrough(ctx->event)->
+		set_name("mdbox_purge_finished")->
+		add_int("files_purged", ctx->files_purged)->
+		add_int("files_left", count - files_done)->
+		add_int("reclaimed_bytes", ctx->reclaimed_bytes)->
+		add_int("io_bytes", ctx->io_bytes)->
+		add_int("io_ops", ctx->io_ops)->
+		add_int("throttle_usecs", ctx->throttle_usecs)->
+		event(), "Purged %u files, reclaimed %"PRIuUOFF_T" bytes%s",
+		ctx->files_purged, ctx->reclaimed_bytes,
+		interrupted ? " (stopped early)" : "");
 	mdbox_purge_free(&ctx);
 
 	if (storage->corrupted_reason != NULL) {
@@ -41,6 +41,9 @@ struct mdbox_save_context {
 	ARRAY_TYPE(uint32_t) copy_map_uids;
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_transaction_context *map_trans;
+	/* map UIDs that were committed to the map before the mailbox was
+	   locked. Their refcounts are dropped if the save fails. */
+	uint32_t first_map_uid, last_map_uid;
 
 	ARRAY(struct dbox_save_mail) mails;
 };
@@ -280,13 +283,96 @@ mdbox_save_set_map_uids(struct mdbox_save_context *ctx,
 	i_assert(next_map_uid == last_map_uid + 1);
 }
 
+static int
+mdbox_save_assign_map_uids_unlocked(struct mdbox_save_context *ctx,
+				    uint32_t *rebuild_count_r)
+{
+	struct mdbox_map *map = ctx->mbox->storage->map;
+
+	/* Only new mails are being saved, so the map doesn't need to stay
+	   locked while the mailbox index is being updated. Commit the map
+	   records now and unlock the map before locking the mailbox. This
+	   keeps the map locked only for a short time, so concurrent saves to
+	   the same storage mostly wait only for each others' mailbox locks.
+	   The new records have refcount=1, so purging won't touch them even
+	   though nothing references them yet. */
+	*rebuild_count_r = mdbox_map_get_rebuild_count(map);
+	if (mdbox_map_append_assign_map_uids(ctx->append_ctx,
+					     &ctx->first_map_uid,
+					     &ctx->last_map_uid) < 0)
+		return -1;
+	if (mdbox_map_atomic_is_locked(ctx->atomic) &&
+	    mdbox_map_atomic_unlock(ctx->atomic) < 0)
+		return -1;
+	return 0;
+}
+
+static int
+mdbox_save_check_rebuild_count(struct mdbox_save_context *ctx,
+			       uint32_t rebuild_count)
+{
+	struct mdbox_map *map = ctx->mbox->storage->map;
+
+	/* Storage rebuilding recalculates the refcounts from mailbox indexes.
+	   If it happened after the map records were committed, it didn't see
+	   the new mails in this mailbox and their refcounts were reset. */
+	if (mdbox_map_refresh(map) < 0)
+		return -1;
+	if (mdbox_map_get_rebuild_count(map) != rebuild_count) {
+		/* the map records may not exist anymore, don't touch them */
+		ctx->first_map_uid = ctx->last_map_uid = 0;
+		mail_storage_set_error(&ctx->mbox->storage->storage.storage,
+			MAIL_ERROR_TEMP,
+			"Storage was rebuilt while saving, try again");
+		return -1;
+	}
+	return 0;
+}
+
+static void mdbox_save_drop_map_uids(struct mdbox_save_context *ctx)
+{
+	struct mail_storage *storage = &ctx->mbox->storage->storage.storage;
+	struct mdbox_map_transaction_context *map_trans;
+	ARRAY_TYPE(uint32_t) map_uids;
+	uint32_t map_uid;
+	int ret;
+
+	/* The map records were already committed. Keep the mails in the m.*
+	   files and drop their refcounts to 0, so the next purge removes
+	   them. The mailbox must be unlocked before the map is locked. */
+	if (ctx->sync_ctx != NULL)
+		(void)mdbox_sync_finish(&ctx->sync_ctx, FALSE);
+	mail_storage_last_error_push(storage);
+	ret = mdbox_map_append_commit(ctx->append_ctx);
+
+	t_array_init(&map_uids, ctx->last_map_uid - ctx->first_map_uid + 1);
+	for (map_uid = ctx->first_map_uid; map_uid <= ctx->last_map_uid;
+	     map_uid++)
+		array_push_back(&map_uids, &map_uid);
+	map_trans = mdbox_map_transaction_begin(ctx->atomic, FALSE);
+	if (ret == 0 &&
+	    mdbox_map_update_refcounts(map_trans, &map_uids, -1) == 0)
+		ret = mdbox_map_transaction_commit(map_trans, "saving - rollback");
+	else
+		ret = -1;
+	mdbox_map_transaction_free(&map_trans);
+	if (ret < 0) {
+		e_error(ctx->mbox->box.event,
+			"mdbox: Failed to drop refcounts of map UIDs %u..%u: %s",
+			ctx->first_map_uid, ctx->last_map_uid,
+			mail_storage_get_last_internal_error(storage, NULL));
+	}
+	mail_storage_last_error_pop(storage);
+	ctx->first_map_uid = ctx->last_map_uid = 0;
+}
+
 int mdbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 {
 	struct mdbox_save_context *ctx = MDBOX_SAVECTX(_ctx);
 	struct mailbox_transaction_context *_t = _ctx->transaction;
 	const struct mail_index_header *hdr;
-	uint32_t first_map_uid, last_map_uid;
-	bool corrupted;
+	uint32_t first_map_uid, last_map_uid, rebuild_count = 0;
+	bool corrupted, map_unlocked = FALSE;
 
 	i_assert(ctx->ctx.finished);
 
@@ -296,14 +382,23 @@ int mdbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 		return -1;
 	}
 
-	/* make sure the map gets locked */
-	if (mdbox_map_atomic_lock(ctx->atomic, "saving") < 0) {
+	if (!array_is_created(&ctx->copy_map_uids)) {
+		if (mdbox_save_assign_map_uids_unlocked(ctx, &rebuild_count) < 0) {
+			mdbox_transaction_save_rollback(_ctx);
+			return -1;
+		}
+		map_unlocked = TRUE;
+	} else if (mdbox_map_atomic_lock(ctx->atomic, "saving") < 0) {
+		/* copying needs the map to stay locked for the refcount
+		   updates */
 		mdbox_transaction_save_rollback(_ctx);
 		return -1;
 	}
 	/* lock the mailbox after map to avoid deadlocks. if we've noticed
 	   any corruption, deal with it later, otherwise we won't have
-	   up-to-date atomic->sync_view */
+	   up-to-date atomic->sync_view. if the map was already unlocked,
+	   syncing locks it again before the mailbox if there are
+	   expunges. */
 	if (mdbox_sync_begin(ctx->mbox,
 			     MDBOX_SYNC_FLAG_FORCE |
 			     MDBOX_SYNC_FLAG_FSYNC, ctx->atomic,
@@ -317,14 +412,25 @@ int mdbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 	}
 	i_assert(ctx->sync_ctx != NULL);
 
-	/* assign map UIDs for newly saved messages after we've successfully
-	   acquired all the locks. the transaction is now very unlikely to
-	   fail. the UIDs are written to the transaction log immediately within
-	   this function, but the map is left locked. */
-	if (mdbox_map_append_assign_map_uids(ctx->append_ctx, &first_map_uid,
-					     &last_map_uid) < 0) {
-		mdbox_transaction_save_rollback(_ctx);
-		return -1;
+	if (map_unlocked) {
+		if (mdbox_save_check_rebuild_count(ctx, rebuild_count) < 0) {
+			mdbox_transaction_save_rollback(_ctx);
+			return -1;
+		}
+		first_map_uid = ctx->first_map_uid;
+		last_map_uid = ctx->last_map_uid;
+	} else {
+		/* assign map UIDs for newly saved messages after we've
+		   successfully acquired all the locks. the transaction is now
+		   very unlikely to fail. the UIDs are written to the
+		   transaction log immediately within this function, but the
+		   map is left locked. */
+		if (mdbox_map_append_assign_map_uids(ctx->append_ctx,
+						     &first_map_uid,
+						     &last_map_uid) < 0) {
+			mdbox_transaction_save_rollback(_ctx);
+			return -1;
+		}
 	}
 
 	/* update dbox header flags */
@@ -384,6 +490,8 @@ void mdbox_transaction_save_commit_post(struct mail_save_context *_ctx,
 		container_of(_storage, struct mdbox_storage, storage.storage);
 
 	_ctx->transaction = NULL; /* transaction is already freed */
+	/* the mailbox now references the map records */
+	ctx->first_map_uid = ctx->last_map_uid = 0;
 
 	mail_index_sync_set_commit_result(ctx->sync_ctx->index_sync_ctx,
 					  result);
@@ -420,6 +528,8 @@ void mdbox_transaction_save_rollback(struct mail_save_context *_ctx)
 
 	if (!ctx->ctx.finished)
 		mdbox_save_cancel(&ctx->ctx.ctx);
+	if (ctx->first_map_uid != 0)
+		mdbox_save_drop_map_uids(ctx);
 	if (ctx->append_ctx != NULL)
 		mdbox_map_append_free(&ctx->append_ctx);
 	if (ctx->map_trans != NULL)
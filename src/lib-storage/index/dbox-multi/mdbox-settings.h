@@ -6,6 +6,9 @@ struct mdbox_settings {
 	bool mdbox_preallocate_space;
 	uoff_t mdbox_rotate_size;
 	unsigned int mdbox_rotate_interval;
+	unsigned int mdbox_purge_max_files;
+	uoff_t mdbox_purge_max_bytes_per_sec;
+	unsigned int mdbox_purge_max_iops;
 };
 
 extern const struct setting_parser_info mdbox_setting_parser_info;
@@ -26,13 +26,7 @@ sdbox_file_copy_attachments(struct sdbox_file *src_file,
 		/* no attachments in source storage */
 		return 1;
 	}
-	if (dest_storage->attachment_dir == NULL ||
-	    strcmp(src_storage->attachment_dir,
-		   dest_storage->attachment_dir) != 0 ||
-	    strcmp(src_storage->storage.set->mail_attachment_fs,
-		   dest_storage->storage.set->mail_attachment_fs) != 0 ||
-	    strcmp(src_storage->storage.set->mail_attachment_hash,
-		   dest_storage->storage.set->mail_attachment_hash) != 0) {
+	if (!dbox_attachment_storage_is_compatible(src_storage, dest_storage)) {
 		/* different attachment dirs/settings between storages.
 		   have to copy the slow way. */
 		return 0;
@@ -57,13 +51,20 @@ sdbox_file_copy_attachments(struct sdbox_file *src_file,
 	p_array_init(&dest_file->attachment_paths, dest_file->attachment_pool,
 		     array_count(&extrefs));
 
+	/* the same suffix is used for all the links, so the mail can be read
+	   before its UID is assigned */
+	dest_file->attachment_tmp_suffix =
+		p_strconcat(dest_file->attachment_pool, "-",
+			    guid_generate(), NULL);
+
 	ret = 1;
 	array_foreach(&extrefs, extref) T_BEGIN {
 		src = t_strdup_printf("%s/%s", dest_storage->attachment_dir,
 			sdbox_file_attachment_relpath(src_file, extref->path));
 		dest_relpath = p_strconcat(dest_file->attachment_pool,
-					   extref->path, "-",
-					   guid_generate(), NULL);
+					   extref->path,
+					   dest_file->attachment_tmp_suffix,
+					   NULL);
 		dest = t_strdup_printf("%s/%s", dest_storage->attachment_dir,
 				       dest_relpath);
 		/* we verified above that attachment_fs is compatible for
@@ -13,6 +13,9 @@ struct sdbox_file {
 	/* list of attachment paths while saving/copying message */
 	pool_t attachment_pool;
 	ARRAY_TYPE(const_string) attachment_paths;
+	/* Suffix of the temporary attachment links created by copying, or NULL.
+	   The links are renamed when the UID is assigned. */
+	const char *attachment_tmp_suffix;
 	bool written_to_disk;
 };
 
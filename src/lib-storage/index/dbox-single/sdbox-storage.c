@@ -286,6 +286,14 @@ sdbox_get_attachment_path_suffix(struct dbox_file *_file)
 {
 	struct sdbox_file *file = (struct sdbox_file *)_file;
 
+	if (file->uid == 0) {
+		/* the mail is still being saved. the attachments get renamed
+		   only when the UID is assigned. until then newly saved
+		   attachments have no suffix and copied ones have a unique
+		   temporary suffix. */
+		return file->attachment_tmp_suffix == NULL ? "" :
+			file->attachment_tmp_suffix;
+	}
 	return t_strdup_printf("-%s-%u",
 			guid_128_to_string(file->mbox->mailbox_guid),
 			file->uid);
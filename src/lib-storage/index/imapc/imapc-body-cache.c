@@ -0,0 +1,468 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "llist.h"
+#include "ioloop.h"
+#include "str.h"
+#include "hex-binary.h"
+#include "sha1.h"
+#include "istream.h"
+#include "ostream.h"
+#include "fs-api.h"
+#include "istream-fs-file.h"
+#include "mailbox-list.h"
+#include "imapc-body-cache.h"
+
+/* Number of files to stat() per store while scanning the directory */
+#define IMAPC_BODY_CACHE_SCAN_BATCH 256
+/* Rescan the directory after this many seconds */
+#define IMAPC_BODY_CACHE_RESCAN_SECS 60
+/* Rescan the directory after this process has stored max_size divided by
+   this many bytes */
+#define IMAPC_BODY_CACHE_RESCAN_DIVISOR 8
+
+struct imapc_body_cache_file {
+	struct imapc_body_cache_file *prev, *next;
+
+	char *name;
+	uoff_t size;
+	time_t mtime;
+	/* Seen by the currently running directory scan */
+	bool scan_seen:1;
+};
+
+struct imapc_body_cache {
+	struct event *event;
+	struct fs *fs;
+	char *dir;
+	uoff_t max_size;
+
+	/* Known cache files. Only filled when max_size is set and something
+	   has been stored to the cache. Other processes may add and delete
+	   files meanwhile, so this is only an estimate of what exists. It's
+	   kept up to date by rescanning the directory. */
+	HASH_TABLE(char *, struct imapc_body_cache_file *) files;
+	/* least recently used first */
+	struct imapc_body_cache_file *lru_head, *lru_tail;
+	uoff_t used_size;
+
+	/* Directory scan in progress. It's continued a batch at a time by
+	   each store. */
+	struct fs_iter *scan_iter;
+	ARRAY(struct imapc_body_cache_file *) scan_new_files;
+	time_t last_scan_time;
+	/* Bytes stored since the last scan was started */
+	uoff_t stored_since_scan;
+
+	struct imapc_body_cache_stats stats;
+};
+
+int imapc_body_cache_init(struct mailbox_list *list, struct event *event_parent,
+			  const char *fs_driver, const char *dir,
+			  uoff_t max_size, struct imapc_body_cache **cache_r,
+			  const char **error_r)
+{
+	struct imapc_body_cache *cache;
+	const char *name, *args, *error;
+	struct fs *fs;
+
+	args = strpbrk(fs_driver, ": ");
+	if (args == NULL) {
+		name = fs_driver;
+		args = "";
+	} else {
+		name = t_strdup_until(fs_driver, args++);
+	}
+	if (mailbox_list_init_fs(list, event_parent, name, args, dir,
+				 &fs, &error) < 0) {
+		*error_r = t_strdup_printf("imapc_body_cache_fs: %s", error);
+		return -1;
+	}
+
+	cache = i_new(struct imapc_body_cache, 1);
+	cache->event = event_create(event_parent);
+	event_set_append_log_prefix(cache->event, "imapc-body-cache: ");
+	cache->fs = fs;
+	cache->dir = i_strdup(dir);
+	cache->max_size = max_size;
+	hash_table_create(&cache->files, default_pool, 0, str_hash, strcmp);
+	i_array_init(&cache->scan_new_files, 128);
+	*cache_r = cache;
+	return 0;
+}
+
+const char *
+imapc_body_cache_get_key(const char *remote_mailbox, uint32_t uid_validity,
+			 uint32_t uid)
+{
+	unsigned char mailbox_sha1[SHA1_RESULTLEN];
+	string_t *str;
+
+	if (uid_validity == 0)
+		return NULL;
+	sha1_get_digest(remote_mailbox, strlen(remote_mailbox), mailbox_sha1);
+
+	str = t_str_new(64);
+	binary_to_hex_append(str, mailbox_sha1, sizeof(mailbox_sha1));
+	str_printfa(str, ".%u.%u", uid_validity, uid);
+	return str_c(str);
+}
+
+static void imapc_body_cache_file_free(struct imapc_body_cache_file *file)
+{
+	i_free(file->name);
+	i_free(file);
+}
+
+static void imapc_body_cache_forget_all(struct imapc_body_cache *cache)
+{
+	struct imapc_body_cache_file *file;
+
+	while (cache->lru_head != NULL) {
+		file = cache->lru_head;
+		DLLIST2_REMOVE(&cache->lru_head, &cache->lru_tail, file);
+		imapc_body_cache_file_free(file);
+	}
+	hash_table_clear(cache->files, FALSE);
+	cache->used_size = 0;
+}
+
+static void imapc_body_cache_scan_abort(struct imapc_body_cache *cache)
+{
+	struct imapc_body_cache_file *file;
+	const char *error;
+
+	if (cache->scan_iter == NULL)
+		return;
+	if (fs_iter_deinit(&cache->scan_iter, &error) < 0)
+		e_error(cache->event, "%s", error);
+	array_foreach_elem(&cache->scan_new_files, file)
+		imapc_body_cache_file_free(file);
+	array_clear(&cache->scan_new_files);
+}
+
+static void imapc_body_cache_send_finished_event(struct imapc_body_cache *cache)
+{
+	const struct imapc_body_cache_stats *stats = &cache->stats;
+
+	if (stats->lookups == 0 && stats->stores == 0)
+		return;
+
+	struct event_passthrough *e = event_create_passthrough(cache->event)->
+		set_name("imapc_body_cache_finished")->
+		add_int("lookups", stats->lookups)->
+		add_int("hits", stats->hits)->
+		add_int("hit_bytes", stats->hit_bytes)->
+		add_int("stores", stats->stores)->
+		add_int("stored_bytes", stats->stored_bytes)->
+		add_int("evictions", stats->evictions)->
+		add_int("evicted_bytes", stats->evicted_bytes);
+	e_debug(e->event(), "%u/%u lookups found (%"PRIuUOFF_T" bytes), "
+		"%u stored (%"PRIuUOFF_T" bytes), "
+		"%u evicted (%"PRIuUOFF_T" bytes)",
+		stats->hits, stats->lookups, stats->hit_bytes,
+		stats->stores, stats->stored_bytes,
+		stats->evictions, stats->evicted_bytes);
+}
+
+void imapc_body_cache_deinit(struct imapc_body_cache **_cache)
+{
+	struct imapc_body_cache *cache = *_cache;
+
+	if (cache == NULL)
+		return;
+	*_cache = NULL;
+
+	imapc_body_cache_send_finished_event(cache);
+	imapc_body_cache_scan_abort(cache);
+	array_free(&cache->scan_new_files);
+	imapc_body_cache_forget_all(cache);
+	hash_table_destroy(&cache->files);
+	fs_deinit(&cache->fs);
+	event_unref(&cache->event);
+	i_free(cache->dir);
+	i_free(cache);
+}
+
+static const char *
+imapc_body_cache_get_path(struct imapc_body_cache *cache, const char *name)
+{
+	return t_strdup_printf("%s/%s", cache->dir, name);
+}
+
+static void
+imapc_body_cache_forget(struct imapc_body_cache *cache,
+			struct imapc_body_cache_file *file)
+{
+	hash_table_remove(cache->files, file->name);
+	DLLIST2_REMOVE(&cache->lru_head, &cache->lru_tail, file);
+	i_assert(cache->used_size >= file->size);
+	cache->used_size -= file->size;
+	imapc_body_cache_file_free(file);
+}
+
+static void
+imapc_body_cache_add(struct imapc_body_cache *cache, const char *name,
+		     uoff_t size, time_t mtime)
+{
+	struct imapc_body_cache_file *file;
+
+	file = hash_table_lookup(cache->files, name);
+	if (file != NULL)
+		imapc_body_cache_forget(cache, file);
+
+	file = i_new(struct imapc_body_cache_file, 1);
+	file->name = i_strdup(name);
+	file->size = size;
+	file->mtime = mtime;
+	/* the running scan may have already passed the file */
+	file->scan_seen = cache->scan_iter != NULL;
+	hash_table_insert(cache->files, file->name, file);
+	DLLIST2_APPEND(&cache->lru_head, &cache->lru_tail, file);
+	cache->used_size += size;
+}
+
+static int
+imapc_body_cache_file_mtime_cmp(struct imapc_body_cache_file *const *f1,
+				struct imapc_body_cache_file *const *f2)
+{
+	if ((*f1)->mtime < (*f2)->mtime)
+		return -1;
+	if ((*f1)->mtime > (*f2)->mtime)
+		return 1;
+	return 0;
+}
+
+static void imapc_body_cache_scan_finish(struct imapc_body_cache *cache)
+{
+	struct imapc_body_cache_file *const *filep, *file, *next;
+	const char *error;
+
+	if (fs_iter_deinit(&cache->scan_iter, &error) < 0) {
+		/* keep what we know */
+		e_error(cache->event, "%s", error);
+		for (file = cache->lru_head; file != NULL; file = file->next)
+			file->scan_seen = FALSE;
+	} else {
+		/* forget the files that weren't found anymore. another
+		   process deleted them. */
+		for (file = cache->lru_head; file != NULL; file = next) {
+			next = file->next;
+			if (!file->scan_seen)
+				imapc_body_cache_forget(cache, file);
+			else
+				file->scan_seen = FALSE;
+		}
+	}
+
+	/* The file's mtime is when it was added to the cache. That's the
+	   best guess of the LRU order there is for files stored by other
+	   processes. They're older than anything this process has used,
+	   so they're added to the beginning of the LRU list. */
+	array_sort(&cache->scan_new_files, imapc_body_cache_file_mtime_cmp);
+	array_foreach_reverse(&cache->scan_new_files, filep) {
+		file = *filep;
+		if (hash_table_lookup(cache->files, file->name) == NULL) {
+			hash_table_insert(cache->files, file->name, file);
+			DLLIST2_PREPEND(&cache->lru_head, &cache->lru_tail,
+					file);
+			cache->used_size += file->size;
+		} else {
+			imapc_body_cache_file_free(file);
+		}
+	}
+	array_clear(&cache->scan_new_files);
+}
+
+static void
+imapc_body_cache_scan_file(struct imapc_body_cache *cache, const char *name)
+{
+	struct imapc_body_cache_file *file;
+	struct fs_file *fs_file;
+	struct stat st;
+
+	fs_file = fs_file_init_with_event(cache->fs, cache->event,
+		imapc_body_cache_get_path(cache, name), FS_OPEN_MODE_READONLY);
+	if (fs_stat(fs_file, &st) < 0) {
+		if (errno != ENOENT)
+			e_error(cache->event, "%s", fs_file_last_error(fs_file));
+		fs_file_deinit(&fs_file);
+		return;
+	}
+	fs_file_deinit(&fs_file);
+
+	file = hash_table_lookup(cache->files, name);
+	if (file != NULL) {
+		/* the file may have been replaced by another process */
+		i_assert(cache->used_size >= file->size);
+		cache->used_size -= file->size;
+		file->size = st.st_size;
+		cache->used_size += file->size;
+		file->scan_seen = TRUE;
+		return;
+	}
+	file = i_new(struct imapc_body_cache_file, 1);
+	file->name = i_strdup(name);
+	file->size = st.st_size;
+	file->mtime = st.st_mtime;
+	array_push_back(&cache->scan_new_files, &file);
+}
+
+static void imapc_body_cache_scan(struct imapc_body_cache *cache)
+{
+	const char *name;
+	unsigned int count = 0;
+
+	if (cache->scan_iter == NULL) {
+		if (cache->last_scan_time != 0 &&
+		    ioloop_time - cache->last_scan_time <
+		    IMAPC_BODY_CACHE_RESCAN_SECS &&
+		    cache->stored_since_scan <
+		    cache->max_size / IMAPC_BODY_CACHE_RESCAN_DIVISOR)
+			return;
+		cache->scan_iter = fs_iter_init_with_event(cache->fs,
+			cache->event, cache->dir, 0);
+		cache->last_scan_time = ioloop_time;
+		cache->stored_since_scan = 0;
+	}
+
+	/* Don't stat() the whole directory at once. The files not scanned
+	   yet are accounted for by the following stores. */
+	while (count < IMAPC_BODY_CACHE_SCAN_BATCH) {
+		if ((name = fs_iter_next(cache->scan_iter)) == NULL) {
+			imapc_body_cache_scan_finish(cache);
+			return;
+		}
+		if (name[0] == '.') {
+			/* temporary file */
+			continue;
+		}
+		imapc_body_cache_scan_file(cache, name);
+		count++;
+	}
+}
+
+static void
+imapc_body_cache_evict(struct imapc_body_cache *cache, uoff_t new_size)
+{
+	struct imapc_body_cache_file *file;
+	struct fs_file *fs_file;
+	uoff_t size;
+
+	while (cache->lru_head != NULL &&
+	       cache->used_size + new_size > cache->max_size) {
+		file = cache->lru_head;
+		size = file->size;
+		fs_file = fs_file_init_with_event(cache->fs, cache->event,
+			imapc_body_cache_get_path(cache, file->name),
+			FS_OPEN_MODE_READONLY);
+		if (fs_delete(fs_file) < 0 && errno != ENOENT)
+			e_error(cache->event, "%s", fs_file_last_error(fs_file));
+		else {
+			cache->stats.evictions++;
+			cache->stats.evicted_bytes += size;
+		}
+		fs_file_deinit(&fs_file);
+		imapc_body_cache_forget(cache, file);
+	}
+}
+
+struct istream *
+imapc_body_cache_lookup(struct imapc_body_cache *cache, const char *key)
+{
+	struct imapc_body_cache_file *file;
+	struct fs_file *fs_file;
+	struct istream *input;
+	uoff_t size;
+
+	cache->stats.lookups++;
+	fs_file = fs_file_init_with_event(cache->fs, cache->event,
+		imapc_body_cache_get_path(cache, key),
+		FS_OPEN_MODE_READONLY | FS_OPEN_FLAG_SEEKABLE);
+	input = i_stream_create_fs_file(&fs_file, IO_BLOCK_SIZE);
+	/* open the file now, so it can't get evicted anymore while it's
+	   being read */
+	if (i_stream_read(input) < 0 && input->stream_errno != 0) {
+		if (input->stream_errno != ENOENT) {
+			e_error(cache->event, "read(%s) failed: %s",
+				i_stream_get_name(input),
+				i_stream_get_error(input));
+		}
+		i_stream_unref(&input);
+		return NULL;
+	}
+	if (i_stream_get_size(input, TRUE, &size) <= 0) {
+		e_error(cache->event, "Failed to get size of %s: %s",
+			i_stream_get_name(input), i_stream_get_error(input));
+		i_stream_unref(&input);
+		return NULL;
+	}
+	i_stream_seek(input, 0);
+
+	cache->stats.hits++;
+	cache->stats.hit_bytes += size;
+	file = cache->max_size == 0 ? NULL :
+		hash_table_lookup(cache->files, key);
+	if (file != NULL) {
+		/* mark as the most recently used */
+		DLLIST2_REMOVE(&cache->lru_head, &cache->lru_tail, file);
+		DLLIST2_APPEND(&cache->lru_head, &cache->lru_tail, file);
+	}
+	return input;
+}
+
+void imapc_body_cache_store(struct imapc_body_cache *cache, const char *key,
+			    struct istream *input)
+{
+	struct fs_file *fs_file;
+	struct ostream *output;
+	uoff_t old_offset = input->v_offset, size;
+	int ret;
+
+	if (i_stream_get_size(input, TRUE, &size) <= 0 || size == 0)
+		return;
+	if (cache->max_size > 0) {
+		if (size > cache->max_size) {
+			/* would evict everything else */
+			return;
+		}
+		imapc_body_cache_scan(cache);
+		imapc_body_cache_evict(cache, size);
+	}
+
+	fs_file = fs_file_init_with_event(cache->fs, cache->event,
+		imapc_body_cache_get_path(cache, key), FS_OPEN_MODE_REPLACE);
+	output = fs_write_stream(fs_file);
+	i_stream_seek(input, 0);
+	o_stream_nsend_istream(output, input);
+	if (input->stream_errno != 0) {
+		fs_write_stream_abort_error(fs_file, &output,
+			"read(%s) failed: %s", i_stream_get_name(input),
+			i_stream_get_error(input));
+		ret = -1;
+	} else if (fs_write_stream_finish(fs_file, &output) < 0) {
+		e_error(cache->event, "%s", fs_file_last_error(fs_file));
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+	fs_file_deinit(&fs_file);
+	i_stream_seek(input, old_offset);
+	if (ret < 0)
+		return;
+
+	cache->stats.stores++;
+	cache->stats.stored_bytes += size;
+	if (cache->max_size > 0) {
+		imapc_body_cache_add(cache, key, size, ioloop_time);
+		cache->stored_since_scan += size;
+	}
+}
+
+void imapc_body_cache_get_stats(struct imapc_body_cache *cache,
+				struct imapc_body_cache_stats *stats_r)
+{
+	*stats_r = cache->stats;
+}
@@ -0,0 +1,57 @@
+#ifndef IMAPC_BODY_CACHE_H
+#define IMAPC_BODY_CACHE_H
+
+struct mailbox_list;
+struct imapc_body_cache;
+
+struct imapc_body_cache_stats {
+	/* Number of lookups and how many of them were found */
+	unsigned int lookups, hits;
+	/* Bytes read from the cache instead of downloading them */
+	uoff_t hit_bytes;
+	/* Number of bodies added to the cache and their size */
+	unsigned int stores;
+	uoff_t stored_bytes;
+	/* Number of bodies evicted to stay under the size limit */
+	unsigned int evictions;
+	uoff_t evicted_bytes;
+};
+
+/* Initialize a cache of message bodies in dir using the given lib-fs
+   "driver[:args]". If max_size is non-zero, the least recently used bodies
+   are deleted when the cache would grow larger.
+
+   The size limit is approximate when multiple processes share the
+   directory. Each process knows the files it found in its latest directory
+   scan and the files it stored itself. The directory is rescanned every
+   60 seconds and whenever the process has stored max_size/8 bytes since
+   its last scan, so with N processes storing concurrently the directory can
+   grow up to about max_size + N*max_size/8. The scan stat()s only 256 files
+   per store, so a large directory is fully accounted for only after a few
+   stores. */
+int imapc_body_cache_init(struct mailbox_list *list, struct event *event_parent,
+			  const char *fs_driver, const char *dir,
+			  uoff_t max_size, struct imapc_body_cache **cache_r,
+			  const char **error_r);
+void imapc_body_cache_deinit(struct imapc_body_cache **cache);
+
+/* Returns the cache key for the message, or NULL if uid_validity is 0.
+   IMAP has no mailbox GUIDs, so the remote mailbox must be identified by
+   e.g. the server, user and its name. */
+const char *
+imapc_body_cache_get_key(const char *remote_mailbox, uint32_t uid_validity,
+			 uint32_t uid);
+
+/* Returns a seekable stream to the cached body, or NULL if it's not
+   in the cache. */
+struct istream *
+imapc_body_cache_lookup(struct imapc_body_cache *cache, const char *key);
+/* Add the full message in input to the cache. Errors are only logged.
+   The input stream's offset is preserved. */
+void imapc_body_cache_store(struct imapc_body_cache *cache, const char *key,
+			    struct istream *input);
+
+void imapc_body_cache_get_stats(struct imapc_body_cache *cache,
+				struct imapc_body_cache_stats *stats_r);
+
+#endif
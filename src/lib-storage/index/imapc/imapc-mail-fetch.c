@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "str.h"
 #include "ioloop.h"
+#include "seq-range-array.h"
 #include "istream.h"
 #include "istream-concat.h"
 #include "istream-header-filter.h"
@@ -13,9 +14,13 @@
 #include "imap-quote.h"
 #include "imap-bodystructure.h"
 #include "imap-resp-code.h"
+#include "imapc-body-cache.h"
 #include "imapc-mail.h"
 #include "imapc-storage.h"
 
+#define IMAPC_FETCH_STREAM_FIELDS \
+	(MAIL_FETCH_STREAM_HEADER | MAIL_FETCH_STREAM_BODY)
+
 static void imapc_mail_set_failure(struct imapc_mail *mail,
 				   const struct imapc_command_reply *reply)
 {
@@ -139,38 +144,124 @@ headers_merge(pool_t pool, const char *const *h1, const char *const *h2)
 	return array_front(&headers);
 }
 
-static bool
-imapc_mail_try_merge_fetch(struct imapc_mailbox *mbox, string_t *str)
+static void
+imapc_mail_fetch_append_items(struct imapc_mailbox *mbox, string_t *str,
+			      enum mail_fetch_field fields,
+			      char *const *headers, unsigned int headers_count)
+{
+	unsigned int i;
+
+	str_append_c(str, '(');
+	if ((fields & MAIL_FETCH_RECEIVED_DATE) != 0)
+		str_append(str, "INTERNALDATE ");
+	if ((fields & MAIL_FETCH_SAVE_DATE) != 0) {
+		i_assert(HAS_ALL_BITS(mbox->capabilities,
+				      IMAPC_CAPABILITY_SAVEDATE));
+		str_append(str, "SAVEDATE ");
+	}
+	if ((fields & (MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE)) != 0)
+		str_append(str, "RFC822.SIZE ");
+	if ((fields & MAIL_FETCH_GUID) != 0) {
+		str_append(str, mbox->guid_fetch_field_name);
+		str_append_c(str, ' ');
+	}
+	if ((fields & MAIL_FETCH_IMAP_BODY) != 0)
+		str_append(str, "BODY ");
+	if ((fields & MAIL_FETCH_IMAP_BODYSTRUCTURE) != 0)
+		str_append(str, "BODYSTRUCTURE ");
+
+	if ((fields & MAIL_FETCH_STREAM_BODY) != 0) {
+		if (!IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_ZIMBRA_WORKAROUNDS))
+			str_append(str, "BODY.PEEK[] ");
+		else {
+			/* BODY.PEEK[] can return different headers than
+			   BODY.PEEK[HEADER] (e.g. invalid 8bit chars replaced
+			   with '?' in HEADER) - this violates IMAP protocol
+			   and messes up dsync since it sometimes fetches the
+			   full body and sometimes only the headers. */
+			str_append(str, "BODY.PEEK[HEADER] BODY.PEEK[TEXT] ");
+		}
+	} else if ((fields & MAIL_FETCH_STREAM_HEADER) != 0)
+		str_append(str, "BODY.PEEK[HEADER] ");
+	else if (headers_count > 0) {
+		str_append(str, "BODY.PEEK[HEADER.FIELDS (");
+		for (i = 0; i < headers_count; i++) {
+			if (i > 0)
+				str_append_c(str, ' ');
+			imap_append_astring(str, headers[i]);
+		}
+		str_append(str, ")] ");
+	}
+	str_truncate(str, str_len(str)-1);
+	str_append_c(str, ')');
+}
+
+static void
+imapc_mail_pending_headers_add(struct imapc_mailbox *mbox,
+			       const char *const *headers)
 {
-	const char *s1 = str_c(str);
-	const char *s2 = str_c(mbox->pending_fetch_cmd);
-	const char *s1_args, *s2_args, *p1, *p2;
+	char *const *pending, *value;
+	unsigned int i, j, count;
 
-	if (!str_begins(s1, "UID FETCH ", &s1_args))
-		i_unreached();
-	if (!str_begins(s2, "UID FETCH ", &s2_args))
-		i_unreached();
+	if (headers == NULL)
+		return;
 
-	/* skip over UID range */
-	p1 = strchr(s1_args, ' ');
-	p2 = strchr(s2_args, ' ');
+	pending = array_get(&mbox->pending_fetch_headers, &count);
+	for (i = 0; headers[i] != NULL; i++) {
+		for (j = 0; j < count; j++) {
+			if (strcasecmp(pending[j], headers[i]) == 0)
+				break;
+		}
+		if (j == count) {
+			value = i_strdup(headers[i]);
+			array_push_back(&mbox->pending_fetch_headers, &value);
+			pending = array_get(&mbox->pending_fetch_headers,
+					    &count);
+		}
+	}
+}
 
-	if (null_strcmp(p1, p2) != 0)
+static bool
+imapc_mail_try_merge_fetch(struct imapc_mailbox *mbox,
+			   enum mail_fetch_field fields,
+			   const char *const *headers)
+{
+	/* Fetching a few extra metadata items or headers for the other
+	   mails costs much less than waiting for another round trip, so
+	   merge those freely. Message bodies are too large to be fetched
+	   needlessly though, so the wanted streams must be the same. */
+	if ((fields & IMAPC_FETCH_STREAM_FIELDS) !=
+	    (mbox->pending_fetch_fields & IMAPC_FETCH_STREAM_FIELDS))
 		return FALSE;
-	/* append the new UID to the pending FETCH UID range */
-	str_truncate(str, p1-s1);
-	str_insert(mbox->pending_fetch_cmd, p2-s2, ",");
-	str_insert(mbox->pending_fetch_cmd, p2-s2+1, str_c(str) + 10);
+
+	mbox->pending_fetch_fields |= fields;
+	imapc_mail_pending_headers_add(mbox, headers);
 	return TRUE;
 }
 
+static bool
+imapc_fetch_request_has_mail(struct imapc_fetch_request *request,
+			     struct imapc_mail *mail)
+{
+	struct imapc_mail *request_mail;
+
+	array_foreach_elem(&request->mails, request_mail) {
+		if (request_mail == mail)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 static void
-imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
+imapc_mail_delayed_send_or_merge(struct imapc_mail *mail,
+				 enum mail_fetch_field fields,
+				 const char *const *headers)
 {
 	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
+	uint32_t uid = mail->imail.mail.mail.uid;
 
 	if (mbox->pending_fetch_request != NULL &&
-	    !imapc_mail_try_merge_fetch(mbox, str)) {
+	    !imapc_mail_try_merge_fetch(mbox, fields, headers)) {
 		/* send the previous FETCH and create a new one */
 		imapc_mail_fetch_flush(mbox);
 	}
@@ -178,14 +269,22 @@ imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
 		mbox->pending_fetch_request =
 			i_new(struct imapc_fetch_request, 1);
 		i_array_init(&mbox->pending_fetch_request->mails, 4);
-		i_assert(mbox->pending_fetch_cmd->used == 0);
-		str_append_str(mbox->pending_fetch_cmd, str);
+		i_assert(array_count(&mbox->pending_fetch_uids) == 0);
+		mbox->pending_fetch_fields = fields;
+		imapc_mail_pending_headers_add(mbox, headers);
+	}
+	/* The same mail may already be in the request if it wants more
+	   fields than it did when it was prefetched. The merged command
+	   fetches those too, so don't add it twice. */
+	if (!seq_range_array_add(&mbox->pending_fetch_uids, uid) ||
+	    !imapc_fetch_request_has_mail(mbox->pending_fetch_request, mail)) {
+		array_push_back(&mbox->pending_fetch_request->mails, &mail);
+		mail->fetch_count++;
 	}
-	array_push_back(&mbox->pending_fetch_request->mails, &mail);
 
 	if (mbox->to_pending_fetch_send == NULL &&
 	    array_count(&mbox->pending_fetch_request->mails) >
-	    			mbox->box.storage->set->mail_prefetch_count) {
+	    			imapc_mailbox_get_prefetch_count(mbox)) {
 		/* we're now prefetching the maximum number of mails. this
 		   most likely means that we need to flush out the command now
 		   before sending anything else. delay it a little bit though
@@ -208,9 +307,7 @@ imapc_mail_send_fetch(struct mail *_mail, enum mail_fetch_field fields,
 	struct imapc_mail *mail = IMAPC_MAIL(_mail);
 	struct imapc_mailbox *mbox = IMAPC_MAILBOX(_mail->box);
 	struct mail_index_view *view;
-	string_t *str;
 	uint32_t seq;
-	unsigned int i;
 
 	i_assert(headers == NULL ||
 		 !IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_NO_FETCH_HEADERS));
@@ -252,63 +349,21 @@ imapc_mail_send_fetch(struct mail *_mail, enum mail_fetch_field fields,
 
 	if ((fields & MAIL_FETCH_STREAM_BODY) != 0)
 		fields |= MAIL_FETCH_STREAM_HEADER;
-
-	str = t_str_new(64);
-	str_printfa(str, "UID FETCH %u (", _mail->uid);
-	if ((fields & MAIL_FETCH_RECEIVED_DATE) != 0)
-		str_append(str, "INTERNALDATE ");
-	if ((fields & MAIL_FETCH_SAVE_DATE) != 0) {
-		i_assert(HAS_ALL_BITS(mbox->capabilities,
-				      IMAPC_CAPABILITY_SAVEDATE));
-		str_append(str, "SAVEDATE ");
-	}
-	if ((fields & (MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE)) != 0)
-		str_append(str, "RFC822.SIZE ");
-	if ((fields & MAIL_FETCH_GUID) != 0) {
-		str_append(str, mbox->guid_fetch_field_name);
-		str_append_c(str, ' ');
-	}
-	if ((fields & MAIL_FETCH_IMAP_BODY) != 0)
-		str_append(str, "BODY ");
-	if ((fields & MAIL_FETCH_IMAP_BODYSTRUCTURE) != 0)
-		str_append(str, "BODYSTRUCTURE ");
-
-	if ((fields & MAIL_FETCH_STREAM_BODY) != 0) {
-		if (!IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_ZIMBRA_WORKAROUNDS))
-			str_append(str, "BODY.PEEK[] ");
-		else {
-			/* BODY.PEEK[] can return different headers than
-			   BODY.PEEK[HEADER] (e.g. invalid 8bit chars replaced
-			   with '?' in HEADER) - this violates IMAP protocol
-			   and messes up dsync since it sometimes fetches the
-			   full body and sometimes only the headers. */
-			str_append(str, "BODY.PEEK[HEADER] BODY.PEEK[TEXT] ");
-		}
-		fields |= MAIL_FETCH_STREAM_HEADER;
-	} else if ((fields & MAIL_FETCH_STREAM_HEADER) != 0)
-		str_append(str, "BODY.PEEK[HEADER] ");
+	if ((fields & MAIL_FETCH_STREAM_HEADER) != 0)
+		headers = NULL;
 	else if (headers != NULL) {
 		mail->fetching_headers =
 			headers_merge(mail->imail.mail.data_pool, headers,
 				      mail->fetching_headers);
-		str_append(str, "BODY.PEEK[HEADER.FIELDS (");
-		for (i = 0; mail->fetching_headers[i] != NULL; i++) {
-			if (i > 0)
-				str_append_c(str, ' ');
-			imap_append_astring(str, mail->fetching_headers[i]);
-		}
-		str_append(str, ")] ");
+		headers = mail->fetching_headers;
 		mail->header_list_fetched = FALSE;
 	}
-	str_truncate(str, str_len(str)-1);
-	str_append_c(str, ')');
 
 	mail->fetching_fields |= fields;
-	mail->fetch_count++;
 	mail->fetch_sent = FALSE;
 	mail->fetch_failed = FALSE;
 
-	imapc_mail_delayed_send_or_merge(mail, str);
+	imapc_mail_delayed_send_or_merge(mail, fields, headers);
 	return 1;
 }
 
@@ -339,6 +394,68 @@ static void imapc_mail_cache_get(struct imapc_mail *mail,
 	imapc_mail_init_stream(mail);
 }
 
+static const char *
+imapc_mail_body_cache_key(struct imapc_mail *mail)
+{
+	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
+	const struct imapc_settings *set = mbox->storage->set;
+	const char *remote_mailbox;
+
+	/* UIDVALIDITY+UID identifies the message only within the remote
+	   mailbox, which in turn is identified by the server, user and its
+	   name. */
+	remote_mailbox = t_strdup_printf("%s@%s:%u/%s", set->imapc_user,
+					 set->imapc_host, set->imapc_port,
+					 imapc_mailbox_get_remote_name(mbox));
+	return imapc_body_cache_get_key(remote_mailbox,
+					mbox->sync_uid_validity,
+					mail->imail.mail.mail.uid);
+}
+
+static void imapc_mail_body_cache_get(struct imapc_mail *mail)
+{
+	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
+	const char *key;
+
+	if (mail->body_fetched || mail->imail.data.stream != NULL)
+		return;
+	if ((mail->fetching_fields & MAIL_FETCH_STREAM_BODY) != 0) {
+		/* already looked up and now being fetched */
+		return;
+	}
+
+	T_BEGIN {
+		key = imapc_mail_body_cache_key(mail);
+		if (key != NULL) {
+			mail->imail.data.stream =
+				imapc_body_cache_lookup(mbox->storage->body_cache,
+							key);
+		}
+	} T_END;
+	if (mail->imail.data.stream == NULL)
+		return;
+
+	mail->header_fetched = TRUE;
+	mail->body_fetched = TRUE;
+	/* see imapc_mail_cache_get() */
+	mail->imail.mail.mail.mail_stream_accessed = TRUE;
+	imapc_mail_init_stream(mail);
+}
+
+static void imapc_mail_body_cache_store(struct imapc_mail *mail)
+{
+	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
+	const char *key;
+
+	T_BEGIN {
+		key = imapc_mail_body_cache_key(mail);
+		if (key != NULL) {
+			imapc_body_cache_store(mbox->storage->body_cache, key,
+					       mail->imail.data.stream);
+		}
+	} T_END;
+}
+
 static enum mail_fetch_field
 imapc_mail_get_wanted_fetch_fields(struct imapc_mail *mail)
 {
@@ -388,6 +505,8 @@ void imapc_mail_try_init_stream_from_cache(struct imapc_mail *mail)
 
 	if (mbox->prev_mail_cache.uid == _mail->uid)
 		imapc_mail_cache_get(mail, &mbox->prev_mail_cache);
+	if (mbox->storage->body_cache != NULL)
+		imapc_mail_body_cache_get(mail);
 }
 
 bool imapc_mail_prefetch(struct mail *_mail)
@@ -519,6 +638,9 @@ void imapc_mail_fetch_flush(struct imapc_mailbox *mbox)
 {
 	struct imapc_command *cmd;
 	struct imapc_mail *mail;
+	char *const *headers, **headerp;
+	unsigned int headers_count;
+	string_t *str;
 
 	if (mbox->pending_fetch_request == NULL) {
 		i_assert(mbox->to_pending_fetch_send == NULL);
@@ -534,11 +656,22 @@ void imapc_mail_fetch_flush(struct imapc_mailbox *mbox)
 	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_RETRIABLE);
 	array_push_back(&mbox->fetch_requests, &mbox->pending_fetch_request);
 
-	imapc_command_send(cmd, str_c(mbox->pending_fetch_cmd));
+	str = t_str_new(128);
+	str_append(str, "UID FETCH ");
+	imap_write_seq_range(str, &mbox->pending_fetch_uids);
+	str_append_c(str, ' ');
+	headers = array_get(&mbox->pending_fetch_headers, &headers_count);
+	imapc_mail_fetch_append_items(mbox, str, mbox->pending_fetch_fields,
+				      headers, headers_count);
+	imapc_command_send(cmd, str_c(str));
 
 	mbox->pending_fetch_request = NULL;
 	timeout_remove(&mbox->to_pending_fetch_send);
-	str_truncate(mbox->pending_fetch_cmd, 0);
+	array_clear(&mbox->pending_fetch_uids);
+	mbox->pending_fetch_fields = 0;
+	array_foreach_modifiable(&mbox->pending_fetch_headers, headerp)
+		i_free(*headerp);
+	array_clear(&mbox->pending_fetch_headers);
 }
 
 static bool imapc_find_lfile_arg(const struct imapc_untagged_reply *reply,
@@ -723,6 +856,8 @@ imapc_fetch_stream(struct imapc_mail *mail,
 		i_stream_unref(&inputs[1]);
 	}
 
+	if (mail->body_fetched && mbox->storage->body_cache != NULL)
+		imapc_mail_body_cache_store(mail);
 	imapc_mail_init_stream(mail);
 }
 
@@ -226,6 +226,11 @@ imapc_search_init(struct mailbox_transaction_context *t,
 
 	ctx = index_storage_search_init(t, args, sort_program,
 					wanted_fields, wanted_headers);
+	/* prefetch the following mails while iterating, so their FETCHes
+	   get merged into the same command instead of each waiting for its
+	   own round trip. */
+	if (ctx->max_mails != UINT_MAX)
+		ctx->max_mails = imapc_mailbox_get_prefetch_count(mbox) + 1;
 
 	if (!imapc_build_search_query(mbox, args, &search_query)) {
 		/* can't optimize this with SEARCH */
@@ -31,6 +31,11 @@ static const struct setting_define imapc_setting_defines[] = {
 	DEF(UINT, imapc_connection_retry_count),
 	DEF(TIME_MSECS, imapc_connection_retry_interval),
 	DEF(SIZE, imapc_max_line_length),
+	DEF(UINT, imapc_max_pipelined_commands),
+	DEF(UINT, imapc_prefetch_count),
+	DEF(STR, imapc_body_cache_dir),
+	DEF(STR, imapc_body_cache_fs),
+	DEF(SIZE, imapc_body_cache_max_size),
 
 	DEF(STR, pop3_deleted_flag),
 
@@ -57,6 +62,11 @@ static const struct imapc_settings imapc_default_settings = {
 	.imapc_connection_retry_count = 1,
 	.imapc_connection_retry_interval = 1000,
 	.imapc_max_line_length = 0,
+	.imapc_max_pipelined_commands = 0,
+	.imapc_prefetch_count = 0,
+	.imapc_body_cache_dir = "",
+	.imapc_body_cache_fs = "posix",
+	.imapc_body_cache_max_size = 256*1024*1024,
 
 	.pop3_deleted_flag = ""
 };
@@ -52,6 +52,13 @@ struct imapc_settings {
 	unsigned int imapc_connection_retry_count;
 	unsigned int imapc_connection_retry_interval;
 	uoff_t imapc_max_line_length;
+	unsigned int imapc_max_pipelined_commands;
+	/* Overrides mail_prefetch_count if it's higher */
+	unsigned int imapc_prefetch_count;
+	/* Local cache for fetched message bodies. Empty = disabled. */
+	const char *imapc_body_cache_dir;
+	const char *imapc_body_cache_fs;
+	uoff_t imapc_body_cache_max_size;
 
 	const char *pop3_deleted_flag;
 
@@ -15,6 +15,7 @@
 #include "imapc-search.h"
 #include "imapc-sync.h"
 #include "imapc-attribute.h"
+#include "imapc-body-cache.h"
 #include "imapc-settings.h"
 #include "imapc-storage.h"
 
@@ -104,6 +105,12 @@ bool imapc_mailbox_has_modseqs(struct imapc_mailbox *mbox)
 		!IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_NO_MODSEQ);
 }
 
+unsigned int imapc_mailbox_get_prefetch_count(struct imapc_mailbox *mbox)
+{
+	return I_MAX(mbox->box.storage->set->mail_prefetch_count,
+		     mbox->storage->set->imapc_prefetch_count);
+}
+
 static struct mail_storage *imapc_storage_alloc(void)
 {
 	struct imapc_storage *storage;
@@ -350,6 +357,7 @@ int imapc_storage_client_create(struct mail_namespace *ns,
 	set.connect_retry_interval_msecs = imapc_set->imapc_connection_retry_interval;
 	set.max_idle_time = imapc_set->imapc_max_idle_time;
 	set.max_line_length = imapc_set->imapc_max_line_length;
+	set.max_pipelined_commands = imapc_set->imapc_max_pipelined_commands;
 	set.dns_client_socket_path = *ns->user->set->base_dir == '\0' ? "" :
 		t_strconcat(ns->user->set->base_dir, "/",
 			    DNS_CLIENT_SOCKET_NAME, NULL);
@@ -437,6 +445,18 @@ imapc_storage_create(struct mail_storage *_storage,
 	}
 	storage->client->_storage = storage;
 	storage->set = storage->client->set;
+	if (storage->set->imapc_body_cache_dir[0] != '\0') {
+		const char *dir = mail_user_home_expand(ns->user,
+			storage->set->imapc_body_cache_dir);
+		if (imapc_body_cache_init(ns->list, _storage->event,
+					  storage->set->imapc_body_cache_fs, dir,
+					  storage->set->imapc_body_cache_max_size,
+					  &storage->body_cache, error_r) < 0) {
+			storage->client->_storage = NULL;
+			imapc_storage_client_unref(&storage->client);
+			return -1;
+		}
+	}
 	p_array_init(&storage->remote_namespaces, _storage->pool, 4);
 	if (!IMAPC_HAS_FEATURE(storage, IMAPC_FEATURE_NO_FETCH_BODYSTRUCTURE)) {
 		_storage->nonbody_access_fields |=
@@ -447,6 +467,7 @@ imapc_storage_create(struct mail_storage *_storage,
 	_storage->unique_root_dir = p_strdup_printf(_storage->pool,
 						    "%s%s://(%s|%s):%s@%s:%u/%s mechs:%s features:%s "
 						    "rawlog:%s cmd_timeout:%u maxidle:%u maxline:%zuu "
+						    "maxpipelined:%u "
 						    "pop3delflg:%s root_dir:%s",
 						    storage->set->imapc_ssl,
 						    storage->set->imapc_ssl_verify ? "(verify)" : "",
@@ -462,6 +483,7 @@ imapc_storage_create(struct mail_storage *_storage,
 						    storage->set->imapc_cmd_timeout,
 						    storage->set->imapc_max_idle_time,
 						    (size_t) storage->set->imapc_max_line_length,
+						    storage->set->imapc_max_pipelined_commands,
 						    storage->set->pop3_deleted_flag,
 						    ns->list->set.root_dir);
 
@@ -484,6 +506,7 @@ static void imapc_storage_destroy(struct mail_storage *_storage)
 	   deinitialized */
 	imapc_client_logout(storage->client->client);
 
+	imapc_body_cache_deinit(&storage->body_cache);
 	imapc_storage_client_unref(&storage->client);
 	index_storage_destroy(_storage);
 }
@@ -553,7 +576,8 @@ imapc_mailbox_alloc(struct mail_storage *storage, struct mailbox_list *list,
 	p_array_init(&mbox->untagged_fetch_contexts, pool, 16);
 	p_array_init(&mbox->delayed_expunged_uids, pool, 16);
 	p_array_init(&mbox->copy_rollback_expunge_uids, pool, 16);
-	mbox->pending_fetch_cmd = str_new(pool, 128);
+	p_array_init(&mbox->pending_fetch_uids, pool, 16);
+	p_array_init(&mbox->pending_fetch_headers, pool, 8);
 	mbox->pending_copy_cmd = str_new(pool, 128);
 	mbox->prev_mail_cache.fd = -1;
 	imapc_mailbox_register_callbacks(mbox);
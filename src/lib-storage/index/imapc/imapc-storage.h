@@ -87,6 +87,7 @@ struct imapc_storage {
 
 	struct ioloop *root_ioloop;
 	struct imapc_storage_client *client;
+	struct imapc_body_cache *body_cache;
 
 	struct imapc_mailbox *cur_status_box;
 	struct mailbox_status *cur_status;
@@ -148,10 +149,13 @@ struct imapc_mailbox {
 
 	ARRAY(struct imapc_fetch_request *) fetch_requests;
 	ARRAY(struct imapc_untagged_fetch_ctx *) untagged_fetch_contexts;
-	/* if non-empty, contains the latest FETCH command we're going to be
-	   sending soon (but still waiting to see if we can increase its
-	   UID range) */
-	string_t *pending_fetch_cmd;
+	/* if pending_fetch_request is non-NULL, these contain the UIDs,
+	   fields and headers of the latest FETCH command we're going to be
+	   sending soon (but still waiting to see if we can merge more mails
+	   into it) */
+	ARRAY_TYPE(seq_range) pending_fetch_uids;
+	enum mail_fetch_field pending_fetch_fields;
+	ARRAY(char *) pending_fetch_headers;
 	/* if non-empty, contains the latest COPY command we're going to be
 	   sending soon. */
 	string_t *pending_copy_cmd;
@@ -235,6 +239,7 @@ int imapc_mailbox_select(struct imapc_mailbox *mbox);
 void imap_mailbox_select_finish(struct imapc_mailbox *mbox);
 
 bool imapc_mailbox_has_modseqs(struct imapc_mailbox *mbox);
+unsigned int imapc_mailbox_get_prefetch_count(struct imapc_mailbox *mbox);
 bool imapc_resp_text_code_parse(const char *str, enum mail_error *error_r);
 bool imapc_mail_error_to_resp_text_code(enum mail_error error, const char **str_r);
 void imapc_copy_error_from_reply(struct imapc_storage *storage,
@@ -27,6 +27,9 @@ struct mail_save_attachment {
 	pool_t pool;
 	struct fs *fs;
 	struct istream *input;
+	/* When copying a message with index_attachment_save_begin_copy(),
+	   this is the message with its attachments already removed. */
+	struct istream *msg_input;
 
 	struct fs_file *cur_file;
 	ARRAY_TYPE(mail_attachment_extref) extrefs;
@@ -42,6 +45,7 @@ static bool index_attachment_want(const struct istream_attachment_header *hdr,
 				  void *context)
 {
 	struct mail_save_context *ctx = context;
+	struct mail_storage *storage = ctx->transaction->box->storage;
 	struct mail_attachment_part apart;
 
 	i_zero(&apart);
@@ -52,9 +56,13 @@ static bool index_attachment_want(const struct istream_attachment_header *hdr,
 	if (ctx->part_is_attachment != NULL)
 		return ctx->part_is_attachment(ctx, &apart);
 
-	/* don't treat text/ parts as attachments */
-	return hdr->content_type != NULL &&
-		!str_begins_icase_with(hdr->content_type, "text/");
+	if (hdr->content_type == NULL ||
+	    str_begins_icase_with(hdr->content_type, "text/")) {
+		/* don't treat text/ parts as attachments, unless they're
+		   wanted to be stored externally as well */
+		return storage->set->mail_attachment_text_parts;
+	}
+	return TRUE;
 }
 
 static int index_attachment_open_temp_fd(void *context)
@@ -81,6 +89,24 @@ static int index_attachment_open_temp_fd(void *context)
 	return fd;
 }
 
+static const char *
+index_attachment_get_new_path(const char *attachment_dir, const char *digest)
+{
+	guid_128_t guid_128;
+
+	if (strlen(digest) < 4) {
+		/* make sure we can access first 4 bytes without accessing
+		   out of bounds memory */
+		digest = t_strconcat(digest, "\0\0\0\0", NULL);
+	}
+
+	guid_128_generate(guid_128);
+	return t_strdup_printf("%s/%c%c/%c%c/%s-%s", attachment_dir,
+			       digest[0], digest[1],
+			       digest[2], digest[3], digest,
+			       guid_128_to_string(guid_128));
+}
+
 static int
 index_attachment_open_ostream(struct istream_attachment_info *info,
 			      struct ostream **output_r,
@@ -91,26 +117,15 @@ index_attachment_open_ostream(struct istream_attachment_info *info,
 	struct mail_storage *storage = ctx->transaction->box->storage;
 	struct mail_attachment_extref *extref;
 	enum fs_open_flags flags = 0;
-	const char *attachment_dir, *path, *digest = info->hash;
-	guid_128_t guid_128;
+	const char *attachment_dir, *path;
 
 	i_assert(attach->cur_file == NULL);
 
 	if (storage->set->parsed_fsync_mode != FSYNC_MODE_NEVER)
 		flags |= FS_OPEN_FLAG_FSYNC;
 
-	if (strlen(digest) < 4) {
-		/* make sure we can access first 4 bytes without accessing
-		   out of bounds memory */
-		digest = t_strconcat(digest, "\0\0\0\0", NULL);
-	}
-
-	guid_128_generate(guid_128);
 	attachment_dir = index_attachment_dir_get(storage);
-	path = t_strdup_printf("%s/%c%c/%c%c/%s-%s", attachment_dir,
-			       digest[0], digest[1],
-			       digest[2], digest[3], digest,
-			       guid_128_to_string(guid_128));
+	path = index_attachment_get_new_path(attachment_dir, info->hash);
 	attach->cur_file = fs_file_init(attach->fs, path,
 					FS_OPEN_MODE_REPLACE | flags);
 
@@ -188,6 +203,70 @@ void index_attachment_save_begin(struct mail_save_context *ctx,
 	ctx->data.attach = attach;
 }
 
+void index_attachment_save_begin_copy(struct mail_save_context *ctx,
+				      struct fs *fs, struct istream *input,
+				      struct istream *msg_input)
+{
+	struct mail_save_attachment *attach;
+	pool_t pool;
+
+	i_assert(ctx->data.attach == NULL);
+
+	pool = pool_alloconly_create("save attachment copy", 1024);
+	attach = p_new(pool, struct mail_save_attachment, 1);
+	attach->pool = pool;
+	attach->fs = fs;
+	attach->input = input;
+	i_stream_ref(attach->input);
+	attach->msg_input = msg_input;
+	i_stream_ref(attach->msg_input);
+	p_array_init(&attach->extrefs, attach->pool, 8);
+	ctx->data.attach = attach;
+}
+
+int index_attachment_save_link(struct mail_save_context *ctx,
+			       const char *src_path,
+			       const struct mail_attachment_extref *src_extref)
+{
+	struct mail_save_attachment *attach = ctx->data.attach;
+	struct mail_storage *storage = ctx->transaction->box->storage;
+	struct mail_attachment_extref *extref;
+	struct fs_file *src_file, *dest_file;
+	const char *attachment_dir, *digest, *p, *dest_path;
+	int ret = 1;
+
+	i_assert(attach->msg_input != NULL);
+
+	/* the path is <digest dirs>/<digest>-<guid> */
+	digest = strrchr(src_extref->path, '/');
+	digest = digest == NULL ? src_extref->path : digest + 1;
+	p = strchr(digest, '-');
+	if (p != NULL)
+		digest = t_strdup_until(digest, p);
+
+	attachment_dir = index_attachment_dir_get(storage);
+	dest_path = index_attachment_get_new_path(attachment_dir, digest);
+	src_file = fs_file_init(attach->fs, src_path, FS_OPEN_MODE_READONLY);
+	dest_file = fs_file_init(attach->fs, dest_path, FS_OPEN_MODE_READONLY);
+	if (fs_copy(src_file, dest_file) < 0) {
+		if (errno == ENOTSUP || errno == EMLINK || ECANTLINK(errno))
+			ret = 0;
+		else {
+			e_error(ctx->transaction->box->event, "%s",
+				fs_file_last_error(dest_file));
+			ret = -1;
+		}
+	} else {
+		extref = array_append_space(&attach->extrefs);
+		*extref = *src_extref;
+		extref->path = p_strdup(attach->pool,
+					dest_path + strlen(attachment_dir) + 1);
+	}
+	fs_file_deinit(&src_file);
+	fs_file_deinit(&dest_file);
+	return ret;
+}
+
 static int save_check_write_error(struct mail_save_context *ctx,
 				  struct ostream *output)
 {
@@ -203,6 +282,49 @@ static int save_check_write_error(struct mail_save_context *ctx,
 	return -1;
 }
 
+static int index_attachment_save_copy_continue(struct mail_save_context *ctx)
+{
+	struct mail_save_attachment *attach = ctx->data.attach;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	/* the input is only parsed here. the message itself is written
+	   from msg_input once the input is finished. */
+	while ((ret = i_stream_read_more(attach->input, &data, &size)) > 0) {
+		i_stream_skip(attach->input, size);
+		index_mail_cache_parse_continue(ctx->dest_mail);
+	}
+	if (ret == 0)
+		return 0;
+
+	if (attach->input->stream_errno != 0) {
+		mail_set_critical(ctx->dest_mail, "read(%s) failed: %s",
+				  i_stream_get_name(attach->input),
+				  i_stream_get_error(attach->input));
+		return -1;
+	}
+	return 0;
+}
+
+static int index_attachment_save_copy_finish(struct mail_save_context *ctx)
+{
+	struct mail_save_attachment *attach = ctx->data.attach;
+
+	if (index_attachment_save_copy_continue(ctx) < 0)
+		return -1;
+	i_assert(attach->input->eof);
+
+	o_stream_nsend_istream(ctx->data.output, attach->msg_input);
+	if (attach->msg_input->stream_errno != 0) {
+		mail_set_critical(ctx->dest_mail, "read(%s) failed: %s",
+				  i_stream_get_name(attach->msg_input),
+				  i_stream_get_error(attach->msg_input));
+		return -1;
+	}
+	return save_check_write_error(ctx, ctx->data.output);
+}
+
 int index_attachment_save_continue(struct mail_save_context *ctx)
 {
 	struct mail_save_attachment *attach = ctx->data.attach;
@@ -212,6 +334,8 @@ int index_attachment_save_continue(struct mail_save_context *ctx)
 
 	if (attach->input->stream_errno != 0)
 		return -1;
+	if (attach->msg_input != NULL)
+		return index_attachment_save_copy_continue(ctx);
 
 	do {
 		ret = i_stream_read(attach->input);
@@ -244,6 +368,9 @@ int index_attachment_save_finish(struct mail_save_context *ctx)
 {
 	struct mail_save_attachment *attach = ctx->data.attach;
 
+	if (attach->msg_input != NULL)
+		return index_attachment_save_copy_finish(ctx);
+
 	(void)i_stream_read(attach->input);
 	i_assert(attach->input->eof);
 	return attach->input->stream_errno == 0 ? 0 : -1;
@@ -255,6 +382,7 @@ void index_attachment_save_free(struct mail_save_context *ctx)
 
 	if (attach != NULL) {
 		i_stream_unref(&attach->input);
+		i_stream_unref(&attach->msg_input);
 		pool_unref(&attach->pool);
 		ctx->data.attach = NULL;
 	}
@@ -26,6 +26,21 @@ ARRAY_DEFINE_TYPE(mail_attachment_extref, struct mail_attachment_extref);
 
 void index_attachment_save_begin(struct mail_save_context *ctx,
 				 struct fs *fs, struct istream *input);
+/* Like index_attachment_save_begin(), but the attachments already exist in
+   fs and are only referenced by calling index_attachment_save_link() for
+   each of them. msg_input is the message with the attachments removed, as
+   it was originally saved. It gets written as the message once input has
+   been fully read. input is read only for parsing the message. */
+void index_attachment_save_begin_copy(struct mail_save_context *ctx,
+				      struct fs *fs, struct istream *input,
+				      struct istream *msg_input);
+/* Add a new reference to an existing attachment in src_path, which was saved
+   with the given extref. This uses fs_copy(), which hard links the file with
+   posix fs, so the attachment data isn't written again. Returns 1 if ok,
+   0 if fs can't link the file, -1 if error (logged). */
+int index_attachment_save_link(struct mail_save_context *ctx,
+			       const char *src_path,
+			       const struct mail_attachment_extref *src_extref);
 int index_attachment_save_continue(struct mail_save_context *ctx);
 int index_attachment_save_finish(struct mail_save_context *ctx);
 void index_attachment_save_free(struct mail_save_context *ctx);
@@ -389,11 +389,23 @@ struct istream *
 index_mail_cache_parse_init(struct mail *_mail, struct istream *input)
 {
 	struct index_mail *mail = INDEX_MAIL(_mail);
+	struct mail_save_context *save_ctx = _mail->transaction->save_ctx;
 	struct istream *input2;
 
 	i_assert(mail->data.tee_stream == NULL);
 	i_assert(mail->data.parser_ctx == NULL);
 
+	if (save_ctx != NULL && save_ctx->data.precache) {
+		/* the fields were explicitly requested, so cache them
+		   regardless of the caching decisions. They're wanted only
+		   now that the mail is actually being parsed - copying may
+		   not parse it at all. */
+		index_mail_add_temp_wanted_fields(_mail,
+						  save_ctx->data.precache_fields,
+						  save_ctx->data.precache_headers);
+		mail->data.cache_fetch_fields |= save_ctx->data.precache_fields;
+		mail->data.precaching = TRUE;
+	}
 	/* we're doing everything for now, figure out later if we want to
 	   save them. */
 	mail->data.save_sent_date = TRUE;
@@ -7,6 +7,7 @@
 #include "istream.h"
 #include "hex-binary.h"
 #include "str.h"
+#include "time-util.h"
 #include "mailbox-recent-flags.h"
 #include "message-date.h"
 #include "message-part-data.h"
@@ -2305,11 +2306,24 @@ void index_mail_free(struct mail *_mail)
 	pool_unref(&mail->mail.pool);
 }
 
+static void
+index_mail_precache_add_time(struct index_mail *mail,
+			     const struct timeval *start_time)
+{
+	struct timeval end_time;
+
+	i_gettimeofday(&end_time);
+	mail->data.precache_usecs += timeval_diff_usecs(&end_time, start_time);
+}
+
 void index_mail_cache_parse_continue(struct mail *_mail)
 {
 	struct index_mail *mail = INDEX_MAIL(_mail);
 	struct message_block block;
+	struct timeval start_time;
 
+	if (mail->data.precaching)
+		i_gettimeofday(&start_time);
 	while (message_parser_parse_next_block(mail->data.parser_ctx,
 					       &block) > 0) {
 		if (block.size != 0)
@@ -2324,12 +2338,15 @@ void index_mail_cache_parse_continue(struct mail *_mail)
 							block.part, block.hdr);
 		}
 	}
+	if (mail->data.precaching)
+		index_mail_precache_add_time(mail, &start_time);
 }
 
 void index_mail_cache_parse_deinit(struct mail *_mail, time_t received_date,
 				   bool success)
 {
 	struct index_mail *mail = INDEX_MAIL(_mail);
+	struct timeval start_time;
 
 	if (!success) {
 		/* we're going to delete this mail anyway,
@@ -2356,7 +2373,11 @@ void index_mail_cache_parse_deinit(struct mail *_mail, time_t received_date,
 		mail->data.save_date = ioloop_time;
 	}
 
+	if (mail->data.precaching)
+		i_gettimeofday(&start_time);
 	(void)index_mail_parse_body_finish(mail, 0, success);
+	if (mail->data.precaching)
+		index_mail_precache_add_time(mail, &start_time);
 }
 
 static bool
@@ -2617,8 +2638,20 @@ int index_mail_opened(struct mail *mail,
 void index_mail_save_finish(struct mail_save_context *ctx)
 {
 	struct index_mail *imail = INDEX_MAIL(ctx->dest_mail);
+	struct timeval start_time;
 
+	if (imail->data.precaching)
+		i_gettimeofday(&start_time);
 	index_mail_save_finish_make_snippet(imail);
+	if (imail->data.precaching && !imail->data.no_caching) {
+		index_mail_precache_add_time(imail, &start_time);
+		struct event_passthrough *e =
+			event_create_passthrough(mail_event(ctx->dest_mail))->
+			set_name("mail_precache_finished")->
+			add_int("parse_usecs", imail->data.precache_usecs);
+		e_debug(e->event(), "Precached fields while saving "
+			"(parsing took %llu us)", imail->data.precache_usecs);
+	}
 
 	if (ctx->data.from_envelope != NULL &&
 	    imail->data.from_envelope == NULL) {
@@ -103,6 +103,8 @@ struct index_mail_data {
 	struct istream *parser_input;
 	struct message_parser_ctx *parser_ctx;
 	int parsing_count;
+	/* Time spent parsing the mail while saving it, when precaching */
+	unsigned long long precache_usecs;
 	ARRAY_TYPE(keywords) keywords;
 	ARRAY_TYPE(keyword_indexes) keyword_indexes;
 
@@ -129,6 +131,7 @@ struct index_mail_data {
 	bool destroy_callback_set:1;
 	bool prefetch_sent:1;
 	bool header_parser_initialized:1;
+	bool precaching:1;
 	bool attachment_flags_updating:1;
 	bool istream_broken:1;
 	/* virtual_size and physical_size may not match the stream size.
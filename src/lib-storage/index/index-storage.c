@@ -979,6 +979,7 @@ void index_save_context_free(struct mail_save_context *ctx)
 	i_free_and_null(ctx->data.from_envelope);
 	i_free_and_null(ctx->data.guid);
 	i_free_and_null(ctx->data.pop3_uidl);
+	mailbox_header_lookup_unref(&ctx->data.precache_headers);
 	index_attachment_save_free(ctx);
 	i_zero(&ctx->data);
 
@@ -1000,13 +1001,29 @@ mail_copy_cache_field(struct mail_save_context *ctx, struct mail *src_mail,
 
 	dest_field_idx = mail_cache_register_lookup(dest_trans->box->cache, name);
 	if (dest_field_idx == UINT_MAX) {
-		/* unknown field */
-		return;
+		if (!ctx->data.precache) {
+			/* unknown field */
+			return;
+		}
+		/* precaching: register the field for the destination
+		   mailbox the same way as it is in the source mailbox */
+		struct mail_cache_field new_field =
+			*mail_cache_register_get_field(src_mail->box->cache,
+						       src_field_idx);
+		new_field.decision = MAIL_CACHE_DECISION_NO;
+		new_field.last_used = 0;
+		mail_cache_register_fields(dest_trans->box->cache,
+					   &new_field, 1,
+					   unsafe_data_stack_pool);
+		dest_field_idx = new_field.idx;
 	}
 	dest_field = mail_cache_register_get_field(dest_trans->box->cache,
 						   dest_field_idx);
 	if ((dest_field->decision &
-	     ENUM_NEGATE(MAIL_CACHE_DECISION_FORCED)) == MAIL_CACHE_DECISION_NO) {
+	     ENUM_NEGATE(MAIL_CACHE_DECISION_FORCED)) == MAIL_CACHE_DECISION_NO &&
+	    (!ctx->data.precache ||
+	     dest_field->decision == (MAIL_CACHE_DECISION_NO |
+				      MAIL_CACHE_DECISION_FORCED))) {
 		/* field not wanted in destination mailbox */
 		return;
 	}
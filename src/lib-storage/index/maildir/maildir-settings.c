@@ -14,6 +14,8 @@ static const struct setting_define maildir_setting_defines[] = {
 	DEF(BOOL, maildir_very_dirty_syncs),
 	DEF(BOOL, maildir_broken_filename_sizes),
 	DEF(BOOL, maildir_empty_new),
+	DEF(BOOL, maildir_sync_journal),
+	DEF(ENUM, maildir_uidlist_format),
 
 	SETTING_DEFINE_LIST_END
 };
@@ -22,7 +24,9 @@ static const struct maildir_settings maildir_default_settings = {
 	.maildir_copy_with_hardlinks = TRUE,
 	.maildir_very_dirty_syncs = FALSE,
 	.maildir_broken_filename_sizes = FALSE,
-	.maildir_empty_new = FALSE
+	.maildir_empty_new = FALSE,
+	.maildir_sync_journal = FALSE,
+	.maildir_uidlist_format = "text:binary",
 };
 
 const struct setting_parser_info maildir_setting_parser_info = {
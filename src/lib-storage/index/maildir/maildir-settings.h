@@ -7,6 +7,8 @@ struct maildir_settings {
 	bool maildir_very_dirty_syncs;
 	bool maildir_broken_filename_sizes;
 	bool maildir_empty_new;
+	bool maildir_sync_journal;
+	const char *maildir_uidlist_format;
 };
 
 extern const struct setting_parser_info maildir_setting_parser_info;
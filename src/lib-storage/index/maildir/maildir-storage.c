@@ -13,6 +13,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-keywords.h"
 #include "maildir-sync.h"
+#include "maildir-sync-journal.h"
 #include "index-mail.h"
 
 #include <sys/stat.h>
@@ -635,6 +636,8 @@ static void maildir_mailbox_close(struct mailbox *box)
 		maildir_keywords_deinit(&mbox->keywords);
 	if (mbox->uidlist != NULL)
 		maildir_uidlist_deinit(&mbox->uidlist);
+	maildir_sync_journal_deinit(&mbox->sync_journal);
+	mbox->sync_journal_failed = FALSE;
 	index_storage_mailbox_close(box);
 }
 
@@ -78,6 +78,8 @@ struct maildir_mailbox {
 	/* maildir sync: */
 	struct maildir_uidlist *uidlist;
 	struct maildir_keywords *keywords;
+	/* cur/ change journal, if maildir_sync_journal=yes */
+	struct maildir_sync_journal *sync_journal;
 
 	struct maildir_index_header maildir_hdr;
 	uint32_t maildir_ext_id;
@@ -89,6 +91,7 @@ struct maildir_mailbox {
 	bool backend_readonly:1;
 	bool backend_readonly_set:1;
 	bool sync_uidlist_refreshed:1;
+	bool sync_journal_failed:1;
 };
 
 #define MAILDIR_STORAGE(s)	container_of(s, struct maildir_storage, storage)
@@ -0,0 +1,376 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "fd-util.h"
+#include "hash.h"
+#include "llist.h"
+#include "maildir-sync-journal.h"
+
+#ifdef HAVE_INOTIFY_INIT
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define MAILDIR_SYNC_JOURNAL_EVENT_MASK \
+	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define MAILDIR_SYNC_JOURNAL_READ_SIZE \
+	(16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+/* Syncing more changes than this isn't much faster than a full scan */
+#define MAILDIR_SYNC_JOURNAL_MAX_CHANGES 10000
+
+/* value in the changes hash */
+#define MAILDIR_SYNC_JOURNAL_REMOVED POINTER_CAST(1)
+#define MAILDIR_SYNC_JOURNAL_EXISTS POINTER_CAST(2)
+
+struct maildir_sync_journal {
+	struct maildir_sync_journal *prev, *next;
+
+	char *dir;
+	struct event *event;
+	int wd;
+
+	/* filename => MAILDIR_SYNC_JOURNAL_REMOVED/EXISTS */
+	HASH_TABLE(char *, void *) changes;
+
+	/* The changes are relative to the last full scan */
+	bool valid:1;
+	bool scanning:1;
+};
+
+struct maildir_sync_journal_iter {
+	struct maildir_sync_journal *journal;
+	struct hash_iterate_context *iter;
+};
+
+/* The inotify instance shared by all the journals in the process */
+static int journal_inotify_fd = -1;
+static struct maildir_sync_journal *journals = NULL;
+
+static void maildir_sync_journal_clear(struct maildir_sync_journal *journal)
+{
+	struct hash_iterate_context *iter;
+	char *key;
+	void *value;
+
+	iter = hash_table_iterate_init(journal->changes);
+	while (hash_table_iterate(iter, journal->changes, &key, &value))
+		i_free(key);
+	hash_table_iterate_deinit(&iter);
+	hash_table_clear(journal->changes, TRUE);
+}
+
+static void
+maildir_sync_journal_lost(struct maildir_sync_journal *journal,
+			  const char *reason)
+{
+	if (journal->valid || journal->scanning) {
+		e_debug(journal->event, "Change journal for %s lost: %s",
+			journal->dir, reason);
+	}
+	journal->valid = FALSE;
+	journal->scanning = FALSE;
+	maildir_sync_journal_clear(journal);
+}
+
+static void
+maildir_sync_journal_change(struct maildir_sync_journal *journal,
+			    const char *fname, bool exists)
+{
+	void *value = exists ? MAILDIR_SYNC_JOURNAL_EXISTS :
+		MAILDIR_SYNC_JOURNAL_REMOVED;
+	char *key;
+	void *old_value;
+
+	if (hash_table_lookup_full(journal->changes, fname, &key, &old_value)) {
+		hash_table_update(journal->changes, key, value);
+		return;
+	}
+	if (hash_table_count(journal->changes) >=
+	    MAILDIR_SYNC_JOURNAL_MAX_CHANGES) {
+		maildir_sync_journal_lost(journal, "Too many changes");
+		return;
+	}
+	key = i_strdup(fname);
+	hash_table_insert(journal->changes, key, value);
+}
+
+static bool
+maildir_sync_journal_wd_is_used(int wd, struct maildir_sync_journal *skip)
+{
+	struct maildir_sync_journal *journal;
+
+	for (journal = journals; journal != NULL; journal = journal->next) {
+		if (journal->wd == wd && journal != skip)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static bool
+maildir_sync_journal_watch(struct maildir_sync_journal *journal)
+{
+	/* If another journal already watches the same directory, this returns
+	   the same wd for it. */
+	journal->wd = inotify_add_watch(journal_inotify_fd, journal->dir,
+					MAILDIR_SYNC_JOURNAL_EVENT_MASK);
+	if (journal->wd < 0) {
+		e_debug(journal->event, "inotify_add_watch(%s) failed: %m",
+			journal->dir);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+maildir_sync_journal_unwatch(struct maildir_sync_journal *journal)
+{
+	if (journal->wd < 0)
+		return;
+	if (!maildir_sync_journal_wd_is_used(journal->wd, journal))
+		(void)inotify_rm_watch(journal_inotify_fd, journal->wd);
+	journal->wd = -1;
+}
+
+static void
+maildir_sync_journal_handle_event(const struct inotify_event *event)
+{
+	struct maildir_sync_journal *journal;
+
+	for (journal = journals; journal != NULL; journal = journal->next) {
+		if ((event->mask & IN_Q_OVERFLOW) != 0) {
+			maildir_sync_journal_lost(journal,
+						  "Event queue overflow");
+			continue;
+		}
+		if (event->wd != journal->wd || journal->wd < 0)
+			continue;
+		if ((event->mask & (IN_IGNORED | IN_UNMOUNT |
+				    IN_DELETE_SELF | IN_MOVE_SELF)) != 0) {
+			maildir_sync_journal_lost(journal,
+						  "Directory was removed");
+			/* the kernel removes the watch itself */
+			journal->wd = -1;
+			continue;
+		}
+		if ((!journal->valid && !journal->scanning) || event->len == 0)
+			continue;
+
+		if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+			maildir_sync_journal_change(journal, event->name, TRUE);
+		else if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0)
+			maildir_sync_journal_change(journal, event->name, FALSE);
+	}
+}
+
+static void maildir_sync_journal_read(void)
+{
+	union {
+		struct inotify_event event;
+		unsigned char data[MAILDIR_SYNC_JOURNAL_READ_SIZE];
+	} buf;
+	struct maildir_sync_journal *journal;
+	const struct inotify_event *event;
+	ssize_t ret, pos;
+
+	for (;;) {
+		ret = read(journal_inotify_fd, buf.data, sizeof(buf.data));
+		if (ret <= 0) {
+			if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+				i_error("read(inotify) failed: %m");
+				for (journal = journals; journal != NULL;
+				     journal = journal->next) {
+					maildir_sync_journal_lost(journal,
+						"read() failed");
+				}
+			}
+			break;
+		}
+
+		for (pos = 0; pos < ret; ) {
+			event = (const void *)(buf.data + pos);
+			pos += sizeof(*event) + event->len;
+			maildir_sync_journal_handle_event(event);
+		}
+	}
+}
+
+struct maildir_sync_journal *
+maildir_sync_journal_init(const char *dir, struct event *event)
+{
+	struct maildir_sync_journal *journal;
+
+	if (journal_inotify_fd == -1) {
+		journal_inotify_fd = inotify_init();
+		if (journal_inotify_fd == -1) {
+			/* most likely the user's inotify instance limit was
+			   reached */
+			e_debug(event, "inotify_init() failed: %m");
+			return NULL;
+		}
+		fd_close_on_exec(journal_inotify_fd, TRUE);
+		fd_set_nonblock(journal_inotify_fd, TRUE);
+	}
+
+	journal = i_new(struct maildir_sync_journal, 1);
+	journal->dir = i_strdup(dir);
+	journal->event = event;
+	event_ref(journal->event);
+	hash_table_create(&journal->changes, default_pool, 0, str_hash, strcmp);
+	DLLIST_PREPEND(&journals, journal);
+	if (!maildir_sync_journal_watch(journal))
+		maildir_sync_journal_deinit(&journal);
+	return journal;
+}
+
+void maildir_sync_journal_deinit(struct maildir_sync_journal **_journal)
+{
+	struct maildir_sync_journal *journal = *_journal;
+
+	if (journal == NULL)
+		return;
+	*_journal = NULL;
+
+	maildir_sync_journal_unwatch(journal);
+	DLLIST_REMOVE(&journals, journal);
+	if (journals == NULL)
+		i_close_fd(&journal_inotify_fd);
+
+	maildir_sync_journal_clear(journal);
+	hash_table_destroy(&journal->changes);
+	event_unref(&journal->event);
+	i_free(journal->dir);
+	i_free(journal);
+}
+
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal)
+{
+	maildir_sync_journal_read();
+	return journal->valid;
+}
+
+void maildir_sync_journal_scan_begin(struct maildir_sync_journal *journal)
+{
+	/* The changes that have already happened are visible to the
+	   following readdir(), so they can be dropped. */
+	maildir_sync_journal_read();
+	maildir_sync_journal_clear(journal);
+	journal->valid = FALSE;
+	if (journal->wd < 0)
+		(void)maildir_sync_journal_watch(journal);
+	journal->scanning = journal->wd >= 0;
+}
+
+void maildir_sync_journal_scan_end(struct maildir_sync_journal *journal,
+				   bool success)
+{
+	journal->valid = success && journal->scanning && journal->wd >= 0;
+	journal->scanning = FALSE;
+	if (!journal->valid)
+		maildir_sync_journal_clear(journal);
+}
+
+struct maildir_sync_journal_iter *
+maildir_sync_journal_iter_init(struct maildir_sync_journal *journal)
+{
+	struct maildir_sync_journal_iter *iter;
+
+	iter = i_new(struct maildir_sync_journal_iter, 1);
+	iter->journal = journal;
+	iter->iter = hash_table_iterate_init(journal->changes);
+	return iter;
+}
+
+const char *
+maildir_sync_journal_iter_next(struct maildir_sync_journal_iter *iter,
+			       bool *exists_r)
+{
+	char *key;
+	void *value;
+
+	if (!hash_table_iterate(iter->iter, iter->journal->changes,
+				&key, &value))
+		return NULL;
+	*exists_r = value == MAILDIR_SYNC_JOURNAL_EXISTS;
+	return key;
+}
+
+void maildir_sync_journal_iter_deinit(struct maildir_sync_journal_iter **_iter)
+{
+	struct maildir_sync_journal_iter *iter = *_iter;
+
+	*_iter = NULL;
+	hash_table_iterate_deinit(&iter->iter);
+	i_free(iter);
+}
+
+void maildir_sync_journal_clear_changes(struct maildir_sync_journal *journal)
+{
+	maildir_sync_journal_clear(journal);
+}
+
+unsigned int maildir_sync_journal_count(struct maildir_sync_journal *journal)
+{
+	return hash_table_count(journal->changes);
+}
+
+#else
+
+struct maildir_sync_journal *
+maildir_sync_journal_init(const char *dir ATTR_UNUSED,
+			  struct event *event)
+{
+	e_debug(event, "Change journal not supported in this system");
+	return NULL;
+}
+
+void maildir_sync_journal_deinit(struct maildir_sync_journal **journal)
+{
+	i_assert(*journal == NULL);
+}
+
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_scan_begin(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_scan_end(struct maildir_sync_journal *journal ATTR_UNUSED,
+				   bool success ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+struct maildir_sync_journal_iter *
+maildir_sync_journal_iter_init(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+const char *
+maildir_sync_journal_iter_next(struct maildir_sync_journal_iter *iter ATTR_UNUSED,
+			       bool *exists_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_iter_deinit(struct maildir_sync_journal_iter **iter ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_clear_changes(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+unsigned int maildir_sync_journal_count(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef MAILDIR_SYNC_JOURNAL_H
+#define MAILDIR_SYNC_JOURNAL_H
+
+/* Change journal for a maildir directory (cur/). The directory is watched
+   with inotify and the journal remembers the names of the files that were
+   added or removed since the changes were last cleared. This allows syncing
+   to process only the changed files instead of readdir()ing large
+   directories.
+
+   All the journals in the process share a single inotify instance, with
+   one watch for each directory. The instances are limited per user
+   (fs.inotify.max_user_instances) and IDLE needs them as well.
+
+   The journal becomes valid after a full scan of the directory:
+   maildir_sync_journal_scan_begin() is called before opendir() and
+   maildir_sync_journal_scan_end() after closedir(). The changes that happen
+   during the scan are kept. Since each filename's final state is determined
+   by its last change, syncing them gives the correct result even if
+   readdir() already saw the changes.
+
+   Only changes done via the local kernel are noticed, so the journal must
+   not be used with shared filesystems such as NFS. */
+
+struct maildir_sync_journal;
+
+/* Start watching the directory. Returns NULL if watching isn't possible. */
+struct maildir_sync_journal *
+maildir_sync_journal_init(const char *dir, struct event *event);
+void maildir_sync_journal_deinit(struct maildir_sync_journal **journal);
+
+/* Read the pending changes. Returns TRUE if the changes are valid, FALSE if
+   a full scan is needed first, e.g. because the kernel's event queue
+   overflowed. */
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal);
+
+void maildir_sync_journal_scan_begin(struct maildir_sync_journal *journal);
+/* success=FALSE if the scan failed and the directory wasn't fully seen. */
+void maildir_sync_journal_scan_end(struct maildir_sync_journal *journal,
+				   bool success);
+
+/* Iterate through the filenames added or removed since the changes were
+   last cleared. exists_r is TRUE if the file exists after the changes.
+   The changes must not be refreshed while iterating. */
+struct maildir_sync_journal_iter *
+maildir_sync_journal_iter_init(struct maildir_sync_journal *journal);
+const char *
+maildir_sync_journal_iter_next(struct maildir_sync_journal_iter *iter,
+			       bool *exists_r);
+void maildir_sync_journal_iter_deinit(struct maildir_sync_journal_iter **iter);
+
+/* Forget the changes after they have been synced. */
+void maildir_sync_journal_clear_changes(struct maildir_sync_journal *journal);
+/* Returns the number of changed filenames. */
+unsigned int maildir_sync_journal_count(struct maildir_sync_journal *journal);
+
+#endif
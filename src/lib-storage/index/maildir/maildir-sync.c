@@ -182,6 +182,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
 #include "maildir-sync.h"
+#include "maildir-sync-journal.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -223,9 +224,15 @@ struct maildir_sync_context {
 	struct maildir_uidlist_sync_ctx *uidlist_sync_ctx;
 	struct maildir_index_sync_context *index_sync_ctx;
 
+	/* cur/ is synced from the change journal. The cur/ times to save
+	   are the ones before the changes were read. */
+	time_t cur_check_time, cur_mtime;
+	unsigned int cur_mtime_nsecs;
+
 	bool partial:1;
 	bool locked:1;
 	bool racing:1;
+	bool cur_journal:1;
 };
 
 void maildir_sync_set_racing(struct maildir_sync_context *ctx)
@@ -399,6 +406,95 @@ maildir_stat(struct maildir_mailbox *mbox, const char *path, struct stat *st_r)
 	return -1;
 }
 
+static bool maildir_sync_cur_journal_init(struct maildir_sync_context *ctx)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+	struct stat st;
+
+	if (mbox->sync_journal == NULL) {
+		/* start watching before the full scan */
+		if (!mbox->sync_journal_failed) {
+			mbox->sync_journal =
+				maildir_sync_journal_init(ctx->cur_dir,
+							  mbox->box.event);
+			mbox->sync_journal_failed = mbox->sync_journal == NULL;
+		}
+		return FALSE;
+	}
+
+	/* stat() before reading the changes: anything changed after this
+	   updates the mtime, so the next sync will see it */
+	if (maildir_stat(mbox, ctx->cur_dir, &st) < 0)
+		return FALSE;
+	if (!maildir_sync_journal_refresh(mbox->sync_journal))
+		return FALSE;
+
+	ctx->cur_check_time = time(NULL);
+	ctx->cur_mtime = st.st_mtime;
+	ctx->cur_mtime_nsecs = ST_MTIME_NSEC(st);
+	return TRUE;
+}
+
+static int
+maildir_scan_cur_journal(struct maildir_sync_context *ctx)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+	struct maildir_sync_journal_iter *iter;
+	const char *fname;
+	unsigned int count = 0;
+	bool exists;
+	int ret = 0;
+
+	if (!ctx->locked) {
+		/* new files can't be added without the lock. keep the
+		   changes for the next sync. */
+		return 0;
+	}
+
+	/* Add the new and renamed files first, so the removal of a renamed
+	   file's old name is ignored. */
+	iter = maildir_sync_journal_iter_init(mbox->sync_journal);
+	while ((fname = maildir_sync_journal_iter_next(iter, &exists)) != NULL) {
+		if (!exists || fname[0] == '.')
+			continue;
+		if (fname[0] == MAILDIR_INFO_SEP) {
+			if (maildir_rename_empty_basename(ctx, ctx->cur_dir,
+							  fname) < 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		if ((++count % MAILDIR_SLOW_CHECK_COUNT) == 0)
+			maildir_sync_notify(ctx);
+		if (maildir_uidlist_sync_next(ctx->uidlist_sync_ctx,
+					      fname, 0) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	maildir_sync_journal_iter_deinit(&iter);
+	if (ret < 0)
+		return -1;
+
+	iter = maildir_sync_journal_iter_init(mbox->sync_journal);
+	while ((fname = maildir_sync_journal_iter_next(iter, &exists)) != NULL) {
+		if (!exists && fname[0] != '.' &&
+		    fname[0] != MAILDIR_INFO_SEP) {
+			maildir_uidlist_sync_remove_unseen(
+				ctx->uidlist_sync_ctx, fname);
+		}
+	}
+	maildir_sync_journal_iter_deinit(&iter);
+	maildir_sync_journal_clear_changes(mbox->sync_journal);
+
+	mbox->maildir_hdr.cur_check_time = time_to_uint32(ctx->cur_check_time);
+	mbox->maildir_hdr.cur_mtime = ctx->cur_mtime;
+	mbox->maildir_hdr.cur_mtime_nsecs = ctx->cur_mtime_nsecs;
+	return 0;
+}
+
 static int
 maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		 enum maildir_scan_why why)
@@ -412,8 +508,20 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 	enum maildir_uidlist_rec_flag flags;
 	unsigned int time_diff, i, readdir_count = 0, move_count = 0;
 	time_t start_time;
+	struct maildir_sync_journal *journal = NULL;
 	int ret = 1;
-	bool move_new, dir_changed = FALSE;
+	bool move_new, dir_changed = FALSE, scan_complete;
+
+	if (!new_dir && ctx->cur_journal) {
+		/* sync only the changed files in the (possibly huge) cur/ */
+		return maildir_scan_cur_journal(ctx);
+	}
+	if (!new_dir && ctx->mbox->sync_journal != NULL && ctx->locked) {
+		/* without the lock the new files aren't added to uidlist,
+		   so the scan can't be used as the journal's base */
+		journal = ctx->mbox->sync_journal;
+		maildir_sync_journal_scan_begin(journal);
+	}
 
 	path = new_dir ? ctx->new_dir : ctx->cur_dir;
 	for (i = 0;; i++) {
@@ -429,6 +537,8 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 				mailbox_set_critical(&ctx->mbox->box,
 					"opendir(%s) failed: %m", path);
 			}
+			if (journal != NULL)
+				maildir_sync_journal_scan_end(journal, FALSE);
 			return -1;
 		}
 
@@ -442,11 +552,15 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		mailbox_set_critical(&ctx->mbox->box,
 			"fstat(%s) failed: %m", path);
 		(void)closedir(dirp);
+		if (journal != NULL)
+			maildir_sync_journal_scan_end(journal, FALSE);
 		return -1;
 	}
 #else
 	if (maildir_stat(ctx->mbox, path, &st) < 0) {
 		(void)closedir(dirp);
+		if (journal != NULL)
+			maildir_sync_journal_scan_end(journal, FALSE);
 		return -1;
 	}
 #endif
@@ -542,6 +656,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 				break;
 		}
 	}
+	scan_complete = dp == NULL && errno == 0;
 
 #ifdef __APPLE__
 	if (errno == EINVAL && move_count > 0 && !final) {
@@ -562,6 +677,8 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 				     "closedir(%s) failed: %m", path);
 		ret = -1;
 	}
+	if (journal != NULL)
+		maildir_sync_journal_scan_end(journal, scan_complete);
 
 	if (dir_changed) {
 		/* save the exact new times. the new mtimes should be >=
@@ -863,6 +980,14 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 	if (!cur_changed) {
 		ctx->partial = TRUE;
 		sync_flags = MAILDIR_UIDLIST_SYNC_PARTIAL;
+	} else if (!forced && ctx->mbox->storage->set->maildir_sync_journal &&
+		   maildir_sync_cur_journal_init(ctx)) {
+		/* Only the changed files in cur/ are added to or removed
+		   from the uidlist. The uidlist still contains all the files
+		   afterwards, so the index sync isn't partial. */
+		ctx->partial = FALSE;
+		ctx->cur_journal = TRUE;
+		sync_flags = MAILDIR_UIDLIST_SYNC_PARTIAL;
 	} else {
 		ctx->partial = FALSE;
 		sync_flags = 0;
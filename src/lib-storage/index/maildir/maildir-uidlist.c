@@ -22,14 +22,39 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Binary format is written instead of version 3 when
+   maildir_uidlist_format=binary. It's meant for large maildirs: reading it
+   requires no parsing and the filenames can be looked up from its sorted
+   hash table without building an in-memory hash of them. The format is:
+
+   header: struct maildir_uidlist_bin_header
+   records: struct maildir_uidlist_bin_record[records_count], sorted by UID
+   hashes: struct maildir_uidlist_bin_hash[records_count], sorted by hash
+   strings: <filename>\0[<extensions>] for each record, ending with \0\0.
+            Extensions are the same as in memory: <key><value>\0[...]\0
+   header extensions: [<key><value> ...]\0 as in version 3 header
+
+   New records are appended after these in a log:
+
+   entry: struct maildir_uidlist_bin_log_record <filename>\0[<extensions>]
+
+   Each part is padded to 32bit alignment and integers are little endian.
+   Either format can be read regardless of the setting. The file is
+   converted to the wanted format the next time it's rewritten.
 */
 
 #include "lib.h"
 #include "array.h"
+#include "byteorder.h"
 #include "hash.h"
 #include "istream.h"
 #include "ostream.h"
 #include "str.h"
+#include "mmap-util.h"
+#include "read-full.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
 #include "eacces-error.h"
@@ -50,6 +75,52 @@
 #define UIDLIST_IS_LOCKED(uidlist) \
 	((uidlist)->lock_count > 0)
 
+#define UIDLIST_BIN_MAGIC "\x89" "DUIDL\r\n"
+#define UIDLIST_BIN_MAGIC_LEN 8
+#define UIDLIST_BIN_VERSION 1
+#define UIDLIST_BIN_ALIGN(size) (((size) + 3) & ~3U)
+/* Rewrite the binary uidlist when its log has this many records and it's
+   also large compared to the rest of the file. */
+#define UIDLIST_BIN_LOG_REWRITE_MIN_COUNT 1000
+#define UIDLIST_BIN_LOG_REWRITE_PERCENTAGE 10
+
+struct maildir_uidlist_bin_header {
+	unsigned char magic[UIDLIST_BIN_MAGIC_LEN];
+	uint32_t version;
+	uint32_t header_size;
+
+	uint32_t uid_validity;
+	uint32_t next_uid;
+	guid_128_t mailbox_guid;
+
+	uint32_t records_count;
+	uint32_t strings_size;
+	uint32_t hdr_ext_size;
+	/* The log begins at this offset */
+	uint32_t base_size;
+};
+
+struct maildir_uidlist_bin_record {
+	uint32_t uid;
+	/* Offsets into the strings. extensions_offset=0 if there are none. */
+	uint32_t filename_offset;
+	uint32_t extensions_offset;
+};
+
+struct maildir_uidlist_bin_hash {
+	/* maildir_filename_base_hash() of the filename */
+	uint32_t hash;
+	uint32_t record_idx;
+};
+
+struct maildir_uidlist_bin_log_record {
+	uint32_t uid;
+	/* Both sizes include the trailing \0. extensions_size=0 if there are
+	   none. */
+	uint32_t filename_size;
+	uint32_t extensions_size;
+};
+
 struct maildir_uidlist_rec {
 	uint32_t uid;
 	uint32_t flags;
@@ -61,6 +132,12 @@ ARRAY_DEFINE_TYPE(maildir_uidlist_rec_p, struct maildir_uidlist_rec *);
 HASH_TABLE_DEFINE_TYPE(path_to_maildir_uidlist_rec,
 		       char *, struct maildir_uidlist_rec *);
 
+struct maildir_uidlist_base_file {
+	unsigned int hash;
+	struct maildir_uidlist_rec *rec;
+};
+ARRAY_DEFINE_TYPE(maildir_uidlist_base_file, struct maildir_uidlist_base_file);
+
 struct maildir_uidlist {
 	struct mailbox *box;
 	char *path;
@@ -79,12 +156,17 @@ struct maildir_uidlist {
 	pool_t record_pool;
 	ARRAY_TYPE(maildir_uidlist_rec_p) records;
 	HASH_TABLE_TYPE(path_to_maildir_uidlist_rec) files;
+	/* Files read from the binary uidlist, sorted by hash. These haven't
+	   been added to the files hash table. */
+	ARRAY_TYPE(maildir_uidlist_base_file) base_files;
 	unsigned int change_counter;
 
 	unsigned int version;
 	unsigned int uid_validity, next_uid, prev_read_uid, last_seen_uid;
 	unsigned int hdr_next_uid;
 	unsigned int read_records_count, read_line_count;
+	/* Number of records in the binary uidlist base and log */
+	unsigned int bin_base_count, bin_log_count;
 	uoff_t last_read_offset;
 	string_t *hdr_extensions;
 
@@ -99,6 +181,10 @@ struct maildir_uidlist {
 	bool unsorted:1;
 	bool have_mailbox_guid:1;
 	bool opened_readonly:1;
+	/* The opened file uses the binary format */
+	bool binary:1;
+	/* maildir_uidlist_format=binary */
+	bool want_binary:1;
 };
 
 struct maildir_uidlist_sync_ctx {
@@ -276,6 +362,8 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 			  maildir_filename_base_cmp);
 	uidlist->next_uid = 1;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
+	uidlist->want_binary =
+		strcmp(mbox->storage->set->maildir_uidlist_format, "binary") == 0;
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
 	uidlist->dotlock_settings.use_excl_lock =
@@ -315,6 +403,7 @@ static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
 	uidlist->read_records_count = 0;
 
 	hash_table_clear(uidlist->files, FALSE);
+	array_free(&uidlist->base_files);
 	array_clear(&uidlist->records);
 }
 
@@ -329,6 +418,7 @@ void maildir_uidlist_deinit(struct maildir_uidlist **_uidlist)
 	maildir_uidlist_close(uidlist);
 
 	hash_table_destroy(&uidlist->files);
+	array_free(&uidlist->base_files);
 	pool_unref(&uidlist->record_pool);
 
 	array_free(&uidlist->records);
@@ -344,6 +434,54 @@ static int maildir_uid_cmp(struct maildir_uidlist_rec *const *rec1,
 		(*rec1)->uid > (*rec2)->uid ? 1 : 0;
 }
 
+static struct maildir_uidlist_rec *
+maildir_uidlist_files_lookup(struct maildir_uidlist *uidlist,
+			     const char *filename)
+{
+	const struct maildir_uidlist_base_file *files;
+	struct maildir_uidlist_rec *rec;
+	unsigned int hash, idx, left_idx, right_idx, count;
+
+	rec = hash_table_lookup(uidlist->files, filename);
+	if (rec != NULL || !array_is_created(&uidlist->base_files))
+		return rec;
+
+	/* find the first file with the hash */
+	hash = maildir_filename_base_hash(filename);
+	files = array_get(&uidlist->base_files, &count);
+	left_idx = 0; right_idx = count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (files[idx].hash < hash)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	for (idx = left_idx; idx < count && files[idx].hash == hash; idx++) {
+		if (maildir_filename_base_cmp(files[idx].rec->filename,
+					      filename) == 0)
+			return files[idx].rec;
+	}
+	return NULL;
+}
+
+static void maildir_uidlist_files_materialize(struct maildir_uidlist *uidlist)
+{
+	const struct maildir_uidlist_base_file *file;
+
+	if (!array_is_created(&uidlist->base_files))
+		return;
+
+	/* files already in the hash table are newer */
+	array_foreach(&uidlist->base_files, file) {
+		if (hash_table_lookup(uidlist->files, file->rec->filename) == NULL) {
+			hash_table_insert(uidlist->files, file->rec->filename,
+					  file->rec);
+		}
+	}
+	array_free(&uidlist->base_files);
+}
+
 static void ATTR_FORMAT(2, 3)
 maildir_uidlist_set_corrupted(struct maildir_uidlist *uidlist,
 			      const char *fmt, ...)
@@ -445,42 +583,27 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
-static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
-				 const char *line)
+/* Returns 1 if a record with the UID should be added, 0 if it already
+   exists and -1 if the UID is invalid. */
+static int
+maildir_uidlist_next_uid(struct maildir_uidlist *uidlist, uint32_t uid)
 {
-	struct event *event = uidlist->box->event;
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
-	uint32_t uid;
-
-	uid = 0;
-	while (*line >= '0' && *line <= '9') {
-		uid = uid*10 + (*line - '0');
-		line++;
-	}
-
-	if (uid == 0 || *line != ' ') {
-		/* invalid file */
-		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
-					      line);
-		return FALSE;
-	}
 	if (uid <= uidlist->prev_read_uid) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UIDs not ordered (%u >= %u)",
 					      uid, uidlist->prev_read_uid);
-		return FALSE;
+		return -1;
 	}
 	if (uid >= (uint32_t)-1) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UID too high (%u)", uid);
-		return FALSE;
+		return -1;
 	}
 	uidlist->prev_read_uid = uid;
 
 	if (uid <= uidlist->last_seen_uid) {
 		/* we already have this */
-		return TRUE;
+		return 0;
 	}
         uidlist->last_seen_uid = uid;
 
@@ -488,41 +611,31 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		maildir_uidlist_set_corrupted(uidlist,
 			"UID larger than next_uid (%u >= %u)",
 			uid, uidlist->next_uid);
-		return FALSE;
+		return -1;
 	}
+	return 1;
+}
 
-	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
-	rec->uid = uid;
-	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
-
-	while (*line == ' ') line++;
-
-	if (uidlist->version == UIDLIST_VERSION) {
-		/* read extended fields */
-		bool ret;
-
-		T_BEGIN {
-			ret = maildir_uidlist_read_extended(uidlist, &line,
-							    rec);
-		} T_END;
-		if (!ret) {
-			maildir_uidlist_set_corrupted(uidlist,
-				"Invalid extended fields: %s", line);
-			return FALSE;
-		}
-	}
+static bool
+maildir_uidlist_add_read_rec(struct maildir_uidlist *uidlist,
+			     struct maildir_uidlist_rec *rec,
+			     const char *filename)
+{
+	struct event *event = uidlist->box->event;
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
 
-	if (strchr(line, '/') != NULL) {
+	if (strchr(filename, '/') != NULL) {
 		maildir_uidlist_set_corrupted(uidlist,
 			"%s: Broken filename at line %u: %s",
-			uidlist->path, uidlist->read_line_count, line);
+			uidlist->path, uidlist->read_line_count, filename);
 		return FALSE;
 	}
 
-	old_rec = hash_table_lookup(uidlist->files, line);
+	old_rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (old_rec == NULL) {
 		/* no conflicts */
-	} else if (old_rec->uid == uid) {
+	} else if (old_rec->uid == rec->uid) {
 		/* most likely this is a record we saved ourself, but couldn't
 		   update last_seen_uid because uidlist wasn't refreshed while
 		   it was locked.
@@ -534,6 +647,7 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 
 		   we'll waste a bit of memory here by allocating the record
 		   twice, but that's not really a problem.  */
+		maildir_uidlist_files_materialize(uidlist);
 		rec->filename = old_rec->filename;
 		hash_table_update(uidlist->files, rec->filename, rec);
 		uidlist->unsorted = TRUE;
@@ -544,11 +658,12 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		e_warning(event,
 			  "%s: Duplicate file entry at line %u: "
 			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
-			  old_rec->uid, uid, uidlist->retry_rewind ?
+			  uidlist->path, uidlist->read_line_count, filename,
+			  old_rec->uid, rec->uid, uidlist->retry_rewind ?
 			  " - retrying by re-reading from beginning" : "");
 		if (uidlist->retry_rewind)
 			return FALSE;
+		maildir_uidlist_files_materialize(uidlist);
 		/* Delete the old UID */
 		(void)maildir_uidlist_records_array_delete(uidlist, old_rec);
 		/* Replace the old record with this new one */
@@ -558,18 +673,63 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 	}
 
 	recs = array_get(&uidlist->records, &count);
-	if (count > 0 && recs[count-1]->uid > uid) {
+	if (count > 0 && recs[count-1]->uid > rec->uid) {
 		/* we most likely have some records in the array that we saved
 		   ourself without refreshing uidlist */
 		uidlist->unsorted = TRUE;
 	}
 
-	rec->filename = p_strdup(uidlist->record_pool, line);
+	rec->filename = p_strdup(uidlist->record_pool, filename);
 	hash_table_update(uidlist->files, rec->filename, rec);
 	array_push_back(&uidlist->records, &rec);
 	return TRUE;
 }
 
+static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
+				 const char *line)
+{
+	struct maildir_uidlist_rec *rec;
+	uint32_t uid;
+	int ret;
+
+	uid = 0;
+	while (*line >= '0' && *line <= '9') {
+		uid = uid*10 + (*line - '0');
+		line++;
+	}
+
+	if (uid == 0 || *line != ' ') {
+		/* invalid file */
+		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
+					      line);
+		return FALSE;
+	}
+	if ((ret = maildir_uidlist_next_uid(uidlist, uid)) <= 0)
+		return ret == 0;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+	while (*line == ' ') line++;
+
+	if (uidlist->version == UIDLIST_VERSION) {
+		/* read extended fields */
+		bool success;
+
+		T_BEGIN {
+			success = maildir_uidlist_read_extended(uidlist, &line,
+								rec);
+		} T_END;
+		if (!success) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid extended fields: %s", line);
+			return FALSE;
+		}
+	}
+	return maildir_uidlist_add_read_rec(uidlist, rec, line);
+}
+
 static int
 maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 			       const char *line,
@@ -644,68 +804,539 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 		return 0;
 	}
 
-	uidlist->version = *line - '0';
-	line += 2;
+	uidlist->version = *line - '0';
+	line += 2;
+
+	switch (uidlist->version) {
+	case 1:
+		if (sscanf(line, "%u %u", &uid_validity, &next_uid) != 2) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Corrupted header (version 1)");
+			return 0;
+		}
+		break;
+	case UIDLIST_VERSION:
+		T_BEGIN {
+			ret = maildir_uidlist_read_v3_header(uidlist, line,
+							     &uid_validity,
+							     &next_uid);
+		} T_END;
+		if (ret < 0)
+			return 0;
+		break;
+	default:
+		maildir_uidlist_set_corrupted(uidlist, "Unsupported version %u",
+					      uidlist->version);
+		return 0;
+	}
+
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	return 1;
+}
+
+static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
+{
+	array_sort(&uidlist->records, maildir_uid_cmp);
+	uidlist->unsorted = FALSE;
+}
+
+static void
+maildir_uidlist_read_finish(struct maildir_uidlist *uidlist, int ret,
+			    uint32_t orig_uid_validity, uint32_t orig_next_uid)
+{
+	if (uidlist->unsorted) {
+		uidlist->recreate_on_change = TRUE;
+		maildir_uidlist_records_sort_by_uid(uidlist);
+	}
+	if (uidlist->next_uid <= uidlist->prev_read_uid)
+		uidlist->next_uid = uidlist->prev_read_uid + 1;
+	if (ret > 0 && uidlist->uid_validity != orig_uid_validity &&
+	    orig_uid_validity != 0) {
+		uidlist->recreate = TRUE;
+	} else if (ret > 0 && uidlist->next_uid < orig_next_uid) {
+		mailbox_set_critical(uidlist->box,
+			"%s: next_uid was lowered (%u -> %u, hdr=%u)",
+			uidlist->path, orig_next_uid,
+			uidlist->next_uid, uidlist->hdr_next_uid);
+		uidlist->recreate = TRUE;
+		uidlist->next_uid = orig_next_uid;
+	}
+}
+
+static int
+maildir_uidlist_read_text(struct maildir_uidlist *uidlist, int fd,
+			  uoff_t last_read_offset, uoff_t *last_read_offset_r,
+			  bool *retry_r, bool try_retry)
+{
+	const char *line;
+	uint32_t orig_next_uid, orig_uid_validity;
+	struct istream *input;
+	int ret;
+
+	input = i_stream_create_fd(fd, SIZE_MAX);
+	i_stream_seek(input, last_read_offset);
+
+	orig_uid_validity = uidlist->uid_validity;
+	orig_next_uid = uidlist->next_uid;
+	ret = input->v_offset != 0 ? 1 :
+		maildir_uidlist_read_header(uidlist, input);
+	if (ret > 0) {
+		uidlist->prev_read_uid = 0;
+		uidlist->change_counter++;
+		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
+
+		ret = 1;
+		while ((line = i_stream_read_next_line(input)) != NULL) {
+			uidlist->read_records_count++;
+			uidlist->read_line_count++;
+			if (!maildir_uidlist_next(uidlist, line)) {
+				if (!uidlist->retry_rewind)
+					ret = 0;
+				else {
+					ret = -1;
+					*retry_r = TRUE;
+				}
+				break;
+			}
+                }
+		uidlist->retry_rewind = FALSE;
+		if (input->stream_errno != 0)
+                        ret = -1;
+
+		maildir_uidlist_read_finish(uidlist, ret, orig_uid_validity,
+					    orig_next_uid);
+	}
+
+	if (ret < 0 && !*retry_r) {
+                /* I/O error */
+                if (input->stream_errno == ESTALE && try_retry)
+			*retry_r = TRUE;
+		else {
+			mailbox_set_critical(uidlist->box,
+				"read(%s) failed: %s", uidlist->path,
+				i_stream_get_error(input));
+		}
+	}
+	*last_read_offset_r = input->v_offset;
+	i_stream_destroy(&input);
+	return ret;
+}
+
+/* Returns the size of the extensions including the trailing \0,
+   or 0 if they're invalid. */
+static size_t
+maildir_uidlist_bin_extensions_size(const unsigned char *data,
+				    const unsigned char *end)
+{
+	const unsigned char *p = data;
+	size_t len;
+
+	/* <key><value>\0[...]\0 */
+	while (p < end && *p != '\0') {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p))
+			return 0;
+		len = strnlen((const char *)p, end - p);
+		if (len == (size_t)(end - p))
+			return 0;
+		p += len + 1;
+	}
+	return p < end ? (size_t)(p - data) + 1 : 0;
+}
+
+static int
+maildir_uidlist_bin_read_header(struct maildir_uidlist *uidlist,
+				const unsigned char *data, size_t size,
+				uint32_t *records_count_r, size_t *base_size_r)
+{
+	const struct maildir_uidlist_bin_header *hdr = (const void *)data;
+	uint32_t uid_validity, next_uid, records_count, strings_size;
+	uint32_t hdr_ext_size;
+	const unsigned char *strings, *hdr_ext;
+	uint64_t base_size;
+
+	uidlist->read_line_count = 1;
+	if (size < sizeof(*hdr) ||
+	    le32_to_cpu(hdr->version) != UIDLIST_BIN_VERSION ||
+	    le32_to_cpu(hdr->header_size) != sizeof(*hdr)) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted binary header");
+		return 0;
+	}
+	uid_validity = le32_to_cpu(hdr->uid_validity);
+	next_uid = le32_to_cpu(hdr->next_uid);
+	records_count = le32_to_cpu(hdr->records_count);
+	strings_size = le32_to_cpu(hdr->strings_size);
+	hdr_ext_size = le32_to_cpu(hdr->hdr_ext_size);
+
+	base_size = sizeof(*hdr) +
+		(uint64_t)records_count * sizeof(struct maildir_uidlist_bin_record) +
+		(uint64_t)records_count * sizeof(struct maildir_uidlist_bin_hash) +
+		UIDLIST_BIN_ALIGN((uint64_t)strings_size) +
+		UIDLIST_BIN_ALIGN((uint64_t)hdr_ext_size);
+	if (base_size != le32_to_cpu(hdr->base_size) || base_size > size ||
+	    strings_size < 2 || hdr_ext_size < 1) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted binary header (invalid sizes)");
+		return 0;
+	}
+	strings = data + sizeof(*hdr) +
+		records_count * sizeof(struct maildir_uidlist_bin_record) +
+		records_count * sizeof(struct maildir_uidlist_bin_hash);
+	hdr_ext = strings + UIDLIST_BIN_ALIGN(strings_size);
+	if (strings[strings_size-2] != '\0' ||
+	    strings[strings_size-1] != '\0' ||
+	    hdr_ext[hdr_ext_size-1] != '\0' ||
+	    strlen((const char *)hdr_ext) != hdr_ext_size-1) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted binary header (unterminated strings)");
+		return 0;
+	}
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->version = UIDLIST_VERSION;
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	uidlist->have_mailbox_guid = !guid_128_is_empty(hdr->mailbox_guid);
+	memcpy(uidlist->mailbox_guid, hdr->mailbox_guid,
+	       sizeof(uidlist->mailbox_guid));
+	str_truncate(uidlist->hdr_extensions, 0);
+	str_append_data(uidlist->hdr_extensions, hdr_ext, hdr_ext_size-1);
+
+	uidlist->bin_base_count = records_count;
+	uidlist->bin_log_count = 0;
+	*records_count_r = records_count;
+	*base_size_r = base_size;
+	return 1;
+}
+
+static bool
+maildir_uidlist_bin_read_base_fast(struct maildir_uidlist *uidlist,
+				   const unsigned char *data,
+				   uint32_t records_count)
+{
+	const struct maildir_uidlist_bin_record *bin_recs;
+	const struct maildir_uidlist_bin_hash *bin_hashes;
+	const struct maildir_uidlist_bin_header *hdr = (const void *)data;
+	struct maildir_uidlist_base_file *file;
+	struct maildir_uidlist_rec *recs, *rec;
+	uint32_t i, strings_size, offset, prev_hash = 0;
+	unsigned char *strings;
+
+	/* Nothing has been read yet, so the records can be used as they are.
+	   Only check that they're safe to use. */
+	bin_recs = (const void *)(hdr + 1);
+	bin_hashes = (const void *)(bin_recs + records_count);
+	strings_size = le32_to_cpu(hdr->strings_size);
+
+	recs = p_new(uidlist->record_pool, struct maildir_uidlist_rec,
+		     records_count);
+	strings = p_malloc(uidlist->record_pool, strings_size);
+	memcpy(strings, bin_hashes + records_count, strings_size);
+
+	array_free(&uidlist->base_files);
+	i_array_init(&uidlist->base_files, records_count);
+	for (i = 0; i < records_count; i++) {
+		rec = &recs[i];
+		uidlist->read_records_count++;
+		uidlist->read_line_count++;
+		rec->uid = le32_to_cpu(bin_recs[i].uid);
+		if (rec->uid <= uidlist->prev_read_uid ||
+		    rec->uid >= (uint32_t)-1) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"UIDs not ordered (%u >= %u)",
+				rec->uid, uidlist->prev_read_uid);
+			return FALSE;
+		}
+		uidlist->prev_read_uid = rec->uid;
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+		offset = le32_to_cpu(bin_recs[i].filename_offset);
+		if (offset >= strings_size || strings[offset] == '\0') {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid filename offset for UID %u", rec->uid);
+			return FALSE;
+		}
+		rec->filename = (char *)strings + offset;
+
+		offset = le32_to_cpu(bin_recs[i].extensions_offset);
+		if (offset != 0) {
+			if (offset >= strings_size ||
+			    maildir_uidlist_bin_extensions_size(
+					strings + offset,
+					strings + strings_size) == 0) {
+				maildir_uidlist_set_corrupted(uidlist,
+					"Invalid extensions for UID %u",
+					rec->uid);
+				return FALSE;
+			}
+			rec->extensions = strings + offset;
+		}
+		array_push_back(&uidlist->records, &rec);
+	}
+	for (i = 0; i < records_count; i++) {
+		offset = le32_to_cpu(bin_hashes[i].record_idx);
+		if (offset >= records_count ||
+		    le32_to_cpu(bin_hashes[i].hash) < prev_hash) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Corrupted filename hash table");
+			return FALSE;
+		}
+		prev_hash = le32_to_cpu(bin_hashes[i].hash);
+		file = array_append_space(&uidlist->base_files);
+		file->hash = prev_hash;
+		file->rec = &recs[offset];
+	}
+	uidlist->last_seen_uid = uidlist->prev_read_uid;
+	return TRUE;
+}
+
+static bool
+maildir_uidlist_bin_next(struct maildir_uidlist *uidlist, uint32_t uid,
+			 const char *filename, const unsigned char *extensions,
+			 size_t extensions_size)
+{
+	struct maildir_uidlist_rec *rec;
+	int ret;
+
+	uidlist->read_records_count++;
+	uidlist->read_line_count++;
+	if ((ret = maildir_uidlist_next_uid(uidlist, uid)) <= 0)
+		return ret == 0;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+	if (extensions_size > 0) {
+		rec->extensions = p_memdup(uidlist->record_pool, extensions,
+					   extensions_size);
+	}
+	return maildir_uidlist_add_read_rec(uidlist, rec, filename);
+}
+
+static bool
+maildir_uidlist_bin_read_base(struct maildir_uidlist *uidlist,
+			      const unsigned char *data,
+			      uint32_t records_count)
+{
+	const struct maildir_uidlist_bin_header *hdr = (const void *)data;
+	const struct maildir_uidlist_bin_record *bin_recs = (const void *)(hdr + 1);
+	const unsigned char *strings, *strings_end, *ext;
+	uint32_t i, uid, offset;
+	size_t ext_size;
+
+	if (records_count == 0)
+		return TRUE;
+	if (array_count(&uidlist->records) == 0 &&
+	    uidlist->last_seen_uid == 0) {
+		return maildir_uidlist_bin_read_base_fast(uidlist, data,
+							  records_count);
+	}
+
+	/* merge with the existing records */
+	strings = (const void *)(bin_recs + records_count);
+	strings += records_count * sizeof(struct maildir_uidlist_bin_hash);
+	strings_end = strings + le32_to_cpu(hdr->strings_size);
+	for (i = 0; i < records_count; i++) {
+		uid = le32_to_cpu(bin_recs[i].uid);
+		offset = le32_to_cpu(bin_recs[i].filename_offset);
+		if (offset >= (size_t)(strings_end - strings) ||
+		    strings[offset] == '\0') {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid filename offset for UID %u", uid);
+			return FALSE;
+		}
+		ext = NULL; ext_size = 0;
+		if (bin_recs[i].extensions_offset != 0) {
+			ext = strings + le32_to_cpu(bin_recs[i].extensions_offset);
+			if (ext < strings_end) {
+				ext_size = maildir_uidlist_bin_extensions_size(
+					ext, strings_end);
+			}
+			if (ext_size == 0) {
+				maildir_uidlist_set_corrupted(uidlist,
+					"Invalid extensions for UID %u", uid);
+				return FALSE;
+			}
+		}
+		if (!maildir_uidlist_bin_next(uidlist, uid,
+					      (const char *)strings + offset,
+					      ext, ext_size))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+maildir_uidlist_bin_read_log(struct maildir_uidlist *uidlist,
+			     const unsigned char *data, size_t size,
+			     size_t *offset)
+{
+	const struct maildir_uidlist_bin_log_record *log_rec;
+	const unsigned char *filename, *ext;
+	uint32_t uid, filename_size, ext_size;
+	size_t rec_size;
+
+	while (size - *offset >= sizeof(*log_rec)) {
+		log_rec = (const void *)(data + *offset);
+		uid = le32_to_cpu(log_rec->uid);
+		filename_size = le32_to_cpu(log_rec->filename_size);
+		ext_size = le32_to_cpu(log_rec->extensions_size);
+		rec_size = sizeof(*log_rec) +
+			UIDLIST_BIN_ALIGN((uint64_t)filename_size + ext_size);
+		if (rec_size > size - *offset) {
+			/* the rest of the record hasn't been written yet */
+			break;
+		}
+
+		filename = (const void *)(log_rec + 1);
+		ext = filename + filename_size;
+		if (filename_size < 2 || filename[filename_size-1] != '\0' ||
+		    strlen((const char *)filename) != filename_size-1) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid filename for UID %u", uid);
+			return FALSE;
+		}
+		if (ext_size != 0 &&
+		    maildir_uidlist_bin_extensions_size(ext, ext + ext_size) !=
+		    ext_size) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid extensions for UID %u", uid);
+			return FALSE;
+		}
+		if (!maildir_uidlist_bin_next(uidlist, uid,
+					      (const char *)filename,
+					      ext, ext_size))
+			return FALSE;
+		*offset += rec_size;
+		uidlist->bin_log_count++;
+	}
+	return TRUE;
+}
+
+static int
+maildir_uidlist_read_binary(struct maildir_uidlist *uidlist, int fd,
+			    const struct stat *st, uoff_t last_read_offset,
+			    uoff_t *last_read_offset_r)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	uint32_t orig_next_uid, orig_uid_validity, records_count;
+	size_t size = st->st_size, offset = last_read_offset;
+	unsigned char *data;
+	bool mapped = FALSE;
+	int ret;
+
+	*last_read_offset_r = last_read_offset;
+	if ((uoff_t)st->st_size <= last_read_offset)
+		return 1;
 
-	switch (uidlist->version) {
-	case 1:
-		if (sscanf(line, "%u %u", &uid_validity, &next_uid) != 2) {
-			maildir_uidlist_set_corrupted(uidlist,
-				"Corrupted header (version 1)");
-			return 0;
+	if (!storage->set->mmap_disable) {
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			mailbox_set_critical(uidlist->box,
+				"mmap(%s) failed: %m", uidlist->path);
+			return -1;
+		}
+		mapped = TRUE;
+	} else {
+		data = i_malloc(size);
+		ret = pread_full(fd, data, size, 0);
+		if (ret <= 0) {
+			if (ret < 0) {
+				mailbox_set_critical(uidlist->box,
+					"read(%s) failed: %m", uidlist->path);
+			} else {
+				mailbox_set_critical(uidlist->box,
+					"read(%s) failed: Unexpected EOF",
+					uidlist->path);
+			}
+			i_free(data);
+			return -1;
 		}
-		break;
-	case UIDLIST_VERSION:
-		T_BEGIN {
-			ret = maildir_uidlist_read_v3_header(uidlist, line,
-							     &uid_validity,
-							     &next_uid);
-		} T_END;
-		if (ret < 0)
-			return 0;
-		break;
-	default:
-		maildir_uidlist_set_corrupted(uidlist, "Unsupported version %u",
-					      uidlist->version);
-		return 0;
 	}
 
-	if (uid_validity == 0 || next_uid == 0) {
-		maildir_uidlist_set_corrupted(uidlist,
-			"Broken header (uidvalidity = %u, next_uid=%u)",
-			uid_validity, next_uid);
-		return 0;
+	orig_uid_validity = uidlist->uid_validity;
+	orig_next_uid = uidlist->next_uid;
+	ret = 1;
+	if (offset == 0) {
+		ret = maildir_uidlist_bin_read_header(uidlist, data, size,
+						      &records_count, &offset);
 	}
-
-	if (uid_validity == uidlist->uid_validity &&
-	    next_uid < uidlist->hdr_next_uid) {
-		maildir_uidlist_set_corrupted(uidlist,
-			"next_uid header was lowered (%u -> %u)",
-			uidlist->hdr_next_uid, next_uid);
-		return 0;
+	if (ret > 0) {
+		uidlist->prev_read_uid = 0;
+		uidlist->change_counter++;
+		if (last_read_offset == 0 &&
+		    !maildir_uidlist_bin_read_base(uidlist, data,
+						   records_count))
+			ret = 0;
+		else if (!maildir_uidlist_bin_read_log(uidlist, data, size,
+						       &offset))
+			ret = 0;
+		maildir_uidlist_read_finish(uidlist, ret, orig_uid_validity,
+					    orig_next_uid);
+	}
+
+	if (mapped) {
+		if (munmap(data, size) < 0) {
+			mailbox_set_critical(uidlist->box,
+				"munmap(%s) failed: %m", uidlist->path);
+		}
+	} else {
+		i_free(data);
 	}
-
-	uidlist->uid_validity = uid_validity;
-	uidlist->next_uid = next_uid;
-	uidlist->hdr_next_uid = next_uid;
-	return 1;
+	*last_read_offset_r = offset;
+	return ret;
 }
 
-static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
+static int
+maildir_uidlist_detect_format(struct maildir_uidlist *uidlist, int fd)
 {
-	array_sort(&uidlist->records, maildir_uid_cmp);
-	uidlist->unsorted = FALSE;
+	unsigned char magic[UIDLIST_BIN_MAGIC_LEN];
+	ssize_t ret;
+
+	ret = pread(fd, magic, sizeof(magic), 0);
+	if (ret < 0)
+		return -1;
+	uidlist->binary = ret == sizeof(magic) &&
+		memcmp(magic, UIDLIST_BIN_MAGIC, sizeof(magic)) == 0;
+	return 0;
 }
 
 static int
 maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 			    bool *retry_r, bool try_retry)
 {
-	const char *line;
-	uint32_t orig_next_uid, orig_uid_validity;
-	struct istream *input;
 	struct stat st;
-	uoff_t last_read_offset;
+	uoff_t last_read_offset, new_read_offset;
 	int fd, ret;
 	bool readonly = FALSE;
 
@@ -754,6 +1385,17 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 			"fstat(%s) failed: %m", uidlist->path);
 		return -1;
 	}
+	if (last_read_offset == 0 &&
+	    maildir_uidlist_detect_format(uidlist, fd) < 0) {
+		i_close_fd(&fd);
+		if (errno == ESTALE && try_retry) {
+			*retry_r = TRUE;
+			return -1;
+		}
+		mailbox_set_critical(uidlist->box,
+			"pread(%s) failed: %m", uidlist->path);
+		return -1;
+	}
 
 	if (uidlist->record_pool == NULL) {
 		uidlist->record_pool =
@@ -763,53 +1405,14 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 							    st.st_size/8));
 	}
 
-	input = i_stream_create_fd(fd, SIZE_MAX);
-	i_stream_seek(input, last_read_offset);
-
-	orig_uid_validity = uidlist->uid_validity;
-	orig_next_uid = uidlist->next_uid;
-	ret = input->v_offset != 0 ? 1 :
-		maildir_uidlist_read_header(uidlist, input);
-	if (ret > 0) {
-		uidlist->prev_read_uid = 0;
-		uidlist->change_counter++;
-		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
-
-		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
-			uidlist->read_records_count++;
-			uidlist->read_line_count++;
-			if (!maildir_uidlist_next(uidlist, line)) {
-				if (!uidlist->retry_rewind)
-					ret = 0;
-				else {
-					ret = -1;
-					*retry_r = TRUE;
-				}
-				break;
-			}
-                }
-		uidlist->retry_rewind = FALSE;
-		if (input->stream_errno != 0)
-                        ret = -1;
-
-		if (uidlist->unsorted) {
-			uidlist->recreate_on_change = TRUE;
-			maildir_uidlist_records_sort_by_uid(uidlist);
-		}
-		if (uidlist->next_uid <= uidlist->prev_read_uid)
-			uidlist->next_uid = uidlist->prev_read_uid + 1;
-		if (ret > 0 && uidlist->uid_validity != orig_uid_validity &&
-		    orig_uid_validity != 0) {
-			uidlist->recreate = TRUE;
-		} else if (ret > 0 && uidlist->next_uid < orig_next_uid) {
-			mailbox_set_critical(uidlist->box,
-				"%s: next_uid was lowered (%u -> %u, hdr=%u)",
-				uidlist->path, orig_next_uid,
-				uidlist->next_uid, uidlist->hdr_next_uid);
-			uidlist->recreate = TRUE;
-			uidlist->next_uid = orig_next_uid;
-		}
+	if (uidlist->binary) {
+		ret = maildir_uidlist_read_binary(uidlist, fd, &st,
+						  last_read_offset,
+						  &new_read_offset);
+	} else {
+		ret = maildir_uidlist_read_text(uidlist, fd, last_read_offset,
+						&new_read_offset,
+						retry_r, try_retry);
 	}
 
         if (ret == 0) {
@@ -819,25 +1422,20 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
                 /* success */
 		if (readonly)
 			uidlist->recreate_on_change = TRUE;
+		if (uidlist->binary != uidlist->want_binary) {
+			/* convert to the wanted format */
+			uidlist->recreate = TRUE;
+		}
 		uidlist->fd = fd;
 		uidlist->fd_dev = st.st_dev;
 		uidlist->fd_ino = st.st_ino;
 		uidlist->fd_size = st.st_size;
-		uidlist->last_read_offset = input->v_offset;
+		uidlist->last_read_offset = new_read_offset;
 		maildir_uidlist_update_hdr(uidlist, &st);
-        } else if (!*retry_r) {
-                /* I/O error */
-                if (input->stream_errno == ESTALE && try_retry)
-			*retry_r = TRUE;
-		else {
-			mailbox_set_critical(uidlist->box,
-				"read(%s) failed: %s", uidlist->path,
-				i_stream_get_error(input));
-		}
+        } else {
 		uidlist->last_read_offset = 0;
 	}
 
-	i_stream_destroy(&input);
 	if (ret <= 0) {
 		if (close(fd) < 0) {
 			mailbox_set_critical(uidlist->box,
@@ -846,7 +1444,6 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 	}
 	return ret;
 }
-
 static int
 maildir_uidlist_stat(struct maildir_uidlist *uidlist, struct stat *st_r)
 {
@@ -942,6 +1539,13 @@ static int maildir_uidlist_open_latest(struct maildir_uidlist *uidlist)
 			"open(%s) failed: %m", uidlist->path);
 		return -1;
 	}
+	if (uidlist->fd != -1 &&
+	    maildir_uidlist_detect_format(uidlist, uidlist->fd) < 0) {
+		mailbox_set_critical(uidlist->box,
+			"pread(%s) failed: %m", uidlist->path);
+		maildir_uidlist_close(uidlist);
+		return -1;
+	}
 	return 0;
 }
 
@@ -1237,6 +1841,190 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
+static size_t maildir_uidlist_ext_size(const unsigned char *extensions)
+{
+	size_t len;
+
+	for (len = 0; extensions[len] != '\0'; len++) {
+		while (extensions[len] != '\0') len++;
+	}
+	return len + 1;
+}
+
+static size_t maildir_uidlist_base_filename_len(const char *filename)
+{
+	const char *p = strchr(filename, *MAILDIR_INFO_SEP_S);
+
+	return p == NULL ? strlen(filename) : (size_t)(p - filename);
+}
+
+static int
+maildir_uidlist_bin_hash_cmp(const struct maildir_uidlist_bin_hash *h1,
+			     const struct maildir_uidlist_bin_hash *h2)
+{
+	if (h1->hash != h2->hash)
+		return h1->hash < h2->hash ? -1 : 1;
+	return h1->record_idx < h2->record_idx ? -1 :
+		(h1->record_idx > h2->record_idx ? 1 : 0);
+}
+
+static void
+maildir_uidlist_write_bin_padding(struct ostream *output, size_t size)
+{
+	static const unsigned char zeros[3] = { 0, 0, 0 };
+
+	o_stream_nsend(output, zeros, UIDLIST_BIN_ALIGN(size) - size);
+}
+
+static void
+maildir_uidlist_write_bin_base(struct maildir_uidlist *uidlist,
+			       struct maildir_uidlist_iter_ctx *iter,
+			       struct ostream *output)
+{
+	struct maildir_uidlist_bin_header hdr;
+	ARRAY(struct maildir_uidlist_bin_record) bin_recs;
+	ARRAY(struct maildir_uidlist_bin_hash) bin_hashes;
+	struct maildir_uidlist_bin_record *bin_rec;
+	struct maildir_uidlist_bin_hash *bin_hash;
+	struct maildir_uidlist_rec *rec;
+	buffer_t *strings;
+	unsigned int count = array_count(&uidlist->records);
+	size_t len;
+
+	i_array_init(&bin_recs, count + 1);
+	i_array_init(&bin_hashes, count + 1);
+	strings = buffer_create_dynamic(default_pool, count * 64 + 2);
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
+		bin_hash = array_append_space(&bin_hashes);
+		bin_hash->hash = maildir_filename_base_hash(rec->filename);
+		bin_hash->record_idx = array_count(&bin_recs);
+
+		bin_rec = array_append_space(&bin_recs);
+		bin_rec->uid = cpu32_to_le(rec->uid);
+		bin_rec->filename_offset = cpu32_to_le(strings->used);
+		len = maildir_uidlist_base_filename_len(rec->filename);
+		buffer_append(strings, rec->filename, len);
+		buffer_append_c(strings, '\0');
+		if (rec->extensions != NULL) {
+			bin_rec->extensions_offset = cpu32_to_le(strings->used);
+			buffer_append(strings, rec->extensions,
+				      maildir_uidlist_ext_size(rec->extensions));
+		}
+	}
+	/* the strings end with \0\0 */
+	do {
+		buffer_append_c(strings, '\0');
+	} while (strings->used < 2);
+
+	array_sort(&bin_hashes, maildir_uidlist_bin_hash_cmp);
+	array_foreach_modifiable(&bin_hashes, bin_hash) {
+		bin_hash->hash = cpu32_to_le(bin_hash->hash);
+		bin_hash->record_idx = cpu32_to_le(bin_hash->record_idx);
+	}
+
+	i_zero(&hdr);
+	memcpy(hdr.magic, UIDLIST_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu32_to_le(UIDLIST_BIN_VERSION);
+	hdr.header_size = cpu32_to_le(sizeof(hdr));
+	hdr.uid_validity = cpu32_to_le(uidlist->uid_validity);
+	hdr.next_uid = cpu32_to_le(uidlist->next_uid);
+	memcpy(hdr.mailbox_guid, uidlist->mailbox_guid,
+	       sizeof(hdr.mailbox_guid));
+	hdr.records_count = cpu32_to_le(array_count(&bin_recs));
+	uidlist->bin_base_count = array_count(&bin_recs);
+	uidlist->bin_log_count = 0;
+	hdr.strings_size = cpu32_to_le(strings->used);
+	hdr.hdr_ext_size = cpu32_to_le(str_len(uidlist->hdr_extensions) + 1);
+	hdr.base_size = cpu32_to_le(sizeof(hdr) +
+		array_count(&bin_recs) * sizeof(*bin_rec) +
+		array_count(&bin_hashes) * sizeof(*bin_hash) +
+		UIDLIST_BIN_ALIGN(strings->used) +
+		UIDLIST_BIN_ALIGN(str_len(uidlist->hdr_extensions) + 1));
+
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	if (array_count(&bin_recs) > 0) {
+		o_stream_nsend(output, array_front(&bin_recs),
+			       array_count(&bin_recs) * sizeof(*bin_rec));
+		o_stream_nsend(output, array_front(&bin_hashes),
+			       array_count(&bin_hashes) * sizeof(*bin_hash));
+	}
+	o_stream_nsend(output, strings->data, strings->used);
+	maildir_uidlist_write_bin_padding(output, strings->used);
+	o_stream_nsend(output, str_data(uidlist->hdr_extensions),
+		       str_len(uidlist->hdr_extensions) + 1);
+	maildir_uidlist_write_bin_padding(output,
+		str_len(uidlist->hdr_extensions) + 1);
+
+	buffer_free(&strings);
+	array_free(&bin_hashes);
+	array_free(&bin_recs);
+}
+
+static void
+maildir_uidlist_write_bin_log(struct maildir_uidlist *uidlist,
+			      struct maildir_uidlist_iter_ctx *iter,
+			      struct ostream *output)
+{
+	struct maildir_uidlist_bin_log_record log_rec;
+	struct maildir_uidlist_rec *rec;
+	size_t len, ext_size;
+
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
+		uidlist->bin_log_count++;
+		len = maildir_uidlist_base_filename_len(rec->filename);
+		ext_size = rec->extensions == NULL ? 0 :
+			maildir_uidlist_ext_size(rec->extensions);
+
+		i_zero(&log_rec);
+		log_rec.uid = cpu32_to_le(rec->uid);
+		log_rec.filename_size = cpu32_to_le(len + 1);
+		log_rec.extensions_size = cpu32_to_le(ext_size);
+		o_stream_nsend(output, &log_rec, sizeof(log_rec));
+		o_stream_nsend(output, rec->filename, len);
+		o_stream_nsend(output, "", 1);
+		if (ext_size > 0)
+			o_stream_nsend(output, rec->extensions, ext_size);
+		maildir_uidlist_write_bin_padding(output, len + 1 + ext_size);
+	}
+}
+
+static void
+maildir_uidlist_write_text_records(struct maildir_uidlist *uidlist,
+				   struct maildir_uidlist_iter_ctx *iter,
+				   struct ostream *output)
+{
+	struct maildir_uidlist_rec *rec;
+	string_t *str = t_str_new(512);
+	const unsigned char *p;
+	const char *strp;
+	size_t len;
+
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
+		str_truncate(str, 0);
+		str_printfa(str, "%u", rec->uid);
+		if (rec->extensions != NULL) {
+			for (p = rec->extensions; *p != '\0'; ) {
+				i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+				len = strlen((const char *)p);
+				str_append_c(str, ' ');
+				str_append_data(str, p, len);
+				p += len + 1;
+			}
+		}
+		str_append(str, " :");
+		strp = strchr(rec->filename, *MAILDIR_INFO_SEP_S);
+		if (strp == NULL)
+			str_append(str, rec->filename);
+		else
+			str_append_data(str, rec->filename, strp - rec->filename);
+		str_append_c(str, '\n');
+		o_stream_nsend(output, str_data(str), str_len(str));
+	}
+}
+
 static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 				    const char *path, unsigned int first_idx,
 				    uoff_t *file_size_r)
@@ -1244,11 +2032,8 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 	struct mail_storage *storage = uidlist->box->storage;
 	struct maildir_uidlist_iter_ctx *iter;
 	struct ostream *output;
-	struct maildir_uidlist_rec *rec;
 	string_t *str;
-	const unsigned char *p;
-	const char *strp;
-	size_t len;
+	bool full;
 
 	i_assert(fd != -1);
 
@@ -1256,9 +2041,11 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 	o_stream_cork(output);
 	str = t_str_new(512);
 
-	if (output->offset == 0) {
+	full = output->offset == 0;
+	if (full) {
 		i_assert(first_idx == 0);
 		uidlist->version = UIDLIST_VERSION;
+		uidlist->binary = uidlist->want_binary;
 
 		if (uidlist->uid_validity == 0)
 			maildir_uidlist_generate_uid_validity(uidlist);
@@ -1266,6 +2053,8 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 			guid_128_generate(uidlist->mailbox_guid);
 
 		i_assert(uidlist->next_uid > 0);
+	}
+	if (full && !uidlist->binary) {
 		str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
 			    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
 			    uidlist->uid_validity,
@@ -1285,28 +2074,12 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 	i_assert(first_idx <= array_count(&uidlist->records));
 	iter->next += first_idx;
 
-	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
-		uidlist->read_records_count++;
-		str_truncate(str, 0);
-		str_printfa(str, "%u", rec->uid);
-		if (rec->extensions != NULL) {
-			for (p = rec->extensions; *p != '\0'; ) {
-				i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
-				len = strlen((const char *)p);
-				str_append_c(str, ' ');
-				str_append_data(str, p, len);
-				p += len + 1;
-			}
-		}
-		str_append(str, " :");
-		strp = strchr(rec->filename, *MAILDIR_INFO_SEP_S);
-		if (strp == NULL)
-			str_append(str, rec->filename);
-		else
-			str_append_data(str, rec->filename, strp - rec->filename);
-		str_append_c(str, '\n');
-		o_stream_nsend(output, str_data(str), str_len(str));
-	}
+	if (!uidlist->binary)
+		maildir_uidlist_write_text_records(uidlist, iter, output);
+	else if (full)
+		maildir_uidlist_write_bin_base(uidlist, iter, output);
+	else
+		maildir_uidlist_write_bin_log(uidlist, iter, output);
 	maildir_uidlist_iter_deinit(&iter);
 
 	if (o_stream_finish(output) < 0) {
@@ -1354,6 +2127,7 @@ maildir_uidlist_records_drop_expunges(struct maildir_uidlist *uidlist)
 		mail_index_view_close(&view);
 		return;
 	}
+	maildir_uidlist_files_materialize(uidlist);
 
 	i_array_init(&new_records, hdr->messages_count + 64);
 	recs = array_get(&uidlist->records, &count);
@@ -1503,6 +2277,14 @@ static bool maildir_uidlist_want_compress(struct maildir_uidlist_sync_ctx *ctx)
 	if (ctx->uidlist->recreate)
 		return TRUE;
 
+	if (ctx->uidlist->binary &&
+	    ctx->uidlist->bin_log_count >= UIDLIST_BIN_LOG_REWRITE_MIN_COUNT &&
+	    ctx->uidlist->bin_log_count >= ctx->uidlist->bin_base_count *
+	    UIDLIST_BIN_LOG_REWRITE_PERCENTAGE / 100) {
+		/* move the log records to the sorted part */
+		return TRUE;
+	}
+
 	min_rewrite_count =
 		(ctx->uidlist->read_records_count + ctx->new_files_count) *
 		UIDLIST_COMPRESS_PERCENTAGE / 100;
@@ -1519,7 +2301,8 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
 	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
-	    !uidlist->have_mailbox_guid)
+	    !uidlist->have_mailbox_guid ||
+	    uidlist->binary != uidlist->want_binary)
 		return TRUE;
 	return maildir_uidlist_want_compress(ctx);
 }
@@ -1677,7 +2460,7 @@ maildir_uidlist_sync_next_partial(struct maildir_uidlist_sync_ctx *ctx,
 	unsigned int count;
 
 	/* we'll update uidlist directly */
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (rec == NULL) {
 		/* doesn't exist in uidlist */
 		if (!ctx->locked) {
@@ -1735,21 +2518,9 @@ maildir_uidlist_sync_next_partial(struct maildir_uidlist_sync_ctx *ctx,
 
 static unsigned char *ext_dup(pool_t pool, const unsigned char *extensions)
 {
-	unsigned char *ret;
-
 	if (extensions == NULL)
 		return NULL;
-
-	T_BEGIN {
-		unsigned int len;
-
-		for (len = 0; extensions[len] != '\0'; len++) {
-			while (extensions[len] != '\0') len++;
-		}
-		ret = p_malloc(pool, len + 1);
-		memcpy(ret, extensions, len);
-	} T_END;
-	return ret;
+	return p_memdup(pool, extensions, maildir_uidlist_ext_size(extensions));
 }
 
 int maildir_uidlist_sync_next(struct maildir_uidlist_sync_ctx *ctx,
@@ -1804,7 +2575,7 @@ int maildir_uidlist_sync_next_uid(struct maildir_uidlist_sync_ctx *ctx,
 		if (strcmp(rec->filename, filename) != 0)
 			rec->filename = p_strdup(ctx->record_pool, filename);
 	} else {
-		old_rec = hash_table_lookup(uidlist->files, filename);
+		old_rec = maildir_uidlist_files_lookup(uidlist, filename);
 		i_assert(old_rec != NULL || UIDLIST_IS_LOCKED(uidlist));
 
 		rec = p_new(ctx->record_pool, struct maildir_uidlist_rec, 1);
@@ -1845,6 +2616,7 @@ void maildir_uidlist_sync_remove(struct maildir_uidlist_sync_ctx *ctx,
 	i_assert(ctx->partial);
 	i_assert(ctx->uidlist->locked_refresh);
 
+	maildir_uidlist_files_materialize(ctx->uidlist);
 	rec = hash_table_lookup(ctx->uidlist->files, filename);
 	i_assert(rec != NULL);
 	i_assert(rec->uid != (uint32_t)-1);
@@ -1865,6 +2637,22 @@ void maildir_uidlist_sync_remove(struct maildir_uidlist_sync_ctx *ctx,
 	ctx->uidlist->recreate = TRUE;
 }
 
+void maildir_uidlist_sync_remove_unseen(struct maildir_uidlist_sync_ctx *ctx,
+					const char *filename)
+{
+	struct maildir_uidlist_rec *rec;
+
+	i_assert(ctx->partial);
+
+	rec = maildir_uidlist_files_lookup(ctx->uidlist, filename);
+	if (rec == NULL || rec->uid == (uint32_t)-1 ||
+	    (rec->flags & MAILDIR_UIDLIST_REC_FLAG_NONSYNCED) == 0) {
+		/* unknown, not saved yet or seen under another name */
+		return;
+	}
+	maildir_uidlist_sync_remove(ctx, rec->filename);
+}
+
 void maildir_uidlist_sync_set_ext(struct maildir_uidlist_sync_ctx *ctx,
 				  struct maildir_uidlist_rec *rec,
 				  enum maildir_uidlist_rec_ext_key key,
@@ -1893,7 +2681,7 @@ bool maildir_uidlist_get_uid(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (rec == NULL)
 		return FALSE;
 
@@ -1906,7 +2694,7 @@ void maildir_uidlist_update_fname(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (rec == NULL)
 		return;
 
@@ -1921,7 +2709,7 @@ maildir_uidlist_get_full_filename(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	return rec == NULL ? NULL : rec->filename;
 }
 
@@ -1990,6 +2778,7 @@ static void maildir_uidlist_swap(struct maildir_uidlist_sync_ctx *ctx)
 	hash_table_destroy(&uidlist->files);
 	uidlist->files = ctx->files;
 	i_zero(&ctx->files);
+	array_free(&uidlist->base_files);
 
 	pool_unref(&uidlist->record_pool);
 	uidlist->record_pool = ctx->record_pool;
@@ -2073,7 +2862,7 @@ void maildir_uidlist_add_flags(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	i_assert(rec != NULL);
 
 	rec->flags |= flags;
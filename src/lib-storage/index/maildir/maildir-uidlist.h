@@ -125,6 +125,11 @@ int maildir_uidlist_sync_next_uid(struct maildir_uidlist_sync_ctx *ctx,
 				  struct maildir_uidlist_rec **rec_r);
 void maildir_uidlist_sync_remove(struct maildir_uidlist_sync_ctx *ctx,
 				 const char *filename);
+/* Partial syncing: Remove the file from uidlist, unless a file with the same
+   base name was already seen during this sync, e.g. because the file was
+   renamed. Files that don't have a UID yet are ignored. */
+void maildir_uidlist_sync_remove_unseen(struct maildir_uidlist_sync_ctx *ctx,
+					const char *filename);
 void maildir_uidlist_sync_set_ext(struct maildir_uidlist_sync_ctx *ctx,
 				  struct maildir_uidlist_rec *rec,
 				  enum maildir_uidlist_rec_ext_key key,
@@ -730,6 +730,11 @@ struct mail_save_data {
 	char *guid, *pop3_uidl, *from_envelope;
 	uint32_t pop3_order;
 
+	/* mailbox_save_set_precache_fields() was called */
+	bool precache;
+	enum mail_fetch_field precache_fields;
+	struct mailbox_header_lookup_ctx *precache_headers;
+
 	struct ostream *output;
 	struct mail_save_attachment *attach;
 };
@@ -1556,6 +1556,14 @@ void mail_storage_service_deinit(struct mail_storage_service_ctx **_ctx)
 	dict_drivers_unregister_builtin();
 }
 
+void mail_storage_service_forked(struct mail_storage_service_ctx *ctx)
+{
+	if (ctx->conn != NULL)
+		auth_master_forked(ctx->conn);
+	i_assert(ctx->auth_list == NULL);
+	dict_drivers_forked();
+}
+
 const struct mail_user_settings *
 mail_storage_service_user_get_set(struct mail_storage_service_user *user)
 {
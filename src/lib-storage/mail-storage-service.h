@@ -134,6 +134,11 @@ void mail_storage_service_all_init_mask(struct mail_storage_service_ctx *ctx,
 int mail_storage_service_all_next(struct mail_storage_service_ctx *ctx,
 				  const char **username_r);
 void mail_storage_service_deinit(struct mail_storage_service_ctx **ctx);
+/* Must be called by a child process that was fork()ed without exec() and
+   keeps delivering/accessing mails. The auth and dict connections inherited
+   from the parent process are closed, and new ones are created when
+   needed. */
+void mail_storage_service_forked(struct mail_storage_service_ctx *ctx);
 
 /* Activate user context. Normally this is called automatically by the ioloop,
    but e.g. during loops at deinit where all users are being destroyed, it's
@@ -35,6 +35,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(STR_VARS, mail_attachment_dir),
 	DEF(STR_HIDDEN, mail_attachment_hash),
 	DEF(SIZE, mail_attachment_min_size),
+	DEF(BOOL, mail_attachment_text_parts),
 	DEF(STR, mail_attachment_detection_options),
 	DEF(STR_VARS, mail_attribute_dict),
 	DEF(UINT, mail_prefetch_count),
@@ -97,6 +98,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_attachment_dir = "",
 	.mail_attachment_hash = "%{sha1}",
 	.mail_attachment_min_size = 1024*128,
+	.mail_attachment_text_parts = FALSE,
 	.mail_attachment_detection_options = "",
 	.mail_attribute_dict = "",
 	.mail_prefetch_count = 0,
@@ -2869,6 +2869,18 @@ void mailbox_save_set_pop3_order(struct mail_save_context *ctx,
 	ctx->data.pop3_order = order;
 }
 
+void mailbox_save_set_precache_fields(struct mail_save_context *ctx,
+				      enum mail_fetch_field fields,
+				      struct mailbox_header_lookup_ctx *headers)
+{
+	ctx->data.precache = TRUE;
+	ctx->data.precache_fields = fields;
+	if (headers != NULL)
+		mailbox_header_lookup_ref(headers);
+	mailbox_header_lookup_unref(&ctx->data.precache_headers);
+	ctx->data.precache_headers = headers;
+}
+
 struct mail *mailbox_save_get_dest_mail(struct mail_save_context *ctx)
 {
 	return ctx->dest_mail;
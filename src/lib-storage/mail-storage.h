@@ -864,6 +864,14 @@ void mailbox_save_set_pop3_uidl(struct mail_save_context *ctx,
    of the mailbox. Not all backends support this. */
 void mailbox_save_set_pop3_order(struct mail_save_context *ctx,
 				 unsigned int order);
+/* Generate the given fields and headers while the message is being saved and
+   add them to the cache file regardless of the mailbox's caching decisions.
+   This way the first access to the new mail doesn't need to parse it again.
+   If the mail is copied instead, all the source mail's cached fields are
+   copied the same way. */
+void mailbox_save_set_precache_fields(struct mail_save_context *ctx,
+				      enum mail_fetch_field fields,
+				      struct mailbox_header_lookup_ctx *headers);
 /* Returns the destination mail */
 struct mail *mailbox_save_get_dest_mail(struct mail_save_context *ctx);
 /* Begin saving the message. All mail_save_set_*() calls must have been called
@@ -1049,6 +1057,9 @@ int mail_precache(struct mail *mail);
 void mail_set_cache_corrupted(struct mail *mail,
 			      enum mail_fetch_field field,
 			      const char *reason);
+/* Returns the number of times a mail's stream has been opened in this
+   process. */
+uint64_t mail_get_opened_count(void);
 
 /* Return 128 bit GUID using input string. If guid is already 128 bit hex
    encoded, it's returned as-is. Otherwise SHA1 sum is taken and its last
@@ -704,6 +704,8 @@ bool mail_metadata_access_start(struct mail *mail)
 	return TRUE;
 }
 
+static uint64_t mail_opened_count = 0;
+
 void mail_opened_event(struct mail *mail)
 {
 	struct mail_private *pmail =
@@ -712,6 +714,8 @@ void mail_opened_event(struct mail *mail)
 		event_create_passthrough(mail_event(mail))->
 		set_name("mail_opened")->
 		add_str("reason", pmail->get_stream_reason);
+
+	mail_opened_count++;
 	if (pmail->get_stream_reason != NULL)
 		e_debug(e->event(), "Opened mail because: %s",
 			pmail->get_stream_reason);
@@ -719,6 +723,11 @@ void mail_opened_event(struct mail *mail)
 		e_debug(e->event(), "Opened mail");
 }
 
+uint64_t mail_get_opened_count(void)
+{
+	return mail_opened_count;
+}
+
 void mail_metadata_accessed_event(struct event *mail_event)
 {
 	struct event_passthrough *e =
@@ -0,0 +1,309 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "master-service.h"
+#include "test-mail-storage-common.h"
+#include "imapc-body-cache.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_REMOTE_MAILBOX "user@imap.example.com:143/INBOX"
+
+static struct test_mail_storage_ctx *test_init(void)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+
+	test_mail_storage_init_user(ctx, &set);
+	return ctx;
+}
+
+static void test_deinit(struct test_mail_storage_ctx **_ctx)
+{
+	struct test_mail_storage_ctx *ctx = *_ctx;
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(_ctx);
+}
+
+static const char *test_cache_dir(struct test_mail_storage_ctx *ctx)
+{
+	return t_strdup_printf("%s/body-cache", ctx->user->set->mail_home);
+}
+
+static struct imapc_body_cache *
+test_cache_init(struct test_mail_storage_ctx *ctx, uoff_t max_size)
+{
+	struct imapc_body_cache *cache;
+	const char *error;
+
+	if (imapc_body_cache_init(ctx->user->namespaces->list,
+				  ctx->user->event, "posix",
+				  test_cache_dir(ctx), max_size,
+				  &cache, &error) < 0)
+		i_fatal("imapc_body_cache_init() failed: %s", error);
+	return cache;
+}
+
+static void
+test_cache_store(struct imapc_body_cache *cache, const char *key,
+		 const char *data)
+{
+	struct istream *input;
+
+	input = i_stream_create_from_data(data, strlen(data));
+	imapc_body_cache_store(cache, key, input);
+	test_assert(input->v_offset == 0);
+	i_stream_unref(&input);
+}
+
+static bool
+test_cache_lookup(struct imapc_body_cache *cache, const char *key,
+		  const char *data)
+{
+	struct istream *input;
+	const unsigned char *body;
+	size_t size;
+
+	input = imapc_body_cache_lookup(cache, key);
+	if (input == NULL)
+		return FALSE;
+	(void)i_stream_read_bytes(input, &body, &size, strlen(data) + 1);
+	test_assert(input->stream_errno == 0);
+	test_assert(size == strlen(data) && memcmp(body, data, size) == 0);
+	i_stream_unref(&input);
+	return TRUE;
+}
+
+static uoff_t test_cache_dir_size(const char *dir)
+{
+	struct dirent *d;
+	struct stat st;
+	const char *path;
+	uoff_t size = 0;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		path = t_strdup_printf("%s/%s", dir, d->d_name);
+		if (stat(path, &st) < 0)
+			i_fatal("stat(%s) failed: %m", path);
+		size += st.st_size;
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", dir);
+	return size;
+}
+
+static void test_imapc_body_cache_key(void)
+{
+	const char *key1, *key2;
+
+	test_begin("imapc body cache key");
+	/* UIDVALIDITY isn't known yet */
+	test_assert(imapc_body_cache_get_key(TEST_REMOTE_MAILBOX, 0, 1) == NULL);
+
+	key1 = imapc_body_cache_get_key(TEST_REMOTE_MAILBOX, 5, 1);
+	test_assert(strlen(key1) == 40 + strlen(".5.1"));
+	test_assert_strcmp(key1 + 40, ".5.1");
+	test_assert_strcmp(key1,
+		imapc_body_cache_get_key(TEST_REMOTE_MAILBOX, 5, 1));
+
+	/* the same UID in a recreated mailbox is a different mail */
+	key2 = imapc_body_cache_get_key(TEST_REMOTE_MAILBOX, 6, 1);
+	test_assert(strcmp(key1, key2) != 0);
+	/* as is the same UID in another mailbox */
+	key2 = imapc_body_cache_get_key("user@imap.example.com:143/Sent", 5, 1);
+	test_assert(strcmp(key1, key2) != 0);
+	test_assert_strcmp(key2 + 40, ".5.1");
+	test_end();
+}
+
+static void test_imapc_body_cache_lookup_store(void)
+{
+	struct test_mail_storage_ctx *ctx = test_init();
+	struct imapc_body_cache *cache;
+	struct imapc_body_cache_stats stats;
+	const char *key1, *key2, *body = "Subject: test\n\nbody\n";
+
+	test_begin("imapc body cache lookup and store");
+	cache = test_cache_init(ctx, 0);
+	key1 = imapc_body_cache_get_key(TEST_REMOTE_MAILBOX, 5, 1);
+
+	test_assert(!test_cache_lookup(cache, key1, body));
+	test_cache_store(cache, key1, body);
+	test_assert(test_cache_lookup(cache, key1, body));
+
+	/* UIDVALIDITY changed */
+	key2 = imapc_body_cache_get_key(TEST_REMOTE_MAILBOX, 6, 1);
+	test_assert(!test_cache_lookup(cache, key2, body));
+
+	/* empty bodies aren't stored */
+	test_cache_store(cache, key2, "");
+	test_assert(!test_cache_lookup(cache, key2, ""));
+
+	imapc_body_cache_get_stats(cache, &stats);
+	test_assert(stats.lookups == 4);
+	test_assert(stats.hits == 1);
+	test_assert(stats.hit_bytes == strlen(body));
+	test_assert(stats.stores == 1);
+	test_assert(stats.stored_bytes == strlen(body));
+	test_assert(stats.evictions == 0);
+	imapc_body_cache_deinit(&cache);
+
+	/* the body is found by a new process */
+	cache = test_cache_init(ctx, 0);
+	test_assert(test_cache_lookup(cache, key1, body));
+	imapc_body_cache_deinit(&cache);
+	test_end();
+	test_deinit(&ctx);
+}
+
+static void test_imapc_body_cache_lru(void)
+{
+	struct test_mail_storage_ctx *ctx = test_init();
+	struct imapc_body_cache *cache;
+	struct imapc_body_cache_stats stats;
+	const char *body = "Subject: lru\n\n1234567890123456789012345\n";
+
+	test_begin("imapc body cache LRU eviction");
+	test_assert(strlen(body) == 40);
+	cache = test_cache_init(ctx, 100);
+	test_cache_store(cache, "a", body);
+	test_cache_store(cache, "b", body);
+	/* a is now used more recently than b */
+	test_assert(test_cache_lookup(cache, "a", body));
+	test_cache_store(cache, "c", body);
+
+	test_assert(test_cache_lookup(cache, "a", body));
+	test_assert(!test_cache_lookup(cache, "b", body));
+	test_assert(test_cache_lookup(cache, "c", body));
+	test_assert(test_cache_dir_size(test_cache_dir(ctx)) == 80);
+
+	/* larger than the whole cache */
+	test_cache_store(cache, "big", t_strdup_printf("%s%s%s", body, body, body));
+	test_assert(!test_cache_lookup(cache, "big", body));
+
+	imapc_body_cache_get_stats(cache, &stats);
+	test_assert(stats.stores == 3);
+	test_assert(stats.evictions == 1);
+	test_assert(stats.evicted_bytes == 40);
+	imapc_body_cache_deinit(&cache);
+	test_end();
+	test_deinit(&ctx);
+}
+
+static void test_imapc_body_cache_processes(void)
+{
+	struct test_mail_storage_ctx *ctx = test_init();
+	struct imapc_body_cache *cache1, *cache2;
+	const char *dir = test_cache_dir(ctx);
+	const char *body = "Subject: lru\n\n1234567890123456789012345\n";
+	unsigned int i;
+
+	test_begin("imapc body cache shared by processes");
+	/* two caches using the same directory, like two processes */
+	cache1 = test_cache_init(ctx, 100);
+	cache2 = test_cache_init(ctx, 100);
+	for (i = 0; i < 10; i++) {
+		test_cache_store(i % 2 == 0 ? cache1 : cache2,
+				 t_strdup_printf("%u", i), body);
+		/* each cache sees the other's files when rescanning, so
+		   together they stay within the limit */
+		test_assert_idx(test_cache_dir_size(dir) <= 100, i);
+	}
+	/* the latest body is kept and visible to both */
+	test_assert(test_cache_lookup(cache1, "9", body));
+	test_assert(test_cache_lookup(cache2, "9", body));
+	imapc_body_cache_deinit(&cache1);
+	imapc_body_cache_deinit(&cache2);
+	test_end();
+	test_deinit(&ctx);
+}
+
+static void test_imapc_body_cache_incremental_scan(void)
+{
+	struct test_mail_storage_ctx *ctx = test_init();
+	struct imapc_body_cache *cache;
+	struct utimbuf ut = {
+		.actime = ioloop_time - 1000,
+		.modtime = ioloop_time - 1000,
+	};
+	const char *dir = test_cache_dir(ctx), *path;
+	unsigned int i;
+	int fd;
+
+	test_begin("imapc body cache incremental scan");
+	/* files left by earlier processes */
+	if (mkdir(dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	for (i = 0; i < 600; i++) {
+		path = t_strdup_printf("%s/old.%u", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd == -1)
+			i_fatal("open(%s) failed: %m", path);
+		if (write_full(fd, "123456789\n", 10) < 0)
+			i_fatal("write(%s) failed: %m", path);
+		i_close_fd(&fd);
+		if (utime(path, &ut) < 0)
+			i_fatal("utime(%s) failed: %m", path);
+	}
+	test_assert(test_cache_dir_size(dir) == 6000);
+
+	cache = test_cache_init(ctx, 4000);
+	/* only a part of the directory is scanned by the first store */
+	test_cache_store(cache, "new1", "new body\n");
+	test_assert(test_cache_dir_size(dir) > 4000);
+	/* the rest are scanned by the following stores */
+	test_cache_store(cache, "new2", "new body\n");
+	test_cache_store(cache, "new3", "new body\n");
+	test_assert(test_cache_dir_size(dir) <= 4000);
+	/* the old files were evicted first */
+	test_assert(test_cache_lookup(cache, "new1", "new body\n"));
+	test_assert(test_cache_lookup(cache, "new2", "new body\n"));
+	test_assert(test_cache_lookup(cache, "new3", "new body\n"));
+	imapc_body_cache_deinit(&cache);
+	test_end();
+	test_deinit(&ctx);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_imapc_body_cache_key,
+		test_imapc_body_cache_lookup_store,
+		test_imapc_body_cache_lru,
+		test_imapc_body_cache_processes,
+		test_imapc_body_cache_incremental_scan,
+		NULL
+	};
+
+	master_service = master_service_init("test-imapc-body-cache",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+
+	return ret;
+}
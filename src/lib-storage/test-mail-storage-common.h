@@ -17,6 +17,8 @@ struct test_mail_storage_settings {
 	const char *driver_opts;
 	const char *hierarchy_sep;
 	const char *const *extra_input;
+	/* Use the existing home directory instead of recreating it */
+	bool keep_home;
 };
 
 struct test_mail_storage_ctx *test_mail_storage_init(void);
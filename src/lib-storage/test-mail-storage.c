@@ -2,9 +2,27 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "str.h"
+#include "hostpid.h"
+#include "istream.h"
+#include "write-full.h"
+#include "mkdir-parents.h"
 #include "test-common.h"
 #include "master-service.h"
+#include "mail-search-build.h"
 #include "test-mail-storage-common.h"
+#include "sdbox-storage.h"
+#include "sdbox-file.h"
+#include "maildir-sync-journal.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_MDBOX_WRITERS 3
+#define TEST_MDBOX_WRITER_MAILS 20
 
 static const struct test_globals {
 	const char *str;
@@ -609,6 +627,1016 @@ static void test_mailbox_list_maildir(void)
 	test_mail_storage_deinit(&ctx);
 }
 
+static void test_maildir_write_file(const char *path)
+{
+	const char *data = "Subject: test\n\nbody\n";
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, data, strlen(data)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void
+test_maildir_sync_check(struct mailbox *box, const uint32_t *uids,
+			const enum mail_flags *flags, unsigned int count)
+{
+	struct mailbox_transaction_context *trans;
+	struct mailbox_status status;
+	struct mail *mail;
+	uint32_t seq;
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	test_assert(status.messages == count);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (seq = 1; seq <= I_MIN(count, status.messages); seq++) {
+		mail_set_seq(mail, seq);
+		test_assert_idx(mail->uid == uids[seq-1], seq);
+		test_assert_idx((mail_get_flags(mail) & ~MAIL_RECENT) ==
+				flags[seq-1], seq);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_maildir_sync_changes_user(struct test_mail_storage_ctx *ctx,
+					   const char *const *extra_input)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.extra_input = extra_input,
+	};
+	static const uint32_t uids1[] = { 1, 2, 3 };
+	static const enum mail_flags flags1[] = { 0, MAIL_SEEN, 0 };
+	static const uint32_t uids2[] = { 2, 3, 4 };
+	static const enum mail_flags flags2[] = {
+		MAIL_ANSWERED | MAIL_SEEN, 0, 0
+	};
+	static const uint32_t uids3[] = { 2, 4, 5 };
+	static const enum mail_flags flags3[] = {
+		MAIL_ANSWERED | MAIL_SEEN, 0, MAIL_FLAGGED
+	};
+	static const uint32_t uids4[] = { 2, 4 };
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	const char *path, *cur;
+
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+					&path) > 0);
+	cur = t_strconcat(path, "/cur", NULL);
+
+	test_maildir_write_file(t_strconcat(cur, "/1.m1.host:2,", NULL));
+	test_maildir_write_file(t_strconcat(cur, "/2.m2.host:2,S", NULL));
+	test_maildir_write_file(t_strconcat(cur, "/3.m3.host:2,", NULL));
+	test_maildir_sync_check(box, uids1, flags1, N_ELEMENTS(uids1));
+
+	/* expunge, flag change and a new mail */
+	i_unlink(t_strconcat(cur, "/1.m1.host:2,", NULL));
+	if (rename(t_strconcat(cur, "/2.m2.host:2,S", NULL),
+		   t_strconcat(cur, "/2.m2.host:2,RS", NULL)) < 0)
+		i_fatal("rename() failed: %m");
+	test_maildir_write_file(t_strconcat(cur, "/4.m4.host:2,", NULL));
+	test_maildir_sync_check(box, uids2, flags2, N_ELEMENTS(uids2));
+
+	/* a file created and removed between syncs is never seen */
+	test_maildir_write_file(t_strconcat(cur, "/5.m5.host:2,", NULL));
+	i_unlink(t_strconcat(cur, "/5.m5.host:2,", NULL));
+	i_unlink(t_strconcat(cur, "/3.m3.host:2,", NULL));
+	test_maildir_write_file(t_strconcat(cur, "/6.m6.host:2,F", NULL));
+	test_maildir_sync_check(box, uids3, flags3, N_ELEMENTS(uids3));
+
+	/* expunge the last mail */
+	i_unlink(t_strconcat(cur, "/6.m6.host:2,F", NULL));
+	test_maildir_sync_check(box, uids4, flags3, N_ELEMENTS(uids4));
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+}
+
+static void test_maildir_sync_changes(void)
+{
+	const char *const journal_input[] = {
+		"maildir_sync_journal=yes",
+		NULL
+	};
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+
+	test_begin("maildir sync changes");
+	test_maildir_sync_changes_user(ctx, NULL);
+	test_end();
+
+	test_begin("maildir sync changes (journal)");
+	test_maildir_sync_changes_user(ctx, journal_input);
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
+#ifdef HAVE_INOTIFY_INIT
+static unsigned int test_count_inotify_fds(void)
+{
+	struct dirent *d;
+	const char *path;
+	char target[64];
+	unsigned int count = 0;
+	ssize_t ret;
+	DIR *dirp;
+
+	dirp = opendir("/proc/self/fd");
+	if (dirp == NULL)
+		i_fatal("opendir(/proc/self/fd) failed: %m");
+	while ((d = readdir(dirp)) != NULL) {
+		path = t_strconcat("/proc/self/fd/", d->d_name, NULL);
+		ret = readlink(path, target, sizeof(target)-1);
+		if (ret < 0)
+			continue;
+		target[ret] = '\0';
+		if (strcmp(target, "anon_inode:inotify") == 0)
+			count++;
+	}
+	(void)closedir(dirp);
+	return count;
+}
+
+static const char *
+test_maildir_sync_journal_changes(struct maildir_sync_journal *journal)
+{
+	struct maildir_sync_journal_iter *iter;
+	ARRAY_TYPE(const_string) names;
+	const char *fname;
+	bool exists;
+
+	t_array_init(&names, 8);
+	iter = maildir_sync_journal_iter_init(journal);
+	while ((fname = maildir_sync_journal_iter_next(iter, &exists)) != NULL) {
+		fname = t_strconcat(exists ? "+" : "-", fname, NULL);
+		array_push_back(&names, &fname);
+	}
+	maildir_sync_journal_iter_deinit(&iter);
+	array_sort(&names, i_strcmp_p);
+	array_append_zero(&names);
+	return t_strarray_join(array_front(&names), " ");
+}
+
+static void test_maildir_sync_journal(void)
+{
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+	struct maildir_sync_journal *journal1, *journal2, *journal3;
+	struct event *event = event_create(NULL);
+	const char *dir1, *dir2;
+
+	test_begin("maildir sync journal");
+	dir1 = t_strconcat(ctx->home_root, "journal1", NULL);
+	dir2 = t_strconcat(ctx->home_root, "journal2", NULL);
+	if (mkdir_parents(dir1, 0700) < 0 || mkdir(dir2, 0700) < 0)
+		i_fatal("mkdir() failed: %m");
+	test_maildir_write_file(t_strconcat(dir1, "/a", NULL));
+	test_maildir_write_file(t_strconcat(dir1, "/b", NULL));
+
+	/* all the journals share one inotify instance, even when watching
+	   the same directory */
+	journal1 = maildir_sync_journal_init(dir1, event);
+	journal2 = maildir_sync_journal_init(dir1, event);
+	journal3 = maildir_sync_journal_init(dir2, event);
+	test_assert(journal1 != NULL && journal2 != NULL && journal3 != NULL);
+	test_assert(test_count_inotify_fds() == 1);
+
+	/* not valid until scanned */
+	test_assert(!maildir_sync_journal_refresh(journal1));
+	maildir_sync_journal_scan_begin(journal1);
+	maildir_sync_journal_scan_end(journal1, TRUE);
+	maildir_sync_journal_scan_begin(journal2);
+	maildir_sync_journal_scan_end(journal2, TRUE);
+	maildir_sync_journal_scan_begin(journal3);
+	maildir_sync_journal_scan_end(journal3, FALSE);
+
+	/* only the changed names are in the journal */
+	test_maildir_write_file(t_strconcat(dir1, "/c", NULL));
+	test_maildir_write_file(t_strconcat(dir1, "/d", NULL));
+	i_unlink(t_strconcat(dir1, "/d", NULL));
+	i_unlink(t_strconcat(dir1, "/b", NULL));
+	if (rename(t_strconcat(dir1, "/a", NULL),
+		   t_strconcat(dir1, "/a2", NULL)) < 0)
+		i_fatal("rename() failed: %m");
+	test_assert(maildir_sync_journal_refresh(journal1));
+	test_assert_strcmp(test_maildir_sync_journal_changes(journal1),
+			   "+a2 +c -a -b -d");
+	test_assert(maildir_sync_journal_count(journal1) == 5);
+	maildir_sync_journal_clear_changes(journal1);
+	test_assert(maildir_sync_journal_refresh(journal1));
+	test_assert(maildir_sync_journal_count(journal1) == 0);
+	/* the failed scan didn't make the journal valid */
+	test_assert(!maildir_sync_journal_refresh(journal3));
+
+	/* the other journal for the same directory keeps working */
+	maildir_sync_journal_deinit(&journal1);
+	i_unlink(t_strconcat(dir1, "/c", NULL));
+	test_assert(maildir_sync_journal_refresh(journal2));
+	test_assert_strcmp(test_maildir_sync_journal_changes(journal2),
+			   "+a2 -a -b -c -d");
+
+	maildir_sync_journal_deinit(&journal2);
+	maildir_sync_journal_deinit(&journal3);
+	test_assert(test_count_inotify_fds() == 0);
+	event_unref(&event);
+	test_end();
+	test_mail_storage_deinit(&ctx);
+}
+#endif
+
+static void
+test_maildir_uidlist_user(struct test_mail_storage_ctx *ctx,
+			  const char *format, const char *const *files,
+			  const uint32_t *uids, unsigned int count)
+{
+	const char *const extra_input[] = {
+		t_strdup_printf("maildir_uidlist_format=%s", format),
+		NULL
+	};
+	/* the home directory is recreated for each user, so keep the
+	   maildir outside it */
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.driver_opts = "../uidlist-maildir",
+		.extra_input = extra_input,
+	};
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mailbox_status status;
+	struct mail *mail;
+	struct istream *input;
+	const char *path;
+	uint32_t seq;
+
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+					&path) > 0);
+	for (; *files != NULL; files++) {
+		if ((*files)[0] == '-')
+			i_unlink(t_strconcat(path, "/cur/", *files + 1, NULL));
+		else {
+			test_maildir_write_file(t_strconcat(path, "/cur/",
+							    *files, NULL));
+		}
+	}
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	test_assert(status.messages == count);
+
+	/* reading the mails looks up their filenames from the uidlist */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (seq = 1; seq <= I_MIN(count, status.messages); seq++) {
+		mail_set_seq(mail, seq);
+		test_assert_idx(mail->uid == uids[seq-1], seq);
+		test_assert_idx(mail_get_stream(mail, NULL, NULL, &input) == 0,
+				seq);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+}
+
+static bool test_maildir_uidlist_is_binary(struct test_mail_storage_ctx *ctx)
+{
+	const char *path = t_strconcat(ctx->home_root,
+				       "uidlist-maildir/dovecot-uidlist", NULL);
+	char data[2];
+	int fd;
+	bool ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	ret = read(fd, data, sizeof(data)) == sizeof(data) &&
+		data[0] != '3';
+	i_close_fd(&fd);
+	return ret;
+}
+
+static void test_maildir_uidlist_formats(void)
+{
+	const char *const files1[] = {
+		"1.m1.host:2,", "2.m2.host:2,S", "3.m3.host:2,", NULL
+	};
+	const char *const files2[] = {
+		"-2.m2.host:2,S", "4.m4.host:2,", "5.m5.host:2,", NULL
+	};
+	const char *const files3[] = { "6.m6.host:2,", NULL };
+	const char *const files4[] = { "-1.m1.host:2,", "7.m7.host:2,", NULL };
+	const char *const files_none[] = { NULL };
+	static const uint32_t uids1[] = { 1, 2, 3 };
+	static const uint32_t uids2[] = { 1, 3, 4, 5 };
+	static const uint32_t uids3[] = { 1, 3, 4, 5, 6 };
+	static const uint32_t uids4[] = { 3, 4, 5, 6, 7 };
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+
+	test_begin("maildir uidlist formats");
+	test_maildir_uidlist_user(ctx, "binary", files1,
+				  uids1, N_ELEMENTS(uids1));
+	test_assert(test_maildir_uidlist_is_binary(ctx));
+	/* new mails are appended to the binary file */
+	test_maildir_uidlist_user(ctx, "binary", files2,
+				  uids2, N_ELEMENTS(uids2));
+	test_assert(test_maildir_uidlist_is_binary(ctx));
+	test_maildir_uidlist_user(ctx, "binary", files_none,
+				  uids2, N_ELEMENTS(uids2));
+
+	/* convert to text and back */
+	test_maildir_uidlist_user(ctx, "text", files3,
+				  uids3, N_ELEMENTS(uids3));
+	test_assert(!test_maildir_uidlist_is_binary(ctx));
+	test_maildir_uidlist_user(ctx, "binary", files4,
+				  uids4, N_ELEMENTS(uids4));
+	test_assert(test_maildir_uidlist_is_binary(ctx));
+	test_maildir_uidlist_user(ctx, "text", files_none,
+				  uids4, N_ELEMENTS(uids4));
+	test_assert(!test_maildir_uidlist_is_binary(ctx));
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
+static int test_mail_save(struct mailbox *box, const char *data)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	int ret;
+
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	input = i_stream_create_from_data(data, strlen(data));
+	ret = mailbox_save_begin(&save_ctx, input);
+	while (ret == 0 && i_stream_read(input) > 0) {
+		if (mailbox_save_continue(save_ctx) < 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		ret = mailbox_save_finish(&save_ctx);
+	else
+		mailbox_save_cancel(&save_ctx);
+	i_stream_unref(&input);
+	if (ret < 0) {
+		mailbox_transaction_rollback(&trans);
+		return -1;
+	}
+	return mailbox_transaction_commit(&trans);
+}
+
+static const char *test_mdbox_mail(unsigned int writer, unsigned int idx)
+{
+	return t_strdup_printf("Subject: writer %u mail %u\n\nbody\n",
+			       writer, idx);
+}
+
+static int
+test_mdbox_writer(struct test_mail_storage_ctx *ctx, unsigned int writer)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.keep_home = TRUE,
+	};
+	struct mail_namespace *ns;
+	struct mailbox *inbox, *box;
+	unsigned int i;
+	int ret = 0;
+
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	inbox = mailbox_alloc(ns->list, "INBOX", MAILBOX_FLAG_SAVEONLY);
+	box = mailbox_alloc(ns->list, t_strdup_printf("box%u", writer),
+			    MAILBOX_FLAG_SAVEONLY);
+	if (mailbox_open(inbox) < 0 || mailbox_open(box) < 0)
+		ret = -1;
+	/* every other mail goes to the shared INBOX, the rest to this
+	   writer's own mailbox */
+	for (i = 0; i < TEST_MDBOX_WRITER_MAILS && ret == 0; i++) T_BEGIN {
+		ret = test_mail_save(i % 2 == 0 ? inbox : box,
+				      test_mdbox_mail(writer, i));
+	} T_END;
+	if (ret < 0) {
+		i_error("Saving failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	mailbox_free(&inbox);
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	return ret;
+}
+
+static void
+test_mdbox_check_mails(struct mailbox *box, unsigned int count,
+		       bool *seen, unsigned int seen_count)
+{
+	struct mailbox_transaction_context *trans;
+	struct mailbox_status status;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	unsigned int writer, idx;
+	uint32_t seq;
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	test_assert(status.messages == count);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (seq = 1; seq <= status.messages; seq++) {
+		mail_set_seq(mail, seq);
+		if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+			test_assert_idx(FALSE, seq);
+			continue;
+		}
+		(void)i_stream_read_bytes(input, &data, &size, 1024);
+		if (sscanf(t_strndup(data, size),
+			   "Subject: writer %u mail %u", &writer, &idx) != 2 ||
+		    writer * TEST_MDBOX_WRITER_MAILS + idx >= seen_count) {
+			test_assert_idx(FALSE, seq);
+			continue;
+		}
+		test_assert_idx(!seen[writer * TEST_MDBOX_WRITER_MAILS + idx],
+				seq);
+		seen[writer * TEST_MDBOX_WRITER_MAILS + idx] = TRUE;
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_mdbox_concurrent_saves(void)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+	};
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+	bool seen[TEST_MDBOX_WRITERS * TEST_MDBOX_WRITER_MAILS];
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	pid_t pids[TEST_MDBOX_WRITERS];
+	unsigned int i;
+	int status;
+
+	test_begin("mdbox concurrent saves");
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	/* create INBOX here as well, so the writers don't race to
+	   autocreate it */
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	mailbox_free(&box);
+	for (i = 0; i < TEST_MDBOX_WRITERS; i++) {
+		box = mailbox_alloc(ns->list, t_strdup_printf("box%u", i), 0);
+		test_assert(mailbox_create(box, NULL, FALSE) == 0);
+		mailbox_free(&box);
+	}
+	test_mail_storage_deinit_user(ctx);
+
+	for (i = 0; i < TEST_MDBOX_WRITERS; i++) {
+		if ((pids[i] = fork()) == (pid_t)-1)
+			i_fatal("fork() failed: %m");
+		if (pids[i] == 0) {
+			/* temp file names contain the PID */
+			hostpid_init();
+			_exit(test_mdbox_writer(ctx, i) < 0 ? 1 : 0);
+		}
+	}
+	for (i = 0; i < TEST_MDBOX_WRITERS; i++) {
+		if (waitpid(pids[i], &status, 0) < 0)
+			i_fatal("waitpid() failed: %m");
+		test_assert_idx(WIFEXITED(status) &&
+				WEXITSTATUS(status) == 0, i);
+	}
+
+	/* every mail was saved exactly once to the right mailbox */
+	memset(seen, 0, sizeof(seen));
+	set.keep_home = TRUE;
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_mdbox_check_mails(box, TEST_MDBOX_WRITERS *
+			       TEST_MDBOX_WRITER_MAILS / 2,
+			       seen, N_ELEMENTS(seen));
+	mailbox_free(&box);
+	for (i = 0; i < TEST_MDBOX_WRITERS; i++) {
+		box = mailbox_alloc(ns->list, t_strdup_printf("box%u", i), 0);
+		test_mdbox_check_mails(box, TEST_MDBOX_WRITER_MAILS / 2,
+				       seen, N_ELEMENTS(seen));
+		mailbox_free(&box);
+	}
+	for (i = 0; i < N_ELEMENTS(seen); i++)
+		test_assert_idx(seen[i], i);
+	test_mail_storage_deinit_user(ctx);
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
+static bool test_mdbox_file_exists(struct mail_user *user, uint32_t file_id)
+{
+	struct stat st;
+	const char *path = t_strdup_printf("%s/mdbox/storage/m.%u",
+					   user->set->mail_home, file_id);
+
+	if (stat(path, &st) == 0)
+		return TRUE;
+	if (errno != ENOENT)
+		i_fatal("stat(%s) failed: %m", path);
+	return FALSE;
+}
+
+static void test_mdbox_purge_limits(void)
+{
+	const char *const extra_input[] = {
+		/* each mail is saved to its own file */
+		"mdbox_rotate_size=1",
+		"mdbox_purge_max_files=1",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.driver_opts = "mdbox",
+		.extra_input = extra_input,
+	};
+	/* m.2 has the largest mail and m.1 the smallest */
+	static const unsigned int body_sizes[] = { 10, 1000, 100, 500 };
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	string_t *body = t_str_new(1024);
+	unsigned int i, j;
+
+	test_begin("mdbox purge limits");
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	for (i = 0; i < N_ELEMENTS(body_sizes); i++) {
+		str_truncate(body, 0);
+		str_append(body, "Subject: purge\n\n");
+		for (j = 0; j < body_sizes[i]; j++)
+			str_append_c(body, 'x');
+		test_assert_idx(test_mail_save(box, str_c(body)) == 0, i);
+		test_assert_idx(test_mdbox_file_exists(ctx->user, i + 1), i);
+	}
+
+	/* expunge all but the last mail */
+	test_assert(mailbox_sync(box, 0) == 0);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (i = 1; i < N_ELEMENTS(body_sizes); i++) {
+		mail_set_seq(mail, i);
+		mail_expunge(mail);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+
+	/* one file is purged at a time, the largest first */
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(!test_mdbox_file_exists(ctx->user, 2));
+	test_assert(test_mdbox_file_exists(ctx->user, 1));
+	test_assert(test_mdbox_file_exists(ctx->user, 3));
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(!test_mdbox_file_exists(ctx->user, 3));
+	test_assert(test_mdbox_file_exists(ctx->user, 1));
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(!test_mdbox_file_exists(ctx->user, 1));
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(test_mdbox_file_exists(ctx->user, 4));
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
+static void
+test_count_attachments_dir(const char *dir, nlink_t nlink,
+			   unsigned int *count)
+{
+	struct dirent *d;
+	struct stat st;
+	const char *path;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		if (errno != ENOENT)
+			i_fatal("opendir(%s) failed: %m", dir);
+		return;
+	}
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		path = t_strdup_printf("%s/%s", dir, d->d_name);
+		if (stat(path, &st) < 0)
+			i_fatal("stat(%s) failed: %m", path);
+		if (S_ISDIR(st.st_mode))
+			test_count_attachments_dir(path, nlink, count);
+		else if (nlink == 0 || st.st_nlink == nlink)
+			(*count)++;
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", dir);
+}
+
+/* Returns the number of attachment files having the given link count,
+   or all of them if nlink is 0. */
+static unsigned int
+test_count_attachments(struct mail_user *user, nlink_t nlink)
+{
+	unsigned int count = 0;
+
+	test_count_attachments_dir(
+		t_strdup_printf("%s/attachments", user->set->mail_home),
+		nlink, &count);
+	return count;
+}
+
+static void test_mail_expunge_all(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_ctx = mailbox_search_init(trans, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(search_ctx, &mail))
+		mail_expunge(mail);
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+static void test_mdbox_check_body(struct mailbox *box, const char *data)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *body;
+	size_t size;
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+		test_assert(FALSE);
+	else {
+		(void)i_stream_read_bytes(input, &body, &size,
+					  strlen(data) + 1);
+		test_assert(input->stream_errno == 0);
+		test_assert(size == strlen(data) &&
+			    memcmp(body, data, size) == 0);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_mdbox_copy_attachment_links(void)
+{
+	const char *const extra_input[] = {
+		"mail_attachment_dir=~/attachments",
+		"mail_attachment_min_size=16",
+		"mail_attachment_text_parts=yes",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.driver_opts = "mdbox",
+		.extra_input = extra_input,
+	};
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+	struct mail_namespace *ns;
+	struct mailbox *inbox, *box;
+	struct mailbox_transaction_context *src_trans, *dest_trans;
+	struct mail_save_context *save_ctx;
+	struct mail *mail;
+	string_t *data = t_str_new(256);
+	unsigned int i;
+
+	test_begin("mdbox copy links attachments");
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	inbox = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(inbox) == 0);
+	box = mailbox_alloc(ns->list, "copy", 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	/* copy by saving the mail, like when copying between users */
+	box->disable_reflink_copy_to = TRUE;
+
+	str_append(data, "Subject: copy\n\n");
+	for (i = 0; i < 10; i++)
+		str_append(data, "body line that is stored externally\n");
+	test_assert(test_mail_save(inbox, str_c(data)) == 0);
+	test_assert(test_count_attachments(ctx->user, 0) == 1);
+
+	test_assert(mailbox_sync(inbox, 0) == 0);
+	src_trans = mailbox_transaction_begin(inbox, 0, __func__);
+	mail = mail_alloc(src_trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	dest_trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(dest_trans);
+	test_assert(mailbox_copy(&save_ctx, mail) == 0);
+	test_assert(mailbox_transaction_commit(&dest_trans) == 0);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&src_trans) == 0);
+
+	/* the copy is a new link to the same attachment file */
+	test_assert(test_count_attachments(ctx->user, 0) == 2);
+	test_assert(test_count_attachments(ctx->user, 2) == 2);
+	test_mdbox_check_body(box, str_c(data));
+
+	/* purging the original mail removes only its own link */
+	test_mail_expunge_all(inbox);
+	test_assert(mail_storage_purge(inbox->storage) == 0);
+	test_assert(test_count_attachments(ctx->user, 0) == 1);
+	test_assert(test_count_attachments(ctx->user, 1) == 1);
+	test_mdbox_check_body(box, str_c(data));
+
+	test_mail_expunge_all(box);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(test_count_attachments(ctx->user, 0) == 0);
+
+	mailbox_free(&box);
+	mailbox_free(&inbox);
+	test_mail_storage_deinit_user(ctx);
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
+static void test_mail_check_stream(struct mail *mail, const char *data)
+{
+	struct istream *input;
+	const unsigned char *body;
+	size_t size;
+
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+		test_assert(FALSE);
+		return;
+	}
+	(void)i_stream_read_bytes(input, &body, &size, strlen(data) + 1);
+	test_assert(input->stream_errno == 0);
+	test_assert(size == strlen(data) && memcmp(body, data, size) == 0);
+}
+
+static void test_sdbox_attachment_path_suffix(struct mailbox *box)
+{
+	struct sdbox_mailbox *mbox = SDBOX_MAILBOX(box);
+	struct dbox_storage *storage = DBOX_STORAGE(box->storage);
+	struct dbox_file *file;
+
+	/* a mail being saved has no suffix, unless it's a copy */
+	file = sdbox_file_init(mbox, 0);
+	test_assert_strcmp(storage->v.get_attachment_path_suffix(file), "");
+	((struct sdbox_file *)file)->attachment_tmp_suffix = "-tmp";
+	test_assert_strcmp(storage->v.get_attachment_path_suffix(file), "-tmp");
+	dbox_file_unref(&file);
+
+	file = sdbox_file_init(mbox, 1);
+	test_assert_strcmp(storage->v.get_attachment_path_suffix(file),
+		t_strdup_printf("-%s-1", guid_128_to_string(mbox->mailbox_guid)));
+	dbox_file_unref(&file);
+}
+
+static nlink_t test_sdbox_get_nlink(struct mailbox *box, uint32_t uid)
+{
+	struct stat st;
+	const char *dir, *path;
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX, &dir) <= 0)
+		i_unreached();
+	path = t_strdup_printf("%s/"SDBOX_MAIL_FILE_FORMAT, dir, uid);
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	return st.st_nlink;
+}
+
+static void test_sdbox_copy_attachment_links(void)
+{
+	const char *const extra_input[] = {
+		"mail_attachment_dir=~/attachments",
+		"mail_attachment_min_size=16",
+		"mail_attachment_text_parts=yes",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.driver_opts = "sdbox",
+		.extra_input = extra_input,
+	};
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+	struct mail_namespace *ns;
+	struct mailbox *inbox, *box;
+	struct mailbox_transaction_context *src_trans, *dest_trans;
+	struct mail_save_context *save_ctx;
+	struct mail *mail, *dest_mail;
+	string_t *data = t_str_new(256);
+	unsigned int i;
+
+	test_begin("sdbox copy links attachments");
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	inbox = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(inbox) == 0);
+	box = mailbox_alloc(ns->list, "copy", 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	test_assert(mailbox_open(box) == 0);
+	test_sdbox_attachment_path_suffix(box);
+
+	str_append(data, "Subject: copy\n\n");
+	for (i = 0; i < 10; i++)
+		str_append(data, "body line that is stored externally\n");
+	test_assert(test_mail_save(inbox, str_c(data)) == 0);
+	test_assert(test_count_attachments(ctx->user, 0) == 1);
+
+	/* copy the same mail twice within one transaction, so both copies
+	   have their uncommitted attachment links at the same time */
+	test_assert(mailbox_sync(inbox, 0) == 0);
+	src_trans = mailbox_transaction_begin(inbox, 0, __func__);
+	mail = mail_alloc(src_trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	dest_trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (i = 0; i < 2; i++) {
+		save_ctx = mailbox_save_alloc(dest_trans);
+		dest_mail = mailbox_save_get_dest_mail(save_ctx);
+		test_assert(mailbox_copy(&save_ctx, mail) == 0);
+		/* the copy is readable before it's committed */
+		test_mail_check_stream(dest_mail, str_c(data));
+	}
+	test_assert(test_count_attachments(ctx->user, 3) == 3);
+	test_assert(mailbox_transaction_commit(&dest_trans) == 0);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&src_trans) == 0);
+
+	/* both copies were hardlinked, and they link to the same attachment
+	   file */
+	test_assert(test_sdbox_get_nlink(inbox, 1) == 3);
+	test_assert(test_count_attachments(ctx->user, 0) == 3);
+	test_assert(test_count_attachments(ctx->user, 3) == 3);
+	test_assert(mailbox_sync(box, 0) == 0);
+	src_trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(src_trans, 0, NULL);
+	for (i = 1; i <= 2; i++) {
+		mail_set_seq(mail, i);
+		test_mail_check_stream(mail, str_c(data));
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&src_trans) == 0);
+
+	/* expunging removes only the expunged mails' own links */
+	test_mail_expunge_all(inbox);
+	test_assert(test_count_attachments(ctx->user, 0) == 2);
+	test_mail_expunge_all(box);
+	test_assert(test_count_attachments(ctx->user, 0) == 0);
+
+	mailbox_free(&box);
+	mailbox_free(&inbox);
+	test_mail_storage_deinit_user(ctx);
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
+static void test_mail_precache_check(struct mailbox *box, uint32_t seq,
+				     bool cached)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	const char *value;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
+	if (!cached) {
+		test_assert(mail_get_special(mail, MAIL_FETCH_BODY_SNIPPET,
+					     &value) < 0);
+	} else {
+		test_assert(mail_get_special(mail, MAIL_FETCH_BODY_SNIPPET,
+					     &value) == 0 &&
+			    /* skip the snippet version */
+			    value[0] != '\0' &&
+			    strcmp(value + 1, "precached body") == 0);
+		test_assert(mail_get_special(mail,
+				MAIL_FETCH_IMAP_BODYSTRUCTURE, &value) == 0);
+		test_assert(mail_get_first_header(mail, "Subject",
+						  &value) == 1 &&
+			    strcmp(value, "precache") == 0);
+		test_assert(mail_get_first_header(mail, "To", &value) == 0);
+	}
+	test_assert(!mail->mail_stream_accessed);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_mail_precache(void)
+{
+	static const char *const precache_headers[] = {
+		"Subject", "To", NULL
+	};
+	static const char *const data =
+		"Subject: precache\n"
+		"Content-Type: multipart/mixed; boundary=\"b\"\n\n"
+		"--b\n\nprecached body\n--b\n"
+		"Content-Type: application/octet-stream\n\nxyz\n--b--\n";
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+	};
+	struct test_mail_storage_ctx *ctx = test_mail_storage_init();
+	struct mailbox_header_lookup_ctx *headers;
+	struct mail_namespace *ns;
+	struct mailbox *inbox, *box;
+	struct mailbox_transaction_context *src_trans, *dest_trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	struct mail *mail;
+	int ret;
+
+	test_begin("mail save precache");
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	inbox = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(inbox) == 0);
+	box = mailbox_alloc(ns->list, "copy", 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+
+	/* without precaching nothing is cached for a new mailbox */
+	test_assert(test_mail_save(inbox, data) == 0);
+	test_assert(mailbox_sync(inbox, 0) == 0);
+	test_mail_precache_check(inbox, 1, FALSE);
+
+	src_trans = mailbox_transaction_begin(inbox,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(src_trans);
+	headers = mailbox_header_lookup_init(inbox, precache_headers);
+	mailbox_save_set_precache_fields(save_ctx, MAIL_FETCH_BODY_SNIPPET |
+					 MAIL_FETCH_IMAP_BODYSTRUCTURE, headers);
+	mailbox_header_lookup_unref(&headers);
+	input = i_stream_create_from_data(data, strlen(data));
+	ret = mailbox_save_begin(&save_ctx, input);
+	while (ret == 0 && i_stream_read(input) > 0)
+		ret = mailbox_save_continue(save_ctx);
+	test_assert(ret == 0);
+	test_assert(mailbox_save_finish(&save_ctx) == 0);
+	i_stream_unref(&input);
+	test_assert(mailbox_transaction_commit(&src_trans) == 0);
+	test_assert(mailbox_sync(inbox, 0) == 0);
+	test_mail_precache_check(inbox, 2, TRUE);
+
+	/* copying copies all the cached fields, even though the destination
+	   mailbox hasn't decided to cache any of them */
+	src_trans = mailbox_transaction_begin(inbox, 0, __func__);
+	mail = mail_alloc(src_trans, 0, NULL);
+	mail_set_seq(mail, 2);
+	dest_trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(dest_trans);
+	mailbox_save_set_precache_fields(save_ctx, 0, NULL);
+	test_assert(mailbox_copy(&save_ctx, mail) == 0);
+	test_assert(mailbox_transaction_commit(&dest_trans) == 0);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&src_trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_precache_check(box, 1, TRUE);
+
+	mailbox_free(&box);
+	mailbox_free(&inbox);
+	test_mail_storage_deinit_user(ctx);
+	test_end();
+
+	test_mail_storage_deinit(&ctx);
+}
+
 static void test_mailbox_list_mbox(void)
 {
 	struct test_mail_storage_ctx *ctx;
@@ -719,6 +1747,16 @@ int main(int argc, char **argv)
 		test_mail_storage_last_error_push_pop,
 		test_mailbox_verify_name,
 		test_mailbox_list_maildir,
+		test_maildir_sync_changes,
+#ifdef HAVE_INOTIFY_INIT
+		test_maildir_sync_journal,
+#endif
+		test_maildir_uidlist_formats,
+		test_mdbox_concurrent_saves,
+		test_mdbox_purge_limits,
+		test_mdbox_copy_attachment_links,
+		test_sdbox_copy_attachment_links,
+		test_mail_precache,
 		test_mailbox_list_mbox,
 		test_mail_parse_human_timestamp,
 		test_mail_parse_human_timestamp_time_interval,
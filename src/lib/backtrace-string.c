@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "str.h"
+#include "sampling-profiler.h"
 #include "backtrace-string.h"
 
 #define MAX_STACK_SIZE 30
@@ -155,7 +156,7 @@ backtrace_append_libc(string_t *str ATTR_UNUSED, const char **error_r)
 }
 #endif
 
-int backtrace_append(string_t *str, const char **error_r)
+static int backtrace_append_any(string_t *str, const char **error_r)
 {
 #if defined(HAVE_LIBUNWIND)
 	size_t orig_len = str_len(str);
@@ -168,6 +169,18 @@ int backtrace_append(string_t *str, const char **error_r)
 	return backtrace_append_libc(str, error_r);
 }
 
+int backtrace_append(string_t *str, const char **error_r)
+{
+	int ret;
+
+	/* the unwinder's locks aren't safe for the profiler's signal
+	   handler to take while we're holding them */
+	sampling_profiler_block();
+	ret = backtrace_append_any(str, error_r);
+	sampling_profiler_unblock();
+	return ret;
+}
+
 int backtrace_get(const char **backtrace_r, const char **error_r)
 {
 	string_t *str;
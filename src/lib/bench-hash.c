@@ -0,0 +1,130 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "hash.h"
+
+#include <stdio.h>
+
+/**
+ * Compares the chained (hash_table_create()) and open addressing
+ * (hash_table_create_open()) hash tables with string keys, similar to
+ * e.g. auth cache and anvil. All the keys are inserted, looked up in a
+ * random order (both existing and missing keys) and then removed in
+ * a random order.
+ */
+
+struct bench_result {
+	uint64_t insert_nsecs, lookup_nsecs, remove_nsecs;
+};
+
+static char **bench_keys, **bench_missing_keys;
+/* Precomputed so that the random number generation isn't measured */
+static unsigned int *bench_order;
+
+static void
+bench_hash(bool open, unsigned int count, struct bench_result *result_r)
+{
+	HASH_TABLE(char *, char *) hash;
+	uint64_t ts;
+	unsigned int i, found = 0;
+
+	if (open)
+		hash_table_create_open(&hash, default_pool, 0, str_hash, strcmp);
+	else
+		hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+
+	ts = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, bench_keys[i], bench_keys[i]);
+	result_r->insert_nsecs = i_nanoseconds() - ts;
+
+	ts = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, bench_keys[bench_order[i]]) != NULL)
+			found++;
+		if (hash_table_lookup(hash, bench_missing_keys[i]) != NULL)
+			found++;
+	}
+	result_r->lookup_nsecs = i_nanoseconds() - ts;
+	i_assert(found == count);
+
+	ts = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, bench_keys[bench_order[i]]);
+	result_r->remove_nsecs = i_nanoseconds() - ts;
+	i_assert(hash_table_count(hash) == 0);
+
+	hash_table_destroy(&hash);
+}
+
+static void
+bench_print(const char *name, unsigned int count,
+	    const struct bench_result *result)
+{
+	printf("%s\n", name);
+	printf("\tInsert: %0.02lf ns/op\n",
+	       (double)result->insert_nsecs / count);
+	printf("\tLookup: %0.02lf ns/op\n",
+	       (double)result->lookup_nsecs / (count * 2));
+	printf("\tRemove: %0.02lf ns/op\n\n",
+	       (double)result->remove_nsecs / count);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s count\n", prog);
+	fprintf(stderr, "Runs with 1000000 entries if nothing given\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count = 1000000, i, j, tmp;
+	struct bench_result result;
+
+	lib_init();
+
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	printf("%u entries\n\n", count);
+	bench_keys = i_new(char *, count);
+	bench_missing_keys = i_new(char *, count);
+	bench_order = i_new(unsigned int, count);
+	for (i = 0; i < count; i++) {
+		bench_keys[i] = i_strdup_printf("user%u@example.com", i);
+		bench_missing_keys[i] =
+			i_strdup_printf("missing%u@example.com", i);
+		bench_order[i] = i;
+	}
+	for (i = count - 1; i > 0; i--) {
+		j = i_rand_limit(i + 1);
+		tmp = bench_order[i];
+		bench_order[i] = bench_order[j];
+		bench_order[j] = tmp;
+	}
+
+	bench_hash(FALSE, count, &result);
+	bench_print("chained", count, &result);
+	bench_hash(TRUE, count, &result);
+	bench_print("open addressing", count, &result);
+
+	for (i = 0; i < count; i++) {
+		i_free(bench_keys[i]);
+		i_free(bench_missing_keys[i]);
+	}
+	i_free(bench_order);
+	i_free(bench_missing_keys);
+	i_free(bench_keys);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,170 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "time-util.h"
+#include "strnum.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/**
+ * Compares alloc/free throughput and memory usage of the system, allocfree
+ * and slab pools with a workload similar to what ioloop and lib-event
+ * generate: a working set of small objects of a few different sizes, where
+ * random objects are constantly freed and new ones allocated. Each pool is
+ * benchmarked in a separate child process so the RSS numbers aren't
+ * affected by the previous runs.
+ */
+
+/* sizes of some frequently allocated objects */
+static const size_t bench_obj_sizes[] = { 24, 48, 72, 96, 136, 200, 320 };
+
+struct bench_pool {
+	const char *name;
+	pool_t (*create)(void);
+};
+
+static pool_t bench_system_pool(void)
+{
+	return system_pool;
+}
+
+static pool_t bench_allocfree_pool(void)
+{
+	return pool_allocfree_create("bench");
+}
+
+static pool_t bench_slab_pool(void)
+{
+	return pool_slab_create("bench");
+}
+
+static const struct bench_pool bench_pools[] = {
+	{ "system", bench_system_pool },
+	{ "allocfree", bench_allocfree_pool },
+	{ "slab", bench_slab_pool },
+};
+
+/* Precomputed so that the random number generation isn't measured */
+static unsigned int *bench_idx;
+static size_t *bench_sizes;
+
+static size_t bench_get_rss_kb(void)
+{
+	FILE *f;
+	unsigned long size, resident;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+bench_run(const struct bench_pool *bpool, unsigned int count,
+	  unsigned int ops)
+{
+	void **objs;
+	size_t *sizes;
+	size_t rss_start, rss_peak;
+	uint64_t ts, nsecs;
+	unsigned int i, idx;
+	pool_t pool;
+
+	objs = i_new(void *, count);
+	sizes = i_new(size_t, count);
+	rss_start = bench_get_rss_kb();
+
+	ts = i_nanoseconds();
+	pool = bpool->create();
+	for (i = 0; i < count; i++) {
+		sizes[i] = bench_sizes[i];
+		objs[i] = p_malloc(pool, sizes[i]);
+	}
+	for (i = 0; i < ops; i++) {
+		idx = bench_idx[i];
+		p_free(pool, objs[idx]);
+		sizes[idx] = bench_sizes[count + i];
+		objs[idx] = p_malloc(pool, sizes[idx]);
+	}
+	rss_peak = bench_get_rss_kb();
+	/* free half of the objects to see how much memory is kept */
+	for (i = 0; i < count; i += 2)
+		p_free(pool, objs[i]);
+	nsecs = i_nanoseconds() - ts;
+
+	printf("%s\n", bpool->name);
+	printf("\tTotal: %0.02lf ms\n", nsecs / 1000000.0);
+	printf("\tPer alloc+free: %0.02lf ns\n",
+	       (double)nsecs / (count + ops));
+	printf("\tRSS growth: %zu kB peak, %zu kB after freeing half\n\n",
+	       rss_peak - rss_start, bench_get_rss_kb() - rss_start);
+	fflush(stdout);
+
+	for (i = 1; i < count; i += 2)
+		p_free(pool, objs[i]);
+	if (pool != system_pool)
+		pool_unref(&pool);
+	i_free(sizes);
+	i_free(objs);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s object_count operations\n", prog);
+	fprintf(stderr, "Runs with 100000 objects and 10000000 operations "
+		"if nothing given\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count = 100000, ops = 10000000, i;
+	pid_t pid;
+	int status;
+
+	lib_init();
+
+	if (argc == 3) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0 ||
+		    str_to_uint(argv[2], &ops) < 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	printf("%u objects, %u alloc+free operations\n\n", count, ops);
+	bench_idx = i_new(unsigned int, ops);
+	bench_sizes = i_new(size_t, (size_t)count + ops);
+	for (i = 0; i < ops; i++)
+		bench_idx[i] = i_rand_limit(count);
+	for (i = 0; i < count + ops; i++) {
+		bench_sizes[i] = bench_obj_sizes[
+			i_rand_limit(N_ELEMENTS(bench_obj_sizes))];
+	}
+	fflush(stdout);
+
+	for (i = 0; i < N_ELEMENTS(bench_pools); i++) {
+		pid = fork();
+		if (pid < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			bench_run(&bench_pools[i], count, ops);
+			lib_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0)
+			i_fatal("waitpid() failed: %m");
+	}
+
+	i_free(bench_sizes);
+	i_free(bench_idx);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,203 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "priorityq.h"
+#include "timing-wheel.h"
+
+#include <stdio.h>
+
+/**
+ * Simulates a process with many idle connections, each having an inactivity
+ * timeout that is reset whenever there is traffic on the connection, and
+ * compares the time spent on timeout handling with a priority queue (what
+ * ioloop uses for short timeouts) and with a timing wheel. The clock is
+ * simulated, so the results show only the data structure overhead.
+ */
+
+#define BENCH_START_MSECS 1700000000000ULL
+#define BENCH_TICK_MSECS 1
+
+struct bench_timeout {
+	struct priorityq_item pq_item;
+	struct timing_wheel_item wheel_item;
+	unsigned int msecs;
+	uint64_t next_run;
+};
+
+/* Precomputed so that the random number generation isn't measured */
+static unsigned int *bench_reset_idx;
+
+struct bench_result {
+	uint64_t nsecs;
+	unsigned int resets, expires;
+};
+
+static int bench_timeout_cmp(const void *p1, const void *p2)
+{
+	const struct bench_timeout *to1 = p1, *to2 = p2;
+
+	if (to1->next_run < to2->next_run)
+		return -1;
+	return to1->next_run > to2->next_run ? 1 : 0;
+}
+
+static void
+bench_timeouts_init(struct bench_timeout *timeouts, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		i_zero(&timeouts[i]);
+		timing_wheel_item_init(&timeouts[i].wheel_item);
+		/* typical inactivity timeouts: 30 s .. 30 min */
+		timeouts[i].msecs = 30*1000 + i_rand_limit(30*60*1000);
+	}
+}
+
+static void
+bench_priorityq(struct bench_timeout *timeouts, unsigned int count,
+		unsigned int resets_per_sec, unsigned int secs,
+		struct bench_result *result_r)
+{
+	struct priorityq *pq;
+	struct priorityq_item *item;
+	struct bench_timeout *to;
+	uint64_t now = BENCH_START_MSECS, end, ts;
+	unsigned int i, n;
+
+	i_zero(result_r);
+	bench_timeouts_init(timeouts, count);
+	ts = i_nanoseconds();
+
+	pq = priorityq_init(bench_timeout_cmp, count);
+	for (i = 0; i < count; i++) {
+		timeouts[i].next_run = now + timeouts[i].msecs;
+		priorityq_add(pq, &timeouts[i].pq_item);
+	}
+
+	end = now + secs * 1000;
+	for (; now < end; now += BENCH_TICK_MSECS) {
+		n = resets_per_sec * BENCH_TICK_MSECS / 1000;
+		for (; n > 0; n--) {
+			to = &timeouts[bench_reset_idx[result_r->resets]];
+			to->next_run = now + to->msecs;
+			priorityq_remove(pq, &to->pq_item);
+			priorityq_add(pq, &to->pq_item);
+			result_r->resets++;
+		}
+		while ((item = priorityq_peek(pq)) != NULL &&
+		       ((struct bench_timeout *)item)->next_run <= now) {
+			to = (struct bench_timeout *)item;
+			to->next_run = now + to->msecs;
+			priorityq_remove(pq, &to->pq_item);
+			priorityq_add(pq, &to->pq_item);
+			result_r->expires++;
+		}
+	}
+	while (priorityq_pop(pq) != NULL) ;
+	priorityq_deinit(&pq);
+	result_r->nsecs = i_nanoseconds() - ts;
+}
+
+static void
+bench_timing_wheel(struct bench_timeout *timeouts, unsigned int count,
+		   unsigned int resets_per_sec, unsigned int secs,
+		   struct bench_result *result_r)
+{
+	struct timing_wheel *wheel;
+	struct timing_wheel_item *item;
+	struct bench_timeout *to;
+	uint64_t now = BENCH_START_MSECS, end, ts;
+	unsigned int i, n;
+
+	i_zero(result_r);
+	bench_timeouts_init(timeouts, count);
+	ts = i_nanoseconds();
+
+	wheel = timing_wheel_init(now);
+	for (i = 0; i < count; i++) {
+		timing_wheel_add(wheel, &timeouts[i].wheel_item,
+				 now + timeouts[i].msecs);
+	}
+
+	end = now + secs * 1000;
+	for (; now < end; now += BENCH_TICK_MSECS) {
+		n = resets_per_sec * BENCH_TICK_MSECS / 1000;
+		for (; n > 0; n--) {
+			to = &timeouts[bench_reset_idx[result_r->resets]];
+			timing_wheel_remove(wheel, &to->wheel_item);
+			timing_wheel_add(wheel, &to->wheel_item,
+					 now + to->msecs);
+			result_r->resets++;
+		}
+		while ((item = timing_wheel_peek_expired(wheel, now)) != NULL) {
+			to = container_of(item, struct bench_timeout,
+					  wheel_item);
+			timing_wheel_remove(wheel, item);
+			timing_wheel_add(wheel, item, now + to->msecs);
+			result_r->expires++;
+		}
+	}
+	while (timing_wheel_pop_any(wheel) != NULL) ;
+	timing_wheel_deinit(&wheel);
+	result_r->nsecs = i_nanoseconds() - ts;
+}
+
+static void bench_print(const char *name, const struct bench_result *result)
+{
+	unsigned int ops = result->resets + result->expires;
+
+	printf("%s\n", name);
+	printf("\tTotal: %0.02lf ms\n", result->nsecs / 1000000.0);
+	printf("\tResets: %u, expires: %u\n", result->resets, result->expires);
+	printf("\tPer operation: %0.02lf ns\n\n",
+	       ops == 0 ? 0.0 : (double)result->nsecs / ops);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s timeout_count resets_per_sec seconds\n", prog);
+	fprintf(stderr, "Runs with 100000 timeouts, 20000 resets/s for 60 seconds "
+		"if nothing given\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count = 100000, resets_per_sec = 20000, secs = 60;
+	struct bench_timeout *timeouts;
+	struct bench_result result;
+
+	lib_init();
+
+	if (argc == 4) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0 ||
+		    str_to_uint(argv[2], &resets_per_sec) < 0 ||
+		    str_to_uint(argv[3], &secs) < 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	printf("%u timeouts, %u resets/s, %u simulated seconds\n\n",
+	       count, resets_per_sec, secs);
+	timeouts = i_new(struct bench_timeout, count);
+	bench_reset_idx = i_new(unsigned int, (size_t)resets_per_sec * secs);
+	for (size_t i = 0; i < (size_t)resets_per_sec * secs; i++)
+		bench_reset_idx[i] = i_rand_limit(count);
+
+	bench_priorityq(timeouts, count, resets_per_sec, secs, &result);
+	bench_print("priorityq", &result);
+	bench_timing_wheel(timeouts, count, resets_per_sec, secs, &result);
+	bench_print("timing wheel", &result);
+
+	i_free(bench_reset_idx);
+	i_free(timeouts);
+	lib_deinit();
+	return 0;
+}
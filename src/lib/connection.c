@@ -898,6 +898,19 @@ void connection_disconnect(struct connection *conn)
 	conn->disconnected = TRUE;
 }
 
+void connection_forked(struct connection *conn)
+{
+	if (conn->disconnected)
+		return;
+	/* connection_disconnect() would flush the output and shutdown() the
+	   socket, which would break the parent process's connection. */
+	io_remove(&conn->io);
+	if (conn->output != NULL)
+		o_stream_abort(conn->output);
+	fd_close_maybe_stdio(&conn->fd_in, &conn->fd_out);
+	connection_disconnect(conn);
+}
+
 void connection_deinit(struct connection *conn)
 {
 	i_assert(conn->list->connections_count > 0);
@@ -252,6 +252,10 @@ int connection_client_connect_with_retries(struct connection *conn,
 
 /* Disconnects a connection */
 void connection_disconnect(struct connection *conn);
+/* Disconnects a connection inherited from the parent process after fork().
+   Only this process's copy of the socket is closed, so the parent's
+   connection keeps working. Any buffered output is dropped. */
+void connection_forked(struct connection *conn);
 
 /* Deinitializes a connection, calls disconnect */
 void connection_deinit(struct connection *conn);
@@ -72,26 +72,27 @@ struct data_stack_frame {
 };
 #endif
 
-unsigned int data_stack_frame_id = 0;
+/* Everything except the out-of-memory area is per-thread. */
+THREAD_LOCAL unsigned int data_stack_frame_id = 0;
 
-static bool data_stack_initialized = FALSE;
-static data_stack_frame_t root_frame_id;
+static THREAD_LOCAL bool data_stack_initialized = FALSE;
+static THREAD_LOCAL data_stack_frame_t root_frame_id;
 
-static struct stack_frame *current_frame;
+static THREAD_LOCAL struct stack_frame *current_frame;
 
 /* The latest block currently used for allocation. current_block->next is
    always NULL. */
-static struct stack_block *current_block;
+static THREAD_LOCAL struct stack_block *current_block;
 /* The largest block that data stack has allocated so far, which was already
    freed. This can prevent rapid malloc()+free()ing when data stack is grown
    and shrunk constantly. */
-static struct stack_block *unused_block = NULL;
+static THREAD_LOCAL struct stack_block *unused_block = NULL;
 
-static struct event *event_datastack = NULL;
-static bool event_datastack_deinitialized = FALSE;
+static THREAD_LOCAL struct event *event_datastack = NULL;
+static THREAD_LOCAL bool event_datastack_deinitialized = FALSE;
 
-static struct stack_block *last_buffer_block;
-static size_t last_buffer_size;
+static THREAD_LOCAL struct stack_block *last_buffer_block;
+static THREAD_LOCAL size_t last_buffer_size;
 static bool outofmem = FALSE;
 
 static union {
@@ -748,9 +749,13 @@ void data_stack_init(void)
 	data_stack_initialized = TRUE;
 	data_stack_frame_id = 1;
 
-	outofmem_area.block.size = outofmem_area.block.left =
-		sizeof(outofmem_area) - sizeof(outofmem_area.block);
-	outofmem_area.block.canary = BLOCK_CANARY;
+	if (outofmem_area.block.size == 0) {
+		/* the main thread initializes this before any other threads
+		   are created */
+		outofmem_area.block.size = outofmem_area.block.left =
+			sizeof(outofmem_area) - sizeof(outofmem_area.block);
+		outofmem_area.block.canary = BLOCK_CANARY;
+	}
 
 	current_block = mem_block_alloc(INITIAL_STACK_SIZE);
 	current_frame = NULL;
@@ -777,3 +782,15 @@ void data_stack_deinit(void)
 	current_block = NULL;
 	data_stack_free_unused();
 }
+
+void data_stack_thread_init(void)
+{
+	/* events can't be used outside the main thread */
+	event_datastack_deinitialized = TRUE;
+	data_stack_init();
+}
+
+void data_stack_thread_deinit(void)
+{
+	data_stack_deinit();
+}
@@ -29,6 +29,9 @@
     - Debugging invalid memory usage may be difficult using existing tools,
       although compiling with DEBUG enabled helps finding simple buffer
       overflows.
+
+   Each thread has its own data stack. Threads other than the main thread
+   must call data_stack_thread_init() before using it.
 */
 
 #ifndef STATIC_CHECKER
@@ -37,7 +40,7 @@ typedef unsigned int data_stack_frame_t;
 typedef struct data_stack_frame *data_stack_frame_t;
 #endif
 
-extern unsigned int data_stack_frame_id;
+extern THREAD_LOCAL unsigned int data_stack_frame_id;
 
 /* All t_..() allocations between t_push*() and t_pop() are freed after t_pop()
    is called. Returns the current stack frame number, which can be used
@@ -164,4 +167,9 @@ void data_stack_init(void);
 void data_stack_deinit_event(void);
 void data_stack_deinit(void);
 
+/* Initialize/deinitialize data stack for a thread created by thread-pool.
+   Unlike the main thread's data stack, it never sends events. */
+void data_stack_thread_init(void);
+void data_stack_thread_deinit(void);
+
 #endif
@@ -17,12 +17,22 @@ enum event_filter_node_op {
 	EVENT_FILTER_OP_NOT,
 };
 
+struct event_filter_query_internal {
+	struct event_filter_node *expr;
+	void *context;
+};
+ARRAY_DEFINE_TYPE(event_filter_query_internal,
+		  struct event_filter_query_internal);
+
 struct event_filter {
 	struct event_filter *prev, *next;
 
 	pool_t pool;
 	int refcount;
-	ARRAY(struct event_filter_query_internal) queries;
+	ARRAY_TYPE(event_filter_query_internal) queries;
+	/* Compiled queries, or NULL if there are none. Compiled again
+	   whenever the queries change. */
+	struct event_filter_program *program;
 
 	bool fragment;
 	bool named_queries_only;
@@ -84,6 +94,8 @@ struct event_filter_node {
 		} category;
 		struct event_field field;
 	};
+	/* field's value as string, or NULL if not initialized yet */
+	const char *value_str;
 
 	bool ambiguous_unit:1;
 	bool warned_ambiguous_unit:1;
@@ -97,6 +109,56 @@ struct event_filter_node {
 bool event_filter_category_to_log_type(const char *name,
 				       enum event_filter_log_type *log_type_r);
 
+/* Evaluate a leaf node */
+bool event_filter_query_match_cmp(struct event_filter_node *node,
+				  struct event *event,
+				  const char *source_filename,
+				  unsigned int source_linenum,
+				  enum event_filter_log_type log_type);
+/* Set node->value_str for a field node, allocating it from the pool. */
+void event_filter_node_init_value_str(struct event_filter_node *node,
+				      pool_t pool);
+
+/* event-filter-program.c */
+struct event_filter_program_iter {
+	struct event_filter_program *program;
+	struct event *event;
+	const char *source_filename;
+	unsigned int source_linenum;
+	enum event_filter_log_type log_type;
+
+	/* indexes of queries requiring the event's name */
+	const unsigned int *named;
+	unsigned int named_count, named_idx;
+	/* indexes of queries not requiring any event name */
+	const unsigned int *unnamed;
+	unsigned int unnamed_count, unnamed_idx;
+
+	/* categories of the event (and parents and global events) as bits
+	   of the program's categories */
+	uint64_t category_mask;
+	bool category_mask_set;
+};
+
+/* Compile the queries into a program. Leaf nodes are referenced by the
+   program, so they must not be freed while the program exists. */
+struct event_filter_program *
+event_filter_program_compile(pool_t filter_pool,
+			     const ARRAY_TYPE(event_filter_query_internal) *queries);
+void event_filter_program_ref(struct event_filter_program *program);
+void event_filter_program_unref(struct event_filter_program **program);
+
+void event_filter_program_iter_init(struct event_filter_program_iter *iter_r,
+				    struct event_filter_program *program,
+				    struct event *event,
+				    const char *source_filename,
+				    unsigned int source_linenum,
+				    enum event_filter_log_type log_type);
+/* Returns TRUE and the query's context if a query matched, FALSE when there
+   are no more matches. */
+bool event_filter_program_iter_next(struct event_filter_program_iter *iter,
+				    bool skip_null_context, void **context_r);
+
 /* lexer & parser state */
 struct event_filter_parser_state {
 	void *scanner;
@@ -127,5 +189,7 @@ const char *
 event_filter_category_from_log_type(enum event_filter_log_type log_type);
 struct event_filter_node *
 event_filter_get_expr_for_testing(struct event_filter *filter, unsigned int *count_r);
+/* Match events by walking the query trees instead of the compiled program. */
+void event_filter_set_program_disabled_for_testing(bool disabled);
 
 #endif
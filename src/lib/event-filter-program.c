@@ -0,0 +1,464 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "wildcard-match.h"
+#include "lib-event-private.h"
+#include "event-filter-private.h"
+
+/* The expression trees of an event filter's queries are compiled into a
+   single flat array of instructions. Each instruction tests one leaf node
+   and jumps to the next instruction depending on the result, so AND, OR and
+   NOT don't exist in the program anymore. Evaluation ends when jumping to
+   PROGRAM_MATCH or PROGRAM_NO_MATCH.
+
+   Most queries (e.g. all stats metrics) require a specific event name. These
+   queries are indexed by the event name, so only the queries that can
+   possibly match the event are evaluated at all. */
+
+#define PROGRAM_MATCH UINT_MAX
+#define PROGRAM_NO_MATCH (UINT_MAX-1)
+
+/* Maximum number of registered categories that are tested via the event's
+   category bitmask. The rest are tested the slow way. */
+#define PROGRAM_MAX_CATEGORIES 64
+
+enum event_filter_instr_type {
+	/* event name equals str */
+	EVENT_FILTER_INSTR_NAME_EXACT,
+	/* event name matches wildcard str */
+	EVENT_FILTER_INSTR_NAME_WILDCARD,
+	/* log type is in log_type mask */
+	EVENT_FILTER_INSTR_LOG_TYPE,
+	/* the event's category bitmask has category_bit set */
+	EVENT_FILTER_INSTR_CATEGORY,
+	/* always FALSE, e.g. category isn't registered */
+	EVENT_FILTER_INSTR_FALSE,
+	/* evaluate the filter node */
+	EVENT_FILTER_INSTR_NODE,
+};
+
+struct event_filter_instr {
+	enum event_filter_instr_type type;
+	/* The next instruction if the test is TRUE/FALSE */
+	unsigned int jump_true, jump_false;
+
+	union {
+		const char *str;
+		enum event_filter_log_type log_type;
+		unsigned int category_bit;
+		struct event_filter_node *node;
+	};
+};
+
+ARRAY_DEFINE_TYPE(event_filter_instr, struct event_filter_instr);
+
+struct event_filter_program_query {
+	/* index of the first instruction */
+	unsigned int start;
+	void *context;
+};
+
+/* Sorted array of query indexes */
+ARRAY_DEFINE_TYPE(event_filter_query_idx, unsigned int);
+
+struct event_filter_program {
+	pool_t pool;
+	int refcount;
+
+	ARRAY(struct event_filter_instr) instrs;
+	ARRAY(struct event_filter_program_query) queries;
+
+	/* event name => ARRAY_TYPE(event_filter_query_idx) */
+	HASH_TABLE(const char *, ARRAY_TYPE(event_filter_query_idx) *) name_queries;
+	/* queries that don't require any specific event name */
+	ARRAY_TYPE(event_filter_query_idx) unnamed_queries;
+
+	/* category->internal pointers for each category bit */
+	void *categories[PROGRAM_MAX_CATEGORIES];
+	unsigned int categories_count;
+};
+
+static void
+event_filter_program_add_name(struct event_filter_program *program,
+			      const char *name, unsigned int query_idx)
+{
+	ARRAY_TYPE(event_filter_query_idx) *queries;
+
+	queries = hash_table_lookup(program->name_queries, name);
+	if (queries == NULL) {
+		queries = p_new(program->pool,
+				ARRAY_TYPE(event_filter_query_idx), 1);
+		p_array_init(queries, program->pool, 4);
+		name = p_strdup(program->pool, name);
+		hash_table_insert(program->name_queries, name, queries);
+	}
+	/* the same name may be in the query multiple times */
+	if (array_count(queries) == 0 || *array_back(queries) != query_idx)
+		array_push_back(queries, &query_idx);
+}
+
+/* Add to names_r the event names of which one the event must have for the
+   node to match. Returns FALSE if any event name (or no name) could
+   match. */
+static bool
+event_filter_node_get_names(struct event_filter_node *node,
+			    ARRAY_TYPE(const_string) *names_r)
+{
+	unsigned int count;
+
+	switch (node->op) {
+	case EVENT_FILTER_OP_AND:
+		/* either side's names are enough */
+		count = array_count(names_r);
+		if (event_filter_node_get_names(node->children[0], names_r))
+			return TRUE;
+		array_delete(names_r, count, array_count(names_r) - count);
+		return event_filter_node_get_names(node->children[1], names_r);
+	case EVENT_FILTER_OP_OR:
+		return event_filter_node_get_names(node->children[0], names_r) &&
+			event_filter_node_get_names(node->children[1], names_r);
+	case EVENT_FILTER_OP_NOT:
+		return FALSE;
+	default:
+		break;
+	}
+	if (node->type != EVENT_FILTER_NODE_TYPE_EVENT_NAME_EXACT)
+		return FALSE;
+	array_push_back(names_r, &node->field.value.str);
+	return TRUE;
+}
+
+static unsigned int
+event_filter_program_get_category_bit(struct event_filter_program *program,
+				      struct event_category *category)
+{
+	unsigned int i;
+
+	for (i = 0; i < program->categories_count; i++) {
+		if (program->categories[i] == category->internal)
+			return i;
+	}
+	if (program->categories_count == PROGRAM_MAX_CATEGORIES)
+		return UINT_MAX;
+	program->categories[program->categories_count] = category->internal;
+	return program->categories_count++;
+}
+
+static void
+event_filter_program_compile_leaf(struct event_filter_program *program,
+				  pool_t filter_pool,
+				  struct event_filter_node *node,
+				  struct event_filter_instr *instr)
+{
+	switch (node->type) {
+	case EVENT_FILTER_NODE_TYPE_LOGIC:
+		i_unreached();
+	case EVENT_FILTER_NODE_TYPE_EVENT_NAME_EXACT:
+		instr->type = EVENT_FILTER_INSTR_NAME_EXACT;
+		instr->str = node->field.value.str;
+		return;
+	case EVENT_FILTER_NODE_TYPE_EVENT_NAME_WILDCARD:
+		instr->type = EVENT_FILTER_INSTR_NAME_WILDCARD;
+		instr->str = node->field.value.str;
+		return;
+	case EVENT_FILTER_NODE_TYPE_EVENT_CATEGORY:
+		if (node->category.name == NULL) {
+			instr->type = EVENT_FILTER_INSTR_LOG_TYPE;
+			instr->log_type = node->category.log_type;
+		} else if (node->category.ptr == NULL) {
+			/* not registered, so no event can have it */
+			instr->type = EVENT_FILTER_INSTR_FALSE;
+		} else {
+			instr->category_bit =
+				event_filter_program_get_category_bit(
+					program, node->category.ptr);
+			if (instr->category_bit != UINT_MAX) {
+				instr->type = EVENT_FILTER_INSTR_CATEGORY;
+				return;
+			}
+			/* too many categories */
+			break;
+		}
+		return;
+	case EVENT_FILTER_NODE_TYPE_EVENT_SOURCE_LOCATION:
+		break;
+	case EVENT_FILTER_NODE_TYPE_EVENT_FIELD_EXACT:
+	case EVENT_FILTER_NODE_TYPE_EVENT_FIELD_WILDCARD:
+	case EVENT_FILTER_NODE_TYPE_EVENT_FIELD_NUMERIC_WILDCARD:
+		event_filter_node_init_value_str(node, filter_pool);
+		break;
+	}
+	instr->type = EVENT_FILTER_INSTR_NODE;
+	instr->node = node;
+}
+
+/* Compile the node so that it jumps to jump_true or jump_false after
+   evaluation. The instructions are added in reverse order, so that the
+   jump targets are always known. Returns the (reversed) index of the
+   node's first instruction. */
+static unsigned int
+event_filter_program_compile_node(struct event_filter_program *program,
+				  pool_t filter_pool,
+				  ARRAY_TYPE(event_filter_instr) *instrs,
+				  struct event_filter_node *node,
+				  unsigned int jump_true, unsigned int jump_false)
+{
+	struct event_filter_instr *instr;
+	unsigned int idx;
+
+	switch (node->op) {
+	case EVENT_FILTER_OP_AND:
+		idx = event_filter_program_compile_node(program, filter_pool,
+			instrs, node->children[1], jump_true, jump_false);
+		return event_filter_program_compile_node(program, filter_pool,
+			instrs, node->children[0], idx, jump_false);
+	case EVENT_FILTER_OP_OR:
+		idx = event_filter_program_compile_node(program, filter_pool,
+			instrs, node->children[1], jump_true, jump_false);
+		return event_filter_program_compile_node(program, filter_pool,
+			instrs, node->children[0], jump_true, idx);
+	case EVENT_FILTER_OP_NOT:
+		return event_filter_program_compile_node(program, filter_pool,
+			instrs, node->children[0], jump_false, jump_true);
+	default:
+		break;
+	}
+	instr = array_append_space(instrs);
+	instr->jump_true = jump_true;
+	instr->jump_false = jump_false;
+	event_filter_program_compile_leaf(program, filter_pool, node, instr);
+	return array_count(instrs) - 1;
+}
+
+static unsigned int
+event_filter_program_reverse_idx(unsigned int base, unsigned int count,
+				 unsigned int idx)
+{
+	if (idx == PROGRAM_MATCH || idx == PROGRAM_NO_MATCH)
+		return idx;
+	i_assert(idx < count);
+	return base + count - 1 - idx;
+}
+
+static void
+event_filter_program_compile_query(struct event_filter_program *program,
+				   pool_t filter_pool,
+				   const struct event_filter_query_internal *query,
+				   unsigned int query_idx)
+{
+	struct event_filter_program_query *pquery;
+	ARRAY_TYPE(event_filter_instr) instrs;
+	ARRAY_TYPE(const_string) names;
+	const struct event_filter_instr *rinstrs;
+	struct event_filter_instr *instr;
+	unsigned int i, start, count, base = array_count(&program->instrs);
+	const char *name;
+
+	t_array_init(&names, 4);
+	if (!event_filter_node_get_names(query->expr, &names))
+		array_push_back(&program->unnamed_queries, &query_idx);
+	else {
+		array_foreach_elem(&names, name)
+			event_filter_program_add_name(program, name, query_idx);
+	}
+
+	t_array_init(&instrs, 16);
+	start = event_filter_program_compile_node(program, filter_pool,
+		&instrs, query->expr, PROGRAM_MATCH, PROGRAM_NO_MATCH);
+
+	/* reverse the instructions, so they're evaluated mostly sequentially */
+	rinstrs = array_get(&instrs, &count);
+	for (i = count; i > 0; i--) {
+		instr = array_append_space(&program->instrs);
+		*instr = rinstrs[i-1];
+		instr->jump_true = event_filter_program_reverse_idx(
+			base, count, instr->jump_true);
+		instr->jump_false = event_filter_program_reverse_idx(
+			base, count, instr->jump_false);
+	}
+
+	pquery = array_append_space(&program->queries);
+	pquery->start = event_filter_program_reverse_idx(base, count, start);
+	pquery->context = query->context;
+}
+
+struct event_filter_program *
+event_filter_program_compile(pool_t filter_pool,
+			     const ARRAY_TYPE(event_filter_query_internal) *queries)
+{
+	struct event_filter_program *program;
+	const struct event_filter_query_internal *query;
+	pool_t pool;
+
+	pool = pool_alloconly_create(MEMPOOL_GROWING"event filter program",
+				     1024);
+	program = p_new(pool, struct event_filter_program, 1);
+	program->pool = pool;
+	program->refcount = 1;
+	p_array_init(&program->instrs, pool, 16);
+	p_array_init(&program->queries, pool, array_count(queries));
+	p_array_init(&program->unnamed_queries, pool, 4);
+	hash_table_create(&program->name_queries, pool, 0, str_hash, strcmp);
+
+	array_foreach(queries, query) T_BEGIN {
+		event_filter_program_compile_query(program, filter_pool, query,
+			array_foreach_idx(queries, query));
+	} T_END;
+	return program;
+}
+
+void event_filter_program_ref(struct event_filter_program *program)
+{
+	i_assert(program->refcount > 0);
+	program->refcount++;
+}
+
+void event_filter_program_unref(struct event_filter_program **_program)
+{
+	struct event_filter_program *program = *_program;
+
+	if (program == NULL)
+		return;
+	*_program = NULL;
+
+	i_assert(program->refcount > 0);
+	if (--program->refcount > 0)
+		return;
+	hash_table_destroy(&program->name_queries);
+	pool_unref(&program->pool);
+}
+
+static void
+event_filter_program_add_event_categories(struct event_filter_program *program,
+					  struct event *event, uint64_t *mask)
+{
+	struct event_category *category, *cat;
+	unsigned int i;
+
+	for (; event != NULL; event = event_get_parent(event)) {
+		if (!array_is_created(&event->categories))
+			continue;
+		array_foreach_elem(&event->categories, category) {
+			for (cat = category; cat != NULL; cat = cat->parent) {
+				for (i = 0; i < program->categories_count; i++) {
+					if (program->categories[i] == cat->internal)
+						*mask |= 1ULL << i;
+				}
+			}
+		}
+	}
+}
+
+static uint64_t
+event_filter_program_get_category_mask(struct event_filter_program_iter *iter)
+{
+	if (!iter->category_mask_set) {
+		iter->category_mask = 0;
+		event_filter_program_add_event_categories(iter->program,
+			iter->event, &iter->category_mask);
+		event_filter_program_add_event_categories(iter->program,
+			event_get_global(), &iter->category_mask);
+		iter->category_mask_set = TRUE;
+	}
+	return iter->category_mask;
+}
+
+static bool
+event_filter_program_eval(struct event_filter_program_iter *iter,
+			  unsigned int pc)
+{
+	const struct event_filter_instr *instrs =
+		array_front(&iter->program->instrs);
+	const char *name = iter->event->sending_name;
+	bool ret;
+
+	while (pc < PROGRAM_NO_MATCH) {
+		const struct event_filter_instr *instr = &instrs[pc];
+
+		switch (instr->type) {
+		case EVENT_FILTER_INSTR_NAME_EXACT:
+			ret = name != NULL && strcmp(name, instr->str) == 0;
+			break;
+		case EVENT_FILTER_INSTR_NAME_WILDCARD:
+			ret = name != NULL &&
+				wildcard_match_escaped(name, instr->str);
+			break;
+		case EVENT_FILTER_INSTR_LOG_TYPE:
+			ret = (instr->log_type & iter->log_type) != 0;
+			break;
+		case EVENT_FILTER_INSTR_CATEGORY:
+			ret = (event_filter_program_get_category_mask(iter) &
+			       (1ULL << instr->category_bit)) != 0;
+			break;
+		case EVENT_FILTER_INSTR_FALSE:
+			ret = FALSE;
+			break;
+		case EVENT_FILTER_INSTR_NODE:
+			ret = event_filter_query_match_cmp(instr->node,
+				iter->event, iter->source_filename,
+				iter->source_linenum, iter->log_type);
+			break;
+		default:
+			i_unreached();
+		}
+		pc = ret ? instr->jump_true : instr->jump_false;
+	}
+	return pc == PROGRAM_MATCH;
+}
+
+void event_filter_program_iter_init(struct event_filter_program_iter *iter_r,
+				    struct event_filter_program *program,
+				    struct event *event,
+				    const char *source_filename,
+				    unsigned int source_linenum,
+				    enum event_filter_log_type log_type)
+{
+	ARRAY_TYPE(event_filter_query_idx) *named = NULL;
+
+	i_zero(iter_r);
+	iter_r->program = program;
+	iter_r->event = event;
+	iter_r->source_filename = source_filename;
+	iter_r->source_linenum = source_linenum;
+	iter_r->log_type = log_type;
+
+	if (event->sending_name != NULL) {
+		named = hash_table_lookup(program->name_queries,
+					  (const char *)event->sending_name);
+	}
+	if (named != NULL)
+		iter_r->named = array_get(named, &iter_r->named_count);
+	iter_r->unnamed = array_get(&program->unnamed_queries,
+				    &iter_r->unnamed_count);
+}
+
+bool event_filter_program_iter_next(struct event_filter_program_iter *iter,
+				    bool skip_null_context, void **context_r)
+{
+	const struct event_filter_program_query *query;
+	unsigned int query_idx;
+
+	for (;;) {
+		/* merge the two sorted lists, so the queries are returned
+		   in the same order as they were added */
+		if (iter->named_idx < iter->named_count &&
+		    (iter->unnamed_idx == iter->unnamed_count ||
+		     iter->named[iter->named_idx] <
+		     iter->unnamed[iter->unnamed_idx]))
+			query_idx = iter->named[iter->named_idx++];
+		else if (iter->unnamed_idx < iter->unnamed_count)
+			query_idx = iter->unnamed[iter->unnamed_idx++];
+		else
+			return FALSE;
+
+		query = array_idx(&iter->program->queries, query_idx);
+		if (skip_null_context && query->context == NULL)
+			continue;
+		if (event_filter_program_eval(iter, query->start)) {
+			*context_r = query->context;
+			return TRUE;
+		}
+	}
+}
@@ -36,12 +36,8 @@ static const struct log_type_map {
 };
 static_assert_array_size(event_filter_log_type_map, LOG_TYPE_COUNT);
 
-struct event_filter_query_internal {
-	struct event_filter_node *expr;
-	void *context;
-};
-
 static struct event_filter *event_filters = NULL;
+static bool event_filter_program_disabled = FALSE;
 
 static struct event_filter *event_filter_create_real(pool_t pool, bool fragment)
 {
@@ -91,6 +87,7 @@ void event_filter_unref(struct event_filter **_filter)
 	if (--filter->refcount > 0)
 		return;
 
+	event_filter_program_unref(&filter->program);
 	if (!filter->fragment) {
 		DLLIST_REMOVE(&event_filters, filter);
 
@@ -99,6 +96,17 @@ void event_filter_unref(struct event_filter **_filter)
 	}
 }
 
+/* Compile the queries again after they have changed, so matching never needs
+   to compile (or allocate) anything. Fragments are never matched. */
+static void event_filter_recompile(struct event_filter *filter)
+{
+	event_filter_program_unref(&filter->program);
+	if (!filter->fragment && array_count(&filter->queries) > 0) {
+		filter->program = event_filter_program_compile(filter->pool,
+							       &filter->queries);
+	}
+}
+
 static const char *
 wanted_field_value_str(const struct event_field *wanted_field)
 {
@@ -121,6 +129,27 @@ wanted_field_value_str(const struct event_field *wanted_field)
 	i_unreached();
 }
 
+void event_filter_node_init_value_str(struct event_filter_node *node,
+				      pool_t pool)
+{
+	if (node->value_str != NULL)
+		return;
+	if (node->field.value_type == EVENT_FIELD_VALUE_TYPE_STR)
+		node->value_str = node->field.value.str;
+	else T_BEGIN {
+		node->value_str = p_strdup(pool,
+			wanted_field_value_str(&node->field));
+	} T_END;
+}
+
+static const char *
+event_filter_node_value_str(const struct event_filter_node *node)
+{
+	if (node->value_str != NULL)
+		return node->value_str;
+	return wanted_field_value_str(&node->field);
+}
+
 /*
  * Look for an existing query with the same context pointer and return it.
  *
@@ -214,6 +243,7 @@ event_filter_parse_real(const char *str, struct event_filter *filter,
 
 		add_node(filter->pool, &int_query->expr, state.output,
 			 EVENT_FILTER_OP_OR);
+		event_filter_recompile(filter);
 
 		filter->named_queries_only = filter->named_queries_only &&
 			filter_node_requires_event_name(state.output);
@@ -409,6 +439,7 @@ event_filter_merge_with_context_internal(struct event_filter *dest,
 		dest->named_queries_only = dest->named_queries_only &&
 			filter_node_requires_event_name(int_query->expr);
 	} T_END;
+	event_filter_recompile(dest);
 }
 
 bool event_filter_remove_queries_with_context(struct event_filter *filter,
@@ -421,6 +452,7 @@ bool event_filter_remove_queries_with_context(struct event_filter *filter,
 		if (int_query->context == context) {
 			idx = array_foreach_idx(&filter->queries, int_query);
 			array_delete(&filter->queries, idx, 1);
+			event_filter_recompile(filter);
 			return TRUE;
 		}
 	}
@@ -653,13 +685,6 @@ cmp_str(const char *value, const char *wanted_value, enum cmp_flags flags)
 	}
 }
 
-static bool
-cmp_value(const char *value, const struct event_field *wanted_field,
-	  enum cmp_flags flags)
-{
-	return cmp_str(value, wanted_field_value_str(wanted_field), flags);
-}
-
 static bool
 event_match_strlist_recursive(struct event *event,
 			      const char *wanted_key, const char *wanted_value,
@@ -685,10 +710,11 @@ event_match_strlist_recursive(struct event *event,
 }
 
 static bool
-event_match_strlist(struct event *event, const struct event_field *wanted_field,
+event_match_strlist(struct event *event, const struct event_filter_node *node,
 		    enum cmp_flags cmp_flags)
 {
-	const char *wanted_value = wanted_field_value_str(wanted_field);
+	const struct event_field *wanted_field = &node->field;
+	const char *wanted_value = event_filter_node_value_str(node);
 	bool seen = FALSE;
 
 	if (event_match_strlist_recursive(event, wanted_field->key, wanted_value,
@@ -787,7 +813,9 @@ event_match_field(struct event *event, struct event_filter_node *node,
 				wanted_field->value.str[0] == '\0';
 		}
 		T_BEGIN {
-			ret = cmp_value(field->value.str, wanted_field, cmp_flags);
+			ret = cmp_str(field->value.str,
+				      event_filter_node_value_str(node),
+				      cmp_flags);
 		} T_END;
 		return ret;
 	case EVENT_FIELD_VALUE_TYPE_INTMAX:
@@ -851,7 +879,7 @@ event_match_field(struct event *event, struct event_filter_node *node,
 			i_snprintf(tmp, sizeof(tmp), "%jd", field->value.intmax);
 			T_BEGIN {
 				ret = wildcard_match_escaped_icase(tmp,
-					wanted_field_value_str(wanted_field));
+					event_filter_node_value_str(node));
 			} T_END;
 			return ret;
 		}
@@ -911,7 +939,7 @@ event_match_field(struct event *event, struct event_filter_node *node,
 		}
 		T_BEGIN {
 			ret = wildcard_match_escaped_icase(net_ip2addr(&field->value.ip),
-							   wanted_field_value_str(wanted_field));
+							   event_filter_node_value_str(node));
 		} T_END;
 		return ret;
 	case EVENT_FIELD_VALUE_TYPE_STRLIST:
@@ -933,18 +961,18 @@ event_match_field(struct event *event, struct event_filter_node *node,
 			return FALSE;
 		}
 		T_BEGIN {
-			ret = event_match_strlist(event, wanted_field, cmp_flags);
+			ret = event_match_strlist(event, node, cmp_flags);
 		} T_END;
 		return ret;
 	}
 	i_unreached();
 }
 
-static bool
-event_filter_query_match_cmp(struct event_filter_node *node,
-			     struct event *event, const char *source_filename,
-			     unsigned int source_linenum,
-			     enum event_filter_log_type log_type)
+bool event_filter_query_match_cmp(struct event_filter_node *node,
+				  struct event *event,
+				  const char *source_filename,
+				  unsigned int source_linenum,
+				  enum event_filter_log_type log_type)
 {
 	i_assert((node->op == EVENT_FILTER_OP_CMP_EQ) ||
 		 (node->op == EVENT_FILTER_OP_CMP_GT) ||
@@ -1022,19 +1050,36 @@ event_filter_query_match_eval(struct event_filter_node *node,
 	i_unreached();
 }
 
+static enum event_filter_log_type
+event_filter_get_log_type(const struct failure_context *ctx)
+{
+	i_assert(ctx->type < N_ELEMENTS(event_filter_log_type_map));
+	return event_filter_log_type_map[ctx->type].log_type;
+}
+
 static bool
 event_filter_query_match(const struct event_filter_query_internal *query,
 			 struct event *event, const char *source_filename,
 			 unsigned int source_linenum,
 			 const struct failure_context *ctx)
 {
-	enum event_filter_log_type log_type;
+	return event_filter_query_match_eval(query->expr, event, source_filename,
+					     source_linenum,
+					     event_filter_get_log_type(ctx));
+}
 
-	i_assert(ctx->type < N_ELEMENTS(event_filter_log_type_map));
-	log_type = event_filter_log_type_map[ctx->type].log_type;
+static struct event_filter_program *
+event_filter_get_program(struct event_filter *filter)
+{
+	if (event_filter_program_disabled)
+		return NULL;
+	/* NULL only if there are no queries */
+	return filter->program;
+}
 
-	return event_filter_query_match_eval(query->expr, event, source_filename,
-					     source_linenum, log_type);
+void event_filter_set_program_disabled_for_testing(bool disabled)
+{
+	event_filter_program_disabled = disabled;
 }
 
 static bool
@@ -1064,12 +1109,24 @@ bool event_filter_match_source(struct event_filter *filter, struct event *event,
 			       const struct failure_context *ctx)
 {
 	const struct event_filter_query_internal *query;
+	struct event_filter_program *program;
 
 	i_assert(!filter->fragment);
 
 	if (!event_filter_match_fastpath(filter, event))
 		return FALSE;
 
+	program = event_filter_get_program(filter);
+	if (program != NULL) {
+		struct event_filter_program_iter iter;
+		void *context;
+
+		event_filter_program_iter_init(&iter, program, event,
+					       source_filename, source_linenum,
+					       event_filter_get_log_type(ctx));
+		return event_filter_program_iter_next(&iter, FALSE, &context);
+	}
+
 	array_foreach(&filter->queries, query) {
 		if (event_filter_query_match(query, event, source_filename,
 					     source_linenum, ctx))
@@ -1083,6 +1140,10 @@ struct event_filter_match_iter {
 	struct event *event;
 	const struct failure_context *failure_ctx;
 	unsigned int idx;
+
+	/* NULL if matching without the compiled program */
+	struct event_filter_program *program;
+	struct event_filter_program_iter program_iter;
 };
 
 struct event_filter_match_iter *
@@ -1099,6 +1160,16 @@ event_filter_match_iter_init(struct event_filter *filter, struct event *event,
 	iter->failure_ctx = ctx;
 	if (!event_filter_match_fastpath(filter, event))
 		iter->idx = UINT_MAX;
+	else if ((iter->program = event_filter_get_program(filter)) != NULL) {
+		/* the program may get freed while iterating if the filter
+		   changes */
+		event_filter_program_ref(iter->program);
+		event_filter_program_iter_init(&iter->program_iter,
+					       iter->program, event,
+					       event->source_filename,
+					       event->source_linenum,
+					       event_filter_get_log_type(ctx));
+	}
 	return iter;
 }
 
@@ -1106,6 +1177,14 @@ void *event_filter_match_iter_next(struct event_filter_match_iter *iter)
 {
 	const struct event_filter_query_internal *queries;
 	unsigned int count;
+	void *context;
+
+	if (iter->program != NULL) {
+		if (!event_filter_program_iter_next(&iter->program_iter,
+						    TRUE, &context))
+			return NULL;
+		return context;
+	}
 
 	queries = array_get(&iter->filter->queries, &count);
 	while (iter->idx < count) {
@@ -1128,6 +1207,7 @@ void event_filter_match_iter_deinit(struct event_filter_match_iter **_iter)
 	struct event_filter_match_iter *iter = *_iter;
 
 	*_iter = NULL;
+	event_filter_program_unref(&iter->program);
 	i_free(iter);
 }
 
@@ -1135,15 +1215,17 @@ static void
 event_filter_query_update_category(struct event_filter_query_internal *query,
 				   struct event_filter_node *node,
 				   struct event_category *category,
-				   bool add)
+				   bool add, bool *changed)
 {
 	if (node == NULL)
 		return;
 
 	switch (node->type) {
 	case EVENT_FILTER_NODE_TYPE_LOGIC:
-		event_filter_query_update_category(query, node->children[0], category, add);
-		event_filter_query_update_category(query, node->children[1], category, add);
+		event_filter_query_update_category(query, node->children[0],
+						   category, add, changed);
+		event_filter_query_update_category(query, node->children[1],
+						   category, add, changed);
 		break;
 	case EVENT_FILTER_NODE_TYPE_EVENT_NAME_EXACT:
 	case EVENT_FILTER_NODE_TYPE_EVENT_NAME_WILDCARD:
@@ -1160,11 +1242,15 @@ event_filter_query_update_category(struct event_filter_query_internal *query,
 			if (node->category.ptr != NULL)
 				break;
 
-			if (strcmp(node->category.name, category->name) == 0)
+			if (strcmp(node->category.name, category->name) == 0) {
 				node->category.ptr = category;
+				*changed = TRUE;
+			}
 		} else {
-			if (node->category.ptr == category)
+			if (node->category.ptr == category) {
 				node->category.ptr = NULL;
+				*changed = TRUE;
+			}
 		}
 		break;
 	}
@@ -1177,10 +1263,15 @@ static void event_filter_category_registered(struct event_category *category)
 	struct event_filter *filter;
 
 	for (filter = event_filters; filter != NULL; filter = filter->next) {
+		bool changed = FALSE;
+
 		array_foreach_modifiable(&filter->queries, query) {
 			event_filter_query_update_category(query, query->expr,
-							   category, add);
+							   category, add,
+							   &changed);
 		}
+		if (changed)
+			event_filter_recompile(filter);
 	}
 }
 
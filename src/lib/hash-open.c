@@ -0,0 +1,461 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "byteorder.h"
+#include "hash-private.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/*
+ * Open addressing hash table
+ * ==========================
+ *
+ * The keys and values are stored in a dense entries array in insertion
+ * order. The hash index is a Swiss table: an array of control bytes and a
+ * parallel array of entry indexes. Each control byte is either EMPTY,
+ * DELETED or the lowest 7 bits of the (mixed) hash of the entry in that
+ * slot. The slots are grouped into groups of HASH_OPEN_GROUP_WIDTH, and a
+ * lookup compares a whole group of control bytes at once (with SSE2, or
+ * 8 bytes at a time with plain 64bit integer operations). Only the slots
+ * whose control byte matches need their key compared. Lookups stop at the
+ * first group that has an EMPTY slot.
+ *
+ * Removing an entry only clears its key in the entries array, so
+ * iteration can simply walk through the entries array. Since iterators
+ * don't depend on the hash index, it can be rebuilt at any time, even
+ * while the table is frozen. The holes in the entries array are removed
+ * only while the table isn't frozen.
+ */
+
+#define HASH_OPEN_CTRL_EMPTY 0x80
+#define HASH_OPEN_CTRL_DELETED 0xfe
+
+#define HASH_OPEN_MIN_CAPACITY 16
+/* maximum number of used slots (including DELETED) */
+#define HASH_OPEN_MAX_FILL(capacity) ((capacity) / 8 * 7)
+
+#ifdef __SSE2__
+#  define HASH_OPEN_GROUP_WIDTH 16
+#  define HASH_OPEN_MASK_BITS_PER_SLOT 1
+typedef uint32_t hash_open_mask_t;
+
+static inline hash_open_mask_t
+hash_open_group_match(const uint8_t *ctrl, uint8_t h2)
+{
+	__m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)h2),
+						group));
+}
+
+static inline hash_open_mask_t hash_open_group_match_empty(const uint8_t *ctrl)
+{
+	return hash_open_group_match(ctrl, HASH_OPEN_CTRL_EMPTY);
+}
+
+static inline hash_open_mask_t hash_open_group_match_free(const uint8_t *ctrl)
+{
+	/* both EMPTY and DELETED have the highest bit set */
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+#  define HASH_OPEN_GROUP_WIDTH 8
+#  define HASH_OPEN_MASK_BITS_PER_SLOT 8
+typedef uint64_t hash_open_mask_t;
+
+#define HASH_OPEN_LSBS 0x0101010101010101ULL
+#define HASH_OPEN_MSBS 0x8080808080808080ULL
+
+static inline hash_open_mask_t ATTR_NO_SANITIZE_INTEGER
+hash_open_group_match(const uint8_t *ctrl, uint8_t h2)
+{
+	uint64_t x = le64_to_cpu_unaligned(ctrl) ^ (HASH_OPEN_LSBS * h2);
+
+	/* This may have false positives after a real match, but that's fine
+	   since the keys are compared anyway. */
+	return (x - HASH_OPEN_LSBS) & ~x & HASH_OPEN_MSBS;
+}
+
+static inline hash_open_mask_t hash_open_group_match_empty(const uint8_t *ctrl)
+{
+	uint64_t group = le64_to_cpu_unaligned(ctrl);
+
+	/* EMPTY is the only value with the highest bit set and bit 1 unset */
+	return group & ~(group << 6) & HASH_OPEN_MSBS;
+}
+
+static inline hash_open_mask_t hash_open_group_match_free(const uint8_t *ctrl)
+{
+	uint64_t group = le64_to_cpu_unaligned(ctrl);
+
+	/* EMPTY and DELETED have the highest bit set and bit 0 unset */
+	return group & ~(group << 7) & HASH_OPEN_MSBS;
+}
+#endif
+
+struct hash_open_entry {
+	/* NULL if the entry has been removed */
+	void *key;
+	void *value;
+	unsigned int hash;
+};
+
+struct hash_open {
+	/* capacity number of control bytes and entry indexes */
+	uint8_t *ctrl;
+	unsigned int *slots;
+	unsigned int capacity, min_capacity;
+	/* Number of EMPTY slots that can still be used before the index
+	   must be rebuilt */
+	unsigned int growth_left;
+
+	struct hash_open_entry *entries;
+	unsigned int entries_count, entries_alloc;
+	/* Number of removed entries in the entries array */
+	unsigned int holes;
+};
+
+static inline unsigned int hash_open_mask_next(hash_open_mask_t *mask)
+{
+	unsigned int bit;
+
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4)
+	bit = __builtin_ctzll(*mask);
+#else
+	for (bit = 0; (*mask & ((hash_open_mask_t)1 << bit)) == 0; bit++) ;
+#endif
+	*mask &= *mask - 1;
+	return bit / HASH_OPEN_MASK_BITS_PER_SLOT;
+}
+
+static inline uint64_t ATTR_NO_SANITIZE_INTEGER
+	ATTR_NO_SANITIZE_IMPLICIT_CONVERSION
+hash_open_mix(unsigned int hash)
+{
+	/* The hash callbacks (especially the direct hash) don't necessarily
+	   spread the bits well. Use the high bits of a multiplicative
+	   hash. */
+	return (uint64_t)hash * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint8_t hash_open_h2(uint64_t mixed)
+{
+	return mixed >> 57;
+}
+
+static inline unsigned int
+hash_open_first_group(const struct hash_open *open, uint64_t mixed)
+{
+	return (unsigned int)(mixed >> 32) &
+		(open->capacity / HASH_OPEN_GROUP_WIDTH - 1);
+}
+
+static inline unsigned int
+hash_open_next_group(const struct hash_open *open, unsigned int group,
+		     unsigned int *step)
+{
+	/* triangular probing visits all the groups when the group count
+	   is a power of 2 */
+	return (group + ++*step) & (open->capacity / HASH_OPEN_GROUP_WIDTH - 1);
+}
+
+static unsigned int hash_open_capacity_for(unsigned int count)
+{
+	unsigned int capacity = HASH_OPEN_MIN_CAPACITY;
+
+	while (HASH_OPEN_MAX_FILL(capacity) < count) {
+		i_assert(capacity < UINT_MAX / 2);
+		capacity *= 2;
+	}
+	return capacity;
+}
+
+static unsigned int
+hash_open_lookup_slot(const struct hash_table *table, const void *key,
+		      unsigned int hash)
+{
+	const struct hash_open *open = table->open;
+	const struct hash_open_entry *entry;
+	uint64_t mixed = hash_open_mix(hash);
+	uint8_t h2 = hash_open_h2(mixed);
+	unsigned int group, step = 0, slot;
+	hash_open_mask_t mask;
+
+	group = hash_open_first_group(open, mixed);
+	for (;;) {
+		const uint8_t *ctrl = open->ctrl + group * HASH_OPEN_GROUP_WIDTH;
+
+		mask = hash_open_group_match(ctrl, h2);
+		while (mask != 0) {
+			slot = group * HASH_OPEN_GROUP_WIDTH +
+				hash_open_mask_next(&mask);
+			if (open->ctrl[slot] != h2)
+				continue;
+			entry = &open->entries[open->slots[slot]];
+			if (entry->hash == hash &&
+			    table->key_compare_cb(entry->key, key) == 0)
+				return slot;
+		}
+		/* there's always at least one EMPTY slot, so this ends */
+		if (hash_open_group_match_empty(ctrl) != 0)
+			return UINT_MAX;
+		group = hash_open_next_group(open, group, &step);
+	}
+}
+
+static unsigned int
+hash_open_find_free_slot(const struct hash_open *open, uint64_t mixed)
+{
+	unsigned int group, step = 0;
+	hash_open_mask_t mask;
+
+	group = hash_open_first_group(open, mixed);
+	for (;;) {
+		mask = hash_open_group_match_free(open->ctrl +
+						  group * HASH_OPEN_GROUP_WIDTH);
+		if (mask != 0) {
+			return group * HASH_OPEN_GROUP_WIDTH +
+				hash_open_mask_next(&mask);
+		}
+		group = hash_open_next_group(open, group, &step);
+	}
+}
+
+static void hash_open_rehash(struct hash_table *table, unsigned int capacity)
+{
+	struct hash_open *open = table->open;
+	unsigned int i, slot;
+	uint64_t mixed;
+
+	i_assert(table->nodes_count <= HASH_OPEN_MAX_FILL(capacity));
+
+	if (capacity != open->capacity) {
+		i_free(open->ctrl);
+		i_free(open->slots);
+		open->ctrl = i_malloc(capacity);
+		open->slots = i_new(unsigned int, capacity);
+		open->capacity = capacity;
+	}
+	memset(open->ctrl, HASH_OPEN_CTRL_EMPTY, capacity);
+	open->growth_left = HASH_OPEN_MAX_FILL(capacity) - table->nodes_count;
+
+	for (i = 0; i < open->entries_count; i++) {
+		if (open->entries[i].key == NULL)
+			continue;
+		mixed = hash_open_mix(open->entries[i].hash);
+		slot = hash_open_find_free_slot(open, mixed);
+		open->ctrl[slot] = hash_open_h2(mixed);
+		open->slots[slot] = i;
+	}
+}
+
+static void hash_open_entries_compress(struct hash_open *open)
+{
+	unsigned int i, j;
+
+	for (i = j = 0; i < open->entries_count; i++) {
+		if (open->entries[i].key != NULL)
+			open->entries[j++] = open->entries[i];
+	}
+	open->entries_count = j;
+	open->holes = 0;
+}
+
+static void hash_open_entries_resize(struct hash_open *open,
+				     unsigned int new_alloc)
+{
+	i_assert(new_alloc >= open->entries_count);
+
+	open->entries = i_realloc_type(open->entries, struct hash_open_entry,
+				       open->entries_alloc, new_alloc);
+	open->entries_alloc = new_alloc;
+}
+
+static void hash_open_compress(struct hash_table *table, bool force)
+{
+	struct hash_open *open = table->open;
+	unsigned int new_capacity = open->capacity;
+	unsigned int count = table->nodes_count;
+
+	i_assert(table->frozen == 0);
+
+	if (open->capacity > open->min_capacity &&
+	    count < open->capacity / 8) {
+		new_capacity = I_MAX(hash_open_capacity_for(count + count/2 + 1),
+				     open->min_capacity);
+	}
+	if (!force && open->holes <= open->entries_count / 2 &&
+	    new_capacity == open->capacity)
+		return;
+
+	hash_open_entries_compress(open);
+	if (new_capacity < open->capacity) {
+		hash_open_entries_resize(open,
+			HASH_OPEN_MAX_FILL(new_capacity));
+	}
+	hash_open_rehash(table, new_capacity);
+}
+
+void hash_open_init(struct hash_table *table)
+{
+	struct hash_open *open;
+
+	open = table->open = i_new(struct hash_open, 1);
+	open->min_capacity = hash_open_capacity_for(table->initial_size);
+	open->entries_alloc = HASH_OPEN_MAX_FILL(open->min_capacity);
+	open->entries = i_new(struct hash_open_entry, open->entries_alloc);
+	hash_open_rehash(table, open->min_capacity);
+}
+
+void hash_open_deinit(struct hash_table *table)
+{
+	struct hash_open *open = table->open;
+
+	i_free(open->entries);
+	i_free(open->slots);
+	i_free(open->ctrl);
+	i_free(table->open);
+}
+
+void hash_open_clear(struct hash_table *table)
+{
+	struct hash_open *open = table->open;
+
+	table->nodes_count = 0;
+	open->entries_count = 0;
+	open->holes = 0;
+	hash_open_rehash(table, open->capacity);
+}
+
+bool hash_open_lookup(const struct hash_table *table, const void *key,
+		      void **orig_key_r, void **value_r)
+{
+	const struct hash_open *open = table->open;
+	const struct hash_open_entry *entry;
+	unsigned int slot;
+
+	slot = hash_open_lookup_slot(table, key, table->hash_cb(key));
+	if (slot == UINT_MAX)
+		return FALSE;
+	entry = &open->entries[open->slots[slot]];
+	*orig_key_r = entry->key;
+	*value_r = entry->value;
+	return TRUE;
+}
+
+void hash_open_insert(struct hash_table *table, void *key, void *value,
+		      bool update)
+{
+	struct hash_open *open = table->open;
+	struct hash_open_entry *entry;
+	unsigned int hash, slot, count = table->nodes_count;
+	uint64_t mixed;
+
+	i_assert(table->nodes_count < UINT_MAX);
+	i_assert(key != NULL);
+
+	hash = table->hash_cb(key);
+	slot = hash_open_lookup_slot(table, key, hash);
+	if (slot != UINT_MAX) {
+		i_assert(update);
+		open->entries[open->slots[slot]].value = value;
+		return;
+	}
+
+	if (open->entries_count == open->entries_alloc) {
+		if (table->frozen == 0 && open->holes > 0)
+			hash_open_compress(table, TRUE);
+		else {
+			hash_open_entries_resize(open,
+				I_MAX(open->entries_alloc * 2,
+				      HASH_OPEN_MAX_FILL(HASH_OPEN_MIN_CAPACITY)));
+		}
+	}
+
+	mixed = hash_open_mix(hash);
+	slot = hash_open_find_free_slot(open, mixed);
+	if (open->ctrl[slot] == HASH_OPEN_CTRL_EMPTY) {
+		if (open->growth_left == 0) {
+			/* Either grow, or just get rid of the DELETED slots
+			   if there are many of them. */
+			hash_open_rehash(table,
+				hash_open_capacity_for(count + count/2 + 1));
+			slot = hash_open_find_free_slot(open, mixed);
+		}
+		i_assert(open->ctrl[slot] == HASH_OPEN_CTRL_EMPTY);
+		open->growth_left--;
+	}
+	open->ctrl[slot] = hash_open_h2(mixed);
+	open->slots[slot] = open->entries_count;
+
+	entry = &open->entries[open->entries_count++];
+	entry->key = key;
+	entry->value = value;
+	entry->hash = hash;
+	table->nodes_count++;
+}
+
+bool hash_open_try_remove(struct hash_table *table, const void *key)
+{
+	struct hash_open *open = table->open;
+	struct hash_open_entry *entry;
+	unsigned int slot, idx;
+	const uint8_t *group_ctrl;
+
+	slot = hash_open_lookup_slot(table, key, table->hash_cb(key));
+	if (unlikely(slot == UINT_MAX))
+		return FALSE;
+
+	idx = open->slots[slot];
+	entry = &open->entries[idx];
+	entry->key = NULL;
+	entry->value = NULL;
+	table->nodes_count--;
+	if (idx == open->entries_count - 1 && table->frozen == 0)
+		open->entries_count--;
+	else
+		open->holes++;
+
+	/* If the group already has an EMPTY slot, lookups never continue
+	   past it, so this slot can become EMPTY as well. */
+	group_ctrl = open->ctrl + slot / HASH_OPEN_GROUP_WIDTH *
+		HASH_OPEN_GROUP_WIDTH;
+	if (hash_open_group_match_empty(group_ctrl) != 0) {
+		open->ctrl[slot] = HASH_OPEN_CTRL_EMPTY;
+		open->growth_left++;
+	} else {
+		open->ctrl[slot] = HASH_OPEN_CTRL_DELETED;
+	}
+
+	if (table->frozen == 0)
+		hash_open_compress(table, FALSE);
+	return TRUE;
+}
+
+bool hash_open_iterate(struct hash_iterate_context *ctx,
+		       void **key_r, void **value_r)
+{
+	const struct hash_open *open = ctx->table->open;
+	const struct hash_open_entry *entry;
+
+	for (; ctx->pos < open->entries_count; ctx->pos++) {
+		entry = &open->entries[ctx->pos];
+		if (entry->key != NULL) {
+			*key_r = entry->key;
+			*value_r = entry->value;
+			ctx->pos++;
+			return TRUE;
+		}
+	}
+	*key_r = *value_r = NULL;
+	return FALSE;
+}
+
+void hash_open_thaw(struct hash_table *table)
+{
+	hash_open_compress(table, FALSE);
+}
@@ -0,0 +1,51 @@
+#ifndef HASH_PRIVATE_H
+#define HASH_PRIVATE_H
+
+#include "hash.h"
+
+struct hash_node {
+	struct hash_node *next;
+	void *key;
+	void *value;
+};
+
+struct hash_table {
+	pool_t node_pool;
+
+	int frozen;
+	unsigned int initial_size, nodes_count, removed_count;
+
+	unsigned int size;
+	struct hash_node *nodes;
+	struct hash_node *free_nodes;
+
+	hash_callback_t *hash_cb;
+	hash_cmp_callback_t *key_compare_cb;
+
+	/* Non-NULL if the table was created with hash_table_create_open().
+	   Only frozen, initial_size, nodes_count and the callbacks above are
+	   used then. */
+	struct hash_open *open;
+};
+
+struct hash_iterate_context {
+	struct hash_table *table;
+	struct hash_node *next;
+	unsigned int pos;
+};
+
+void hash_open_init(struct hash_table *table);
+void hash_open_deinit(struct hash_table *table);
+void hash_open_clear(struct hash_table *table);
+
+bool hash_open_lookup(const struct hash_table *table, const void *key,
+		      void **orig_key_r, void **value_r);
+void hash_open_insert(struct hash_table *table, void *key, void *value,
+		      bool update);
+bool hash_open_try_remove(struct hash_table *table, const void *key);
+
+bool hash_open_iterate(struct hash_iterate_context *ctx,
+		       void **key_r, void **value_r);
+void hash_open_thaw(struct hash_table *table);
+
+#endif
@@ -3,7 +3,7 @@
 /* @UNSAFE: whole file */
 
 #include "lib.h"
-#include "hash.h"
+#include "hash-private.h"
 #include "primes.h"
 
 #include <ctype.h>
@@ -12,6 +12,8 @@
 
 #undef hash_table_create
 #undef hash_table_create_direct
+#undef hash_table_create_open
+#undef hash_table_create_open_direct
 #undef hash_table_destroy
 #undef hash_table_clear
 #undef hash_table_lookup
@@ -26,32 +28,6 @@
 #undef hash_table_thaw
 #undef hash_table_copy
 
-struct hash_node {
-	struct hash_node *next;
-	void *key;
-	void *value;
-};
-
-struct hash_table {
-	pool_t node_pool;
-
-	int frozen;
-	unsigned int initial_size, nodes_count, removed_count;
-
-	unsigned int size;
-	struct hash_node *nodes;
-	struct hash_node *free_nodes;
-
-	hash_callback_t *hash_cb;
-	hash_cmp_callback_t *key_compare_cb;
-};
-
-struct hash_iterate_context {
-	struct hash_table *table;
-	struct hash_node *next;
-	unsigned int pos;
-};
-
 enum hash_table_operation{
 	HASH_TABLE_OP_INSERT,
 	HASH_TABLE_OP_UPDATE,
@@ -98,6 +74,31 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
+void hash_table_create_open(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size, hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_table *table;
+
+	pool_ref(node_pool);
+	table = i_new(struct hash_table, 1);
+	table->node_pool = node_pool;
+	table->initial_size = initial_size;
+
+	table->hash_cb = hash_cb;
+	table->key_compare_cb = key_compare_cb;
+
+	hash_open_init(table);
+	*table_r = table;
+}
+
+void hash_table_create_open_direct(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size)
+{
+	hash_table_create_open(table_r, node_pool, initial_size,
+			       direct_hash, direct_cmp);
+}
+
 static void free_node(struct hash_table *table, struct hash_node *node)
 {
 	if (!table->node_pool->alloconly_pool)
@@ -139,7 +140,9 @@ void hash_table_destroy(struct hash_table **_table)
 
 	i_assert(table->frozen == 0);
 
-	if (!table->node_pool->alloconly_pool) {
+	if (table->open != NULL)
+		hash_open_deinit(table);
+	else if (!table->node_pool->alloconly_pool) {
 		hash_table_destroy_nodes(table);
 		destroy_node_list(table, table->free_nodes);
 	}
@@ -153,6 +156,11 @@ void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
 	i_assert(table->frozen == 0);
 
+	if (table->open != NULL) {
+		hash_open_clear(table);
+		return;
+	}
+
 	if (!table->node_pool->alloconly_pool)
 		hash_table_destroy_nodes(table);
 
@@ -191,6 +199,14 @@ void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
 
+	if (table->open != NULL) {
+		void *orig_key, *value;
+
+		if (!hash_open_lookup(table, key, &orig_key, &value))
+			return NULL;
+		return value;
+	}
+
 	node = hash_table_lookup_node(table, key, table->hash_cb(key));
 	return node != NULL ? node->value : NULL;
 }
@@ -201,6 +217,9 @@ bool hash_table_lookup_full(const struct hash_table *table,
 {
 	struct hash_node *node;
 
+	if (table->open != NULL)
+		return hash_open_lookup(table, lookup_key, orig_key, value);
+
 	node = hash_table_lookup_node(table, lookup_key,
 				      table->hash_cb(lookup_key));
 	if (node == NULL)
@@ -297,11 +316,19 @@ hash_table_insert_node(struct hash_table *table, void *key, void *value,
 
 void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
+	if (table->open != NULL) {
+		hash_open_insert(table, key, value, FALSE);
+		return;
+	}
 	hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
+	if (table->open != NULL) {
+		hash_open_insert(table, key, value, TRUE);
+		return;
+	}
 	hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
 }
 
@@ -347,6 +374,9 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 	struct hash_node *node;
 	unsigned int hash;
 
+	if (table->open != NULL)
+		return hash_open_try_remove(table, key);
+
 	hash = table->hash_cb(key);
 
 	node = hash_table_lookup_node(table, key, hash);
@@ -376,7 +406,8 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
+	if (table->open == NULL)
+		ctx->next = &table->nodes[0];
 	return ctx;
 }
 
@@ -403,6 +434,9 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 {
 	struct hash_node *node;
 
+	if (ctx->table->open != NULL)
+		return hash_open_iterate(ctx, key_r, value_r);
+
 	node = ctx->next;
 	if (node != NULL && node->key == NULL)
 		node = hash_table_iterate_next(ctx, node);
@@ -441,6 +475,11 @@ void hash_table_thaw(struct hash_table *table)
 	if (--table->frozen > 0)
 		return;
 
+	if (table->open != NULL) {
+		hash_open_thaw(table);
+		return;
+	}
+
 	if (table->removed_count > 0) {
 		if (!hash_table_resize(table, FALSE))
 			hash_table_compress_removed(table);
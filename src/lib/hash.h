@@ -22,8 +22,7 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size,
 		       hash_callback_t *hash_cb,
 		       hash_cmp_callback_t *key_compare_cb);
-#define hash_table_create(table, pool, size, hash_cb, key_cmp_cb) \
-	TYPE_CHECKS(void, \
+#define HASH_TABLE_CREATE_TYPE_CHECKS(table, hash_cb, key_cmp_cb) \
 	/* NOLINTBEGIN(bugprone-sizeof-expression) */ \
 	COMPILE_ERROR_IF_TRUE( \
 		sizeof((*table)._key) != sizeof(void *) || \
@@ -37,8 +36,11 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		!__builtin_types_compatible_p(typeof(&hash_cb), \
 			unsigned int (*)(typeof((*table)._key))) && \
 		!__builtin_types_compatible_p(typeof(&hash_cb), \
-		unsigned int (*)(typeof((*table)._const_key)))), \
-	/* NOLINTEND(bugprone-sizeof-expression) */ \
+		unsigned int (*)(typeof((*table)._const_key)))) \
+	/* NOLINTEND(bugprone-sizeof-expression) */
+#define hash_table_create(table, pool, size, hash_cb, key_cmp_cb) \
+	TYPE_CHECKS(void, \
+	HASH_TABLE_CREATE_TYPE_CHECKS(table, hash_cb, key_cmp_cb), \
 	hash_table_create(&(*table)._table, pool, size, \
 		(hash_callback_t *)hash_cb, \
 		(hash_cmp_callback_t *)key_cmp_cb))
@@ -55,6 +57,33 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 	/* NOLINTEND(bugprone-sizeof-expression) */ \
 	hash_table_create_direct(&(*table)._table, pool, size))
 
+/* Create a hash table using open addressing instead of chaining. The keys
+   and values are stored in a single array, and the hash index uses SIMD
+   probing, so lookups do much less pointer chasing than with
+   hash_table_create(). This is faster for large tables, but all the memory
+   is allocated from the system pool; node_pool isn't used. The API works
+   identically for both table types. */
+void hash_table_create_open(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size,
+			    hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb);
+#define hash_table_create_open(table, pool, size, hash_cb, key_cmp_cb) \
+	TYPE_CHECKS(void, \
+	HASH_TABLE_CREATE_TYPE_CHECKS(table, hash_cb, key_cmp_cb), \
+	hash_table_create_open(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb))
+void hash_table_create_open_direct(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size);
+#define hash_table_create_open_direct(table, pool, size) \
+	TYPE_CHECKS(void, \
+	/* NOLINTBEGIN(bugprone-sizeof-expression) */ \
+	COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)), \
+	/* NOLINTEND(bugprone-sizeof-expression) */ \
+	hash_table_create_open_direct(&(*table)._table, pool, size))
+
 #define hash_table_is_created(table) \
 	((table)._table != NULL)
 
@@ -61,6 +61,41 @@ void io_loop_handler_deinit(struct ioloop *ioloop)
 #define IO_EPOLL_INPUT (EPOLLIN | EPOLLPRI | IO_EPOLL_ERROR)
 #define IO_EPOLL_OUTPUT	(EPOLLOUT | IO_EPOLL_ERROR)
 
+static int epoll_event_mask(struct io_list *list);
+
+void io_loop_recreate(struct ioloop *ioloop)
+{
+	if (ioloop == NULL ||
+	    ioloop->handler_context == NULL)
+		return;
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_list **list;
+	struct epoll_event event;
+	unsigned int fd, count;
+
+	/* After fork() the epoll instance is still shared with the parent
+	   process. Closing it here only drops our reference. */
+	if (close(ctx->epfd) < 0)
+		i_error("close(epoll) failed: %m");
+	ctx->epfd = epoll_create(array_count(&ctx->events) + 1);
+	if (ctx->epfd < 0)
+		i_fatal("epoll_create(): %m");
+	fd_close_on_exec(ctx->epfd, TRUE);
+
+	list = array_get_modifiable(&ctx->fd_index, &count);
+	for (fd = 0; fd < count; fd++) {
+		if (list[fd] == NULL)
+			continue;
+		i_zero(&event);
+		event.data.ptr = list[fd];
+		event.events = epoll_event_mask(list[fd]);
+		if (event.events == 0)
+			continue;
+		if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+			i_panic("epoll_ctl(add, %u) failed: %m", fd);
+	}
+}
+
 static int epoll_event_mask(struct io_list *list)
 {
 	int events = 0, i;
@@ -158,7 +193,7 @@ void io_loop_handle_remove(struct io_file *io, bool closed)
 		   instead of appending to the events array */
 		ctx->deleted_count++;
 	}
-	i_free(io);
+	ioloop_object_free(io);
 }
 
 void io_loop_handler_run_internal(struct ioloop *ioloop)
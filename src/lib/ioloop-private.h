@@ -2,6 +2,7 @@
 #define IOLOOP_PRIVATE_H
 
 #include "priorityq.h"
+#include "timing-wheel.h"
 #include "ioloop.h"
 #include "array-decl.h"
 
@@ -17,6 +18,9 @@ struct ioloop {
 	struct io_file *io_files;
 	struct io_file *next_io_file;
 	struct priorityq *timeouts;
+	/* Timeouts with msecs >= IOLOOP_TIMING_WHEEL_MIN_MSECS. They are
+	   reset often and don't need sub-millisecond precision. */
+	struct timing_wheel *timeouts_wheel;
 	ARRAY(struct timeout *) timeouts_new;
 	struct io_wait_timer *wait_timers;
 
@@ -69,6 +73,7 @@ struct io_file {
 
 struct timeout {
 	struct priorityq_item item;
+	struct timing_wheel_item wheel_item;
 	const char *source_filename;
 	unsigned int source_linenum;
 
@@ -114,6 +119,14 @@ void io_loop_call_io(struct io *io);
 
 void io_loop_handler_run_internal(struct ioloop *ioloop);
 
+/* Small ioloop objects (io_file, timeout, ioloop_context, io_wait_timer)
+   are allocated from the slab object pool, since they're frequently
+   created and destroyed. */
+#define ioloop_object_new(type) \
+	p_new(pool_slab_get_object_pool(), type, 1)
+#define ioloop_object_free(mem) \
+	p_free(pool_slab_get_object_pool(), mem)
+
 /* I/O handler calls */
 void io_loop_handle_add(struct io_file *io);
 void io_loop_handle_remove(struct io_file *io, bool closed);
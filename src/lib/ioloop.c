@@ -23,6 +23,11 @@
    10000ms, it might think it's okay to stop after 10100ms or more. So use
    a larger value for larger timeouts. */
 #define IOLOOP_TIME_MOVED_FORWARDS_MIN_USECS_LARGE (1000000)
+/* Timeouts of at least this many milliseconds are kept in a timing wheel
+   instead of the priority queue. These are typically idle/inactivity
+   timeouts that are reset constantly, which is O(1) with the wheel. Shorter
+   timeouts and absolute timeouts stay in the priority queue. */
+#define IOLOOP_TIMING_WHEEL_MIN_MSECS 1000
 
 time_t ioloop_time = 0;
 struct timeval ioloop_timeval;
@@ -56,7 +61,7 @@ io_add_file(struct ioloop *ioloop, int fd, enum io_condition condition,
 	i_assert(callback != NULL);
 	i_assert((condition & IO_NOTIFY) == 0);
 
-	io = i_new(struct io_file, 1);
+	io = ioloop_object_new(struct io_file);
         io->io.condition = condition;
 	io->io.callback = callback;
         io->io.context = context;
@@ -190,7 +195,7 @@ static void io_remove_full(struct io **_io, bool closed)
 		if (io_file->fd != -1)
 			io_loop_handle_remove(io_file, closed);
 		else
-			i_free(io);
+			ioloop_object_free(io_file);
 
 		/* remove io from the ioloop before unreferencing the istream,
 		   because a destroyed istream may automatically close the
@@ -259,6 +264,51 @@ static void timeout_update_next(struct timeout *timeout, struct timeval *tv_now)
 	}
 }
 
+static inline uint64_t timeval_to_wheel_msecs(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+static inline void
+wheel_msecs_to_timeval(uint64_t msecs, struct timeval *tv_r)
+{
+	tv_r->tv_sec = msecs / 1000;
+	tv_r->tv_usec = (msecs % 1000) * 1000;
+}
+
+static inline bool timeout_uses_wheel(const struct timeout *timeout)
+{
+	return !timeout->one_shot &&
+		timeout->msecs >= IOLOOP_TIMING_WHEEL_MIN_MSECS;
+}
+
+static inline bool timeout_is_queued(const struct timeout *timeout)
+{
+	return timeout->item.idx != UINT_MAX ||
+		timing_wheel_item_is_added(&timeout->wheel_item);
+}
+
+static void timeout_queue_add(struct timeout *timeout)
+{
+	if (timeout_uses_wheel(timeout)) {
+		timing_wheel_add(timeout->ioloop->timeouts_wheel,
+				 &timeout->wheel_item,
+				 timeval_to_wheel_msecs(&timeout->next_run));
+	} else {
+		priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	}
+}
+
+static void timeout_queue_remove(struct timeout *timeout)
+{
+	if (timing_wheel_item_is_added(&timeout->wheel_item)) {
+		timing_wheel_remove(timeout->ioloop->timeouts_wheel,
+				    &timeout->wheel_item);
+	} else {
+		priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
+	}
+}
+
 static struct timeout *
 timeout_add_common(struct ioloop *ioloop, const char *source_filename,
 		   unsigned int source_linenum,
@@ -266,8 +316,9 @@ timeout_add_common(struct ioloop *ioloop, const char *source_filename,
 {
 	struct timeout *timeout;
 
-	timeout = i_new(struct timeout, 1);
+	timeout = ioloop_object_new(struct timeout);
 	timeout->item.idx = UINT_MAX;
+	timing_wheel_item_init(&timeout->wheel_item);
 	timeout->source_filename = source_filename;
 	timeout->source_linenum = source_linenum;
 	timeout->ioloop = ioloop;
@@ -382,8 +433,8 @@ timeout_copy(const struct timeout *old_to, struct ioloop *ioloop)
 	new_to->msecs = old_to->msecs;
 	new_to->next_run = old_to->next_run;
 
-	if (old_to->item.idx != UINT_MAX)
-		priorityq_add(new_to->ioloop->timeouts, &new_to->item);
+	if (timeout_is_queued(old_to))
+		timeout_queue_add(new_to);
 	else if (!new_to->one_shot) {
 		i_assert(new_to->msecs > 0);
 		array_push_back(&new_to->ioloop->timeouts_new, &new_to);
@@ -396,7 +447,7 @@ static void timeout_free(struct timeout *timeout)
 {
 	if (timeout->ctx != NULL)
 		io_loop_context_unref(&timeout->ctx);
-	i_free(timeout);
+	ioloop_object_free(timeout);
 }
 
 void timeout_remove(struct timeout **_timeout)
@@ -410,8 +461,8 @@ void timeout_remove(struct timeout **_timeout)
 	ioloop = timeout->ioloop;
 
 	*_timeout = NULL;
-	if (timeout->item.idx != UINT_MAX)
-		priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
+	if (timeout_is_queued(timeout))
+		timeout_queue_remove(timeout);
 	else if (!timeout->one_shot && timeout->msecs > 0) {
 		struct timeout *const *to_idx;
 		array_foreach(&ioloop->timeouts_new, to_idx) {
@@ -428,7 +479,7 @@ void timeout_remove(struct timeout **_timeout)
 static void ATTR_NULL(2)
 timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 {
-	if (timeout->item.idx == UINT_MAX)
+	if (!timeout_is_queued(timeout))
 		return;
 
 	timeout_update_next(timeout, tv_now);
@@ -445,8 +496,8 @@ timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 		timeout->next_run = *tv_now;
 		timeval_add_usecs(&timeout->next_run, 1);
 	}
-	priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
-	priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	timeout_queue_remove(timeout);
+	timeout_queue_add(timeout);
 }
 
 void timeout_reset(struct timeout *timeout)
@@ -455,8 +506,9 @@ void timeout_reset(struct timeout *timeout)
 	timeout_reset_timeval(timeout, NULL);
 }
 
-static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
-				 struct timeval *tv_now, bool in_timeout_loop)
+static int timeout_get_wait_time(const struct timeval *next_run,
+				 struct timeval *tv_r, struct timeval *tv_now,
+				 bool in_timeout_loop)
 {
 	int ret;
 
@@ -466,10 +518,10 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 	tv_r->tv_usec = tv_now->tv_usec;
 
 	i_assert(tv_r->tv_sec > 0);
-	i_assert(timeout->next_run.tv_sec > 0);
+	i_assert(next_run->tv_sec > 0);
 
-	tv_r->tv_sec = timeout->next_run.tv_sec - tv_r->tv_sec;
-	tv_r->tv_usec = timeout->next_run.tv_usec - tv_r->tv_usec;
+	tv_r->tv_sec = next_run->tv_sec - tv_r->tv_sec;
+	tv_r->tv_usec = next_run->tv_usec - tv_r->tv_usec;
 	if (tv_r->tv_usec < 0) {
 		tv_r->tv_sec--;
 		tv_r->tv_usec += 1000000;
@@ -498,18 +550,35 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 
 static int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 {
-	struct timeval tv_now;
+	struct timeval tv_now, wheel_next_run;
 	struct priorityq_item *item;
 	struct timeout *timeout;
+	const struct timeval *next_run = NULL;
+	uint64_t wheel_next_msecs;
 	int msecs;
 
 	item = priorityq_peek(ioloop->timeouts);
 	timeout = (struct timeout *)item;
+	if (timeout != NULL)
+		next_run = &timeout->next_run;
+
+	/* The wheel may return an earlier time than its first timeout's
+	   next_run, so we may wake up once or twice too early for long
+	   timeouts. That's harmless. */
+	wheel_next_msecs = timing_wheel_get_next_msecs(ioloop->timeouts_wheel);
+	if (wheel_next_msecs != UINT64_MAX) {
+		wheel_msecs_to_timeval(wheel_next_msecs, &wheel_next_run);
+		if (next_run == NULL ||
+		    timeval_cmp(&wheel_next_run, next_run) < 0) {
+			next_run = &wheel_next_run;
+			timeout = NULL;
+		}
+	}
 
 	/* we need to see if there are pending IO waiting,
 	   if there is, we set msecs = 0 to ensure they are
 	   processed without delay */
-	if (timeout == NULL && ioloop->io_pending_count == 0) {
+	if (next_run == NULL && ioloop->io_pending_count == 0) {
 		/* no timeouts. use INT_MAX msecs for timeval and
 		   return -1 for poll/epoll infinity. */
 		tv_r->tv_sec = INT_MAX / 1000;
@@ -526,7 +595,7 @@ static int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 		tv_r->tv_usec = 0;
 	} else {
 		tv_now.tv_sec = 0;
-		msecs = timeout_get_wait_time(timeout, tv_r, &tv_now, FALSE);
+		msecs = timeout_get_wait_time(next_run, tv_r, &tv_now, FALSE);
 	}
 	ioloop->next_max_time = tv_now;
 	timeval_add_msecs(&ioloop->next_max_time, msecs);
@@ -536,7 +605,8 @@ static int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 	   ioloop and after that we update ioloop_timeval immediately again. */
 	ioloop_timeval = tv_now;
 	ioloop_time = tv_now.tv_sec;
-	i_assert(msecs == 0 || timeout->msecs > 0 || timeout->one_shot);
+	i_assert(msecs == 0 || timeout == NULL ||
+		 timeout->msecs > 0 || timeout->one_shot);
 	return msecs;
 }
 
@@ -592,11 +662,20 @@ static void io_loop_timeouts_start_new(struct ioloop *ioloop)
 		i_assert(!timeout->one_shot);
 		i_assert(timeout->msecs > 0);
 		timeout_update_next(timeout, &ioloop_timeval);
-		priorityq_add(ioloop->timeouts, &timeout->item);
+		timeout_queue_add(timeout);
 	}
 	array_clear(&ioloop->timeouts_new);
 }
 
+static void
+io_loop_timeouts_wheel_update(struct timing_wheel_item *item,
+			      void *context ATTR_UNUSED)
+{
+	struct timeout *to = container_of(item, struct timeout, wheel_item);
+
+	wheel_msecs_to_timeval(item->expire_msecs, &to->next_run);
+}
+
 static void io_loop_timeouts_update(struct ioloop *ioloop, long long diff_usecs)
 {
 	struct priorityq_item *const *items;
@@ -612,6 +691,8 @@ static void io_loop_timeouts_update(struct ioloop *ioloop, long long diff_usecs)
 		else
 			timeval_sub_usecs(&to->next_run, -diff_usecs);
 	}
+	timing_wheel_shift(ioloop->timeouts_wheel, diff_usecs / 1000,
+			   io_loop_timeouts_wheel_update, NULL);
 }
 
 static void io_loops_timeouts_update(long long diff_usecs)
@@ -640,10 +721,39 @@ static void ioloop_add_wait_time(struct ioloop *ioloop)
 		timer->usecs += diff;
 }
 
-static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
+static struct timeout *
+io_loop_get_expired_timeout(struct ioloop *ioloop, struct timeval *tv_call)
 {
 	struct priorityq_item *item;
-	struct timeval tv_old, tv, tv_call;
+	struct timing_wheel_item *wheel_item;
+	struct timeout *timeout = NULL, *wheel_timeout;
+	struct timeval tv;
+
+	/* use tv_call to make sure we don't get to infinite loop in
+	   case callbacks update ioloop_timeval. */
+	item = priorityq_peek(ioloop->timeouts);
+	if (item != NULL &&
+	    timeout_get_wait_time(&((struct timeout *)item)->next_run,
+				  &tv, tv_call, TRUE) == 0)
+		timeout = (struct timeout *)item;
+
+	wheel_item = timing_wheel_peek_expired(ioloop->timeouts_wheel,
+					       timeval_to_wheel_msecs(tv_call));
+	if (wheel_item != NULL) {
+		wheel_timeout = container_of(wheel_item, struct timeout,
+					     wheel_item);
+		if (timeout == NULL ||
+		    timeval_cmp(&wheel_timeout->next_run,
+				&timeout->next_run) < 0)
+			timeout = wheel_timeout;
+	}
+	return timeout;
+}
+
+static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
+{
+	struct timeout *timeout;
+	struct timeval tv_old, tv_call;
 	long long diff_usecs;
 	data_stack_frame_t t_id;
 
@@ -679,14 +789,7 @@ static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 	tv_call = ioloop_timeval;
 
 	while (ioloop->running &&
-	       (item = priorityq_peek(ioloop->timeouts)) != NULL) {
-		struct timeout *timeout = (struct timeout *)item;
-
-		/* use tv_call to make sure we don't get to infinite loop in
-		   case callbacks update ioloop_timeval. */
-		if (timeout_get_wait_time(timeout, &tv, &tv_call, TRUE) > 0)
-			break;
-
+	       (timeout = io_loop_get_expired_timeout(ioloop, &tv_call)) != NULL) {
 		if (timeout->one_shot) {
 			/* remove timeout from queue */
 			priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
@@ -850,6 +953,8 @@ struct ioloop *io_loop_create(void)
 
         ioloop = i_new(struct ioloop, 1);
 	ioloop->timeouts = priorityq_init(timeout_cmp, 32);
+	ioloop->timeouts_wheel =
+		timing_wheel_init(timeval_to_wheel_msecs(&ioloop_timeval));
 	i_array_init(&ioloop->timeouts_new, 8);
 
 	ioloop->time_moved_callback = current_ioloop != NULL ?
@@ -866,6 +971,7 @@ void io_loop_destroy(struct ioloop **_ioloop)
 	struct ioloop *ioloop = *_ioloop;
 	struct timeout *to;
 	struct priorityq_item *item;
+	struct timing_wheel_item *wheel_item;
 	bool leaks = FALSE;
 
 	*_ioloop = NULL;
@@ -933,6 +1039,23 @@ void io_loop_destroy(struct ioloop **_ioloop)
 	}
 	priorityq_deinit(&ioloop->timeouts);
 
+	while ((wheel_item = timing_wheel_pop_any(ioloop->timeouts_wheel)) != NULL) {
+		struct timeout *to =
+			container_of(wheel_item, struct timeout, wheel_item);
+		const char *error = t_strdup_printf(
+			"Timeout leak: %p (%s:%u)", (void *)to->callback,
+			to->source_filename,
+			to->source_linenum);
+
+		if (panic_on_leak)
+			i_panic("%s", error);
+		else
+			i_warning("%s", error);
+		timeout_free(to);
+		leaks = TRUE;
+	}
+	timing_wheel_deinit(&ioloop->timeouts_wheel);
+
 	while (ioloop->wait_timers != NULL) {
 		struct io_wait_timer *timer = ioloop->wait_timers;
 		const char *error = t_strdup_printf(
@@ -1054,7 +1177,7 @@ struct ioloop_context *io_loop_context_new(struct ioloop *ioloop)
 {
 	struct ioloop_context *ctx;
 
-	ctx = i_new(struct ioloop_context, 1);
+	ctx = ioloop_object_new(struct ioloop_context);
 	ctx->refcount = 1;
 	ctx->ioloop = ioloop;
 	i_array_init(&ctx->callbacks, 4);
@@ -1083,7 +1206,7 @@ void io_loop_context_unref(struct ioloop_context **_ctx)
 
 	array_free(&ctx->callbacks);
 	array_free(&ctx->global_event_stack);
-	i_free(ctx);
+	ioloop_object_free(ctx);
 }
 
 #undef io_loop_context_add_callbacks
@@ -1312,6 +1435,7 @@ bool io_loop_is_empty(struct ioloop *ioloop)
 {
 	return ioloop->io_files == NULL &&
 		priorityq_count(ioloop->timeouts) == 0 &&
+		timing_wheel_count(ioloop->timeouts_wheel) == 0 &&
 		array_count(&ioloop->timeouts_new) == 0;
 }
 
@@ -1341,7 +1465,7 @@ io_wait_timer_add_to(struct ioloop *ioloop, const char *source_filename,
 {
 	struct io_wait_timer *timer;
 
-	timer = i_new(struct io_wait_timer, 1);
+	timer = ioloop_object_new(struct io_wait_timer);
 	timer->ioloop = ioloop;
 	timer->source_filename = source_filename;
 	timer->source_linenum = source_linenum;
@@ -1380,7 +1504,7 @@ void io_wait_timer_remove(struct io_wait_timer **_timer)
 
 	*_timer = NULL;
 	DLLIST_REMOVE(&timer->ioloop->wait_timers, timer);
-	i_free(timer);
+	ioloop_object_free(timer);
 }
 
 uint64_t io_wait_timer_get_usecs(struct io_wait_timer *timer)
@@ -28,11 +28,42 @@ struct temp_ostream {
 	int fd;
 	bool fd_tried;
 	uoff_t fd_size;
+
+	struct iostream_temp_mem_budget *mem_budget;
+	size_t mem_budget_used;
+};
+
+struct temp_istream_buf {
+	buffer_t *buf;
+	struct iostream_temp_mem_budget *mem_budget;
 };
 
 static bool o_stream_temp_dup_cancel(struct temp_ostream *tstream,
 				     enum ostream_send_istream_result *res_r);
 
+static void o_stream_temp_mem_budget_update(struct temp_ostream *tstream)
+{
+	struct iostream_temp_mem_budget *budget = tstream->mem_budget;
+	size_t used = tstream->buf == NULL ? 0 : tstream->buf->used;
+
+	if (budget == NULL)
+		return;
+	i_assert(budget->used_size >= tstream->mem_budget_used);
+	budget->used_size = budget->used_size - tstream->mem_budget_used + used;
+	tstream->mem_budget_used = used;
+}
+
+static bool
+o_stream_temp_mem_budget_exceeded(struct temp_ostream *tstream, size_t size)
+{
+	struct iostream_temp_mem_budget *budget = tstream->mem_budget;
+
+	if (budget == NULL || budget->used_size + size <= budget->max_size)
+		return FALSE;
+	budget->exceeded_count++;
+	return TRUE;
+}
+
 static void
 o_stream_temp_close(struct iostream_private *stream,
 		    bool close_parent ATTR_UNUSED)
@@ -42,6 +73,7 @@ o_stream_temp_close(struct iostream_private *stream,
 
 	i_close_fd(&tstream->fd);
 	buffer_free(&tstream->buf);
+	o_stream_temp_mem_budget_update(tstream);
 	i_free(tstream->temp_path_prefix);
 	i_free(tstream->name);
 }
@@ -75,6 +107,7 @@ static int o_stream_temp_move_to_fd(struct temp_ostream *tstream)
 	tstream->ostream.fd = tstream->fd;
 	tstream->fd_size = tstream->buf->used;
 	buffer_free(&tstream->buf);
+	o_stream_temp_mem_budget_update(tstream);
 	return 0;
 }
 
@@ -95,6 +128,7 @@ int o_stream_temp_move_to_memory(struct ostream *output)
 		buffer_append(tstream->buf, buf, ret);
 		offset += ret;
 	}
+	o_stream_temp_mem_budget_update(tstream);
 	if (ret < 0) {
 		/* not really expecting this to happen */
 		i_error("iostream-temp %s: read(%s*) failed: %m",
@@ -127,6 +161,7 @@ o_stream_temp_fd_sendv(struct temp_ostream *tstream,
 				bytes += iov[i].iov_len;
 				tstream->ostream.ostream.offset += iov[i].iov_len;
 			}
+			o_stream_temp_mem_budget_update(tstream);
 			i_assert(tstream->fd_tried);
 			return bytes;
 		}
@@ -158,7 +193,8 @@ o_stream_temp_sendv(struct ostream_private *stream,
 		return o_stream_temp_fd_sendv(tstream, iov, iov_count);
 
 	for (i = 0; i < iov_count; i++) {
-		if (tstream->buf->used + iov[i].iov_len > tstream->max_mem_size) {
+		if (tstream->buf->used + iov[i].iov_len > tstream->max_mem_size ||
+		    o_stream_temp_mem_budget_exceeded(tstream, iov[i].iov_len)) {
 			if (o_stream_temp_move_to_fd(tstream) == 0) {
 				i_assert(tstream->fd != -1);
 				return o_stream_temp_fd_sendv(tstream, iov+i,
@@ -170,6 +206,7 @@ o_stream_temp_sendv(struct ostream_private *stream,
 		ret += iov[i].iov_len;
 		stream->ostream.offset += iov[i].iov_len;
 	}
+	o_stream_temp_mem_budget_update(tstream);
 	return ret;
 }
 
@@ -275,6 +312,7 @@ o_stream_temp_write_at(struct ostream_private *stream,
 		i_assert(stream->ostream.offset == tstream->buf->used);
 		buffer_write(tstream->buf, offset, data, size);
 		stream->ostream.offset = tstream->buf->used;
+		o_stream_temp_mem_budget_update(tstream);
 	} else {
 		if (pwrite_full(tstream->fd, data, size, offset) < 0) {
 			stream->ostream.stream_errno = errno;
@@ -340,9 +378,26 @@ struct ostream *iostream_temp_create_sized(const char *temp_path_prefix,
 	return output;
 }
 
-static void iostream_temp_buf_destroyed(buffer_t *buf)
+void iostream_temp_set_mem_budget(struct ostream *output,
+				  struct iostream_temp_mem_budget *budget)
+{
+	struct temp_ostream *tstream =
+		container_of(output->real_stream, struct temp_ostream, ostream);
+
+	i_assert(output->offset == 0);
+	i_assert(tstream->mem_budget == NULL);
+
+	tstream->mem_budget = budget;
+}
+
+static void iostream_temp_buf_destroyed(struct temp_istream_buf *tbuf)
 {
-	buffer_free(&buf);
+	if (tbuf->mem_budget != NULL) {
+		i_assert(tbuf->mem_budget->used_size >= tbuf->buf->used);
+		tbuf->mem_budget->used_size -= tbuf->buf->used;
+	}
+	buffer_free(&tbuf->buf);
+	i_free(tbuf);
 }
 
 struct istream *iostream_temp_finish(struct ostream **output,
@@ -390,13 +445,23 @@ struct istream *iostream_temp_finish(struct ostream **output,
 			"(Temp file fd %d in %s%s, %"PRIuUOFF_T" bytes)",
 			fd, tstream->temp_path_prefix, for_path, tstream->fd_size));
 	} else {
+		/* The buffer is given to the istream without copying. It stays
+		   in the memory budget until the istream is destroyed. */
+		struct temp_istream_buf *tbuf = i_new(struct temp_istream_buf, 1);
+
 		input = i_stream_create_from_data(tstream->buf->data,
 						  tstream->buf->used);
 		i_stream_set_name(input, t_strdup_printf(
 			"(Temp buffer in %s%s, %zu bytes)",
 			tstream->temp_path_prefix, for_path, tstream->buf->used));
+		tbuf->buf = tstream->buf;
+		if (tstream->mem_budget != NULL) {
+			i_assert(tstream->mem_budget_used == tbuf->buf->used);
+			tbuf->mem_budget = tstream->mem_budget;
+			tstream->mem_budget_used = 0;
+		}
 		i_stream_add_destroy_callback(input, iostream_temp_buf_destroyed,
-					      tstream->buf);
+					      tbuf);
 		tstream->buf = NULL;
 	}
 	o_stream_destroy(output);
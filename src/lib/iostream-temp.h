@@ -8,6 +8,19 @@ enum iostream_temp_flags {
 	IOSTREAM_TEMP_FLAG_TRY_FD_DUP	= 0x01
 };
 
+/* Memory budget shared by multiple temp iostreams. */
+struct iostream_temp_mem_budget {
+	/* Maximum total memory used by the streams' buffers */
+	size_t max_size;
+	/* Memory currently used by the streams' buffers. This includes the
+	   buffers of the istreams returned by iostream_temp_finish() until
+	   they're destroyed. */
+	size_t used_size;
+	/* Number of times a stream was moved to a temporary file because
+	   max_size would have been exceeded. */
+	unsigned int exceeded_count;
+};
+
 /* Start writing to given output stream. The data is initially written to
    memory, and later to a temporary file that is immediately unlinked. */
 struct ostream *iostream_temp_create(const char *temp_path_prefix,
@@ -19,6 +32,14 @@ struct ostream *iostream_temp_create_sized(const char *temp_path_prefix,
 					   enum iostream_temp_flags flags,
 					   const char *name,
 					   size_t max_mem_size);
+/* Account the stream's memory usage in the given budget. If writing to the
+   stream would exceed the budget, the stream is moved to a temporary file
+   even if it's below its own max_mem_size. This must be called before
+   anything is written to the stream. The budget must not be freed until
+   all the streams using it, including the istreams returned by
+   iostream_temp_finish(), are destroyed. */
+void iostream_temp_set_mem_budget(struct ostream *output,
+				  struct iostream_temp_mem_budget *budget);
 /* Finished writing to stream. Return input stream for it and free the
    output stream. (It's also possible to abort iostream-temp by simply
    destroying the ostream.) */
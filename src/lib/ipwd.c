@@ -3,6 +3,7 @@
 #define _POSIX_PTHREAD_SEMANTICS /* for Solaris */
 #include "lib.h"
 #include "ipwd.h"
+#include "sampling-profiler.h"
 
 #include <unistd.h>
 
@@ -49,7 +50,10 @@ int i_getpwnam(const char *name, struct passwd *pwd_r)
 	errno = 0;
 	do {
 		pw_init();
+		/* NSS modules may get dlopen()ed */
+		sampling_profiler_block();
 		errno = getpwnam_r(name, pwd_r, pwbuf, pwbuf_size, &result);
+		sampling_profiler_unblock();
 	} while (errno == ERANGE);
 	if (result != NULL)
 		return 1;
@@ -67,7 +71,9 @@ int i_getpwuid(uid_t uid, struct passwd *pwd_r)
 	errno = 0;
 	do {
 		pw_init();
+		sampling_profiler_block();
 		errno = getpwuid_r(uid, pwd_r, pwbuf, pwbuf_size, &result);
+		sampling_profiler_unblock();
 	} while (errno == ERANGE);
 	if (result != NULL)
 		return 1;
@@ -81,7 +87,9 @@ int i_getgrnam(const char *name, struct group *grp_r)
 	errno = 0;
 	do {
 		gr_init();
+		sampling_profiler_block();
 		errno = getgrnam_r(name, grp_r, grbuf, grbuf_size, &result);
+		sampling_profiler_unblock();
 	} while (errno == ERANGE);
 	if (result != NULL)
 		return 1;
@@ -95,7 +103,9 @@ int i_getgrgid(gid_t gid, struct group *grp_r)
 	errno = 0;
 	do {
 		gr_init();
+		sampling_profiler_block();
 		errno = getgrgid_r(gid, grp_r, grbuf, grbuf_size, &result);
+		sampling_profiler_unblock();
 	} while (errno == ERANGE);
 	if (result != NULL)
 		return 1;
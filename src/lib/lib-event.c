@@ -552,7 +552,7 @@ event_reason_begin(const char *reason_code, const char *source_filename,
 {
 	struct event_reason *reason;
 
-	reason = i_new(struct event_reason, 1);
+	reason = p_new(pool_slab_get_object_pool(), struct event_reason, 1);
 	reason->event = event_create(event_get_global(),
 				     source_filename, source_linenum);
 	event_strlist_append(reason->event, EVENT_REASON_CODE, reason_code);
@@ -571,7 +571,7 @@ void event_reason_end(struct event_reason **_reason)
 	   permanently stored anywhere. This assert could help catch bugs. */
 	i_assert(reason->event->refcount == 1);
 	event_unref(&reason->event);
-	i_free(reason);
+	p_free(pool_slab_get_object_pool(), reason);
 }
 
 const char *event_reason_code(const char *module, const char *name)
@@ -1292,7 +1292,8 @@ event_categories_iterate_init(const struct event *event)
 	if (count == 0)
 		return NULL;
 
-	iter = i_new(struct event_category_iterator, 1);
+	iter = p_new(pool_slab_get_object_pool(),
+		     struct event_category_iterator, 1);
 
 	hash_table_create_direct(&iter->hash, default_pool,
 				 3 * count /* estimate */);
@@ -1328,7 +1329,7 @@ void event_categories_iterate_deinit(struct event_category_iterator **_iter)
 
 	hash_table_iterate_deinit(&iter->iter);
 	hash_table_destroy(&iter->hash);
-	i_free(iter);
+	p_free(pool_slab_get_object_pool(), iter);
 }
 
 void event_send(struct event *event, struct failure_context *ctx,
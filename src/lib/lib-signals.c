@@ -183,6 +183,16 @@ static void sig_ignore(int signo ATTR_UNUSED)
 	   the system call might be restarted */
 }
 
+static void lib_signals_create_pipe(void)
+{
+	if (pipe(sig_pipe_fd) < 0)
+		i_fatal("pipe() failed: %m");
+	fd_set_nonblock(sig_pipe_fd[0], TRUE);
+	fd_set_nonblock(sig_pipe_fd[1], TRUE);
+	fd_close_on_exec(sig_pipe_fd[0], TRUE);
+	fd_close_on_exec(sig_pipe_fd[1], TRUE);
+}
+
 static struct signal_ioloop *
 lib_signals_ioloop_find(struct ioloop *ioloop)
 {
@@ -535,16 +545,31 @@ void lib_signals_set_handler2(int signo, enum libsig_flags flags,
 
 	if (h->delayed_handler != NULL && sig_pipe_fd[0] == -1) {
 		/* first delayed handler */
-		if (pipe(sig_pipe_fd) < 0)
-			i_fatal("pipe() failed: %m");
-		fd_set_nonblock(sig_pipe_fd[0], TRUE);
-		fd_set_nonblock(sig_pipe_fd[1], TRUE);
-		fd_close_on_exec(sig_pipe_fd[0], TRUE);
-		fd_close_on_exec(sig_pipe_fd[1], TRUE);
+		lib_signals_create_pipe();
 	}
 	signal_handler_switch_ioloop(h);
 }
 
+void lib_signals_forked(void)
+{
+	struct signal_ioloop *l;
+
+	if (sig_pipe_fd[0] == -1)
+		return;
+
+	for (l = signal_ioloops; l != NULL; l = l->next)
+		io_remove(&l->io);
+	if (close(sig_pipe_fd[0]) < 0)
+		i_error("close(sig_pipe) failed: %m");
+	if (close(sig_pipe_fd[1]) < 0)
+		i_error("close(sig_pipe) failed: %m");
+	lib_signals_create_pipe();
+	for (l = signal_ioloops; l != NULL; l = l->next) {
+		if (l->ioloop != NULL)
+			lib_signals_init_io(l);
+	}
+}
+
 static void lib_signals_ignore_forced(int signo, bool restart_syscalls)
 {
 	struct sigaction act;
@@ -35,6 +35,10 @@ const char *lib_signal_code_to_str(int signo, int sicode);
    forking a process. */
 void lib_signals_ioloop_detach(void);
 void lib_signals_ioloop_attach(void);
+/* Called in a child process after fork() and io_loop_recreate(), so the
+   delayed signals are no longer sent via a pipe shared with the parent
+   process. */
+void lib_signals_forked(void);
 
 /* Set signal handler for specific signal. */
 void lib_signals_set_handler(int signo, enum libsig_flags flags,
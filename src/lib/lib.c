@@ -224,6 +224,7 @@ void lib_deinit(void)
 	failures_deinit();
 	process_title_deinit();
 	random_deinit();
+	pool_slab_deinit_object_pool();
 
 	lib_clean_exit = TRUE;
 }
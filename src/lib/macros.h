@@ -132,6 +132,17 @@
 #  define ATTR_DEPRECATED(str)
 #endif
 
+/* Variables that are private to each thread. lib's thread-local state is
+   accessed very often (e.g. data stack), so use the fastest TLS model. This
+   works as long as libdovecot isn't dlopen()ed. */
+#ifndef HAVE_THREADS
+#  define THREAD_LOCAL
+#elif defined(__GNUC__)
+#  define THREAD_LOCAL _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#  define THREAD_LOCAL _Thread_local
+#endif
+
 /* Macros to provide type safety for callback functions' context parameters.
    This is used like:
 
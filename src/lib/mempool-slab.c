@@ -0,0 +1,524 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "mempool.h"
+#include "llist.h"
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#  include <valgrind/valgrind.h>
+#endif
+
+/*
+ * Slab pools support allocating and freeing memory like allocfree pools,
+ * but small allocations are grouped by size class into larger slabs.
+ * This avoids malloc() overhead and heap fragmentation with objects that
+ * are constantly created and destroyed.
+ *
+ * Implementation
+ * ==============
+ *
+ * Each allocation is rounded up to the nearest size class. Each size class
+ * has a list of slabs, which are fixed size malloc()ed memory areas
+ * containing a header (struct slab) followed by equally sized chunks:
+ *
+ * +------+-------+-------+-------+-----
+ * | slab | chunk | chunk | chunk | ...
+ * +------+-------+-------+-------+-----
+ *
+ * Each chunk begins with a pointer to its slab (struct slab_chunk) followed
+ * by the caller's data. Free chunks are kept in a per-slab freelist, where
+ * the first bytes of the data area point to the next free chunk. Chunks that
+ * haven't been used at all yet are handed out from the end of the slab
+ * without going through the freelist.
+ *
+ * The size class keeps a list of slabs that have free chunks. Allocations
+ * are done from the first such slab. When a slab becomes completely unused,
+ * it's freed unless it's the only slab with free chunks in the size class.
+ * This way the memory is returned to the system when the number of objects
+ * shrinks.
+ *
+ * Allocations larger than the largest size class are malloc()ed separately
+ * (struct slab_large). Their chunk header's slab pointer is NULL.
+ *
+ * In DEBUG builds freed chunks are filled with a poison pattern, which is
+ * verified when the chunk is allocated again to catch writes to freed
+ * memory.
+ */
+
+#define SLAB_SIZE (16 * 1024)
+#define SLAB_POISON_BYTE 0xdb
+
+/* Maximum data size for each size class */
+static const unsigned int slab_class_sizes[] = {
+	16, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 768, 1024
+};
+#define SLAB_CLASS_COUNT N_ELEMENTS(slab_class_sizes)
+#define SLAB_MAX_SMALL_SIZE 1024
+
+struct slab_chunk {
+	/* NULL for large allocations */
+	struct slab *slab;
+};
+
+struct slab_free_chunk {
+	struct slab_free_chunk *next;
+};
+
+struct slab {
+	struct slab *prev, *next;
+	struct slab_class *class;
+
+	struct slab_free_chunk *free_chunks;
+	unsigned char *unused_area;
+	unsigned int used_count;
+};
+
+struct slab_class {
+	/* Slabs with at least one free chunk */
+	struct slab *partial_slabs;
+	/* Slabs with no free chunks */
+	struct slab *full_slabs;
+
+	unsigned int chunk_size;
+	unsigned int chunks_per_slab;
+	unsigned int data_size;
+};
+
+struct slab_large {
+	struct slab_large *prev, *next;
+	size_t size;
+};
+
+struct slab_pool {
+	struct pool pool;
+	int refcount;
+
+	struct slab_class classes[SLAB_CLASS_COUNT];
+	struct slab_large *large_allocs;
+
+	struct pool_slab_stats stats;
+	char *name;
+};
+
+#define SIZEOF_SLAB_POOL MEM_ALIGN(sizeof(struct slab_pool))
+#define SIZEOF_SLAB MEM_ALIGN(sizeof(struct slab))
+#define SIZEOF_SLAB_CHUNK MEM_ALIGN(sizeof(struct slab_chunk))
+#define SIZEOF_SLAB_LARGE MEM_ALIGN(sizeof(struct slab_large))
+
+#define SLAB_CHUNK_DATA(chunk) PTR_OFFSET(chunk, SIZEOF_SLAB_CHUNK)
+
+static const char *pool_slab_get_name(pool_t pool);
+static void pool_slab_ref(pool_t pool);
+static void pool_slab_unref(pool_t *pool);
+static void *pool_slab_malloc(pool_t pool, size_t size);
+static void pool_slab_free(pool_t pool, void *mem);
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size);
+static void pool_slab_clear(pool_t pool);
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_slab_pool_vfuncs = {
+	pool_slab_get_name,
+
+	pool_slab_ref,
+	pool_slab_unref,
+
+	pool_slab_malloc,
+	pool_slab_free,
+
+	pool_slab_realloc,
+
+	pool_slab_clear,
+	pool_slab_get_max_easy_alloc_size
+};
+
+static const struct pool static_slab_pool = {
+	.v = &static_slab_pool_vfuncs,
+
+	.alloconly_pool = FALSE,
+	.datastack_pool = FALSE
+};
+
+static pool_t object_pool = NULL;
+
+pool_t pool_slab_create(const char *name)
+{
+	struct slab_pool *spool;
+	unsigned int i;
+
+	spool = calloc(1, SIZEOF_SLAB_POOL);
+	if (spool == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "calloc(1, %zu): Out of memory",
+			       SIZEOF_SLAB_POOL);
+	spool->name = strdup(name);
+	if (spool->name == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "strdup(): Out of memory");
+	spool->pool = static_slab_pool;
+	spool->refcount = 1;
+
+	for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+		struct slab_class *class = &spool->classes[i];
+
+		class->data_size = slab_class_sizes[i];
+		class->chunk_size = SIZEOF_SLAB_CHUNK +
+			MEM_ALIGN(slab_class_sizes[i]);
+		class->chunks_per_slab =
+			(SLAB_SIZE - SIZEOF_SLAB) / class->chunk_size;
+		i_assert(class->chunks_per_slab > 1);
+	}
+	return &spool->pool;
+}
+
+pool_t pool_slab_get_object_pool(void)
+{
+	if (object_pool != NULL)
+		return object_pool;
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+	/* Valgrind can't see leaks or use-after-free of individual
+	   objects inside slabs, so use plain malloc() and free(). */
+	if (RUNNING_ON_VALGRIND) {
+		object_pool = system_pool;
+		return object_pool;
+	}
+#endif
+	object_pool = pool_slab_create("objects");
+	return object_pool;
+}
+
+void pool_slab_deinit_object_pool(void)
+{
+	if (object_pool != NULL && object_pool != system_pool)
+		pool_unref(&object_pool);
+	object_pool = NULL;
+}
+
+static void pool_slab_destroy(struct slab_pool *spool)
+{
+	pool_slab_clear(&spool->pool);
+	free(spool->name);
+	free(spool);
+}
+
+static const char *pool_slab_get_name(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	return spool->name;
+}
+
+static void pool_slab_ref(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	i_assert(spool->refcount > 0);
+	spool->refcount++;
+}
+
+static void pool_slab_unref(pool_t *_pool)
+{
+	pool_t pool = *_pool;
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	i_assert(spool->refcount > 0);
+
+	/* erase the pointer before freeing anything, as the pointer may
+	   exist inside the pool's memory area */
+	*_pool = NULL;
+
+	if (--spool->refcount > 0)
+		return;
+	pool_slab_destroy(spool);
+}
+
+static struct slab_class *
+pool_slab_get_class(struct slab_pool *spool, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+		if (size <= slab_class_sizes[i])
+			return &spool->classes[i];
+	}
+	i_unreached();
+}
+
+#ifdef DEBUG
+static void
+slab_chunk_poison(struct slab_class *class, struct slab_free_chunk *fchunk)
+{
+	memset(fchunk + 1, SLAB_POISON_BYTE,
+	       class->data_size - sizeof(*fchunk));
+}
+
+static void
+slab_chunk_check_poison(struct slab_class *class,
+			struct slab_free_chunk *fchunk)
+{
+	const unsigned char *data = (const unsigned char *)(fchunk + 1);
+	size_t i, size = class->data_size - sizeof(*fchunk);
+
+	for (i = 0; i < size; i++) {
+		if (data[i] != SLAB_POISON_BYTE) {
+			i_panic("slab pool: Freed memory %p was modified "
+				"at offset %zu", (void *)fchunk,
+				i + sizeof(*fchunk));
+		}
+	}
+}
+#endif
+
+static struct slab_chunk *slab_chunk_get(void *mem)
+{
+	/* cannot use PTR_OFFSET because of negative value */
+	i_assert((uintptr_t)mem >= SIZEOF_SLAB_CHUNK);
+	return (struct slab_chunk *)((unsigned char *)mem - SIZEOF_SLAB_CHUNK);
+}
+
+static struct slab_large *slab_large_get(struct slab_chunk *chunk)
+{
+	return (struct slab_large *)((unsigned char *)chunk -
+				     SIZEOF_SLAB_LARGE);
+}
+
+static struct slab *
+pool_slab_new_slab(struct slab_pool *spool, struct slab_class *class)
+{
+	struct slab *slab;
+
+	slab = malloc(SLAB_SIZE);
+	if (slab == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "malloc(%u): Out of memory",
+			       SLAB_SIZE);
+	slab->prev = slab->next = NULL;
+	slab->class = class;
+	slab->free_chunks = NULL;
+	slab->unused_area = PTR_OFFSET(slab, SIZEOF_SLAB);
+	slab->used_count = 0;
+	DLLIST_PREPEND(&class->partial_slabs, slab);
+
+	spool->stats.slab_count++;
+	spool->stats.alloc_size += SLAB_SIZE;
+	return slab;
+}
+
+static void *
+pool_slab_alloc_small(struct slab_pool *spool, struct slab_class *class)
+{
+	struct slab *slab = class->partial_slabs;
+	struct slab_chunk *chunk;
+
+	if (slab == NULL)
+		slab = pool_slab_new_slab(spool, class);
+
+	if (slab->free_chunks != NULL) {
+		struct slab_free_chunk *fchunk = slab->free_chunks;
+
+#ifdef DEBUG
+		slab_chunk_check_poison(class, fchunk);
+#endif
+		slab->free_chunks = fchunk->next;
+		chunk = slab_chunk_get(fchunk);
+		i_assert(chunk->slab == slab);
+	} else {
+		chunk = (struct slab_chunk *)slab->unused_area;
+		chunk->slab = slab;
+		slab->unused_area += class->chunk_size;
+	}
+	if (++slab->used_count == class->chunks_per_slab) {
+		DLLIST_REMOVE(&class->partial_slabs, slab);
+		DLLIST_PREPEND(&class->full_slabs, slab);
+	}
+	spool->stats.used_size += class->data_size;
+	return SLAB_CHUNK_DATA(chunk);
+}
+
+static void *pool_slab_alloc_large(struct slab_pool *spool, size_t size)
+{
+	struct slab_large *large;
+	struct slab_chunk *chunk;
+	size_t alloc_size = SIZEOF_SLAB_LARGE + SIZEOF_SLAB_CHUNK + size;
+
+	large = malloc(alloc_size);
+	if (large == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "malloc(%zu): Out of memory",
+			       alloc_size);
+	large->size = size;
+	DLLIST_PREPEND(&spool->large_allocs, large);
+	chunk = PTR_OFFSET(large, SIZEOF_SLAB_LARGE);
+	chunk->slab = NULL;
+
+	spool->stats.large_alloc_count++;
+	spool->stats.used_size += size;
+	spool->stats.alloc_size += alloc_size;
+	return SLAB_CHUNK_DATA(chunk);
+}
+
+static void *pool_slab_malloc(pool_t pool, size_t size)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	void *mem;
+
+	if (size <= SLAB_MAX_SMALL_SIZE) {
+		mem = pool_slab_alloc_small(spool,
+					    pool_slab_get_class(spool, size));
+	} else {
+		mem = pool_slab_alloc_large(spool, size);
+	}
+	memset(mem, 0, size);
+	spool->stats.alloc_count++;
+	spool->stats.total_alloc_count++;
+	return mem;
+}
+
+static void
+pool_slab_free_small(struct slab_pool *spool, struct slab_chunk *chunk)
+{
+	struct slab *slab = chunk->slab;
+	struct slab_class *class = slab->class;
+	struct slab_free_chunk *fchunk = SLAB_CHUNK_DATA(chunk);
+
+	i_assert(slab->used_count > 0);
+
+#ifdef DEBUG
+	slab_chunk_poison(class, fchunk);
+#endif
+	if (slab->used_count-- == class->chunks_per_slab) {
+		/* slab was full */
+		DLLIST_REMOVE(&class->full_slabs, slab);
+		DLLIST_PREPEND(&class->partial_slabs, slab);
+	}
+	if (slab->used_count == 0 &&
+	    (slab->prev != NULL || slab->next != NULL)) {
+		/* unused, and there's another slab with free chunks */
+		DLLIST_REMOVE(&class->partial_slabs, slab);
+		free(slab);
+		spool->stats.slab_count--;
+		spool->stats.alloc_size -= SLAB_SIZE;
+	} else {
+		fchunk->next = slab->free_chunks;
+		slab->free_chunks = fchunk;
+	}
+	i_assert(spool->stats.used_size >= class->data_size);
+	spool->stats.used_size -= class->data_size;
+}
+
+static void
+pool_slab_free_large(struct slab_pool *spool, struct slab_large *large)
+{
+	i_assert(spool->stats.large_alloc_count > 0);
+
+	DLLIST_REMOVE(&spool->large_allocs, large);
+	spool->stats.large_alloc_count--;
+	spool->stats.used_size -= large->size;
+	spool->stats.alloc_size -=
+		SIZEOF_SLAB_LARGE + SIZEOF_SLAB_CHUNK + large->size;
+	free(large);
+}
+
+static void pool_slab_free(pool_t pool, void *mem)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_chunk *chunk = slab_chunk_get(mem);
+
+	i_assert(spool->stats.alloc_count > 0);
+
+	if (chunk->slab != NULL) {
+		i_assert(chunk->slab->class >= spool->classes &&
+			 chunk->slab->class < spool->classes + SLAB_CLASS_COUNT);
+		pool_slab_free_small(spool, chunk);
+	} else {
+		pool_slab_free_large(spool, slab_large_get(chunk));
+	}
+	spool->stats.alloc_count--;
+}
+
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_chunk *chunk = slab_chunk_get(mem);
+	void *new_mem;
+
+	if (chunk->slab != NULL && new_size <= chunk->slab->class->data_size &&
+	    new_size > chunk->slab->class->data_size / 2) {
+		/* fits into the same chunk */
+		if (new_size > old_size)
+			memset(PTR_OFFSET(mem, old_size), 0, new_size - old_size);
+		return mem;
+	}
+
+	if (chunk->slab == NULL && new_size > SLAB_MAX_SMALL_SIZE) {
+		struct slab_large *large = slab_large_get(chunk);
+		size_t old_alloc_size =
+			SIZEOF_SLAB_LARGE + SIZEOF_SLAB_CHUNK + large->size;
+		size_t new_alloc_size =
+			SIZEOF_SLAB_LARGE + SIZEOF_SLAB_CHUNK + new_size;
+
+		DLLIST_REMOVE(&spool->large_allocs, large);
+		if ((new_mem = realloc(large, new_alloc_size)) == NULL) {
+			i_fatal_status(FATAL_OUTOFMEM, "realloc(%zu): "
+				       "Out of memory", new_alloc_size);
+		}
+		large = new_mem;
+		DLLIST_PREPEND(&spool->large_allocs, large);
+		spool->stats.used_size += new_size - large->size;
+		spool->stats.alloc_size += new_alloc_size - old_alloc_size;
+		large->size = new_size;
+
+		chunk = PTR_OFFSET(large, SIZEOF_SLAB_LARGE);
+		mem = SLAB_CHUNK_DATA(chunk);
+		if (new_size > old_size)
+			memset(PTR_OFFSET(mem, old_size), 0, new_size - old_size);
+		return mem;
+	}
+
+	new_mem = pool_slab_malloc(pool, new_size);
+	memcpy(new_mem, mem, I_MIN(old_size, new_size));
+	pool_slab_free(&spool->pool, mem);
+	return new_mem;
+}
+
+static void pool_slab_free_slabs(struct slab_pool *spool, struct slab **list)
+{
+	struct slab *slab;
+
+	while ((slab = *list) != NULL) {
+		DLLIST_REMOVE(list, slab);
+		free(slab);
+		spool->stats.slab_count--;
+	}
+}
+
+static void pool_slab_clear(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_large *large;
+	unsigned int i;
+
+	for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+		pool_slab_free_slabs(spool, &spool->classes[i].partial_slabs);
+		pool_slab_free_slabs(spool, &spool->classes[i].full_slabs);
+	}
+	while ((large = spool->large_allocs) != NULL)
+		pool_slab_free_large(spool, large);
+
+	i_assert(spool->stats.slab_count == 0);
+	spool->stats.alloc_count = 0;
+	spool->stats.used_size = 0;
+	spool->stats.alloc_size = 0;
+}
+
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool ATTR_UNUSED)
+{
+	return 0;
+}
+
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	i_assert(pool->v == &static_slab_pool_vfuncs);
+	*stats_r = spool->stats;
+}
@@ -82,6 +82,18 @@ pool_t pool_allocfree_create(const char *name);
    See pool_alloconly_create_clean. */
 pool_t pool_allocfree_create_clean(const char *name);
 
+/* Create new slab pool. It works like alloc pool, but small allocations are
+   served from per-size-class slabs, which is faster and fragments the heap
+   less with objects that are constantly allocated and freed. */
+pool_t pool_slab_create(const char *name);
+/* Returns the process-wide slab pool used for small frequently allocated
+   objects (ioloop, lib-event). It's not thread-safe. When running under
+   valgrind, this returns system_pool instead, so valgrind can track each
+   object separately. */
+pool_t pool_slab_get_object_pool(void);
+/* Free the object pool. Called by lib_deinit(). */
+void pool_slab_deinit_object_pool(void);
+
 /* Similar to nearest_power(), but try not to exceed buffer's easy
    allocation size. If you don't have any explicit minimum size, use
    old_size + 1. */
@@ -181,6 +193,25 @@ size_t pool_allocfree_get_total_used_size(pool_t pool);
 /* Returns how much system memory has been allocated for this pool. */
 size_t pool_allocfree_get_total_alloc_size(pool_t pool);
 
+struct pool_slab_stats {
+	/* Number of currently allocated chunks */
+	unsigned int alloc_count;
+	/* Number of currently allocated separately malloc()ed large chunks.
+	   These are also included in alloc_count. */
+	unsigned int large_alloc_count;
+	/* Number of slabs currently allocated */
+	unsigned int slab_count;
+	/* Total number of allocations done from this pool */
+	uint64_t total_alloc_count;
+
+	/* Bytes currently in use, rounded up to the size class */
+	size_t used_size;
+	/* Bytes of system memory allocated for this pool */
+	size_t alloc_size;
+};
+/* Returns statistics for a pool created with pool_slab_create(). */
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r);
+
 /* private: */
 void pool_system_free(pool_t pool, void *mem);
 void pool_external_refs_unref(pool_t pool);
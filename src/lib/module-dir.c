@@ -4,6 +4,7 @@
 #include "array.h"
 #include "str.h"
 #include "sort.h"
+#include "sampling-profiler.h"
 #include "module-dir.h"
 
 #ifdef HAVE_MODULES
@@ -25,10 +26,15 @@ static const char *module_name_drop_suffix(const char *name);
 
 void *module_get_symbol_quiet(struct module *module, const char *symbol)
 {
+	void *ret;
+
 	/* clear out old errors */
 	(void)dlerror();
 
-	return dlsym(module->handle, symbol);
+	sampling_profiler_block();
+	ret = dlsym(module->handle, symbol);
+	sampling_profiler_unblock();
+	return ret;
 }
 
 void *module_get_symbol(struct module *module, const char *symbol)
@@ -64,7 +70,12 @@ static void module_free(struct module *module)
 	   if GDB environment is set, don't actually unload the module
 	   (the GDB environment is used elsewhere too) */
 	if (getenv("GDB") == NULL) {
-		if (dlclose(module->handle) != 0)
+		int ret;
+
+		sampling_profiler_block();
+		ret = dlclose(module->handle);
+		sampling_profiler_unblock();
+		if (ret != 0)
 			i_error("dlclose(%s) failed: %m", module->path);
 	}
 	i_free(module->path);
@@ -83,7 +94,7 @@ module_check_wrong_binary_dependency(const struct module_dir_load_settings *set,
 		return TRUE;
 
 	symbol_name = t_strconcat(module->name, "_binary_dependency", NULL);
-	binary_dep = dlsym(module->handle, symbol_name);
+	binary_dep = module_get_symbol_quiet(module, symbol_name);
 	if (binary_dep == NULL)
 		return TRUE;
 
@@ -114,8 +125,8 @@ module_check_missing_plugin_dependencies(const struct module_dir_load_settings *
 	string_t *errmsg;
 	size_t len;
 
-	deps = dlsym(module->handle,
-		     t_strconcat(module->name, "_dependencies", NULL));
+	deps = module_get_symbol_quiet(module,
+		t_strconcat(module->name, "_dependencies", NULL));
 	if (deps == NULL)
 		return TRUE;
 
@@ -144,10 +155,20 @@ module_check_missing_plugin_dependencies(const struct module_dir_load_settings *
 	return TRUE;
 }
 
+static void *module_dlopen(const char *path, int flags)
+{
+	void *handle;
+
+	sampling_profiler_block();
+	handle = dlopen(path, flags);
+	sampling_profiler_unblock();
+	return handle;
+}
+
 static void *quiet_dlopen(const char *path, int flags)
 {
 #ifndef __OpenBSD__
-	return dlopen(path, flags);
+	return module_dlopen(path, flags);
 #else
 	void *handle;
 	int fd;
@@ -159,7 +180,7 @@ static void *quiet_dlopen(const char *path, int flags)
 		i_fatal("dup() failed: %m");
 	if (dup2(dev_null_fd, STDERR_FILENO) < 0)
 		i_fatal("dup2() failed: %m");
-	handle = dlopen(path, flags);
+	handle = module_dlopen(path, flags);
 	if (dup2(fd, STDERR_FILENO) < 0)
 		i_fatal("dup2() failed: %m");
 	if (close(fd) < 0)
@@ -206,14 +227,14 @@ module_load(const char *path, const char *name,
 			return 0;
 		}
 	} else {
-		handle = dlopen(path, RTLD_GLOBAL | RTLD_NOW);
+		handle = module_dlopen(path, RTLD_GLOBAL | RTLD_NOW);
 		if (handle == NULL) {
 			*error_r = t_strdup_printf("dlopen() failed: %s",
 						   dlerror());
 #ifdef RTLD_LAZY
 			/* try to give a better error message by lazily loading
 			   the plugin and checking its dependencies */
-			handle = dlopen(path, RTLD_LAZY);
+			handle = module_dlopen(path, RTLD_LAZY);
 			if (handle == NULL)
 				return -1;
 #else
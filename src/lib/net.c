@@ -3,6 +3,7 @@
 #define _GNU_SOURCE /* For Linux's struct ucred */
 #include "lib.h"
 #include "time-util.h"
+#include "sampling-profiler.h"
 #include "net.h"
 
 #include <unistd.h>
@@ -697,8 +698,11 @@ int net_gethostbyname(const char *addr, struct ip_addr **ips,
 	hints.ai_socktype = SOCK_STREAM;
 
 	ai = NULL;
-	/* save error to host_error for later use */
+	/* save error to host_error for later use. NSS modules may get
+	   dlopen()ed. */
+	sampling_profiler_block();
 	host_error = getaddrinfo(addr, NULL, &hints, &ai);
+	sampling_profiler_unblock();
 	if (net_handle_gai_error("getaddrinfo", host_error, FALSE) != 0) {
 		i_assert(ai == NULL);
 		return host_error;
@@ -733,8 +737,10 @@ int net_gethostbyaddr(const struct ip_addr *ip, const char **name_r)
 
 	i_zero(&so);
 	sin_set_ip(&so, ip);
+	sampling_profiler_block();
 	ret = getnameinfo(&so.sa, addrlen, hbuf, sizeof(hbuf), NULL, 0,
 			  NI_NAMEREQD);
+	sampling_profiler_unblock();
 	if (net_handle_gai_error("getnameinfo", ret, FALSE) != 0)
 		return ret;
 
@@ -946,8 +952,11 @@ const char *net_ip2addr(const struct ip_addr *ip)
 
 	char *addr = t_malloc_no0(MAX_IP_LEN+1);
 	int ret;
-	if ((ret = getnameinfo(&u.sa, so_len, addr, MAX_IP_LEN+1, NULL, 0,
-			       NI_NUMERICHOST)) < 0) {
+	sampling_profiler_block();
+	ret = getnameinfo(&u.sa, so_len, addr, MAX_IP_LEN+1, NULL, 0,
+			  NI_NUMERICHOST);
+	sampling_profiler_unblock();
+	if (ret < 0) {
 		(void)net_handle_gai_error("getnameinfo", ret, TRUE);
 		return "";
 	}
@@ -1004,7 +1013,10 @@ int net_addr2ip(const char *addr, struct ip_addr *ip_r)
 		const struct addrinfo hints = {
 			.ai_flags = AI_NUMERICHOST,
 		};
-		if ((ret = getaddrinfo(addr, NULL, &hints, &res)) == 0) {
+		sampling_profiler_block();
+		ret = getaddrinfo(addr, NULL, &hints, &res);
+		sampling_profiler_unblock();
+		if (ret == 0) {
 			i_assert(res != NULL);
 			const union sockaddr_union *so =
 				(union sockaddr_union *)res->ai_addr;
@@ -10,6 +10,7 @@
 #include "restrict-access.h"
 #include "env-util.h"
 #include "ipwd.h"
+#include "sampling-profiler.h"
 
 #include <time.h>
 #ifdef HAVE_PR_SET_DUMPABLE
@@ -301,8 +302,13 @@ void restrict_access(const struct restrict_access_settings *set,
 
 	/* set system user's groups */
 	if (set->system_groups_user != NULL && is_root) {
-		if (initgroups(set->system_groups_user,
-			       process_primary_gid) < 0) {
+		int ret;
+
+		/* NSS modules may get dlopen()ed */
+		sampling_profiler_block();
+		ret = initgroups(set->system_groups_user, process_primary_gid);
+		sampling_profiler_unblock();
+		if (ret < 0) {
 			i_fatal("initgroups(%s, %s) failed: %m",
 				set->system_groups_user,
 				get_gid_str(process_primary_gid));
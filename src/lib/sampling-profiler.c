@@ -0,0 +1,459 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "ioloop.h"
+#include "lib-signals.h"
+#include "sampling-profiler.h"
+
+#if defined(HAVE_SETITIMER) && defined(HAVE_BACKTRACE_SYMBOLS) && \
+	defined(HAVE_EXECINFO_H)
+#include <sys/time.h>
+#include <execinfo.h>
+
+/* Samples that can be buffered until they're drained. With the typical
+   10ms interval this is 5 seconds of CPU time. */
+#define SAMPLING_PROFILER_RING_SIZE 512
+#define SAMPLING_PROFILER_MAX_FRAMES 32
+/* The signal handler itself, lib-signals' handler and the signal
+   trampoline are the first frames in each sample. */
+#define SAMPLING_PROFILER_SKIP_FRAMES 3
+#define SAMPLING_PROFILER_DRAIN_MSECS 1000
+#define SAMPLING_PROFILER_SEND_INTERVAL_SECS 10
+/* Protect against unbounded memory usage, e.g. from clients sending lots of
+   different unknown command names. */
+#define SAMPLING_PROFILER_MAX_LABELS 128
+#define SAMPLING_PROFILER_MAX_STACKS 10000
+#define SAMPLING_PROFILER_OTHER_LABEL "(other)"
+#define SAMPLING_PROFILER_OTHER_STACK "(other)"
+
+struct sampling_profiler_sample {
+	const char *label;
+	int depth, skip_frames;
+	void *frames[SAMPLING_PROFILER_MAX_FRAMES];
+};
+
+struct sampling_profiler_stack {
+	/* label;stack */
+	const char *folded;
+	const char *label;
+	const char *stack;
+	unsigned int count, sent_count;
+};
+
+struct sampling_profiler {
+	pool_t pool;
+	struct event *event;
+	unsigned int interval_msecs;
+	struct timeout *to_drain;
+	time_t last_send;
+
+	HASH_TABLE(const char *, const char *) labels;
+	HASH_TABLE(void *, const char *) symbols;
+	HASH_TABLE(const char *, struct sampling_profiler_stack *) stacks_hash;
+	ARRAY(struct sampling_profiler_stack *) stacks;
+	unsigned int sent_dropped_count;
+};
+
+static struct sampling_profiler *profiler = NULL;
+
+/* Accessed by the signal handler. The handler only writes to the slot at
+   ring_head when it's not between ring_tail and ring_head, so the main
+   loop can read those slots without blocking the signal. */
+static struct sampling_profiler_sample *ring;
+static volatile unsigned int ring_head, ring_tail, ring_dropped;
+static const char *volatile current_label;
+/* While non-zero, the signal handler only marks the sample as pending and
+   sampling_profiler_unblock() takes it. These are per-thread, because thread
+   pool workers may call the blocking functions too. The workers have SIGPROF
+   blocked, so only the main thread's values are seen by the handler. */
+static THREAD_LOCAL volatile unsigned int block_count;
+static THREAD_LOCAL volatile bool sample_pending;
+
+static struct sampling_profiler_sample *sampling_profiler_sample_get(void)
+{
+	struct sampling_profiler_sample *sample;
+	unsigned int head = ring_head;
+
+	if (head - ring_tail >= SAMPLING_PROFILER_RING_SIZE) {
+		ring_dropped++;
+		return NULL;
+	}
+	sample = &ring[head % SAMPLING_PROFILER_RING_SIZE];
+	sample->label = current_label;
+	return sample;
+}
+
+static void
+sampling_profiler_signal(const siginfo_t *si ATTR_UNUSED,
+			 void *context ATTR_UNUSED)
+{
+	struct sampling_profiler_sample *sample;
+
+	/* backtrace() takes the dynamic linker's and the unwinder's locks.
+	   Interrupting code that holds them would deadlock, so don't unwind
+	   inside a blocked section. */
+	if (block_count > 0) {
+		sample_pending = TRUE;
+		return;
+	}
+	sample_pending = FALSE;
+	if ((sample = sampling_profiler_sample_get()) == NULL)
+		return;
+	sample->depth = backtrace(sample->frames, N_ELEMENTS(sample->frames));
+	sample->skip_frames = SAMPLING_PROFILER_SKIP_FRAMES;
+	ring_head++;
+}
+
+void sampling_profiler_block(void)
+{
+	block_count++;
+}
+
+void sampling_profiler_unblock(void)
+{
+	struct sampling_profiler_sample *sample;
+	int old_errno = errno;
+
+	i_assert(block_count > 0);
+
+	if (block_count == 1 && sample_pending && profiler != NULL) {
+		/* the signal arrived while blocked. take the sample now,
+		   while still blocked so the signal can't unwind at the
+		   same time. */
+		sample_pending = FALSE;
+		if ((sample = sampling_profiler_sample_get()) != NULL) {
+			sample->depth = backtrace(sample->frames,
+						  N_ELEMENTS(sample->frames));
+			/* skip only this function */
+			sample->skip_frames = 1;
+			ring_head++;
+		}
+		errno = old_errno;
+	}
+	block_count--;
+}
+
+static const char *sampling_profiler_symbol(void *addr)
+{
+	const char *symbol, *p, *name, *end;
+	char **strings;
+
+	symbol = hash_table_lookup(profiler->symbols, addr);
+	if (symbol != NULL)
+		return symbol;
+
+	/* dladdr() takes the dynamic linker's lock */
+	sampling_profiler_block();
+	strings = backtrace_symbols(&addr, 1);
+	sampling_profiler_unblock();
+	if (strings == NULL)
+		symbol = p_strdup_printf(profiler->pool, "%p", addr);
+	else {
+		/* The string is usually "/path/binary(function+0x12) [0x..]".
+		   Use only the function name, so all the samples within the
+		   function are aggregated together. Without the function name
+		   use binary+offset. */
+		p = strrchr(strings[0], '/');
+		p = p == NULL ? strings[0] : p + 1;
+		name = strchr(p, '(');
+		end = name == NULL ? NULL : strchr(name, '+');
+		if (end == NULL)
+			symbol = p_strdup_printf(profiler->pool, "%p", addr);
+		else if (end == name + 1) {
+			symbol = p_strdup_printf(profiler->pool, "%s%s",
+				t_strdup_until(p, name),
+				t_strcut(end, ')'));
+		} else {
+			symbol = p_strdup_until(profiler->pool, name + 1, end);
+		}
+		free(strings);
+	}
+	hash_table_insert(profiler->symbols, addr, symbol);
+	return symbol;
+}
+
+static void
+sampling_profiler_add_sample(const struct sampling_profiler_sample *sample)
+{
+	struct sampling_profiler_stack *stack;
+	const char *label = sample->label == NULL ? "" : sample->label;
+	string_t *folded = t_str_new(256);
+	int i;
+
+	str_append(folded, label);
+	for (i = sample->depth - 1; i >= sample->skip_frames; i--) {
+		str_append_c(folded, ';');
+		str_append(folded, sampling_profiler_symbol(sample->frames[i]));
+	}
+
+	stack = hash_table_lookup(profiler->stacks_hash, str_c(folded));
+	if (stack == NULL &&
+	    array_count(&profiler->stacks) >= SAMPLING_PROFILER_MAX_STACKS) {
+		str_truncate(folded, strlen(label));
+		str_printfa(folded, ";%s", SAMPLING_PROFILER_OTHER_STACK);
+		stack = hash_table_lookup(profiler->stacks_hash,
+					  str_c(folded));
+	}
+	if (stack == NULL) {
+		stack = p_new(profiler->pool, struct sampling_profiler_stack, 1);
+		stack->folded = p_strdup(profiler->pool, str_c(folded));
+		stack->label = p_strdup(profiler->pool, label);
+		stack->stack = stack->folded + strlen(label);
+		if (stack->stack[0] == ';')
+			stack->stack++;
+		hash_table_insert(profiler->stacks_hash, stack->folded, stack);
+		array_push_back(&profiler->stacks, &stack);
+	}
+	stack->count++;
+}
+
+void sampling_profiler_drain(void)
+{
+	unsigned int head;
+
+	if (profiler == NULL)
+		return;
+
+	head = ring_head;
+	for (; ring_tail != head; ring_tail++) T_BEGIN {
+		sampling_profiler_add_sample(
+			&ring[ring_tail % SAMPLING_PROFILER_RING_SIZE]);
+	} T_END;
+}
+
+void sampling_profiler_send_events(void)
+{
+	struct sampling_profiler_stack *stack;
+	unsigned int dropped;
+
+	if (profiler == NULL)
+		return;
+
+	sampling_profiler_drain();
+	profiler->last_send = ioloop_time;
+	array_foreach_elem(&profiler->stacks, stack) {
+		if (stack->count == stack->sent_count)
+			continue;
+
+		unsigned int samples = stack->count - stack->sent_count;
+		stack->sent_count = stack->count;
+		e_debug(event_create_passthrough(profiler->event)->
+			set_name("sampling_profile")->
+			add_str("label", stack->label)->
+			add_str("stack", stack->stack)->
+			add_int("samples", samples)->
+			add_int("interval_msecs", profiler->interval_msecs)->
+			event(), "%s %u", stack->folded, samples);
+	}
+
+	dropped = ring_dropped;
+	if (dropped != profiler->sent_dropped_count) {
+		e_debug(profiler->event,
+			"Dropped %u samples, because ring buffer was full",
+			dropped - profiler->sent_dropped_count);
+		profiler->sent_dropped_count = dropped;
+	}
+}
+
+void sampling_profiler_append_folded(string_t *dest)
+{
+	struct sampling_profiler_stack *stack;
+
+	if (profiler == NULL)
+		return;
+
+	sampling_profiler_drain();
+	array_foreach_elem(&profiler->stacks, stack)
+		str_printfa(dest, "%s %u\n", stack->folded, stack->count);
+}
+
+unsigned int sampling_profiler_get_dropped_count(void)
+{
+	return ring_dropped;
+}
+
+static void sampling_profiler_timeout(void *context ATTR_UNUSED)
+{
+	sampling_profiler_drain();
+	if (ioloop_time - profiler->last_send >=
+	    SAMPLING_PROFILER_SEND_INTERVAL_SECS)
+		sampling_profiler_send_events();
+}
+
+static const char *sampling_profiler_intern_label(const char *label)
+{
+	const char *interned, *key;
+	char *p;
+
+	interned = hash_table_lookup(profiler->labels, label);
+	if (interned != NULL)
+		return interned;
+	if (hash_table_count(profiler->labels) >= SAMPLING_PROFILER_MAX_LABELS)
+		return SAMPLING_PROFILER_OTHER_LABEL;
+
+	/* ';' and ' ' have special meaning in the folded format */
+	p = p_strdup(profiler->pool, label);
+	interned = p;
+	for (; *p != '\0'; p++) {
+		if (*p == ';' || *p == ' ')
+			*p = '_';
+	}
+	key = p_strdup(profiler->pool, label);
+	hash_table_insert(profiler->labels, key, interned);
+	return interned;
+}
+
+const char *sampling_profiler_set_label(const char *label)
+{
+	const char *old_label = current_label;
+	const char *interned;
+
+	if (profiler == NULL)
+		return NULL;
+
+	interned = label == NULL ? NULL :
+		sampling_profiler_intern_label(label);
+	current_label = interned;
+
+	/* drain early if the ring is getting full, e.g. because the ioloop
+	   is busy running a long command */
+	if (ring_head - ring_tail >= SAMPLING_PROFILER_RING_SIZE / 2)
+		sampling_profiler_drain();
+	return old_label;
+}
+
+int sampling_profiler_init(unsigned int interval_msecs,
+			   struct event *event_parent, const char **error_r)
+{
+	struct itimerval itv;
+	void *frames[SAMPLING_PROFILER_MAX_FRAMES];
+	pool_t pool;
+
+	i_assert(profiler == NULL);
+	i_assert(interval_msecs > 0);
+
+	/* The first backtrace() call may load libgcc, which isn't safe to do
+	   inside a signal handler. */
+	(void)backtrace(frames, N_ELEMENTS(frames));
+
+	pool = pool_alloconly_create("sampling profiler", 1024*16);
+	profiler = p_new(pool, struct sampling_profiler, 1);
+	profiler->pool = pool;
+	profiler->interval_msecs = interval_msecs;
+	profiler->last_send = ioloop_time;
+	profiler->event = event_create(event_parent);
+	event_set_append_log_prefix(profiler->event, "sampling-profiler: ");
+	hash_table_create(&profiler->labels, default_pool, 0, str_hash, strcmp);
+	hash_table_create_direct(&profiler->symbols, default_pool, 0);
+	hash_table_create(&profiler->stacks_hash, default_pool, 0,
+			  str_hash, strcmp);
+	i_array_init(&profiler->stacks, 64);
+
+	ring = i_new(struct sampling_profiler_sample,
+		     SAMPLING_PROFILER_RING_SIZE);
+	ring_head = ring_tail = ring_dropped = 0;
+	current_label = NULL;
+	sample_pending = FALSE;
+	lib_signals_set_handler(SIGPROF, LIBSIG_FLAG_RESTART,
+				sampling_profiler_signal, NULL);
+
+	i_zero(&itv);
+	itv.it_interval.tv_sec = interval_msecs / 1000;
+	itv.it_interval.tv_usec = (interval_msecs % 1000) * 1000;
+	itv.it_value = itv.it_interval;
+	if (setitimer(ITIMER_PROF, &itv, NULL) < 0) {
+		*error_r = t_strdup_printf("setitimer(ITIMER_PROF) failed: %m");
+		sampling_profiler_deinit();
+		return -1;
+	}
+	profiler->to_drain = timeout_add(SAMPLING_PROFILER_DRAIN_MSECS,
+					 sampling_profiler_timeout, NULL);
+	return 0;
+}
+
+void sampling_profiler_deinit(void)
+{
+	struct itimerval itv;
+	pool_t pool;
+
+	if (profiler == NULL)
+		return;
+
+	i_zero(&itv);
+	if (setitimer(ITIMER_PROF, &itv, NULL) < 0)
+		i_error("setitimer(ITIMER_PROF) failed: %m");
+	lib_signals_unset_handler(SIGPROF, sampling_profiler_signal, NULL);
+
+	sampling_profiler_send_events();
+	current_label = NULL;
+	i_free(ring);
+
+	timeout_remove(&profiler->to_drain);
+	hash_table_destroy(&profiler->labels);
+	hash_table_destroy(&profiler->symbols);
+	hash_table_destroy(&profiler->stacks_hash);
+	array_free(&profiler->stacks);
+	event_unref(&profiler->event);
+	pool = profiler->pool;
+	profiler = NULL;
+	pool_unref(&pool);
+}
+
+bool sampling_profiler_is_running(void)
+{
+	return profiler != NULL;
+}
+
+#else
+
+int sampling_profiler_init(unsigned int interval_msecs ATTR_UNUSED,
+			   struct event *event_parent ATTR_UNUSED,
+			   const char **error_r)
+{
+	*error_r = "Sampling profiler not supported in this system";
+	return -1;
+}
+
+void sampling_profiler_deinit(void)
+{
+}
+
+bool sampling_profiler_is_running(void)
+{
+	return FALSE;
+}
+
+void sampling_profiler_block(void)
+{
+}
+
+void sampling_profiler_unblock(void)
+{
+}
+
+const char *sampling_profiler_set_label(const char *label ATTR_UNUSED)
+{
+	return NULL;
+}
+
+void sampling_profiler_drain(void)
+{
+}
+
+void sampling_profiler_send_events(void)
+{
+}
+
+void sampling_profiler_append_folded(string_t *dest ATTR_UNUSED)
+{
+}
+
+unsigned int sampling_profiler_get_dropped_count(void)
+{
+	return 0;
+}
+
+#endif
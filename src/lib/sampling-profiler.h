@@ -0,0 +1,50 @@
+#ifndef SAMPLING_PROFILER_H
+#define SAMPLING_PROFILER_H
+
+/* Per-process sampling CPU profiler. A profiling timer signal captures the
+   current stack into a ring buffer, which is later aggregated in the main
+   loop into "folded stacks" (label;outermost;...;innermost count), as used
+   by e.g. flamegraph tools. Samples are aggregated per label, which is
+   typically the name of the command being executed.
+
+   The aggregated samples are periodically sent as "sampling_profile"
+   events with fields:
+
+   label - Label set by sampling_profiler_set_label(), or "" if none
+   stack - Folded stack without the label, outermost frame first
+   samples - Number of new samples for the stack since the last event
+   interval_msecs - The sampling interval */
+
+/* Start profiling with the given sampling interval. The events are sent
+   as children of event_parent. Returns 0 on success, -1 if profiling isn't
+   supported in this system. */
+int sampling_profiler_init(unsigned int interval_msecs,
+			   struct event *event_parent, const char **error_r);
+/* Stop profiling and send the remaining samples as events. */
+void sampling_profiler_deinit(void);
+bool sampling_profiler_is_running(void);
+
+/* Set the label new samples are aggregated under. NULL clears the label.
+   Returns the previous label, which can be given back to restore it. This
+   is a no-op returning NULL when the profiler isn't running. */
+const char *sampling_profiler_set_label(const char *label);
+
+/* Code that may hold the locks used by backtrace() - dlopen(), dlclose(),
+   dladdr() and stack unwinding - must be called between these. A sample
+   falling within the block is taken only when it ends. These can be nested
+   and called also when the profiler isn't running. */
+void sampling_profiler_block(void);
+void sampling_profiler_unblock(void);
+
+/* Aggregate all the samples in the ring buffer. */
+void sampling_profiler_drain(void);
+/* Drain and send events for all the stacks that have new samples since the
+   previous call. */
+void sampling_profiler_send_events(void);
+/* Drain and append all the samples aggregated so far in folded format,
+   one stack per line. */
+void sampling_profiler_append_folded(string_t *dest);
+/* Returns the number of samples lost, because the ring buffer was full. */
+unsigned int sampling_profiler_get_dropped_count(void);
+
+#endif
@@ -877,6 +877,72 @@ static void test_connection_output_throttle(void)
 
 /* END OUTPUT THROTTLE TEST */
 
+/* BEGIN FORKED TEST */
+
+static const struct connection_settings forked_client_set =
+{
+	.service_name_in = "TEST-S",
+	.service_name_out = "TEST-C",
+	.major_version = 1,
+	.minor_version = 0,
+	.client = TRUE,
+	.dont_send_version = TRUE,
+	.input_max_size = SIZE_MAX,
+	.output_max_size = SIZE_MAX,
+};
+
+static const struct connection_vfuncs forked_client_v = {
+	.destroy = test_connection_simple_destroy,
+};
+
+static void test_connection_forked(void)
+{
+	struct connection_list *clients;
+	struct connection *conn;
+	char buf[16];
+	int fds[2], parent_fd;
+
+	test_begin("connection forked");
+
+	struct ioloop *loop = io_loop_create();
+	clients = connection_list_init(&forked_client_set, &forked_client_v);
+	conn = i_new(struct connection, 1);
+
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	/* the parent process's copy of the socket */
+	parent_fd = dup(fds[0]);
+	test_assert(parent_fd != -1);
+	connection_init_client_fd(clients, conn, "server", fds[0], fds[0]);
+
+	/* buffered output belongs to the parent, so it's not sent */
+	o_stream_cork(conn->output);
+	o_stream_nsend_str(conn->output, "child\n");
+	connection_forked(conn);
+	test_assert(conn->disconnected);
+	test_assert(conn->fd_in == -1 && conn->fd_out == -1);
+
+	/* the parent's connection still works both ways */
+	test_assert(write(parent_fd, "parent\n", 7) == 7);
+	test_assert(read(fds[1], buf, sizeof(buf)) == 7 &&
+		    memcmp(buf, "parent\n", 7) == 0);
+	test_assert(write(fds[1], "reply\n", 6) == 6);
+	test_assert(read(parent_fd, buf, sizeof(buf)) == 6 &&
+		    memcmp(buf, "reply\n", 6) == 0);
+
+	i_close_fd(&parent_fd);
+	test_assert(read(fds[1], buf, sizeof(buf)) == 0);
+	i_close_fd(&fds[1]);
+
+	connection_deinit(conn);
+	i_free(conn);
+	connection_list_deinit(&clients);
+	io_loop_destroy(&loop);
+
+	test_end();
+}
+
+/* END FORKED TEST */
+
 void test_connection(void)
 {
 	test_connection_simple();
@@ -895,4 +961,5 @@ void test_connection(void)
 	test_connection_no_version();
 	test_connection_is_valid_dns_name();
 	test_connection_output_throttle();
+	test_connection_forked();
 }
@@ -33,6 +33,16 @@ static void check_expr(const char *test_name,
 					    log_type);
 	test_out_quiet(t_strdup_printf("%s:got=expected", test_name),
 		       got == expected);
+
+	/* the compiled program must give the same result. The log type bits
+	   are in the same order as enum log_type. */
+	struct failure_context ctx = { .type = LOG_TYPE_DEBUG };
+	while ((1U << ctx.type) != log_type)
+		ctx.type++;
+	got = event_filter_match_source(filter, event, SOURCE_FILENAME,
+					SOURCE_LINE, &ctx);
+	test_out_quiet(t_strdup_printf("%s:program got=expected", test_name),
+		       got == expected);
 }
 
 static void do_test_expr(const char *filter_string, struct event *event,
@@ -1,6 +1,7 @@
 /* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "str.h"
 #include "ioloop.h"
 #include "event-filter-private.h"
 
@@ -1123,6 +1124,133 @@ static void test_event_filter_timeval_values(void)
 	test_end();
 }
 
+static const char *
+test_event_filter_iter_contexts(struct event_filter *filter, struct event *e)
+{
+	const struct failure_context failure_ctx = {
+		.type = LOG_TYPE_DEBUG
+	};
+	struct event_filter_match_iter *iter;
+	string_t *str = t_str_new(32);
+	const char *context;
+
+	iter = event_filter_match_iter_init(filter, e, &failure_ctx);
+	while ((context = event_filter_match_iter_next(iter)) != NULL)
+		str_append(str, context);
+	event_filter_match_iter_deinit(&iter);
+	return str_c(str);
+}
+
+static void test_event_filter_program(void)
+{
+	static struct event_category cat1 = { .name = "program1" };
+	static struct event_category cat2 = { .name = "program2" };
+	static const char *const queries[] = {
+		"event=a",
+		"category=program1",
+		"event=b OR event=a",
+		"event=b AND NOT field=x",
+		"(event=c AND field=y) OR event=\"a*\"",
+		"category=program2 AND event=b",
+		"event=a AND NOT event=a",
+	};
+	static const char *const contexts[] = {
+		"1", "2", "3", "4", "5", "6", "7"
+	};
+	struct event_filter *filter, *query_filter;
+	const char *error;
+	unsigned int i;
+
+	test_begin("event filter: program");
+
+	filter = event_filter_create();
+	for (i = 0; i < N_ELEMENTS(queries); i++) {
+		query_filter = event_filter_create();
+		test_assert_idx(event_filter_parse(queries[i], query_filter,
+						   &error) == 0, i);
+		event_filter_merge_with_context(filter, query_filter,
+						(void *)contexts[i]);
+		event_filter_unref(&query_filter);
+	}
+
+	struct event *e = event_create(NULL);
+	event_add_category(e, &cat1);
+	event_set_name(e, "a");
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, e), "1235");
+	event_set_name(e, "b");
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, e), "234");
+	event_add_str(e, "field", "x");
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, e), "23");
+	event_set_name(e, "c");
+	event_add_str(e, "field", "y");
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, e), "25");
+
+	/* category registered after the filter was compiled */
+	event_set_name(e, "b");
+	struct event *child = event_create(e);
+	event_set_name(child, "b");
+	event_add_category(child, &cat2);
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, child), "2346");
+	event_unref(&child);
+
+	/* removing queries recompiles the program */
+	test_assert(event_filter_remove_queries_with_context(filter,
+		(void *)contexts[1]));
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, e), "34");
+
+	/* same results when walking the trees */
+	event_filter_set_program_disabled_for_testing(TRUE);
+	test_assert_strcmp(test_event_filter_iter_contexts(filter, e), "34");
+	event_filter_set_program_disabled_for_testing(FALSE);
+
+	event_filter_unref(&filter);
+	event_unref(&e);
+	test_end();
+}
+
+static void test_event_filter_program_many_categories(void)
+{
+	/* registered categories can't be freed */
+	static struct event_category cats[70];
+	static char names[N_ELEMENTS(cats)][16];
+	struct event_filter *filter;
+	const struct failure_context failure_ctx = {
+		.type = LOG_TYPE_DEBUG
+	};
+	const char *error;
+	unsigned int i;
+
+	test_begin("event filter: program with many categories");
+
+	filter = event_filter_create();
+	for (i = 0; i < N_ELEMENTS(cats); i++) {
+		i_snprintf(names[i], sizeof(names[i]), "manycat%u", i);
+		cats[i].name = names[i];
+		test_assert_idx(event_filter_parse(
+			t_strdup_printf("category=manycat%u AND event=e%u", i, i),
+			filter, &error) == 0, i);
+	}
+
+	struct event *e = event_create(NULL);
+	for (i = 0; i < N_ELEMENTS(cats); i++)
+		event_add_category(e, &cats[i]);
+	for (i = 0; i < N_ELEMENTS(cats); i++) {
+		event_set_name(e, t_strdup_printf("e%u", i));
+		test_assert_idx(event_filter_match(filter, e, &failure_ctx), i);
+	}
+	event_unref(&e);
+
+	e = event_create(NULL);
+	for (i = 0; i < N_ELEMENTS(cats); i++) {
+		event_set_name(e, t_strdup_printf("e%u", i));
+		test_assert_idx(!event_filter_match(filter, e, &failure_ctx), i);
+	}
+	event_unref(&e);
+
+	event_filter_unref(&filter);
+	test_end();
+}
+
 void test_event_filter(void)
 {
 	test_event_filter_strings();
@@ -1145,4 +1273,6 @@ void test_event_filter(void)
 	test_event_filter_interval_values();
 	test_event_filter_ambiguous_units();
 	test_event_filter_timeval_values();
+	test_event_filter_program();
+	test_event_filter_program_many_categories();
 }
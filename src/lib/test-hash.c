@@ -4,7 +4,7 @@
 #include "hash.h"
 
 
-static void test_hash_random_pool(pool_t pool)
+static void test_hash_random_pool(pool_t pool, bool open)
 {
 	const unsigned int keymax = ON_VALGRIND ? 10000 : 100000;
 	HASH_TABLE(void *, void *) hash;
@@ -12,7 +12,10 @@ static void test_hash_random_pool(pool_t pool)
 	unsigned int i, key, keyidx, delidx;
 
 	keys = i_new(unsigned int, keymax); keyidx = 0;
-	hash_table_create_direct(&hash, pool, 0);
+	if (open)
+		hash_table_create_open_direct(&hash, pool, 0);
+	else
+		hash_table_create_direct(&hash, pool, 0);
 	for (i = 0; i < keymax; i++) {
 		key = (i_rand_limit(keymax)) + 1;
 		if (i_rand_limit(5) > 0) {
@@ -35,15 +38,93 @@ static void test_hash_random_pool(pool_t pool)
 	i_free(keys);
 }
 
+static void test_hash_iterate_frozen(bool open)
+{
+	HASH_TABLE(char *, void *) hash;
+	struct hash_iterate_context *iter;
+	const unsigned int count = 1000;
+	unsigned int i, n, seen[1000];
+	char *key, *orig_key;
+	void *value;
+
+	if (open)
+		hash_table_create_open(&hash, default_pool, 0, str_hash, strcmp);
+	else
+		hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < count; i++) {
+		key = i_strdup_printf("%u", i);
+		hash_table_insert(hash, key, POINTER_CAST(i + 1));
+	}
+	test_assert(hash_table_count(hash) == count);
+
+	/* update keeps the original key */
+	key = t_strdup_noconst("10");
+	hash_table_update(hash, key, POINTER_CAST(11));
+	test_assert(hash_table_lookup_full(hash, (const char *)"10",
+					   &orig_key, &value));
+	test_assert(orig_key != key);
+	test_assert(value == POINTER_CAST(11));
+
+	/* remove every other node and add new nodes while iterating */
+	memset(seen, 0, sizeof(seen));
+	iter = hash_table_iterate_init(hash);
+	for (n = 0; hash_table_iterate(iter, hash, &key, &value); n++) {
+		i = POINTER_CAST_TO(value, unsigned int) - 1;
+		if (i == count) {
+			/* added during the iteration */
+			continue;
+		}
+		seen[i]++;
+		if (i % 2 == 0) {
+			hash_table_remove(hash, key);
+			i_free(key);
+		}
+		if (n < 100) {
+			key = i_strdup_printf("new%u", n);
+			hash_table_insert(hash, key, POINTER_CAST(count + 1));
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	/* all the original nodes were seen exactly once */
+	for (i = 0; i < count; i++)
+		test_assert_idx(seen[i] == 1, i);
+	test_assert(hash_table_count(hash) == count/2 + 100);
+	for (i = 0; i < count; i++) {
+		test_assert_idx((hash_table_lookup(hash, dec2str(i)) != NULL) ==
+				(i % 2 == 1), i);
+	}
+
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		hash_table_remove(hash, key);
+		i_free(key);
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(hash_table_count(hash) == 0);
+	hash_table_destroy(&hash);
+}
+
 void test_hash(void)
 {
 	pool_t pool;
 
 	test_begin("hash table (random)");
-	test_hash_random_pool(default_pool);
+	test_hash_random_pool(default_pool, FALSE);
 
 	pool = pool_alloconly_create("test hash", 1024);
-	test_hash_random_pool(pool);
+	test_hash_random_pool(pool, FALSE);
 	pool_unref(&pool);
 	test_end();
+
+	test_begin("hash table open (random)");
+	test_hash_random_pool(default_pool, TRUE);
+	test_end();
+
+	test_begin("hash table iterate frozen");
+	test_hash_iterate_frozen(FALSE);
+	test_end();
+
+	test_begin("hash table open iterate frozen");
+	test_hash_iterate_frozen(TRUE);
+	test_end();
 }
@@ -7,6 +7,7 @@
 #include "istream.h"
 
 #include <unistd.h>
+#include <sys/wait.h>
 
 struct test_ctx {
 	bool got_left;
@@ -225,6 +226,91 @@ static void test_ioloop_zero_timeout_recreate(void)
 	test_end();
 }
 
+struct recreate_ctx {
+	bool got_parent, got_child, got_to;
+};
+
+static void test_ioloop_recreate_parent_cb(struct recreate_ctx *ctx)
+{
+	ctx->got_parent = TRUE;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_recreate_child_cb(struct recreate_ctx *ctx)
+{
+	ctx->got_child = TRUE;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_recreate_to(struct recreate_ctx *ctx)
+{
+	ctx->got_to = TRUE;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_recreate_after_fork(void)
+{
+	struct recreate_ctx ctx;
+	struct ioloop *ioloop;
+	struct io *io_parent, *io_child;
+	struct timeout *to;
+	int fd_parent[2], fd_child[2], status;
+	pid_t pid;
+	char c = 0;
+
+	test_begin("ioloop recreate after fork");
+	i_zero(&ctx);
+	if (pipe(fd_parent) < 0 || pipe(fd_child) < 0)
+		i_fatal("pipe() failed: %m");
+
+	ioloop = io_loop_create();
+	io_parent = io_add(fd_parent[0], IO_READ,
+			   test_ioloop_recreate_parent_cb, &ctx);
+	io_child = io_add(fd_child[0], IO_READ,
+			  test_ioloop_recreate_child_cb, &ctx);
+	to = timeout_add(5000, test_ioloop_recreate_to, &ctx);
+
+	switch (pid = fork()) {
+	case (pid_t)-1:
+		i_fatal("fork() failed: %m");
+	case 0:
+		/* Removing the parent's io must not affect the parent
+		   process. With a shared kernel ioloop state it would. */
+		io_loop_recreate(ioloop);
+		io_remove(&io_parent);
+		/* the child's own io still works */
+		if (write(fd_child[1], &c, 1) < 0)
+			i_fatal("write(pipe) failed: %m");
+		io_loop_run(ioloop);
+		if (write(fd_parent[1], &c, 1) < 0)
+			i_fatal("write(pipe) failed: %m");
+		timeout_remove(&to);
+		io_remove(&io_child);
+		io_loop_destroy(&ioloop);
+		test_exit(ctx.got_child && !ctx.got_to ? 0 : 1);
+	default:
+		break;
+	}
+
+	io_remove(&io_child);
+	io_loop_run(ioloop);
+	test_assert(ctx.got_parent);
+	test_assert(!ctx.got_to);
+
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	timeout_remove(&to);
+	io_remove(&io_parent);
+	io_loop_destroy(&ioloop);
+	i_close_fd(&fd_parent[0]);
+	i_close_fd(&fd_parent[1]);
+	i_close_fd(&fd_child[0]);
+	i_close_fd(&fd_child[1]);
+	test_end();
+}
+
 static void io_callback(void *context ATTR_UNUSED)
 {
 }
@@ -396,6 +482,7 @@ void test_ioloop(void)
 	test_ioloop_timeout();
 	test_ioloop_zero_timeout();
 	test_ioloop_zero_timeout_recreate();
+	test_ioloop_recreate_after_fork();
 	test_ioloop_find_fd_conditions();
 	test_ioloop_pending_io();
 	test_ioloop_fd();
@@ -141,10 +141,60 @@ static void test_iostream_temp_istream(void)
 	test_end();
 }
 
+static void test_iostream_temp_mem_budget(void)
+{
+	struct iostream_temp_mem_budget budget = { .max_size = 10 };
+	struct ostream *output1, *output2;
+	struct istream *input1, *input2;
+
+	test_begin("iostream_temp mem budget");
+
+	output1 = iostream_temp_create_sized(".", 0, "test", 8);
+	iostream_temp_set_mem_budget(output1, &budget);
+	output2 = iostream_temp_create_sized(".", 0, "test", 8);
+	iostream_temp_set_mem_budget(output2, &budget);
+
+	test_assert(o_stream_send(output1, "123456", 6) == 6);
+	test_assert(budget.used_size == 6);
+	test_assert(o_stream_get_fd(output1) == -1);
+	test_assert(o_stream_send(output2, "1234", 4) == 4);
+	test_assert(budget.used_size == 10);
+	test_assert(o_stream_get_fd(output2) == -1);
+
+	/* exceeds the budget, but not the stream's own limit */
+	test_assert(o_stream_send(output2, "5", 1) == 1);
+	test_assert(o_stream_get_fd(output2) != -1);
+	test_assert(budget.used_size == 6);
+	test_assert(budget.exceeded_count == 1);
+
+	/* memory buffer stays in the budget until the istream is freed */
+	input1 = iostream_temp_finish(&output1, 128);
+	test_assert(i_stream_get_fd(input1) == -1);
+	test_assert(budget.used_size == 6);
+	input2 = iostream_temp_finish(&output2, 128);
+	test_assert(i_stream_get_fd(input2) != -1);
+	test_assert(budget.used_size == 6);
+	i_stream_destroy(&input1);
+	test_assert(budget.used_size == 0);
+	i_stream_destroy(&input2);
+
+	/* destroying the ostream frees its usage */
+	output1 = iostream_temp_create_sized(".", 0, "test", 8);
+	iostream_temp_set_mem_budget(output1, &budget);
+	test_assert(o_stream_send(output1, "1234", 4) == 4);
+	test_assert(budget.used_size == 4);
+	o_stream_destroy(&output1);
+	test_assert(budget.used_size == 0);
+	test_assert(budget.exceeded_count == 1);
+
+	test_end();
+}
+
 void test_iostream_temp(void)
 {
 	test_iostream_temp_create_sized_memory();
 	test_iostream_temp_create_sized_disk();
 	test_iostream_temp_create_write_error();
 	test_iostream_temp_istream();
+	test_iostream_temp_mem_budget();
 }
@@ -4,9 +4,11 @@
 #include "time-util.h"
 #include "ioloop.h"
 #include "lib-signals.h"
+#include "sleep.h"
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 struct test_context_delayed {
 	bool timed_out:1;
@@ -236,10 +238,74 @@ test_lib_signals_delayed_no_ioloop_automove(void)
 	test_end();
 }
 
+static void
+test_lib_signals_forked(void)
+{
+	struct test_context_delayed tctx;
+	struct timeout *to_kill, *to_test;
+	struct ioloop *ioloop;
+	pid_t pid;
+	int status;
+
+	test_begin("lib-signals forked");
+
+	i_zero(&tctx);
+
+	ioloop = io_loop_create();
+	lib_signals_init();
+	lib_signals_set_handler(SIGALRM,
+		LIBSIG_FLAGS_SAFE | LIBSIG_FLAG_IOLOOP_AUTOMOVE,
+		signal_handler_delayed, &tctx);
+
+	if ((pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		/* The child's signal must be handled by the child. Give the
+		   parent time to read the signal pipe if it was still shared
+		   with it. */
+		io_loop_recreate(ioloop);
+		lib_signals_forked();
+		kill_timeout(&tctx);
+		i_sleep_msecs(200);
+		to_test = timeout_add_short(400, test_timeout, &tctx);
+		io_loop_run(ioloop);
+		_exit(!tctx.timed_out && tctx.signal_handled ? 0 : 1);
+	}
+
+	/* the parent is running its ioloop at the same time, but it must
+	   not see the child's signal */
+	to_test = timeout_add_short(800, test_timeout, &tctx);
+	io_loop_run(ioloop);
+	timeout_remove(&to_test);
+	test_assert(tctx.timed_out);
+	test_assert(!tctx.signal_handled);
+
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* the parent's own signals still work */
+	i_zero(&tctx);
+	to_kill = timeout_add_short(100, kill_timeout, &tctx);
+	to_test = timeout_add_short(400, test_timeout, &tctx);
+	io_loop_run(ioloop);
+	timeout_remove(&to_kill);
+	timeout_remove(&to_test);
+
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+
+	test_assert(!tctx.timed_out);
+	test_assert(tctx.signal_handled);
+
+	test_end();
+}
+
 
 void test_lib_signals(void)
 {
 	test_lib_signals_delayed();
 	test_lib_signals_delayed_nested_ioloop();
 	test_lib_signals_delayed_no_ioloop_automove();
+	test_lib_signals_forked();
 }
@@ -0,0 +1,202 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+#define SENSE 0xAB
+
+static bool mem_has_bytes(const void *mem, size_t size, uint8_t b)
+{
+	const uint8_t *bytes = mem;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (bytes[i] != b)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void test_mempool_slab_alloc_free(void)
+{
+	struct pool_slab_stats stats;
+	void *mem[1000];
+	pool_t pool;
+	size_t used = 0;
+	unsigned int i;
+
+	test_begin("mempool slab alloc and free");
+	pool = pool_slab_create("test");
+
+	for (i = 0; i < N_ELEMENTS(mem); i++) {
+		mem[i] = p_malloc(pool, i + 1);
+		test_assert_idx(mem_has_bytes(mem[i], i + 1, 0), i);
+		memset(mem[i], SENSE, i + 1);
+	}
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == N_ELEMENTS(mem));
+	test_assert(stats.total_alloc_count == N_ELEMENTS(mem));
+	test_assert(stats.large_alloc_count == 0);
+	test_assert(stats.slab_count > 0);
+	test_assert(stats.used_size >=
+		    N_ELEMENTS(mem) * (N_ELEMENTS(mem) + 1) / 2);
+	test_assert(stats.alloc_size >= stats.used_size);
+
+	/* free every other allocation and allocate them again */
+	for (i = 0; i < N_ELEMENTS(mem); i += 2) {
+		test_assert_idx(mem_has_bytes(mem[i], i + 1, SENSE), i);
+		p_free(pool, mem[i]);
+	}
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == N_ELEMENTS(mem) / 2);
+	for (i = 0; i < N_ELEMENTS(mem); i += 2) {
+		mem[i] = p_malloc(pool, i + 1);
+		test_assert_idx(mem_has_bytes(mem[i], i + 1, 0), i);
+		memset(mem[i], SENSE, i + 1);
+	}
+	for (i = 0; i < N_ELEMENTS(mem); i++) {
+		test_assert_idx(mem_has_bytes(mem[i], i + 1, SENSE), i);
+		used += i + 1;
+	}
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == N_ELEMENTS(mem));
+	test_assert(stats.total_alloc_count == N_ELEMENTS(mem) * 3 / 2);
+	test_assert(stats.used_size >= used);
+
+	/* freeing everything releases all but one slab per size class */
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		p_free(pool, mem[i]);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == 0);
+	test_assert(stats.used_size == 0);
+	test_assert(stats.slab_count <= 15);
+
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_large(void)
+{
+	struct pool_slab_stats stats;
+	pool_t pool;
+	void *mem1, *mem2;
+
+	test_begin("mempool slab large allocations");
+	pool = pool_slab_create("test");
+
+	mem1 = p_malloc(pool, 4096);
+	mem2 = p_malloc(pool, 100000);
+	test_assert(mem_has_bytes(mem2, 100000, 0));
+	memset(mem1, SENSE, 4096);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == 2);
+	test_assert(stats.large_alloc_count == 2);
+	test_assert(stats.slab_count == 0);
+	test_assert(stats.used_size == 4096 + 100000);
+
+	/* large -> large */
+	mem1 = p_realloc(pool, mem1, 4096, 8192);
+	test_assert(mem_has_bytes(mem1, 4096, SENSE));
+	test_assert(mem_has_bytes(PTR_OFFSET(mem1, 4096), 4096, 0));
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_size == 8192 + 100000);
+
+	/* large -> small */
+	mem1 = p_realloc(pool, mem1, 8192, 100);
+	test_assert(mem_has_bytes(mem1, 100, SENSE));
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.large_alloc_count == 1);
+	test_assert(stats.slab_count == 1);
+
+	p_free(pool, mem2);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == 1);
+	test_assert(stats.large_alloc_count == 0);
+
+	/* clearing frees everything */
+	p_clear(pool);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == 0);
+	test_assert(stats.slab_count == 0);
+	test_assert(stats.alloc_size == 0);
+
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_realloc(void)
+{
+	pool_t pool;
+	void *mem = NULL, *old_mem;
+	unsigned int i;
+
+	test_begin("mempool slab realloc");
+	pool = pool_slab_create("test");
+
+	for (i = 1; i < 2000; i++) {
+		mem = p_realloc(pool, mem, i-1, i);
+		test_assert_idx(mem_has_bytes(mem, i-1, 0xde), i);
+		test_assert_idx(mem_has_bytes(PTR_OFFSET(mem, i-1), 1, 0), i);
+		memset(mem, 0xde, i);
+	}
+	/* growing within the size class keeps the same memory */
+	p_free(pool, mem);
+	mem = p_malloc(pool, 100);
+	old_mem = mem;
+	mem = p_realloc(pool, mem, 100, 120);
+	test_assert(mem == old_mem);
+	/* shrinking a lot moves it to a smaller size class */
+	memset(mem, SENSE, 120);
+	mem = p_realloc(pool, mem, 120, 10);
+	test_assert(mem_has_bytes(mem, 10, SENSE));
+
+	pool_unref(&pool);
+	test_end();
+}
+
+void test_mempool_slab(void)
+{
+	test_mempool_slab_alloc_free();
+	test_mempool_slab_large();
+	test_mempool_slab_realloc();
+}
+
+enum fatal_test_state fatal_mempool_slab(unsigned int stage)
+{
+	static pool_t pool;
+#ifdef DEBUG
+	unsigned char *mem, *freed;
+#endif
+
+	if (pool == NULL && stage != 0)
+		return FATAL_TEST_FAILURE;
+
+	switch(stage) {
+	case 0: /* forbidden size */
+		test_begin("fatal_mempool_slab");
+		pool = pool_slab_create("fatal");
+		test_expect_fatal_string("Trying to allocate 0 bytes");
+		(void)p_malloc(pool, 0);
+		return FATAL_TEST_FAILURE;
+
+	case 1: /* logically impossible size */
+		test_expect_fatal_string("Trying to allocate");
+		(void)p_malloc(pool, POOL_MAX_ALLOC_SIZE + 1ULL);
+		return FATAL_TEST_FAILURE;
+
+#ifdef DEBUG
+	case 2: /* write after free */
+		mem = p_malloc(pool, 64);
+		freed = mem;
+		p_free(pool, mem);
+		freed[32] = 1;
+		test_expect_fatal_string("was modified");
+		(void)p_malloc(pool, 64);
+		return FATAL_TEST_FAILURE;
+#endif
+	}
+
+	/* Either our tests have finished, or the test suite has got confused. */
+	pool_unref(&pool);
+	test_end();
+	return FATAL_TEST_FINISHED;
+}
@@ -0,0 +1,172 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "str.h"
+#include "ioloop.h"
+#include "lib-signals.h"
+#include "sampling-profiler.h"
+
+#include <time.h>
+#include <signal.h>
+
+#if defined(HAVE_SETITIMER) && defined(HAVE_BACKTRACE_SYMBOLS) && \
+	defined(HAVE_EXECINFO_H)
+static volatile unsigned int test_burn_counter;
+
+static void test_burn_cpu(void)
+{
+	string_t *str = t_str_new(128);
+	clock_t start = clock();
+
+	/* keep burning CPU until there are some samples, but give up after
+	   a few seconds of CPU time */
+	while (clock() - start < 3 * CLOCKS_PER_SEC) {
+		for (unsigned int i = 0; i < 100000; i++)
+			test_burn_counter++;
+		str_truncate(str, 0);
+		sampling_profiler_append_folded(str);
+		if (str_len(str) > 0)
+			break;
+	}
+}
+
+static void test_sampling_profiler_samples(void)
+{
+	struct ioloop *ioloop;
+	const char *error, *old_label, *const *lines;
+	string_t *str = t_str_new(256);
+
+	test_begin("sampling profiler samples");
+	ioloop = io_loop_create();
+	lib_signals_init();
+	test_assert(!sampling_profiler_is_running());
+	test_assert(sampling_profiler_set_label("foo") == NULL);
+
+	test_assert(sampling_profiler_init(1, NULL, &error) == 0);
+	test_assert(sampling_profiler_is_running());
+	old_label = sampling_profiler_set_label("burn;cpu now");
+	test_assert(old_label == NULL);
+	test_burn_cpu();
+	test_assert(strcmp(sampling_profiler_set_label(old_label),
+			   "burn_cpu_now") == 0);
+
+	sampling_profiler_append_folded(str);
+	lines = t_strsplit(str_c(str), "\n");
+	test_assert(lines[0] != NULL && lines[0][0] != '\0');
+	for (; *lines != NULL && **lines != '\0'; lines++) {
+		const char *count = strrchr(*lines, ' ');
+		unsigned int n;
+
+		test_assert(str_begins_with(*lines, "burn_cpu_now;"));
+		test_assert(count != NULL &&
+			    str_to_uint(count + 1, &n) == 0 && n > 0);
+		/* the stack includes the caller of the test function */
+		test_assert(strstr(*lines, "main") != NULL);
+	}
+	sampling_profiler_deinit();
+	test_assert(!sampling_profiler_is_running());
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_sampling_profiler_block(void)
+{
+	struct ioloop *ioloop;
+	const char *error, *const *lines;
+	string_t *str = t_str_new(256);
+	unsigned int blocked_count = 0;
+	sigset_t sigset;
+	clock_t start;
+
+	test_begin("sampling profiler block");
+	ioloop = io_loop_create();
+	lib_signals_init();
+	test_assert(sampling_profiler_init(1, NULL, &error) == 0);
+
+	sampling_profiler_block();
+	sampling_profiler_block();
+	(void)sampling_profiler_set_label("blocked");
+	start = clock();
+	while (clock() - start < CLOCKS_PER_SEC / 20)
+		test_burn_counter++;
+	/* no samples were taken while blocked */
+	sampling_profiler_unblock();
+	sampling_profiler_append_folded(str);
+	test_assert(strstr(str_c(str), "blocked;") == NULL);
+
+	/* the pending signals are taken as a single sample. block the real
+	   signal, so no more samples get the label. */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGPROF);
+	if (sigprocmask(SIG_BLOCK, &sigset, NULL) < 0)
+		i_fatal("sigprocmask() failed: %m");
+	sampling_profiler_unblock();
+	(void)sampling_profiler_set_label("unblocked");
+	if (sigprocmask(SIG_UNBLOCK, &sigset, NULL) < 0)
+		i_fatal("sigprocmask() failed: %m");
+
+	str_truncate(str, 0);
+	sampling_profiler_append_folded(str);
+	for (lines = t_strsplit(str_c(str), "\n"); *lines != NULL; lines++) {
+		if (!str_begins_with(*lines, "blocked;"))
+			continue;
+		test_assert(strstr(*lines, "main") != NULL);
+		test_assert(strcmp(strrchr(*lines, ' '), " 1") == 0);
+		blocked_count++;
+	}
+	test_assert(blocked_count == 1);
+
+	sampling_profiler_deinit();
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_sampling_profiler_labels(void)
+{
+	struct ioloop *ioloop;
+	const char *error, *label;
+	unsigned int i;
+
+	test_begin("sampling profiler labels");
+	ioloop = io_loop_create();
+	lib_signals_init();
+	test_assert(sampling_profiler_init(1000, NULL, &error) == 0);
+
+	/* labels are interned */
+	label = t_strdup("FETCH");
+	(void)sampling_profiler_set_label(label);
+	label = sampling_profiler_set_label(NULL);
+	test_assert(strcmp(label, "FETCH") == 0);
+	(void)sampling_profiler_set_label("FETCH");
+	test_assert(sampling_profiler_set_label(NULL) == label);
+
+	/* the number of labels is limited */
+	for (i = 0; i < 200; i++)
+		(void)sampling_profiler_set_label(dec2str(i));
+	test_assert(strcmp(sampling_profiler_set_label("1"), "(other)") == 0);
+	test_assert(strcmp(sampling_profiler_set_label("FETCH"), "1") == 0);
+
+	sampling_profiler_deinit();
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+#endif
+
+void test_sampling_profiler(void)
+{
+#if defined(HAVE_SETITIMER) && defined(HAVE_BACKTRACE_SYMBOLS) && \
+	defined(HAVE_EXECINFO_H)
+	test_sampling_profiler_samples();
+	test_sampling_profiler_block();
+	test_sampling_profiler_labels();
+#else
+	const char *error;
+
+	test_begin("sampling profiler");
+	test_assert(sampling_profiler_init(10, NULL, &error) == -1);
+	test_end();
+#endif
+}
@@ -0,0 +1,158 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "str.h"
+#include "istream.h"
+#include "ioloop.h"
+#include "thread-pool.h"
+
+#define TEST_JOB_COUNT 100
+
+struct test_job {
+	struct thread_pool_job *job;
+	unsigned int num;
+
+	/* set by the job callback */
+	size_t result_len;
+	unsigned int line_count;
+	bool finished;
+};
+
+static struct test_job test_jobs[TEST_JOB_COUNT];
+static unsigned int test_finished_count;
+
+static void test_job_run(struct test_job *job)
+{
+	const char *data;
+	struct istream *input;
+	const char *line;
+	pool_t pool;
+	string_t *str;
+
+	/* use the thread-safe subset of lib */
+	data = t_strdup_printf("line %u\nsecond line\nthird line\n", job->num);
+	input = i_stream_create_from_data(data, strlen(data));
+	while ((line = i_stream_read_next_line(input)) != NULL)
+		job->line_count++;
+	i_stream_unref(&input);
+
+	pool = pool_alloconly_create("test job", 128);
+	str = str_new(pool, 16);
+	for (unsigned int i = 0; i < 1000; i++)
+		str_printfa(str, "%u", job->num);
+	job->result_len = str_len(str);
+	pool_unref(&pool);
+}
+
+static void test_job_finish(struct test_job *job)
+{
+	test_assert(!job->finished);
+	job->finished = TRUE;
+	job->job = NULL;
+	if (++test_finished_count == TEST_JOB_COUNT)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_jobs_reset(void)
+{
+	for (unsigned int i = 0; i < TEST_JOB_COUNT; i++) {
+		i_zero(&test_jobs[i]);
+		test_jobs[i].num = i;
+	}
+	test_finished_count = 0;
+}
+
+static void test_thread_pool_ioloop(void)
+{
+	struct thread_pool *tpool;
+	struct ioloop *ioloop;
+	unsigned int i;
+
+	test_begin("thread pool ioloop");
+	ioloop = io_loop_create();
+	test_jobs_reset();
+	tpool = thread_pool_init(4);
+	for (i = 0; i < TEST_JOB_COUNT; i++) {
+		test_jobs[i].job = thread_pool_run(tpool, test_job_run,
+						   test_job_finish,
+						   &test_jobs[i]);
+	}
+	test_assert(thread_pool_get_job_count(tpool) == TEST_JOB_COUNT);
+	io_loop_run(ioloop);
+
+	test_assert(thread_pool_get_job_count(tpool) == 0);
+	for (i = 0; i < TEST_JOB_COUNT; i++) {
+		size_t len = strlen(dec2str(i)) * 1000;
+
+		test_assert_idx(test_jobs[i].finished, i);
+		test_assert_idx(test_jobs[i].line_count == 3, i);
+		test_assert_idx(test_jobs[i].result_len == len, i);
+	}
+	thread_pool_deinit(&tpool);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_thread_pool_abort(void)
+{
+	struct thread_pool *tpool;
+	struct ioloop *ioloop;
+	unsigned int i, finished = 0;
+
+	test_begin("thread pool abort");
+	ioloop = io_loop_create();
+	test_jobs_reset();
+	tpool = thread_pool_init(2);
+	for (i = 0; i < TEST_JOB_COUNT; i++) {
+		test_jobs[i].job = thread_pool_run(tpool, test_job_run,
+						   test_job_finish,
+						   &test_jobs[i]);
+	}
+	/* abort every other job, whatever state they're in */
+	for (i = 0; i < TEST_JOB_COUNT; i += 2)
+		thread_pool_job_abort(&test_jobs[i].job);
+	test_assert(thread_pool_get_job_count(tpool) == TEST_JOB_COUNT / 2);
+
+	thread_pool_wait(tpool);
+	test_assert(thread_pool_get_job_count(tpool) == 0);
+	for (i = 0; i < TEST_JOB_COUNT; i++) {
+		test_assert_idx(test_jobs[i].finished == (i % 2 == 1), i);
+		if (test_jobs[i].finished) {
+			test_assert_idx(test_jobs[i].line_count == 3, i);
+			finished++;
+		}
+	}
+	test_assert(finished == TEST_JOB_COUNT / 2);
+	thread_pool_deinit(&tpool);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_thread_pool_deinit(void)
+{
+	struct thread_pool *tpool;
+	struct ioloop *ioloop;
+	unsigned int i;
+
+	test_begin("thread pool deinit");
+	ioloop = io_loop_create();
+	test_jobs_reset();
+	tpool = thread_pool_init(3);
+	for (i = 0; i < TEST_JOB_COUNT; i++) {
+		test_jobs[i].job = thread_pool_run(tpool, test_job_run,
+						   test_job_finish,
+						   &test_jobs[i]);
+	}
+	/* deinit finishes all the jobs */
+	thread_pool_deinit(&tpool);
+	test_assert(test_finished_count == TEST_JOB_COUNT);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+void test_thread_pool(void)
+{
+	test_thread_pool_ioloop();
+	test_thread_pool_abort();
+	test_thread_pool_deinit();
+}
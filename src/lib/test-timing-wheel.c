@@ -0,0 +1,180 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "timing-wheel.h"
+
+#define TEST_START_MSECS 1700000000123ULL
+
+struct tw_test_item {
+	struct timing_wheel_item item;
+	unsigned int num;
+	bool expired;
+};
+
+static void test_timing_wheel_order(void)
+{
+	static const uint64_t input[] = {
+		/* levels 0..3 and overflow, including exact slot edges */
+		5, 1, 63, 64, 65, 4095, 4096, 4097, 100000,
+		262143, 262144, 16777215, 16777216, 16777217, 50000000,
+	};
+	struct tw_test_item items[N_ELEMENTS(input)];
+	struct timing_wheel_item *item;
+	struct timing_wheel *wheel;
+	uint64_t now, prev = 0, next;
+	unsigned int i, count = 0;
+
+	test_begin("timing wheel order");
+	wheel = timing_wheel_init(TEST_START_MSECS);
+	for (i = 0; i < N_ELEMENTS(input); i++) {
+		timing_wheel_item_init(&items[i].item);
+		items[i].num = i;
+		timing_wheel_add(wheel, &items[i].item,
+				 TEST_START_MSECS + input[i]);
+	}
+	test_assert(timing_wheel_count(wheel) == N_ELEMENTS(input));
+
+	now = TEST_START_MSECS;
+	while (timing_wheel_count(wheel) > 0) {
+		next = timing_wheel_get_next_msecs(wheel);
+		test_assert(next > now);
+		now = next;
+		while ((item = timing_wheel_peek_expired(wheel, now)) != NULL) {
+			/* must expire exactly at its time */
+			test_assert(item->expire_msecs == now);
+			test_assert(item->expire_msecs >= prev);
+			prev = item->expire_msecs;
+			timing_wheel_remove(wheel, item);
+			count++;
+		}
+	}
+	test_assert(count == N_ELEMENTS(input));
+	test_assert(timing_wheel_get_next_msecs(wheel) == UINT64_MAX);
+	timing_wheel_deinit(&wheel);
+	test_end();
+}
+
+static void test_timing_wheel_random(void)
+{
+#define TW_RANDOM_ITEMS 200
+	struct tw_test_item items[TW_RANDOM_ITEMS];
+	struct timing_wheel_item *item;
+	struct timing_wheel *wheel;
+	uint64_t now = TEST_START_MSECS, min_expire;
+	unsigned int i, n, expected_count = 0;
+
+	test_begin("timing wheel random");
+	wheel = timing_wheel_init(now);
+	for (i = 0; i < TW_RANDOM_ITEMS; i++) {
+		timing_wheel_item_init(&items[i].item);
+		items[i].num = i;
+	}
+
+	for (n = 0; n < 20000; n++) {
+		/* add, move or remove a random item */
+		i = i_rand_limit(TW_RANDOM_ITEMS);
+		if (timing_wheel_item_is_added(&items[i].item)) {
+			timing_wheel_remove(wheel, &items[i].item);
+			expected_count--;
+		}
+		if (i_rand_limit(4) != 0) {
+			uint64_t msecs = i_rand_limit(4) == 0 ?
+				i_rand_limit(20000000) : i_rand_limit(5000);
+			timing_wheel_add(wheel, &items[i].item, now + msecs);
+			expected_count++;
+		}
+		test_assert(timing_wheel_count(wheel) == expected_count);
+
+		/* advance time */
+		now += i_rand_limit(i_rand_limit(10) == 0 ? 100000 : 50);
+		min_expire = UINT64_MAX;
+		for (i = 0; i < TW_RANDOM_ITEMS; i++) {
+			if (timing_wheel_item_is_added(&items[i].item) &&
+			    items[i].item.expire_msecs < min_expire)
+				min_expire = items[i].item.expire_msecs;
+		}
+		test_assert(timing_wheel_get_next_msecs(wheel) <= min_expire);
+
+		while ((item = timing_wheel_peek_expired(wheel, now)) != NULL) {
+			test_assert(item->expire_msecs <= now);
+			/* earliest item must expire first */
+			test_assert(item->expire_msecs == min_expire);
+			timing_wheel_remove(wheel, item);
+			expected_count--;
+
+			min_expire = UINT64_MAX;
+			for (i = 0; i < TW_RANDOM_ITEMS; i++) {
+				if (timing_wheel_item_is_added(&items[i].item) &&
+				    items[i].item.expire_msecs < min_expire)
+					min_expire = items[i].item.expire_msecs;
+			}
+		}
+		/* nothing left that should have expired */
+		test_assert(min_expire > now);
+	}
+
+	while ((item = timing_wheel_pop_any(wheel)) != NULL)
+		expected_count--;
+	test_assert(expected_count == 0);
+	timing_wheel_deinit(&wheel);
+	test_end();
+}
+
+static void
+test_timing_wheel_shift_callback(struct timing_wheel_item *item,
+				 void *context)
+{
+	unsigned int *count = context;
+	struct tw_test_item *titem = (struct tw_test_item *)item;
+
+	test_assert(item->expire_msecs == TEST_START_MSECS - 1000 +
+		    (titem->num + 1) * 10000);
+	(*count)++;
+}
+
+static void test_timing_wheel_shift(void)
+{
+	struct tw_test_item items[3];
+	struct timing_wheel_item *item;
+	struct timing_wheel *wheel;
+	unsigned int i, count = 0;
+
+	test_begin("timing wheel shift");
+	wheel = timing_wheel_init(TEST_START_MSECS);
+	for (i = 0; i < N_ELEMENTS(items); i++) {
+		timing_wheel_item_init(&items[i].item);
+		items[i].num = i;
+		timing_wheel_add(wheel, &items[i].item,
+				 TEST_START_MSECS + (i + 1) * 10000);
+	}
+
+	/* time moved backwards by a second */
+	timing_wheel_shift(wheel, -1000, test_timing_wheel_shift_callback,
+			   &count);
+	test_assert(count == N_ELEMENTS(items));
+	test_assert(timing_wheel_count(wheel) == N_ELEMENTS(items));
+	test_assert(timing_wheel_peek_expired(wheel, TEST_START_MSECS - 1000 +
+					      9999) == NULL);
+	item = timing_wheel_peek_expired(wheel, TEST_START_MSECS - 1000 + 10000);
+	test_assert(item == &items[0].item);
+
+	/* already expired items can be added */
+	timing_wheel_remove(wheel, &items[0].item);
+	timing_wheel_add(wheel, &items[0].item, TEST_START_MSECS - 100000);
+	test_assert(timing_wheel_peek_expired(wheel, TEST_START_MSECS) ==
+		    &items[0].item);
+	test_assert(timing_wheel_get_next_msecs(wheel) ==
+		    TEST_START_MSECS - 100000);
+
+	while (timing_wheel_pop_any(wheel) != NULL) ;
+	test_assert(timing_wheel_count(wheel) == 0);
+	timing_wheel_deinit(&wheel);
+	test_end();
+}
+
+void test_timing_wheel(void)
+{
+	test_timing_wheel_order();
+	test_timing_wheel_random();
+	test_timing_wheel_shift();
+}
@@ -0,0 +1,400 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "llist.h"
+#include "fd-util.h"
+#include "thread-pool.h"
+
+#include <unistd.h>
+#ifdef HAVE_THREADS
+#  include <pthread.h>
+#  include <signal.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+
+enum thread_pool_job_state {
+	THREAD_POOL_JOB_STATE_QUEUED = 0,
+	THREAD_POOL_JOB_STATE_RUNNING,
+	THREAD_POOL_JOB_STATE_FINISHED,
+};
+
+struct thread_pool_job {
+	struct thread_pool_job *prev, *next;
+	struct thread_pool *pool;
+
+	thread_pool_job_callback_t *job_callback;
+	thread_pool_finish_callback_t *finish_callback;
+	void *context;
+
+	/* protected by pool->mutex */
+	enum thread_pool_job_state state;
+};
+
+struct thread_pool {
+	/* Number of jobs that haven't been finished or aborted yet. Accessed
+	   only by the ioloop thread. */
+	unsigned int job_count;
+
+	/* The lists are protected by the mutex */
+	struct thread_pool_job *queue_head, *queue_tail;
+	struct thread_pool_job *finished_head, *finished_tail;
+
+#ifdef HAVE_THREADS
+	pthread_mutex_t mutex;
+	/* Signaled when a job is added to the queue, or when stopping */
+	pthread_cond_t queue_cond;
+	/* Signaled when a job is finished */
+	pthread_cond_t finished_cond;
+	unsigned int running_count;
+	bool stopping;
+
+	pthread_t *threads;
+	unsigned int thread_count;
+
+	/* Worker threads notify the ioloop about finished jobs via this.
+	   With eventfd both are the same fd. */
+	int notify_fd_read, notify_fd_write;
+	struct io *io;
+#else
+	struct timeout *to;
+#endif
+};
+
+static void thread_pool_handle_finished(struct thread_pool *pool);
+
+#ifdef HAVE_THREADS
+static inline void thread_pool_lock(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+}
+
+static inline void thread_pool_unlock(struct thread_pool *pool)
+{
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void thread_pool_notify(struct thread_pool *pool)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t value = 1;
+#else
+	unsigned char value = 0;
+#endif
+
+	/* EAGAIN means the ioloop already has a notification pending */
+	if (write(pool->notify_fd_write, &value, sizeof(value)) < 0 &&
+	    errno != EAGAIN)
+		i_panic("thread pool: write(notify fd) failed: %m");
+}
+
+static void thread_pool_notify_read(struct thread_pool *pool)
+{
+	unsigned char buf[64];
+	ssize_t ret;
+
+	do {
+		ret = read(pool->notify_fd_read, buf, sizeof(buf));
+	} while (ret == sizeof(buf));
+	if (ret < 0 && errno != EAGAIN)
+		i_fatal("thread pool: read(notify fd) failed: %m");
+
+	thread_pool_handle_finished(pool);
+}
+
+static void *thread_pool_worker(void *context)
+{
+	struct thread_pool *pool = context;
+	struct thread_pool_job *job;
+
+	data_stack_thread_init();
+
+	thread_pool_lock(pool);
+	for (;;) {
+		while (pool->queue_head == NULL && !pool->stopping)
+			pthread_cond_wait(&pool->queue_cond, &pool->mutex);
+		if (pool->queue_head == NULL)
+			break;
+
+		job = pool->queue_head;
+		DLLIST2_REMOVE(&pool->queue_head, &pool->queue_tail, job);
+		job->state = THREAD_POOL_JOB_STATE_RUNNING;
+		pool->running_count++;
+		thread_pool_unlock(pool);
+
+		T_BEGIN {
+			job->job_callback(job->context);
+		} T_END;
+
+		thread_pool_lock(pool);
+		job->state = THREAD_POOL_JOB_STATE_FINISHED;
+		pool->running_count--;
+		DLLIST2_APPEND(&pool->finished_head, &pool->finished_tail, job);
+		pthread_cond_broadcast(&pool->finished_cond);
+		thread_pool_notify(pool);
+	}
+	thread_pool_unlock(pool);
+
+	data_stack_thread_deinit();
+	return NULL;
+}
+
+static void thread_pool_start(struct thread_pool *pool)
+{
+	sigset_t set, old_set;
+	unsigned int i;
+	int fd[2], ret;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd[0] == -1)
+		i_fatal("eventfd() failed: %m");
+#else
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	fd_set_nonblock(fd[0], TRUE);
+	fd_set_nonblock(fd[1], TRUE);
+	fd_close_on_exec(fd[0], TRUE);
+	fd_close_on_exec(fd[1], TRUE);
+#endif
+	pool->notify_fd_read = fd[0];
+	pool->notify_fd_write = fd[1];
+	pool->io = io_add(pool->notify_fd_read, IO_READ,
+			  thread_pool_notify_read, pool);
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->queue_cond, NULL);
+	pthread_cond_init(&pool->finished_cond, NULL);
+
+	/* Signals must be handled by the main thread. This also keeps the
+	   sampling profiler's SIGPROF out of the workers, and away from
+	   pthread_create(), which may take the dynamic linker's locks. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	pool->threads = i_new(pthread_t, pool->thread_count);
+	for (i = 0; i < pool->thread_count; i++) {
+		ret = pthread_create(&pool->threads[i], NULL,
+				     thread_pool_worker, pool);
+		if (ret != 0)
+			i_fatal("pthread_create() failed: %s", strerror(ret));
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
+
+static void thread_pool_stop(struct thread_pool *pool)
+{
+	unsigned int i;
+
+	thread_pool_lock(pool);
+	pool->stopping = TRUE;
+	pthread_cond_broadcast(&pool->queue_cond);
+	thread_pool_unlock(pool);
+
+	for (i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+	i_free(pool->threads);
+
+	pthread_cond_destroy(&pool->finished_cond);
+	pthread_cond_destroy(&pool->queue_cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	io_remove(&pool->io);
+	if (pool->notify_fd_write != pool->notify_fd_read)
+		i_close_fd(&pool->notify_fd_write);
+	i_close_fd(&pool->notify_fd_read);
+}
+
+static void thread_pool_queued(struct thread_pool *pool)
+{
+	pthread_cond_signal(&pool->queue_cond);
+}
+
+static void thread_pool_wait_finished(struct thread_pool *pool)
+{
+	thread_pool_lock(pool);
+	while (pool->queue_head != NULL || pool->running_count > 0)
+		pthread_cond_wait(&pool->finished_cond, &pool->mutex);
+	thread_pool_unlock(pool);
+}
+
+static void thread_pool_job_wait(struct thread_pool_job *job)
+{
+	while (job->state == THREAD_POOL_JOB_STATE_RUNNING)
+		pthread_cond_wait(&job->pool->finished_cond, &job->pool->mutex);
+}
+#else
+static inline void thread_pool_lock(struct thread_pool *pool ATTR_UNUSED)
+{
+}
+
+static inline void thread_pool_unlock(struct thread_pool *pool ATTR_UNUSED)
+{
+}
+
+static void thread_pool_run_next(struct thread_pool *pool)
+{
+	struct thread_pool_job *job = pool->queue_head;
+
+	/* Without threads run one job per ioloop run, so the ioloop isn't
+	   blocked for too long at a time. */
+	if (job != NULL) {
+		DLLIST2_REMOVE(&pool->queue_head, &pool->queue_tail, job);
+		T_BEGIN {
+			job->job_callback(job->context);
+		} T_END;
+		job->state = THREAD_POOL_JOB_STATE_FINISHED;
+		DLLIST2_APPEND(&pool->finished_head, &pool->finished_tail, job);
+	}
+	if (pool->queue_head == NULL)
+		timeout_remove(&pool->to);
+	thread_pool_handle_finished(pool);
+}
+
+static void thread_pool_start(struct thread_pool *pool ATTR_UNUSED)
+{
+}
+
+static void thread_pool_stop(struct thread_pool *pool)
+{
+	timeout_remove(&pool->to);
+}
+
+static void thread_pool_queued(struct thread_pool *pool)
+{
+	if (pool->to == NULL)
+		pool->to = timeout_add_short(0, thread_pool_run_next, pool);
+}
+
+static void thread_pool_wait_finished(struct thread_pool *pool)
+{
+	while (pool->queue_head != NULL)
+		thread_pool_run_next(pool);
+}
+
+static void thread_pool_job_wait(struct thread_pool_job *job ATTR_UNUSED)
+{
+}
+#endif
+
+struct thread_pool *thread_pool_init(unsigned int thread_count)
+{
+	struct thread_pool *pool;
+
+	i_assert(thread_count > 0);
+
+	pool = i_new(struct thread_pool, 1);
+#ifdef HAVE_THREADS
+	pool->thread_count = thread_count;
+#endif
+	thread_pool_start(pool);
+	return pool;
+}
+
+void thread_pool_deinit(struct thread_pool **_pool)
+{
+	struct thread_pool *pool = *_pool;
+
+	*_pool = NULL;
+	thread_pool_wait(pool);
+	thread_pool_stop(pool);
+	i_assert(pool->job_count == 0);
+	i_free(pool);
+}
+
+#undef thread_pool_run
+struct thread_pool_job *
+thread_pool_run(struct thread_pool *pool,
+		thread_pool_job_callback_t *job_callback,
+		thread_pool_finish_callback_t *finish_callback, void *context)
+{
+	struct thread_pool_job *job;
+
+	job = i_new(struct thread_pool_job, 1);
+	job->pool = pool;
+	job->job_callback = job_callback;
+	job->finish_callback = finish_callback;
+	job->context = context;
+
+	pool->job_count++;
+	thread_pool_lock(pool);
+	DLLIST2_APPEND(&pool->queue_head, &pool->queue_tail, job);
+	thread_pool_queued(pool);
+	thread_pool_unlock(pool);
+	return job;
+}
+
+void thread_pool_job_abort(struct thread_pool_job **_job)
+{
+	struct thread_pool_job *job = *_job;
+	struct thread_pool *pool = job->pool;
+
+	*_job = NULL;
+
+	thread_pool_lock(pool);
+	switch (job->state) {
+	case THREAD_POOL_JOB_STATE_QUEUED:
+		DLLIST2_REMOVE(&pool->queue_head, &pool->queue_tail, job);
+		break;
+	case THREAD_POOL_JOB_STATE_RUNNING:
+		thread_pool_job_wait(job);
+		/* fall through */
+	case THREAD_POOL_JOB_STATE_FINISHED:
+		DLLIST2_REMOVE(&pool->finished_head, &pool->finished_tail, job);
+		break;
+	}
+	thread_pool_unlock(pool);
+
+	i_assert(pool->job_count > 0);
+	pool->job_count--;
+	i_free(job);
+}
+
+static void thread_pool_handle_finished(struct thread_pool *pool)
+{
+	struct thread_pool_job *job;
+
+	/* Take the jobs one at a time, because a finish callback may abort
+	   the other finished jobs. */
+	for (;;) {
+		thread_pool_lock(pool);
+		job = pool->finished_head;
+		if (job != NULL) {
+			DLLIST2_REMOVE(&pool->finished_head,
+				       &pool->finished_tail, job);
+		}
+		thread_pool_unlock(pool);
+		if (job == NULL)
+			break;
+
+		i_assert(pool->job_count > 0);
+		pool->job_count--;
+		job->finish_callback(job->context);
+		i_free(job);
+	}
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+	/* finish callbacks may queue more jobs */
+	while (pool->job_count > 0) {
+		thread_pool_wait_finished(pool);
+		thread_pool_handle_finished(pool);
+	}
+}
+
+unsigned int thread_pool_get_job_count(struct thread_pool *pool)
+{
+	return pool->job_count;
+}
+
+void thread_pool_switch_ioloop(struct thread_pool *pool)
+{
+#ifdef HAVE_THREADS
+	pool->io = io_loop_move_io(&pool->io);
+#else
+	if (pool->to != NULL)
+		pool->to = io_loop_move_timeout(&pool->to);
+#endif
+}
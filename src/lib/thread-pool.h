@@ -0,0 +1,74 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/* Pool of worker threads for running CPU-bound jobs (e.g. compression,
+   crypto, message parsing) without blocking the ioloop. The job callback is
+   called in a worker thread, and the finish callback is called afterwards
+   in the ioloop that created the pool.
+
+   Most of lib isn't thread-safe. Only the following can be used in the job
+   callback:
+
+    - Data stack (t_*() functions, T_BEGIN/T_END, pool_datastack_create()).
+      Each worker thread has its own data stack, and each job is run in its
+      own data stack frame.
+    - Memory pools, buffers and strings (p_*(), i_malloc(), buffer_*(),
+      str_*(), array_*() etc.) as long as the same object isn't accessed
+      concurrently by multiple threads. Note that pool_ref()/pool_unref()
+      aren't atomic.
+    - istreams created by i_stream_create_from_data() and
+      i_stream_create_from_buffer(), and filter istreams on top of them that
+      don't need an ioloop. The stream must be created and destroyed within
+      the same job.
+    - Memory-only functions like strfuncs, str_*escape*(), hash functions.
+
+   Everything else is unsafe: logging (i_error(), e_debug() etc.), events,
+   ioloop, i_rand*(), hash tables shared with the main thread, etc. The job
+   should collect any errors into its context and let the finish callback
+   log them. i_panic() and i_fatal() (including failed assertions) kill the
+   whole process as usual.
+
+   If Dovecot was built without thread support, the jobs are run in the
+   ioloop instead. */
+
+struct thread_pool;
+struct thread_pool_job;
+
+typedef void thread_pool_job_callback_t(void *context);
+typedef void thread_pool_finish_callback_t(void *context);
+
+/* Create a new thread pool with the given number of worker threads. */
+struct thread_pool *thread_pool_init(unsigned int thread_count);
+/* Wait for all the jobs to finish, call their finish callbacks and destroy
+   the pool. */
+void thread_pool_deinit(struct thread_pool **pool);
+
+/* Queue a new job. The returned job pointer is valid until the finish
+   callback is called or the job is aborted. */
+struct thread_pool_job *
+thread_pool_run(struct thread_pool *pool,
+		thread_pool_job_callback_t *job_callback,
+		thread_pool_finish_callback_t *finish_callback, void *context);
+#define thread_pool_run(pool, job_callback, finish_callback, context) \
+	thread_pool_run(pool, \
+		(thread_pool_job_callback_t *)(job_callback), \
+		(thread_pool_finish_callback_t *)(finish_callback), \
+		1 ? (context) : \
+		CALLBACK_TYPECHECK(job_callback, void (*)(typeof(context))) + \
+		CALLBACK_TYPECHECK(finish_callback, void (*)(typeof(context))))
+/* Abort the job without calling its finish callback. If the job hasn't
+   started yet, it's never run. If it's already running, this waits for it
+   to finish. */
+void thread_pool_job_abort(struct thread_pool_job **job);
+
+/* Wait until all the queued jobs are finished and call their finish
+   callbacks. */
+void thread_pool_wait(struct thread_pool *pool);
+/* Returns the number of jobs that haven't had their finish callback
+   called yet. */
+unsigned int thread_pool_get_job_count(struct thread_pool *pool);
+
+/* Move the pool's completion handling to the current ioloop. */
+void thread_pool_switch_ioloop(struct thread_pool *pool);
+
+#endif
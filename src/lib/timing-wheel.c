@@ -0,0 +1,330 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "llist.h"
+#include "timing-wheel.h"
+
+/* Each level has 64 slots. A slot in level n covers 64^n milliseconds, so
+   the four levels cover 2^24 ms (~4.6 hours) into the future. Items further
+   away are kept in an overflow list, which is rescanned whenever the time
+   crosses a 2^24 ms boundary.
+
+   An item is placed into the level of the highest 6 bit digit where its
+   expire time differs from the wheel's current time. When the current time
+   reaches the beginning of the item's slot, the item is cascaded to a lower
+   level (or to the expired list). */
+#define TIMING_WHEEL_LEVEL_BITS 6
+#define TIMING_WHEEL_SLOTS (1U << TIMING_WHEEL_LEVEL_BITS)
+#define TIMING_WHEEL_SLOT_MASK (TIMING_WHEEL_SLOTS - 1)
+#define TIMING_WHEEL_LEVELS 4
+#define TIMING_WHEEL_LEVEL_SHIFT(level) ((level) * TIMING_WHEEL_LEVEL_BITS)
+#define TIMING_WHEEL_RANGE_BITS \
+	TIMING_WHEEL_LEVEL_SHIFT(TIMING_WHEEL_LEVELS)
+
+#define TIMING_WHEEL_LIST_COUNT (TIMING_WHEEL_LEVELS * TIMING_WHEEL_SLOTS)
+#define TIMING_WHEEL_LIST_OVERFLOW TIMING_WHEEL_LIST_COUNT
+#define TIMING_WHEEL_LIST_EXPIRED (TIMING_WHEEL_LIST_COUNT + 1)
+#define TIMING_WHEEL_LIST_NONE UINT_MAX
+
+struct timing_wheel {
+	/* All slots up to and including this time have been processed. */
+	uint64_t cur_msecs;
+	unsigned int count;
+
+	struct timing_wheel_item *slots[TIMING_WHEEL_LIST_COUNT];
+	/* Bit n is set if level's slot n is non-empty */
+	uint64_t slot_bitmaps[TIMING_WHEEL_LEVELS];
+
+	struct timing_wheel_item *overflow;
+	/* Sorted by expire_msecs */
+	struct timing_wheel_item *expired_head, *expired_tail;
+};
+
+struct timing_wheel *timing_wheel_init(uint64_t now_msecs)
+{
+	struct timing_wheel *wheel;
+
+	wheel = i_new(struct timing_wheel, 1);
+	wheel->cur_msecs = now_msecs;
+	return wheel;
+}
+
+void timing_wheel_deinit(struct timing_wheel **_wheel)
+{
+	struct timing_wheel *wheel = *_wheel;
+
+	*_wheel = NULL;
+	i_assert(wheel->count == 0);
+	i_free(wheel);
+}
+
+void timing_wheel_item_init(struct timing_wheel_item *item)
+{
+	i_zero(item);
+	item->list_idx = TIMING_WHEEL_LIST_NONE;
+}
+
+bool timing_wheel_item_is_added(const struct timing_wheel_item *item)
+{
+	return item->list_idx != TIMING_WHEEL_LIST_NONE;
+}
+
+unsigned int timing_wheel_count(const struct timing_wheel *wheel)
+{
+	return wheel->count;
+}
+
+static void
+timing_wheel_add_expired(struct timing_wheel *wheel,
+			 struct timing_wheel_item *item)
+{
+	struct timing_wheel_item *prev = wheel->expired_tail;
+
+	item->list_idx = TIMING_WHEEL_LIST_EXPIRED;
+	if (prev == NULL || prev->expire_msecs <= item->expire_msecs) {
+		/* the common case */
+		DLLIST2_APPEND(&wheel->expired_head, &wheel->expired_tail,
+			       item);
+		return;
+	}
+	while (prev->prev != NULL &&
+	       prev->prev->expire_msecs > item->expire_msecs)
+		prev = prev->prev;
+	if (prev->prev == NULL) {
+		DLLIST2_PREPEND(&wheel->expired_head, &wheel->expired_tail,
+				item);
+	} else {
+		DLLIST2_INSERT_AFTER(&wheel->expired_head,
+				     &wheel->expired_tail, prev->prev, item);
+	}
+}
+
+static void
+timing_wheel_link(struct timing_wheel *wheel, struct timing_wheel_item *item)
+{
+	uint64_t diff_bits;
+	unsigned int level, slot;
+
+	if (item->expire_msecs <= wheel->cur_msecs) {
+		timing_wheel_add_expired(wheel, item);
+		return;
+	}
+
+	diff_bits = item->expire_msecs ^ wheel->cur_msecs;
+	level = (bits_required64(diff_bits) - 1) / TIMING_WHEEL_LEVEL_BITS;
+	if (level >= TIMING_WHEEL_LEVELS) {
+		item->list_idx = TIMING_WHEEL_LIST_OVERFLOW;
+		DLLIST_PREPEND(&wheel->overflow, item);
+		return;
+	}
+	slot = (item->expire_msecs >> TIMING_WHEEL_LEVEL_SHIFT(level)) &
+		TIMING_WHEEL_SLOT_MASK;
+	item->list_idx = level * TIMING_WHEEL_SLOTS + slot;
+	DLLIST_PREPEND(&wheel->slots[item->list_idx], item);
+	wheel->slot_bitmaps[level] |= 1ULL << slot;
+}
+
+static void
+timing_wheel_unlink(struct timing_wheel *wheel, struct timing_wheel_item *item)
+{
+	unsigned int idx = item->list_idx;
+
+	if (idx < TIMING_WHEEL_LIST_COUNT) {
+		DLLIST_REMOVE(&wheel->slots[idx], item);
+		if (wheel->slots[idx] == NULL) {
+			wheel->slot_bitmaps[idx / TIMING_WHEEL_SLOTS] &=
+				~(1ULL << (idx % TIMING_WHEEL_SLOTS));
+		}
+	} else if (idx == TIMING_WHEEL_LIST_OVERFLOW) {
+		DLLIST_REMOVE(&wheel->overflow, item);
+	} else {
+		i_assert(idx == TIMING_WHEEL_LIST_EXPIRED);
+		DLLIST2_REMOVE(&wheel->expired_head, &wheel->expired_tail,
+			       item);
+	}
+	item->list_idx = TIMING_WHEEL_LIST_NONE;
+}
+
+void timing_wheel_add(struct timing_wheel *wheel,
+		      struct timing_wheel_item *item, uint64_t expire_msecs)
+{
+	i_assert(item->list_idx == TIMING_WHEEL_LIST_NONE);
+
+	item->expire_msecs = expire_msecs;
+	timing_wheel_link(wheel, item);
+	wheel->count++;
+}
+
+void timing_wheel_remove(struct timing_wheel *wheel,
+			 struct timing_wheel_item *item)
+{
+	i_assert(item->list_idx != TIMING_WHEEL_LIST_NONE);
+	i_assert(wheel->count > 0);
+
+	timing_wheel_unlink(wheel, item);
+	wheel->count--;
+}
+
+static uint64_t
+timing_wheel_level_next_msecs(struct timing_wheel *wheel, unsigned int level)
+{
+	unsigned int shift = TIMING_WHEEL_LEVEL_SHIFT(level);
+	unsigned int cur_slot =
+		(wheel->cur_msecs >> shift) & TIMING_WHEEL_SLOT_MASK;
+	uint64_t bitmap, base;
+
+	/* Items are always in slots after the current time's slot. */
+	if (cur_slot == TIMING_WHEEL_SLOT_MASK)
+		return UINT64_MAX;
+	bitmap = wheel->slot_bitmaps[level] & (~0ULL << (cur_slot + 1));
+	if (bitmap == 0)
+		return UINT64_MAX;
+
+	base = wheel->cur_msecs &
+		~((1ULL << (shift + TIMING_WHEEL_LEVEL_BITS)) - 1);
+	return base +
+		((uint64_t)(bits_required64(bitmap & -bitmap) - 1) << shift);
+}
+
+static uint64_t timing_wheel_next_cascade_msecs(struct timing_wheel *wheel)
+{
+	uint64_t msecs, next_msecs = UINT64_MAX;
+	unsigned int level;
+
+	for (level = 0; level < TIMING_WHEEL_LEVELS; level++) {
+		if (wheel->slot_bitmaps[level] == 0)
+			continue;
+		msecs = timing_wheel_level_next_msecs(wheel, level);
+		if (msecs < next_msecs)
+			next_msecs = msecs;
+	}
+	if (wheel->overflow != NULL) {
+		msecs = (wheel->cur_msecs |
+			 ((1ULL << TIMING_WHEEL_RANGE_BITS) - 1)) + 1;
+		if (msecs < next_msecs)
+			next_msecs = msecs;
+	}
+	return next_msecs;
+}
+
+static void
+timing_wheel_cascade_list(struct timing_wheel *wheel,
+			  struct timing_wheel_item *list)
+{
+	struct timing_wheel_item *item, *next;
+
+	for (item = list; item != NULL; item = next) {
+		next = item->next;
+		item->prev = item->next = NULL;
+		timing_wheel_link(wheel, item);
+	}
+}
+
+static void timing_wheel_cascade(struct timing_wheel *wheel)
+{
+	struct timing_wheel_item *list;
+	unsigned int level, shift, slot, idx;
+
+	if (wheel->overflow != NULL &&
+	    (wheel->cur_msecs & ((1ULL << TIMING_WHEEL_RANGE_BITS) - 1)) == 0) {
+		list = wheel->overflow;
+		wheel->overflow = NULL;
+		timing_wheel_cascade_list(wheel, list);
+	}
+
+	/* Go through the levels from the highest, so that the items cascaded
+	   into a lower level's current slot get handled as well. */
+	for (level = TIMING_WHEEL_LEVELS; level > 0; level--) {
+		shift = TIMING_WHEEL_LEVEL_SHIFT(level - 1);
+		if ((wheel->cur_msecs & ((1ULL << shift) - 1)) != 0)
+			continue;
+		slot = (wheel->cur_msecs >> shift) & TIMING_WHEEL_SLOT_MASK;
+		if ((wheel->slot_bitmaps[level - 1] & (1ULL << slot)) == 0)
+			continue;
+
+		idx = (level - 1) * TIMING_WHEEL_SLOTS + slot;
+		list = wheel->slots[idx];
+		wheel->slots[idx] = NULL;
+		wheel->slot_bitmaps[level - 1] &= ~(1ULL << slot);
+		timing_wheel_cascade_list(wheel, list);
+	}
+}
+
+static void timing_wheel_advance(struct timing_wheel *wheel,
+				 uint64_t now_msecs)
+{
+	uint64_t next_msecs;
+
+	while (wheel->cur_msecs < now_msecs) {
+		next_msecs = timing_wheel_next_cascade_msecs(wheel);
+		if (next_msecs > now_msecs) {
+			wheel->cur_msecs = now_msecs;
+			break;
+		}
+		wheel->cur_msecs = next_msecs;
+		timing_wheel_cascade(wheel);
+	}
+}
+
+uint64_t timing_wheel_get_next_msecs(struct timing_wheel *wheel)
+{
+	if (wheel->expired_head != NULL)
+		return wheel->expired_head->expire_msecs;
+	return timing_wheel_next_cascade_msecs(wheel);
+}
+
+struct timing_wheel_item *
+timing_wheel_peek_expired(struct timing_wheel *wheel, uint64_t now_msecs)
+{
+	if (wheel->expired_head == NULL)
+		timing_wheel_advance(wheel, now_msecs);
+	return wheel->expired_head;
+}
+
+struct timing_wheel_item *timing_wheel_pop_any(struct timing_wheel *wheel)
+{
+	struct timing_wheel_item *item = wheel->expired_head;
+	unsigned int level;
+
+	if (item == NULL)
+		item = wheel->overflow;
+	for (level = 0; item == NULL && level < TIMING_WHEEL_LEVELS; level++) {
+		uint64_t bitmap = wheel->slot_bitmaps[level];
+
+		if (bitmap != 0) {
+			item = wheel->slots[level * TIMING_WHEEL_SLOTS +
+					    bits_required64(bitmap & -bitmap) - 1];
+		}
+	}
+	if (item != NULL)
+		timing_wheel_remove(wheel, item);
+	return item;
+}
+
+void timing_wheel_shift(struct timing_wheel *wheel, int64_t diff_msecs,
+			timing_wheel_shift_callback_t *callback,
+			void *context)
+{
+	struct timing_wheel_item *item, *list = NULL;
+	unsigned int count = wheel->count;
+
+	while ((item = timing_wheel_pop_any(wheel)) != NULL)
+		DLLIST_PREPEND(&list, item);
+
+	if (diff_msecs < 0 && (uint64_t)-diff_msecs > wheel->cur_msecs)
+		wheel->cur_msecs = 0;
+	else
+		wheel->cur_msecs += diff_msecs;
+
+	while ((item = list) != NULL) {
+		DLLIST_REMOVE(&list, item);
+		if (diff_msecs < 0 && (uint64_t)-diff_msecs > item->expire_msecs)
+			item->expire_msecs = 0;
+		else
+			item->expire_msecs += diff_msecs;
+		callback(item, context);
+		timing_wheel_add(wheel, item, item->expire_msecs);
+	}
+	i_assert(wheel->count == count);
+}
@@ -0,0 +1,63 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+/* Hierarchical timing wheel with millisecond resolution. Adding, removing
+   and moving items are O(1), which makes it a good fit for long timeouts
+   that keep getting reset before they expire. Embed a struct
+   timing_wheel_item anywhere in your own struct and get back to the
+   containing struct with container_of(). */
+
+struct timing_wheel_item {
+	/* Updated automatically, don't modify. */
+	struct timing_wheel_item *prev, *next;
+	uint64_t expire_msecs;
+	unsigned int list_idx;
+};
+
+/* Callback for timing_wheel_shift() */
+typedef void timing_wheel_shift_callback_t(struct timing_wheel_item *item,
+					   void *context);
+
+/* Create a new timing wheel. now_msecs is the current time. */
+struct timing_wheel *timing_wheel_init(uint64_t now_msecs);
+void timing_wheel_deinit(struct timing_wheel **wheel);
+
+/* Initialize the item. This needs to be done once before the item is
+   added to a wheel. */
+void timing_wheel_item_init(struct timing_wheel_item *item);
+/* Returns TRUE if item is currently in a wheel. */
+bool timing_wheel_item_is_added(const struct timing_wheel_item *item) ATTR_PURE;
+
+/* Return number of items in the wheel. */
+unsigned int timing_wheel_count(const struct timing_wheel *wheel) ATTR_PURE;
+
+/* Add an item to expire at expire_msecs. If the time is already in the past,
+   the item expires at the next timing_wheel_peek_expired() call. */
+void timing_wheel_add(struct timing_wheel *wheel,
+		      struct timing_wheel_item *item, uint64_t expire_msecs);
+/* Remove the item from the wheel. */
+void timing_wheel_remove(struct timing_wheel *wheel,
+			 struct timing_wheel_item *item);
+
+/* Returns the earliest time when timing_wheel_peek_expired() may return an
+   item, or UINT64_MAX if the wheel is empty. This can be earlier than the
+   first item's expire time, because items are moved between the wheel levels
+   when their time gets closer. */
+uint64_t timing_wheel_get_next_msecs(struct timing_wheel *wheel);
+/* Advance the wheel to now_msecs and return the first item that has
+   expired, or NULL if none. The returned item is still in the wheel - it
+   must be removed or added again before calling this function again. Items
+   are returned in the order of their expire time. */
+struct timing_wheel_item *
+timing_wheel_peek_expired(struct timing_wheel *wheel, uint64_t now_msecs);
+/* Remove and return any item in the wheel, or NULL if the wheel is empty. */
+struct timing_wheel_item *timing_wheel_pop_any(struct timing_wheel *wheel);
+
+/* Move the wheel's time and all the items' expire times by diff_msecs.
+   This is intended for handling system time jumps. The callback is called
+   for each item after its expire_msecs has been updated. */
+void timing_wheel_shift(struct timing_wheel *wheel, int64_t diff_msecs,
+			timing_wheel_shift_callback_t *callback,
+			void *context);
+
+#endif
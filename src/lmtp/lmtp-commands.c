@@ -18,6 +18,9 @@
 #include "lmtp-local.h"
 #include "lmtp-commands.h"
 
+/* Memory used by all the DATA spools in this process */
+static struct iostream_temp_mem_budget lmtp_data_spool_budget;
+
 /*
  * MAIL command
  */
@@ -198,6 +201,18 @@ cmd_data_finish(struct client *client,
 	input_msg = iostream_temp_finish(&state->mail_data_output,
 					 IO_BLOCK_SIZE);
 
+	bool in_memory = i_stream_get_fd(input_msg) == -1;
+	struct event_passthrough *e =
+		event_create_passthrough(client->event)->
+		set_name("lmtp_data_spooled")->
+		add_str("spool", in_memory ? "memory" : "file")->
+		add_int("size", state->data_size)->
+		add_int("memory_used", lmtp_data_spool_budget.used_size)->
+		add_int("memory_limit_exceeded",
+			lmtp_data_spool_budget.exceeded_count);
+	e_debug(e->event(), "DATA spooled to %s (%"PRIuUOFF_T" bytes)",
+		in_memory ? "memory" : "temp file", state->data_size);
+
 	ret = client->v.cmd_data(client, cmd, trans,
 				 input_msg, client->state.data_size);
 	i_stream_unref(&input_msg);
@@ -262,7 +277,15 @@ int cmd_data_begin(void *conn_ctx,
 	path = t_str_new(256);
 	mail_user_set_get_temp_prefix(path, client->raw_mail_user->set);
 	client->state.mail_data_output =
-		iostream_temp_create_named(str_c(path), 0, "(lmtp data)");
+		iostream_temp_create_sized(str_c(path), 0, "(lmtp data)",
+			client->lmtp_set->lmtp_data_spool_max_memory_size);
+	/* Small mails are kept in memory, unless the process already uses too
+	   much memory for them. The limit is updated here in case the setting
+	   differs between clients. */
+	lmtp_data_spool_budget.max_size =
+		client->lmtp_set->lmtp_data_spool_memory_limit;
+	iostream_temp_set_mem_budget(client->state.mail_data_output,
+				     &lmtp_data_spool_budget);
 
 	client->state.data_input = data_input;
 	return 0;
@@ -1,14 +1,19 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lmtp-common.h"
+#include "ioloop.h"
 #include "smtp-server.h"
 #include "str.h"
 #include "istream.h"
+#include "child-wait.h"
+#include "write-full.h"
+#include "strnum.h"
 #include "strescape.h"
 #include "time-util.h"
 #include "hostpid.h"
 #include "var-expand.h"
 #include "restrict-access.h"
+#include "sampling-profiler.h"
 #include "anvil-client.h"
 #include "settings.h"
 #include "settings-parser.h"
@@ -27,6 +32,10 @@
 #include "lmtp-recipient.h"
 #include "lmtp-local.h"
 
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
 struct lmtp_local_recipient {
 	struct lmtp_recipient *rcpt;
 
@@ -40,6 +49,24 @@ struct lmtp_local_recipient {
 	bool anvil_connect_sent:1;
 };
 
+struct lmtp_local_worker {
+	struct lmtp_local *local;
+	pid_t pid;
+	int fd;
+	struct istream *input;
+	struct io *io;
+	/* range of rcpt_to delivered by this worker */
+	unsigned int first, end;
+
+	bool killed:1;
+	bool exited:1;
+};
+
+struct lmtp_local_worker_reply {
+	unsigned int status;
+	const char *enh_code, *message;
+};
+
 struct lmtp_local {
 	struct client *client;
 
@@ -49,8 +76,24 @@ struct lmtp_local {
 	struct mail_user *rcpt_user;
 
 	struct smtp_server_stats stats;
+
+	/* Parallel delivery in progress. The replies from the workers are
+	   submitted after all of them have finished. */
+	pool_t workers_pool;
+	struct smtp_server_cmd_ctx *workers_cmd;
+	struct lmtp_local_worker *workers;
+	unsigned int workers_count;
+	/* indexed by rcpt_to, status=0 if not received */
+	struct lmtp_local_worker_reply *worker_replies;
+	struct child_wait *child_wait;
+	struct timeout *to_workers;
+
+	/* This is a forked delivery worker process */
+	bool worker:1;
 };
 
+static void lmtp_local_workers_free(struct lmtp_local *local);
+
 /*
  * LMTP local
  */
@@ -75,6 +118,14 @@ void lmtp_local_deinit(struct lmtp_local **_local)
 
 	*_local = NULL;
 
+	if (local->workers_pool != NULL) {
+		/* The transaction was aborted, most likely because the client
+		   disconnected. Let the workers finish their deliveries. */
+		e_debug(local->client->event,
+			"Not waiting for the lmtp delivery workers anymore");
+		lmtp_local_workers_free(local);
+	}
+
 	if (array_is_created(&local->rcpt_to))
 		array_free(&local->rcpt_to);
 
@@ -515,7 +566,9 @@ lmtp_local_deliver(struct lmtp_local *local,
 
 	ret = client->v.local_deliver(client, lrcpt, cmd, trans, &lldctx);
 
-	lmtp_local_rcpt_anvil_disconnect(llrcpt);
+	/* the parent process still tracks the anvil session */
+	if (!local->worker)
+		lmtp_local_rcpt_anvil_disconnect(llrcpt);
 
 	settings_free(lldctx.smtp_set);
 	return ret;
@@ -637,31 +690,43 @@ int lmtp_local_default_deliver(struct client *client,
 	return ret;
 }
 
+static void
+lmtp_local_reply_duplicates(struct lmtp_local *local,
+			    struct smtp_server_cmd_ctx *cmd)
+{
+	struct lmtp_local_recipient *llrcpt;
+
+	/* don't deliver more than once to the same recipient */
+	array_foreach_elem(&local->rcpt_to, llrcpt) {
+		if (llrcpt->duplicate == NULL)
+			continue;
+		smtp_server_reply_submit_duplicate(cmd,
+			llrcpt->rcpt->rcpt->index,
+			llrcpt->duplicate->rcpt->rcpt->index);
+	}
+}
+
 static uid_t
 lmtp_local_deliver_to_rcpts(struct lmtp_local *local,
 			    struct smtp_server_cmd_ctx *cmd,
 			    struct smtp_server_transaction *trans,
-			    struct mail_deliver_session *session)
+			    struct mail_deliver_session *session,
+			    unsigned int first, unsigned int end)
 {
 	struct client *client = local->client;
 	uid_t first_uid = (uid_t)-1;
 	struct mail *src_mail;
 	struct lmtp_local_recipient *const *llrcpts;
-	unsigned int count, i;
+	unsigned int i;
 	int ret;
 
 	src_mail = local->raw_mail;
-	llrcpts = array_get(&local->rcpt_to, &count);
-	for (i = 0; i < count; i++) {
+	llrcpts = array_front(&local->rcpt_to);
+	for (i = first; i < end; i++) {
 		struct lmtp_local_recipient *llrcpt = llrcpts[i];
-		struct smtp_server_recipient *rcpt = llrcpt->rcpt->rcpt;
 
 		if (llrcpt->duplicate != NULL) {
-			struct smtp_server_recipient *drcpt =
-				llrcpt->duplicate->rcpt->rcpt;
-			/* don't deliver more than once to the same recipient */
-			smtp_server_reply_submit_duplicate(cmd, rcpt->index,
-							   drcpt->index);
+			/* replied by lmtp_local_reply_duplicates() */
 			continue;
 		}
 
@@ -677,7 +742,7 @@ lmtp_local_deliver_to_rcpts(struct lmtp_local *local,
 		      local->first_saved_mail == src_mail)) ||
 		    /* failed. try the next one. */
 		    (ret != 0 && local->rcpt_user != NULL)) {
-			if (i == (count - 1))
+			if (i == (end - 1))
 				mail_user_autoexpunge(local->rcpt_user);
 			mail_storage_service_io_deactivate_user(local->rcpt_user->service_user);
 			mail_user_deinit(&local->rcpt_user);
@@ -698,6 +763,430 @@ lmtp_local_deliver_to_rcpts(struct lmtp_local *local,
 	return first_uid;
 }
 
+static void
+lmtp_local_free_first_saved_mail(struct lmtp_local *local,
+				 uid_t old_uid, uid_t first_uid)
+{
+	struct mail *mail = local->first_saved_mail;
+
+	if (mail == NULL)
+		return;
+	local->first_saved_mail = NULL;
+
+	struct mailbox_transaction_context *trans = mail->transaction;
+	struct mailbox *box = trans->box;
+	struct mail_user *user = box->storage->user;
+
+	/* just in case these functions are going to write anything,
+	   change uid back to user's own one */
+	if (first_uid != old_uid) {
+		if (seteuid(0) < 0)
+			i_fatal("seteuid(0) failed: %m");
+		if (seteuid(first_uid) < 0)
+			i_fatal("seteuid() failed: %m");
+	}
+
+	mail_storage_service_io_activate_user(user->service_user);
+	mail_free(&mail);
+	mailbox_transaction_rollback(&trans);
+	mailbox_free(&box);
+	mail_user_autoexpunge(user);
+	mail_storage_service_io_deactivate_user(user->service_user);
+	mail_user_deinit(&user);
+}
+
+/*
+ * Parallel delivery
+ */
+
+static int lmtp_local_parse_shared_mail(struct lmtp_local *local)
+{
+	struct mail *mail = local->raw_mail;
+	struct message_part *parts;
+	struct istream *input;
+	const char *value;
+	uoff_t size;
+
+	/* Read and parse the message only once here. The workers inherit
+	   the results, and they can't safely read the rest of the DATA
+	   input anyway. */
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+		return -1;
+	while (i_stream_read(input) > 0)
+		i_stream_skip(input, i_stream_get_data_size(input));
+	if (input->stream_errno != 0)
+		return -1;
+
+	if (mail_get_parts(mail, &parts) < 0 ||
+	    mail_get_physical_size(mail, &size) < 0 ||
+	    mail_get_virtual_size(mail, &size) < 0 ||
+	    mail_get_special(mail, MAIL_FETCH_IMAP_BODYSTRUCTURE, &value) < 0)
+		return -1;
+	return 0;
+}
+
+static void
+lmtp_local_worker_write_replies(struct lmtp_local *local,
+				const struct lmtp_local_worker *worker)
+{
+	struct lmtp_local_recipient *const *llrcpts;
+	struct smtp_server_reply *reply;
+	const char *enh_code;
+	unsigned int i, status;
+	string_t *str = t_str_new(256);
+
+	llrcpts = array_front(&local->rcpt_to);
+	for (i = worker->first; i < worker->end; i++) {
+		if (llrcpts[i]->duplicate != NULL)
+			continue;
+		reply = smtp_server_recipient_get_reply(llrcpts[i]->rcpt->rcpt);
+		if (reply == NULL)
+			continue;
+
+		status = smtp_server_reply_get_status(reply, &enh_code);
+		str_printfa(str, "%u\t%u\t", i, status);
+		str_append_tabescaped(str, enh_code == NULL ? "" : enh_code);
+		str_append_c(str, '\t');
+		str_append_tabescaped(str,
+				      smtp_server_reply_get_message(reply));
+		str_append_c(str, '\n');
+	}
+	/* EPIPE means that the parent no longer waits for the replies */
+	if (write_full(worker->fd, str_data(str), str_len(str)) < 0 &&
+	    errno != EPIPE) {
+		e_error(local->client->event,
+			"write(lmtp delivery worker pipe) failed: %m");
+	}
+}
+
+static void ATTR_NORETURN
+lmtp_local_worker_run(struct lmtp_local *local,
+		      struct smtp_server_cmd_ctx *cmd,
+		      struct smtp_server_transaction *trans,
+		      const struct lmtp_local_worker *worker, uid_t old_uid)
+{
+	struct mail_deliver_session *session;
+	uid_t first_uid;
+
+	master_service_init_forked(master_service);
+	/* Don't share the parent's auth, dict and anvil connections. Both
+	   processes would be reading the replies from the same sockets. */
+	mail_storage_service_forked(storage_service);
+	if (anvil != NULL)
+		anvil_client_forked(anvil);
+	local->worker = TRUE;
+
+	session = mail_deliver_session_init();
+	first_uid = lmtp_local_deliver_to_rcpts(local, cmd, trans, session,
+						worker->first, worker->end);
+	mail_deliver_session_deinit(&session);
+	lmtp_local_free_first_saved_mail(local, old_uid, first_uid);
+
+	T_BEGIN {
+		lmtp_local_worker_write_replies(local, worker);
+	} T_END;
+	master_service_exit_forked(master_service, 0);
+}
+
+static int
+lmtp_local_worker_parse_reply(struct lmtp_local *local,
+			      const struct lmtp_local_worker *worker,
+			      const char *line)
+{
+	struct lmtp_local_worker_reply *reply;
+	const char *const *args = t_strsplit_tabescaped(line);
+	unsigned int idx, status;
+	const char *enh_code;
+
+	if (str_array_length(args) != 4 ||
+	    str_to_uint(args[0], &idx) < 0 ||
+	    idx < worker->first || idx >= worker->end ||
+	    str_to_uint(args[1], &status) < 0 ||
+	    status < 200 || status >= 560)
+		return -1;
+	enh_code = args[2];
+	if (enh_code[0] != '\0' &&
+	    ((unsigned int)(enh_code[0] - '0') != status / 100 ||
+	     enh_code[1] != '.'))
+		return -1;
+
+	reply = &local->worker_replies[idx];
+	if (array_idx_elem(&local->rcpt_to, idx)->duplicate != NULL ||
+	    reply->status != 0)
+		return -1;
+	reply->status = status;
+	reply->enh_code = p_strdup(local->workers_pool, enh_code);
+	reply->message = p_strdup(local->workers_pool, args[3]);
+	return 0;
+}
+
+static void lmtp_local_worker_close(struct lmtp_local_worker *worker)
+{
+	io_remove(&worker->io);
+	i_stream_destroy(&worker->input);
+}
+
+/* Read the replies that the worker has sent so far. Returns TRUE if the
+   pipe has reached EOF, which means that the worker is (practically) dead,
+   since it doesn't close the pipe before exiting. */
+static bool lmtp_local_worker_read(struct lmtp_local_worker *worker)
+{
+	struct lmtp_local *local = worker->local;
+	const char *line;
+
+	while ((line = i_stream_read_next_line(worker->input)) != NULL) T_BEGIN {
+		if (lmtp_local_worker_parse_reply(local, worker, line) < 0) {
+			e_error(local->client->event,
+				"lmtp delivery worker %s sent invalid reply: %s",
+				dec2str(worker->pid), line);
+		}
+	} T_END;
+	if (worker->input->stream_errno != 0) {
+		e_error(local->client->event,
+			"read(lmtp delivery worker pipe) failed: %s",
+			i_stream_get_error(worker->input));
+		return TRUE;
+	}
+	return worker->input->eof;
+}
+
+static void
+lmtp_local_workers_finish(struct lmtp_local *local)
+{
+	struct smtp_server_cmd_ctx *cmd = local->workers_cmd;
+	struct lmtp_local_recipient *const *llrcpts;
+	const struct lmtp_local_worker_reply *reply;
+	unsigned int i, k;
+
+	llrcpts = array_front(&local->rcpt_to);
+	for (i = 0; i < local->workers_count; i++) {
+		const struct lmtp_local_worker *worker = &local->workers[i];
+
+		for (k = worker->first; k < worker->end; k++) {
+			if (llrcpts[k]->duplicate != NULL)
+				continue;
+			lmtp_local_rcpt_anvil_disconnect(llrcpts[k]);
+
+			reply = &local->worker_replies[k];
+			if (reply->status == 0) {
+				/* The worker failed or timed out. Some of
+				   these may have been delivered already, but
+				   a temporary failure is the safe reply. */
+				smtp_server_recipient_reply(
+					llrcpts[k]->rcpt->rcpt, 451, "4.3.0",
+					"Temporary internal error");
+			} else {
+				smtp_server_reply_index(cmd,
+					llrcpts[k]->rcpt->rcpt->index,
+					reply->status, reply->enh_code,
+					"%s", reply->message);
+			}
+		}
+	}
+	lmtp_local_workers_free(local);
+	lmtp_local_reply_duplicates(local, cmd);
+}
+
+static void lmtp_local_workers_check_finished(struct lmtp_local *local)
+{
+	unsigned int i;
+
+	for (i = 0; i < local->workers_count; i++) {
+		if (local->workers[i].input != NULL ||
+		    !local->workers[i].exited)
+			return;
+	}
+	lmtp_local_workers_finish(local);
+}
+
+static void lmtp_local_worker_input(struct lmtp_local_worker *worker)
+{
+	if (!lmtp_local_worker_read(worker))
+		return;
+	lmtp_local_worker_close(worker);
+	lmtp_local_workers_check_finished(worker->local);
+}
+
+static void
+lmtp_local_worker_exited(const struct child_wait_status *status,
+			 struct lmtp_local *local)
+{
+	struct lmtp_local_worker *worker = NULL;
+	unsigned int i;
+
+	for (i = 0; i < local->workers_count; i++) {
+		if (local->workers[i].pid == status->pid)
+			worker = &local->workers[i];
+	}
+	i_assert(worker != NULL);
+
+	worker->exited = TRUE;
+	if (!worker->killed &&
+	    (!WIFEXITED(status->status) || WEXITSTATUS(status->status) != 0)) {
+		e_error(local->client->event,
+			"lmtp delivery worker %s failed with status %d",
+			dec2str(worker->pid), status->status);
+	}
+	lmtp_local_workers_check_finished(local);
+}
+
+static void lmtp_local_workers_timeout(struct lmtp_local *local)
+{
+	struct lmtp_local_worker *worker;
+	unsigned int i;
+
+	timeout_remove(&local->to_workers);
+	for (i = 0; i < local->workers_count; i++) {
+		worker = &local->workers[i];
+		if (worker->input != NULL) {
+			/* Any replies it managed to send are still used. */
+			(void)lmtp_local_worker_read(worker);
+			lmtp_local_worker_close(worker);
+		}
+		if (worker->exited)
+			continue;
+
+		/* The recipients without a reply get a temporary failure,
+		   even though some of them may already have been delivered.
+		   That's still better than keeping the client waiting. */
+		e_error(local->client->event,
+			"lmtp delivery worker %s timed out after %u secs - "
+			"killing it", dec2str(worker->pid),
+			local->client->lmtp_set->lmtp_local_delivery_worker_timeout);
+		worker->killed = TRUE;
+		if (kill(worker->pid, SIGKILL) < 0 && errno != ESRCH) {
+			e_error(local->client->event,
+				"kill(%s, SIGKILL) failed: %m",
+				dec2str(worker->pid));
+		}
+	}
+	lmtp_local_workers_check_finished(local);
+}
+
+static void lmtp_local_workers_free(struct lmtp_local *local)
+{
+	unsigned int i;
+
+	/* The workers that are still running are reaped by child-wait
+	   without a callback. */
+	for (i = 0; i < local->workers_count; i++)
+		lmtp_local_worker_close(&local->workers[i]);
+	if (local->child_wait != NULL)
+		child_wait_free(&local->child_wait);
+	timeout_remove(&local->to_workers);
+	local->workers = NULL;
+	local->workers_count = 0;
+	local->worker_replies = NULL;
+	local->workers_cmd = NULL;
+	pool_unref(&local->workers_pool);
+}
+
+static bool
+lmtp_local_deliver_parallel(struct lmtp_local *local,
+			    struct smtp_server_cmd_ctx *cmd,
+			    struct smtp_server_transaction *trans,
+			    uid_t old_uid)
+{
+	struct lmtp_local_recipient *const *llrcpts;
+	struct lmtp_local_worker *workers;
+	unsigned int i, j, count, rcpt_count = 0, worker_count;
+	int fd[2];
+
+	llrcpts = array_get(&local->rcpt_to, &count);
+	for (i = 0; i < count; i++) {
+		if (llrcpts[i]->duplicate == NULL)
+			rcpt_count++;
+	}
+	worker_count = I_MIN(local->client->lmtp_set->lmtp_local_delivery_workers,
+			     rcpt_count);
+	if (worker_count < 2)
+		return FALSE;
+	if (lmtp_local_parse_shared_mail(local) < 0) {
+		/* let the sequential delivery handle the error */
+		return FALSE;
+	}
+
+	/* Split the recipients into contiguous ranges, so each worker can
+	   still copy (hard link) the first mail it saved for the rest. */
+	local->workers_pool = pool_alloconly_create("lmtp local workers", 1024);
+	workers = p_new(local->workers_pool, struct lmtp_local_worker,
+			worker_count);
+	for (i = 0, j = 0; i < worker_count; i++) {
+		workers[i].local = local;
+		workers[i].first = j;
+		workers[i].end = j = count * (i + 1) / worker_count;
+		workers[i].fd = -1;
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		if (pipe(fd) < 0) {
+			e_error(local->client->event, "pipe() failed: %m");
+			break;
+		}
+		fd_close_on_exec(fd[0], TRUE);
+		fd_close_on_exec(fd[1], TRUE);
+		workers[i].pid = fork();
+		if (workers[i].pid == (pid_t)-1) {
+			e_error(local->client->event, "fork() failed: %m");
+			i_close_fd(&fd[0]);
+			i_close_fd(&fd[1]);
+			break;
+		}
+		if (workers[i].pid == 0) {
+			/* child */
+			for (j = 0; j < i; j++)
+				i_close_fd(&workers[j].fd);
+			i_close_fd(&fd[0]);
+			workers[i].fd = fd[1];
+			lmtp_local_worker_run(local, cmd, trans,
+					      &workers[i], old_uid);
+		}
+		i_close_fd(&fd[1]);
+		workers[i].fd = fd[0];
+	}
+
+	if (i == 0) {
+		/* Couldn't start any workers */
+		pool_unref(&local->workers_pool);
+		return FALSE;
+	}
+
+	/* The workers are waited for in the ioloop. The replies are
+	   submitted only after all of them have finished. */
+	local->workers = workers;
+	local->workers_count = i;
+	local->workers_cmd = cmd;
+	local->worker_replies = p_new(local->workers_pool,
+				      struct lmtp_local_worker_reply, count);
+	local->child_wait = child_wait_new(lmtp_local_worker_exited, local);
+	for (j = 0; j < local->workers_count; j++) {
+		fd_set_nonblock(workers[j].fd, TRUE);
+		workers[j].input = i_stream_create_fd_autoclose(&workers[j].fd,
+								SIZE_MAX);
+		workers[j].io = io_add(i_stream_get_fd(workers[j].input),
+				       IO_READ, lmtp_local_worker_input,
+				       &workers[j]);
+		child_wait_add_pid(local->child_wait, workers[j].pid);
+	}
+	local->to_workers = timeout_add(
+		local->client->lmtp_set->lmtp_local_delivery_worker_timeout * 1000,
+		lmtp_local_workers_timeout, local);
+
+	if (i < worker_count) {
+		/* Couldn't start all the workers. Deliver the rest in this
+		   process. */
+		struct mail_deliver_session *session;
+		uid_t first_uid;
+
+		session = mail_deliver_session_init();
+		first_uid = lmtp_local_deliver_to_rcpts(local, cmd, trans,
+			session, workers[i].first, count);
+		mail_deliver_session_deinit(&session);
+		lmtp_local_free_first_saved_mail(local, old_uid, first_uid);
+	}
+	return TRUE;
+}
+
 static int
 lmtp_local_open_raw_mail(struct lmtp_local *local,
 			 struct smtp_server_transaction *trans,
@@ -740,39 +1229,25 @@ void lmtp_local_data(struct client *client,
 {
 	struct lmtp_local *local = client->local;
 	struct mail_deliver_session *session;
+	const char *old_profile_label;
 	uid_t old_uid, first_uid;
 
 	if (lmtp_local_open_raw_mail(local, trans, input) < 0)
 		return;
 
-	session = mail_deliver_session_init();
-	old_uid = geteuid();
-	first_uid = lmtp_local_deliver_to_rcpts(local, cmd, trans, session);
-	mail_deliver_session_deinit(&session);
+	old_profile_label = sampling_profiler_set_label("DATA");
 
-	if (local->first_saved_mail != NULL) {
-		struct mail *mail = local->first_saved_mail;
-		struct mailbox_transaction_context *trans = mail->transaction;
-		struct mailbox *box = trans->box;
-		struct mail_user *user = box->storage->user;
-
-		/* just in case these functions are going to write anything,
-		   change uid back to user's own one */
-		if (first_uid != old_uid) {
-			if (seteuid(0) < 0)
-				i_fatal("seteuid(0) failed: %m");
-			if (seteuid(first_uid) < 0)
-				i_fatal("seteuid() failed: %m");
-		}
-
-		mail_storage_service_io_activate_user(user->service_user);
-		mail_free(&mail);
-		mailbox_transaction_rollback(&trans);
-		mailbox_free(&box);
-		mail_user_autoexpunge(user);
-		mail_storage_service_io_deactivate_user(user->service_user);
-		mail_user_deinit(&user);
+	old_uid = geteuid();
+	if (!lmtp_local_deliver_parallel(local, cmd, trans, old_uid)) {
+		session = mail_deliver_session_init();
+		first_uid = lmtp_local_deliver_to_rcpts(local, cmd, trans,
+			session, 0, array_count(&local->rcpt_to));
+		mail_deliver_session_deinit(&session);
+		lmtp_local_free_first_saved_mail(local, old_uid, first_uid);
 	}
+	/* with the delivery workers this is done once they finish */
+	if (local->workers_pool == NULL)
+		lmtp_local_reply_duplicates(local, cmd);
 
 	if (old_uid == 0) {
 		/* switch back to running as root, since that's what we're
@@ -781,4 +1256,5 @@ void lmtp_local_data(struct client *client,
 		mail_storage_service_restore_privileges(old_uid, base_dir,
 							cmd->event);
 	}
+	(void)sampling_profiler_set_label(old_profile_label);
 }
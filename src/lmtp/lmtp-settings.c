@@ -60,6 +60,10 @@ static const struct setting_define lmtp_setting_defines[] = {
 	DEF(BOOL, lmtp_add_received_header),
 	DEF(BOOL_HIDDEN, lmtp_verbose_replies),
 	DEF(UINT, lmtp_user_concurrency_limit),
+	DEF(UINT, lmtp_local_delivery_workers),
+	DEF(TIME, lmtp_local_delivery_worker_timeout),
+	DEF(SIZE, lmtp_data_spool_max_memory_size),
+	DEF(SIZE, lmtp_data_spool_memory_limit),
 	DEF(ENUM, lmtp_hdr_delivery_address),
 	DEF(STR_VARS, lmtp_rawlog_dir),
 	DEF(STR_VARS, lmtp_proxy_rawlog_dir),
@@ -82,6 +86,10 @@ static const struct lmtp_settings lmtp_default_settings = {
 	.lmtp_add_received_header = TRUE,
 	.lmtp_verbose_replies = FALSE,
 	.lmtp_user_concurrency_limit = 0,
+	.lmtp_local_delivery_workers = 1,
+	.lmtp_local_delivery_worker_timeout = 5*60,
+	.lmtp_data_spool_max_memory_size = 256*1024,
+	.lmtp_data_spool_memory_limit = 16*1024*1024,
 	.lmtp_hdr_delivery_address = "final:none:original",
 	.lmtp_rawlog_dir = "",
 	.lmtp_proxy_rawlog_dir = "",
@@ -26,6 +26,10 @@ struct lmtp_settings {
 	bool lmtp_add_received_header;
 	bool lmtp_verbose_replies;
 	unsigned int lmtp_user_concurrency_limit;
+	unsigned int lmtp_local_delivery_workers;
+	unsigned int lmtp_local_delivery_worker_timeout;
+	uoff_t lmtp_data_spool_max_memory_size;
+	uoff_t lmtp_data_spool_memory_limit;
 	const char *lmtp_hdr_delivery_address;
 	const char *lmtp_rawlog_dir;
 	const char *lmtp_proxy_rawlog_dir;
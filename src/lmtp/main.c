@@ -4,6 +4,7 @@
 #include "ioloop.h"
 #include "path-util.h"
 #include "restrict-access.h"
+#include "child-wait.h"
 #include "anvil-client.h"
 #include "master-service.h"
 #include "master-service-settings.h"
@@ -94,6 +95,8 @@ static void main_init(void)
 	}
 	dns_client_socket_path = i_strdup(tmp_socket_path);
 	mail_deliver_hooks_init();
+	/* for lmtp_local_delivery_workers */
+	child_wait_init();
 }
 
 static void main_deinit(void)
@@ -104,6 +107,7 @@ static void main_deinit(void)
 	i_free(dns_client_socket_path);
 	i_free(base_dir);
 	smtp_server_deinit(&lmtp_server);
+	child_wait_deinit();
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,344 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lmtp-common.h"
+#include "test-common.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "net.h"
+#include "ipwd.h"
+#include "hostpid.h"
+#include "write-full.h"
+#include "child-wait.h"
+#include "path-util.h"
+#include "unlink-directory.h"
+#include "settings.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "mail-deliver.h"
+#include "mail-storage-service.h"
+#include "lmtp-recipient.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TEMP_DIRNAME ".test-lmtp-local"
+
+struct smtp_server *lmtp_server = NULL;
+char *dns_client_socket_path, *base_dir;
+struct mail_storage_service_ctx *storage_service;
+struct anvil_client *anvil;
+lmtp_client_created_func_t *hook_client_created = NULL;
+struct event_category event_category_lmtp = {
+	.name = "lmtp",
+};
+
+static const char *tmpdir;
+static struct lmtp_client_vfuncs test_client_super;
+
+void lmtp_anvil_init(void)
+{
+}
+
+static int
+test_client_local_deliver(struct client *client,
+			  struct lmtp_recipient *lrcpt,
+			  struct smtp_server_cmd_ctx *cmd,
+			  struct smtp_server_transaction *trans,
+			  struct lmtp_local_deliver_context *lldctx)
+{
+	const char *path, *line;
+	int fd, ret;
+
+	if (strcmp(lrcpt->username, "hang") == 0) {
+		/* the parent kills us */
+		sleep(60);
+	}
+	ret = test_client_super.local_deliver(client, lrcpt, cmd, trans,
+					      lldctx);
+	if (ret == 0) {
+		/* remember which process delivered the mail */
+		path = t_strconcat(tmpdir, "/deliveries", NULL);
+		line = t_strdup_printf("%s %s\n", lrcpt->username,
+				       dec2str(getpid()));
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+		if (fd == -1)
+			i_fatal("open(%s) failed: %m", path);
+		if (write_full(fd, line, strlen(line)) < 0)
+			i_fatal("write(%s) failed: %m", path);
+		i_close_fd(&fd);
+	}
+	return ret;
+}
+
+static void test_client_created(struct client **client)
+{
+	test_client_super = (*client)->v;
+	(*client)->v.local_deliver = test_client_local_deliver;
+}
+
+/* Returns the PID of the process that delivered the mail to the user, or 0
+   if it wasn't delivered exactly once. */
+static pid_t test_delivery_pid(const char *username)
+{
+	const char *path = t_strconcat(tmpdir, "/deliveries", NULL);
+	struct istream *input;
+	const char *line, *p;
+	pid_t pid = 0;
+	bool found = FALSE;
+
+	input = i_stream_create_file(path, SIZE_MAX);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		p = strchr(line, ' ');
+		if (p == NULL || strncmp(line, username, p - line) != 0 ||
+		    username[p - line] != '\0')
+			continue;
+		if (found || str_to_pid(p + 1, &pid) < 0)
+			pid = 0;
+		found = TRUE;
+	}
+	test_assert(input->stream_errno == 0);
+	i_stream_unref(&input);
+	return pid;
+}
+
+static unsigned int test_inbox_count(void)
+{
+	const char *dir = t_strconcat(tmpdir, "/home/Maildir/new", NULL);
+	struct dirent *d;
+	unsigned int count = 0;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] != '.')
+			count++;
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", dir);
+	return count;
+}
+
+/* Run the LMTP session and return the replies, one line per reply. */
+static const char *const *test_lmtp_session(const char *session)
+{
+	struct master_service_connection conn;
+	string_t *output = t_str_new(1024);
+	unsigned char buf[1024];
+	ssize_t ret;
+	int fd[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+	/* The commands fit into the socket buffer, so they can all be
+	   written before the server starts reading them. */
+	if (write_full(fd[1], session, strlen(session)) < 0)
+		i_fatal("write(lmtp session) failed: %m");
+
+	i_zero(&conn);
+	(void)client_create(fd[0], fd[0], &conn);
+	/* runs until QUIT destroys the (only) client */
+	master_service_run(master_service, NULL);
+
+	while ((ret = read(fd[1], buf, sizeof(buf))) > 0)
+		buffer_append(output, buf, ret);
+	if (ret < 0)
+		i_fatal("read(lmtp session) failed: %m");
+	i_close_fd(&fd[1]);
+	return t_strsplit_spaces(str_c(output), "\r\n");
+}
+
+static void test_lmtp_local_delivery_workers(void)
+{
+	const char *const *replies;
+	pid_t pid1, pid2, pid3;
+
+	test_begin("lmtp local delivery workers");
+	test_expect_error_string("timed out after 1 secs - killing it");
+	replies = test_lmtp_session(
+		"LHLO test\r\n"
+		"MAIL FROM:<sender@example.com>\r\n"
+		"RCPT TO:<user1>\r\n"
+		"RCPT TO:<user2>\r\n"
+		"RCPT TO:<user1>\r\n"
+		"RCPT TO:<user3>\r\n"
+		"DATA\r\n"
+		"Subject: test\r\n"
+		"\r\n"
+		"body\r\n"
+		".\r\n"
+		/* a worker that hangs is killed */
+		"MAIL FROM:<sender@example.com>\r\n"
+		"RCPT TO:<user4>\r\n"
+		"RCPT TO:<hang>\r\n"
+		"DATA\r\n"
+		"Subject: test 2\r\n"
+		"\r\n"
+		"body\r\n"
+		".\r\n"
+		"QUIT\r\n");
+	test_expect_no_more_errors();
+
+	/* skip the greeting and LHLO replies */
+	while (*replies != NULL && !str_begins_with(*replies, "250 "))
+		replies++;
+	test_assert(str_array_length(replies) == 18);
+	if (str_array_length(replies) != 18) {
+		test_end();
+		return;
+	}
+	/* first transaction: all recipients in order */
+	test_assert(str_begins_with(replies[1], "250 2.1.0 "));
+	test_assert(str_begins_with(replies[2], "250 2.1.5 "));
+	test_assert(str_begins_with(replies[3], "250 2.1.5 "));
+	test_assert(str_begins_with(replies[4], "250 2.1.5 "));
+	test_assert(str_begins_with(replies[5], "250 2.1.5 "));
+	test_assert(str_begins_with(replies[6], "354 "));
+	test_assert(str_begins_with(replies[7], "250 2.0.0 <user1> "));
+	test_assert(str_begins_with(replies[8], "250 2.0.0 <user2> "));
+	test_assert(str_begins_with(replies[9], "250 2.0.0 <user1> "));
+	test_assert(str_begins_with(replies[10], "250 2.0.0 <user3> "));
+	/* second transaction */
+	test_assert(str_begins_with(replies[11], "250 2.1.0 "));
+	test_assert(str_begins_with(replies[12], "250 2.1.5 "));
+	test_assert(str_begins_with(replies[13], "250 2.1.5 "));
+	test_assert(str_begins_with(replies[14], "354 "));
+	test_assert(str_begins_with(replies[15], "250 2.0.0 <user4> "));
+	test_assert_strcmp(replies[16],
+			   "451 4.3.0 <hang> Temporary internal error");
+	test_assert(str_begins_with(replies[17], "221 "));
+
+	/* The duplicate recipient got only one mail. The first worker
+	   delivered to user1 and user2, the second one to user3. */
+	pid1 = test_delivery_pid("user1");
+	pid2 = test_delivery_pid("user2");
+	pid3 = test_delivery_pid("user3");
+	test_assert(pid1 != 0 && pid1 != getpid());
+	test_assert(pid2 == pid1);
+	test_assert(pid3 != 0 && pid3 != getpid() && pid3 != pid1);
+	test_assert(test_delivery_pid("user4") != 0);
+	test_assert(test_delivery_pid("hang") == 0);
+	test_assert(test_inbox_count() == 4);
+	test_end();
+}
+
+static void test_cleanup(void)
+{
+	const char *error;
+
+	if (unlink_directory(tmpdir, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0 &&
+	    errno != ENOENT)
+		i_error("unlink_directory() failed: %s", error);
+}
+
+static void test_init(void)
+{
+	static const char *const settings[] = {
+		"mail_location", "maildir:~/Maildir",
+		"mail_plugins", "",
+		"lmtp_local_delivery_workers", "2",
+		"lmtp_local_delivery_worker_timeout", "1s",
+		"postmaster_address", "postmaster@example.com",
+		"hostname", "test.example.com",
+		NULL
+	};
+	struct settings_root *set_root =
+		master_service_get_settings_root(master_service);
+	struct smtp_server_settings lmtp_set;
+	const char *cwd, *error;
+	unsigned int i;
+
+	if (geteuid() == 0) {
+		/* Mails can't be delivered as root. Run the test as an
+		   unprivileged user, which might not be able to access the
+		   current directory. */
+		struct passwd pw;
+
+		if (i_getpwnam("nobody", &pw) <= 0)
+			i_fatal("i_getpwnam(nobody) failed");
+		tmpdir = t_strdup_printf("/tmp/"TEMP_DIRNAME".%s", my_pid);
+		test_cleanup();
+		if (mkdir(tmpdir, 0700) < 0)
+			i_fatal("mkdir() failed: %m");
+		if (chown(tmpdir, pw.pw_uid, pw.pw_gid) < 0)
+			i_fatal("chown() failed: %m");
+		if (setegid(pw.pw_gid) < 0 || seteuid(pw.pw_uid) < 0)
+			i_fatal("seteuid() failed: %m");
+	} else {
+		test_assert(t_get_working_dir(&cwd, &error) == 0);
+		tmpdir = t_strconcat(cwd, "/"TEMP_DIRNAME, NULL);
+		test_cleanup();
+		if (mkdir(tmpdir, 0700) < 0)
+			i_fatal("mkdir() failed: %m");
+	}
+
+	for (i = 0; settings[i] != NULL; i += 2) {
+		settings_root_override(set_root, settings[i], settings[i + 1],
+				       SETTINGS_OVERRIDE_TYPE_CODE);
+	}
+	settings_root_override(set_root, "base_dir", tmpdir,
+			       SETTINGS_OVERRIDE_TYPE_CODE);
+	/* The settings overrides aren't %variable expanded, so all the
+	   users share the same home. */
+	settings_root_override(set_root, "mail_home",
+			       t_strconcat(tmpdir, "/home", NULL),
+			       SETTINGS_OVERRIDE_TYPE_CODE);
+	if (master_service_settings_read_simple(master_service, &error) < 0)
+		i_fatal("%s", error);
+	base_dir = i_strdup(tmpdir);
+	dns_client_socket_path = i_strconcat(tmpdir, "/dns-client", NULL);
+
+	storage_service = mail_storage_service_init(master_service,
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR |
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+
+	i_zero(&lmtp_set);
+	lmtp_set.protocol = SMTP_PROTOCOL_LMTP;
+	lmtp_set.auth_optional = TRUE;
+	lmtp_set.rcpt_domain_optional = TRUE;
+	lmtp_server = smtp_server_init(&lmtp_set);
+	mail_deliver_hooks_init();
+	child_wait_init();
+	hook_client_created = test_client_created;
+}
+
+static void test_deinit(void)
+{
+	child_wait_deinit();
+	smtp_server_deinit(&lmtp_server);
+	mail_storage_service_deinit(&storage_service);
+	i_free(dns_client_socket_path);
+	i_free(base_dir);
+	test_cleanup();
+}
+
+int main(int argc, char *argv[])
+{
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_STD_CLIENT |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS;
+	static void (*const test_functions[])(void) = {
+		test_lmtp_local_delivery_workers,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-lmtp-local",
+					     service_flags, &argc, &argv, "");
+	master_service_init_finish(master_service);
+	test_init();
+
+	ret = test_run(test_functions);
+
+	test_deinit();
+	master_service_deinit(&master_service);
+	return ret;
+}
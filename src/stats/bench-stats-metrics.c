@@ -0,0 +1,169 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-stats-common.h"
+#include "array.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "event-filter-private.h"
+
+#include <stdio.h>
+
+/**
+ * Measures matching events against the stats service's event filter with
+ * many metrics configured, both with the compiled filter program and by
+ * walking the filter trees. Half of the events don't match any metric,
+ * which is the common case with processes that send all their events.
+ */
+
+#define BENCH_METRICS_COUNT 200
+
+bool test_stats_callback(struct event *event ATTR_UNUSED,
+			 enum event_callback_type type ATTR_UNUSED,
+			 struct failure_context *ctx ATTR_UNUSED,
+			 const char *fmt ATTR_UNUSED,
+			 va_list args ATTR_UNUSED)
+{
+	return TRUE;
+}
+
+static const char *bench_metric_filter(unsigned int i)
+{
+	switch (i % 4) {
+	case 0:
+		return t_strdup_printf("event=bench_event_%u", i);
+	case 1:
+		return t_strdup_printf(
+			"event=bench_event_%u AND category=test", i);
+	case 2:
+		return t_strdup_printf(
+			"event=bench_event_%u AND user=\"user1*\"", i);
+	default:
+		return t_strdup_printf(
+			"(event=bench_event_%u OR event=bench_extra_%u) "
+			"AND NOT category=child", i, i);
+	}
+}
+
+static const char *const *bench_settings(void)
+{
+	ARRAY_TYPE(const_string) settings;
+	string_t *names = t_str_new(1024);
+	unsigned int i;
+
+	t_array_init(&settings, BENCH_METRICS_COUNT * 3 + 2);
+	str_append(names, "metric=");
+	for (i = 0; i < BENCH_METRICS_COUNT; i++) {
+		const char *name = t_strdup_printf("metric%u", i);
+		const char *set;
+
+		if (i > 0)
+			str_append_c(names, ' ');
+		str_append(names, name);
+
+		set = t_strdup_printf("metric/%s/metric_name=%s", name, name);
+		array_push_back(&settings, &set);
+		set = t_strdup_printf("metric/%s/filter=%s", name,
+				      bench_metric_filter(i));
+		array_push_back(&settings, &set);
+	}
+	const char *names_str = str_c(names);
+	array_push_back(&settings, &names_str);
+	array_append_zero(&settings);
+	return array_front(&settings);
+}
+
+static struct event **bench_create_events(unsigned int count)
+{
+	struct event **events = i_new(struct event *, count);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		events[i] = event_create(NULL);
+		event_add_category(events[i], (i % 3) == 0 ?
+				   &child_test_category : &test_category);
+		event_add_str(events[i], "user",
+			      t_strdup_printf("user%u", i % 20));
+		event_add_int(events[i], "bytes", i);
+		/* every second event doesn't match any metric */
+		event_set_name(events[i], t_strdup_printf(
+			(i % 2) == 0 ? "bench_event_%u" : "bench_unused_%u",
+			i % BENCH_METRICS_COUNT));
+	}
+	return events;
+}
+
+static void
+bench_run(const char *name, struct event **events, unsigned int count,
+	  unsigned int rounds)
+{
+	const struct failure_context ctx = { .type = LOG_TYPE_DEBUG };
+	struct event_filter *filter = stats_metrics_get_event_filter(stats_metrics);
+	unsigned int i, j, matches = 0;
+	uint64_t ts, match_nsecs, metrics_nsecs;
+
+	ts = i_nanoseconds();
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < count; i++) {
+			if (event_filter_match(filter, events[i], &ctx))
+				matches++;
+		}
+	}
+	match_nsecs = i_nanoseconds() - ts;
+
+	ts = i_nanoseconds();
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < count; i++)
+			stats_metrics_event(stats_metrics, events[i], &ctx);
+	}
+	metrics_nsecs = i_nanoseconds() - ts;
+
+	printf("%s\n", name);
+	printf("\tevent_filter_match(): %0.02lf ns/event (%u matches)\n",
+	       (double)match_nsecs / (count * rounds), matches);
+	printf("\tstats_metrics_event(): %0.02lf ns/event\n\n",
+	       (double)metrics_nsecs / (count * rounds));
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s rounds\n", prog);
+	fprintf(stderr, "Runs 100 rounds if nothing given\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int i, rounds = 100, count = BENCH_METRICS_COUNT * 2;
+	struct event **events;
+
+	lib_init();
+
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &rounds) < 0 || rounds == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+			return 1;
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	T_BEGIN {
+		test_init(bench_settings());
+		events = bench_create_events(count);
+	} T_END;
+
+	printf("%u metrics, %u events, %u rounds\n\n",
+	       BENCH_METRICS_COUNT, count, rounds);
+	event_filter_set_program_disabled_for_testing(TRUE);
+	bench_run("filter trees", events, count, rounds);
+	event_filter_set_program_disabled_for_testing(FALSE);
+	bench_run("compiled program", events, count, rounds);
+
+	for (i = 0; i < count; i++)
+		event_unref(&events[i]);
+	i_free(events);
+	test_deinit();
+	lib_deinit();
+	return 0;
+}
@@ -10,6 +10,7 @@
 #include "master-service.h"
 #include "stats-metrics.h"
 #include "stats-settings.h"
+#include "stats-window.h"
 #include "client-reader.h"
 #include "client-writer.h"
 #include "event-exporter.h"
@@ -37,14 +38,63 @@ static void reader_client_destroy(struct connection *conn)
 	master_service_client_connection_destroyed(master_service);
 }
 
+static void
+reader_client_dump_window_field(string_t *str, const char *field,
+				const struct stats_histogram *hist,
+				unsigned int msecs)
+{
+	if (strcmp(field, "count") == 0)
+		str_printfa(str, "%"PRIu64, hist->count);
+	else if (strcmp(field, "sum") == 0)
+		str_printfa(str, "%"PRIu64, hist->sum);
+	else if (strcmp(field, "min") == 0)
+		str_printfa(str, "%"PRIu64, hist->min);
+	else if (strcmp(field, "max") == 0)
+		str_printfa(str, "%"PRIu64, hist->max);
+	else if (strcmp(field, "avg") == 0)
+		str_printfa(str, "%.02f", stats_histogram_get_avg(hist));
+	else if (strcmp(field, "median") == 0)
+		str_printfa(str, "%"PRIu64,
+			    stats_histogram_get_percentile(hist, 0.5));
+	else if (strcmp(field, "rate") == 0)
+		str_printfa(str, "%.02f", hist->count * 1000.0 / msecs);
+	else if (field[0] == '%') {
+		str_printfa(str, "%"PRIu64,
+			    stats_histogram_get_percentile(hist,
+				strtod(field+1, NULL)/100.0));
+	} else {
+		/* return unknown fields as empty */
+	}
+}
+
 static void reader_client_dump_stats(string_t *str, struct stats_dist *stats,
+				     const struct metric *metric,
 				     const char *const *fields)
 {
+	struct stats_histogram hist;
+	unsigned int hist_msecs = 0;
+	int hist_idx = -1, idx;
+
 	for (unsigned int i = 0; fields[i] != NULL; i++) {
 		const char *field = fields[i];
+		const char *window = strchr(field, ':');
 
 		str_append_c(str, '\t');
-		if (strcmp(field, "count") == 0)
+		if (window != NULL) {
+			/* field:window - only durations have windows */
+			idx = metric == NULL ? -1 :
+				stats_metric_find_window(metric, window + 1);
+			if (idx < 0)
+				continue;
+			if (idx != hist_idx) {
+				hist_msecs = stats_metric_get_window(metric,
+								     idx, &hist);
+				hist_idx = idx;
+			}
+			reader_client_dump_window_field(str,
+				t_strdup_until(field, window), &hist,
+				hist_msecs);
+		} else if (strcmp(field, "count") == 0)
 			str_printfa(str, "%u", stats_dist_get_count(stats));
 		else if (strcmp(field, "sum") == 0)
 			str_printfa(str, "%"PRIu64, stats_dist_get_sum(stats));
@@ -70,11 +120,12 @@ static void reader_client_dump_stats(string_t *str, struct stats_dist *stats,
 static void reader_client_dump_metric(string_t *str, const struct metric *metric,
 				      const char *const *fields)
 {
-	reader_client_dump_stats(str, metric->duration_stats, fields);
+	reader_client_dump_stats(str, metric->duration_stats, metric, fields);
 	for (unsigned int i = 0; i < metric->fields_count; i++) {
 		str_append_c(str, '\t');
 		str_append_tabescaped(str, metric->fields[i].field_key);
-		reader_client_dump_stats(str, metric->fields[i].stats, fields);
+		reader_client_dump_stats(str, metric->fields[i].stats, NULL,
+					 fields);
 	}
 	str_append_c(str, '\n');
 }
@@ -171,6 +222,8 @@ reader_client_input_metrics_add(struct reader_client *client,
 		.filter = args[4],
 		.exporter = args[5],
 		.exporter_include = args[6],
+		/* optional for backwards compatibility */
+		.windows = args[7] != NULL ? args[7] : "",
 	};
 	o_stream_cork(client->conn.output);
 	if (stats_metrics_add_dynamic(stats_metrics, &set, &error)) {
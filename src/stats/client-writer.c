@@ -8,15 +8,19 @@
 #include "strescape.h"
 #include "lib-event-private.h"
 #include "event-filter.h"
+#include "istream-unix.h"
 #include "ostream.h"
 #include "connection.h"
 #include "master-service.h"
+#include "stats-ring.h"
 #include "stats-event-category.h"
 #include "stats-metrics.h"
 #include "stats-settings.h"
 #include "client-writer.h"
 
 #define STATS_UPDATE_CLIENTS_DELAY_MSECS 1000
+/* How often the clients' shared memory rings are drained */
+#define STATS_RING_POLL_INTERVAL_MSECS 50
 
 struct stats_event {
 	struct stats_event *prev, *next;
@@ -30,11 +34,19 @@ struct writer_client {
 
 	struct stats_event *events;
 	HASH_TABLE(struct stats_event *, struct stats_event *) events_hash;
+
+	struct stats_ring *ring;
+	buffer_t *ring_buf;
+	bool ring_corrupted:1;
 };
 
 static struct timeout *to_update_clients;
+static struct timeout *to_ring_poll;
+static unsigned int ring_clients_count = 0;
 static struct connection_list *writer_clients = NULL;
 
+static bool writer_client_ring_drain(struct writer_client *client);
+
 static void client_writer_send_handshake(struct writer_client *client)
 {
 	string_t *filter = t_str_new(128);
@@ -62,13 +74,19 @@ static int stats_event_cmp(const struct stats_event *event1,
 void client_writer_create(int fd)
 {
 	struct writer_client *client;
+	const char *name;
 
 	client = i_new(struct writer_client, 1);
 	hash_table_create(&client->events_hash, default_pool, 0,
 			  stats_event_hash, stats_event_cmp);
 
+	/* UNIX socket clients may send a shared memory ring fd */
+	if (net_getunixname(fd, &name) == 0)
+		client->conn.unix_socket = TRUE;
 	connection_init_server(writer_clients, &client->conn,
 			       "stats", fd, fd);
+	if (client->conn.unix_socket)
+		i_stream_unix_set_read_fd(client->conn.input);
 	client_writer_send_handshake(client);
 }
 
@@ -77,6 +95,15 @@ static void writer_client_destroy(struct connection *conn)
 	struct writer_client *client = (struct writer_client *)conn;
 	struct stats_event *event, *next;
 
+	if (client->ring != NULL) {
+		/* process the events written after the last socket input */
+		(void)writer_client_ring_drain(client);
+		stats_ring_free(&client->ring);
+		buffer_free(&client->ring_buf);
+		if (--ring_clients_count == 0)
+			timeout_remove(&to_ring_poll);
+	}
+
 	for (event = client->events; event != NULL; event = next) {
 		next = event->next;
 		event_unref(&event->event);
@@ -291,16 +318,15 @@ writer_client_input_category(struct writer_client *client ATTR_UNUSED,
 	return TRUE;
 }
 
-static int
-writer_client_input_args(struct connection *conn, const char *const *args)
+static bool
+writer_client_input_cmd(struct writer_client *client, const char *const *args)
 {
-	struct writer_client *client = (struct writer_client *)conn;
 	const char *error, *cmd = args[0];
 	bool ret;
 
 	if (cmd == NULL) {
-		e_error(conn->event, "Client sent empty line");
-		return 1;
+		e_error(client->conn.event, "Client sent empty line");
+		return TRUE;
 	}
 	if (strcmp(cmd, "EVENT") == 0)
 		ret = writer_client_input_event(client, args+1, &error);
@@ -317,11 +343,119 @@ writer_client_input_args(struct connection *conn, const char *const *args)
 		ret = FALSE;
 	}
 	if (!ret) {
-		e_error(conn->event,
+		e_error(client->conn.event,
 			"Client sent invalid input for %s: %s (input: %s)",
 			cmd, error, t_strarray_join(args, "\t"));
-		return -1;
+		return FALSE;
 	}
+	return TRUE;
+}
+
+static bool writer_client_ring_drain(struct writer_client *client)
+{
+	const char *error, *line, *end, *p;
+	bool ret = TRUE;
+	int ring_ret;
+
+	if (client->ring_corrupted)
+		return FALSE;
+	ring_ret = stats_ring_read(client->ring, client->ring_buf, &error);
+	if (ring_ret == 0)
+		return TRUE;
+	if (ring_ret < 0) {
+		e_error(client->conn.event, "Corrupted stats ring: %s", error);
+		client->ring_corrupted = TRUE;
+		return FALSE;
+	}
+
+	/* the client writes only full lines */
+	line = client->ring_buf->data;
+	end = line + client->ring_buf->used;
+	if (end[-1] != '\n') {
+		e_error(client->conn.event,
+			"Corrupted stats ring: Data doesn't end with LF");
+		client->ring_corrupted = TRUE;
+		ret = FALSE;
+	}
+	for (; ret && line < end; line = p + 1) {
+		p = memchr(line, '\n', end - line);
+		if (p == NULL)
+			break;
+		T_BEGIN {
+			const char *const *args = t_strsplit_tabescaped(
+				t_strdup_until(line, p));
+			ret = writer_client_input_cmd(client, args);
+		} T_END;
+	}
+	buffer_set_used_size(client->ring_buf, 0);
+	return ret;
+}
+
+static void writer_clients_ring_poll(void *context ATTR_UNUSED)
+{
+	struct connection *conn, *next;
+
+	for (conn = writer_clients->connections; conn != NULL; conn = next) {
+		struct writer_client *client =
+			container_of(conn, struct writer_client, conn);
+
+		next = conn->next;
+		if (client->ring != NULL && !writer_client_ring_drain(client))
+			writer_client_destroy(conn);
+	}
+}
+
+static bool
+writer_client_input_ring(struct writer_client *client, const char **error_r)
+{
+	const char *error;
+	int fd;
+
+	if (client->ring != NULL) {
+		*error_r = "Ring already received";
+		return FALSE;
+	}
+	fd = !client->conn.unix_socket ? -1 :
+		i_stream_unix_get_read_fd(client->conn.input);
+	if (fd == -1) {
+		*error_r = "Ring fd not received";
+		return FALSE;
+	}
+	if (stats_ring_open(fd, &client->ring, &error) < 0) {
+		*error_r = t_strdup_printf("Failed to open ring: %s", error);
+		return FALSE;
+	}
+	client->ring_buf = buffer_create_dynamic(default_pool, 4096);
+	if (ring_clients_count++ == 0) {
+		to_ring_poll = timeout_add_short(
+			STATS_RING_POLL_INTERVAL_MSECS,
+			writer_clients_ring_poll, NULL);
+	}
+	return TRUE;
+}
+
+static int
+writer_client_input_args(struct connection *conn, const char *const *args)
+{
+	struct writer_client *client = (struct writer_client *)conn;
+	const char *error;
+
+	/* Everything in the ring was written before this line */
+	if (client->ring != NULL && !writer_client_ring_drain(client))
+		return -1;
+
+	if (args[0] != NULL && strcmp(args[0], "RING") == 0) {
+		if (!writer_client_input_ring(client, &error)) {
+			e_error(conn->event,
+				"Client sent invalid input for RING: %s",
+				error);
+			return -1;
+		}
+	} else if (!writer_client_input_cmd(client, args))
+		return -1;
+
+	if (client->ring != NULL)
+		stats_ring_socket_line_processed(client->ring);
 	return 1;
 }
 
@@ -329,7 +463,8 @@ static struct connection_settings client_set = {
 	.service_name_in = "stats-client",
 	.service_name_out = "stats-server",
 	.major_version = 4,
-	.minor_version = 0,
+	/* 4.1 added RING */
+	.minor_version = 1,
 
 	.input_max_size = 1024*128, /* "big enough" */
 	.output_max_size = SIZE_MAX,
@@ -371,4 +506,5 @@ void client_writers_deinit(void)
 {
 	timeout_remove(&to_update_clients);
 	connection_list_deinit(&writer_clients);
+	i_assert(to_ring_poll == NULL);
 }
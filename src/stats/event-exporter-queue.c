@@ -0,0 +1,191 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "ostream.h"
+#include "compression.h"
+#include "event-exporter.h"
+
+/* Bounded ring of formatted events waiting to be sent. When the transport
+   can't keep up, the oldest events are dropped so the stats process memory
+   usage stays bounded. */
+struct exporter_queue_event {
+	unsigned char *data;
+	size_t size;
+};
+
+struct exporter_queue {
+	struct exporter *exporter;
+
+	/* ring of queue_max_events, allocated on first use */
+	struct exporter_queue_event *events;
+	unsigned int head, count;
+
+	struct timeout *to_flush;
+	buffer_t *batch, *compressed;
+
+	uint64_t dropped_count;
+	unsigned int dropped_unlogged_count;
+	time_t last_drop_log;
+};
+
+struct exporter_queue *event_export_queue_init(struct exporter *exporter)
+{
+	struct exporter_queue *queue;
+
+	i_assert(exporter->batch_max_events > 0);
+	i_assert(exporter->queue_max_events >= exporter->batch_max_events);
+
+	queue = i_new(struct exporter_queue, 1);
+	queue->exporter = exporter;
+	return queue;
+}
+
+static void event_export_queue_drop_oldest(struct exporter_queue *queue)
+{
+	struct exporter_queue_event *event = &queue->events[queue->head];
+
+	i_free(event->data);
+	queue->head = (queue->head + 1) % queue->exporter->queue_max_events;
+	queue->count--;
+
+	queue->dropped_count++;
+	queue->dropped_unlogged_count++;
+	if (queue->last_drop_log != ioloop_time) {
+		i_warning("Exporter %s: Queue is full - "
+			  "dropped %u oldest events", queue->exporter->name,
+			  queue->dropped_unlogged_count);
+		queue->dropped_unlogged_count = 0;
+		queue->last_drop_log = ioloop_time;
+	}
+}
+
+static int
+event_export_queue_compress(struct exporter_queue *queue)
+{
+	const struct compression_handler *handler =
+		queue->exporter->compression;
+	struct ostream *output, *comp_output;
+
+	if (queue->compressed == NULL)
+		queue->compressed = buffer_create_dynamic(default_pool, 1024);
+	buffer_set_used_size(queue->compressed, 0);
+
+	output = o_stream_create_buffer(queue->compressed);
+	comp_output = handler->create_ostream(output,
+					      handler->get_default_level());
+	o_stream_unref(&output);
+	o_stream_nsend(comp_output, queue->batch->data, queue->batch->used);
+	if (o_stream_finish(comp_output) < 0) {
+		i_error("Exporter %s: %s compression failed: %s",
+			queue->exporter->name, handler->name,
+			o_stream_get_error(comp_output));
+		o_stream_unref(&comp_output);
+		return -1;
+	}
+	o_stream_unref(&comp_output);
+	return 0;
+}
+
+static void
+event_export_queue_send_batch(struct exporter_queue *queue)
+{
+	struct exporter *exporter = queue->exporter;
+	unsigned int i, count = I_MIN(queue->count, exporter->batch_max_events);
+
+	if (queue->batch == NULL)
+		queue->batch = buffer_create_dynamic(default_pool, 1024);
+	buffer_set_used_size(queue->batch, 0);
+
+	/* remove the events from the queue before calling the transport, so
+	   it's safe for it to call event_export_queue_flush() */
+	for (i = 0; i < count; i++) {
+		struct exporter_queue_event *event = &queue->events[queue->head];
+
+		buffer_append(queue->batch, event->data, event->size);
+		buffer_append_c(queue->batch, '\n');
+		i_free(event->data);
+		queue->head = (queue->head + 1) % exporter->queue_max_events;
+	}
+	queue->count -= count;
+
+	if (exporter->compression == NULL)
+		exporter->transport(exporter, queue->batch);
+	else if (event_export_queue_compress(queue) == 0)
+		exporter->transport(exporter, queue->compressed);
+}
+
+static bool event_export_queue_is_busy(struct exporter_queue *queue)
+{
+	return queue->exporter->transport_busy != NULL &&
+		queue->exporter->transport_busy(queue->exporter);
+}
+
+void event_export_queue_flush(struct exporter_queue *queue)
+{
+	timeout_remove(&queue->to_flush);
+	while (queue->count > 0 && !event_export_queue_is_busy(queue))
+		event_export_queue_send_batch(queue);
+}
+
+void event_export_queue_add(struct exporter_queue *queue, const buffer_t *buf)
+{
+	struct exporter *exporter = queue->exporter;
+	struct exporter_queue_event *event;
+
+	if (queue->events == NULL) {
+		queue->events = i_new(struct exporter_queue_event,
+				      exporter->queue_max_events);
+	}
+	if (queue->count == exporter->queue_max_events)
+		event_export_queue_drop_oldest(queue);
+
+	event = &queue->events[(queue->head + queue->count) %
+			       exporter->queue_max_events];
+	event->data = i_memdup(buf->data, buf->used);
+	event->size = buf->used;
+	queue->count++;
+
+	if (queue->count >= exporter->batch_max_events) {
+		if (!event_export_queue_is_busy(queue))
+			event_export_queue_flush(queue);
+	} else if (queue->to_flush == NULL) {
+		queue->to_flush = timeout_add(exporter->batch_max_msecs,
+					      event_export_queue_flush, queue);
+	}
+}
+
+unsigned int event_export_queue_get_count(const struct exporter_queue *queue)
+{
+	return queue->count;
+}
+
+uint64_t event_export_queue_get_dropped_count(const struct exporter_queue *queue)
+{
+	return queue->dropped_count;
+}
+
+void event_export_queue_deinit(struct exporter_queue **_queue)
+{
+	struct exporter_queue *queue = *_queue;
+
+	if (queue == NULL)
+		return;
+
+	/* the transports buffer whatever they can't send immediately */
+	while (queue->count > 0)
+		event_export_queue_send_batch(queue);
+	*_queue = NULL;
+	if (queue->dropped_unlogged_count > 0) {
+		i_warning("Exporter %s: Queue is full - "
+			  "dropped %u oldest events", queue->exporter->name,
+			  queue->dropped_unlogged_count);
+	}
+
+	timeout_remove(&queue->to_flush);
+	buffer_free(&queue->batch);
+	buffer_free(&queue->compressed);
+	i_free(queue->events);
+	i_free(queue);
+}
@@ -15,6 +15,7 @@
 
 struct exporter_file {
 	struct exporter_file *next;
+	const struct exporter *exporter;
 	char *fname;
 	struct ostream *output;
 	int fd;
@@ -66,6 +67,7 @@ static struct exporter_file *exporter_file_init(const struct exporter *exporter,
 {
 	struct exporter_file *node;
 	node = i_new(struct exporter_file, 1);
+	node->exporter = exporter;
 	node->fname = i_strdup(t_strcut(exporter->transport_args, ' '));
 	node->fd = -1;
 	node->unix_socket = unix_socket;
@@ -85,6 +87,24 @@ static void exporter_file_open_error(struct exporter_file *node, const char *fun
 	node->last_error = ioloop_time;
 }
 
+static int exporter_file_output_flush(struct exporter_file *node)
+{
+	int ret;
+
+	if ((ret = o_stream_flush(node->output)) < 0) {
+		if (ioloop_time - node->last_error > EXPORTER_LAST_ERROR_DELAY) {
+			i_error("write(%s): %s", o_stream_get_name(node->output),
+				o_stream_get_error(node->output));
+			node->last_error = ioloop_time;
+		}
+		o_stream_close(node->output);
+		return -1;
+	}
+	if (ret > 0 && node->exporter->queue != NULL)
+		event_export_queue_flush(node->exporter->queue);
+	return ret;
+}
+
 static bool exporter_file_open_unix(struct exporter_file *node)
 {
 	node->fd = net_connect_unix_with_retries(node->fname ,
@@ -95,6 +115,14 @@ static bool exporter_file_open_unix(struct exporter_file *node)
 		return FALSE;
 	}
 	node->output = o_stream_create_unix(node->fd, IO_BLOCK_SIZE);
+	if (node->exporter->queue != NULL) {
+		/* The queue doesn't send more batches while the previous one
+		   is still buffered, so a whole batch can always be buffered
+		   without losing data. */
+		o_stream_set_max_buffer_size(node->output, SIZE_MAX);
+		o_stream_set_flush_callback(node->output,
+					    exporter_file_output_flush, node);
+	}
 	return TRUE;
 }
 
@@ -132,7 +160,11 @@ static void event_export_transport_file_write(struct exporter_file *node,
 		{ .iov_base = buf->data, .iov_len = buf->used },
 		{ .iov_base = "\n", .iov_len = 1 }
 	};
-	if (o_stream_sendv(node->output, vec, N_ELEMENTS(vec)) < 0) {
+	/* batches are already newline terminated (or compressed) */
+	unsigned int vec_count = node->exporter->queue != NULL ?
+		1 : N_ELEMENTS(vec);
+
+	if (o_stream_sendv(node->output, vec, vec_count) < 0) {
 		if (ioloop_time - node->last_error > EXPORTER_LAST_ERROR_DELAY) {
 			i_error("write(%s): %s", o_stream_get_name(node->output),
 				o_stream_get_error(node->output));
@@ -164,6 +196,16 @@ void event_export_transport_unix(const struct exporter *exporter,
 	event_export_transport_file_write(node, buf);
 }
 
+bool event_export_transport_file_busy(const struct exporter *exporter)
+{
+	struct exporter_file *node = exporter->transport_context;
+
+	/* still waiting for the previous batch to be sent */
+	return node != NULL && node->output != NULL &&
+		!node->output->closed &&
+		o_stream_get_buffer_used_size(node->output) > 0;
+}
+
 void event_export_transport_file_reopen(void)
 {
 	/* close all files, but not unix sockets */
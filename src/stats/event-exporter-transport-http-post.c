@@ -1,31 +1,70 @@
 /* Copyright (c) 2019 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "ioloop.h"
 #include "str.h"
 #include "event-exporter.h"
 #include "http-client.h"
+#include "compression.h"
 #include "iostream-ssl.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "master-service-ssl-settings.h"
 #include "stats-common.h"
 
+/* Maximum number of batches being sent concurrently per exporter. Further
+   events are queued (and the oldest of them dropped if the queue is full)
+   until one of the requests finishes. */
+#define EXPORTER_HTTP_POST_MAX_PENDING_BATCHES 4
+
+struct exporter_http_post {
+	const struct exporter *exporter;
+	unsigned int pending_requests;
+};
+
 /* the http client used to export all events with exporter=http-post */
 static struct http_client *exporter_http_client;
+static ARRAY(struct exporter_http_post *) exporter_http_posts;
 
 void event_export_transport_http_post_deinit(void)
 {
+	struct exporter_http_post *node;
+
 	if (exporter_http_client != NULL)
 		http_client_deinit(&exporter_http_client);
+	if (array_is_created(&exporter_http_posts)) {
+		array_foreach_elem(&exporter_http_posts, node)
+			i_free(node);
+		array_free(&exporter_http_posts);
+	}
+}
+
+static struct exporter_http_post *
+exporter_http_post_init(const struct exporter *exporter)
+{
+	struct exporter_http_post *node;
+
+	node = i_new(struct exporter_http_post, 1);
+	node->exporter = exporter;
+	if (!array_is_created(&exporter_http_posts))
+		i_array_init(&exporter_http_posts, 4);
+	array_push_back(&exporter_http_posts, &node);
+	event_export_transport_assign_context(exporter, node);
+	return node;
 }
 
 static void response_fxn(const struct http_response *response,
-			 void *context ATTR_UNUSED)
+			 struct exporter_http_post *node)
 {
 	static time_t last_log;
 	static unsigned int suppressed;
 
+	i_assert(node->pending_requests > 0);
+	node->pending_requests--;
+	if (node->exporter->queue != NULL)
+		event_export_queue_flush(node->exporter->queue);
+
 	if (http_response_is_success(response))
 		return;
 
@@ -45,9 +84,27 @@ static void response_fxn(const struct http_response *response,
 	suppressed = 0;
 }
 
+static const char *
+exporter_http_post_content_encoding(const struct exporter *exporter)
+{
+	/* the same names as HTTP uses, except for gzip */
+	if (strcmp(exporter->compression->name, "gz") == 0)
+		return "gzip";
+	return exporter->compression->name;
+}
+
+bool event_export_transport_http_post_busy(const struct exporter *exporter)
+{
+	struct exporter_http_post *node = exporter->transport_context;
+
+	return node != NULL &&
+		node->pending_requests >= EXPORTER_HTTP_POST_MAX_PENDING_BATCHES;
+}
+
 void event_export_transport_http_post(const struct exporter *exporter,
 				      const buffer_t *buf)
 {
+	struct exporter_http_post *node = exporter->transport_context;
 	struct http_client_request *req;
 
 	if (exporter_http_client == NULL) {
@@ -64,13 +121,20 @@ void event_export_transport_http_post(const struct exporter *exporter,
 		}
 		exporter_http_client = http_client_init(&set);
 	}
+	if (node == NULL)
+		node = exporter_http_post_init(exporter);
 
 	req = http_client_request_url_str(exporter_http_client, "POST",
 					  exporter->transport_args,
-					  response_fxn, NULL);
+					  response_fxn, node);
 	http_client_request_add_header(req, "Content-Type", exporter->format_mime_type);
+	if (exporter->compression != NULL) {
+		http_client_request_add_header(req, "Content-Encoding",
+			exporter_http_post_content_encoding(exporter));
+	}
 	http_client_request_set_payload_data(req, buf->data, buf->used);
 
 	http_client_request_set_timeout_msecs(req, exporter->transport_timeout);
+	node->pending_requests++;
 	http_client_request_submit(req);
 }
@@ -17,6 +17,22 @@ void event_export_transport_file(const struct exporter *exporter, const buffer_t
 void event_export_transport_unix(const struct exporter *exporter, const buffer_t *buf);
 void event_export_transport_file_reopen(void);
 void event_export_transport_file_deinit(void);
+bool event_export_transport_http_post_busy(const struct exporter *exporter);
+bool event_export_transport_file_busy(const struct exporter *exporter);
+
+/* queue for sending the formatted events in batches */
+struct exporter_queue *event_export_queue_init(struct exporter *exporter);
+/* Sends all the queued events, even if the transport is busy. */
+void event_export_queue_deinit(struct exporter_queue **queue);
+/* Add a formatted event to the queue. If the queue is full, the oldest event
+   is dropped. */
+void event_export_queue_add(struct exporter_queue *queue, const buffer_t *buf);
+/* Send the queued events as long as the transport isn't busy. */
+void event_export_queue_flush(struct exporter_queue *queue);
+/* Returns the number of events currently in the queue. */
+unsigned int event_export_queue_get_count(const struct exporter_queue *queue);
+/* Returns the number of events dropped because the queue was full. */
+uint64_t event_export_queue_get_dropped_count(const struct exporter_queue *queue);
 
 /* append a microsecond resolution RFC3339 UTC timestamp */
 void event_export_helper_fmt_rfc3339_time(string_t *dest, const struct timeval *time);
@@ -7,6 +7,9 @@
 #include "stats-dist.h"
 #include "time-util.h"
 #include "var-expand.h"
+#include "compression.h"
+#include "ioloop.h"
+#include "stats-window.h"
 #include "event-filter.h"
 #include "event-exporter.h"
 #include "settings.h"
@@ -33,10 +36,12 @@ static struct metric *
 stats_metric_sub_metric_alloc(struct metric *metric, const char *name, pool_t pool);
 static void stats_metric_free(struct metric *metric);
 
-static void stats_exporters_add_set(struct stats_metrics *metrics,
-				    const struct stats_exporter_settings *set)
+static int stats_exporters_add_set(struct stats_metrics *metrics,
+				   const struct stats_exporter_settings *set,
+				   const char **error_r)
 {
 	struct exporter *exporter;
+	int ret;
 
 	exporter = p_new(metrics->pool, struct exporter, 1);
 	exporter->name = p_strdup(metrics->pool, set->name);
@@ -71,6 +76,8 @@ static void stats_exporters_add_set(struct stats_metrics *metrics,
 		exporter->transport = event_export_transport_drop;
 	} else if (strcmp(set->transport, "http-post") == 0) {
 		exporter->transport = event_export_transport_http_post;
+		exporter->transport_busy =
+			event_export_transport_http_post_busy;
 	} else if (strcmp(set->transport, "log") == 0) {
 		exporter->transport = event_export_transport_log;
 		exporter->format_max_field_len =
@@ -79,13 +86,35 @@ static void stats_exporters_add_set(struct stats_metrics *metrics,
 		exporter->transport = event_export_transport_file;
 	} else if (strcmp(set->transport, "unix") == 0) {
 		exporter->transport = event_export_transport_unix;
+		exporter->transport_busy = event_export_transport_file_busy;
 	} else {
 		i_unreached();
 	}
 
 	exporter->transport_args = set->transport_args;
 
+	exporter->batch_max_events = set->batch_max_events;
+	exporter->batch_max_msecs = set->batch_max_time;
+	exporter->queue_max_events = set->queue_max_events;
+	if (set->compression[0] != '\0') {
+		ret = compression_lookup_handler(set->compression,
+						 &exporter->compression);
+		if (ret <= 0) {
+			*error_r = t_strdup_printf(
+				"Exporter %s: %s compression '%s'", set->name,
+				ret == 0 ? "Support not compiled in for" :
+				"Unknown", set->compression);
+			return -1;
+		}
+	}
+	if (exporter->batch_max_events > 1 || exporter->compression != NULL) {
+		if (exporter->format == event_export_fmt_json)
+			exporter->format_mime_type = "application/x-ndjson";
+		exporter->queue = event_export_queue_init(exporter);
+	}
+
 	array_push_back(&metrics->exporters, &exporter);
+	return 0;
 }
 
 void event_export_transport_assign_context(const struct exporter *exporter,
@@ -111,7 +140,7 @@ static int stats_exporters_add_filter(struct stats_metrics *metrics,
 		*error_r = "Exporter name can't be empty";
 		ret = -1;
 	} else {
-		stats_exporters_add_set(metrics, set);
+		ret = stats_exporters_add_set(metrics, set, error_r);
 	}
 	settings_free(set);
 	return ret;
@@ -135,6 +164,18 @@ stats_metric_alloc(pool_t pool, const char *name,
 			metric->fields[i].stats = stats_dist_init();
 		}
 	}
+	if (array_is_created(&set->parsed_windows)) {
+		const struct stats_metric_settings_window *windows =
+			array_get(&set->parsed_windows, &metric->windows_count);
+
+		metric->windows = p_new(pool, struct stats_window *,
+					metric->windows_count);
+		for (unsigned int i = 0; i < metric->windows_count; i++) {
+			metric->windows[i] =
+				stats_window_init(windows[i].name,
+						  windows[i].msecs);
+		}
+	}
 	return metric;
 }
 
@@ -247,6 +288,7 @@ stats_metric_settings_dup(pool_t pool, const struct stats_metric_settings *src)
 	set->filter = p_strdup(pool, src->filter);
 	set->exporter = p_strdup(pool, src->exporter);
 	set->exporter_include = p_strdup(pool, src->exporter_include);
+	set->windows = p_strdup(pool, src->windows);
 
 	return set;
 }
@@ -393,6 +435,8 @@ static void stats_metric_free(struct metric *metric)
 	stats_dist_deinit(&metric->duration_stats);
 	for (unsigned int i = 0; i < metric->fields_count; i++)
 		stats_dist_deinit(&metric->fields[i].stats);
+	for (unsigned int i = 0; i < metric->windows_count; i++)
+		stats_window_deinit(&metric->windows[i]);
 	settings_free(metric->set);
 
 	if (!array_is_created(&metric->sub_metrics))
@@ -401,8 +445,14 @@ static void stats_metric_free(struct metric *metric)
 		stats_metric_free(sub_metric);
 }
 
-static void stats_export_deinit(void)
+static void stats_export_deinit(struct stats_metrics *metrics)
 {
+	struct exporter *exporter;
+
+	/* send the queued events before the transports are deinitialized */
+	array_foreach_elem(&metrics->exporters, exporter)
+		event_export_queue_deinit(&exporter->queue);
+
 	/* no need for event_export_transport_drop_deinit() - no-op */
 	event_export_transport_http_post_deinit();
 	/* no need for event_export_transport_log_deinit() - no-op */
@@ -416,7 +466,7 @@ void stats_metrics_deinit(struct stats_metrics **_metrics)
 
 	*_metrics = NULL;
 
-	stats_export_deinit();
+	stats_export_deinit(metrics);
 
 	array_foreach_elem(&metrics->metrics, metric)
 		stats_metric_free(metric);
@@ -819,12 +869,54 @@ stats_metric_event_field(struct event *event, const char *fieldname,
 	stats_dist_add(stats, num);
 }
 
+static uint64_t stats_metrics_now_msecs(void)
+{
+	return (uint64_t)ioloop_timeval.tv_sec * 1000 +
+		ioloop_timeval.tv_usec / 1000;
+}
+
+static void
+stats_metric_event_windows(struct metric *metric, struct event *event)
+{
+	const struct event_field *field =
+		event_find_field_nonrecursive(event,
+					      STATS_EVENT_FIELD_NAME_DURATION);
+	uint64_t now_msecs = stats_metrics_now_msecs();
+
+	i_assert(field != NULL &&
+		 field->value_type == EVENT_FIELD_VALUE_TYPE_INTMAX);
+	for (unsigned int i = 0; i < metric->windows_count; i++) {
+		stats_window_add(metric->windows[i], now_msecs,
+				 field->value.intmax);
+	}
+}
+
+unsigned int stats_metric_get_window(const struct metric *metric,
+				     unsigned int idx,
+				     struct stats_histogram *hist_r)
+{
+	i_assert(idx < metric->windows_count);
+	return stats_window_get(metric->windows[idx],
+				stats_metrics_now_msecs(), hist_r);
+}
+
+int stats_metric_find_window(const struct metric *metric, const char *name)
+{
+	for (unsigned int i = 0; i < metric->windows_count; i++) {
+		if (strcmp(stats_window_get_name(metric->windows[i]), name) == 0)
+			return i;
+	}
+	return -1;
+}
+
 static void
 stats_metric_event(struct metric *metric, struct event *event, pool_t pool)
 {
 	/* duration is special - we always add it */
 	stats_metric_event_field(event, STATS_EVENT_FIELD_NAME_DURATION,
 				 metric->duration_stats);
+	if (metric->windows_count > 0)
+		stats_metric_event_windows(metric, event);
 
 	for (unsigned int i = 0; i < metric->fields_count; i++)
 		stats_metric_event_field(event,
@@ -852,7 +944,10 @@ stats_export_event(struct metric *metric, struct event *oldevent)
 		buf = t_buffer_create(128);
 
 		exporter->format(metric, event, buf);
-		exporter->transport(exporter, buf);
+		if (exporter->queue != NULL)
+			event_export_queue_add(exporter->queue, buf);
+		else
+			exporter->transport(exporter, buf);
 	} T_END;
 
 	event_unref(&event);
@@ -889,6 +984,13 @@ struct stats_metrics_iter {
 	unsigned int idx;
 };
 
+struct exporter *const *
+stats_metrics_get_exporters(struct stats_metrics *metrics,
+			    unsigned int *count_r)
+{
+	return array_get(&metrics->exporters, count_r);
+}
+
 struct stats_metrics_iter *
 stats_metrics_iterate_init(struct stats_metrics *metrics)
 {
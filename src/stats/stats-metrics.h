@@ -8,6 +8,9 @@
 
 struct metric;
 struct stats_metrics;
+struct exporter_queue;
+struct compression_handler;
+struct stats_histogram;
 
 struct exporter {
 	const char *name;
@@ -39,6 +42,24 @@ struct exporter {
 
 	/* function to send the event */
 	void (*transport)(const struct exporter *, const buffer_t *);
+	/* Returns TRUE if the transport can't currently take more batches.
+	   The transport calls event_export_queue_flush() once it can again.
+	   NULL if the transport is never busy. */
+	bool (*transport_busy)(const struct exporter *);
+
+	/*
+	 * batching options
+	 *
+	 * when queue is non-NULL, formatted events are queued and sent to
+	 * the transport as newline terminated batches of up to
+	 * batch_max_events, or after batch_max_msecs at the latest.
+	 */
+	unsigned int batch_max_events;
+	unsigned int batch_max_msecs;
+	unsigned int queue_max_events;
+	/* compression for the batches, NULL if none */
+	const struct compression_handler *compression;
+	struct exporter_queue *queue;
 };
 
 struct metric_export_info {
@@ -96,6 +117,10 @@ struct metric {
 
 	/* Timing for how long the event existed */
 	struct stats_dist *duration_stats;
+	/* Rolling time windows of the duration. Unlike duration_stats these
+	   aren't cleared by stats_metrics_reset(). */
+	unsigned int windows_count;
+	struct stats_window **windows;
 
 	unsigned int fields_count;
 	struct metric_field *fields;
@@ -131,6 +156,20 @@ stats_metrics_get_event_filter(struct stats_metrics *metrics);
 void stats_metrics_event(struct stats_metrics *metrics, struct event *event,
 			 const struct failure_context *ctx);
 
+/* Get the duration histogram of the metric's idx'th rolling window at the
+   current time. Returns the number of milliseconds the histogram covers. */
+unsigned int stats_metric_get_window(const struct metric *metric,
+				     unsigned int idx,
+				     struct stats_histogram *hist_r);
+/* Returns the idx of the metric's rolling window with the given name,
+   or -1 if not found. */
+int stats_metric_find_window(const struct metric *metric, const char *name);
+
+/* Returns all the configured exporters. */
+struct exporter *const *
+stats_metrics_get_exporters(struct stats_metrics *metrics,
+			    unsigned int *count_r);
+
 /* Iterate through all the tracked metrics. */
 struct stats_metrics_iter *
 stats_metrics_iterate_init(struct stats_metrics *metrics);
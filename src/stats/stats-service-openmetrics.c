@@ -13,6 +13,8 @@
 #include "stats-settings.h"
 #include "stats-metrics.h"
 #include "stats-service-private.h"
+#include "event-exporter.h"
+#include "stats-window.h"
 
 #define OPENMETRICS_CONTENT_VERSION "0.0.1"
 
@@ -30,8 +32,13 @@ enum openmetrics_metric_type {
 	OPENMETRICS_METRIC_TYPE_DURATION,
 	OPENMETRICS_METRIC_TYPE_FIELD,
 	OPENMETRICS_METRIC_TYPE_HISTOGRAM,
+	OPENMETRICS_METRIC_TYPE_WINDOW_RATE,
+	OPENMETRICS_METRIC_TYPE_WINDOW_DURATION,
 };
 
+/* Duration quantiles exported for the metric { windows } */
+static const double openmetrics_window_quantiles[] = { 0.5, 0.9, 0.99 };
+
 enum openmetrics_request_state {
 	OPENMETRICS_REQUEST_STATE_INIT = 0,
 	OPENMETRICS_REQUEST_STATE_METRIC,
@@ -111,16 +118,98 @@ static void openmetrics_export_dovecot(string_t *out)
 	str_append(out, "dovecot_build_info{"OPENMETRICS_BUILD_INFO"} 1\n");
 }
 
+static void openmetrics_export_exporters(string_t *out)
+{
+	struct exporter *const *exporters;
+	unsigned int i, count;
+	bool header_added = FALSE;
+
+	exporters = stats_metrics_get_exporters(stats_metrics, &count);
+	for (i = 0; i < count; i++) {
+		if (exporters[i]->queue == NULL)
+			continue;
+		if (!header_added) {
+			str_append(out, "# HELP dovecot_stats_exporter_dropped_events "
+					"Events dropped because the exporter "
+					"queue was full\n");
+			str_append(out, "# TYPE dovecot_stats_exporter_dropped_events "
+					"counter\n");
+			header_added = TRUE;
+		}
+		str_append(out, "dovecot_stats_exporter_dropped_events_total"
+				"{exporter=\"");
+		json_append_escaped(out, exporters[i]->name);
+		str_printfa(out, "\"} %"PRIu64"\n",
+			    event_export_queue_get_dropped_count(
+				exporters[i]->queue));
+	}
+}
+
 static void openmetrics_export_eof(string_t *out)
 {
 	str_append(out, "# EOF\n");
 }
 
+static void
+openmetrics_export_window_labels(struct openmetrics_request *req,
+				 string_t *out, const struct metric *metric,
+				 unsigned int idx)
+{
+	str_append_c(out, '{');
+	if (str_len(req->labels) > 0) {
+		str_append_str(out, req->labels);
+		str_append_c(out, ',');
+	}
+	str_append(out, "window=\"");
+	json_append_escaped(out, stats_window_get_name(metric->windows[idx]));
+	str_append_c(out, '"');
+}
+
+static void
+openmetrics_export_window_values(struct openmetrics_request *req,
+				 string_t *out, const struct metric *metric)
+{
+	struct stats_histogram hist;
+	unsigned int i, j, msecs;
+
+	for (i = 0; i < metric->windows_count; i++) {
+		msecs = stats_metric_get_window(metric, i, &hist);
+		if (req->metric_type == OPENMETRICS_METRIC_TYPE_WINDOW_RATE) {
+			str_append(out, "dovecot_");
+			str_append(out, req->metric->name);
+			str_append(out, "_window_events_per_second");
+			openmetrics_export_window_labels(req, out, metric, i);
+			str_printfa(out, "} %.3f\n", hist.count * 1000.0 / msecs);
+			continue;
+		}
+		/* no events - quantiles are undefined */
+		if (hist.count == 0)
+			continue;
+		for (j = 0; j < N_ELEMENTS(openmetrics_window_quantiles); j++) {
+			double quantile = openmetrics_window_quantiles[j];
+
+			str_append(out, "dovecot_");
+			str_append(out, req->metric->name);
+			str_append(out, "_window_duration_seconds");
+			openmetrics_export_window_labels(req, out, metric, i);
+			/* Convert from microseconds to seconds */
+			str_printfa(out, ",quantile=\"%g\"} %.6f\n", quantile,
+				stats_histogram_get_percentile(&hist, quantile)/1e6);
+		}
+	}
+}
+
 static void
 openmetrics_export_metric_value(struct openmetrics_request *req, string_t *out,
 				const struct metric *metric)
 {
 	const struct metric_field *field;
+
+	if (req->metric_type == OPENMETRICS_METRIC_TYPE_WINDOW_RATE ||
+	    req->metric_type == OPENMETRICS_METRIC_TYPE_WINDOW_DURATION) {
+		openmetrics_export_window_values(req, out, metric);
+		return;
+	}
 	/* Metric name */
 	str_append(out, "dovecot_");
 	str_append(out, req->metric->name);
@@ -145,6 +234,8 @@ openmetrics_export_metric_value(struct openmetrics_request *req, string_t *out,
 			str_printfa(out, "_%s_total", field->field_key);
 		break;
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
+	case OPENMETRICS_METRIC_TYPE_WINDOW_RATE:
+	case OPENMETRICS_METRIC_TYPE_WINDOW_DURATION:
 		i_unreached();
 	}
 	/* Labels */
@@ -170,6 +261,8 @@ openmetrics_export_metric_value(struct openmetrics_request *req, string_t *out,
 			    stats_dist_get_sum(field->stats));
 		break;
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
+	case OPENMETRICS_METRIC_TYPE_WINDOW_RATE:
+	case OPENMETRICS_METRIC_TYPE_WINDOW_DURATION:
 		i_unreached();
 	}
 }
@@ -304,6 +397,12 @@ openmetrics_export_metric_header(struct openmetrics_request *req, string_t *out)
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
 		str_append(out, " Histogram");
 		break;
+	case OPENMETRICS_METRIC_TYPE_WINDOW_RATE:
+		str_append(out, "_window_events_per_second Recent rate of events of this kind");
+		break;
+	case OPENMETRICS_METRIC_TYPE_WINDOW_DURATION:
+		str_append(out, "_window_duration_seconds Recent duration quantiles of events of this kind");
+		break;
 	}
 	if (*metric->set->description != '\0') {
 		str_append(out, " of ");
@@ -327,6 +426,12 @@ openmetrics_export_metric_header(struct openmetrics_request *req, string_t *out)
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
 		str_append(out, " histogram\n");
 		break;
+	case OPENMETRICS_METRIC_TYPE_WINDOW_RATE:
+		str_append(out, "_window_events_per_second gauge\n");
+		break;
+	case OPENMETRICS_METRIC_TYPE_WINDOW_DURATION:
+		str_append(out, "_window_duration_seconds gauge\n");
+		break;
 	}
 }
 
@@ -550,6 +655,18 @@ static bool openmetrics_export_has_histogram(struct openmetrics_request *req)
 		STATS_METRIC_GROUPBY_QUANTIZED);
 }
 
+static void openmetrics_export_next_windows(struct openmetrics_request *req)
+{
+	if (req->metric->windows_count > 0) {
+		/* Continue with the rolling windows */
+		req->metric_type = OPENMETRICS_METRIC_TYPE_WINDOW_RATE;
+		req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
+	} else {
+		/* Continue with next metric */
+		req->state = OPENMETRICS_REQUEST_STATE_METRIC;
+	}
+}
+
 static void openmetrics_export_next(struct openmetrics_request *req)
 {
 	/* Determine what to export next. */
@@ -569,8 +686,8 @@ static void openmetrics_export_next(struct openmetrics_request *req)
 			req->metric_type = OPENMETRICS_METRIC_TYPE_FIELD;
 			req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
 		} else {
-			/* No histogram; continue with next metric */
-			req->state = OPENMETRICS_REQUEST_STATE_METRIC;
+			/* No histogram or fields */
+			openmetrics_export_next_windows(req);
 		}
 		break;
 	case OPENMETRICS_METRIC_TYPE_FIELD:
@@ -580,7 +697,7 @@ static void openmetrics_export_next(struct openmetrics_request *req)
 			req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
 		} else {
 			/* all fields consumed */
-			req->state = OPENMETRICS_REQUEST_STATE_METRIC;
+			openmetrics_export_next_windows(req);
 		}
 		break;
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
@@ -590,10 +707,17 @@ static void openmetrics_export_next(struct openmetrics_request *req)
 			req->metric_type = OPENMETRICS_METRIC_TYPE_FIELD;
 			req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
 		} else {
-			/* Continue with next metric */
-			req->state = OPENMETRICS_REQUEST_STATE_METRIC;
+			openmetrics_export_next_windows(req);
 		}
 		break;
+	case OPENMETRICS_METRIC_TYPE_WINDOW_RATE:
+		req->metric_type = OPENMETRICS_METRIC_TYPE_WINDOW_DURATION;
+		req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
+		break;
+	case OPENMETRICS_METRIC_TYPE_WINDOW_DURATION:
+		/* Continue with next metric */
+		req->state = OPENMETRICS_REQUEST_STATE_METRIC;
+		break;
 	}
 }
 
@@ -606,6 +730,7 @@ openmetrics_export_continue(struct openmetrics_request *req, string_t *out)
 		i_assert(req->stats_iter == NULL);
 		req->stats_iter = stats_metrics_iterate_init(stats_metrics);
 		openmetrics_export_dovecot(out);
+		openmetrics_export_exporters(out);
 		req->state = OPENMETRICS_REQUEST_STATE_METRIC;
 		break;
 	case OPENMETRICS_REQUEST_STATE_METRIC:
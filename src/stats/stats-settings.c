@@ -11,6 +11,7 @@
 #include "var-expand.h"
 
 /* <settings checks> */
+#include "str-parse.h"
 #include "event-filter.h"
 #include <math.h>
 /* </settings checks> */
@@ -78,6 +79,10 @@ static const struct setting_define stats_exporter_setting_defines[] = {
 	DEF(TIME_MSECS, transport_timeout),
 	DEF(STR, format),
 	DEF(STR, format_args),
+	DEF(UINT, batch_max_events),
+	DEF(TIME_MSECS, batch_max_time),
+	DEF(UINT, queue_max_events),
+	DEF(STR, compression),
 	SETTING_DEFINE_LIST_END
 };
 
@@ -88,6 +93,10 @@ static const struct stats_exporter_settings stats_exporter_default_settings = {
 	.transport_timeout = 250, /* ms */
 	.format = "",
 	.format_args = "",
+	.batch_max_events = 1,
+	.batch_max_time = 1000, /* ms */
+	.queue_max_events = 10000,
+	.compression = "",
 };
 
 const struct setting_parser_info stats_exporter_setting_parser_info = {
@@ -117,6 +126,7 @@ static const struct setting_define stats_metric_setting_defines[] = {
 	DEF(STR, exporter),
 	DEF(STR, exporter_include),
 	DEF(STR, description),
+	DEF(STR, windows),
 	SETTING_DEFINE_LIST_END
 };
 
@@ -128,6 +138,7 @@ static const struct stats_metric_settings stats_metric_default_settings = {
 	.group_by = "",
 	.exporter_include = STATS_METRIC_SETTINGS_DEFAULT_EXPORTER_INCLUDE,
 	.description = "",
+	.windows = "",
 };
 
 const struct setting_parser_info stats_metric_setting_parser_info = {
@@ -287,6 +298,23 @@ static bool stats_exporter_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 	if (!parse_format_args(set, error_r))
 		return FALSE;
 
+	/* The compression name is looked up in stats_exporters_add_set() */
+	if (set->batch_max_events == 0) {
+		*error_r = "event_exporter_batch_max_events must not be 0";
+		return FALSE;
+	}
+	if (set->queue_max_events < set->batch_max_events) {
+		*error_r = "event_exporter_queue_max_events must not be smaller "
+			"than event_exporter_batch_max_events";
+		return FALSE;
+	}
+	if (strcmp(set->transport, "log") == 0 &&
+	    (set->batch_max_events > 1 || set->compression[0] != '\0')) {
+		*error_r = "log exporter transport doesn't support batching "
+			"or compression";
+		return FALSE;
+	}
+
 	/* Some formats don't have a native way of serializing time stamps */
 	if (time_fmt_required &&
 	    set->parsed_time_format == EVENT_EXPORTER_TIME_FMT_NATIVE) {
@@ -507,6 +535,39 @@ static bool parse_metric_group_by(struct stats_metric_settings *set,
 	return TRUE;
 }
 
+static bool parse_metric_windows(struct stats_metric_settings *set,
+				 pool_t pool, const char **error_r)
+{
+	const char *const *names = t_strsplit_spaces(set->windows, " ");
+	struct stats_metric_settings_window *window;
+	const char *error;
+	unsigned int msecs;
+
+	if (names[0] == NULL)
+		return TRUE;
+
+	p_array_init(&set->parsed_windows, pool, str_array_length(names));
+	for (; *names != NULL; names++) {
+		if (str_parse_get_interval_msecs(*names, &msecs, &error) < 0) {
+			*error_r = t_strdup_printf(
+				"metric %s { windows } has invalid time "
+				"'%s': %s", set->name, *names, error);
+			return FALSE;
+		}
+		if (msecs < STATS_METRIC_WINDOW_MIN_MSECS) {
+			*error_r = t_strdup_printf(
+				"metric %s { windows } '%s' is shorter "
+				"than the minimum %u msecs", set->name,
+				*names, STATS_METRIC_WINDOW_MIN_MSECS);
+			return FALSE;
+		}
+		window = array_append_space(&set->parsed_windows);
+		window->name = p_strdup(pool, *names);
+		window->msecs = msecs;
+	}
+	return TRUE;
+}
+
 static bool stats_metric_settings_check(void *_set, pool_t pool, const char **error_r)
 {
 	struct stats_metric_settings *set = _set;
@@ -527,6 +588,9 @@ static bool stats_metric_settings_check(void *_set, pool_t pool, const char **er
 	if (!parse_metric_group_by(set, pool, error_r))
 		return FALSE;
 
+	if (!parse_metric_windows(set, pool, error_r))
+		return FALSE;
+
 	return TRUE;
 }
 
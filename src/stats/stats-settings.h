@@ -69,6 +69,10 @@ struct stats_exporter_settings {
 	unsigned int transport_timeout;
 	const char *format;
 	const char *format_args;
+	unsigned int batch_max_events;
+	unsigned int batch_max_time;
+	unsigned int queue_max_events;
+	const char *compression;
 
 	/* parsed values */
 	enum event_exporter_time_fmt parsed_time_format;
@@ -91,6 +95,15 @@ struct stats_metric_settings_bucket_range {
 	intmax_t max;
 };
 
+/* Shortest allowed metric { windows } value */
+#define STATS_METRIC_WINDOW_MIN_MSECS 1000
+
+struct stats_metric_settings_window {
+	/* as configured, e.g. "1m" */
+	const char *name;
+	unsigned int msecs;
+};
+
 struct stats_metric_settings_group_by {
 	const char *field;
 	enum stats_metric_group_by_func func;
@@ -108,8 +121,10 @@ struct stats_metric_settings {
 	const char *fields;
 	const char *group_by;
 	const char *filter;
+	const char *windows;
 
 	ARRAY(struct stats_metric_settings_group_by) parsed_group_by;
+	ARRAY(struct stats_metric_settings_window) parsed_windows;
 	struct event_filter *parsed_filter;
 
 	/* exporter related fields */
@@ -0,0 +1,184 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "stats-window.h"
+
+#include <math.h>
+
+struct stats_window_slot {
+	/* now_msecs / slot_msecs of the time when the slot was filled */
+	uint64_t number;
+	struct stats_histogram hist;
+};
+
+struct stats_window {
+	const char *name;
+	unsigned int slot_msecs;
+
+	/* STATS_WINDOW_SLOTS+1 slots, the extra one being the currently
+	   filled one. Allocated when the first value is added, so idle
+	   (sub-)metrics don't use memory for them. */
+	struct stats_window_slot *slots;
+};
+
+static unsigned int stats_histogram_bucket_idx(uint64_t value)
+{
+	unsigned int bits, shift;
+
+	if (value < STATS_HISTOGRAM_SUB_COUNT)
+		return value;
+	bits = bits_required64(value);
+	if (bits > STATS_HISTOGRAM_MAX_BITS)
+		return STATS_HISTOGRAM_BUCKETS - 1;
+
+	shift = bits - 1 - STATS_HISTOGRAM_SUB_BITS;
+	return (shift + 1) * STATS_HISTOGRAM_SUB_COUNT +
+		((value >> shift) & (STATS_HISTOGRAM_SUB_COUNT - 1));
+}
+
+static uint64_t stats_histogram_bucket_value(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t low;
+
+	if (idx < STATS_HISTOGRAM_SUB_COUNT)
+		return idx;
+	shift = idx / STATS_HISTOGRAM_SUB_COUNT - 1;
+	low = (uint64_t)(STATS_HISTOGRAM_SUB_COUNT +
+			 idx % STATS_HISTOGRAM_SUB_COUNT) << shift;
+	/* middle of the bucket */
+	return low + ((1ULL << shift) - 1) / 2;
+}
+
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value)
+{
+	if (hist->count == 0 || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[stats_histogram_bucket_idx(value)]++;
+}
+
+void stats_histogram_merge(struct stats_histogram *dest,
+			   const struct stats_histogram *src)
+{
+	unsigned int i;
+
+	if (src->count == 0)
+		return;
+	if (dest->count == 0 || src->min < dest->min)
+		dest->min = src->min;
+	if (src->max > dest->max)
+		dest->max = src->max;
+	dest->count += src->count;
+	dest->sum += src->sum;
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+		dest->buckets[i] += src->buckets[i];
+}
+
+uint64_t stats_histogram_get_percentile(const struct stats_histogram *hist,
+					double fraction)
+{
+	uint64_t rank, seen = 0, value;
+	double rank_d;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+	if (fraction <= 0)
+		return hist->min;
+	if (fraction >= 1)
+		return hist->max;
+
+	rank_d = ceil(fraction * hist->count);
+	rank = (uint64_t)rank_d;
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	i_assert(i < STATS_HISTOGRAM_BUCKETS);
+
+	/* the exact min/max are known, so never return anything outside
+	   them */
+	value = stats_histogram_bucket_value(i);
+	return I_MIN(I_MAX(value, hist->min), hist->max);
+}
+
+double stats_histogram_get_avg(const struct stats_histogram *hist)
+{
+	if (hist->count == 0)
+		return 0;
+	return (double)hist->sum / hist->count;
+}
+
+struct stats_window *
+stats_window_init(const char *name, unsigned int window_msecs)
+{
+	struct stats_window *window;
+
+	i_assert(window_msecs > 0);
+
+	window = i_new(struct stats_window, 1);
+	window->name = name;
+	window->slot_msecs = I_MAX(window_msecs / STATS_WINDOW_SLOTS, 1U);
+	return window;
+}
+
+void stats_window_deinit(struct stats_window **_window)
+{
+	struct stats_window *window = *_window;
+
+	if (window == NULL)
+		return;
+	*_window = NULL;
+
+	i_free(window->slots);
+	i_free(window);
+}
+
+const char *stats_window_get_name(const struct stats_window *window)
+{
+	return window->name;
+}
+
+void stats_window_add(struct stats_window *window, uint64_t now_msecs,
+		      uint64_t value)
+{
+	uint64_t number = now_msecs / window->slot_msecs;
+	struct stats_window_slot *slot;
+
+	if (window->slots == NULL) {
+		window->slots = i_new(struct stats_window_slot,
+				      STATS_WINDOW_SLOTS + 1);
+	}
+	slot = &window->slots[number % (STATS_WINDOW_SLOTS + 1)];
+	if (slot->number != number) {
+		/* slot has expired */
+		i_zero(slot);
+		slot->number = number;
+	}
+	stats_histogram_add(&slot->hist, value);
+}
+
+unsigned int stats_window_get(const struct stats_window *window,
+			      uint64_t now_msecs,
+			      struct stats_histogram *hist_r)
+{
+	uint64_t number = now_msecs / window->slot_msecs;
+	unsigned int i;
+
+	i_zero(hist_r);
+	for (i = 0; window->slots != NULL && i <= STATS_WINDOW_SLOTS; i++) {
+		const struct stats_window_slot *slot = &window->slots[i];
+
+		if (slot->number <= number &&
+		    slot->number + STATS_WINDOW_SLOTS >= number)
+			stats_histogram_merge(hist_r, &slot->hist);
+	}
+	return STATS_WINDOW_SLOTS * window->slot_msecs +
+		now_msecs % window->slot_msecs;
+}
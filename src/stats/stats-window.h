@@ -0,0 +1,51 @@
+#ifndef STATS_WINDOW_H
+#define STATS_WINDOW_H
+
+/* Log-linear histogram: values are bucketed by their highest set bit and
+   the STATS_HISTOGRAM_SUB_BITS bits following it, so each bucket's width is
+   at most 1/8 of its lower bound. Values below 8 have their own buckets.
+   Values with more than STATS_HISTOGRAM_MAX_BITS bits (i.e. over 12 days
+   in microseconds) all go to the last bucket. Histograms can be merged
+   simply by adding the bucket counters together. */
+#define STATS_HISTOGRAM_SUB_BITS 3
+#define STATS_HISTOGRAM_SUB_COUNT (1U << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_HISTOGRAM_MAX_BITS 40
+#define STATS_HISTOGRAM_BUCKETS \
+	((STATS_HISTOGRAM_MAX_BITS - STATS_HISTOGRAM_SUB_BITS + 1) * \
+	 STATS_HISTOGRAM_SUB_COUNT)
+
+/* Number of slots each window is split into. The slots expire one at a
+   time, so the values returned for a window cover between the window's
+   length and 1/STATS_WINDOW_SLOTS more than that. */
+#define STATS_WINDOW_SLOTS 6
+
+struct stats_histogram {
+	uint64_t count, sum, min, max;
+	uint32_t buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value);
+void stats_histogram_merge(struct stats_histogram *dest,
+			   const struct stats_histogram *src);
+/* Returns the approximate value at the given fraction (0..1), or 0 if the
+   histogram is empty. */
+uint64_t stats_histogram_get_percentile(const struct stats_histogram *hist,
+					double fraction);
+double stats_histogram_get_avg(const struct stats_histogram *hist);
+
+/* Rolling time window of values. The name is not copied. */
+struct stats_window *
+stats_window_init(const char *name, unsigned int window_msecs);
+void stats_window_deinit(struct stats_window **window);
+
+const char *stats_window_get_name(const struct stats_window *window);
+
+void stats_window_add(struct stats_window *window, uint64_t now_msecs,
+		      uint64_t value);
+/* Get the merged histogram of values added within the window. Returns the
+   number of milliseconds the histogram covers. */
+unsigned int stats_window_get(const struct stats_window *window,
+			      uint64_t now_msecs,
+			      struct stats_histogram *hist_r);
+
+#endif
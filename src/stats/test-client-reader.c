@@ -215,6 +215,92 @@ static void test_client_reader_group_by(void)
 	test_end();
 }
 
+static const char *const settings_blob_3[] = {
+	"metric=test",
+	"metric/test/metric_name=test",
+	"metric/test/filter=event=test",
+	"metric/test/metric_windows=10s 1m",
+	NULL
+};
+
+static int
+test_reader_server_input_args_windows(struct connection *conn ATTR_UNUSED,
+				      const char *const *args)
+{
+	if (args[0] == NULL)
+		return -1;
+
+	test_assert_strcmp(args[0], "test");
+	/* count count:10s count:1m rate:1m count:5m */
+	test_assert(str_array_length(args) == 6);
+	test_assert_strcmp(args[1], "3");
+	test_assert_strcmp(args[2], "3");
+	test_assert_strcmp(args[3], "3");
+	test_assert(args[4][0] != '\0' && strcmp(args[4], "0.00") != 0);
+	/* unknown window */
+	test_assert_strcmp(args[5], "");
+	return 1;
+}
+
+static void test_dump_metrics_windows(void)
+{
+	int fds[2];
+
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	struct connection *conn = i_new(struct connection, 1);
+
+	struct ioloop *loop = io_loop_create();
+
+	client_reader_create(fds[1]);
+	connection_init_client_fd(conn_list, conn, "stats", fds[0], fds[0]);
+	o_stream_nsend_str(conn->output,
+		"DUMP\tcount\tcount:10s\tcount:1m\trate:1m\tcount:5m\n");
+
+	io_loop_run(loop);
+	connection_deinit(conn);
+	i_free(conn);
+
+	io_loop_set_running(loop);
+	io_loop_handler_run(loop);
+
+	io_loop_destroy(&loop);
+}
+
+static void test_client_reader_windows(void)
+{
+	const struct connection_vfuncs client_vfuncs = {
+		.input_args = test_reader_server_input_args_windows,
+		.destroy = test_reader_server_destroy,
+	};
+
+	test_begin("client reader (windows)");
+
+	test_init(settings_blob_3);
+
+	client_readers_init();
+	conn_list = connection_list_init(&client_set, &client_vfuncs);
+
+	/* windows use ioloop time */
+	io_loop_time_refresh();
+	for (unsigned int i = 0; i < 3; i++) {
+		struct event *event = event_create(NULL);
+		event_add_category(event, &test_category);
+		event_set_name(event, "test");
+		test_event_send(event);
+		event_unref(&event);
+	}
+
+	test_dump_metrics_windows();
+
+	test_deinit();
+
+	client_readers_deinit();
+	connection_list_deinit(&conn_list);
+
+	test_end();
+}
+
 int main(void) {
 	/* fake master service to pretend destroying
 	   connections. */
@@ -226,6 +312,7 @@ int main(void) {
 	void (*const test_functions[])(void) = {
 		test_client_reader,
 		test_client_reader_group_by,
+		test_client_reader_windows,
 		NULL
 	};
 
@@ -0,0 +1,260 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-stats-common.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "compression.h"
+#include "event-exporter.h"
+
+#include <unistd.h>
+
+#define TEST_EXPORT_FILE ".test-event-exporter-queue.tmp"
+
+static ARRAY(buffer_t *) test_batches;
+static bool test_transport_is_busy;
+
+bool test_stats_callback(struct event *event,
+			 enum event_callback_type type ATTR_UNUSED,
+			 struct failure_context *ctx, const char *fmt ATTR_UNUSED,
+			 va_list args ATTR_UNUSED)
+{
+	if (stats_metrics != NULL) {
+		stats_metrics_event(stats_metrics, event, ctx);
+		struct event_filter *filter =
+			stats_metrics_get_event_filter(stats_metrics);
+		return !event_filter_match(filter, event, ctx);
+	}
+	return TRUE;
+}
+
+static void test_transport(const struct exporter *exporter ATTR_UNUSED,
+			   const buffer_t *buf)
+{
+	buffer_t *batch = buffer_create_dynamic(test_pool, buf->used);
+
+	buffer_append_buf(batch, buf, 0, SIZE_MAX);
+	array_push_back(&test_batches, &batch);
+}
+
+static bool test_transport_busy(const struct exporter *exporter ATTR_UNUSED)
+{
+	return test_transport_is_busy;
+}
+
+static void test_exporter_init(struct exporter *exporter,
+			       unsigned int batch_max_events,
+			       unsigned int queue_max_events)
+{
+	i_zero(exporter);
+	exporter->name = "test";
+	exporter->transport = test_transport;
+	exporter->transport_busy = test_transport_busy;
+	exporter->batch_max_events = batch_max_events;
+	exporter->batch_max_msecs = 10;
+	exporter->queue_max_events = queue_max_events;
+	exporter->queue = event_export_queue_init(exporter);
+
+	test_transport_is_busy = FALSE;
+	p_array_init(&test_batches, test_pool, 8);
+}
+
+static void test_queue_add(struct exporter *exporter, const char *str)
+{
+	buffer_t buf;
+
+	buffer_create_from_const_data(&buf, str, strlen(str));
+	event_export_queue_add(exporter->queue, &buf);
+}
+
+static void test_transport_stop_ioloop(const struct exporter *exporter,
+				       const buffer_t *buf)
+{
+	test_transport(exporter, buf);
+	io_loop_stop(current_ioloop);
+}
+
+static void test_event_export_queue_batch(void)
+{
+	struct exporter exporter;
+	struct ioloop *ioloop;
+	buffer_t *const *batches;
+
+	test_begin("event export queue batch");
+	test_pool = pool_alloconly_create("test pool", 1024);
+	ioloop = io_loop_create();
+	test_exporter_init(&exporter, 3, 10);
+	exporter.transport = test_transport_stop_ioloop;
+
+	test_queue_add(&exporter, "e1");
+	test_queue_add(&exporter, "e2");
+	test_assert(array_count(&test_batches) == 0);
+	test_queue_add(&exporter, "e3");
+	test_queue_add(&exporter, "e4");
+	test_assert(array_count(&test_batches) == 1);
+	test_assert(event_export_queue_get_count(exporter.queue) == 1);
+
+	/* the rest is sent after batch_max_msecs */
+	io_loop_run(ioloop);
+
+	batches = array_front(&test_batches);
+	test_assert(array_count(&test_batches) == 2);
+	test_assert_strcmp(str_c(batches[0]), "e1\ne2\ne3\n");
+	test_assert_strcmp(str_c(batches[1]), "e4\n");
+	test_assert(event_export_queue_get_count(exporter.queue) == 0);
+	test_assert(event_export_queue_get_dropped_count(exporter.queue) == 0);
+
+	event_export_queue_deinit(&exporter.queue);
+	io_loop_destroy(&ioloop);
+	pool_unref(&test_pool);
+	test_end();
+}
+
+static void test_event_export_queue_drop_oldest(void)
+{
+	struct exporter exporter;
+	struct ioloop *ioloop;
+	buffer_t *const *batches;
+
+	test_begin("event export queue drop oldest");
+	test_pool = pool_alloconly_create("test pool", 1024);
+	ioloop = io_loop_create();
+	test_exporter_init(&exporter, 2, 4);
+	exporter.transport = test_transport_stop_ioloop;
+
+	test_transport_is_busy = TRUE;
+	test_expect_error_string("dropped 1 oldest events");
+	for (unsigned int i = 1; i <= 7; i++)
+		test_queue_add(&exporter, t_strdup_printf("e%u", i));
+	test_expect_no_more_errors();
+	test_assert(array_count(&test_batches) == 0);
+	test_assert(event_export_queue_get_count(exporter.queue) == 4);
+	test_assert(event_export_queue_get_dropped_count(exporter.queue) == 3);
+
+	/* transport is no longer busy */
+	test_transport_is_busy = FALSE;
+	event_export_queue_flush(exporter.queue);
+	batches = array_front(&test_batches);
+	test_assert(array_count(&test_batches) == 2);
+	test_assert_strcmp(str_c(batches[0]), "e4\ne5\n");
+	test_assert_strcmp(str_c(batches[1]), "e6\ne7\n");
+
+	/* busy transport delays even the timeout flush */
+	test_transport_is_busy = TRUE;
+	test_queue_add(&exporter, "e8");
+	test_transport_is_busy = FALSE;
+	io_loop_run(ioloop);
+	test_assert(array_count(&test_batches) == 3);
+
+	/* the rest of the drops are logged at deinit at the latest */
+	test_expect_error_string("dropped 2 oldest events");
+	event_export_queue_deinit(&exporter.queue);
+	test_expect_no_more_errors();
+	io_loop_destroy(&ioloop);
+	pool_unref(&test_pool);
+	test_end();
+}
+
+static void test_event_export_queue_compression(void)
+{
+	struct exporter exporter;
+	struct ioloop *ioloop;
+	struct istream *input;
+	buffer_t *const *batches;
+	const unsigned char *data;
+	size_t size;
+
+	test_begin("event export queue compression");
+	test_pool = pool_alloconly_create("test pool", 1024);
+	ioloop = io_loop_create();
+	test_exporter_init(&exporter, 2, 2);
+	if (compression_lookup_handler("gz", &exporter.compression) <= 0)
+		i_fatal("gz compression not supported");
+
+	test_queue_add(&exporter, "compressed1");
+	test_queue_add(&exporter, "compressed2");
+	test_assert(array_count(&test_batches) == 1);
+	batches = array_front(&test_batches);
+
+	input = i_stream_create_from_buffer(batches[0]);
+	struct istream *dec_input = i_stream_create_decompress(input, 0);
+	i_stream_unref(&input);
+	test_assert(i_stream_read_more(dec_input, &data, &size) > 0);
+	test_assert(size == 24 &&
+		    memcmp(data, "compressed1\ncompressed2\n", size) == 0);
+	i_stream_unref(&dec_input);
+
+	event_export_queue_deinit(&exporter.queue);
+	io_loop_destroy(&ioloop);
+	pool_unref(&test_pool);
+	test_end();
+}
+
+static const char *const settings_blob_file[] = {
+	"event_exporter=test",
+	"event_exporter/test/event_exporter_name=test",
+	"event_exporter/test/event_exporter_transport=file",
+	"event_exporter/test/event_exporter_transport_args="TEST_EXPORT_FILE,
+	"event_exporter/test/event_exporter_format=tab-text",
+	"event_exporter/test/event_exporter_format_args=time-unix",
+	"event_exporter/test/event_exporter_batch_max_events=2",
+	"event_exporter/test/event_exporter_compression=gz",
+	"metric=test",
+	"metric/test/metric_name=test",
+	"metric/test/filter=event=test",
+	"metric/test/metric_exporter=test",
+	NULL
+};
+
+static void test_event_export_queue_file(void)
+{
+	struct ioloop *ioloop;
+	struct istream *input, *dec_input;
+	const unsigned char *data;
+	unsigned int i, lines = 0;
+	size_t size;
+
+	test_begin("event export queue via file exporter");
+	ioloop = io_loop_create();
+	i_unlink_if_exists(TEST_EXPORT_FILE);
+	test_init(settings_blob_file);
+	for (i = 0; i < 3; i++) {
+		struct event *event = event_create(NULL);
+		event_set_name(event, "test");
+		test_event_send(event);
+		event_unref(&event);
+	}
+	/* the last event is sent at deinit */
+	test_deinit();
+	io_loop_destroy(&ioloop);
+
+	/* two concatenated gzip streams */
+	input = i_stream_create_file(TEST_EXPORT_FILE, IO_BLOCK_SIZE);
+	dec_input = i_stream_create_decompress(input, 0);
+	i_stream_unref(&input);
+	while (i_stream_read_more(dec_input, &data, &size) > 0) {
+		for (i = 0; i < size; i++) {
+			if (data[i] == '\n')
+				lines++;
+		}
+		i_stream_skip(dec_input, size);
+	}
+	test_assert(dec_input->stream_errno == 0);
+	test_assert(lines == 3);
+	i_stream_unref(&dec_input);
+	i_unlink(TEST_EXPORT_FILE);
+	test_end();
+}
+
+int main(void)
+{
+	void (*const test_functions[])(void) = {
+		test_event_export_queue_batch,
+		test_event_export_queue_drop_oldest,
+		test_event_export_queue_compression,
+		test_event_export_queue_file,
+		NULL
+	};
+
+	return test_run(test_functions);
+}
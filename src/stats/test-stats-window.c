@@ -0,0 +1,124 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "stats-window.h"
+#include "test-common.h"
+
+static void test_stats_histogram(void)
+{
+	struct stats_histogram hist;
+	uint64_t value, p;
+	unsigned int i;
+
+	test_begin("stats histogram");
+	i_zero(&hist);
+	test_assert(stats_histogram_get_percentile(&hist, 0.5) == 0);
+
+	/* 1..10000 */
+	for (i = 1; i <= 10000; i++)
+		stats_histogram_add(&hist, i);
+	test_assert(hist.count == 10000);
+	test_assert(hist.min == 1);
+	test_assert(hist.max == 10000);
+	test_assert(hist.sum == 10000ULL * 10001 / 2);
+	test_assert(stats_histogram_get_avg(&hist) == 5000.5);
+	test_assert(stats_histogram_get_percentile(&hist, 0) == 1);
+	test_assert(stats_histogram_get_percentile(&hist, 1) == 10000);
+
+	/* percentiles are within the bucket accuracy */
+	for (i = 1; i < 100; i++) {
+		value = i * 100;
+		p = stats_histogram_get_percentile(&hist, i / 100.0);
+		test_assert_idx(p >= value - value / STATS_HISTOGRAM_SUB_COUNT &&
+				p <= value + value / STATS_HISTOGRAM_SUB_COUNT, i);
+	}
+
+	/* small values are exact */
+	i_zero(&hist);
+	for (i = 0; i < STATS_HISTOGRAM_SUB_COUNT; i++)
+		stats_histogram_add(&hist, i);
+	test_assert(stats_histogram_get_percentile(&hist, 0.5) == 3);
+
+	/* huge values go to the last bucket, but min/max stay exact */
+	i_zero(&hist);
+	stats_histogram_add(&hist, UINT64_MAX);
+	stats_histogram_add(&hist, 1ULL << 50);
+	test_assert(stats_histogram_get_percentile(&hist, 0.5) == 1ULL << 50);
+	test_assert(stats_histogram_get_percentile(&hist, 0.99) == 1ULL << 50);
+	test_assert(stats_histogram_get_percentile(&hist, 1) == UINT64_MAX);
+	test_end();
+}
+
+static void test_stats_histogram_merge(void)
+{
+	struct stats_histogram hist1, hist2, all;
+	unsigned int i;
+
+	test_begin("stats histogram merge");
+	i_zero(&hist1);
+	i_zero(&hist2);
+	i_zero(&all);
+	for (i = 0; i < 1000; i++) {
+		stats_histogram_add(i % 2 == 0 ? &hist1 : &hist2, i * 37);
+		stats_histogram_add(&all, i * 37);
+	}
+	stats_histogram_merge(&hist1, &hist2);
+	test_assert(memcmp(&hist1, &all, sizeof(all)) == 0);
+
+	/* merging an empty histogram doesn't change min */
+	i_zero(&hist2);
+	stats_histogram_merge(&hist1, &hist2);
+	test_assert(hist1.min == 0 && hist1.count == 1000);
+	test_end();
+}
+
+static void test_stats_window(void)
+{
+	struct stats_window *window;
+	struct stats_histogram hist;
+	uint64_t now = 1000000;
+
+	test_begin("stats window");
+	/* 6 slots of 10 seconds */
+	window = stats_window_init("1m", 60000);
+	test_assert(stats_window_get(window, now, &hist) == 60000);
+	test_assert(hist.count == 0);
+
+	stats_window_add(window, now, 100);
+	stats_window_add(window, now + 5000, 200);
+	test_assert(stats_window_get(window, now + 5000, &hist) == 65000);
+	test_assert(hist.count == 2 && hist.min == 100 && hist.max == 200);
+
+	/* still included 60 seconds later, since the slot began at
+	   now - now % 10000 */
+	stats_window_add(window, now + 30000, 300);
+	test_assert(stats_window_get(window, now + 60000, &hist) == 60000);
+	test_assert(hist.count == 3);
+
+	/* the first slot has expired */
+	test_assert(stats_window_get(window, now + 70000, &hist) == 60000);
+	test_assert(hist.count == 1 && hist.min == 300);
+
+	/* reusing the first slot's ring position clears the old values */
+	stats_window_add(window, now + 70000, 400);
+	test_assert(stats_window_get(window, now + 70000, &hist) == 60000);
+	test_assert(hist.count == 2 && hist.sum == 700);
+
+	/* everything expired */
+	test_assert(stats_window_get(window, now + 1000000, &hist) == 60000);
+	test_assert(hist.count == 0);
+
+	stats_window_deinit(&window);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_stats_histogram,
+		test_stats_histogram_merge,
+		test_stats_window,
+		NULL
+	};
+	return test_run(test_functions);
+}